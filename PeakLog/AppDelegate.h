@@ -23,8 +23,9 @@
 
 #import <Cocoa/Cocoa.h>
 
-@interface AppDelegate : NSObject <NSApplicationDelegate>
+@interface AppDelegate : NSObject <NSApplicationDelegate, NSTableViewDataSource, NSTableViewDelegate>
 @property (assign) IBOutlet NSWindow *window;
+@property (assign) IBOutlet NSTableView *logTable;
 @property (assign) IBOutlet NSArrayController *arrayController;
 @property (assign) IBOutlet NSPopUpButtonCell *bitratePopup;
 @property (assign) IBOutlet NSTextFieldCell *statusText;
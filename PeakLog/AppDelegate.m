@@ -25,13 +25,41 @@
 #import "LogLine.h"
 
 #include "PeakUSB.h"
+#include "PeakBatch.h"
+#include "PeakFrameStore.h"
+#include "PeakExport.h"
+#include "PeakFilter.h"
+#include "PeakReplay.h"
+#include "PeakTimebase.h"
+#include "PeakCanopen.h"
+#include "PeakDbc.h"
+#include "PeakParse.h"
+#include "PeakLive.h"
+
+#define kMaxFilterTerms 65536
+
+// off unless the user turns it on with File > Share Live Frames
+static NSString* const PeakShareLiveFramesKey = @"ShareLiveFrames";
 
 @implementation AppDelegate
 {
-    NSUInteger arrayControllerMaxSize;
+    PeakFrameStore store;
+    NSPredicate* defaultFilter;
+    NSPredicate* uiFilter; // only set if the driver cannot evaluate the filter
+    PeakBatcher* batcher;
+    CanMsg* batch;
+    NSTimer* displayTimer;
+    PeakReplay replay;
+    BOOL replayOpen;
+    PeakCanopenDecoder* canopen;
+    UInt32* tags; // of the frames in batch
+    PeakDbc dbc;
+    dispatch_queue_t sendQueue; // frame lists
+    NSMutableArray* parseErrors; // of the list being sent, only touched on sendQueue
+    UInt64 unsent;
 }
 
-@synthesize arrayController, bitratePopup;
+@synthesize arrayController, bitratePopup, logTable;
 
 - (IBAction)setBitrate:(NSPopUpButtonCell*)sender
 {
@@ -40,100 +68,499 @@
 
 - (IBAction)clearLog:(id)sender
 {
-    NSRange range = NSMakeRange(0, [[arrayController arrangedObjects] count]);
-    [arrayController removeObjectsAtArrangedObjectIndexes:[NSIndexSet indexSetWithIndexesInRange:range]];
+    PeakFrameStoreClear(&store);
+    [logTable reloadData];
 }
 
-- (IBAction)trimLog:(id)sender
+- (IBAction)toggleCapture:(NSMenuItem*)sender
 {
-    NSUInteger size = [[arrayController arrangedObjects] count];
-    NSInteger oversize = size - arrayControllerMaxSize;
-    if(oversize > 0)
-    {
-        NSRange range = NSMakeRange(0, oversize);
-        [arrayController removeObjectsAtArrangedObjectIndexes:[NSIndexSet indexSetWithIndexesInRange:range]];
+    if(PeakStopCapture() == kIOReturnSuccess) {
+        sender.title = @"Record…";
+        return;
+    }
+    
+    NSSavePanel *panel = [NSSavePanel savePanel];
+    panel.allowedFileTypes = @[@"peakcap", @"peakarc"]; // peakarc records a compressed archive
+    panel.nameFieldStringValue = @"capture.peakcap";
+    
+    if([panel runModal] == NSFileHandlingPanelOKButton) {
+        if(PeakStartCapture([[panel.URL path] fileSystemRepresentation]) == kIOReturnSuccess) {
+            sender.title = @"Stop Recording";
+        } else {
+            NSBeep();
+        }
+    }
+}
+
+- (IBAction)toggleSharing:(NSMenuItem*)sender
+{
+    BOOL share = sender.state != NSOnState;
+    
+    if(share && PeakStartSharing(PEAK_LIVE_PREFIX, PEAK_LIVE_DEFAULT_CAPACITY) != kIOReturnSuccess) {
+        NSBeep();
+        return;
+    }
+    if(!share)
+        PeakStopSharing();
+    
+    [[NSUserDefaults standardUserDefaults] setBool:share forKey:PeakShareLiveFramesKey];
+}
+
+- (BOOL)validateMenuItem:(NSMenuItem*)item
+{
+    if(item.action == @selector(toggleSharing:))
+        item.state = [[NSUserDefaults standardUserDefaults] boolForKey:PeakShareLiveFramesKey] ? NSOnState : NSOffState;
+    return YES;
+}
+
+- (IBAction)toggleReplay:(NSMenuItem*)sender
+{
+    if(replayOpen) {
+        BOOL running = PeakReplayIsRunning(&replay);
+        PeakReplayClose(&replay);
+        replayOpen = NO;
+        sender.title = @"Replay…";
+        if(running)
+            return;
+    }
+    
+    NSOpenPanel *panel = [NSOpenPanel openPanel];
+    panel.allowedFileTypes = @[@"peakcap"];
+    
+    if([panel runModal] != NSFileHandlingPanelOKButton)
+        return;
+    
+    // original timing, on a thread of its own so the window keeps up with the echoed frames
+    PeakReplayConfig config;
+    PeakReplayConfigInit(&config);
+    if(PeakReplayOpen(&replay, [[panel.URL path] fileSystemRepresentation], &config) != kIOReturnSuccess) {
+        NSBeep();
+        return;
+    }
+    replayOpen = YES;
+    
+    if(PeakReplayStart(&replay) == kIOReturnSuccess) {
+        sender.title = @"Stop Replay";
+    } else {
+        NSBeep();
+    }
+}
+
+- (IBAction)exportLog:(id)sender
+{
+    NSSavePanel *panel = [NSSavePanel savePanel];
+    panel.allowedFileTypes = @[@"log", @"asc", @"csv"];
+    panel.allowsOtherFileTypes = NO;
+    panel.nameFieldStringValue = @"log.asc";
+    
+    if([panel runModal] != NSFileHandlingPanelOKButton)
+        return;
+    
+    const char* path = [[panel.URL path] fileSystemRepresentation];
+    PeakExporter exporter;
+    if(PeakExportOpen(&exporter, path, PeakExportFormatForPath(path), NULL) != kIOReturnSuccess) {
+        NSBeep();
+        return;
+    }
+    
+    // in batches through the frame buffer we already have for draining
+    UInt64 count = PeakFrameStoreCount(&store);
+    IOReturn kr = kIOReturnSuccess;
+    for(UInt64 row = 0; row < count && kr == kIOReturnSuccess; ) {
+        UInt32 n = 0;
+        while(n < PEAK_BATCH_MAX_FRAMES && row < count)
+            PeakFrameStoreGet(&store, row++, &batch[n++]);
+        kr = PeakExportFrames(&exporter, batch, n);
     }
+    
+    if(PeakExportClose(&exporter) != kIOReturnSuccess || kr != kIOReturnSuccess)
+        NSBeep();
+}
+
+- (IBAction)loadPdoMapping:(id)sender
+{
+    NSOpenPanel *panel = [NSOpenPanel openPanel];
+    
+    if([panel runModal] != NSFileHandlingPanelOKButton)
+        return;
+    
+    // frames already in the log are described with the new mapping as well
+    if(PeakCanopenLoadMapping(canopen, [[panel.URL path] fileSystemRepresentation]) != kIOReturnSuccess)
+        NSBeep();
+    [logTable reloadData];
+}
+
+- (IBAction)loadDbc:(id)sender
+{
+    NSOpenPanel *panel = [NSOpenPanel openPanel];
+    PeakDbc loaded;
+    
+    if([panel runModal] != NSFileHandlingPanelOKButton)
+        return;
+    
+    // the old database stays if the new one does not load
+    if(PeakDbcLoad(&loaded, [[panel.URL path] fileSystemRepresentation]) != kIOReturnSuccess) {
+        NSBeep();
+        return;
+    }
+    PeakDbcFree(&dbc);
+    dbc = loaded;
+    [logTable reloadData];
+}
+
+// Frame lists go out in batches from a queue of their own, which waits while the transmit queue is full.
+// The log shows the frames as they are queued, as it always showed pasted ones; those the driver did not
+// take are only counted.
+static IOReturn SendParsedFrames(void* refCon, CanMsg* msgs, UInt32 count)
+{
+    AppDelegate* refToSelf = (__bridge AppDelegate *)(refCon);
+    NSMutableData* echo = [NSMutableData dataWithCapacity:count * sizeof(CanMsg)];
+    UInt32 queued = 0;
+    
+    if(PeakParseSendQueued(msgs, count, &queued) != kIOReturnSuccess)
+        refToSelf->unsent += count - queued;
+    
+    for(UInt32 i = 0; i < queued; i++) {
+        if(PeakFilterFrame(&msgs[i]))
+            [echo appendBytes:&msgs[i] length:sizeof(CanMsg)];
+    }
+    if(echo.length) {
+        dispatch_async(dispatch_get_main_queue(), ^(void) {
+            [refToSelf appendMsgs:echo.bytes count:echo.length / sizeof(CanMsg)];
+        });
+    }
+    return kIOReturnSuccess;
+}
+
+static void CollectParseError(void* refCon, UInt32 line, UInt32 column, const char* message)
+{
+    AppDelegate* refToSelf = (__bridge AppDelegate *)(refCon);
+    
+    if(refToSelf->parseErrors.count < 20)
+        [refToSelf->parseErrors addObject:[NSString stringWithFormat:@"Line %u, column %u: %s", line, column, message]];
+}
+
+- (void)sendFrameList:(NSData*)text path:(NSString*)path
+{
+    dispatch_async(sendQueue, ^(void) {
+        PeakParseConfig config;
+        PeakParseStats stats;
+        IOReturn kr;
+        
+        PeakParseConfigInit(&config);
+        config.frames = SendParsedFrames;
+        config.error = CollectParseError;
+        config.refCon = (__bridge void *)(self);
+        parseErrors = [NSMutableArray array];
+        unsent = 0;
+        
+        if(path)
+            kr = PeakParseFile([path fileSystemRepresentation], &config, &stats);
+        else
+            kr = PeakParseText(text.bytes, text.length, &config, &stats);
+        
+        if(kr == kIOReturnSuccess && stats.errors == 0 && unsent == 0)
+            return;
+        
+        NSMutableArray* lines = parseErrors;
+        UInt64 failed = unsent;
+        if(stats.errors > lines.count)
+            [lines addObject:[NSString stringWithFormat:@"and %llu more", stats.errors - lines.count]];
+        if(failed)
+            [lines addObject:[NSString stringWithFormat:@"%llu frames could not be sent", failed]];
+        if(kr != kIOReturnSuccess)
+            [lines addObject:@"The frame list could not be read"];
+        
+        dispatch_async(dispatch_get_main_queue(), ^(void) {
+            NSAlert* alert = [NSAlert alertWithMessageText:[NSString stringWithFormat:@"%llu of %llu frames skipped", stats.errors + failed, stats.frames + stats.errors]
+                                             defaultButton:nil alternateButton:nil otherButton:nil
+                                 informativeTextWithFormat:@"%@", [lines componentsJoinedByString:@"\n"]];
+            [alert runModal];
+        });
+    });
 }
 
 - (IBAction)pasteCanMessage:(id)sender
 {
-    NSPasteboard *pasteboard = [NSPasteboard generalPasteboard];
-    NSArray *classes = [[NSArray alloc] initWithObjects:[NSAttributedString class], [NSString class], nil];
-    NSDictionary *options = [NSDictionary dictionary];
- 
-    if ([pasteboard canReadObjectForClasses:classes options:options]) {
-        NSArray* pbis = [pasteboard pasteboardItems]; 
-        if(pbis.count == 1) {
-            
-            NSString* string = [[[pbis objectAtIndex:0] stringForType:@"public.utf8-plain-text"] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
-            
-            NSArray* lines = [string componentsSeparatedByCharactersInSet:[NSCharacterSet characterSetWithCharactersInString:@";\r\n"]];
-            
-            for (NSString* line in lines)
-            {
-                NSArray* numbers = [line componentsSeparatedByCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
-                if(numbers.count > 0 && numbers.count < 10 && line.length > 0)
-                {
-                    CanMsg* msg = malloc(sizeof(CanMsg));
-                    bzero(msg, sizeof(CanMsg));
-                    msg->len = (UInt8) numbers.count-1;
-                    msg->loc = 1;
-                    for(int i = 0; i < numbers.count; i++)
-                    {
-                        unsigned value;
-                        [[NSScanner scannerWithString:[numbers objectAtIndex:i]] scanHexInt:&value];
-                        if(i == 0) {
-                            if(value & 0x40000000) {
-                                msg->rtr = 1;
-                            }
-                            if(value & 0x80000000) {
-                                msg->ext = 1; // set extended flag
-                                msg->canid.ul = value & 0x1fffffff; // CAN2.0B 29 bit identfier
-                            }
-                            else {
-                                msg->canid.ul = value & 0x7ff; // CAN2.0A 11 bit identifier
-                            }
-                        } else {
-                            msg->data[i-1] = (UInt8) value & 0xff;
-                        }
+    NSString* string = [[NSPasteboard generalPasteboard] stringForType:NSPasteboardTypeString];
+    
+    if(string)
+        [self sendFrameList:[string dataUsingEncoding:NSUTF8StringEncoding] path:nil];
+}
+
+- (IBAction)openFrameList:(id)sender
+{
+    NSOpenPanel *panel = [NSOpenPanel openPanel];
+    
+    if([panel runModal] == NSFileHandlingPanelOKButton)
+        [self sendFrameList:nil path:[panel.URL path]];
+}
+
+- (void)appendMsg:(const CanMsg*)msg
+{
+    [self appendMsgs:msg count:1];
+}
+
+- (void)appendMsgs:(const CanMsg*)msgs count:(NSUInteger)count
+{
+    // the decoder follows the SDO transfers in the order the frames arrive, the texts come later
+    for(NSUInteger done = 0; done < count; ) {
+        UInt32 n = (UInt32)MIN(count - done, PEAK_BATCH_MAX_FRAMES);
+        for(UInt32 i = 0; i < n; i++)
+            tags[i] = PeakCanopenTrack(canopen, &msgs[done + i]);
+        
+        if(uiFilter) {
+            // the predicates work on LogLines, only build them while such a filter is set
+            for(UInt32 i = 0; i < n; i++) {
+                if([uiFilter evaluateWithObject:[[LogLine alloc] initWithMessage:&msgs[done + i] tag:tags[i] decoder:canopen]])
+                    PeakFrameStoreAppend(&store, &msgs[done + i], &tags[i], 1);
+            }
+        } else {
+            PeakFrameStoreAppend(&store, &msgs[done], tags, n);
+        }
+        done += n;
+    }
+    
+    // the store drops the oldest frames itself, the table only asks for the visible rows
+    BOOL follow = NSMaxRange([logTable rowsInRect:logTable.visibleRect]) >= logTable.numberOfRows;
+    [logTable reloadData];
+    if(follow)
+        [logTable scrollRowToVisible:logTable.numberOfRows - 1];
+}
+
+#pragma mark - Filter
+
+// Appends the alternatives of a predicate from the filter panel as filter terms. Fails for predicates on
+// the text columns, which only the LogLines can answer.
+static BOOL TermsForPredicate(NSPredicate* predicate, NSMutableData* terms)
+{
+    PeakFilterTerm term;
+    PeakFilterTermInit(&term);
+    
+    if([predicate isEqual:[NSPredicate predicateWithValue:YES]]) {
+        [terms appendBytes:&term length:sizeof(term)];
+        return YES;
+    }
+    
+    if([predicate isKindOfClass:[NSCompoundPredicate class]]) {
+        NSCompoundPredicate* compound = (NSCompoundPredicate*)predicate;
+        
+        if(compound.compoundPredicateType == NSOrPredicateType) {
+            for(NSPredicate* sub in compound.subpredicates) {
+                if(!TermsForPredicate(sub, terms))
+                    return NO;
+            }
+            return YES;
+        }
+        
+        if(compound.compoundPredicateType == NSAndPredicateType) {
+            // every combination of the alternatives of the subpredicates
+            NSMutableData* result = [NSMutableData dataWithBytes:&term length:sizeof(term)];
+            for(NSPredicate* sub in compound.subpredicates) {
+                NSMutableData* alternatives = [NSMutableData data];
+                NSMutableData* combined = [NSMutableData data];
+                if(!TermsForPredicate(sub, alternatives))
+                    return NO;
+                
+                const PeakFilterTerm* a = result.bytes;
+                const PeakFilterTerm* b = alternatives.bytes;
+                for(NSUInteger i = 0; i < result.length / sizeof(term); i++) {
+                    for(NSUInteger j = 0; j < alternatives.length / sizeof(term); j++) {
+                        PeakFilterTerm both = a[i];
+                        if(PeakFilterTermAnd(&both, &b[j]))
+                            [combined appendBytes:&both length:sizeof(both)];
                     }
-                    gettimeofday(&msg->ts, NULL);
-                    PeakSend(msg);
-                    [self appendMsg:msg];
                 }
+                if(combined.length / sizeof(term) > kMaxFilterTerms)
+                    return NO;
+                result = combined;
             }
+            [terms appendData:result];
+            return YES;
         }
+        
+        return NO; // "None of the following are true"
     }
+    
+    if(![predicate isKindOfClass:[NSComparisonPredicate class]])
+        return NO;
+    
+    NSComparisonPredicate* comparison = (NSComparisonPredicate*)predicate;
+    if(comparison.leftExpression.expressionType != NSKeyPathExpressionType ||
+       comparison.rightExpression.expressionType != NSConstantValueExpressionType)
+        return NO;
+    
+    NSString* keyPath = comparison.leftExpression.keyPath;
+    id value = comparison.rightExpression.constantValue;
+    
+    if([keyPath isEqualToString:@"flags"] && [value isKindOfClass:[NSString class]] &&
+       comparison.predicateOperatorType == NSContainsPredicateOperatorType) {
+        if([value isEqualToString:@"Basic"]) {
+            term.flagsMask = PEAK_FILTER_EXT;
+        } else if([value isEqualToString:@"Ext"]) {
+            term.flagsMask = term.flagsValue = PEAK_FILTER_EXT;
+        } else if([value isEqualToString:@"Rtr"]) {
+            term.flagsMask = term.flagsValue = PEAK_FILTER_RTR;
+        } else if([value isEqualToString:@"Err"]) {
+            term.flagsMask = term.flagsValue = PEAK_FILTER_ERR;
+        } else {
+            return NO;
+        }
+        [terms appendBytes:&term length:sizeof(term)];
+        return YES;
+    }
+    
+    if(![value isKindOfClass:[NSNumber class]])
+        return NO;
+    
+    long long v = [value longLongValue];
+    long long low, high;
+    if([keyPath isEqualToString:@"canid"]) {
+        low = 0; high = PEAK_FILTER_MAX_ID;
+    } else if([keyPath isEqualToString:@"length"]) {
+        low = 0; high = 8;
+    } else {
+        return NO;
+    }
+    
+    // one or two ranges on the key
+    long long ranges[4] = { low, high, 1, 0 };
+    switch(comparison.predicateOperatorType) {
+        case NSEqualToPredicateOperatorType:              ranges[0] = ranges[1] = v; break;
+        case NSLessThanPredicateOperatorType:             ranges[1] = v - 1; break;
+        case NSLessThanOrEqualToPredicateOperatorType:    ranges[1] = v; break;
+        case NSGreaterThanPredicateOperatorType:          ranges[0] = v + 1; break;
+        case NSGreaterThanOrEqualToPredicateOperatorType: ranges[0] = v; break;
+        case NSNotEqualToPredicateOperatorType:           ranges[1] = v - 1; ranges[2] = v + 1; ranges[3] = high; break;
+        default: return NO;
+    }
+    
+    for(int i = 0; i < 4; i += 2) {
+        long long from = MAX(ranges[i], low), to = MIN(ranges[i + 1], high);
+        if(from > to)
+            continue;
+        PeakFilterTerm range = term;
+        if([keyPath isEqualToString:@"canid"]) {
+            range.low = (UInt32)from;
+            range.high = (UInt32)to;
+        } else {
+            range.minLength = (UInt8)from;
+            range.maxLength = (UInt8)to;
+        }
+        [terms appendBytes:&range length:sizeof(range)];
+    }
+    return YES;
 }
 
-- (void)appendMsg:(CanMsg*)msg
+- (void)observeValueForKeyPath:(NSString *)keyPath ofObject:(id)object change:(NSDictionary *)change context:(void *)context
 {
-    LogLine *logLine = [[LogLine alloc] initWithMessage:msg];
+    NSPredicate* predicate = arrayController.filterPredicate;
+    NSMutableData* terms = [NSMutableData data];
     
-    if(!arrayController.filterPredicate || (arrayController.filterPredicate && [arrayController.filterPredicate evaluateWithObject:logLine])) {
-        [arrayController addObject:logLine];
+    // the driver drops frames right after decoding them, unless the filter needs the text columns
+    if(predicate == nil || [predicate isEqual:defaultFilter]) {
+        PeakSetFilter(NULL, 0);
+        uiFilter = nil;
+    } else if(TermsForPredicate(predicate, terms)) {
+        PeakFilterTerm none; // no alternative left passes nothing, NULL would pass everything
+        PeakSetFilter(terms.length ? terms.bytes : &none, (UInt32)(terms.length / sizeof(PeakFilterTerm)));
+        uiFilter = nil;
+    } else {
+        PeakSetFilter(NULL, 0);
+        uiFilter = predicate;
     }
+}
+
+#pragma mark - Log table
+
+- (NSInteger)numberOfRowsInTableView:(NSTableView *)tableView
+{
+    return (NSInteger)PeakFrameStoreCount(&store);
+}
+
+- (id)tableView:(NSTableView *)tableView objectValueForTableColumn:(NSTableColumn *)tableColumn row:(NSInteger)row
+{
+    static NSString* const flagNames[8] = {
+        @"Basic", @"Ext", @"Rtr|Basic", @"Rtr|Ext", @"Err|Basic", @"Err|Ext", @"Err|Rtr|Basic", @"Err|Rtr|Ext"
+    };
+    NSString* column = tableColumn.identifier;
+    CanMsg msg;
     
-    if([[arrayController arrangedObjects] count] > arrayControllerMaxSize)
-    {
-        [arrayController removeObjectAtArrangedObjectIndex:0];
+    if(PeakFrameStoreGet(&store, (UInt64)row, &msg) != kIOReturnSuccess)
+        return nil;
+    
+    if([column isEqualToString:@"timestamp"]) {
+        return [NSNumber numberWithLongLong:(long long)msg.ts];
+    } else if([column isEqualToString:@"flags"]) {
+        return flagNames[msg.ext | msg.rtr << 1 | msg.err << 2];
+    } else if([column isEqualToString:@"canid"]) {
+        return [NSNumber numberWithInt:msg.canid.ul];
+    } else if([column isEqualToString:@"length"]) {
+        return [NSNumber numberWithInt:msg.len];
+    } else if([column isEqualToString:@"data"]) {
+        char data[48];
+        PeakFrameStoreFormatData(&store, (UInt64)row, data, sizeof(data));
+        return [NSString stringWithUTF8String:data];
+    } else if([column isEqualToString:@"datadescr"]) {
+        char descr[PEAK_CANOPEN_DESCR_MAX];
+        // signals of the DBC take precedence over the CANopen services
+        if(!PeakDbcDescribe(&dbc, &msg, descr, sizeof(descr)) &&
+           !PeakCanopenDescribe(canopen, &msg, PeakFrameStoreTag(&store, (UInt64)row), descr, sizeof(descr)))
+            return msg.loc ? @"Pasted" : @"";
+        if(msg.loc)
+            return [NSString stringWithFormat:@"Pasted: %s", descr];
+        return [NSString stringWithUTF8String:descr];
     }
+    
+    return nil;
+}
+
+- (void)drainFrames:(id)sender
+{
+    if(!batcher)
+        return;
+    
+    UInt32 count;
+    do {
+        count = PeakBatcherDrain(batcher, batch, PEAK_BATCH_MAX_FRAMES, PeakMonotonicNs());
+        if(count) {
+            [self appendMsgs:batch count:count];
+            PeakNoteDisplayed(batch, count);
+        }
+    } while(count == PEAK_BATCH_MAX_FRAMES);
 }
 
 void notificationCallback (CFNotificationCenterRef center, void *observer, CFStringRef name, const void *object, CFDictionaryRef userInfo)
 {
     AppDelegate* refToSelf = (__bridge AppDelegate *)(observer);
     
+    if(CFStringCompare(name, CFSTR("CanStats"), 0) == 0) {
+        // the stats live on the poster's stack, format them right away
+        char text[1024];
+        PeakFormatInstrumentation((const PeakInstrumentStats*)object, PEAK_STATS_TEXT, text, sizeof(text));
+        NSString* tip = [NSString stringWithUTF8String:text];
+        dispatch_async(dispatch_get_main_queue(), ^(void) {
+            refToSelf.statusText.controlView.toolTip = tip;
+        });
+        return;
+    }
+    
     dispatch_async(dispatch_get_main_queue(), ^(void) {
         
         if(CFStringCompare(name, CFSTR("CanMsg"), 0) == 0) {
             
-            [refToSelf appendMsg:(CanMsg*)object];
+            refToSelf->batcher = (PeakBatcher*)object;
+            [refToSelf drainFrames:nil];
             
         }
         else if(CFStringCompare(name, CFSTR("CanDevice"), 0) == 0) {
             if(object) {
-                refToSelf.statusText.title = [NSString stringWithFormat:@"%d/sec", *(int*)object];
+                // the rate of all adapters together
+                UInt32 channels = PeakChannelCount();
+                if(channels > 1)
+                    refToSelf.statusText.title = [NSString stringWithFormat:@"%u adapters, %d/sec", (unsigned)channels, *(int*)object];
+                else
+                    refToSelf.statusText.title = [NSString stringWithFormat:@"%d/sec", *(int*)object];
             } else {
                 refToSelf.statusText.title = @"No device";
             }
@@ -158,12 +585,29 @@ void notificationCallback (CFNotificationCenterRef center, void *observer, CFStr
     [[bitratePopup itemAtIndex:2] setEnabled:NO];
     [bitratePopup setAutoenablesItems:NO];
     
+    // the array controller only holds the filter edited in the predicate editor, the frames live in the store
+    if(PeakFrameStoreCreate(&store, PEAK_STORE_DEFAULT_CAPACITY) != kIOReturnSuccess)
+        PeakFrameStoreCreate(&store, 1024);
     [arrayController setClearsFilterPredicateOnInsertion:NO];
-    arrayControllerMaxSize = 1000;
-    [arrayController setFilterPredicate:[NSPredicate predicateWithFormat:@"length >= 0 OR canid >= 0"]];
+    defaultFilter = [NSPredicate predicateWithFormat:@"length >= 0 OR canid >= 0"];
+    [arrayController setFilterPredicate:defaultFilter];
+    [arrayController addObserver:self forKeyPath:@"filterPredicate" options:0 context:NULL];
+    
+    batch = calloc(PEAK_BATCH_MAX_FRAMES, sizeof(CanMsg));
+    tags = calloc(PEAK_BATCH_MAX_FRAMES, sizeof(UInt32));
+    PeakCanopenCreate(&canopen);
+    sendQueue = dispatch_queue_create("PeakFrameList", NULL);
+    
+    // frames left over by the coalesced flushes are picked up on the display tick
+    displayTimer = [NSTimer scheduledTimerWithTimeInterval:(double)PEAK_BATCH_DEFAULT_TICK_NS / 1e9 target:self selector:@selector(drainFrames:) userInfo:nil repeats:YES];
     
     CFNotificationCenterAddObserver(CFNotificationCenterGetLocalCenter(), (__bridge const void *)(self), notificationCallback, NULL, NULL, CFNotificationSuspensionBehaviorHold);
         
+    // local tools attach to the live frames of each adapter through /PeakLog.<channel>, only if the user
+    // turned it on: any process of the same user can read the segments
+    if([[NSUserDefaults standardUserDefaults] boolForKey:PeakShareLiveFramesKey])
+        PeakStartSharing(PEAK_LIVE_PREFIX, PEAK_LIVE_DEFAULT_CAPACITY);
+    
     dispatch_async(dispatch_queue_create("PeakUSBDriver", NULL), ^(void) {
         PeakStart();
     });
@@ -171,6 +615,10 @@ void notificationCallback (CFNotificationCenterRef center, void *observer, CFStr
 
 - (void)applicationWillTerminate:(NSNotification *)notification
 {
+    if(replayOpen)
+        PeakReplayClose(&replay);
+    PeakStopCapture();
+    PeakStopSharing();
     PeakStop();
     [[NSApplication sharedApplication] terminate:self];
 }
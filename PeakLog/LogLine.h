@@ -8,6 +8,7 @@
 #import <Foundation/Foundation.h>
 
 #include "PeakUSB.h"
+#include "PeakCanopen.h"
 
 #pragma mark - Formatter classes
 
@@ -41,6 +42,8 @@
 @property (readonly) NSString *data;
 @property (readonly) NSString *datadescr;
 
-- (id)initWithMessage:(CanMsg*)msg;
+- (id)initWithMessage:(const CanMsg*)msg;
+// datadescr describes the frame with the decoder and the tag it got while streaming
+- (id)initWithMessage:(const CanMsg*)msg tag:(UInt32)tag decoder:(const PeakCanopenDecoder*)decoder;
 
 @end
@@ -17,8 +17,8 @@
     {
         if ([arg isKindOfClass:[NSNumber class]])
         {
-            long long ts = [arg longLongValue];
-            return [NSString stringWithFormat:@"%06llu.%06llu", (ts >> 20), (ts & 0xFFFFF)];
+            long long ts = [arg longLongValue]; // ns since 1970
+            return [NSString stringWithFormat:@"%06llu.%06llu", (ts / 1000000000LL), (ts % 1000000000LL) / 1000LL];
         }
         else
         {
@@ -130,17 +130,10 @@
 
 -(NSPredicate *)predicateWithSubpredicates:(NSArray *) subpredicates
 {    
-    int min = 0, max = 0;
-    switch ([[self typePopUp] selectedTag]) {
-        case 0: min = 0; max = 128; break; // MNT
-        case 1: min = 129; max = 254; break; // EMERG
-        case 2: min = 385; max = 1279; break; // PDO
-        case 3: min = 1409; max = 1663; break; // SDO
-        case 4: min = 1793; max = 1919; break; // HEARTBEAT
-        case 5: min = 2020; max = 2021; break; // LSS
-        default: break;
-    }
-    return [NSPredicate predicateWithFormat:@"canid >= %d AND canid <= %d", min, max];
+    // the menu tags are the PEAK_CANOPEN_TYPE_ values
+    UInt32 min, max;
+    PeakCanopenTypeRange((UInt32)[[self typePopUp] selectedTag], &min, &max);
+    return [NSPredicate predicateWithFormat:@"canid >= %d AND canid <= %d", (int)min, (int)max];
 }
 
 @end
@@ -192,7 +185,9 @@
 
 @implementation LogLine
 {
-    CanMsg* _msg;
+    CanMsg _msg; // copied, the driver reuses its receive slots
+    UInt32 _tag;
+    const PeakCanopenDecoder* _decoder;
 }
 
 - (id)init
@@ -203,64 +198,67 @@
     return nil;
 }
 
-- (id)initWithMessage:(CanMsg*)msg
+- (id)initWithMessage:(const CanMsg*)msg
+{
+    return [self initWithMessage:msg tag:0 decoder:NULL];
+}
+
+- (id)initWithMessage:(const CanMsg*)msg tag:(UInt32)tag decoder:(const PeakCanopenDecoder*)decoder
 {
     self = [super init];
     if(self) {
-        _msg = msg;
+        _msg = *msg;
+        _tag = tag;
+        _decoder = decoder;
     }
     return self;
 }
 
 - (NSNumber *)timestamp
 {
-    long long i = _msg->ts.tv_sec << 20 | _msg->ts.tv_usec;
-    return [NSNumber numberWithLongLong:i];
+    return [NSNumber numberWithLongLong:(long long)_msg.ts];
 }
 
 - (NSString *)data
 {
     NSMutableString* data = [[NSMutableString alloc] init];
-    for(int i = 0; i < _msg->len; i++)
-        [data appendFormat:@" 0x%02x", _msg->data[i]];
+    for(int i = 0; i < _msg.len; i++)
+        [data appendFormat:@" 0x%02x", _msg.data[i]];
     return data;
 }
 
 - (NSString *)datadescr
 {
-    if(_msg->loc)
-        return @"Pasted";
-    else
-        return @"";
+    char descr[PEAK_CANOPEN_DESCR_MAX];
+    if(!_decoder || !PeakCanopenDescribe(_decoder, &_msg, _tag, descr, sizeof(descr)))
+        return _msg.loc ? @"Pasted" : @"";
+    if(_msg.loc)
+        return [NSString stringWithFormat:@"Pasted: %s", descr];
+    return [NSString stringWithUTF8String:descr];
 }
 
 - (NSNumber *)canid
 {
-    return [NSNumber numberWithInt:_msg->canid.ul];
+    return [NSNumber numberWithInt:_msg.canid.ul];
 }
 
 - (NSNumber *)length
 {
-    return [NSNumber numberWithInt:_msg->len];
+    return [NSNumber numberWithInt:_msg.len];
 }
 
 - (NSString *)flags
 {
     NSMutableString* flags = [[NSMutableString alloc] initWithCapacity:16];
-    if(_msg->err)
+    if(_msg.err)
         [flags appendString:@"|Err"];
-    if(_msg->rtr)
+    if(_msg.rtr)
         [flags appendString:@"|Rtr"];
-    if(_msg->ext)
+    if(_msg.ext)
         [flags appendString:@"|Ext"];
     else
         [flags appendString:@"|Basic"];
     return [flags substringFromIndex:1];
 }
 
-- (void)dealloc
-{
-    free(_msg);
-}
-
 @end
@@ -0,0 +1,418 @@
+/*
+    File:           PeakAcceptance.c
+
+    Description:    SJA1000 acceptance code/mask registers computed from a set of wanted identifiers,
+                    and the control writes programming them into the adapter.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "PeakAcceptance.h"
+
+// Register layout of an identifier, ACR0 is the most significant byte:
+//
+//   single, 11 bit:  ACR0 ID.10-3, ACR1 ID.2-0 RTR -, ACR2 DB1, ACR3 DB2
+//   single, 29 bit:  ACR0..ACR3 ID.28-0 RTR - -
+//   dual, 11 bit:    filter 1 ACR0 ID.10-3, ACR1 ID.2-0 RTR DB1.7-4, ACR3.3-0 DB1.3-0
+//                    filter 2 ACR2 ID.10-3, ACR3.7-4 ID.2-0 RTR
+//   dual, 29 bit:    filter 1 ACR0 ACR1 ID.28-13, filter 2 ACR2 ACR3 ID.28-13
+//
+// In dual mode ACR3.3-0 is shared: the payload nibble of filter 1 for 11 bit frames and ID.16-13 of
+// filter 2 for 29 bit frames.
+
+#define REFINE_PASSES       8
+#define REFINE_LIMIT        4096    // patterns, the refinement is quadratic
+
+typedef struct {
+    UInt32  word;       // identifier in the register layout
+    UInt32  care;       // bits the identifier defines
+    UInt32  ext;
+} Pattern;
+
+typedef struct {
+    UInt32  code, mask;
+    int     used, hasStd;
+} Cover;
+
+#pragma mark - Counting
+
+static UInt64 Ones(UInt32 bits)
+{
+    return (UInt64)1 << __builtin_popcount(bits);
+}
+
+// identifiers passed by either of two code/mask pairs within region
+static UInt64 Union(UInt32 code1, UInt32 mask1, UInt32 code2, UInt32 mask2, UInt32 region)
+{
+    UInt64 n = Ones(mask1 & region) + Ones(mask2 & region);
+    
+    if (((code1 ^ code2) & ~mask1 & ~mask2 & region) == 0)
+        n -= Ones(mask1 & mask2 & region);
+    
+    return n;
+}
+
+static UInt32 Code32(const PeakAcceptance* acc)
+{
+    return ((UInt32)acc->code[0] << 24) | ((UInt32)acc->code[1] << 16) | ((UInt32)acc->code[2] << 8) | acc->code[3];
+}
+
+static UInt32 Mask32(const PeakAcceptance* acc)
+{
+    return ((UInt32)acc->mask[0] << 24) | ((UInt32)acc->mask[1] << 16) | ((UInt32)acc->mask[2] << 8) | acc->mask[3];
+}
+
+void PeakAcceptancePassed(const PeakAcceptance* acc, UInt64* stdIds, UInt64* extIds)
+{
+    UInt32 code = Code32(acc), mask = Mask32(acc);
+    
+    if (acc->single)
+    {
+        *stdIds = Ones(mask & 0xffe00000);
+        *extIds = Ones(mask & 0xfffffff8);
+    }
+    else
+    {
+        *stdIds = Union(code >> 16, mask >> 16, code & 0xffff, mask & 0xffff, 0xffe0);
+        *extIds = Union(code >> 16, mask >> 16, code & 0xffff, mask & 0xffff, 0xffff) << 13;
+    }
+}
+
+// share of the identifier space passed, what we minimize
+static double Cost(const PeakAcceptance* acc)
+{
+    UInt64 stdIds, extIds;
+    
+    PeakAcceptancePassed(acc, &stdIds, &extIds);
+    return stdIds / 2048.0 + extIds / 536870912.0;
+}
+
+#pragma mark - Covers
+
+static void CoverAdd(Cover* c, const Pattern* p)
+{
+    if (!c->used)
+    {
+        c->mask = ~p->care;
+        c->code = p->word;
+        c->used = 1;
+    }
+    else
+    {
+        c->mask |= ~p->care | (p->word ^ c->code);
+    }
+    
+    c->code &= ~c->mask;
+    c->hasStd |= !p->ext;
+}
+
+static void SetRegisters(PeakAcceptance* acc, UInt32 code, UInt32 mask, int single)
+{
+    UInt32 i;
+    
+    for (i = 0; i < 4; i++)
+    {
+        acc->code[i] = (UInt8)(code >> (24 - 8 * i));
+        acc->mask[i] = (UInt8)(mask >> (24 - 8 * i));
+    }
+    acc->single = single;
+}
+
+static void Single(PeakAcceptance* acc, const UInt32* ids, UInt32 count)
+{
+    Cover c;
+    Pattern p;
+    UInt32 i;
+    
+    bzero(&c, sizeof(Cover));
+    for (i = 0; i < count; i++)
+    {
+        p.ext = (ids[i] & PEAK_ACCEPTANCE_EXT) != 0;
+        p.word = p.ext ? (ids[i] & 0x1fffffff) << 3 : ids[i] << 21;
+        p.care = p.ext ? 0xfffffff8 : 0xffe00000;
+        CoverAdd(&c, &p);
+    }
+    
+    SetRegisters(acc, c.code, c.mask, 1);
+}
+
+// registers for the patterns split into two groups, an empty group repeats the other one
+static void DualRegisters(PeakAcceptance* acc, const Pattern* p, UInt32 n, const UInt8* group)
+{
+    Cover c[2];
+    UInt32 i;
+    
+    bzero(c, sizeof(c));
+    for (i = 0; i < n; i++)
+        CoverAdd(&c[group[i]], &p[i]);
+    
+    if (!c[0].used)
+        c[0] = c[1];
+    if (!c[1].used)
+        c[1] = c[0];
+    
+    // filter 1 ignores the payload of 11 bit frames, which takes ID.16-13 away from filter 2
+    if (c[0].hasStd)
+        c[1].mask |= 0x000f;
+    
+    SetRegisters(acc, (c[0].code << 16) | (c[1].code & 0xffff), (c[0].mask << 16) | (c[1].mask & 0xffff), 0);
+}
+
+static double DualCost(const Pattern* p, UInt32 n, const UInt8* group)
+{
+    PeakAcceptance acc;
+    
+    DualRegisters(&acc, p, n, group);
+    return Cost(&acc);
+}
+
+// Splits the identifiers between the two filters: the best of a split by frame type and a split on each
+// identifier bit, improved by moving single identifiers over while that helps.
+static IOReturn Dual(PeakAcceptance* acc, const UInt32* ids, UInt32 count)
+{
+    Pattern *p = calloc(count, sizeof(Pattern));
+    UInt8 *group = calloc(count, 1), *best = calloc(count, 1);
+    double cost, bestCost;
+    UInt32 i, bit, pass;
+    int improved;
+    
+    if (!p || !group || !best)
+    {
+        free(p);
+        free(group);
+        free(best);
+        return kIOReturnNoMemory;
+    }
+    
+    for (i = 0; i < count; i++)
+    {
+        p[i].ext = (ids[i] & PEAK_ACCEPTANCE_EXT) != 0;
+        p[i].word = p[i].ext ? (ids[i] & 0x1fffffff) >> 13 : ids[i] << 5;
+        p[i].care = p[i].ext ? 0xffff : 0xffe0;
+        best[i] = 0;
+    }
+    bestCost = DualCost(p, count, best);
+    
+    for (i = 0; i < count; i++)
+        group[i] = !p[i].ext;
+    cost = DualCost(p, count, group);
+    if (cost < bestCost)
+    {
+        bestCost = cost;
+        memcpy(best, group, count);
+    }
+    
+    for (bit = 0; bit < 16; bit++)
+    {
+        for (i = 0; i < count; i++)
+            group[i] = (p[i].word >> bit) & 1;
+        cost = DualCost(p, count, group);
+        if (cost < bestCost)
+        {
+            bestCost = cost;
+            memcpy(best, group, count);
+        }
+    }
+    
+    for (pass = 0; pass < REFINE_PASSES && count <= REFINE_LIMIT; pass++)
+    {
+        improved = 0;
+        for (i = 0; i < count; i++)
+        {
+            best[i] ^= 1;
+            cost = DualCost(p, count, best);
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                improved = 1;
+            }
+            else
+            {
+                best[i] ^= 1;
+            }
+        }
+        if (!improved)
+            break;
+    }
+    
+    DualRegisters(acc, p, count, best);
+    free(p);
+    free(group);
+    free(best);
+    return kIOReturnSuccess;
+}
+
+#pragma mark - Registers
+
+void PeakAcceptanceOpen(PeakAcceptance* acc)
+{
+    SetRegisters(acc, 0, 0xffffffff, 1);
+}
+
+static int CompareIds(const void* a, const void* b)
+{
+    UInt32 x = *(const UInt32*)a, y = *(const UInt32*)b;
+    return (x > y) - (x < y);
+}
+
+IOReturn PeakAcceptanceCompute(PeakAcceptance* acc, const UInt32* ids, UInt32 count, UInt32 mode)
+{
+    PeakAcceptance dual;
+    UInt32 *set, n = 0, i;
+    IOReturn kr;
+    
+    if (mode > PEAK_ACCEPTANCE_BEST)
+        return kIOReturnBadArgument;
+    
+    PeakAcceptanceOpen(acc);
+    if (count == 0)
+        return kIOReturnSuccess;
+    
+    set = malloc(count * sizeof(UInt32));
+    if (set == NULL)
+        return kIOReturnNoMemory;
+    
+    for (i = 0; i < count; i++)
+    {
+        UInt32 id = ids[i];
+        
+        if (id & PEAK_ACCEPTANCE_EXT)
+            id &= PEAK_ACCEPTANCE_EXT | 0x1fffffff;
+        else if (id > 0x7ff)
+        {
+            free(set);
+            return kIOReturnBadArgument;
+        }
+        set[i] = id;
+    }
+    
+    qsort(set, count, sizeof(UInt32), CompareIds);
+    for (i = 0; i < count; i++)
+    {
+        if (n == 0 || set[n - 1] != set[i])
+            set[n++] = set[i];
+    }
+    
+    kr = kIOReturnSuccess;
+    if (mode != PEAK_ACCEPTANCE_DUAL)
+        Single(acc, set, n);
+    if (mode != PEAK_ACCEPTANCE_SINGLE)
+    {
+        kr = Dual(&dual, set, n);
+        if (kr == kIOReturnSuccess && (mode == PEAK_ACCEPTANCE_DUAL || Cost(&dual) < Cost(acc)))
+            *acc = dual;
+    }
+    
+    free(set);
+    return kr;
+}
+
+int PeakAcceptanceMatch(const PeakAcceptance* acc, const CanMsg* msg)
+{
+    UInt32 code = Code32(acc), mask = Mask32(acc);
+    UInt32 id = msg->canid.ul, rtr = msg->rtr, word, compare;
+    UInt8 db1 = msg->data[0];
+    int hasDb1 = !msg->rtr && msg->len > 0; // missing payload bytes are not compared
+    int hasDb2 = !msg->rtr && msg->len > 1;
+    
+    if (acc->single)
+    {
+        if (msg->ext)
+        {
+            word = (id & 0x1fffffff) << 3 | rtr << 2;
+            compare = 0xfffffffc;
+        }
+        else
+        {
+            word = (id & 0x7ff) << 21 | rtr << 20 | (UInt32)db1 << 8 | msg->data[1];
+            compare = 0xfff00000 | (hasDb1 ? 0xff00 : 0) | (hasDb2 ? 0x00ff : 0);
+        }
+        return ((word ^ code) & ~mask & compare) == 0;
+    }
+    
+    if (msg->ext)
+    {
+        word = (id & 0x1fffffff) >> 13;
+        return ((word ^ (code >> 16)) & ~(mask >> 16) & 0xffff) == 0
+            || ((word ^ code) & ~mask & 0xffff) == 0;
+    }
+    
+    word = (id & 0x7ff) << 5 | rtr << 4;
+    if (((word ^ (code >> 16)) & ~(mask >> 16) & 0xfff0) == 0)
+    {
+        compare = hasDb1 ? 0xff : 0;
+        if ((((db1 >> 4) ^ (code >> 16)) & ~(mask >> 16) & 0x0f & compare) == 0
+            && (((db1 & 0x0f) ^ code) & ~mask & 0x0f & compare) == 0)
+            return 1;
+    }
+    return ((word ^ code) & ~mask & 0xfff0) == 0;
+}
+
+#pragma mark - Control writes
+
+UInt32 PeakAcceptanceParams(const PeakAcceptance* acc, PCAN_USB_PARAM params[PEAK_ACCEPTANCE_PARAMS])
+{
+    UInt32 n = 0, i;
+    
+    bzero(params, PEAK_ACCEPTANCE_PARAMS * sizeof(PCAN_USB_PARAM));
+    
+    // stay in reset mode, CANON starts the controller
+    params[n].Function = PCAN_USB_FUNCTION_REGISTER;
+    params[n].Number = 2;
+    params[n].Param[0] = SJA1000_MOD;
+    params[n].Param[1] = SJA1000_MOD_RM | (acc->single ? SJA1000_MOD_AFM : 0);
+    n++;
+    
+    for (i = 0; i < 4; i++)
+    {
+        params[n].Function = PCAN_USB_FUNCTION_REGISTER;
+        params[n].Number = 2;
+        params[n].Param[0] = SJA1000_ACR0 + i;
+        params[n].Param[1] = acc->code[i];
+        n++;
+        
+        params[n].Function = PCAN_USB_FUNCTION_REGISTER;
+        params[n].Number = 2;
+        params[n].Param[0] = SJA1000_AMR0 + i;
+        params[n].Param[1] = acc->mask[i];
+        n++;
+    }
+    
+    return n;
+}
+
+int PeakAcceptanceApplyParam(PeakAcceptance* acc, const PCAN_USB_PARAM* param)
+{
+    UInt8 reg = param->Param[0], value = param->Param[1];
+    
+    if (param->Function != PCAN_USB_FUNCTION_REGISTER || param->Number != 2)
+        return 0;
+    
+    if (reg == SJA1000_MOD)
+        acc->single = (value & SJA1000_MOD_AFM) != 0;
+    else if (reg >= SJA1000_ACR0 && reg < SJA1000_ACR0 + 4)
+        acc->code[reg - SJA1000_ACR0] = value;
+    else if (reg >= SJA1000_AMR0 && reg < SJA1000_AMR0 + 4)
+        acc->mask[reg - SJA1000_AMR0] = value;
+    else
+        return 0;
+    
+    return 1;
+}
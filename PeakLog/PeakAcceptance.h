@@ -0,0 +1,69 @@
+/*
+    File:           PeakAcceptance.h
+
+    Description:    SJA1000 acceptance code/mask registers computed from a set of wanted identifiers,
+                    and the control writes programming them into the adapter.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakAcceptance_h
+#define PeakLog_PeakAcceptance_h
+
+#include "PeakUSB.h"
+
+// PeliCAN mode registers, the acceptance registers are only writable in reset mode
+#define SJA1000_MOD                 0
+#define SJA1000_ACR0                16
+#define SJA1000_AMR0                20
+#define SJA1000_MOD_RM              0x01    // reset mode
+#define SJA1000_MOD_AFM             0x08    // single acceptance filter
+
+// PCAN_USB_PARAM function writing one controller register: Param[0] address, Param[1] value
+#define PCAN_USB_FUNCTION_REGISTER  9
+
+#define PEAK_ACCEPTANCE_PARAMS      9       // control writes for one register set
+
+// the ext flag of an identifier in a wanted set
+#define PEAK_ACCEPTANCE_EXT         0x80000000
+
+// filter modes
+#define PEAK_ACCEPTANCE_SINGLE      0       // one 32 bit filter
+#define PEAK_ACCEPTANCE_DUAL        1       // two 16 bit filters, a frame passes if either matches
+#define PEAK_ACCEPTANCE_BEST        2       // whichever passes less of the identifier space
+
+typedef struct {
+    UInt8   code[4];        // ACR0..3
+    UInt8   mask[4];        // AMR0..3, set bits are don't care
+    UInt8   single;         // MOD.AFM
+} PeakAcceptance;
+
+// Registers passing everything, the reset state of the controller.
+void PeakAcceptanceOpen(PeakAcceptance* acc);
+// Tightest registers passing every identifier in ids, duplicates are fine, an empty set opens the filter.
+IOReturn PeakAcceptanceCompute(PeakAcceptance* acc, const UInt32* ids, UInt32 count, UInt32 mode);
+// What the controller does with a frame.
+int PeakAcceptanceMatch(const PeakAcceptance* acc, const CanMsg* msg);
+// Number of 11 and 29 bit identifiers the registers pass for some RTR bit and payload.
+void PeakAcceptancePassed(const PeakAcceptance* acc, UInt64* stdIds, UInt64* extIds);
+
+// Control writes for the registers, to be sent while the controller is in reset mode. Returns the count.
+UInt32 PeakAcceptanceParams(const PeakAcceptance* acc, PCAN_USB_PARAM params[PEAK_ACCEPTANCE_PARAMS]);
+// The device side: applies a control write to the registers, returns 0 if it is none of ours.
+int PeakAcceptanceApplyParam(PeakAcceptance* acc, const PCAN_USB_PARAM* param);
+
+#endif
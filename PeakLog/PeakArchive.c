@@ -0,0 +1,756 @@
+/*
+    File:           PeakArchive.c
+
+    Description:    Compressed archive of captured frames in independently decodable chunks, with a
+                    chunk directory for random access.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "PeakArchive.h"
+#include "PeakBatch.h"
+#include "PeakCapture.h"
+#include "PeakIndex.h"
+
+// worst case of a frame in the columns: timestamp varint, key, key index, flags, channel and payload
+#define FRAME_BYTES_MAX             (10 + 5 + 2 + 1 + 1 + 8)
+#define KEY_SLOTS                   (2 * PEAK_ARCHIVE_CHUNK_FRAMES)
+
+#define ZIGZAG(d)                   (((UInt64)(d) << 1) ^ (UInt64)((d) >> 63))
+#define UNZIGZAG(u)                 ((SInt64)((u) >> 1) ^ -(SInt64)((u) & 1))
+
+#pragma mark - Columns
+
+static inline UInt8* PutVarint(UInt8* ptr, UInt64 value)
+{
+    while (value >= 0x80)
+    {
+        *ptr++ = (UInt8)value | 0x80;
+        value >>= 7;
+    }
+    *ptr++ = (UInt8)value;
+    return ptr;
+}
+
+// NULL if the varint runs past end
+static inline const UInt8* GetVarint(const UInt8* ptr, const UInt8* end, UInt64* value)
+{
+    UInt64 result = 0;
+    UInt32 shift;
+    
+    for (shift = 0; ptr < end && shift < 64; shift += 7)
+    {
+        UInt8 byte = *ptr++;
+        result |= (UInt64)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            *value = result;
+            return ptr;
+        }
+    }
+    return NULL;
+}
+
+static inline UInt8 FlagsFromMsg(const CanMsg* msg)
+{
+    return (msg->ext ? PEAK_CAPTURE_EXT : 0) | (msg->rtr ? PEAK_CAPTURE_RTR : 0) |
+           (msg->err ? PEAK_CAPTURE_ERR : 0) | (msg->loc ? PEAK_CAPTURE_LOC : 0);
+}
+
+// the payload up to its length, zero behind it whatever the decoder left there
+static inline UInt64 Payload(const CanMsg* msg)
+{
+    UInt64 payload = 0;
+    memcpy(&payload, msg->data, msg->len > 8 ? 8 : msg->len);
+    return payload;
+}
+
+// Codes the open chunk into writer->raw, returns its length.
+static UInt32 EncodeChunk(PeakArchiveWriter* writer, PeakArchiveChunk* chunk)
+{
+    const CanMsg* msgs = writer->frames;
+    UInt32 i, slot, key, keyCount = 0, count = writer->count;
+    UInt64 prev, payload;
+    UInt8* ptr = writer->raw;
+    
+    bzero(writer->slots, KEY_SLOTS * sizeof(UInt32));
+    chunk->flags = 0;
+    chunk->firstTs = msgs[0].ts;
+    chunk->minTs = chunk->maxTs = msgs[0].ts;
+    
+    // the dictionary, every key gets the index of its first appearance
+    for (i = 0; i < count; i++)
+    {
+        key = PEAK_INDEX_KEY(msgs[i].canid.ul, msgs[i].ext);
+        slot = (key * 2654435761u) & (KEY_SLOTS - 1);
+        while (writer->slots[slot] != 0 && writer->keys[writer->slots[slot] - 1] != key)
+            slot = (slot + 1) & (KEY_SLOTS - 1);
+        if (writer->slots[slot] == 0)
+        {
+            writer->keys[keyCount] = key;
+            writer->last[keyCount] = 0;
+            writer->slots[slot] = ++keyCount;
+        }
+        writer->indices[i] = (UInt16)(writer->slots[slot] - 1);
+        
+        if (msgs[i].channel != 0)
+            chunk->flags |= PEAK_ARCHIVE_CHANNELS;
+        if (msgs[i].ts < chunk->minTs)
+            chunk->minTs = msgs[i].ts;
+        if (msgs[i].ts > chunk->maxTs)
+            chunk->maxTs = msgs[i].ts;
+    }
+    
+    ptr = PutVarint(ptr, keyCount);
+    for (i = 0; i < keyCount; i++)
+        ptr = PutVarint(ptr, writer->keys[i]);
+    
+    if (keyCount <= 256)
+    {
+        for (i = 0; i < count; i++)
+            *ptr++ = (UInt8)writer->indices[i];
+    }
+    else
+    {
+        for (i = 0; i < count; i++)
+        {
+            *ptr++ = (UInt8)writer->indices[i];
+            *ptr++ = (UInt8)(writer->indices[i] >> 8);
+        }
+    }
+    
+    // merged channels may go back in time a little, hence zigzag
+    prev = chunk->firstTs;
+    for (i = 0; i < count; i++)
+    {
+        SInt64 delta = (SInt64)(msgs[i].ts - prev);
+        ptr = PutVarint(ptr, ZIGZAG(delta));
+        prev = msgs[i].ts;
+    }
+    
+    for (i = 0; i < count; i++)
+        *ptr++ = (msgs[i].len > 8 ? 8 : msgs[i].len) | FlagsFromMsg(&msgs[i]) << 4;
+    
+    if (chunk->flags & PEAK_ARCHIVE_CHANNELS)
+    {
+        for (i = 0; i < count; i++)
+            *ptr++ = msgs[i].channel;
+    }
+    
+    // a signal that did not change leaves zeros, which deflate makes next to nothing of
+    for (i = 0; i < count; i++)
+    {
+        UInt32 len = msgs[i].len > 8 ? 8 : msgs[i].len;
+        
+        if (msgs[i].rtr)
+            continue;
+        payload = Payload(&msgs[i]);
+        prev = payload ^ writer->last[writer->indices[i]];
+        writer->last[writer->indices[i]] = payload;
+        memcpy(ptr, &prev, len);
+        ptr += len;
+    }
+    
+    return (UInt32)(ptr - writer->raw);
+}
+
+// The frames of a chunk from its columns, kIOReturnIOError if they do not add up.
+static IOReturn DecodeChunk(PeakArchiveReader* reader, const PeakArchiveChunk* chunk, CanMsg* msgs)
+{
+    const UInt8* ptr = reader->raw;
+    const UInt8* end = reader->raw + chunk->rawSize;
+    const UInt8* indices;
+    UInt32 i, wide, count = chunk->frames;
+    UInt64 value, keyCount, prev;
+    
+    if ((ptr = GetVarint(ptr, end, &keyCount)) == NULL || keyCount > count)
+        return kIOReturnIOError;
+    for (i = 0; i < keyCount; i++)
+    {
+        if ((ptr = GetVarint(ptr, end, &value)) == NULL)
+            return kIOReturnIOError;
+        reader->keys[i] = (UInt32)value;
+        reader->last[i] = 0;
+    }
+    
+    wide = keyCount > 256;
+    indices = ptr;
+    if ((UInt64)(end - ptr) < (UInt64)count << wide)
+        return kIOReturnIOError;
+    ptr += count << wide;
+    
+    bzero(msgs, count * sizeof(CanMsg));
+    for (i = 0; i < count; i++)
+    {
+        UInt32 index = wide ? indices[2 * i] | indices[2 * i + 1] << 8 : indices[i];
+        if (index >= keyCount)
+            return kIOReturnIOError;
+        msgs[i].canid.ul = reader->keys[index] & 0x1fffffff;
+        msgs[i].ext = (reader->keys[index] & 0x80000000) != 0;
+    }
+    
+    prev = chunk->firstTs;
+    for (i = 0; i < count; i++)
+    {
+        if ((ptr = GetVarint(ptr, end, &value)) == NULL)
+            return kIOReturnIOError;
+        prev += UNZIGZAG(value);
+        msgs[i].ts = prev;
+    }
+    
+    if ((UInt64)(end - ptr) < count)
+        return kIOReturnIOError;
+    for (i = 0; i < count; i++, ptr++)
+    {
+        msgs[i].len = *ptr & 0x0f;
+        msgs[i].rtr = (*ptr >> 4 & PEAK_CAPTURE_RTR) != 0;
+        msgs[i].err = (*ptr >> 4 & PEAK_CAPTURE_ERR) != 0;
+        msgs[i].loc = (*ptr >> 4 & PEAK_CAPTURE_LOC) != 0;
+        if (msgs[i].len > 8)
+            return kIOReturnIOError;
+    }
+    
+    if (chunk->flags & PEAK_ARCHIVE_CHANNELS)
+    {
+        if ((UInt64)(end - ptr) < count)
+            return kIOReturnIOError;
+        for (i = 0; i < count; i++, ptr++)
+            msgs[i].channel = *ptr < PEAK_MAX_CHANNELS ? *ptr : 0;
+    }
+    
+    for (i = 0; i < count; i++)
+    {
+        UInt32 index = wide ? indices[2 * i] | indices[2 * i + 1] << 8 : indices[i];
+        UInt64 payload = 0;
+        
+        if (msgs[i].rtr)
+            continue;
+        if ((UInt64)(end - ptr) < msgs[i].len)
+            return kIOReturnIOError;
+        memcpy(&payload, ptr, msgs[i].len);
+        ptr += msgs[i].len;
+        // like the writer's, the last payload has no bytes past its length
+        payload ^= reader->last[index];
+        if (msgs[i].len < 8)
+            payload &= (1ULL << 8 * msgs[i].len) - 1;
+        reader->last[index] = msgs[i].ldata = payload;
+    }
+    
+    return ptr == end ? kIOReturnSuccess : kIOReturnIOError;
+}
+
+#pragma mark - Writer
+
+static IOReturn WriteAll(int fd, const void* buffer, size_t length)
+{
+    const UInt8* ptr = buffer;
+    
+    while (length > 0)
+    {
+        ssize_t n = write(fd, ptr, length);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Unable to write archive (%s)\n", strerror(errno));
+            return kIOReturnIOError;
+        }
+        ptr += n;
+        length -= n;
+    }
+    
+    return kIOReturnSuccess;
+}
+
+static void FreeWriter(PeakArchiveWriter* writer)
+{
+    free(writer->frames);
+    free(writer->raw);
+    free(writer->packed);
+    free(writer->slots);
+    free(writer->keys);
+    free(writer->indices);
+    free(writer->last);
+    free(writer->directory);
+    if (writer->fd >= 0)
+        close(writer->fd);
+    bzero(writer, sizeof(PeakArchiveWriter));
+    writer->fd = -1;
+}
+
+IOReturn PeakArchiveWriterOpen(PeakArchiveWriter* writer, const char* path, UInt16 bitrate, UInt32 serial, UInt32 deviceNo)
+{
+    struct timespec now;
+    IOReturn kr;
+    
+    bzero(writer, sizeof(PeakArchiveWriter));
+    writer->rawCapacity = PEAK_ARCHIVE_CHUNK_FRAMES * FRAME_BYTES_MAX + 16;
+    writer->packedCapacity = (UInt32)compressBound(writer->rawCapacity);
+    writer->directoryCapacity = 64;
+    
+    writer->frames    = malloc(PEAK_ARCHIVE_CHUNK_FRAMES * sizeof(CanMsg));
+    writer->raw       = malloc(writer->rawCapacity);
+    writer->packed    = malloc(writer->packedCapacity);
+    writer->slots     = malloc(KEY_SLOTS * sizeof(UInt32));
+    writer->keys      = malloc(PEAK_ARCHIVE_CHUNK_FRAMES * sizeof(UInt32));
+    writer->indices   = malloc(PEAK_ARCHIVE_CHUNK_FRAMES * sizeof(UInt16));
+    writer->last      = malloc(PEAK_ARCHIVE_CHUNK_FRAMES * sizeof(UInt64));
+    writer->directory = malloc(writer->directoryCapacity * sizeof(PeakArchiveEntry));
+    writer->fd = -1;
+    
+    if (!writer->frames || !writer->raw || !writer->packed || !writer->slots || !writer->keys || !writer->indices ||
+        !writer->last || !writer->directory)
+    {
+        FreeWriter(writer);
+        return kIOReturnNoMemory;
+    }
+    
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer->fd < 0)
+    {
+        fprintf(stderr, "Unable to open archive %s (%s)\n", path, strerror(errno));
+        FreeWriter(writer);
+        return kIOReturnNotOpen;
+    }
+    
+    clock_gettime(CLOCK_REALTIME, &now);
+    writer->header.magic       = PEAK_ARCHIVE_MAGIC;
+    writer->header.version     = PEAK_ARCHIVE_VERSION;
+    writer->header.headerSize  = sizeof(PeakArchiveHeader);
+    writer->header.chunkFrames = PEAK_ARCHIVE_CHUNK_FRAMES;
+    writer->header.bitrate     = bitrate;
+    writer->header.serial      = serial;
+    writer->header.deviceNo    = deviceNo;
+    writer->header.startNs     = (SInt64)now.tv_sec * 1000000000LL + now.tv_nsec;
+    
+    kr = WriteAll(writer->fd, &writer->header, sizeof(PeakArchiveHeader));
+    if (kr != kIOReturnSuccess)
+    {
+        FreeWriter(writer);
+        return kr;
+    }
+    writer->offset = sizeof(PeakArchiveHeader);
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakArchiveWriterFlush(PeakArchiveWriter* writer)
+{
+    PeakArchiveChunk chunk;
+    PeakArchiveEntry* entry;
+    UInt64 startNs = PeakMonotonicNs();
+    uLongf size = writer->packedCapacity;
+    IOReturn kr;
+    
+    if (writer->fd < 0)
+        return kIOReturnNotOpen;
+    if (writer->count == 0)
+        return kIOReturnSuccess;
+    
+    bzero(&chunk, sizeof(PeakArchiveChunk));
+    chunk.magic = PEAK_ARCHIVE_CHUNK_MAGIC;
+    chunk.frames = writer->count;
+    chunk.rawSize = EncodeChunk(writer, &chunk);
+    if (compress2(writer->packed, &size, writer->raw, chunk.rawSize, PEAK_ARCHIVE_LEVEL) != Z_OK)
+        return kIOReturnNoMemory;
+    chunk.size = (UInt32)size;
+    chunk.crc = (UInt32)crc32(0, writer->packed, chunk.size);
+    writer->stats.encodeNs += PeakMonotonicNs() - startNs;
+    
+    if (writer->chunkCount == writer->directoryCapacity)
+    {
+        entry = realloc(writer->directory, 2 * writer->directoryCapacity * sizeof(PeakArchiveEntry));
+        if (entry == NULL)
+            return kIOReturnNoMemory;
+        writer->directory = entry;
+        writer->directoryCapacity *= 2;
+    }
+    
+    kr = WriteAll(writer->fd, &chunk, sizeof(PeakArchiveChunk));
+    if (kr == kIOReturnSuccess)
+        kr = WriteAll(writer->fd, writer->packed, chunk.size);
+    if (kr != kIOReturnSuccess)
+        return kr;
+    
+    if (chunk.maxTs > writer->maxTs)
+        writer->maxTs = chunk.maxTs;
+    entry = &writer->directory[writer->chunkCount++];
+    entry->offset     = writer->offset;
+    entry->firstFrame = writer->stats.frames;
+    entry->minTs      = chunk.minTs;
+    entry->maxTs      = writer->maxTs;
+    
+    writer->offset += sizeof(PeakArchiveChunk) + chunk.size;
+    writer->stats.frames += writer->count;
+    writer->stats.chunks++;
+    writer->stats.rawBytes += writer->count * sizeof(PeakCaptureRecord);
+    writer->stats.columnBytes += chunk.rawSize;
+    writer->stats.bytes += sizeof(PeakArchiveChunk) + chunk.size;
+    writer->count = 0;
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakArchiveWriterAppend(PeakArchiveWriter* writer, const CanMsg* msgs, UInt32 count)
+{
+    UInt32 n;
+    IOReturn kr;
+    
+    if (writer->fd < 0)
+        return kIOReturnNotOpen;
+    
+    while (count > 0)
+    {
+        n = PEAK_ARCHIVE_CHUNK_FRAMES - writer->count;
+        if (n > count)
+            n = count;
+        memcpy(&writer->frames[writer->count], msgs, n * sizeof(CanMsg));
+        writer->count += n;
+        msgs += n;
+        count -= n;
+        
+        if (writer->count == PEAK_ARCHIVE_CHUNK_FRAMES)
+        {
+            kr = PeakArchiveWriterFlush(writer);
+            if (kr != kIOReturnSuccess)
+                return kr;
+        }
+    }
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakArchiveWriterClose(PeakArchiveWriter* writer)
+{
+    PeakArchiveTrailer trailer;
+    IOReturn kr;
+    
+    if (writer->fd < 0)
+        return kIOReturnNotOpen;
+    
+    // without the directory the file is still read by walking the chunks
+    kr = PeakArchiveWriterFlush(writer);
+    if (kr == kIOReturnSuccess)
+        kr = WriteAll(writer->fd, writer->directory, writer->chunkCount * sizeof(PeakArchiveEntry));
+    if (kr == kIOReturnSuccess)
+    {
+        trailer.directory = writer->offset;
+        trailer.chunkCount = writer->chunkCount;
+        trailer.magic = PEAK_ARCHIVE_DIR_MAGIC;
+        kr = WriteAll(writer->fd, &trailer, sizeof(PeakArchiveTrailer));
+    }
+    if (kr == kIOReturnSuccess && (fsync(writer->fd) != 0 || close(writer->fd) != 0))
+        kr = kIOReturnIOError;
+    else if (kr != kIOReturnSuccess)
+        close(writer->fd);
+    
+    writer->fd = -1;
+    FreeWriter(writer);
+    return kr;
+}
+
+#pragma mark - Reader
+
+static IOReturn ReadAt(int fd, void* buffer, size_t length, UInt64 offset)
+{
+    return pread(fd, buffer, length, (off_t)offset) == (ssize_t)length ? kIOReturnSuccess : kIOReturnIOError;
+}
+
+static IOReturn AddEntry(PeakArchiveReader* reader, UInt32* capacity, UInt64 offset, const PeakArchiveChunk* chunk)
+{
+    PeakArchiveEntry* entry;
+    UInt64 maxTs = reader->chunkCount ? reader->directory[reader->chunkCount - 1].maxTs : 0;
+    
+    if (reader->chunkCount == *capacity)
+    {
+        entry = realloc(reader->directory, 2 * *capacity * sizeof(PeakArchiveEntry));
+        if (entry == NULL)
+            return kIOReturnNoMemory;
+        reader->directory = entry;
+        *capacity *= 2;
+    }
+    
+    entry = &reader->directory[reader->chunkCount++];
+    entry->offset     = offset;
+    entry->firstFrame = reader->frameCount;
+    entry->minTs      = chunk->minTs;
+    entry->maxTs      = chunk->maxTs > maxTs ? chunk->maxTs : maxTs;
+    reader->frameCount += chunk->frames;
+    return kIOReturnSuccess;
+}
+
+// Rebuilds the directory of an archive that was not closed, up to the last complete chunk.
+static IOReturn Recover(PeakArchiveReader* reader, UInt64 fileSize)
+{
+    UInt64 offset = reader->header.headerSize;
+    UInt32 capacity = 64;
+    PeakArchiveChunk chunk;
+    IOReturn kr;
+    
+    reader->directory = malloc(capacity * sizeof(PeakArchiveEntry));
+    if (reader->directory == NULL)
+        return kIOReturnNoMemory;
+    
+    while (offset + sizeof(PeakArchiveChunk) <= fileSize)
+    {
+        if (ReadAt(reader->fd, &chunk, sizeof(PeakArchiveChunk), offset) != kIOReturnSuccess ||
+            chunk.magic != PEAK_ARCHIVE_CHUNK_MAGIC || chunk.frames > reader->header.chunkFrames ||
+            chunk.size > reader->packedCapacity ||
+            offset + sizeof(PeakArchiveChunk) + chunk.size > fileSize ||
+            ReadAt(reader->fd, reader->packed, chunk.size, offset + sizeof(PeakArchiveChunk)) != kIOReturnSuccess ||
+            crc32(0, reader->packed, chunk.size) != chunk.crc)
+            break;
+        
+        kr = AddEntry(reader, &capacity, offset, &chunk);
+        if (kr != kIOReturnSuccess)
+            return kr;
+        offset += sizeof(PeakArchiveChunk) + chunk.size;
+    }
+    
+    reader->recovered = 1;
+    return kIOReturnSuccess;
+}
+
+static IOReturn ReadDirectory(PeakArchiveReader* reader, UInt64 fileSize)
+{
+    PeakArchiveTrailer trailer;
+    UInt64 size;
+    UInt32 i;
+    
+    if (fileSize < reader->header.headerSize + sizeof(PeakArchiveTrailer) ||
+        ReadAt(reader->fd, &trailer, sizeof(PeakArchiveTrailer), fileSize - sizeof(PeakArchiveTrailer)) != kIOReturnSuccess ||
+        trailer.magic != PEAK_ARCHIVE_DIR_MAGIC)
+        return kIOReturnNotOpen;
+    
+    size = (UInt64)trailer.chunkCount * sizeof(PeakArchiveEntry);
+    if (trailer.directory + size + sizeof(PeakArchiveTrailer) != fileSize)
+        return kIOReturnNotOpen;
+    
+    reader->directory = malloc(size ? size : 1);
+    if (reader->directory == NULL)
+        return kIOReturnNoMemory;
+    if (ReadAt(reader->fd, reader->directory, size, trailer.directory) != kIOReturnSuccess)
+        return kIOReturnIOError;
+    
+    reader->chunkCount = trailer.chunkCount;
+    for (i = 1; i < reader->chunkCount; i++)
+    {
+        if (reader->directory[i].offset <= reader->directory[i - 1].offset ||
+            reader->directory[i].firstFrame <= reader->directory[i - 1].firstFrame)
+            return kIOReturnIOError;
+    }
+    
+    // the frames of the last chunk are in its header
+    if (reader->chunkCount > 0)
+    {
+        PeakArchiveChunk chunk;
+        const PeakArchiveEntry* last = &reader->directory[reader->chunkCount - 1];
+        
+        if (ReadAt(reader->fd, &chunk, sizeof(PeakArchiveChunk), last->offset) != kIOReturnSuccess ||
+            chunk.magic != PEAK_ARCHIVE_CHUNK_MAGIC)
+            return kIOReturnIOError;
+        reader->frameCount = last->firstFrame + chunk.frames;
+    }
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakArchiveOpen(PeakArchiveReader* reader, const char* path)
+{
+    struct stat st;
+    IOReturn kr;
+    
+    bzero(reader, sizeof(PeakArchiveReader));
+    reader->fd = open(path, O_RDONLY);
+    if (reader->fd < 0)
+    {
+        fprintf(stderr, "Unable to open archive %s (%s)\n", path, strerror(errno));
+        return kIOReturnNotOpen;
+    }
+    
+    kr = ReadAt(reader->fd, &reader->header, sizeof(PeakArchiveHeader), 0);
+    if (kr == kIOReturnSuccess && reader->header.magic != PEAK_ARCHIVE_MAGIC)
+        kr = kIOReturnBadArgument;
+    // later versions may only grow the header
+    if (kr == kIOReturnSuccess && (reader->header.version < 1 || reader->header.headerSize < sizeof(PeakArchiveHeader) ||
+                                   reader->header.chunkFrames == 0 || reader->header.chunkFrames > 0x10000))
+        kr = kIOReturnUnsupported;
+    if (kr == kIOReturnSuccess && fstat(reader->fd, &st) != 0)
+        kr = kIOReturnIOError;
+    
+    if (kr == kIOReturnSuccess)
+    {
+        reader->rawCapacity = reader->header.chunkFrames * FRAME_BYTES_MAX + 16;
+        reader->packedCapacity = (UInt32)compressBound(reader->rawCapacity);
+        reader->raw = malloc(reader->rawCapacity);
+        reader->packed = malloc(reader->packedCapacity);
+        reader->keys = malloc(reader->header.chunkFrames * sizeof(UInt32));
+        reader->last = malloc(reader->header.chunkFrames * sizeof(UInt64));
+        if (!reader->raw || !reader->packed || !reader->keys || !reader->last)
+            kr = kIOReturnNoMemory;
+    }
+    
+    if (kr == kIOReturnSuccess)
+    {
+        kr = ReadDirectory(reader, (UInt64)st.st_size);
+        if (kr == kIOReturnNotOpen)
+        {
+            free(reader->directory);
+            reader->directory = NULL;
+            reader->chunkCount = 0;
+            reader->frameCount = 0;
+            kr = Recover(reader, (UInt64)st.st_size);
+        }
+    }
+    
+    if (kr != kIOReturnSuccess)
+        PeakArchiveClose(reader);
+    return kr;
+}
+
+void PeakArchiveClose(PeakArchiveReader* reader)
+{
+    if (reader->fd >= 0)
+        close(reader->fd);
+    free(reader->directory);
+    free(reader->raw);
+    free(reader->packed);
+    free(reader->keys);
+    free(reader->last);
+    bzero(reader, sizeof(PeakArchiveReader));
+    reader->fd = -1;
+}
+
+IOReturn PeakArchiveReadChunk(PeakArchiveReader* reader, UInt32 index, CanMsg* msgs, UInt32* count)
+{
+    PeakArchiveChunk chunk;
+    uLongf size;
+    UInt64 offset;
+    
+    *count = 0;
+    if (reader->fd < 0)
+        return kIOReturnNotOpen;
+    if (index >= reader->chunkCount)
+        return kIOReturnBadArgument;
+    
+    offset = reader->directory[index].offset;
+    if (ReadAt(reader->fd, &chunk, sizeof(PeakArchiveChunk), offset) != kIOReturnSuccess ||
+        chunk.magic != PEAK_ARCHIVE_CHUNK_MAGIC || chunk.frames == 0 || chunk.frames > reader->header.chunkFrames ||
+        chunk.size > reader->packedCapacity || chunk.rawSize > reader->rawCapacity)
+        return kIOReturnIOError;
+    
+    if (ReadAt(reader->fd, reader->packed, chunk.size, offset + sizeof(PeakArchiveChunk)) != kIOReturnSuccess ||
+        crc32(0, reader->packed, chunk.size) != chunk.crc)
+        return kIOReturnIOError;
+    
+    size = reader->rawCapacity;
+    if (uncompress(reader->raw, &size, reader->packed, chunk.size) != Z_OK || size != chunk.rawSize)
+        return kIOReturnIOError;
+    
+    if (DecodeChunk(reader, &chunk, msgs) != kIOReturnSuccess)
+        return kIOReturnIOError;
+    *count = chunk.frames;
+    return kIOReturnSuccess;
+}
+
+UInt32 PeakArchiveSeekTime(const PeakArchiveReader* reader, UInt64 ns)
+{
+    UInt32 lo = 0, hi = reader->chunkCount;
+    
+    // maxTs never decreases, the first chunk reaching ns
+    while (lo < hi)
+    {
+        UInt32 mid = lo + (hi - lo) / 2;
+        if (reader->directory[mid].maxTs < ns)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+#pragma mark - Conversion
+
+IOReturn PeakArchiveFromCapture(const char* capturePath, const char* archivePath)
+{
+    PeakCaptureHeader header;
+    PeakArchiveWriter writer;
+    UInt8* records = NULL;
+    CanMsg* msgs = NULL;
+    UInt64 offset;
+    ssize_t n;
+    UInt32 i, count;
+    IOReturn kr;
+    int fd;
+    
+    fd = open(capturePath, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Unable to open capture %s (%s)\n", capturePath, strerror(errno));
+        return kIOReturnNotOpen;
+    }
+    
+    kr = PeakCaptureReadHeader(fd, &header);
+    if (kr == kIOReturnSuccess)
+        kr = PeakArchiveWriterOpen(&writer, archivePath, header.bitrate, header.serial, header.deviceNo);
+    if (kr != kIOReturnSuccess)
+    {
+        close(fd);
+        return kr;
+    }
+    
+    // the archive starts when the capture did
+    writer.header.startNs = header.startNs;
+    if (pwrite(writer.fd, &writer.header, sizeof(PeakArchiveHeader), 0) != sizeof(PeakArchiveHeader))
+        kr = kIOReturnIOError;
+    
+    records = malloc((size_t)PEAK_CAPTURE_MERGE_FRAMES * header.recordSize);
+    msgs = malloc(PEAK_CAPTURE_MERGE_FRAMES * sizeof(CanMsg));
+    if (records == NULL || msgs == NULL)
+        kr = kIOReturnNoMemory;
+    
+    // a partial record at the end is what an interrupted capture leaves, it is not archived
+    for (offset = header.headerSize; kr == kIOReturnSuccess; offset += (UInt64)count * header.recordSize)
+    {
+        n = pread(fd, records, (size_t)PEAK_CAPTURE_MERGE_FRAMES * header.recordSize, (off_t)offset);
+        if (n < 0)
+            kr = kIOReturnIOError;
+        count = n > 0 ? (UInt32)(n / header.recordSize) : 0;
+        if (count == 0)
+            break;
+        
+        for (i = 0; i < count; i++)
+            PeakCaptureRecordToMsg((const PeakCaptureRecord*)(records + (size_t)i * header.recordSize), &msgs[i]);
+        kr = PeakArchiveWriterAppend(&writer, msgs, count);
+    }
+    
+    if (kr == kIOReturnSuccess)
+        kr = PeakArchiveWriterClose(&writer);
+    else
+        PeakArchiveWriterClose(&writer);
+    
+    free(records);
+    free(msgs);
+    close(fd);
+    return kr;
+}
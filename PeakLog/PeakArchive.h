@@ -0,0 +1,163 @@
+/*
+    File:           PeakArchive.h
+
+    Description:    Compressed archive of captured frames in independently decodable chunks, with a
+                    chunk directory for random access.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakArchive_h
+#define PeakLog_PeakArchive_h
+
+#include "PeakUSB.h"
+
+// An archive "capture.peakarc" is meant for keeping captures for a long time. The frames are cut into
+// chunks of up to PEAK_ARCHIVE_CHUNK_FRAMES, each of which is decoded without the others:
+//
+//  PeakArchiveHeader
+//  PeakArchiveChunk + size bytes deflated      for every chunk
+//  PeakArchiveEntry    directory[chunkCount]
+//  PeakArchiveTrailer
+//
+// Inflated, a chunk holds its frames column by column, all integers as LEB128 varints:
+//
+//  keyCount, keys[keyCount]        the distinct PEAK_INDEX_KEYs of the chunk
+//  key index of every frame        a byte each with up to 256 keys, else two (little endian)
+//  timestamp of every frame        zigzag coded difference to the frame before, the first to firstTs
+//  dlc | flags << 4 of every frame PEAK_CAPTURE_ flags
+//  channel of every frame          only if the chunk has PEAK_ARCHIVE_CHANNELS set
+//  payload of every frame          dlc bytes XORed with the last payload of the same key, none for RTR
+//
+// A file that was not closed properly has no directory; it is found again by walking the chunks, up to
+// the last complete one.
+#define PEAK_ARCHIVE_MAGIC          0x52414b50  // "PKAR" on disk
+#define PEAK_ARCHIVE_CHUNK_MAGIC    0x4b434b50  // "PKCK"
+#define PEAK_ARCHIVE_DIR_MAGIC      0x52444b50  // "PKDR"
+#define PEAK_ARCHIVE_VERSION        1
+#define PEAK_ARCHIVE_SUFFIX         ".peakarc"
+
+#define PEAK_ARCHIVE_CHUNK_FRAMES   65536
+#define PEAK_ARCHIVE_LEVEL          6           // deflate level
+#define PEAK_ARCHIVE_FLUSH_NS       10000000000ULL // a capture closes a partial chunk after 10 s
+
+#define PEAK_ARCHIVE_CHANNELS       0x01        // chunk flags: the channel column is present
+
+typedef struct {
+    UInt32  magic;
+    UInt16  version;
+    UInt16  headerSize;     // sizeof(PeakArchiveHeader) for version 1, the first chunk starts here
+    UInt32  chunkFrames;    // most frames in a chunk
+    UInt16  bitrate;        // BTR0/BTR1 code as in CAN_BAUD_RATES
+    UInt16  reserved0;
+    UInt32  serial;         // adapter serial number, 0 if unknown
+    UInt32  deviceNo;
+    SInt64  startNs;        // wall clock at the start of the capture, ns since 1970
+    UInt8   reserved[32];
+} __attribute__ ((packed)) PeakArchiveHeader;
+
+typedef struct {
+    UInt32  magic;
+    UInt32  frames;
+    UInt32  rawSize;        // inflated
+    UInt32  size;           // deflated, follows the chunk header
+    UInt32  crc;            // CRC-32 of the deflated bytes
+    UInt32  flags;          // PEAK_ARCHIVE_...
+    UInt64  firstTs;        // of the first frame
+    UInt64  minTs;
+    UInt64  maxTs;
+} __attribute__ ((packed)) PeakArchiveChunk;
+
+typedef struct {
+    UInt64  offset;         // of the PeakArchiveChunk
+    UInt64  firstFrame;     // frames in the chunks before
+    UInt64  minTs;          // smallest timestamp in the chunk
+    UInt64  maxTs;          // largest timestamp up to the end of the chunk, never decreases
+} __attribute__ ((packed)) PeakArchiveEntry;
+
+typedef struct {
+    UInt64  directory;      // offset of the directory
+    UInt32  chunkCount;
+    UInt32  magic;          // PEAK_ARCHIVE_DIR_MAGIC, last in the file
+} __attribute__ ((packed)) PeakArchiveTrailer;
+
+typedef struct {
+    UInt64  frames;
+    UInt64  chunks;
+    UInt64  rawBytes;       // what the frames take as capture records
+    UInt64  columnBytes;    // chunks before deflating
+    UInt64  bytes;          // written to the file
+    UInt64  encodeNs;       // spent in column coding and deflating
+} PeakArchiveStats;
+
+// Collects frames until a chunk is full, then codes and writes it. The buffers are allocated once in
+// PeakArchiveWriterOpen.
+typedef struct PeakArchiveWriter {
+    int                 fd;
+    UInt64              offset;
+    PeakArchiveHeader   header;
+    CanMsg*             frames;         // of the open chunk
+    UInt32              count;
+    UInt8*              raw;            // the columns
+    UInt8*              packed;         // deflated
+    UInt32              rawCapacity;
+    UInt32              packedCapacity;
+    UInt32*             slots;          // key + 1 to key index, open addressing
+    UInt32*             keys;           // of the chunk, in order of appearance
+    UInt16*             indices;        // key index of every frame
+    UInt64*             last;           // payload by key index
+    PeakArchiveEntry*   directory;
+    UInt32              chunkCount;
+    UInt32              directoryCapacity;
+    UInt64              maxTs;
+    PeakArchiveStats    stats;
+} PeakArchiveWriter;
+
+typedef struct {
+    int                 fd;
+    PeakArchiveHeader   header;
+    PeakArchiveEntry*   directory;
+    UInt32              chunkCount;
+    UInt64              frameCount;
+    int                 recovered;      // the directory was rebuilt by walking the chunks
+    UInt8*              raw;
+    UInt8*              packed;
+    UInt32              rawCapacity;
+    UInt32              packedCapacity;
+    UInt32*             keys;
+    UInt64*             last;
+} PeakArchiveReader;
+
+IOReturn PeakArchiveWriterOpen(PeakArchiveWriter* writer, const char* path, UInt16 bitrate, UInt32 serial, UInt32 deviceNo);
+IOReturn PeakArchiveWriterAppend(PeakArchiveWriter* writer, const CanMsg* msgs, UInt32 count);
+// Writes the open chunk even if it is not full.
+IOReturn PeakArchiveWriterFlush(PeakArchiveWriter* writer);
+// Flushes, writes the directory and closes the file.
+IOReturn PeakArchiveWriterClose(PeakArchiveWriter* writer);
+
+IOReturn PeakArchiveOpen(PeakArchiveReader* reader, const char* path);
+void PeakArchiveClose(PeakArchiveReader* reader);
+
+// The frames of a chunk into msgs, which has room for header.chunkFrames.
+IOReturn PeakArchiveReadChunk(PeakArchiveReader* reader, UInt32 chunk, CanMsg* msgs, UInt32* count);
+// First chunk that may hold a timestamp at or after ns, chunkCount if there is none.
+UInt32 PeakArchiveSeekTime(const PeakArchiveReader* reader, UInt64 ns);
+
+// Archives a capture file (see PeakCapture.h).
+IOReturn PeakArchiveFromCapture(const char* capturePath, const char* archivePath);
+
+#endif
@@ -0,0 +1,107 @@
+/*
+    File:           PeakBatch.c
+
+    Description:    Coalesces received frames into batches for the consumer, flushed once per bulk
+                    read completion or on the display tick, whichever comes first.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "PeakBatch.h"
+
+UInt64 PeakMonotonicNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (UInt64)now.tv_sec * 1000000000ULL + (UInt64)now.tv_nsec;
+}
+
+#pragma mark - Setup
+
+void PeakBatcherInit(PeakBatcher* batcher, PeakMerge* merge, PeakBatchFlushFunc flush, void* refCon)
+{
+    bzero(batcher, sizeof(PeakBatcher));
+    batcher->merge = merge;
+    batcher->flush = flush;
+    batcher->refCon = refCon;
+    batcher->tickNs = PEAK_BATCH_DEFAULT_TICK_NS;
+    PeakHistogramReset(&batcher->dequeue);
+}
+
+void PeakBatcherSetTick(PeakBatcher* batcher, UInt64 tickNs)
+{
+    __atomic_store_n(&batcher->tickNs, tickNs, __ATOMIC_RELAXED);
+}
+
+#pragma mark - Producer
+
+void PeakBatcherCompletion(PeakBatcher* batcher, UInt64 nowNs)
+{
+    UInt64 last = __atomic_load_n(&batcher->lastFlushNs, __ATOMIC_RELAXED);
+    UInt64 tick = __atomic_load_n(&batcher->tickNs, __ATOMIC_RELAXED);
+    UInt32 idle = 0;
+
+    if (PeakMergeFill(batcher->merge) == 0)
+        return;
+
+    // within the tick the consumer timer will come by anyway
+    if (last && nowNs - last < tick)
+    {
+        __atomic_add_fetch(&batcher->coalesced, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (!__atomic_compare_exchange_n(&batcher->scheduled, &idle, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    {
+        __atomic_add_fetch(&batcher->coalesced, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    __atomic_add_fetch(&batcher->requests, 1, __ATOMIC_RELAXED);
+    batcher->flush(batcher->refCon);
+}
+
+#pragma mark - Consumer
+
+UInt32 PeakBatcherDrain(PeakBatcher* batcher, CanMsg* batch, UInt32 max, UInt64 nowNs)
+{
+    UInt32 i, count;
+
+    // clear first, a completion racing with the drain then schedules another flush instead of being lost
+    __atomic_store_n(&batcher->scheduled, 0, __ATOMIC_RELEASE);
+
+    count = PeakMergeDrain(batcher->merge, batch, max, nowNs);
+
+    if (count)
+    {
+        __atomic_store_n(&batcher->lastFlushNs, nowNs, __ATOMIC_RELAXED);
+        batcher->batches++;
+        batcher->frames += count;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        UInt64 completed = batch[i].mono + batch[i].delay;
+        if (nowNs > completed)
+            PeakHistogramRecord(&batcher->dequeue, nowNs - completed);
+    }
+
+    return count;
+}
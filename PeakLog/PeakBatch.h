@@ -0,0 +1,67 @@
+/*
+    File:           PeakBatch.h
+
+    Description:    Coalesces received frames into batches for the consumer, flushed once per bulk
+                    read completion or on the display tick, whichever comes first.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakBatch_h
+#define PeakLog_PeakBatch_h
+
+#include "PeakMerge.h"
+#include "PeakHistogram.h"
+
+// default display tick, 30 Hz
+#define PEAK_BATCH_DEFAULT_TICK_NS  (1000000000ULL / 30)
+
+// maximum number of frames handed to the consumer at once
+#define PEAK_BATCH_MAX_FRAMES       4096
+
+typedef void (*PeakBatchFlushFunc)(void* refCon);
+
+// The producers, one per adapter, call PeakBatcherCompletion after every bulk read. That asks the consumer for a flush, but
+// only if no flush is outstanding and the last one is at least one tick ago, so a busy bus causes at most
+// one wakeup per tick. Whatever is left is picked up by the consumer's own tick timer calling
+// PeakBatcherDrain, so frames never wait longer than one tick.
+typedef struct {
+    PeakMerge*          merge;          // the adapters' rings
+    PeakBatchFlushFunc  flush;          // wakes up the consumer, called on the producer thread
+    void*               refCon;
+    UInt64              tickNs;         // minimum spacing of producer triggered flushes, 0 = every completion
+    UInt64              lastFlushNs;    // written by the consumer
+    UInt32              scheduled;      // a flush has been requested and not drained yet
+    UInt64              requests;       // flushes requested by the producer
+    UInt64              coalesced;      // completions folded into an outstanding or recent flush
+    UInt64              batches;        // non-empty drains
+    UInt64              frames;         // frames handed to the consumer
+    PeakHistogram       dequeue;        // USB completion to the drain, written by the consumer
+} PeakBatcher;
+
+UInt64 PeakMonotonicNs(void);
+
+void PeakBatcherInit(PeakBatcher* batcher, PeakMerge* merge, PeakBatchFlushFunc flush, void* refCon);
+void PeakBatcherSetTick(PeakBatcher* batcher, UInt64 tickNs);
+
+// producer side
+void PeakBatcherCompletion(PeakBatcher* batcher, UInt64 nowNs);
+
+// consumer side, copies up to max frames out of the rings in time order and returns their number
+UInt32 PeakBatcherDrain(PeakBatcher* batcher, CanMsg* batch, UInt32 max, UInt64 nowNs);
+
+#endif
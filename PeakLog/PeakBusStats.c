@@ -0,0 +1,224 @@
+/*
+    File:           PeakBusStats.c
+
+    Description:    Per identifier rate, period and jitter and the bus load of one channel, updated in
+                    constant time per frame.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "PeakBusStats.h"
+
+#define EXT_KEY     0x80000000
+
+#pragma mark - Wire format
+
+UInt32 PeakBusStatsBitsPerSecond(UInt16 bitrate)
+{
+    static const UInt32 bitsPerSecond[9] = {
+        1000000, 500000, 250000, 125000, 100000, 50000, 20000, 10000, 5000
+    };
+    UInt32 i;
+    
+    for (i = 0; i < 9; i++)
+    {
+        if (CAN_BAUD_RATES[i] == bitrate)
+            return bitsPerSecond[i];
+    }
+    return 0;
+}
+
+UInt32 PeakBusStatsFrameBits(const CanMsg* msg)
+{
+    // remote frames carry the DLC but no data
+    UInt32 data = msg->rtr ? 0 : 8 * msg->len;
+    // SOF, identifier, RTR/SRR, IDE, reserved bits and DLC, then the data and the CRC are stuffed
+    UInt32 stuffed = (msg->ext ? 39 : 19) + data + 15;
+    
+    // at worst every fourth bit after the first five, plus CRC delimiter, ACK, EOF and interframe space
+    return stuffed + (stuffed - 1) / 4 + 13;
+}
+
+#pragma mark - Tables
+
+IOReturn PeakBusStatsCreate(PeakBusStats** stats)
+{
+    // no bitrate until one is set, PeakBusStatsReset keeps it
+    *stats = calloc(1, sizeof(PeakBusStats));
+    if (*stats == NULL)
+        return kIOReturnNoMemory;
+    
+    return kIOReturnSuccess;
+}
+
+void PeakBusStatsFree(PeakBusStats* stats)
+{
+    free(stats);
+}
+
+void PeakBusStatsReset(PeakBusStats* stats)
+{
+    UInt32 bitsPerSecond = stats->bitsPerSecond;
+    
+    bzero(stats, sizeof(PeakBusStats));
+    stats->bitsPerSecond = bitsPerSecond;
+}
+
+void PeakBusStatsSetBitrate(PeakBusStats* stats, UInt16 bitrate)
+{
+    stats->bitsPerSecond = PeakBusStatsBitsPerSecond(bitrate);
+}
+
+static PeakBusEntry* Lookup(PeakBusStats* stats, const CanMsg* msg)
+{
+    UInt32 key, slot;
+    
+    if (!msg->ext)
+        return &stats->std[msg->canid.ul & (PEAK_BUS_STD_IDS - 1)];
+    
+    key = (msg->canid.ul & 0x1fffffff) | EXT_KEY;
+    slot = (key * 2654435761u) & (PEAK_BUS_EXT_SLOTS - 1);
+    
+    // a slot is in use once it has seen a frame
+    while (stats->ext[slot].frames != 0 && stats->ext[slot].key != key)
+        slot = (slot + 1) & (PEAK_BUS_EXT_SLOTS - 1);
+    
+    if (stats->ext[slot].frames == 0)
+    {
+        if (stats->extCount == PEAK_BUS_EXT_MAX)
+            return NULL;
+        stats->extCount++;
+    }
+    
+    stats->ext[slot].key = key;
+    return &stats->ext[slot];
+}
+
+#pragma mark - Update
+
+void PeakBusStatsUpdate(PeakBusStats* stats, const CanMsg* msg)
+{
+    PeakBusEntry* entry = Lookup(stats, msg);
+    UInt32 bits = PeakBusStatsFrameBits(msg);
+    UInt64 period;
+    double delta, n;
+    
+    stats->frames++;
+    stats->bits += bits;
+    
+    if (stats->windowStartNs == 0)
+        stats->windowStartNs = stats->prevStartNs = msg->mono;
+    else if (msg->mono > stats->windowStartNs && msg->mono - stats->windowStartNs >= 1000000000ULL)
+    {
+        stats->prevStartNs = stats->windowStartNs;
+        stats->prevBits = stats->windowBits;
+        stats->windowStartNs = msg->mono;
+        stats->windowBits = 0;
+    }
+    stats->windowBits += bits;
+    
+    if (entry == NULL)
+    {
+        stats->untracked++;
+        return;
+    }
+    
+    entry->len = msg->len;
+    if (entry->frames == 0)
+    {
+        entry->key = msg->ext ? entry->key : msg->canid.ul & (PEAK_BUS_STD_IDS - 1);
+        entry->lastNs = msg->mono;
+        entry->minPeriodNs = ~0ULL;
+        // published after the entry is set up
+        stats->active[stats->activeCount] = entry;
+        __atomic_store_n(&entry->frames, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&stats->activeCount, stats->activeCount + 1, __ATOMIC_RELEASE);
+        return;
+    }
+    
+    // frames of the same buffer can share a timestamp, the adapter clock never runs backwards
+    period = msg->mono > entry->lastNs ? msg->mono - entry->lastNs : 0;
+    entry->lastNs = msg->mono;
+    entry->frames++;
+    
+    if (period < entry->minPeriodNs)
+        entry->minPeriodNs = period;
+    if (period > entry->maxPeriodNs)
+        entry->maxPeriodNs = period;
+    
+    n = (double)(entry->frames - 1);
+    delta = period - entry->mean;
+    entry->mean += delta / n;
+    entry->m2 += delta * (period - entry->mean);
+    
+    if (entry->frames == 2)
+        entry->recent = period;
+    else
+        entry->recent += (period - entry->recent) / (1 << PEAK_BUS_RECENT_SHIFT);
+}
+
+#pragma mark - Snapshots
+
+void PeakBusStatsGetLoad(const PeakBusStats* stats, UInt64 nowNs, PeakBusLoad* load)
+{
+    UInt64 startNs = stats->prevStartNs, bits = stats->prevBits + stats->windowBits;
+    
+    bzero(load, sizeof(PeakBusLoad));
+    load->bitsPerSecond = stats->bitsPerSecond;
+    load->ids           = __atomic_load_n(&stats->activeCount, __ATOMIC_ACQUIRE);
+    load->untracked     = stats->untracked;
+    load->frames        = stats->frames;
+    load->bits          = stats->bits;
+    
+    // a quiet bus lets the load fall off, the span reaches back to the start of the previous window
+    if (stats->bitsPerSecond && startNs && nowNs > startNs)
+        load->load = 100.0 * bits * 1e9 / ((double)stats->bitsPerSecond * (nowNs - startNs));
+}
+
+UInt32 PeakBusStatsGetIds(const PeakBusStats* stats, UInt64 nowNs, PeakIdStats* ids, UInt32 max)
+{
+    UInt32 i, count = __atomic_load_n(&stats->activeCount, __ATOMIC_ACQUIRE);
+    
+    for (i = 0; i < count && i < max; i++)
+    {
+        const PeakBusEntry* entry = stats->active[i];
+        PeakIdStats* id = &ids[i];
+        UInt64 frames = entry->frames, quiet;
+        double period = entry->recent;
+        
+        id->canid        = entry->key & ~EXT_KEY;
+        id->ext          = (entry->key & EXT_KEY) != 0;
+        id->len          = entry->len;
+        id->frames       = frames;
+        id->minPeriodNs  = frames > 1 ? entry->minPeriodNs : 0;
+        id->maxPeriodNs  = entry->maxPeriodNs;
+        id->meanPeriodNs = entry->mean;
+        id->jitterNs     = frames > 2 ? sqrt(entry->m2 / (frames - 2)) : 0.0;
+        
+        // an identifier gone quiet has its rate drop with the time since its last frame
+        quiet = nowNs > entry->lastNs ? nowNs - entry->lastNs : 0;
+        if (quiet > period)
+            period = quiet;
+        id->rate = frames > 1 && period > 0 ? 1e9 / period : 0.0;
+    }
+    
+    return count;
+}
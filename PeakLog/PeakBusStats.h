@@ -0,0 +1,79 @@
+/*
+    File:           PeakBusStats.h
+
+    Description:    Per identifier rate, period and jitter and the bus load of one channel, updated in
+                    constant time per frame.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakBusStats_h
+#define PeakLog_PeakBusStats_h
+
+#include "PeakUSB.h"
+
+#define PEAK_BUS_STD_IDS            2048    // 11 bit identifiers, indexed directly
+#define PEAK_BUS_EXT_SLOTS          4096    // 29 bit identifiers, open addressing, power of two
+#define PEAK_BUS_EXT_MAX            (PEAK_BUS_EXT_SLOTS / 4 * 3)    // filled no further than that
+#define PEAK_BUS_RECENT_SHIFT       4       // the recent period follows over about 16 frames
+
+typedef struct {
+    UInt32  key;            // identifier, the ext ones with the top bit set
+    UInt8   len;
+    UInt64  frames;
+    UInt64  lastNs;
+    UInt64  minPeriodNs;
+    UInt64  maxPeriodNs;
+    double  mean;           // Welford's running mean and sum of squared deviations of the period
+    double  m2;
+    double  recent;         // exponentially weighted period
+} PeakBusEntry;
+
+// One writer, the decoder of the channel; snapshots may be taken from any thread while it runs and see
+// each entry as of some frame or one in between. Entries are never moved, the table does not grow.
+typedef struct {
+    PeakBusEntry    std[PEAK_BUS_STD_IDS];
+    PeakBusEntry    ext[PEAK_BUS_EXT_SLOTS];
+    PeakBusEntry*   active[PEAK_BUS_STD_IDS + PEAK_BUS_EXT_MAX];   // in order of appearance
+    UInt32          activeCount;
+    UInt32          extCount;
+    UInt32          bitsPerSecond;
+    UInt64          frames;
+    UInt64          bits;
+    UInt64          untracked;
+    UInt64          windowStartNs;  // the load is summed up in windows of a second
+    UInt64          windowBits;
+    UInt64          prevStartNs;
+    UInt64          prevBits;
+} PeakBusStats;
+
+IOReturn PeakBusStatsCreate(PeakBusStats** stats);
+void PeakBusStatsFree(PeakBusStats* stats);
+void PeakBusStatsReset(PeakBusStats* stats);
+// bitrate is one of the CAN_BAUD_ codes
+void PeakBusStatsSetBitrate(PeakBusStats* stats, UInt16 bitrate);
+UInt32 PeakBusStatsBitsPerSecond(UInt16 bitrate);
+
+// Bits a frame takes on the wire at most: stuff bits over SOF to CRC, delimiters, ACK, EOF and IFS.
+UInt32 PeakBusStatsFrameBits(const CanMsg* msg);
+void PeakBusStatsUpdate(PeakBusStats* stats, const CanMsg* msg);
+
+// Snapshots, the load and rates as of nowNs on the PeakMonotonicNs clock.
+void PeakBusStatsGetLoad(const PeakBusStats* stats, UInt64 nowNs, PeakBusLoad* load);
+UInt32 PeakBusStatsGetIds(const PeakBusStats* stats, UInt64 nowNs, PeakIdStats* ids, UInt32 max);
+
+#endif
@@ -0,0 +1,972 @@
+/*
+    File:           PeakCanopen.c
+
+    Description:    Streaming CANopen decoder describing NMT, SYNC, TIME, EMCY, heartbeat, node
+                    guarding, LSS, SDO and mapped PDO frames for the log window.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PeakCanopen.h"
+
+// SDO transfer states
+#define SDO_IDLE                    0
+#define SDO_DOWNLOAD                1       // segmented, the client sends
+#define SDO_UPLOAD                  2       // segmented, the server sends
+#define SDO_BLOCK_DOWNLOAD          3       // between the sub-blocks of a block download
+#define SDO_BLOCK_DOWNLOAD_SEGMENTS 4       // the client sends a sub-block
+#define SDO_BLOCK_UPLOAD            5
+#define SDO_BLOCK_UPLOAD_SEGMENTS   6       // the server sends a sub-block
+
+static const char* kServiceNames[] = {
+    "", "NMT", "SYNC", "EMCY", "TIME", "TPDO1", "RPDO1", "TPDO2", "RPDO2", "TPDO3", "RPDO3", "TPDO4", "RPDO4",
+    "SDO", "SDO", "Heartbeat", "LSS slave", "LSS master"
+};
+
+// the filter panel's message types, NMT takes SYNC along as it always did
+static const UInt16 kTypeRanges[6][2] = {
+    { 0x000, 0x080 }, { 0x081, 0x0FF }, { 0x181, 0x57F }, { 0x581, 0x67F }, { 0x701, 0x77F }, { 0x7E4, 0x7E5 }
+};
+
+static const struct {
+    UInt32      code;
+    const char* text;
+} kAbortCodes[] = {
+    { 0x05030000, "toggle bit not alternated" },
+    { 0x05040000, "SDO protocol timed out" },
+    { 0x05040001, "command specifier not valid" },
+    { 0x05040002, "invalid block size" },
+    { 0x05040003, "invalid sequence number" },
+    { 0x05040004, "CRC error" },
+    { 0x05040005, "out of memory" },
+    { 0x06010000, "unsupported access" },
+    { 0x06010001, "read of a write only object" },
+    { 0x06010002, "write of a read only object" },
+    { 0x06020000, "object does not exist" },
+    { 0x06040041, "object cannot be mapped" },
+    { 0x06040042, "PDO length exceeded" },
+    { 0x06040043, "parameter incompatibility" },
+    { 0x06040047, "internal incompatibility" },
+    { 0x06060000, "hardware error" },
+    { 0x06070010, "data type does not match" },
+    { 0x06070012, "data type length too high" },
+    { 0x06070013, "data type length too low" },
+    { 0x06090011, "subindex does not exist" },
+    { 0x06090030, "value range exceeded" },
+    { 0x06090031, "value too high" },
+    { 0x06090032, "value too low" },
+    { 0x06090036, "maximum less than minimum" },
+    { 0x060A0023, "resource not available" },
+    { 0x08000000, "general error" },
+    { 0x08000020, "data cannot be stored" },
+    { 0x08000021, "data cannot be stored, local control" },
+    { 0x08000022, "data cannot be stored, device state" },
+    { 0x08000023, "no object dictionary" },
+    { 0x08000024, "no data available" },
+};
+
+#pragma mark - Text
+
+// The description is put together in a line of PEAK_CANOPEN_DESCR_MAX, every piece is bounded.
+static inline char* PutString(char* ptr, const char* string)
+{
+    size_t n = strlen(string);
+    memcpy(ptr, string, n);
+    return ptr + n;
+}
+
+static inline char* PutDigits(char* ptr, UInt32 value, int digits)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    int i;
+    
+    for (i = digits - 1; i >= 0; i--)
+        *ptr++ = hex[(value >> (4 * i)) & 0xf];
+    return ptr;
+}
+
+static inline char* PutHex(char* ptr, UInt32 value, int digits)
+{
+    *ptr++ = '0';
+    *ptr++ = 'x';
+    return PutDigits(ptr, value, digits);
+}
+
+static inline char* PutDec(char* ptr, SInt64 value)
+{
+    char tmp[20];
+    char* pos = tmp + sizeof(tmp);
+    UInt64 u = value < 0 ? -(UInt64)value : (UInt64)value;
+    
+    do {
+        *--pos = '0' + (char)(u % 10);
+        u /= 10;
+    } while (u);
+    
+    if (value < 0)
+        *ptr++ = '-';
+    memcpy(ptr, pos, tmp + sizeof(tmp) - pos);
+    return ptr + (tmp + sizeof(tmp) - pos);
+}
+
+static inline char* PutObject(char* ptr, UInt16 index, UInt8 subindex)
+{
+    *ptr++ = ' ';
+    ptr = PutHex(ptr, index, 4);
+    *ptr++ = ':';
+    return PutDigits(ptr, subindex, 2);
+}
+
+static UInt32 Finish(const char* line, const char* end, char* buffer, UInt32 size)
+{
+    UInt32 length = (UInt32)(end - line);
+    
+    if (size == 0)
+        return 0;
+    if (length >= size)
+        length = size - 1;
+    memcpy(buffer, line, length);
+    buffer[length] = 0;
+    return length;
+}
+
+#pragma mark - Setup
+
+IOReturn PeakCanopenCreate(PeakCanopenDecoder** decoder)
+{
+    PeakCanopenDecoder* d = calloc(1, sizeof(PeakCanopenDecoder));
+    UInt32 id, node;
+    
+    if (d == NULL)
+        return kIOReturnNoMemory;
+    
+    // the predefined connection set, every COB-ID to its service and node
+    d->table[0x000] = PEAK_CANOPEN_NMT << 8;
+    d->table[0x080] = PEAK_CANOPEN_SYNC << 8;
+    d->table[0x100] = PEAK_CANOPEN_TIME << 8;
+    d->table[0x7E4] = PEAK_CANOPEN_LSS_SLAVE << 8;
+    d->table[0x7E5] = PEAK_CANOPEN_LSS_MASTER << 8;
+    for (node = 1; node < PEAK_CANOPEN_NODES; node++)
+    {
+        d->table[0x080 + node] = PEAK_CANOPEN_EMCY << 8 | node;
+        for (id = 0; id <= PEAK_CANOPEN_RPDO4 - PEAK_CANOPEN_TPDO1; id++)
+            d->table[0x180 + 0x80 * id + node] = (PEAK_CANOPEN_TPDO1 + id) << 8 | node;
+        d->table[0x580 + node] = PEAK_CANOPEN_SDO_TX << 8 | node;
+        d->table[0x600 + node] = PEAK_CANOPEN_SDO_RX << 8 | node;
+        d->table[0x700 + node] = PEAK_CANOPEN_HEARTBEAT << 8 | node;
+    }
+    
+    *decoder = d;
+    return kIOReturnSuccess;
+}
+
+void PeakCanopenFree(PeakCanopenDecoder* decoder)
+{
+    free(decoder);
+}
+
+void PeakCanopenReset(PeakCanopenDecoder* decoder)
+{
+    bzero(decoder->nodes, sizeof(decoder->nodes));
+}
+
+void PeakCanopenTypeRange(UInt32 type, UInt32* low, UInt32* high)
+{
+    if (type > PEAK_CANOPEN_TYPE_LSS)
+        type = PEAK_CANOPEN_TYPE_NMT;
+    *low = kTypeRanges[type][0];
+    *high = kTypeRanges[type][1];
+}
+
+#pragma mark - PDO mappings
+
+IOReturn PeakCanopenSetMapping(PeakCanopenDecoder* decoder, UInt16 cobid, const PeakCanopenField* fields, UInt32 count)
+{
+    PeakCanopenPdo* pdo;
+    UInt32 i, bits = 0, last;
+    
+    if (cobid >= PEAK_CANOPEN_IDS || count > PEAK_CANOPEN_PDO_FIELDS)
+        return kIOReturnBadArgument;
+    for (i = 0; i < count; i++)
+    {
+        bits = fields[i].offset + fields[i].bits;
+        if (fields[i].bits == 0 || fields[i].bits > 64 || bits > 64 || (fields[i].type == PEAK_CANOPEN_REAL && fields[i].bits != 32))
+            return kIOReturnBadArgument;
+    }
+    
+    if (count == 0)
+    {
+        // the last mapping takes the place of the removed one
+        if (decoder->pdoOf[cobid])
+        {
+            i = decoder->pdoOf[cobid] - 1;
+            last = --decoder->pdoCount;
+            decoder->pdos[i] = decoder->pdos[last];
+            decoder->pdoOf[decoder->pdos[i].cobid] = i + 1;
+            decoder->pdoOf[cobid] = 0;
+        }
+        return kIOReturnSuccess;
+    }
+    
+    if (decoder->pdoOf[cobid] == 0)
+    {
+        if (decoder->pdoCount == PEAK_CANOPEN_PDOS)
+            return kIOReturnNoResources;
+        decoder->pdoOf[cobid] = ++decoder->pdoCount;
+    }
+    
+    pdo = &decoder->pdos[decoder->pdoOf[cobid] - 1];
+    pdo->cobid = cobid;
+    pdo->count = count;
+    memcpy(pdo->fields, fields, count * sizeof(PeakCanopenField));
+    for (i = 0; i < count; i++)
+        pdo->fields[i].name[PEAK_CANOPEN_NAME - 1] = 0;
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakCanopenLoadMapping(PeakCanopenDecoder* decoder, const char* path)
+{
+    PeakCanopenField fields[PEAK_CANOPEN_PDO_FIELDS];
+    char line[1024], *token, *save, *end, *colon;
+    IOReturn kr = kIOReturnSuccess;
+    UInt32 count, offset, number = 0;
+    unsigned long cobid;
+    FILE* file = fopen(path, "r");
+    
+    if (file == NULL)
+    {
+        fprintf(stderr, "Unable to open PDO mapping %s.\n", path);
+        return kIOReturnNotOpen;
+    }
+    
+    while (kr == kIOReturnSuccess && fgets(line, sizeof(line), file))
+    {
+        number++;
+        if ((token = strchr(line, '#')) != NULL)
+            *token = 0;
+        if ((token = strtok_r(line, " \t\r\n", &save)) == NULL)
+            continue;
+        
+        cobid = strtoul(token, &end, 0);
+        count = offset = 0;
+        if (*end || cobid >= PEAK_CANOPEN_IDS)
+            kr = kIOReturnBadArgument;
+        
+        while (kr == kIOReturnSuccess && (token = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+        {
+            PeakCanopenField* field = &fields[count];
+            
+            colon = strchr(token, ':');
+            if (count == PEAK_CANOPEN_PDO_FIELDS || colon == NULL)
+            {
+                kr = kIOReturnBadArgument;
+                break;
+            }
+            
+            bzero(field, sizeof(PeakCanopenField));
+            *colon = 0;
+            strncpy(field->name, token, PEAK_CANOPEN_NAME - 1);
+            field->bits = (UInt8)strtoul(colon + 1, &end, 10);
+            field->offset = (UInt8)offset;
+            if (*end == ':')
+            {
+                if (end[1] == 's')
+                    field->type = PEAK_CANOPEN_SIGNED;
+                else if (end[1] == 'f')
+                    field->type = PEAK_CANOPEN_REAL;
+                else if (end[1] != 'u')
+                    kr = kIOReturnBadArgument;
+            }
+            else if (*end)
+            {
+                kr = kIOReturnBadArgument;
+            }
+            offset += field->bits;
+            count++;
+        }
+        
+        if (kr == kIOReturnSuccess)
+            kr = PeakCanopenSetMapping(decoder, (UInt16)cobid, fields, count);
+        if (kr != kIOReturnSuccess)
+            fprintf(stderr, "%s:%u: invalid PDO mapping.\n", path, (unsigned)number);
+    }
+    
+    fclose(file);
+    return kr;
+}
+
+#pragma mark - Streaming
+
+static UInt32 ObjectTag(const PeakCanopenNode* node, UInt32 flags)
+{
+    return (UInt32)node->index << 16 | (UInt32)node->subindex << 8 | PEAK_CANOPEN_TAG_SDO | flags;
+}
+
+static void StartTransfer(PeakCanopenNode* node, const CanMsg* msg, UInt8 state)
+{
+    node->index    = msg->data[1] | msg->data[2] << 8;
+    node->subindex = msg->data[3];
+    node->state    = state;
+    node->toggle   = 0;
+    node->seqno    = 0;
+    node->last     = 0;
+}
+
+// a segment of a sub-block, its first byte is the sequence number and the c bit
+static UInt32 BlockSegment(PeakCanopenNode* node, const CanMsg* msg, UInt8 waiting)
+{
+    UInt8 seqno = msg->data[0] & 0x7f;
+    UInt32 flags = PEAK_CANOPEN_TAG_BLOCK;
+    
+    if (seqno != node->seqno + 1)
+        flags |= PEAK_CANOPEN_TAG_ERROR;
+    node->seqno = seqno;
+    
+    if (msg->data[0] & 0x80)
+        node->last = 1;
+    if (node->last || seqno >= node->blksize)
+        node->state = waiting;
+    return ObjectTag(node, flags);
+}
+
+// client to server
+static UInt32 TrackClient(PeakCanopenNode* node, const CanMsg* msg)
+{
+    UInt8 cs = msg->data[0];
+    UInt32 flags = 0;
+    
+    if (node->state == SDO_BLOCK_DOWNLOAD_SEGMENTS)
+        return BlockSegment(node, msg, SDO_BLOCK_DOWNLOAD);
+    
+    switch (cs >> 5)
+    {
+        case 0: // download segment
+            if (node->state != SDO_DOWNLOAD || ((cs >> 4) & 1) != node->toggle)
+                flags = PEAK_CANOPEN_TAG_ERROR;
+            node->toggle ^= 1;
+            if (cs & 0x01)
+                node->state = SDO_IDLE;
+            return ObjectTag(node, flags);
+        case 1: // initiate download, segmented unless expedited
+            StartTransfer(node, msg, (cs & 0x02) ? SDO_IDLE : SDO_DOWNLOAD);
+            break;
+        case 2:
+            StartTransfer(node, msg, SDO_IDLE);
+            break;
+        case 3: // upload segment request
+            if (node->state != SDO_UPLOAD || ((cs >> 4) & 1) != node->toggle)
+                flags = PEAK_CANOPEN_TAG_ERROR;
+            return ObjectTag(node, flags);
+        case 4:
+            node->state = SDO_IDLE;
+            break;
+        case 5: // block upload
+            switch (cs & 0x03)
+            {
+                case 0:
+                    StartTransfer(node, msg, SDO_BLOCK_UPLOAD);
+                    node->blksize = msg->data[4];
+                    break;
+                case 1:
+                    node->state = SDO_IDLE;
+                    return ObjectTag(node, 0);
+                case 2: // a sub-block acknowledged, the next one follows unless that was the last
+                    node->blksize = msg->data[2];
+                    node->seqno = 0;
+                    node->state = node->last ? SDO_BLOCK_UPLOAD : SDO_BLOCK_UPLOAD_SEGMENTS;
+                    return ObjectTag(node, 0);
+                case 3:
+                    node->seqno = 0;
+                    node->state = SDO_BLOCK_UPLOAD_SEGMENTS;
+                    return ObjectTag(node, 0);
+            }
+            break;
+        case 6: // block download
+            if (cs & 0x01)
+            {
+                node->state = SDO_IDLE;
+                return ObjectTag(node, 0);
+            }
+            StartTransfer(node, msg, SDO_BLOCK_DOWNLOAD);
+            break;
+    }
+    return 0;
+}
+
+// server to client
+static UInt32 TrackServer(PeakCanopenNode* node, const CanMsg* msg)
+{
+    UInt8 cs = msg->data[0];
+    UInt32 flags = 0;
+    
+    if (node->state == SDO_BLOCK_UPLOAD_SEGMENTS)
+        return BlockSegment(node, msg, SDO_BLOCK_UPLOAD);
+    
+    switch (cs >> 5)
+    {
+        case 0: // upload segment
+            if (node->state != SDO_UPLOAD || ((cs >> 4) & 1) != node->toggle)
+                flags = PEAK_CANOPEN_TAG_ERROR;
+            node->toggle ^= 1;
+            if (cs & 0x01)
+                node->state = SDO_IDLE;
+            return ObjectTag(node, flags);
+        case 1: // download segment confirmed
+            return ObjectTag(node, 0);
+        case 2: // initiate upload response, segmented unless expedited
+            StartTransfer(node, msg, (cs & 0x02) ? SDO_IDLE : SDO_UPLOAD);
+            break;
+        case 4:
+            node->state = SDO_IDLE;
+            break;
+        case 5: // block download
+            switch (cs & 0x03)
+            {
+                case 0:
+                    node->blksize = msg->data[4];
+                    node->seqno = 0;
+                    node->state = SDO_BLOCK_DOWNLOAD_SEGMENTS;
+                    break;
+                case 1:
+                    node->state = SDO_IDLE;
+                    break;
+                case 2:
+                    node->blksize = msg->data[2];
+                    node->seqno = 0;
+                    node->state = node->last ? SDO_BLOCK_DOWNLOAD : SDO_BLOCK_DOWNLOAD_SEGMENTS;
+                    break;
+            }
+            return ObjectTag(node, 0);
+        case 6: // block upload
+            return ObjectTag(node, 0);
+    }
+    return 0;
+}
+
+UInt32 PeakCanopenTrack(PeakCanopenDecoder* decoder, const CanMsg* msg)
+{
+    UInt16 entry;
+    PeakCanopenNode* node;
+    
+    if (msg->ext || msg->err || msg->canid.ul >= PEAK_CANOPEN_IDS)
+        return 0;
+    
+    entry = decoder->table[msg->canid.ul];
+    node = &decoder->nodes[entry & 0x7f];
+    
+    switch (entry >> 8)
+    {
+        case PEAK_CANOPEN_SDO_RX:
+            return msg->rtr || msg->len < 8 ? 0 : TrackClient(node, msg);
+        case PEAK_CANOPEN_SDO_TX:
+            return msg->rtr || msg->len < 8 ? 0 : TrackServer(node, msg);
+        case PEAK_CANOPEN_HEARTBEAT:
+            if (msg->rtr)
+                node->guarded = 1;
+            else if (node->guarded)
+                return PEAK_CANOPEN_TAG_GUARD;
+            return 0;
+        case PEAK_CANOPEN_NMT:
+            // a reset ends whatever transfer was going on
+            if (msg->len >= 2 && (msg->data[0] == 0x81 || msg->data[0] == 0x82))
+            {
+                if (msg->data[1] == 0)
+                    PeakCanopenReset(decoder);
+                else if (msg->data[1] < PEAK_CANOPEN_NODES)
+                    bzero(&decoder->nodes[msg->data[1]], sizeof(PeakCanopenNode));
+            }
+            return 0;
+    }
+    return 0;
+}
+
+#pragma mark - Descriptions
+
+static UInt32 Little(const UInt8* data, UInt32 bytes)
+{
+    UInt32 value = 0;
+    
+    while (bytes--)
+        value = value << 8 | data[bytes];
+    return value;
+}
+
+static const char* AbortText(UInt32 code)
+{
+    UInt32 i;
+    
+    for (i = 0; i < sizeof(kAbortCodes) / sizeof(kAbortCodes[0]); i++)
+    {
+        if (kAbortCodes[i].code == code)
+            return kAbortCodes[i].text;
+    }
+    return "unknown";
+}
+
+static const char* EmcyText(UInt16 code)
+{
+    switch (code)
+    {
+        case 0x8110: return "CAN overrun";
+        case 0x8120: return "CAN error passive";
+        case 0x8130: return "life guard or heartbeat error";
+        case 0x8140: return "recovered from bus off";
+        case 0x8150: return "CAN-ID collision";
+        case 0x8210: return "PDO too short";
+        case 0x8220: return "PDO too long";
+    }
+    switch (code >> 8)
+    {
+        case 0x00: return "error reset";
+        case 0x10: return "generic error";
+        case 0x20: case 0x21: case 0x22: case 0x23: return "current";
+        case 0x30: case 0x31: case 0x32: case 0x33: return "voltage";
+        case 0x40: case 0x41: case 0x42: return "temperature";
+        case 0x50: return "device hardware";
+        case 0x60: case 0x61: case 0x62: case 0x63: return "device software";
+        case 0x70: return "additional modules";
+        case 0x80: case 0x81: case 0x82: return "monitoring";
+        case 0x90: return "external error";
+        case 0xF0: return "additional functions";
+        case 0xFF: return "device specific";
+    }
+    return "reserved";
+}
+
+static const char* NodeState(UInt8 state)
+{
+    switch (state)
+    {
+        case 0x00: return "boot-up";
+        case 0x04: return "stopped";
+        case 0x05: return "operational";
+        case 0x7F: return "pre-operational";
+    }
+    return NULL;
+}
+
+static char* PutNode(char* ptr, const char* service, UInt32 node)
+{
+    ptr = PutString(ptr, service);
+    ptr = PutString(ptr, " node ");
+    return PutDec(ptr, node);
+}
+
+// value of an expedited transfer, bytes of data[4..7]
+static char* PutValue(char* ptr, const CanMsg* msg, UInt8 cs)
+{
+    UInt32 bytes = (cs & 0x01) ? 4 - ((cs >> 2) & 0x03) : 4;
+    UInt32 value = Little(&msg->data[4], bytes);
+    
+    ptr = PutString(ptr, " = ");
+    ptr = PutDec(ptr, value);
+    *ptr++ = ' ';
+    *ptr++ = '(';
+    ptr = PutHex(ptr, value, 2 * bytes);
+    *ptr++ = ')';
+    return ptr;
+}
+
+static char* PutSize(char* ptr, const CanMsg* msg, UInt8 cs, UInt8 sizeBit)
+{
+    if (!(cs & sizeBit))
+        return ptr;
+    
+    *ptr++ = ',';
+    *ptr++ = ' ';
+    ptr = PutDec(ptr, Little(&msg->data[4], 4));
+    return PutString(ptr, " bytes");
+}
+
+static char* PutAbort(char* ptr, const CanMsg* msg)
+{
+    UInt32 code = Little(&msg->data[4], 4);
+    
+    ptr = PutString(ptr, " abort");
+    ptr = PutObject(ptr, msg->data[1] | msg->data[2] << 8, msg->data[3]);
+    *ptr++ = ' ';
+    ptr = PutHex(ptr, code, 8);
+    *ptr++ = ' ';
+    return PutString(ptr, AbortText(code));
+}
+
+static char* PutSegment(char* ptr, const CanMsg* msg, UInt32 tag, const char* what)
+{
+    UInt8 cs = msg->data[0];
+    
+    if (tag & PEAK_CANOPEN_TAG_SDO)
+        ptr = PutObject(ptr, tag >> 16, (tag >> 8) & 0xff);
+    ptr = PutString(ptr, what);
+    ptr = PutString(ptr, (cs & 0x10) ? ", toggle 1" : ", toggle 0");
+    if (cs & 0x20) // requests and confirmations carry no data
+        return ptr;
+    
+    *ptr++ = ',';
+    *ptr++ = ' ';
+    ptr = PutDec(ptr, 7 - ((cs >> 1) & 0x07));
+    ptr = PutString(ptr, " bytes");
+    if (cs & 0x01)
+        ptr = PutString(ptr, ", last");
+    return ptr;
+}
+
+static char* DescribeClient(char* ptr, const CanMsg* msg, UInt32 tag)
+{
+    UInt8 cs = msg->data[0];
+    UInt16 index = msg->data[1] | msg->data[2] << 8;
+    UInt8 subindex = msg->data[3];
+    
+    switch (cs >> 5)
+    {
+        case 0:
+            ptr = PutString(ptr, " download");
+            return PutSegment(ptr, msg, tag, " segment");
+        case 1:
+            ptr = PutString(ptr, " download");
+            ptr = PutObject(ptr, index, subindex);
+            if (cs & 0x02)
+                return PutValue(ptr, msg, cs);
+            ptr = PutString(ptr, " segmented");
+            return PutSize(ptr, msg, cs, 0x01);
+        case 2:
+            ptr = PutString(ptr, " upload");
+            ptr = PutObject(ptr, index, subindex);
+            return PutString(ptr, " request");
+        case 3:
+            ptr = PutString(ptr, " upload");
+            return PutSegment(ptr, msg, tag, " request");
+        case 4:
+            return PutAbort(ptr, msg);
+        case 5:
+            ptr = PutString(ptr, " block upload");
+            switch (cs & 0x03)
+            {
+                case 0:
+                    ptr = PutObject(ptr, index, subindex);
+                    ptr = PutString(ptr, " request, blksize ");
+                    return PutDec(ptr, msg->data[4]);
+                case 1:
+                    return PutString(ptr, " end confirmed");
+                case 2:
+                    ptr = PutString(ptr, " ack seqno ");
+                    ptr = PutDec(ptr, msg->data[1]);
+                    ptr = PutString(ptr, ", blksize ");
+                    return PutDec(ptr, msg->data[2]);
+                case 3:
+                    return PutString(ptr, " start");
+            }
+            break;
+        case 6:
+            ptr = PutString(ptr, " block download");
+            if (cs & 0x01)
+            {
+                ptr = PutString(ptr, " end, crc ");
+                return PutHex(ptr, msg->data[1] | msg->data[2] << 8, 4);
+            }
+            ptr = PutObject(ptr, index, subindex);
+            return PutSize(ptr, msg, cs, 0x02);
+    }
+    return PutString(ptr, " invalid command");
+}
+
+static char* DescribeServer(char* ptr, const CanMsg* msg, UInt32 tag)
+{
+    UInt8 cs = msg->data[0];
+    UInt16 index = msg->data[1] | msg->data[2] << 8;
+    UInt8 subindex = msg->data[3];
+    
+    switch (cs >> 5)
+    {
+        case 0:
+            ptr = PutString(ptr, " upload");
+            return PutSegment(ptr, msg, tag, " segment");
+        case 1:
+            ptr = PutString(ptr, " download");
+            return PutSegment(ptr, msg, tag, " confirmed");
+        case 2:
+            ptr = PutString(ptr, " upload");
+            ptr = PutObject(ptr, index, subindex);
+            if (cs & 0x02)
+                return PutValue(ptr, msg, cs);
+            ptr = PutString(ptr, " segmented");
+            return PutSize(ptr, msg, cs, 0x01);
+        case 3:
+            ptr = PutString(ptr, " download");
+            ptr = PutObject(ptr, index, subindex);
+            return PutString(ptr, " confirmed");
+        case 4:
+            return PutAbort(ptr, msg);
+        case 5:
+            ptr = PutString(ptr, " block download");
+            switch (cs & 0x03)
+            {
+                case 0:
+                    ptr = PutObject(ptr, index, subindex);
+                    ptr = PutString(ptr, " confirmed, blksize ");
+                    return PutDec(ptr, msg->data[4]);
+                case 1:
+                    return PutString(ptr, " end confirmed");
+                case 2:
+                    ptr = PutString(ptr, " ack seqno ");
+                    ptr = PutDec(ptr, msg->data[1]);
+                    ptr = PutString(ptr, ", blksize ");
+                    return PutDec(ptr, msg->data[2]);
+            }
+            break;
+        case 6:
+            ptr = PutString(ptr, " block upload");
+            if (cs & 0x01)
+            {
+                ptr = PutString(ptr, " end, ");
+                ptr = PutDec(ptr, (cs >> 2) & 0x07);
+                ptr = PutString(ptr, " bytes unused, crc ");
+                return PutHex(ptr, msg->data[1] | msg->data[2] << 8, 4);
+            }
+            ptr = PutObject(ptr, index, subindex);
+            return PutSize(ptr, msg, cs, 0x02);
+    }
+    return PutString(ptr, " invalid command");
+}
+
+static char* DescribeSdo(char* ptr, const CanMsg* msg, UInt32 tag, UInt32 node, int client)
+{
+    ptr = PutNode(ptr, "SDO", node);
+    
+    if (msg->rtr || msg->len < 8)
+        return PutString(ptr, " invalid length");
+    
+    if (tag & PEAK_CANOPEN_TAG_BLOCK)
+    {
+        ptr = PutString(ptr, client ? " block download" : " block upload");
+        ptr = PutObject(ptr, tag >> 16, (tag >> 8) & 0xff);
+        ptr = PutString(ptr, " segment ");
+        ptr = PutDec(ptr, msg->data[0] & 0x7f);
+        if (msg->data[0] & 0x80)
+            ptr = PutString(ptr, ", last");
+    }
+    else
+    {
+        ptr = client ? DescribeClient(ptr, msg, tag) : DescribeServer(ptr, msg, tag);
+    }
+    
+    if (tag & PEAK_CANOPEN_TAG_ERROR)
+        ptr = PutString(ptr, (tag & PEAK_CANOPEN_TAG_BLOCK) ? ", out of sequence" : ", toggle error");
+    return ptr;
+}
+
+static char* DescribePdo(const PeakCanopenDecoder* decoder, char* ptr, const CanMsg* msg, UInt32 service, UInt32 node)
+{
+    const PeakCanopenPdo* pdo;
+    UInt64 value, mask;
+    UInt32 i, bits;
+    union { UInt32 u; float f; } real;
+    
+    ptr = PutNode(ptr, kServiceNames[service], node);
+    if (msg->rtr)
+        return PutString(ptr, " request");
+    if (decoder->pdoOf[msg->canid.ul] == 0)
+        return ptr;
+    
+    pdo = &decoder->pdos[decoder->pdoOf[msg->canid.ul] - 1];
+    *ptr++ = ':';
+    for (i = 0; i < pdo->count; i++)
+    {
+        const PeakCanopenField* field = &pdo->fields[i];
+        
+        *ptr++ = ' ';
+        ptr = PutString(ptr, field->name);
+        *ptr++ = '=';
+        
+        bits = field->offset + field->bits;
+        if (bits > 8 * msg->len)
+        {
+            *ptr++ = '?';
+            continue;
+        }
+        
+        mask = field->bits == 64 ? ~0ULL : (1ULL << field->bits) - 1;
+        value = (msg->ldata >> field->offset) & mask;
+        if (field->type == PEAK_CANOPEN_SIGNED && field->bits < 64 && (value >> (field->bits - 1)))
+            value |= ~mask;
+        
+        if (field->type == PEAK_CANOPEN_REAL)
+        {
+            real.u = (UInt32)value;
+            ptr += snprintf(ptr, 32, "%g", real.f);
+        }
+        else if (field->type == PEAK_CANOPEN_SIGNED)
+        {
+            ptr = PutDec(ptr, (SInt64)value);
+        }
+        else if (value >> 63)
+        {
+            ptr = PutHex(ptr, (UInt32)(value >> 32), 8);
+            ptr = PutDigits(ptr, (UInt32)value, 8);
+        }
+        else
+        {
+            ptr = PutDec(ptr, (SInt64)value);
+        }
+    }
+    return ptr;
+}
+
+UInt32 PeakCanopenDescribe(const PeakCanopenDecoder* decoder, const CanMsg* msg, UInt32 tag, char* buffer, UInt32 size)
+{
+    char line[PEAK_CANOPEN_DESCR_MAX + 64];
+    char* ptr = line;
+    const char* text;
+    UInt32 entry, service, node;
+    
+    if (msg->ext || msg->err || msg->canid.ul >= PEAK_CANOPEN_IDS)
+    {
+        if (size)
+            buffer[0] = 0;
+        return 0;
+    }
+    
+    entry = decoder->table[msg->canid.ul];
+    service = entry >> 8;
+    node = entry & 0xff;
+    
+    switch (service)
+    {
+        case PEAK_CANOPEN_NMT:
+            ptr = PutString(ptr, "NMT ");
+            if (msg->len < 2)
+            {
+                ptr = PutString(ptr, "invalid length");
+                break;
+            }
+            switch (msg->data[0])
+            {
+                case 0x01: ptr = PutString(ptr, "start"); break;
+                case 0x02: ptr = PutString(ptr, "stop"); break;
+                case 0x80: ptr = PutString(ptr, "enter pre-operational"); break;
+                case 0x81: ptr = PutString(ptr, "reset node"); break;
+                case 0x82: ptr = PutString(ptr, "reset communication"); break;
+                default:
+                    ptr = PutString(ptr, "command ");
+                    ptr = PutHex(ptr, msg->data[0], 2);
+                    break;
+            }
+            if (msg->data[1] == 0)
+                ptr = PutString(ptr, " all nodes");
+            else
+                ptr = PutNode(ptr, "", msg->data[1]);
+            break;
+        case PEAK_CANOPEN_SYNC:
+            ptr = PutString(ptr, "SYNC");
+            if (msg->len >= 1 && !msg->rtr)
+            {
+                ptr = PutString(ptr, " counter ");
+                ptr = PutDec(ptr, msg->data[0]);
+            }
+            break;
+        case PEAK_CANOPEN_TIME:
+            ptr = PutString(ptr, "TIME");
+            if (msg->len >= 6 && !msg->rtr)
+            {
+                // ms after midnight and days since 1984-01-01
+                ptr = PutString(ptr, " day ");
+                ptr = PutDec(ptr, Little(&msg->data[4], 2));
+                ptr = PutString(ptr, ", ");
+                ptr = PutDec(ptr, Little(msg->data, 4) & 0x0fffffff);
+                ptr = PutString(ptr, " ms");
+            }
+            break;
+        case PEAK_CANOPEN_EMCY:
+            ptr = PutNode(ptr, "EMCY", node);
+            if (msg->len >= 3 && !msg->rtr)
+            {
+                UInt16 code = (UInt16)Little(msg->data, 2);
+                *ptr++ = ':';
+                *ptr++ = ' ';
+                ptr = PutHex(ptr, code, 4);
+                *ptr++ = ' ';
+                ptr = PutString(ptr, EmcyText(code));
+                ptr = PutString(ptr, ", register ");
+                ptr = PutHex(ptr, msg->data[2], 2);
+            }
+            break;
+        case PEAK_CANOPEN_SDO_TX:
+        case PEAK_CANOPEN_SDO_RX:
+            ptr = DescribeSdo(ptr, msg, tag, node, service == PEAK_CANOPEN_SDO_RX);
+            break;
+        case PEAK_CANOPEN_HEARTBEAT:
+            if (msg->rtr)
+            {
+                ptr = PutNode(ptr, "Node guarding request", node);
+                break;
+            }
+            ptr = PutNode(ptr, (tag & PEAK_CANOPEN_TAG_GUARD) ? "Node guarding" : "Heartbeat", node);
+            if (msg->len < 1)
+                break;
+            *ptr++ = ':';
+            *ptr++ = ' ';
+            text = NodeState(msg->data[0] & 0x7f);
+            if (text)
+                ptr = PutString(ptr, text);
+            else
+                ptr = PutHex(ptr, msg->data[0] & 0x7f, 2);
+            if (tag & PEAK_CANOPEN_TAG_GUARD)
+                ptr = PutString(ptr, (msg->data[0] & 0x80) ? ", toggle 1" : ", toggle 0");
+            break;
+        case PEAK_CANOPEN_LSS_SLAVE:
+        case PEAK_CANOPEN_LSS_MASTER:
+            ptr = PutString(ptr, kServiceNames[service]);
+            if (msg->len < 1)
+                break;
+            switch (msg->data[0])
+            {
+                case 0x04: ptr = PutString(ptr, (msg->data[1] & 1) ? " switch state global, configuration" : " switch state global, waiting"); break;
+                case 0x11: ptr = PutString(ptr, " configure node-ID "); ptr = PutDec(ptr, msg->data[1]); break;
+                case 0x13: ptr = PutString(ptr, " configure bit timing"); break;
+                case 0x15: ptr = PutString(ptr, " activate bit timing"); break;
+                case 0x17: ptr = PutString(ptr, " store configuration"); break;
+                case 0x40: case 0x41: case 0x42: case 0x43:
+                    ptr = PutString(ptr, " switch state selective ");
+                    ptr = PutHex(ptr, Little(&msg->data[1], 4), 8);
+                    break;
+                case 0x44: ptr = PutString(ptr, " switch state selective response"); break;
+                case 0x4F: ptr = PutString(ptr, " identify slave response"); break;
+                case 0x50: ptr = PutString(ptr, " identify non-configured slave response"); break;
+                case 0x5E: ptr = PutString(ptr, " inquire node-ID"); break;
+                default:
+                    ptr = PutString(ptr, " command ");
+                    ptr = PutHex(ptr, msg->data[0], 2);
+                    break;
+            }
+            break;
+        case PEAK_CANOPEN_NONE:
+            break;
+        default:
+            ptr = DescribePdo(decoder, ptr, msg, service, node);
+            break;
+    }
+    
+    return Finish(line, ptr, buffer, size);
+}
+
+UInt32 PeakCanopenDecode(PeakCanopenDecoder* decoder, const CanMsg* msg, char* buffer, UInt32 size)
+{
+    return PeakCanopenDescribe(decoder, msg, PeakCanopenTrack(decoder, msg), buffer, size);
+}
@@ -0,0 +1,126 @@
+/*
+    File:           PeakCanopen.h
+
+    Description:    Streaming CANopen decoder describing NMT, SYNC, TIME, EMCY, heartbeat, node
+                    guarding, LSS, SDO and mapped PDO frames for the log window.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakCanopen_h
+#define PeakLog_PeakCanopen_h
+
+#include "PeakUSB.h"
+
+#define PEAK_CANOPEN_IDS            2048    // 11 bit COB-IDs, the dispatch table is indexed directly
+#define PEAK_CANOPEN_NODES          128
+#define PEAK_CANOPEN_PDOS           1024    // COB-IDs with a PDO mapping
+#define PEAK_CANOPEN_PDO_FIELDS     16      // mapped objects per PDO
+#define PEAK_CANOPEN_NAME           16      // of a mapped object, with the terminating 0
+#define PEAK_CANOPEN_DESCR_MAX      640     // longest description, a PDO of 16 overlapping 64 bit fields with long names
+
+// services, the upper byte of a dispatch table entry; the lower one is the node-ID
+#define PEAK_CANOPEN_NONE           0
+#define PEAK_CANOPEN_NMT            1
+#define PEAK_CANOPEN_SYNC           2
+#define PEAK_CANOPEN_EMCY           3
+#define PEAK_CANOPEN_TIME           4
+#define PEAK_CANOPEN_TPDO1          5       // TPDO1, RPDO1 .. TPDO4, RPDO4 in COB-ID order
+#define PEAK_CANOPEN_RPDO4          12
+#define PEAK_CANOPEN_SDO_TX         13      // server to client, 0x580 + node
+#define PEAK_CANOPEN_SDO_RX         14      // client to server, 0x600 + node
+#define PEAK_CANOPEN_HEARTBEAT      15      // and node guarding
+#define PEAK_CANOPEN_LSS_SLAVE      16      // 0x7E4
+#define PEAK_CANOPEN_LSS_MASTER     17      // 0x7E5
+
+// message types of the filter panel, see PeakCanopenTypeRange
+#define PEAK_CANOPEN_TYPE_NMT       0
+#define PEAK_CANOPEN_TYPE_EMCY      1
+#define PEAK_CANOPEN_TYPE_PDO       2
+#define PEAK_CANOPEN_TYPE_SDO       3
+#define PEAK_CANOPEN_TYPE_HEARTBEAT 4
+#define PEAK_CANOPEN_TYPE_LSS       5
+
+// What the stream told about a frame beyond its own bytes. SDO segments get the object of their transfer
+// in the upper 24 bits (index << 16 | subindex << 8).
+#define PEAK_CANOPEN_TAG_SDO        0x01    // the object is known
+#define PEAK_CANOPEN_TAG_BLOCK      0x02    // a segment of a block transfer
+#define PEAK_CANOPEN_TAG_ERROR      0x04    // toggle bit or sequence number out of order
+#define PEAK_CANOPEN_TAG_GUARD      0x08    // a node guarding reply rather than a heartbeat
+
+// PDO field types
+#define PEAK_CANOPEN_UNSIGNED       0
+#define PEAK_CANOPEN_SIGNED         1
+#define PEAK_CANOPEN_REAL           2       // 32 bit float
+
+typedef struct {
+    char    name[PEAK_CANOPEN_NAME];
+    UInt8   offset;         // first bit in the payload, little endian as the objects are mapped
+    UInt8   bits;
+    UInt8   type;
+} PeakCanopenField;
+
+typedef struct {
+    UInt16              cobid;
+    UInt8               count;
+    PeakCanopenField    fields[PEAK_CANOPEN_PDO_FIELDS];
+} PeakCanopenPdo;
+
+// the SDO transfer going on with a node, one at a time
+typedef struct {
+    UInt16  index;
+    UInt8   subindex;
+    UInt8   state;
+    UInt8   toggle;         // of the next segment
+    UInt8   seqno;          // of the last block segment
+    UInt8   blksize;
+    UInt8   last;           // the segment with the c bit went by
+    UInt8   guarded;        // the node was asked for its state by RTR
+} PeakCanopenNode;
+
+typedef struct {
+    UInt16              table[PEAK_CANOPEN_IDS];    // service << 8 | node
+    UInt16              pdoOf[PEAK_CANOPEN_IDS];    // index into pdos + 1, 0 if not mapped
+    PeakCanopenNode     nodes[PEAK_CANOPEN_NODES];
+    PeakCanopenPdo      pdos[PEAK_CANOPEN_PDOS];
+    UInt32              pdoCount;
+} PeakCanopenDecoder;
+
+IOReturn PeakCanopenCreate(PeakCanopenDecoder** decoder);
+void PeakCanopenFree(PeakCanopenDecoder* decoder);
+// forgets the transfers going on, keeps the mappings
+void PeakCanopenReset(PeakCanopenDecoder* decoder);
+
+// Replaces the mapping of a PDO COB-ID, count 0 removes it.
+IOReturn PeakCanopenSetMapping(PeakCanopenDecoder* decoder, UInt16 cobid, const PeakCanopenField* fields, UInt32 count);
+// Reads mappings from a text file, a line per PDO: the COB-ID and its objects as name:bits[:u|s|f] in
+// mapping order, e.g. "0x181 statusword:16 position:32:s". # starts a comment.
+IOReturn PeakCanopenLoadMapping(PeakCanopenDecoder* decoder, const char* path);
+
+// The streaming half: follows the SDO transfers and node guarding, must see every frame in order.
+// Returns the tag to describe the frame with later.
+UInt32 PeakCanopenTrack(PeakCanopenDecoder* decoder, const CanMsg* msg);
+// The stateless half: the description of a frame and its tag into buffer, truncated to size. Returns the
+// length, 0 for frames that are no CANopen ones.
+UInt32 PeakCanopenDescribe(const PeakCanopenDecoder* decoder, const CanMsg* msg, UInt32 tag, char* buffer, UInt32 size);
+// both at once
+UInt32 PeakCanopenDecode(PeakCanopenDecoder* decoder, const CanMsg* msg, char* buffer, UInt32 size);
+
+// The COB-ID range of a PEAK_CANOPEN_TYPE_
+void PeakCanopenTypeRange(UInt32 type, UInt32* low, UInt32* high);
+
+#endif
@@ -0,0 +1,542 @@
+/*
+    File:           PeakCapture.c
+
+    Description:    Append-only binary capture files with fixed size records, written by a background
+                    thread so the bulk read completion never waits for the disk.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "PeakCapture.h"
+#include "PeakIndex.h"
+#include "PeakArchive.h"
+#include "PeakTrigger.h"
+#include "PeakBatch.h"
+
+#pragma mark - Records
+
+void PeakCaptureRecordFromMsg(PeakCaptureRecord* record, const CanMsg* msg)
+{
+    record->ts = msg->ts;
+    record->canid = msg->canid.ul;
+    record->flags = (msg->ext ? PEAK_CAPTURE_EXT : 0) | (msg->rtr ? PEAK_CAPTURE_RTR : 0) |
+                    (msg->err ? PEAK_CAPTURE_ERR : 0) | (msg->loc ? PEAK_CAPTURE_LOC : 0);
+    record->dlc = msg->len;
+    record->channel = msg->channel;
+    record->reserved = 0;
+    
+    // whatever the decoder left after the frame's bytes stays out of the file
+    bzero(record->data, 8);
+    memcpy(record->data, msg->data, msg->len > 8 ? 8 : msg->len);
+}
+
+void PeakCaptureRecordToMsg(const PeakCaptureRecord* record, CanMsg* msg)
+{
+    bzero(msg, sizeof(CanMsg));
+    msg->ts = record->ts;
+    msg->canid.ul = record->canid;
+    msg->ext = (record->flags & PEAK_CAPTURE_EXT) != 0;
+    msg->rtr = (record->flags & PEAK_CAPTURE_RTR) != 0;
+    msg->err = (record->flags & PEAK_CAPTURE_ERR) != 0;
+    msg->loc = (record->flags & PEAK_CAPTURE_LOC) != 0;
+    msg->len = record->dlc > 8 ? 8 : record->dlc;
+    msg->channel = record->channel < PEAK_MAX_CHANNELS ? record->channel : 0;
+    memcpy(msg->data, record->data, 8);
+}
+
+IOReturn PeakCaptureReadHeader(int fd, PeakCaptureHeader* header)
+{
+    if (pread(fd, header, sizeof(PeakCaptureHeader), 0) != sizeof(PeakCaptureHeader))
+        return kIOReturnIOError;
+    
+    if (header->magic != PEAK_CAPTURE_MAGIC)
+        return kIOReturnBadArgument;
+    
+    // later versions may only grow the header and the records
+    if (header->version < 1 || header->headerSize < sizeof(PeakCaptureHeader) || header->recordSize < sizeof(PeakCaptureRecord))
+        return kIOReturnUnsupported;
+    
+    return kIOReturnSuccess;
+}
+
+#pragma mark - Writer thread
+
+static IOReturn WriteAll(PeakCapture* capture, const void* buffer, size_t length)
+{
+    const UInt8* ptr = buffer;
+    
+    while (length > 0)
+    {
+        ssize_t n = write(capture->fd, ptr, length);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Unable to write capture (%s)\n", strerror(errno));
+            __atomic_add_fetch(&capture->stats.errors, 1, __ATOMIC_RELAXED);
+            return kIOReturnIOError;
+        }
+        ptr += n;
+        length -= n;
+    }
+    
+    return kIOReturnSuccess;
+}
+
+static void Flush(PeakCapture* capture, UInt32 count)
+{
+    UInt64 now;
+    
+    if (count == 0)
+        return;
+    
+    if (WriteAll(capture, capture->records, count * sizeof(PeakCaptureRecord)) == kIOReturnSuccess)
+    {
+        __atomic_add_fetch(&capture->stats.frames, count, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&capture->stats.bytes, count * sizeof(PeakCaptureRecord), __ATOMIC_RELAXED);
+        
+        now = PeakMonotonicNs();
+        if (now > capture->oldestNs)
+            PeakHistogramRecord(&capture->latency, now - capture->oldestNs);
+        
+        // only what made it to the file, a short capture is detected as stale and reindexed when read
+        if (capture->index)
+            PeakIndexBuilderAdd(capture->index, capture->records, count);
+    }
+    __atomic_add_fetch(&capture->stats.writes, 1, __ATOMIC_RELAXED);
+    capture->oldestNs = ~0ULL;
+}
+
+// Hands merged frames to the archive, or with count 0 writes out its open chunk. Returns 1 if chunks were
+// written, the stats count those.
+static int Archive(PeakCapture* capture, UInt32 count)
+{
+    PeakArchiveWriter* archive = capture->archive;
+    PeakArchiveStats before = archive->stats;
+    IOReturn kr;
+    UInt64 now;
+    
+    kr = count ? PeakArchiveWriterAppend(archive, capture->batch, count) : PeakArchiveWriterFlush(archive);
+    if (kr != kIOReturnSuccess)
+        __atomic_add_fetch(&capture->stats.errors, 1, __ATOMIC_RELAXED);
+    
+    if (archive->stats.chunks == before.chunks)
+        return 0;
+    
+    __atomic_add_fetch(&capture->stats.frames, archive->stats.frames - before.frames, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&capture->stats.bytes, archive->stats.bytes - before.bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&capture->stats.writes, archive->stats.chunks - before.chunks, __ATOMIC_RELAXED);
+    
+    now = PeakMonotonicNs();
+    if (now > capture->oldestNs)
+        PeakHistogramRecord(&capture->latency, now - capture->oldestNs);
+    capture->oldestNs = ~0ULL;
+    return 1;
+}
+
+// n frames of the batch, at most the room left in the records
+static void Store(PeakCapture* capture, UInt32 n, UInt32* count, UInt64* lastFlushNs)
+{
+    UInt32 i;
+    
+    for (i = 0; i < n; i++)
+    {
+        const CanMsg* msg = &capture->batch[i];
+        // the pre-trigger frames are old on purpose
+        if (msg->mono + msg->delay < capture->oldestNs && capture->trigger == NULL)
+            capture->oldestNs = msg->mono + msg->delay;
+        if (capture->archive == NULL)
+            PeakCaptureRecordFromMsg(&capture->records[(*count)++], msg);
+    }
+    
+    if (capture->archive && n > 0 && Archive(capture, n))
+        *lastFlushNs = PeakMonotonicNs();
+    
+    if (*count == PEAK_CAPTURE_WRITE_RECORDS)
+    {
+        Flush(capture, *count);
+        *count = 0;
+        *lastFlushNs = PeakMonotonicNs();
+    }
+}
+
+static void* WriterThread(void* refCon)
+{
+    PeakCapture* capture = refCon;
+    struct timespec poll = { 0, PEAK_CAPTURE_POLL_NS };
+    UInt64 lastFlushNs = PeakMonotonicNs(), now, horizon;
+    UInt32 n, m, room, count = 0;
+    
+    for (;;)
+    {
+        // read the flag first, so everything appended before PeakCaptureClose is still written
+        UInt32 enabled = __atomic_load_n(&capture->enabled, __ATOMIC_ACQUIRE);
+        
+        // the last round takes everything, whatever the window still holds back
+        do
+        {
+            now = PeakMonotonicNs();
+            room = PEAK_CAPTURE_WRITE_RECORDS - count;
+            n = PeakMergeDrain(&capture->merge, capture->batch, room < PEAK_CAPTURE_MERGE_FRAMES ? room : PEAK_CAPTURE_MERGE_FRAMES,
+                               enabled ? now : ~0ULL);
+            if (capture->trigger == NULL)
+            {
+                Store(capture, n, &count, &lastFlushNs);
+                continue;
+            }
+            
+            // everything goes through the history, only the frames of the trigger windows come back out;
+            // all frames older than the merge window are in, which is the clock of the timeouts
+            horizon = enabled && now > capture->merge.windowNs ? now - capture->merge.windowNs : 0;
+            PeakTriggerFeed(capture->trigger, capture->batch, n, horizon);
+            do
+            {
+                room = PEAK_CAPTURE_WRITE_RECORDS - count;
+                m = PeakTriggerTake(capture->trigger, capture->batch, room < PEAK_CAPTURE_MERGE_FRAMES ? room : PEAK_CAPTURE_MERGE_FRAMES);
+                Store(capture, m, &count, &lastFlushNs);
+            }
+            while (m > 0);
+        }
+        while (n > 0);
+        
+        if (!enabled)
+            break;
+        
+        // a slow bus should not keep frames in memory for long, archives wait longer for fuller chunks
+        if (count > 0 && PeakMonotonicNs() - lastFlushNs >= PEAK_CAPTURE_FLUSH_NS)
+        {
+            Flush(capture, count);
+            count = 0;
+            lastFlushNs = PeakMonotonicNs();
+        }
+        if (capture->archive && capture->archive->count > 0 && PeakMonotonicNs() - lastFlushNs >= PEAK_ARCHIVE_FLUSH_NS)
+        {
+            Archive(capture, 0);
+            lastFlushNs = PeakMonotonicNs();
+        }
+        
+        nanosleep(&poll, NULL);
+    }
+    
+    Flush(capture, count);
+    if (capture->archive)
+        Archive(capture, 0);
+    return NULL;
+}
+
+#pragma mark - Setup
+
+static void ReleaseIndex(PeakCapture* capture)
+{
+    if (capture->index)
+    {
+        PeakIndexBuilderFree(capture->index);
+        free(capture->index);
+    }
+    free(capture->path);
+    capture->index = NULL;
+    capture->path = NULL;
+}
+
+static IOReturn ReleaseArchive(PeakCapture* capture)
+{
+    IOReturn kr = PeakArchiveWriterClose(capture->archive);
+    
+    free(capture->archive);
+    capture->archive = NULL;
+    return kr;
+}
+
+IOReturn PeakCaptureSetTrigger(PeakCapture* capture, const PeakTriggerConfig* config)
+{
+    PeakTrigger* trigger = NULL;
+    IOReturn kr;
+    
+    if (capture->fd >= 0 || capture->archive)
+        return kIOReturnBusy;
+    
+    if (config)
+    {
+        trigger = malloc(sizeof(PeakTrigger));
+        if (trigger == NULL)
+            return kIOReturnNoMemory;
+        
+        kr = PeakTriggerCreate(trigger, config);
+        if (kr != kIOReturnSuccess)
+        {
+            free(trigger);
+            return kr;
+        }
+    }
+    
+    if (capture->trigger)
+    {
+        PeakTriggerDestroy(capture->trigger);
+        free(capture->trigger);
+    }
+    capture->trigger = trigger;
+    return kIOReturnSuccess;
+}
+
+static int IsArchivePath(const char* path)
+{
+    size_t length = strlen(path), suffix = strlen(PEAK_ARCHIVE_SUFFIX);
+    return length >= suffix && strcmp(path + length - suffix, PEAK_ARCHIVE_SUFFIX) == 0;
+}
+
+IOReturn PeakCaptureCreate(PeakCapture* capture)
+{
+    bzero(capture, sizeof(PeakCapture));
+    capture->fd = -1;
+    capture->oldestNs = ~0ULL;
+    PeakMergeInit(&capture->merge, PEAK_MERGE_DEFAULT_WINDOW_NS);
+    PeakHistogramReset(&capture->latency);
+    
+    capture->batch = malloc(PEAK_CAPTURE_MERGE_FRAMES * sizeof(CanMsg));
+    capture->records = malloc(PEAK_CAPTURE_WRITE_RECORDS * sizeof(PeakCaptureRecord));
+    if (capture->batch == NULL || capture->records == NULL)
+    {
+        free(capture->batch);
+        free(capture->records);
+        capture->batch = NULL;
+        capture->records = NULL;
+        return kIOReturnNoMemory;
+    }
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakCaptureAddChannel(PeakCapture* capture, UInt32 channel)
+{
+    IOReturn kr;
+    
+    if (channel >= PEAK_MAX_CHANNELS)
+        return kIOReturnBadArgument;
+    
+    // the writer may be merging the other rings meanwhile, this one is only published when it is ready
+    if (capture->rings[channel].slots == NULL)
+    {
+        kr = PeakRingCreate(&capture->rings[channel], PEAK_CAPTURE_RING_CAPACITY);
+        if (kr != kIOReturnSuccess)
+            return kr;
+    }
+    
+    PeakMergeAttach(&capture->merge, channel, &capture->rings[channel]);
+    return kIOReturnSuccess;
+}
+
+void PeakCaptureRemoveChannel(PeakCapture* capture, UInt32 channel)
+{
+    PeakMergeDetach(&capture->merge, channel);
+}
+
+static UInt32 Overflows(PeakCapture* capture)
+{
+    UInt32 i, overflows = __atomic_load_n(&capture->unrouted, __ATOMIC_RELAXED);
+    
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+        overflows += __atomic_load_n(&capture->rings[i].overflows, __ATOMIC_RELAXED);
+    return overflows;
+}
+
+static IOReturn OpenRecords(PeakCapture* capture, const char* path, UInt16 bitrate, UInt32 serial, UInt32 deviceNo)
+{
+    struct timespec now;
+    IOReturn kr;
+    
+    capture->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (capture->fd < 0)
+    {
+        fprintf(stderr, "Unable to open capture %s (%s)\n", path, strerror(errno));
+        return kIOReturnNotOpen;
+    }
+    
+    clock_gettime(CLOCK_REALTIME, &now);
+    bzero(&capture->header, sizeof(PeakCaptureHeader));
+    capture->header.magic      = PEAK_CAPTURE_MAGIC;
+    capture->header.version    = PEAK_CAPTURE_VERSION;
+    capture->header.headerSize = sizeof(PeakCaptureHeader);
+    capture->header.recordSize = sizeof(PeakCaptureRecord);
+    capture->header.bitrate    = bitrate;
+    capture->header.serial     = serial;
+    capture->header.deviceNo   = deviceNo;
+    capture->header.startNs    = (SInt64)now.tv_sec * 1000000000LL + now.tv_nsec;
+    
+    kr = WriteAll(capture, &capture->header, sizeof(PeakCaptureHeader));
+    if (kr != kIOReturnSuccess)
+    {
+        close(capture->fd);
+        capture->fd = -1;
+        return kr;
+    }
+    
+    // without memory for the index the capture still works, it is indexed when it is read
+    capture->path = strdup(path);
+    capture->index = malloc(sizeof(PeakIndexBuilder));
+    if (capture->index && PeakIndexBuilderInit(capture->index) != kIOReturnSuccess)
+    {
+        PeakIndexBuilderFree(capture->index);
+        free(capture->index);
+        capture->index = NULL;
+    }
+    return kIOReturnSuccess;
+}
+
+// The archive has its chunk directory, it needs no index.
+static IOReturn OpenArchive(PeakCapture* capture, const char* path, UInt16 bitrate, UInt32 serial, UInt32 deviceNo)
+{
+    IOReturn kr;
+    
+    capture->archive = malloc(sizeof(PeakArchiveWriter));
+    if (capture->archive == NULL)
+        return kIOReturnNoMemory;
+    
+    kr = PeakArchiveWriterOpen(capture->archive, path, bitrate, serial, deviceNo);
+    if (kr != kIOReturnSuccess)
+    {
+        free(capture->archive);
+        capture->archive = NULL;
+        return kr;
+    }
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakCaptureOpen(PeakCapture* capture, const char* path, UInt16 bitrate, UInt32 serial, UInt32 deviceNo)
+{
+    IOReturn kr;
+    UInt32 i;
+    
+    if (capture->records == NULL)
+        return kIOReturnNotOpen;
+    
+    if (capture->fd >= 0 || capture->archive)
+        return kIOReturnBusy;
+    
+    bzero(&capture->stats, sizeof(PeakCaptureStats));
+    if (IsArchivePath(path))
+        kr = OpenArchive(capture, path, bitrate, serial, deviceNo);
+    else
+        kr = OpenRecords(capture, path, bitrate, serial, deviceNo);
+    if (kr != kIOReturnSuccess)
+        return kr;
+    
+    // frames left over from a close that raced with the decoder belong to the previous file
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+    {
+        if (capture->rings[i].slots)
+            capture->rings[i].tail = __atomic_load_n(&capture->rings[i].head, __ATOMIC_ACQUIRE);
+    }
+    capture->overflowBase = Overflows(capture);
+    
+    __atomic_store_n(&capture->enabled, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&capture->thread, NULL, WriterThread, capture) != 0)
+    {
+        __atomic_store_n(&capture->enabled, 0, __ATOMIC_RELEASE);
+        if (capture->archive)
+        {
+            ReleaseArchive(capture);
+        }
+        else
+        {
+            close(capture->fd);
+            capture->fd = -1;
+            ReleaseIndex(capture);
+        }
+        return kIOReturnNoResources;
+    }
+    
+    return kIOReturnSuccess;
+}
+
+void PeakCaptureClose(PeakCapture* capture)
+{
+    if (capture->fd < 0 && capture->archive == NULL)
+        return;
+    
+    __atomic_store_n(&capture->enabled, 0, __ATOMIC_RELEASE);
+    pthread_join(capture->thread, NULL);
+    
+    if (capture->archive)
+    {
+        if (ReleaseArchive(capture) != kIOReturnSuccess)
+            capture->stats.errors++;
+        return;
+    }
+    
+    if (fsync(capture->fd) != 0 || close(capture->fd) != 0)
+        capture->stats.errors++;
+    capture->fd = -1;
+    
+    if (capture->index && capture->path)
+        PeakIndexBuilderWrite(capture->index, capture->path);
+    ReleaseIndex(capture);
+}
+
+int PeakCaptureIsOpen(PeakCapture* capture)
+{
+    return __atomic_load_n(&capture->enabled, __ATOMIC_ACQUIRE) != 0;
+}
+
+#pragma mark - Decoder side
+
+void PeakCaptureAppend(PeakCapture* capture, const CanMsg* msg)
+{
+    PeakRing* ring = &capture->rings[msg->channel];
+    CanMsg* slot;
+    
+    if (!__atomic_load_n(&capture->enabled, __ATOMIC_ACQUIRE))
+        return;
+    
+    if (ring->slots == NULL)
+    {
+        __atomic_add_fetch(&capture->unrouted, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    
+    // counted as a ring overflow if the writer fell behind
+    slot = PeakRingReserve(ring);
+    if (slot == NULL)
+        return;
+    
+    *slot = *msg;
+    PeakRingCommit(ring);
+}
+
+void PeakCaptureNoteStatus(PeakCapture* capture, UInt32 channel, UInt64 monoNs, UInt8 function, UInt8 number)
+{
+    if (capture->trigger && __atomic_load_n(&capture->enabled, __ATOMIC_ACQUIRE))
+        PeakTriggerNoteStatus(capture->trigger, channel, monoNs, function, number);
+}
+
+#pragma mark - Statistics
+
+void PeakCaptureGetStats(PeakCapture* capture, PeakCaptureStats* stats)
+{
+    stats->frames  = __atomic_load_n(&capture->stats.frames, __ATOMIC_RELAXED);
+    stats->bytes   = __atomic_load_n(&capture->stats.bytes, __ATOMIC_RELAXED);
+    stats->writes  = __atomic_load_n(&capture->stats.writes, __ATOMIC_RELAXED);
+    stats->errors  = __atomic_load_n(&capture->stats.errors, __ATOMIC_RELAXED);
+    stats->dropped = Overflows(capture) - capture->overflowBase;
+}
@@ -0,0 +1,126 @@
+/*
+    File:           PeakCapture.h
+
+    Description:    Append-only binary capture files with fixed size records, written by a background
+                    thread so the bulk read completion never waits for the disk.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakCapture_h
+#define PeakLog_PeakCapture_h
+
+#include <pthread.h>
+
+#include "PeakUSB.h"
+#include "PeakMerge.h"
+#include "PeakHistogram.h"
+
+// A capture file is a PeakCaptureHeader followed by PeakCaptureRecords up to the end of the file, all
+// little endian. A file that was not closed properly is still valid up to its last complete record.
+#define PEAK_CAPTURE_MAGIC          0x50434b50  // "PKCP" on disk
+#define PEAK_CAPTURE_VERSION        1
+
+#define PEAK_CAPTURE_EXT            0x01        // flags, as the bit fields in CanMsg
+#define PEAK_CAPTURE_RTR            0x02
+#define PEAK_CAPTURE_ERR            0x04
+#define PEAK_CAPTURE_LOC            0x08
+
+#define PEAK_CAPTURE_RING_CAPACITY  65536       // frames between decoder and writer, a few seconds at 1 MBit/s
+#define PEAK_CAPTURE_MERGE_FRAMES   4096        // frames taken from the rings at once
+#define PEAK_CAPTURE_WRITE_RECORDS  32768       // records per write(), 768 KB
+#define PEAK_CAPTURE_POLL_NS        10000000ULL // writer wakes up every 10 ms
+#define PEAK_CAPTURE_FLUSH_NS       1000000000ULL // and writes out partial buffers after a second
+
+typedef struct {
+    UInt32  magic;
+    UInt16  version;
+    UInt16  headerSize;     // sizeof(PeakCaptureHeader) for version 1, records start here
+    UInt16  recordSize;     // sizeof(PeakCaptureRecord) for version 1
+    UInt16  bitrate;        // BTR0/BTR1 code as in CAN_BAUD_RATES
+    UInt32  serial;         // adapter serial number, 0 if unknown
+    UInt32  deviceNo;       // adapter device number
+    UInt32  reserved0;
+    SInt64  startNs;        // wall clock at the start of the capture, ns since 1970
+    UInt8   reserved[32];
+} __attribute__ ((packed)) PeakCaptureHeader;
+
+typedef struct {
+    UInt64  ts;             // ns since 1970
+    UInt32  canid;
+    UInt8   flags;          // PEAK_CAPTURE_...
+    UInt8   dlc;
+    UInt8   channel;        // adapter, 0 in files of a single one
+    UInt8   reserved;
+    UInt8   data[8];
+} __attribute__ ((packed)) PeakCaptureRecord;
+
+typedef struct {
+    UInt64  frames;         // records written to the file
+    UInt64  bytes;
+    UInt64  writes;         // write() calls
+    UInt32  dropped;        // frames lost because the writer fell behind
+    UInt32  errors;
+} PeakCaptureStats;
+
+// Each adapter's decoder appends frames to the ring of its channel, the writer thread merges them in time
+// order, converts them in batches into one large buffer and writes it in one go. The buffers are
+// allocated once in PeakCaptureCreate, a ring the first time its channel is added, and all of them are
+// reused by every capture.
+typedef struct {
+    PeakRing            rings[PEAK_MAX_CHANNELS];
+    PeakMerge           merge;
+    CanMsg*             batch;      // merged frames waiting for conversion
+    PeakCaptureRecord*  records;
+    pthread_t           thread;
+    int                 fd;
+    UInt32              enabled;    // the decoder may append
+    UInt32              overflowBase; // ring overflows before this capture
+    UInt32              unrouted;   // frames of a channel without a ring
+    char*               path;
+    struct PeakIndexBuilder* index; // sidecar index collected by the writer, see PeakIndex.h
+    struct PeakArchiveWriter* archive; // paths ending in PEAK_ARCHIVE_SUFFIX, instead of fd, see PeakArchive.h
+    struct PeakTrigger* trigger;    // only the frames of its windows are written, NULL for all, see PeakTrigger.h
+    PeakCaptureHeader   header;
+    PeakCaptureStats    stats;
+    UInt64              oldestNs;   // USB completion of the oldest frame not yet written
+    PeakHistogram       latency;    // from there to the write of its block, written by the writer thread
+} PeakCapture;
+
+void PeakCaptureRecordFromMsg(PeakCaptureRecord* record, const CanMsg* msg);
+void PeakCaptureRecordToMsg(const PeakCaptureRecord* record, CanMsg* msg);
+IOReturn PeakCaptureReadHeader(int fd, PeakCaptureHeader* header);
+
+IOReturn PeakCaptureCreate(PeakCapture* capture);
+// An adapter appending to the capture, frames of channels not added are counted as dropped.
+IOReturn PeakCaptureAddChannel(PeakCapture* capture, UInt32 channel);
+void PeakCaptureRemoveChannel(PeakCapture* capture, UInt32 channel);
+// While closed: the following captures only write the windows of a trigger, NULL writes everything again.
+IOReturn PeakCaptureSetTrigger(PeakCapture* capture, const PeakTriggerConfig* config);
+// A path ending in PEAK_ARCHIVE_SUFFIX is written as a compressed archive rather than as records.
+IOReturn PeakCaptureOpen(PeakCapture* capture, const char* path, UInt16 bitrate, UInt32 serial, UInt32 deviceNo);
+void PeakCaptureClose(PeakCapture* capture);
+int PeakCaptureIsOpen(PeakCapture* capture);
+
+// decoder side, never blocks, one thread per channel
+void PeakCaptureAppend(PeakCapture* capture, const CanMsg* msg);
+// a status record for the trigger, PCAN function and number
+void PeakCaptureNoteStatus(PeakCapture* capture, UInt32 channel, UInt64 monoNs, UInt8 function, UInt8 number);
+
+void PeakCaptureGetStats(PeakCapture* capture, PeakCaptureStats* stats);
+
+#endif
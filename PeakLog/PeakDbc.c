@@ -0,0 +1,605 @@
+/*
+    File:           PeakDbc.c
+
+    Description:    Signals of a DBC database compiled into flat extraction plans, decoded per frame for
+                    the log window or per batch into a column for each signal.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "PeakDbc.h"
+
+#define VECTOR_INDEPENDENT_SIGNALS  0xC0000000  // the pseudo message of signals without one
+
+#define MANTISSA_EXPONENT           0x4330000000000000ULL   // the bits of 2^52
+#define MANTISSA_BIAS               4503599627370496.0
+
+#pragma mark - Plans
+
+// Fills in the plan of a signal from its DBC layout, start is the LSB for Intel and the MSB for
+// Motorola signals in the bit numbering of the DBC (bit 0 is the LSB of the first byte).
+static int CompileSignal(PeakDbcSignal* sig, UInt32 start, UInt32 bits, int motorola, int isSigned)
+{
+    SInt32 shift;
+    
+    if (bits == 0 || bits > 64 || start > 63)
+        return 0;
+    
+    if (motorola)
+    {
+        // in the byte swapped word the first byte is the most significant one
+        shift = (SInt32)((7 - start / 8) * 8 + start % 8) - (SInt32)(bits - 1);
+        if (shift < 0)
+            return 0;
+        sig->bytes = 8 - shift / 8;
+    }
+    else
+    {
+        shift = (SInt32)start;
+        if (start + bits > 64)
+            return 0;
+        sig->bytes = (start + bits + 7) / 8;
+    }
+    
+    sig->motorola = motorola ? 1 : 0;
+    sig->shift    = (UInt8)shift;
+    sig->bits     = (UInt8)bits;
+    sig->mask     = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+    sig->sign     = isSigned ? 1ULL << (bits - 1) : 0;
+    sig->narrow   = bits <= 52;
+    return 1;
+}
+
+static inline double SignalValue(const PeakDbcSignal* sig, UInt64 word, UInt64 swapped)
+{
+    UInt64 raw = ((sig->motorola ? swapped : word) >> sig->shift) & sig->mask;
+    union { UInt32 u; float f; } f32;
+    union { UInt64 u; double d; } f64;
+    
+    switch (sig->type)
+    {
+        case PEAK_DBC_FLOAT:
+            f32.u = (UInt32)raw;
+            return f32.f * sig->factor + sig->offset;
+        case PEAK_DBC_DOUBLE:
+            f64.u = raw;
+            return f64.d * sig->factor + sig->offset;
+    }
+    return (double)(SInt64)((raw ^ sig->sign) - sig->sign) * sig->factor + sig->offset;
+}
+
+#pragma mark - Parser
+
+// the next token separated by blanks, cut out in place
+static char* Token(char** ptr)
+{
+    char* start = *ptr + strspn(*ptr, " \t\r\n");
+    char* end = start + strcspn(start, " \t\r\n");
+    
+    if (*start == 0)
+        return NULL;
+    
+    *ptr = *end ? end + 1 : end;
+    *end = 0;
+    return start;
+}
+
+// names longer than size - 1 are cut
+static void CopyName(char* dst, const char* src, size_t size)
+{
+    size_t n = strnlen(src, size - 1);
+    
+    memcpy(dst, src, n);
+    dst[n] = 0;
+}
+
+static PeakDbcMessage* FindMessage(PeakDbc* dbc, unsigned long id)
+{
+    UInt32 i;
+    
+    for (i = 0; i < dbc->messageCount; i++)
+    {
+        if (dbc->messages[i].canid == (id & 0x1fffffff) && dbc->messages[i].ext == ((id & PEAK_DBC_EXT) != 0))
+            return &dbc->messages[i];
+    }
+    return NULL;
+}
+
+static int ParseMessage(PeakDbc* dbc, char* line, UInt32* capacity)
+{
+    char *ptr = line, *token, *colon;
+    PeakDbcMessage* msg;
+    unsigned long id;
+    
+    Token(&ptr); // BO_
+    if ((token = Token(&ptr)) == NULL)
+        return 0;
+    id = strtoul(token, NULL, 10);
+    if (id == VECTOR_INDEPENDENT_SIGNALS)
+        return -1;
+    
+    if (dbc->messageCount == *capacity)
+    {
+        PeakDbcMessage* grown = realloc(dbc->messages, 2 * *capacity * sizeof(PeakDbcMessage));
+        if (grown == NULL)
+            return 0;
+        dbc->messages = grown;
+        *capacity *= 2;
+    }
+    
+    msg = &dbc->messages[dbc->messageCount];
+    bzero(msg, sizeof(PeakDbcMessage));
+    msg->canid = (UInt32)(id & 0x1fffffff);
+    msg->ext   = (id & PEAK_DBC_EXT) != 0;
+    msg->muxer = -1;
+    
+    // "Name:" or "Name :"
+    if ((token = Token(&ptr)) == NULL)
+        return 0;
+    if ((colon = strchr(token, ':')) != NULL)
+        *colon = 0;
+    CopyName(msg->name, token, PEAK_DBC_NAME);
+    if (colon == NULL)
+        Token(&ptr);
+    if ((token = Token(&ptr)) != NULL)
+        msg->dlc = (UInt8)strtoul(token, NULL, 10);
+    
+    dbc->messageCount++;
+    return 1;
+}
+
+static int ParseSignal(PeakDbcMessage* msg, char* line, UInt32* capacity)
+{
+    char *ptr = line, *colon = strchr(line, ':'), *token, *name, *mux = NULL;
+    char order, sign, unit[PEAK_DBC_UNIT] = "";
+    unsigned start, bits;
+    double factor, offset, min, max;
+    PeakDbcSignal sig;
+    
+    if (colon == NULL)
+        return 0;
+    *colon = 0;
+    
+    Token(&ptr); // SG_
+    name = Token(&ptr);
+    if (name && (token = Token(&ptr)) != NULL)
+        mux = token;
+    if (name == NULL)
+        return 0;
+    
+    if (sscanf(colon + 1, " %u|%u@%c%c (%lf,%lf) [%lf|%lf] \"%16[^\"]\"", &start, &bits, &order, &sign, &factor, &offset, &min, &max, unit) < 6)
+        return 0;
+    
+    bzero(&sig, sizeof(PeakDbcSignal));
+    CopyName(sig.name, name, PEAK_DBC_NAME);
+    CopyName(sig.unit, unit, PEAK_DBC_UNIT);
+    sig.factor = factor;
+    sig.offset = offset;
+    sig.mux    = -1;
+    if (!CompileSignal(&sig, start, bits, order == '0', sign == '-'))
+    {
+        fprintf(stderr, "Signal %s of %s does not fit into eight bytes.\n", sig.name, msg->name);
+        return -1;
+    }
+    
+    if (mux && mux[0] == 'M')
+        msg->muxer = (SInt16)msg->signalCount;
+    else if (mux && mux[0] == 'm')
+        sig.mux = (SInt16)strtol(mux + 1, NULL, 10);
+    
+    if (msg->signalCount == *capacity)
+    {
+        UInt32 size = *capacity ? 2 * *capacity : 8;
+        PeakDbcSignal* grown = realloc(msg->signals, size * sizeof(PeakDbcSignal));
+        if (grown == NULL)
+            return 0;
+        msg->signals = grown;
+        *capacity = size;
+    }
+    
+    msg->signals[msg->signalCount++] = sig;
+    msg->motorola |= sig.motorola;
+    return 1;
+}
+
+// SIG_VALTYPE_ <id> <signal> : <1|2>;
+static void ParseValueType(PeakDbc* dbc, char* line)
+{
+    char *ptr = line, *token, *name;
+    PeakDbcMessage* msg;
+    UInt32 i, type;
+    
+    Token(&ptr);
+    if ((token = Token(&ptr)) == NULL || (msg = FindMessage(dbc, strtoul(token, NULL, 10))) == NULL)
+        return;
+    if ((name = Token(&ptr)) == NULL || (token = strchr(ptr, ':')) == NULL)
+        return;
+    
+    type = (UInt32)strtoul(token + 1, NULL, 10);
+    for (i = 0; i < msg->signalCount; i++)
+    {
+        PeakDbcSignal* sig = &msg->signals[i];
+        
+        if (strcmp(sig->name, name) != 0)
+            continue;
+        if ((type == PEAK_DBC_FLOAT && sig->bits == 32) || (type == PEAK_DBC_DOUBLE && sig->bits == 64))
+        {
+            sig->type = type;
+            sig->sign = 0;
+            sig->narrow = 0;
+        }
+    }
+}
+
+static IOReturn BuildIndex(PeakDbc* dbc)
+{
+    UInt32 i, extCount = 0, size = 16, slot, key;
+    
+    for (i = 0; i < dbc->messageCount; i++)
+    {
+        const PeakDbcMessage* msg = &dbc->messages[i];
+        
+        if (msg->ext)
+            extCount++;
+        else if (msg->canid < PEAK_DBC_STD_IDS)
+            dbc->std[msg->canid] = i + 1;
+        
+        dbc->signalCount += msg->signalCount;
+        if (msg->signalCount > dbc->maxSignals)
+            dbc->maxSignals = msg->signalCount;
+    }
+    
+    // at most half full
+    while (size < 2 * extCount)
+        size *= 2;
+    dbc->extKeys = calloc(size, sizeof(UInt32));
+    dbc->extIndex = calloc(size, sizeof(UInt16));
+    dbc->extMask = size - 1;
+    
+    dbc->counts  = calloc(dbc->messageCount, sizeof(UInt32));
+    dbc->starts  = calloc(dbc->messageCount, sizeof(UInt32));
+    dbc->order   = malloc(PEAK_DBC_BATCH * sizeof(UInt32));
+    dbc->which   = malloc(PEAK_DBC_BATCH * sizeof(UInt32));
+    dbc->rows    = malloc(PEAK_DBC_BATCH * sizeof(UInt32));
+    dbc->words   = malloc(PEAK_DBC_BATCH * sizeof(UInt64));
+    dbc->swapped = malloc(PEAK_DBC_BATCH * sizeof(UInt64));
+    dbc->lengths = malloc(PEAK_DBC_BATCH * sizeof(UInt8));
+    dbc->muxes   = malloc(PEAK_DBC_BATCH * sizeof(SInt64));
+    dbc->values  = malloc((size_t)PEAK_DBC_BATCH * (dbc->maxSignals ? dbc->maxSignals : 1) * sizeof(double));
+    dbc->blocks  = malloc(PEAK_DBC_BATCH * sizeof(PeakDbcBlock));
+    
+    if (!dbc->extKeys || !dbc->extIndex || !dbc->counts || !dbc->starts || !dbc->order || !dbc->which || !dbc->rows ||
+        !dbc->words || !dbc->swapped || !dbc->lengths || !dbc->muxes || !dbc->values || !dbc->blocks)
+        return kIOReturnNoMemory;
+    
+    for (i = 0; i < dbc->messageCount; i++)
+    {
+        if (!dbc->messages[i].ext)
+            continue;
+        
+        key = dbc->messages[i].canid | PEAK_DBC_EXT;
+        slot = (key * 2654435761u) & dbc->extMask;
+        while (dbc->extKeys[slot] != 0 && dbc->extKeys[slot] != key)
+            slot = (slot + 1) & dbc->extMask;
+        dbc->extKeys[slot] = key;
+        dbc->extIndex[slot] = i + 1;
+    }
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakDbcLoad(PeakDbc* dbc, const char* path)
+{
+    UInt32 capacity = 64, signals = 0;
+    PeakDbcMessage* msg = NULL;
+    char* line = NULL;
+    size_t size = 0;
+    IOReturn kr;
+    int found;
+    FILE* file;
+    
+    bzero(dbc, sizeof(PeakDbc));
+    if ((file = fopen(path, "r")) == NULL)
+    {
+        fprintf(stderr, "Unable to open DBC file %s.\n", path);
+        return kIOReturnNotOpen;
+    }
+    
+    dbc->messages = malloc(capacity * sizeof(PeakDbcMessage));
+    if (dbc->messages == NULL)
+    {
+        fclose(file);
+        return kIOReturnNoMemory;
+    }
+    
+    while (getline(&line, &size, file) > 0)
+    {
+        const char* start = line + strspn(line, " \t");
+        
+        if (strncmp(start, "BO_ ", 4) == 0)
+        {
+            found = ParseMessage(dbc, line, &capacity);
+            msg = found > 0 ? &dbc->messages[dbc->messageCount - 1] : NULL;
+            signals = 0;
+        }
+        else if (strncmp(start, "SG_ ", 4) == 0 && msg)
+        {
+            ParseSignal(msg, line, &signals);
+        }
+        else if (strncmp(start, "SIG_VALTYPE_ ", 13) == 0)
+        {
+            ParseValueType(dbc, line);
+        }
+    }
+    free(line);
+    fclose(file);
+    
+    if (dbc->messageCount == 0 || dbc->messageCount >= 0xffff)
+    {
+        fprintf(stderr, "No messages in %s.\n", path);
+        PeakDbcFree(dbc);
+        return kIOReturnBadArgument;
+    }
+    
+    kr = BuildIndex(dbc);
+    if (kr != kIOReturnSuccess)
+        PeakDbcFree(dbc);
+    return kr;
+}
+
+void PeakDbcFree(PeakDbc* dbc)
+{
+    UInt32 i;
+    
+    for (i = 0; dbc->messages && i < dbc->messageCount; i++)
+        free(dbc->messages[i].signals);
+    free(dbc->messages);
+    free(dbc->extKeys);
+    free(dbc->extIndex);
+    free(dbc->counts);
+    free(dbc->starts);
+    free(dbc->order);
+    free(dbc->which);
+    free(dbc->rows);
+    free(dbc->words);
+    free(dbc->swapped);
+    free(dbc->lengths);
+    free(dbc->muxes);
+    free(dbc->values);
+    free(dbc->blocks);
+    bzero(dbc, sizeof(PeakDbc));
+}
+
+#pragma mark - Single frames
+
+static inline UInt32 IndexOf(const PeakDbc* dbc, const CanMsg* msg)
+{
+    UInt32 key, slot;
+    
+    if (msg->err || msg->rtr)
+        return 0;
+    if (!msg->ext)
+        return msg->canid.ul < PEAK_DBC_STD_IDS ? dbc->std[msg->canid.ul] : 0;
+    
+    key = (msg->canid.ul & 0x1fffffff) | PEAK_DBC_EXT;
+    slot = (key * 2654435761u) & dbc->extMask;
+    while (dbc->extKeys[slot] != 0)
+    {
+        if (dbc->extKeys[slot] == key)
+            return dbc->extIndex[slot];
+        slot = (slot + 1) & dbc->extMask;
+    }
+    return 0;
+}
+
+const PeakDbcMessage* PeakDbcLookup(const PeakDbc* dbc, const CanMsg* msg)
+{
+    UInt32 index = dbc->messages ? IndexOf(dbc, msg) : 0;
+    return index ? &dbc->messages[index - 1] : NULL;
+}
+
+UInt32 PeakDbcDecodeFrame(const PeakDbc* dbc, const CanMsg* msg, double* values)
+{
+    const PeakDbcMessage* m = PeakDbcLookup(dbc, msg);
+    UInt64 swapped = __builtin_bswap64(msg->ldata);
+    SInt64 mux = -1;
+    UInt32 i;
+    
+    if (m == NULL)
+        return 0;
+    
+    if (m->muxer >= 0 && msg->len >= m->signals[m->muxer].bytes)
+        mux = (SInt64)SignalValue(&m->signals[m->muxer], msg->ldata, swapped);
+    
+    for (i = 0; i < m->signalCount; i++)
+    {
+        const PeakDbcSignal* sig = &m->signals[i];
+        
+        if (msg->len < sig->bytes || (sig->mux >= 0 && sig->mux != mux))
+            values[i] = NAN;
+        else
+            values[i] = SignalValue(sig, msg->ldata, swapped);
+    }
+    return m->signalCount;
+}
+
+UInt32 PeakDbcDescribe(const PeakDbc* dbc, const CanMsg* msg, char* buffer, UInt32 size)
+{
+    const PeakDbcMessage* m = PeakDbcLookup(dbc, msg);
+    double values[256];
+    UInt32 i, length;
+    int n;
+    
+    if (size)
+        buffer[0] = 0;
+    if (m == NULL || m->signalCount > 256 || size == 0)
+        return 0;
+    
+    PeakDbcDecodeFrame(dbc, msg, values);
+    n = snprintf(buffer, size, "%s:", m->name);
+    length = n < (int)size ? (UInt32)n : size - 1;
+    
+    for (i = 0; i < m->signalCount && length < size - 1; i++)
+    {
+        const PeakDbcSignal* sig = &m->signals[i];
+        
+        if (isnan(values[i]))
+            continue;
+        n = snprintf(buffer + length, size - length, sig->unit[0] ? " %s=%g %s" : " %s=%g", sig->name, values[i], sig->unit);
+        length += n < (int)(size - length) ? (UInt32)n : size - length - 1;
+    }
+    return length;
+}
+
+#pragma mark - Batches
+
+// One signal of a block of frames into a column. The loops have no branches and unit strides, so the
+// compiler can run them on vectors; narrow integers convert through the mantissa of a double, which
+// unlike an SInt64 conversion needs nothing beyond SSE2.
+static void ExtractColumn(const PeakDbcSignal* sig, const UInt64* words, UInt32 count, double* out)
+{
+    const UInt64 mask = sig->mask, sign = sig->sign;
+    const UInt32 shift = sig->shift;
+    const double factor = sig->factor, offset = sig->offset;
+    UInt32 i;
+    
+    if (sig->type != PEAK_DBC_INTEGER)
+    {
+        for (i = 0; i < count; i++)
+            out[i] = SignalValue(sig, words[i], words[i]);
+    }
+    else if (sig->narrow)
+    {
+        // raw ^ sign is the value biased to be positive, below 2^52 it is the mantissa of 2^52 + raw ^ sign
+        const double bias = MANTISSA_BIAS + (double)sign;
+        
+        for (i = 0; i < count; i++)
+        {
+            UInt64 biased = (((words[i] >> shift) & mask) ^ sign) | MANTISSA_EXPONENT;
+            double value;
+            
+            memcpy(&value, &biased, sizeof(double));
+            out[i] = (value - bias) * factor + offset;
+        }
+    }
+    else
+    {
+        for (i = 0; i < count; i++)
+            out[i] = (double)(SInt64)((((words[i] >> shift) & mask) ^ sign) - sign) * factor + offset;
+    }
+}
+
+UInt32 PeakDbcDecodeBatch(PeakDbc* dbc, const CanMsg* msgs, UInt32 count, const PeakDbcBlock** blocks)
+{
+    UInt32 i, j, m, n, s, first, seen = 0, pos = 0, arena = 0;
+    UInt8 shortest;
+    
+    *blocks = dbc->blocks;
+    if (dbc->messages == NULL)
+        return 0;
+    if (count > PEAK_DBC_BATCH)
+        count = PEAK_DBC_BATCH;
+    
+    // how many frames of each message
+    for (i = 0; i < count; i++)
+    {
+        m = dbc->which[i] = IndexOf(dbc, &msgs[i]);
+        if (m && dbc->counts[m - 1]++ == 0)
+            dbc->order[seen++] = m - 1;
+    }
+    
+    for (j = 0; j < seen; j++)
+    {
+        m = dbc->order[j];
+        dbc->starts[m] = pos;
+        pos += dbc->counts[m];
+    }
+    
+    // the payloads grouped by message, starts end up behind each group
+    for (i = 0; i < count; i++)
+    {
+        if ((m = dbc->which[i]) == 0)
+            continue;
+        pos = dbc->starts[m - 1]++;
+        dbc->rows[pos]    = i;
+        dbc->words[pos]   = msgs[i].ldata;
+        dbc->lengths[pos] = msgs[i].len;
+    }
+    
+    for (j = 0; j < seen; j++)
+    {
+        const PeakDbcMessage* msg = &dbc->messages[dbc->order[j]];
+        double* values = dbc->values + arena;
+        
+        m = dbc->order[j];
+        n = dbc->counts[m];
+        first = dbc->starts[m] - n;
+        
+        if (msg->motorola)
+        {
+            for (i = first; i < first + n; i++)
+                dbc->swapped[i] = __builtin_bswap64(dbc->words[i]);
+        }
+        
+        shortest = 8;
+        for (i = first; i < first + n; i++)
+            shortest = dbc->lengths[i] < shortest ? dbc->lengths[i] : shortest;
+        
+        // the switch first, the multiplexed signals compare against it
+        if (msg->muxer >= 0)
+        {
+            const PeakDbcSignal* sig = &msg->signals[msg->muxer];
+            const UInt64* words = sig->motorola ? dbc->swapped : dbc->words;
+            
+            for (i = first; i < first + n; i++)
+                dbc->muxes[i] = dbc->lengths[i] >= sig->bytes ? (SInt64)((words[i] >> sig->shift) & sig->mask) : -1;
+        }
+        
+        // usually every frame is complete and no signal multiplexed, the fixups below are the exception
+        for (s = 0; s < msg->signalCount; s++)
+        {
+            const PeakDbcSignal* sig = &msg->signals[s];
+            double* out = values + s * n;
+            
+            ExtractColumn(sig, (sig->motorola ? dbc->swapped : dbc->words) + first, n, out);
+            
+            if (shortest < sig->bytes)
+            {
+                for (i = 0; i < n; i++)
+                    out[i] = dbc->lengths[first + i] >= sig->bytes ? out[i] : NAN;
+            }
+            if (sig->mux >= 0)
+            {
+                for (i = 0; i < n; i++)
+                    out[i] = dbc->muxes[first + i] == sig->mux ? out[i] : NAN;
+            }
+        }
+        
+        dbc->blocks[j].message = m;
+        dbc->blocks[j].count   = n;
+        dbc->blocks[j].rows    = dbc->rows + first;
+        dbc->blocks[j].values  = values;
+        arena += n * msg->signalCount;
+        dbc->counts[m] = 0;
+    }
+    
+    return seen;
+}
@@ -0,0 +1,119 @@
+/*
+    File:           PeakDbc.h
+
+    Description:    Signals of a DBC database compiled into flat extraction plans, decoded per frame for
+                    the log window or per batch into a column for each signal.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakDbc_h
+#define PeakLog_PeakDbc_h
+
+#include "PeakUSB.h"
+#include "PeakBatch.h"
+
+#define PEAK_DBC_BATCH              PEAK_BATCH_MAX_FRAMES   // frames per PeakDbcDecodeBatch
+#define PEAK_DBC_NAME               33      // names with the terminating 0, longer ones are cut
+#define PEAK_DBC_UNIT               17
+#define PEAK_DBC_STD_IDS            2048    // 11 bit identifiers, indexed directly
+#define PEAK_DBC_EXT                0x80000000  // the ext flag of a DBC message id
+
+// signal value types, SIG_VALTYPE_
+#define PEAK_DBC_INTEGER            0
+#define PEAK_DBC_FLOAT              1
+#define PEAK_DBC_DOUBLE             2
+
+// The plan of a signal: the payload as a 64 bit word, byte swapped for Motorola signals, is shifted right
+// and masked; signed values are sign extended by (raw ^ sign) - sign, then scaled.
+typedef struct {
+    char    name[PEAK_DBC_NAME];
+    char    unit[PEAK_DBC_UNIT];
+    UInt8   motorola;       // big endian, taken from the byte swapped word
+    UInt8   shift;
+    UInt8   bits;
+    UInt8   bytes;          // the payload must be at least this long
+    UInt8   type;           // PEAK_DBC_INTEGER, _FLOAT or _DOUBLE
+    UInt8   narrow;         // at most 52 bits, converts exactly through the mantissa of a double
+    SInt16  mux;            // multiplexed: the multiplexer value it is sent with, else -1
+    UInt64  mask;
+    UInt64  sign;           // top bit of a signed signal, else 0
+    double  factor;
+    double  offset;
+} PeakDbcSignal;
+
+typedef struct {
+    char            name[PEAK_DBC_NAME];
+    UInt32          canid;
+    UInt8           ext;
+    UInt8           dlc;
+    SInt16          muxer;          // index of the multiplexer switch, -1 if none
+    UInt8           motorola;       // some signal needs the byte swapped payload
+    UInt32          signalCount;
+    PeakDbcSignal*  signals;
+} PeakDbcMessage;
+
+// The frames of one message in a batch, the values signal after signal: values[signal * count + frame].
+// Signals missing from a frame, too short or sent with another multiplexer value, are NAN.
+typedef struct {
+    UInt32          message;        // index into messages
+    UInt32          count;
+    const UInt32*   rows;           // the frames' positions in the batch
+    const double*   values;
+} PeakDbcBlock;
+
+typedef struct {
+    PeakDbcMessage* messages;
+    UInt32          messageCount;
+    UInt32          maxSignals;     // of any message
+    UInt32          signalCount;    // all together
+    UInt16          std[PEAK_DBC_STD_IDS];  // message index + 1, 0 if unknown
+    UInt32*         extKeys;        // open addressing for the 29 bit identifiers
+    UInt16*         extIndex;
+    UInt32          extMask;
+    // batch buffers, allocated once the database is loaded
+    UInt32*         counts;         // frames per message in the current batch
+    UInt32*         starts;
+    UInt32*         order;          // messages seen in the batch, in order of appearance
+    UInt32*         which;          // message index + 1 of every frame in the batch
+    UInt32*         rows;
+    UInt64*         words;          // payloads grouped by message
+    UInt64*         swapped;
+    UInt8*          lengths;
+    SInt64*         muxes;
+    double*         values;
+    PeakDbcBlock*   blocks;
+} PeakDbc;
+
+// Parses the BO_, SG_ and SIG_VALTYPE_ lines of a DBC file, everything else is skipped. Signals that do
+// not fit into eight bytes are left out with a warning.
+IOReturn PeakDbcLoad(PeakDbc* dbc, const char* path);
+void PeakDbcFree(PeakDbc* dbc);
+
+// the message of a frame, NULL if the database has none
+const PeakDbcMessage* PeakDbcLookup(const PeakDbc* dbc, const CanMsg* msg);
+
+// One frame into values (room for maxSignals), returns the message's signal count, 0 if unknown.
+UInt32 PeakDbcDecodeFrame(const PeakDbc* dbc, const CanMsg* msg, double* values);
+// "Name: signal=value unit ..." into buffer, truncated to size. Returns the length, 0 if unknown.
+UInt32 PeakDbcDescribe(const PeakDbc* dbc, const CanMsg* msg, char* buffer, UInt32 size);
+
+// Up to PEAK_DBC_BATCH frames, as they come from PeakBatcherDrain, grouped by message and decoded into
+// columns. Returns the number of blocks; they stay valid until the next batch.
+UInt32 PeakDbcDecodeBatch(PeakDbc* dbc, const CanMsg* msgs, UInt32 count, const PeakDbcBlock** blocks);
+
+#endif
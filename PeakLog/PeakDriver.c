@@ -0,0 +1,1568 @@
+/*
+    File:           PeakDriver.c
+ 
+    Description:    Transport independent part of the user-space driver for PEAK PCAN-USB CAN to USB
+                    Adapters: init sequence, telegram decoding/encoding and timestamps.
+                    Based on the pcan linux driver.
+ 
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+ 
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+ 
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "PeakUSB.h"
+#include "PeakRing.h"
+#include "PeakMerge.h"
+#include "PeakBatch.h"
+#include "PeakRxQueue.h"
+#include "PeakTxQueue.h"
+#include "PeakCapture.h"
+#include "PeakTrigger.h"
+#include "PeakFilter.h"
+#include "PeakAcceptance.h"
+#include "PeakTimebase.h"
+#include "PeakHistogram.h"
+#include "PeakBusStats.h"
+#include "PeakTransport.h"
+#include "PeakLive.h"
+#include "PeakStream.h"
+
+#pragma mark Globals
+
+// Everything belonging to one adapter. The decoder of each adapter runs on its backend's thread and
+// fills the adapter's own ring, the rings are merged in time order for the display and the capture.
+typedef struct {
+    PeakTransport*      transport;          // NULL while the slot is free
+    UInt32              channel;            // index in gDevices, tagged on every frame
+    PCAN_USB_TIME       usbTime;
+    PeakTimebase        timebase;
+    UInt16              bitrate;
+    PeakRing            ring;               // kept for the slot once allocated
+    PeakRxQueue         rxQueue;
+    PeakTxQueue         txQueue;
+    int                 txCreated;
+    UInt32              serial;
+    UInt32              deviceNo;
+    UInt64              telegrams;
+    UInt64              malformed;          // telegrams dropped by the decoder
+    UInt64              frames;
+    UInt64              statusRecords;
+    UInt64              filtered;
+    UInt64              exactFrames;
+    UInt64              exactDropped;
+    UInt64              overruns;           // overrun status records
+    UInt64              decodeNs;
+    PeakHistogram       usbLatency;         // adapter timestamp to USB completion, per frame
+    PeakHistogram       decodeLatency;      // USB completion to decode done, per telegram
+    PeakBusStats*       busStats;           // every frame on the bus, before any filter
+    PeakLive*           live;               // NULL unless the frames are shared, see PeakStartSharing
+    UInt64              epoch;              // odd while the decoder is in a buffer, see WaitForDecoders
+} PeakDevice;
+
+// the latency stages, in the order of PeakInstrumentStats
+#define STAGE_USB                   0
+#define STAGE_DECODE                1
+#define STAGE_DEQUEUE               2
+#define STAGE_DISPLAY               3
+#define STAGE_CAPTURE               4
+#define STAGES                      5
+
+#ifdef __APPLE__
+static PeakTransport*               gTransport = &gPeakIOKitTransport;
+#elif defined(PEAK_NO_LIBUSB)
+static PeakTransport*               gTransport = &gPeakLoopbackTransport; // built without libusb, see Makefile
+#else
+static PeakTransport*               gTransport = &gPeakLibusbTransport;
+#endif
+static PeakDevice                   gDevices[PEAK_MAX_CHANNELS];
+static pthread_mutex_t              gDeviceLock = PTHREAD_MUTEX_INITIALIZER; // attach, detach and init
+static UInt32                       gDeviceCount = 0;
+static PeakObserverFunc             gObserver = NULL;
+static void*                        gObserverRefCon = NULL;
+
+static int                          gMsgCounter = 0;    // frames of all adapters in the current second
+static int                          gMsgRate = 0;       // the previous second's, posted with "CanDevice"
+static time_t                       gLast = 0;
+static UInt16                       gLastBitrate = CAN_BAUD_125K;
+static PeakMerge                    gMerge;
+static UInt64                       gMergeWindow = PEAK_MERGE_DEFAULT_WINDOW_NS;
+static PeakBatcher                  gRxBatcher;
+static UInt32                       gRxDepth = PEAK_RX_DEFAULT_DEPTH;
+static PeakCapture                  gCapture;
+static int                          gCaptureCreated = 0;
+static PeakFilterProgram*           gFilter = NULL;     // NULL passes everything
+static pthread_mutex_t              gFilterLock = PTHREAD_MUTEX_INITIALIZER; // gFilter outside the decoders
+static PeakAcceptance               gAcceptance = { { 0, 0, 0, 0 }, { 0xff, 0xff, 0xff, 0xff }, 1 };
+static int                          gAcceptanceUsed = 0;    // registers to be written by PeakInit
+static PeakFilterProgram*           gExact = NULL;          // the identifiers behind gAcceptance
+static UInt32                       gExactCount = 0;
+static PeakHistogram                gDisplayed;             // written by the consumer
+static pthread_mutex_t              gStatsLock = PTHREAD_MUTEX_INITIALIZER; // the scratch histograms below
+static PeakHistogram                gStageSum[STAGES];      // all channels, since PeakStart
+static PeakHistogram                gStagePrev[STAGES];     // the same at the last "CanStats"
+static PeakHistogram                gStageTemp;
+static PeakInstrumentStats          gStatsPrev;
+static UInt64                       gStartNs = 0;
+static char                         gLivePrefix[PEAK_LIVE_NAME_MAX];   // empty while nothing is shared
+static UInt32                       gLiveCapacity = PEAK_LIVE_DEFAULT_CAPACITY;
+static PeakStream*                  gStream = NULL;     // NULL unless streaming, see PeakStartStreaming
+static pthread_mutex_t              gStreamLock = PTHREAD_MUTEX_INITIALIZER; // start and stop
+
+#pragma mark - Notifications
+
+static void PostNotification(const char *name, const void *object)
+{
+#ifdef __APPLE__
+    CFStringRef cfName = CFStringCreateWithCStringNoCopy(kCFAllocatorDefault, name, kCFStringEncodingASCII, kCFAllocatorNull);
+    CFNotificationCenterPostNotification (CFNotificationCenterGetLocalCenter(), cfName, object, NULL, true);
+    CFRelease(cfName);
+#endif
+    if (gObserver)
+        gObserver(gObserverRefCon, name, object);
+}
+
+void PeakSetObserver(PeakObserverFunc observer, void* refCon)
+{
+    gObserverRefCon = refCon;
+    gObserver = observer;
+}
+
+#pragma mark - Timestamp magic
+
+static void calcTimeFromTicks(PeakDevice* dev, CanMsg* msg)
+{
+    // no division per frame, the timebase scales with a fixed point rate refreshed at the completions
+    msg->mono = PeakTimebaseMonotonic(&dev->timebase, dev->usbTime.ullCumulatedTicks);
+    msg->ts = PeakTimebaseWall(&dev->timebase, msg->mono);
+}
+
+static void updateTimeStampFromWord(PeakDevice* dev, CanMsg* msg, UInt16 wTimeStamp, UInt8 ucStep)
+{
+	register PCAN_USB_TIME *t = &dev->usbTime;
+    
+	if (!t->ucStarted)
+	{
+        t->ucStarted            = 1;
+		t->wStartTicks          = wTimeStamp;
+		t->wOldLastTickValue    = wTimeStamp;
+		t->ullCumulatedTicks    = wTimeStamp;
+		t->ullOldCumulatedTicks = wTimeStamp;
+        PeakTimebaseComplete(&dev->timebase, wTimeStamp, PeakMonotonicNs()); // anchor the first telegram
+	}
+    
+	// correction for status timestamp in the same telegram which is more recent, restore old contents
+	if (ucStep)
+	{
+		t->ullCumulatedTicks = t->ullOldCumulatedTicks;
+		t->wLastTickValue    = t->wOldLastTickValue;
+	}
+    
+	// store current values for old ...
+	t->ullOldCumulatedTicks = t->ullCumulatedTicks;
+	t->wOldLastTickValue    = t->wLastTickValue;
+    
+	if (wTimeStamp < t->wLastTickValue)  // handle wrap, enhance tolerance
+		t->ullCumulatedTicks += 0x10000LL;
+    
+	t->ullCumulatedTicks &= ~0xFFFFLL;   // mask in new 16 bit value - do not cumulate cause of error propagation
+	t->ullCumulatedTicks |= wTimeStamp;
+    
+	t->wLastTickValue   = wTimeStamp;      // store for wrap recognition
+	t->ucLastTickValue  = (UInt8)(wTimeStamp & 0xff); // each update for 16 bit tick updates the 8 bit tick, too
+    
+    calcTimeFromTicks(dev, msg);
+}
+
+static void updateTimeStampFromByte(PeakDevice* dev, CanMsg* msg, UInt8 ucTimeStamp)
+{
+	register PCAN_USB_TIME *t = &dev->usbTime;
+    
+	if (ucTimeStamp < t->ucLastTickValue)  // handle wrap
+	{
+		t->ullCumulatedTicks += 0x100;
+		t->wLastTickValue    += 0x100;
+	}
+    
+	t->ullCumulatedTicks &= ~0xFFULL;      // mask in new 8 bit value - do not cumulate cause of error propagation
+	t->ullCumulatedTicks |= ucTimeStamp;
+    
+	t->wLastTickValue    &= ~0xFF;         // correction for word timestamp, too
+	t->wLastTickValue    |= ucTimeStamp;
+    
+	t->ucLastTickValue    = ucTimeStamp;   // store for wrap recognition
+    
+    calcTimeFromTicks(dev, msg);
+}
+
+#pragma mark - Instrumentation
+
+static UInt64 Delta(UInt64 now, UInt64 before)
+{
+    // counters start over with a new capture
+    return now >= before ? now - before : now;
+}
+
+// Sums up the counters of all stages and their histograms into h, must be called with gStatsLock held.
+static void CollectInstrumentation(PeakInstrumentStats* stats, PeakHistogram h[STAGES])
+{
+    PeakCaptureStats cs;
+    PeakTxQueueStats ts;
+    PeakRingStats rs;
+    UInt32 i;
+    
+    bzero(stats, sizeof(PeakInstrumentStats));
+    for (i = 0; i < STAGES; i++)
+        PeakHistogramReset(&h[i]);
+    
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+    {
+        PeakDevice *dev = &gDevices[i];
+        
+        if (dev->ring.slots == NULL)
+            continue;
+        
+        PeakRingGetStats(&dev->ring, &rs);
+        stats->frames          += dev->frames;
+        stats->telegrams       += dev->telegrams;
+        stats->decodeNs        += dev->decodeNs;
+        stats->adapterOverruns += dev->overruns;
+        stats->filtered        += dev->filtered + dev->exactDropped;
+        stats->ringDropped     += rs.overflows;
+        stats->ringFill        += PeakRingFill(&dev->ring);
+        if (rs.highWater > stats->ringHighWater)
+            stats->ringHighWater = rs.highWater;
+        
+        if (dev->transport)
+            stats->readsInFlight += dev->rxQueue.inFlight;
+        if (dev->txCreated)
+        {
+            PeakTxQueueGetStats(&dev->txQueue, &ts);
+            stats->writesInFlight += ts.inFlight;
+        }
+        
+        PeakHistogramAdd(&h[STAGE_USB], &dev->usbLatency);
+        PeakHistogramAdd(&h[STAGE_DECODE], &dev->decodeLatency);
+    }
+    
+    PeakHistogramAdd(&h[STAGE_DEQUEUE], &gRxBatcher.dequeue);
+    PeakHistogramAdd(&h[STAGE_DISPLAY], &gDisplayed);
+    if (gCaptureCreated)
+    {
+        PeakCaptureGetStats(&gCapture, &cs);
+        stats->captureFill = PeakMergeFill(&gCapture.merge);
+        stats->captureDropped = cs.dropped;
+        PeakHistogramAdd(&h[STAGE_CAPTURE], &gCapture.latency);
+    }
+    
+    stats->late = gMerge.stats.late;
+    stats->channels = gDeviceCount;
+}
+
+static void SummarizeInstrumentation(PeakInstrumentStats* stats, const PeakHistogram h[STAGES])
+{
+    PeakHistogramGetStats(&h[STAGE_USB], &stats->usb);
+    PeakHistogramGetStats(&h[STAGE_DECODE], &stats->decode);
+    PeakHistogramGetStats(&h[STAGE_DEQUEUE], &stats->dequeue);
+    PeakHistogramGetStats(&h[STAGE_DISPLAY], &stats->display);
+    PeakHistogramGetStats(&h[STAGE_CAPTURE], &stats->capture);
+}
+
+// the last second, posted by the decoder that also posts the rate
+static void PostInstrumentation(void)
+{
+    PeakInstrumentStats stats, total;
+    UInt32 i;
+    
+    pthread_mutex_lock(&gStatsLock);
+    CollectInstrumentation(&total, gStageSum);
+    for (i = 0; i < STAGES; i++)
+    {
+        gStageTemp = gStageSum[i];
+        PeakHistogramSubtract(&gStageSum[i], &gStagePrev[i]);
+        gStagePrev[i] = gStageTemp;
+    }
+    
+    stats = total;
+    stats.sinceNs         = gStatsPrev.untilNs ? gStatsPrev.untilNs : gStartNs;
+    stats.untilNs         = PeakMonotonicNs();
+    stats.frames          = Delta(total.frames, gStatsPrev.frames);
+    stats.telegrams       = Delta(total.telegrams, gStatsPrev.telegrams);
+    stats.decodeNs        = Delta(total.decodeNs, gStatsPrev.decodeNs);
+    stats.adapterOverruns = Delta(total.adapterOverruns, gStatsPrev.adapterOverruns);
+    stats.filtered        = Delta(total.filtered, gStatsPrev.filtered);
+    stats.ringDropped     = Delta(total.ringDropped, gStatsPrev.ringDropped);
+    stats.captureDropped  = Delta(total.captureDropped, gStatsPrev.captureDropped);
+    stats.late            = Delta(total.late, gStatsPrev.late);
+    SummarizeInstrumentation(&stats, gStageSum);
+    
+    gStatsPrev = total;
+    gStatsPrev.untilNs = stats.untilNs;
+    pthread_mutex_unlock(&gStatsLock);
+    
+    PostNotification("CanStats", &stats);
+}
+
+IOReturn PeakGetInstrumentation(PeakInstrumentStats* stats)
+{
+    pthread_mutex_lock(&gStatsLock);
+    CollectInstrumentation(stats, gStageSum);
+    SummarizeInstrumentation(stats, gStageSum);
+    pthread_mutex_unlock(&gStatsLock);
+    
+    stats->sinceNs = gStartNs;
+    stats->untilNs = PeakMonotonicNs();
+    return kIOReturnSuccess;
+}
+
+void PeakNoteDisplayed(const CanMsg* msgs, UInt32 count)
+{
+    UInt64 now = PeakMonotonicNs(), completed;
+    UInt32 i;
+    
+    for (i = 0; i < count; i++)
+    {
+        // frames sent from here never went through the stages
+        if (msgs[i].loc)
+            continue;
+        
+        completed = msgs[i].mono + msgs[i].delay;
+        if (now > completed)
+            PeakHistogramRecord(&gDisplayed, now - completed);
+    }
+}
+
+static void ResetInstrumentation(void)
+{
+    UInt32 i;
+    
+    pthread_mutex_lock(&gStatsLock);
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+    {
+        PeakHistogramReset(&gDevices[i].usbLatency);
+        PeakHistogramReset(&gDevices[i].decodeLatency);
+    }
+    for (i = 0; i < STAGES; i++)
+        PeakHistogramReset(&gStagePrev[i]);
+    PeakHistogramReset(&gDisplayed);
+    bzero(&gStatsPrev, sizeof(PeakInstrumentStats));
+    gStartNs = PeakMonotonicNs();
+    pthread_mutex_unlock(&gStatsLock);
+}
+
+#pragma mark - Buffer decoding
+
+// Walks the records the way DecodeMessages reads them and checks that every one ends within length. A
+// telegram that does not is dropped as a whole, before any of its frames or timestamps are used.
+static int TelegramValid(const UInt8* buffer, UInt32 length)
+{
+    const UInt8* ucMsgPtr = buffer + 2;
+    UInt32 i, size, left;
+    
+    if (length < 2 || buffer[0] != 2)
+        return 0;
+    
+    for (i = 0; i < buffer[1]; i++)
+    {
+        left = (UInt32)(buffer + length - ucMsgPtr);
+        if (left == 0)
+            return 0;
+        
+        UInt8 ucStatusLen = *ucMsgPtr;
+        
+        if (!(ucStatusLen & STLN_INTERNAL_DATA))
+        {
+            size = 1 + ((ucStatusLen & STLN_EXTENDED_ID) ? 4 : 2) + (i == 0 ? 2 : 1);
+            if (!(ucStatusLen & STLN_RTR))
+                size += (ucStatusLen & STLN_DATA_LENGTH) > 8 ? 8 : (ucStatusLen & STLN_DATA_LENGTH);
+        }
+        else
+        {
+            if (left < 3)
+                return 0;
+            size = 3;
+            if (ucStatusLen & STLN_WITH_TIMESTAMP)
+                size += i == 0 ? 2 : 1;
+            if (ucMsgPtr[1] == 2 || ucMsgPtr[1] == 4)
+                size += 2;
+            else if (ucMsgPtr[1] == 3)
+                size += 1;
+        }
+        
+        if (size > left)
+            return 0;
+        ucMsgPtr += size;
+    }
+    return 1;
+}
+
+static void DecodeMessages(PeakDevice* dev, const UInt8* buffer, UInt32 length)
+{
+    UInt8 i, j;
+    const UInt8* ucMsgPtr = buffer;
+    CanTimeStamp ts;
+    CanMsg dropped, status;
+    CanMsg streamed[256]; // the frames of the buffer, for the stream clients in one go
+    UInt32 received = 0, statusRecords = 0, counted = 0, streamCount = 0;
+    time_t now, last;
+    UInt64 delay, doneNs;
+    UInt64 completionNs = PeakMonotonicNs(); // a bound for every timestamp in the buffer
+    
+    if (!TelegramValid(buffer, length))
+    {
+        dev->malformed++;
+        return;
+    }
+    
+    // the filters stay the same for the whole buffer, PeakSetFilter waits for us before freeing them
+    __atomic_add_fetch(&dev->epoch, 1, __ATOMIC_SEQ_CST);
+    const PeakFilterProgram* filter = __atomic_load_n(&gFilter, __ATOMIC_SEQ_CST);
+    const PeakFilterProgram* exact = __atomic_load_n(&gExact, __ATOMIC_SEQ_CST);
+    PeakLive* live = __atomic_load_n(&dev->live, __ATOMIC_SEQ_CST);
+    PeakStream* stream = __atomic_load_n(&gStream, __ATOMIC_SEQ_CST);
+    
+    ucMsgPtr++; // the prefix, checked by TelegramValid
+    UInt8 ucMessageLen = *ucMsgPtr++;
+    
+    for(i = 0; i < ucMessageLen; i++)
+    {
+        UInt8 ucStatusLen = *ucMsgPtr++;
+
+        if (!(ucStatusLen & STLN_INTERNAL_DATA)) // real message
+        {
+            CanMsg* msg = PeakRingReserve(&dev->ring);
+            if (msg == NULL)
+                msg = &dropped; // ring is full, decode anyway to keep the buffer and timestamps in step
+            
+            msg->len = ucStatusLen & STLN_DATA_LENGTH;
+            if (msg->len > 8) msg->len = 8;
+            msg->rtr = (ucStatusLen & STLN_RTR) > 0;
+            msg->ext = (ucStatusLen & STLN_EXTENDED_ID) > 0;
+            msg->err = 0;
+            msg->loc = 0;
+            msg->channel = (UInt8)dev->channel;
+            
+            if (ucStatusLen & STLN_EXTENDED_ID)
+			{
+				msg->canid.uc[0] = *ucMsgPtr++;
+				msg->canid.uc[1] = *ucMsgPtr++;
+				msg->canid.uc[2] = *ucMsgPtr++;
+				msg->canid.uc[3] = *ucMsgPtr++;
+				msg->canid.ul >>= 3;
+			}
+			else
+			{
+				msg->canid.ul = 0;
+				msg->canid.uc[0] = *ucMsgPtr++;
+				msg->canid.uc[1] = *ucMsgPtr++;
+				msg->canid.ul >>= 5;
+			}
+            
+            if(i == 0) // only the first packet supplies a word timestamp
+            {
+                ts.uc[0] = *ucMsgPtr++;
+                ts.uc[1] = *ucMsgPtr++;
+                updateTimeStampFromWord(dev, msg, ts.uw, i);
+            } else {
+                updateTimeStampFromByte(dev, msg, *ucMsgPtr++);
+            }
+            // how long the adapter and the bus kept the frame before the completion
+            delay = completionNs > msg->mono ? completionNs - msg->mono : 0;
+            msg->delay = delay < 0xffffffffULL ? (UInt32)delay : 0xffffffff;
+            PeakHistogramRecord(&dev->usbLatency, delay);
+#ifdef DEBUG
+            printf("Timestamp:%llu Flags:0x%02x Id:0x%02x Len:%d Rtr:%s Ext:%s\n", (unsigned long long)msg->ts / 1000000000ULL, ucStatusLen, (unsigned)msg->canid.ul, msg->len, (msg->rtr) ? "yes" : "no", (msg->ext) ? "yes" : "no");
+#endif
+            if (!msg->rtr) // the adapter sends no payload with remote frames
+            {
+                for(j = 0; j < msg->len; j++)
+                    msg->data[j] = *ucMsgPtr++;
+            }
+            
+            PeakBusStatsUpdate(dev->busStats, msg);
+            
+            if (exact)
+            {
+                dev->exactFrames++;
+                if (!PeakFilterMatch(exact, msg))
+                {
+                    // let through by the acceptance registers, which only approximate the set
+                    dev->exactDropped++;
+                    continue;
+                }
+            }
+            
+            // the capture has its own ring, so it keeps frames the display had to drop
+            PeakCaptureAppend(&gCapture, msg);
+            if (live)
+                PeakLivePublish(live, msg);
+            if (stream)
+                streamed[streamCount++] = *msg;
+            counted++;
+            
+            if (filter && !PeakFilterMatch(filter, msg))
+            {
+                dev->filtered++;
+            }
+            else if (msg != &dropped)
+            {
+                PeakRingCommit(&dev->ring);
+                received++;
+            }
+        }
+        else
+        {
+            // internal data & errors, only valid during the notification
+            CanMsg* msg = &status;
+            statusRecords++;
+            bzero(msg, sizeof(CanMsg));
+            msg->channel = (UInt8)dev->channel;
+            UInt8 ucFunction = *ucMsgPtr++;
+            UInt8 ucNumber = *ucMsgPtr++;
+            
+            msg->canid.uc[0] = ucFunction;
+            msg->canid.uc[1] = ucNumber;
+            
+            if (ucStatusLen & STLN_WITH_TIMESTAMP)
+            {
+                if(i == 0) { // only the first packet supplies a word timestamp
+                    ts.uc[0] = *ucMsgPtr++;
+                    ts.uc[1] = *ucMsgPtr++;
+                    updateTimeStampFromWord(dev, msg, ts.uw, i);
+                } else {
+                    updateTimeStampFromByte(dev, msg, *ucMsgPtr++);
+                }
+            }
+            
+            switch (ucFunction) {
+                case 1:
+                    {
+                        if (ucNumber & (CAN_RECEIVE_QUEUE_OVERRUN | QUEUE_OVERRUN))
+                            dev->overruns++;
+                        
+                        if (ucNumber & CAN_RECEIVE_QUEUE_OVERRUN)
+                            printf("CAN_RECEIVE_QUEUE_OVERRUN\n");
+                        
+                        if (ucNumber & QUEUE_OVERRUN)
+                            printf("CAN_QUEUE_OVERRUN\n");
+                        
+                        if (ucNumber & BUS_OFF)
+                            printf("BUS_OFF\n");
+                        
+                        if (ucNumber & BUS_HEAVY)
+                            printf("BUS_HEAVY\n");
+                        
+                        if (ucNumber & BUS_LIGHT)
+                            printf("BUS_LIGHT\n");
+#ifdef DEBUG                        
+                        if (ucNumber == 0)
+                            printf("No error\n");
+#endif
+                    }
+                    break;
+                case 2: // get_analog_value, remove bytes
+                    ucMsgPtr++;
+                    ucMsgPtr++;
+                    break;
+                case 3: // get_bus_load, remove byte
+                    ucMsgPtr++;
+                    break;
+                case 4:
+                    ts.uc[0] = *ucMsgPtr++;
+                    ts.uc[1] = *ucMsgPtr++;
+                    updateTimeStampFromWord(dev, msg, ts.uw, i);
+                    break;
+                case 5: // ErrorFrame/ErrorBusEvent.
+                    if (ucNumber & QUEUE_XMT_FULL)
+                    {
+                        printf("QUEUE_XMT_FULL signaled, ucNumber = 0x%02x\n", ucNumber);
+                        //dev->wCANStatus |= CAN_ERR_QXMTFULL; // fatal error!
+                        //dev->dwErrorCounter++;
+                    }
+                    
+                    //j = 0;
+                    //while (ucLen--)
+                    //    msg.Msg.DATA[j++] = *ucMsgPtr++;
+                    break;
+            }
+            PostNotification("CanStatus", msg);
+            PeakCaptureNoteStatus(&gCapture, dev->channel, msg->mono ? msg->mono : completionNs, ucFunction, ucNumber);
+#ifdef DEBUG            
+            printf("Status Function:%d Number:%d Timestamp:%06llu.%06llu\n", ucFunction, ucNumber, msg->ts / 1000000000ULL, (msg->ts % 1000000000ULL) / 1000ULL);
+#endif
+        }
+    }
+    
+    if (live && counted)
+        PeakLiveWake(live);
+    if (streamCount)
+        PeakStreamPublish(stream, streamed, streamCount);
+    __atomic_add_fetch(&dev->epoch, 1, __ATOMIC_SEQ_CST);
+    
+    dev->telegrams++;
+    dev->frames += ucMessageLen - statusRecords;
+    dev->statusRecords += statusRecords;
+    
+    // the newest tick against the completion feeds the clock fit for the next buffers
+    if (dev->usbTime.ucStarted)
+        PeakTimebaseComplete(&dev->timebase, dev->usbTime.ullCumulatedTicks, completionNs);
+    
+    doneNs = PeakMonotonicNs();
+    PeakHistogramRecord(&dev->decodeLatency, doneNs - completionNs);
+    dev->decodeNs += doneNs - completionNs;
+    
+    // ask the observer for a batch flush, coalesced with the display tick and the other adapters
+    if (received)
+        PeakBatcherCompletion(&gRxBatcher, doneNs);
+    
+    // the rate of all adapters together, posted by whichever decoder sees the new second first
+    __atomic_add_fetch(&gMsgCounter, counted, __ATOMIC_RELAXED);
+    now = time(NULL);
+    last = __atomic_load_n(&gLast, __ATOMIC_RELAXED);
+    if(now > last && __atomic_compare_exchange_n(&gLast, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        gMsgRate = __atomic_exchange_n(&gMsgCounter, 0, __ATOMIC_RELAXED);
+        PostNotification("CanDevice", &gMsgRate);
+        PostInstrumentation();
+    }
+}
+
+static void FlushBatch(void *refCon)
+{
+    PostNotification("CanMsg", refCon);
+}
+
+// Waits until no decoder can still hold what was unpublished before the call: the filters, a live
+// channel, the stream or the capture's trigger. Every decoder that was in a buffer only has to be seen
+// leaving it, a busy adapter starting the next one right away holds nobody up.
+static void WaitForDecoders(void)
+{
+    UInt64 seen[PEAK_MAX_CHANNELS];
+    UInt32 i;
+    
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+        seen[i] = __atomic_load_n(&gDevices[i].epoch, __ATOMIC_SEQ_CST);
+    
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+    {
+        while ((seen[i] & 1) && __atomic_load_n(&gDevices[i].epoch, __ATOMIC_SEQ_CST) == seen[i])
+            sched_yield();
+    }
+}
+
+#pragma mark - Sharing
+
+// called with gDeviceLock held; a channel that cannot be shared is still received as usual
+static void ShareDevice(PeakDevice* dev)
+{
+    char name[PEAK_LIVE_NAME_MAX + 16]; // PeakStartSharing checked the length
+    PeakLive* live;
+    
+    if (gLivePrefix[0] == 0 || dev->live != NULL)
+        return;
+    
+    live = malloc(sizeof(PeakLive));
+    if (live == NULL)
+        return;
+    
+    snprintf(name, sizeof(name), "%s.%u", gLivePrefix, (unsigned)dev->channel);
+    if (PeakLiveCreate(live, name, dev->channel, gLiveCapacity) != kIOReturnSuccess)
+    {
+        free(live);
+        return;
+    }
+    __atomic_store_n(&dev->live, live, __ATOMIC_SEQ_CST);
+}
+
+static void UnshareDevice(PeakDevice* dev)
+{
+    PeakLive* live = __atomic_exchange_n(&dev->live, NULL, __ATOMIC_SEQ_CST);
+    
+    if (live == NULL)
+        return;
+    
+    // a decoder may still be publishing, it is done within one buffer
+    WaitForDecoders();
+    
+    PeakLiveDestroy(live);
+    free(live);
+}
+
+#pragma mark - Transport callbacks
+
+static IOReturn SubmitRead(void *refCon, PeakRxTransfer *transfer)
+{
+    PeakTransport *transport = ((PeakDevice *) refCon)->transport;
+    IOReturn kr = transport->submitRead(transport, transfer);
+    
+    if (kr != kIOReturnSuccess)
+    {
+        printf("Unable to read async interface (%08x)\n", kr);
+    }
+    return kr;
+}
+
+static IOReturn SubmitWrite(void *refCon, const UInt8 *buffer, UInt32 length, void *context)
+{
+    PeakTransport *transport = refCon;
+    return transport->submitWrite(transport, buffer, length, context);
+}
+
+static void DecodeTransfer(void *refCon, const UInt8 *buffer, UInt32 length)
+{
+    DecodeMessages((PeakDevice *) refCon, buffer, length);
+#ifdef DEBUG
+    printf("Decoded message\n");
+    UInt32 i;
+    for (i = 0; i < length; i++) {
+        printf("%02X ", buffer[i]);
+        if(i == 31) printf("\n");
+    }
+    printf("\n");
+#endif
+}
+
+// the init sequence of one adapter, the acceptance registers go in while it is in reset mode
+static IOReturn InitDevice(PeakDevice* dev, UInt16 bitrate)
+{
+    PeakTransport *transport = dev->transport;
+    PCAN_USB_PARAM br = { 1, 2, { (bitrate & 0xff), (bitrate >> 8), 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } };
+    
+    dev->bitrate = bitrate;
+    PeakBusStatsSetBitrate(dev->busStats, bitrate);
+    
+    IOReturn kr = transport->ctrlWrite(transport, &PCAN_CTRL_CANOFF);
+    if (kr != kIOReturnSuccess)
+    {
+        printf("Unable to perform PCAN_CTRL_CANOFF (%08x)\n", kr);
+        return kr;
+    }
+    
+    kr = transport->ctrlWrite(transport, &PCAN_CTRL_SJA1000INIT);
+    if (kr != kIOReturnSuccess)
+    {
+        printf("Unable to perform PCAN_CTRL_SJA1000INIT (%08x)\n", kr);
+        return kr;
+    }
+    
+    if (gAcceptanceUsed)
+    {
+        PCAN_USB_PARAM acc[PEAK_ACCEPTANCE_PARAMS];
+        UInt32 i, n = PeakAcceptanceParams(&gAcceptance, acc);
+        
+        for (i = 0; i < n; i++)
+        {
+            kr = transport->ctrlWrite(transport, &acc[i]);
+            if (kr != kIOReturnSuccess)
+            {
+                printf("Unable to write SJA1000 register %u (%08x)\n", acc[i].Param[0], kr);
+                return kr;
+            }
+        }
+    }
+    
+    kr = transport->ctrlWrite(transport, &br);
+    if (kr != kIOReturnSuccess)
+    {
+        printf("Unable to perform PCAN_CTRL_BITRATE_... (%08x)\n", kr);
+        return kr;
+    }
+    
+    kr = transport->ctrlWrite(transport, &PCAN_CTRL_SILENTOFF);
+    if (kr != kIOReturnSuccess)
+    {
+        printf("Unable to perform PCAN_CTRL_SILENTOFF (%08x)\n", kr);
+        return kr;
+    }
+    
+    kr = transport->ctrlWrite(transport, &PCAN_CTRL_EXTVCCOFF);
+    if (kr != kIOReturnSuccess)
+    {
+        printf("Unable to perform PCAN_CTRL_EXTVCCOFF (%08x)\n", kr);
+        return kr;
+    }
+    
+    kr = transport->ctrlWrite(transport, &PCAN_CTRL_CANON);
+    if (kr != kIOReturnSuccess)
+    {
+        printf("Unable to perform PCAN_CTRL_CANON (%08x)\n", kr);
+        return kr;
+    }
+    
+    return kr;
+}
+
+// re-initializes every attached adapter, the first error is returned
+static IOReturn InitDevices(UInt16 bitrate)
+{
+    IOReturn kr = kIOReturnNoDevice, result;
+    UInt32 i;
+    
+    pthread_mutex_lock(&gDeviceLock);
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+    {
+        if (gDevices[i].transport == NULL)
+            continue;
+        
+        result = InitDevice(&gDevices[i], bitrate);
+        if (kr == kIOReturnNoDevice || (kr == kIOReturnSuccess && result != kIOReturnSuccess))
+            kr = result;
+    }
+    pthread_mutex_unlock(&gDeviceLock);
+    return kr;
+}
+
+static PeakDevice* GetDevice(UInt32 channel)
+{
+    if (channel >= PEAK_MAX_CHANNELS || __atomic_load_n(&gDevices[channel].transport, __ATOMIC_ACQUIRE) == NULL)
+        return NULL;
+    
+    return &gDevices[channel];
+}
+
+IOReturn PeakTransportAttached(PeakTransport* transport)
+{
+    PeakDevice *dev = NULL;
+    UInt8 reply[16];
+    IOReturn kr;
+    UInt32 i;
+    
+    // the first free slot becomes the adapter's channel
+    pthread_mutex_lock(&gDeviceLock);
+    for (i = 0; i < PEAK_MAX_CHANNELS && dev == NULL; i++)
+    {
+        if (gDevices[i].transport == NULL)
+            dev = &gDevices[i];
+    }
+    
+    if (dev == NULL)
+    {
+        pthread_mutex_unlock(&gDeviceLock);
+        fprintf(stderr, "No more than %d adapters.\n", PEAK_MAX_CHANNELS);
+        return kIOReturnNoResources;
+    }
+    
+    // the receive slots are allocated once per channel, frames are never malloc'ed per message
+    if (dev->ring.slots == NULL && PeakRingCreate(&dev->ring, PEAK_RING_DEFAULT_CAPACITY) != kIOReturnSuccess)
+    {
+        pthread_mutex_unlock(&gDeviceLock);
+        fprintf(stderr, "Unable to allocate receive ring.\n");
+        return kIOReturnNoMemory;
+    }
+    
+    if (dev->busStats == NULL && PeakBusStatsCreate(&dev->busStats) != kIOReturnSuccess)
+    {
+        pthread_mutex_unlock(&gDeviceLock);
+        fprintf(stderr, "Unable to allocate bus statistics.\n");
+        return kIOReturnNoMemory;
+    }
+    
+    if (!dev->txCreated)
+    {
+        if (PeakTxQueueCreate(&dev->txQueue, PEAK_TX_DEFAULT_DEPTH) != kIOReturnSuccess)
+        {
+            pthread_mutex_unlock(&gDeviceLock);
+            fprintf(stderr, "Unable to create transmit queue.\n");
+            return kIOReturnNoResources;
+        }
+        dev->txCreated = 1;
+    }
+    
+    // set transport before init
+    dev->channel = (UInt32)(dev - gDevices);
+    transport->device = dev;
+    
+    // a new adapter starts counting its ticks from anywhere
+    bzero(&dev->usbTime, sizeof(PCAN_USB_TIME));
+    PeakBusStatsReset(dev->busStats);
+    PeakTimebaseInit(&dev->timebase, (double)PCAN_USB_TS_US_PER_TICK * 1000.0 / (1 << PCAN_USB_TS_DIV_SHIFTER));
+    dev->serial = dev->deviceNo = 0;
+    __atomic_store_n(&dev->transport, transport, __ATOMIC_RELEASE);
+    
+    kr = InitDevice(dev, gLastBitrate);
+    if (kr != kIOReturnSuccess)
+    {
+        __atomic_store_n(&dev->transport, NULL, __ATOMIC_RELEASE);
+        transport->device = NULL;
+        pthread_mutex_unlock(&gDeviceLock);
+        return kr;
+    }
+    
+    // the replies echo function and number, the values follow in little endian
+    if (transport->ctrlRead(transport, &PCAN_CTRL_READ_SNR, reply) == kIOReturnSuccess)
+        dev->serial = reply[2] | (reply[3] << 8) | (reply[4] << 16) | ((UInt32)reply[5] << 24);
+    transport->ctrlRead(transport, &PCAN_CTRL_READ_QUARTZ, reply);
+    if (transport->ctrlRead(transport, &PCAN_CTRL_READ_DEVICENO, reply) == kIOReturnSuccess)
+        dev->deviceNo = reply[2];
+    transport->ctrlRead(transport, &PCAN_CTRL_READ_BITRATE, reply);
+    
+    // frames left over from an adapter that was here before belong to nobody
+    dev->ring.tail = __atomic_load_n(&dev->ring.head, __ATOMIC_ACQUIRE);
+    PeakMergeAttach(&gMerge, dev->channel, &dev->ring);
+    if (gCaptureCreated)
+        PeakCaptureAddChannel(&gCapture, dev->channel);
+    ShareDevice(dev);
+    gDeviceCount++;
+    pthread_mutex_unlock(&gDeviceLock);
+    
+    printf("Adapter %u (serial %08x, device number %u) on channel %u.\n", (unsigned)gDeviceCount, (unsigned)dev->serial, (unsigned)dev->deviceNo, (unsigned)dev->channel);
+    
+    // start reading from the bulk input interface with several reads in flight
+    PeakRxQueueInit(&dev->rxQueue, gRxDepth, SubmitRead, DecodeTransfer, dev);
+    if (PeakRxQueueStart(&dev->rxQueue) != kIOReturnSuccess)
+        printf("No bulk read in flight on channel %u, nothing will be received.\n", (unsigned)dev->channel);
+    
+    // frames queued by PeakSend are written from here on
+    PeakTxQueueAttach(&dev->txQueue, SubmitWrite, transport);
+    
+    // Notify AppDelegate to remove the 'no device' info and display the message counter
+    PostNotification("CanDevice", &gMsgRate);
+    return kIOReturnSuccess;
+}
+
+void PeakTransportDetached(PeakTransport* transport)
+{
+    PeakDevice *dev = transport->device;
+    UInt32 remaining;
+    
+    pthread_mutex_lock(&gDeviceLock);
+    if (dev != NULL && dev->transport == transport)
+    {
+        // the merge stops waiting for the channel, what it delivered so far is still drained
+        PeakMergeDetach(&gMerge, dev->channel);
+        if (gCaptureCreated)
+            PeakCaptureRemoveChannel(&gCapture, dev->channel);
+        UnshareDevice(dev);
+        PeakTxQueueDetach(&dev->txQueue);
+        __atomic_store_n(&dev->transport, NULL, __ATOMIC_RELEASE);
+        transport->device = NULL;
+        gDeviceCount--;
+    }
+    remaining = gDeviceCount;
+    pthread_mutex_unlock(&gDeviceLock);
+    
+    PostNotification("CanDevice", remaining ? &gMsgRate : NULL);
+}
+
+void PeakTransportReadComplete(PeakTransport* transport, PeakRxTransfer* transfer, IOReturn result, UInt32 length)
+{
+    PeakDevice *dev = transport->device;
+    
+#ifdef DEBUG
+    printf("Asynchronous bulk read complete (%ld)\n", (long)length);
+#endif
+    
+    if (result != kIOReturnSuccess)
+        printf("Error from async bulk read (%08x)\n", result);
+    
+    // the device is going away, the backend closes it, do not re-arm
+    if (dev == NULL || result == kIOReturnNoDevice || result == kIOReturnAborted)
+        return;
+    
+    // any other failure is counted and re-armed, the reads after it must not wait behind it
+    
+    // re-arms the spare buffer, then decodes the completed ones in order
+    if (PeakRxQueueComplete(&dev->rxQueue, transfer, result, length) != kIOReturnSuccess)
+        printf("No bulk read left in flight on channel %u, reception stopped.\n", (unsigned)dev->channel);
+}
+
+void PeakTransportWriteComplete(PeakTransport* transport, void* refCon, IOReturn result)
+{
+    PeakDevice *dev = transport->device;
+    
+    if (result != kIOReturnSuccess)
+    {
+        printf("error from asynchronous bulk write (%08x)\n", result);
+    }
+    
+    // frees the telegram and packs the frames queued meanwhile
+    if (dev != NULL)
+        PeakTxQueueComplete(&dev->txQueue, refCon, result);
+}
+
+#pragma mark - Entry points
+
+IOReturn PeakInit(UInt16 bitrate)
+{
+    gLastBitrate = bitrate;
+    return InitDevices(bitrate);
+}
+
+IOReturn PeakInitChannel(UInt32 channel, UInt16 bitrate)
+{
+    PeakDevice *dev;
+    IOReturn kr;
+    
+    pthread_mutex_lock(&gDeviceLock);
+    dev = GetDevice(channel);
+    kr = dev ? InitDevice(dev, bitrate) : kIOReturnNoDevice;
+    pthread_mutex_unlock(&gDeviceLock);
+    return kr;
+}
+
+UInt32 PeakChannelCount(void)
+{
+    return gDeviceCount;
+}
+
+IOReturn PeakSend(CanMsg* msg)
+{
+    PeakDevice *dev = GetDevice(msg->channel);
+    
+    if(dev == NULL || !dev->txCreated)
+        return kIOReturnNoDevice;
+    
+    // never blocks, kIOReturnNoSpace if the transmit queue is full
+    return PeakTxQueueSend(&dev->txQueue, msg, 1, 0, NULL);
+}
+
+IOReturn PeakSendBatch(const CanMsg* msgs, UInt32 count, int wait, UInt32* queued)
+{
+    PeakDevice *dev;
+    UInt32 done = 0, run, taken;
+    IOReturn kr = kIOReturnSuccess;
+    
+    if (queued)
+        *queued = 0;
+    
+    // every run of frames for the same adapter goes to its queue in one piece
+    while (done < count)
+    {
+        for (run = 1; done + run < count && msgs[done + run].channel == msgs[done].channel; run++)
+            ;
+        
+        dev = GetDevice(msgs[done].channel);
+        if(dev == NULL || !dev->txCreated)
+            return kIOReturnNoDevice;
+        
+        taken = 0;
+        kr = PeakTxQueueSend(&dev->txQueue, &msgs[done], run, wait, &taken);
+        done += taken;
+        if (queued)
+            *queued = done;
+        if (kr != kIOReturnSuccess)
+            break;
+    }
+    
+    return kr;
+}
+
+IOReturn PeakGetTxStats(PeakTxStats* stats)
+{
+    PeakTxQueueStats qs;
+    IOReturn kr = kIOReturnNotOpen;
+    UInt32 i;
+    
+    bzero(stats, sizeof(PeakTxStats));
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+    {
+        if (!gDevices[i].txCreated)
+            continue;
+        
+        PeakTxQueueGetStats(&gDevices[i].txQueue, &qs);
+        stats->queued    += qs.queued;
+        stats->inFlight  += qs.inFlight;
+        stats->frames    += qs.frames;
+        stats->telegrams += qs.telegrams;
+        stats->rejected  += qs.rejected;
+        stats->errors    += qs.errors;
+        kr = kIOReturnSuccess;
+    }
+    return kr;
+}
+
+static void AddRxStats(PeakDevice* dev, PeakRxStats* stats)
+{
+    PeakRingStats rs;
+    
+    PeakRingGetStats(&dev->ring, &rs);
+    stats->telegrams     += dev->telegrams;
+    stats->frames        += dev->frames;
+    stats->statusRecords += dev->statusRecords;
+    stats->filtered      += dev->filtered;
+    stats->overflows     += rs.overflows;
+    stats->malformed     += dev->malformed;
+    stats->stalls        += dev->rxQueue.stalls;
+    stats->readErrors    += dev->rxQueue.errors;
+    if (rs.highWater > stats->highWater)
+        stats->highWater = rs.highWater;
+}
+
+IOReturn PeakGetRxStats(PeakRxStats* stats)
+{
+    IOReturn kr = kIOReturnNotOpen;
+    UInt32 i;
+    
+    bzero(stats, sizeof(PeakRxStats));
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+    {
+        if (gDevices[i].ring.slots == NULL)
+            continue;
+        
+        AddRxStats(&gDevices[i], stats);
+        kr = kIOReturnSuccess;
+    }
+    return kr;
+}
+
+IOReturn PeakGetChannelRxStats(UInt32 channel, PeakRxStats* stats)
+{
+    if (channel >= PEAK_MAX_CHANNELS || gDevices[channel].ring.slots == NULL)
+        return kIOReturnNotOpen;
+    
+    bzero(stats, sizeof(PeakRxStats));
+    AddRxStats(&gDevices[channel], stats);
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakGetClockStats(UInt32 channel, PeakClockStats* stats)
+{
+    PeakDevice *dev = GetDevice(channel);
+    
+    if (dev == NULL)
+        return kIOReturnNoDevice;
+    
+    stats->completions  = dev->timebase.completions;
+    stats->resets       = dev->timebase.resets;
+    stats->wallSteps    = dev->timebase.wallSteps;
+    stats->ppm          = dev->timebase.ppm;
+    stats->jitterNs     = dev->timebase.jitterNs;
+    stats->wallOffsetNs = dev->timebase.wallOffset;
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakGetBusLoad(UInt32 channel, PeakBusLoad* load)
+{
+    PeakDevice *dev = GetDevice(channel);
+    
+    if (dev == NULL)
+        return kIOReturnNoDevice;
+    
+    PeakBusStatsGetLoad(dev->busStats, PeakMonotonicNs(), load);
+    return kIOReturnSuccess;
+}
+
+UInt32 PeakGetIdStats(UInt32 channel, PeakIdStats* stats, UInt32 max)
+{
+    PeakDevice *dev = GetDevice(channel);
+    
+    if (dev == NULL)
+        return 0;
+    
+    return PeakBusStatsGetIds(dev->busStats, PeakMonotonicNs(), stats, max);
+}
+
+IOReturn PeakSetMergeWindow(UInt64 windowNs)
+{
+    gMergeWindow = windowNs;
+    PeakMergeSetWindow(&gMerge, windowNs);
+    if (gCaptureCreated)
+        PeakMergeSetWindow(&gCapture.merge, windowNs);
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakGetMergeStats(PeakMergeStats* stats)
+{
+    PeakMergeGetStats(&gMerge, stats);
+    return kIOReturnSuccess;
+}
+
+static IOReturn StartCapture(const char* path, const PeakTriggerConfig* trigger)
+{
+    PeakDevice *first = NULL;
+    IOReturn kr;
+    UInt32 i;
+    
+    pthread_mutex_lock(&gDeviceLock);
+    if (gCaptureCreated && PeakCaptureIsOpen(&gCapture))
+    {
+        pthread_mutex_unlock(&gDeviceLock);
+        return kIOReturnBusy;
+    }
+    
+    if (!gCaptureCreated)
+    {
+        if (PeakCaptureCreate(&gCapture) != kIOReturnSuccess)
+        {
+            pthread_mutex_unlock(&gDeviceLock);
+            return kIOReturnNoMemory;
+        }
+        PeakMergeSetWindow(&gCapture.merge, gMergeWindow);
+        
+        for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+        {
+            if (gDevices[i].transport)
+                PeakCaptureAddChannel(&gCapture, i);
+        }
+        gCaptureCreated = 1;
+    }
+    
+    // the header names the adapter on the lowest channel, the records carry the channel
+    for (i = 0; i < PEAK_MAX_CHANNELS && first == NULL; i++)
+    {
+        if (gDevices[i].transport)
+            first = &gDevices[i];
+    }
+    
+    // decoders of the last capture may still be passing status records to its trigger
+    WaitForDecoders();
+    kr = PeakCaptureSetTrigger(&gCapture, trigger);
+    if (kr != kIOReturnSuccess)
+    {
+        pthread_mutex_unlock(&gDeviceLock);
+        return kr;
+    }
+    
+    kr = PeakCaptureOpen(&gCapture, path, first ? first->bitrate : gLastBitrate, first ? first->serial : 0, first ? first->deviceNo : 0);
+    pthread_mutex_unlock(&gDeviceLock);
+    return kr;
+}
+
+IOReturn PeakStartCapture(const char* path)
+{
+    return StartCapture(path, NULL);
+}
+
+IOReturn PeakStartTriggerCapture(const char* path, const PeakTriggerConfig* config)
+{
+    if (config == NULL)
+        return kIOReturnBadArgument;
+    return StartCapture(path, config);
+}
+
+IOReturn PeakArmTrigger(void)
+{
+    IOReturn kr = kIOReturnNotOpen;
+    
+    pthread_mutex_lock(&gDeviceLock);
+    if (gCaptureCreated && gCapture.trigger)
+    {
+        PeakTriggerArm(gCapture.trigger);
+        kr = kIOReturnSuccess;
+    }
+    pthread_mutex_unlock(&gDeviceLock);
+    return kr;
+}
+
+IOReturn PeakGetTriggerStats(PeakTriggerStats* stats)
+{
+    IOReturn kr = kIOReturnNotOpen;
+    
+    pthread_mutex_lock(&gDeviceLock);
+    if (gCaptureCreated && gCapture.trigger)
+    {
+        PeakTriggerGetStats(gCapture.trigger, stats);
+        kr = kIOReturnSuccess;
+    }
+    pthread_mutex_unlock(&gDeviceLock);
+    return kr;
+}
+
+IOReturn PeakStopCapture(void)
+{
+    if (!PeakCaptureIsOpen(&gCapture))
+        return kIOReturnNotOpen;
+    
+    PeakCaptureClose(&gCapture);
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakStartSharing(const char* prefix, UInt32 capacity)
+{
+    UInt32 i;
+    
+    // room for the channel suffix
+    if (prefix == NULL || prefix[0] != '/' || strlen(prefix) + 4 > PEAK_LIVE_NAME_MAX)
+        return kIOReturnBadArgument;
+    if (capacity < 2 || (capacity & (capacity - 1)))
+        return kIOReturnBadArgument;
+    
+    pthread_mutex_lock(&gDeviceLock);
+    if (gLivePrefix[0])
+    {
+        pthread_mutex_unlock(&gDeviceLock);
+        return kIOReturnBusy;
+    }
+    
+    strcpy(gLivePrefix, prefix);
+    gLiveCapacity = capacity;
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+    {
+        if (gDevices[i].transport)
+            ShareDevice(&gDevices[i]);
+    }
+    pthread_mutex_unlock(&gDeviceLock);
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakStopSharing(void)
+{
+    UInt32 i;
+    
+    pthread_mutex_lock(&gDeviceLock);
+    if (gLivePrefix[0] == 0)
+    {
+        pthread_mutex_unlock(&gDeviceLock);
+        return kIOReturnNotOpen;
+    }
+    
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+        UnshareDevice(&gDevices[i]);
+    gLivePrefix[0] = 0;
+    pthread_mutex_unlock(&gDeviceLock);
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakStartStreaming(const char* path, const PeakStreamConfig* config)
+{
+    PeakStream* stream;
+    PeakStreamConfig defaults;
+    IOReturn kr;
+    
+    if (config == NULL)
+    {
+        PeakStreamConfigInit(&defaults);
+        config = &defaults;
+    }
+    
+    pthread_mutex_lock(&gStreamLock);
+    if (gStream)
+    {
+        pthread_mutex_unlock(&gStreamLock);
+        return kIOReturnBusy;
+    }
+    
+    stream = malloc(sizeof(PeakStream));
+    if (stream == NULL)
+    {
+        pthread_mutex_unlock(&gStreamLock);
+        return kIOReturnNoMemory;
+    }
+    
+    kr = PeakStreamOpen(stream, path, config);
+    if (kr == kIOReturnSuccess)
+        __atomic_store_n(&gStream, stream, __ATOMIC_SEQ_CST);
+    else
+        free(stream);
+    pthread_mutex_unlock(&gStreamLock);
+    return kr;
+}
+
+IOReturn PeakStopStreaming(void)
+{
+    PeakStream* stream;
+    
+    pthread_mutex_lock(&gStreamLock);
+    stream = __atomic_exchange_n(&gStream, NULL, __ATOMIC_SEQ_CST);
+    if (stream == NULL)
+    {
+        pthread_mutex_unlock(&gStreamLock);
+        return kIOReturnNotOpen;
+    }
+    
+    // a decoder may still be publishing, it is done within one buffer
+    WaitForDecoders();
+    
+    PeakStreamClose(stream);
+    free(stream);
+    pthread_mutex_unlock(&gStreamLock);
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakGetStreamStats(PeakStreamStats* stats)
+{
+    pthread_mutex_lock(&gStreamLock);
+    if (gStream == NULL)
+    {
+        pthread_mutex_unlock(&gStreamLock);
+        return kIOReturnNotOpen;
+    }
+    
+    PeakStreamGetStats(gStream, stats);
+    pthread_mutex_unlock(&gStreamLock);
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakSetFilter(const PeakFilterTerm* terms, UInt32 count)
+{
+    PeakFilterProgram *program = NULL, *old;
+    
+    if (terms != NULL)
+    {
+        program = PeakFilterCompile(terms, count);
+        if (program == NULL)
+            return kIOReturnNoMemory;
+    }
+    
+    pthread_mutex_lock(&gFilterLock);
+    old = __atomic_exchange_n(&gFilter, program, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&gFilterLock);
+    
+    // a decoder may still be using the old program, it is done within one buffer
+    WaitForDecoders();
+    
+    PeakFilterFree(old);
+    return kIOReturnSuccess;
+}
+
+int PeakFilterFrame(const CanMsg* msg)
+{
+    int pass;
+    
+    // any thread may ask, PeakSetFilter swaps the program under the same lock
+    pthread_mutex_lock(&gFilterLock);
+    pass = gFilter == NULL || PeakFilterMatch(gFilter, msg);
+    pthread_mutex_unlock(&gFilterLock);
+    
+    return pass;
+}
+
+// the exact set only tightens, the UI filter stays as it is
+static void SwapExact(PeakFilterProgram* program, UInt32 count)
+{
+    PeakFilterProgram *old = __atomic_exchange_n(&gExact, program, __ATOMIC_SEQ_CST);
+    UInt32 i;
+    
+    WaitForDecoders();
+    
+    PeakFilterFree(old);
+    gExactCount = count;
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+        gDevices[i].exactFrames = gDevices[i].exactDropped = 0;
+}
+
+IOReturn PeakSetAcceptance(const UInt32* ids, UInt32 count, UInt32 mode)
+{
+    PeakFilterProgram *program = NULL;
+    PeakFilterTerm *terms;
+    PeakAcceptance acc;
+    IOReturn kr;
+    UInt32 i, attached;
+    
+    if (ids == NULL)
+        count = 0;
+    
+    kr = PeakAcceptanceCompute(&acc, ids, count, mode);
+    if (kr != kIOReturnSuccess)
+        return kr;
+    
+    if (count > 0)
+    {
+        terms = malloc(count * sizeof(PeakFilterTerm));
+        if (terms == NULL)
+            return kIOReturnNoMemory;
+        
+        for (i = 0; i < count; i++)
+        {
+            PeakFilterTermInit(&terms[i]);
+            terms[i].low = terms[i].high = ids[i] & PEAK_FILTER_MAX_ID;
+            terms[i].flagsMask = PEAK_FILTER_EXT;
+            terms[i].flagsValue = (ids[i] & PEAK_ACCEPTANCE_EXT) ? PEAK_FILTER_EXT : 0;
+        }
+        program = PeakFilterCompile(terms, count);
+        free(terms);
+        if (program == NULL)
+            return kIOReturnNoMemory;
+    }
+    
+    SwapExact(program, count);
+    
+    // PeakInit and an adapter attaching meanwhile read them under the lock
+    pthread_mutex_lock(&gDeviceLock);
+    gAcceptance = acc;
+    gAcceptanceUsed = 1;
+    attached = gDeviceCount;
+    pthread_mutex_unlock(&gDeviceLock);
+    
+    // the registers can only be written in reset mode, so this goes through the whole init sequence
+    if (attached == 0)
+        return kIOReturnSuccess;
+    
+    return PeakInit(gLastBitrate);
+}
+
+IOReturn PeakGetAcceptanceStats(PeakAcceptanceStats* stats)
+{
+    UInt32 i;
+    
+    bzero(stats, sizeof(PeakAcceptanceStats));
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+    {
+        stats->frames  += gDevices[i].exactFrames;
+        stats->dropped += gDevices[i].exactDropped;
+    }
+    stats->wanted  = gExactCount;
+    if (stats->frames)
+        stats->falsePositives = (double)stats->dropped / stats->frames;
+    
+    pthread_mutex_lock(&gDeviceLock);
+    stats->single  = gAcceptance.single;
+    PeakAcceptancePassed(&gAcceptance, &stats->stdPassed, &stats->extPassed);
+    pthread_mutex_unlock(&gDeviceLock);
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakSetReadDepth(UInt32 depth)
+{
+    if (depth == 0 || depth > PEAK_RX_MAX_DEPTH)
+        return kIOReturnBadArgument;
+    
+    gRxDepth = depth; // applies to the next device
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakSetTransport(PeakTransport* transport)
+{
+    if (transport == NULL)
+        return kIOReturnBadArgument;
+    
+    gTransport = transport; // applies to the next PeakStart
+    return kIOReturnSuccess;
+}
+
+//================================================================================================
+//	PeakStop
+//================================================================================================
+IOReturn PeakStop(void)
+{
+    gTransport->stop(gTransport);
+    return kIOReturnSuccess;
+}
+
+//================================================================================================
+//	PeakStart
+//================================================================================================
+IOReturn PeakStart(void)
+{
+    IOReturn kr;
+    
+    // the adapters register their rings as they come, the receive slots are allocated per channel
+    PeakMergeInit(&gMerge, gMergeWindow);
+    PeakBatcherInit(&gRxBatcher, &gMerge, FlushBatch, &gRxBatcher);
+    ResetInstrumentation();
+    
+    fprintf(stderr, "Starting %s transport.\n", gTransport->name);
+    
+    // runs the backend's event loop until PeakStop
+    kr = gTransport->run(gTransport);
+    
+    fprintf(stderr, "Stopped %s transport.\n", gTransport->name);
+    return kr;
+}
@@ -0,0 +1,512 @@
+/*
+    File:           PeakExport.c
+
+    Description:    Batch text export of frames as candump -L, Vector ASC and CSV through a large
+                    output buffer with table driven number formatting.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "PeakExport.h"
+#include "PeakIndex.h"
+
+static char gHexPairs[512];     // "000102...FF"
+static char gDecPairs[200];     // "000102...99"
+static int  gTablesReady = 0;
+
+#pragma mark - Number formatting
+
+static void InitTables(void)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    int i;
+    
+    if (gTablesReady)
+        return;
+    
+    for (i = 0; i < 256; i++)
+    {
+        gHexPairs[2 * i]     = hex[i >> 4];
+        gHexPairs[2 * i + 1] = hex[i & 0xf];
+    }
+    for (i = 0; i < 100; i++)
+    {
+        gDecPairs[2 * i]     = '0' + i / 10;
+        gDecPairs[2 * i + 1] = '0' + i % 10;
+    }
+    gTablesReady = 1;
+}
+
+static inline char* PutHex2(char* ptr, UInt8 value)
+{
+    memcpy(ptr, &gHexPairs[2 * value], 2);
+    return ptr + 2;
+}
+
+// exactly digits hex digits, digits is even
+static inline char* PutHexFixed(char* ptr, UInt32 value, int digits)
+{
+    int i;
+    for (i = digits - 2; i >= 0; i -= 2)
+        ptr = PutHex2(ptr, (UInt8)(value >> (4 * i)));
+    return ptr;
+}
+
+// without leading zeros
+static inline char* PutHex(char* ptr, UInt32 value)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    char tmp[8];
+    int n = 0;
+    
+    do {
+        tmp[n++] = hex[value & 0xf];
+        value >>= 4;
+    } while (value);
+    
+    while (n)
+        *ptr++ = tmp[--n];
+    return ptr;
+}
+
+// exactly digits decimal digits
+static inline char* PutDecFixed(char* ptr, UInt64 value, int digits)
+{
+    char* end = ptr + digits;
+    char* pos = end;
+    
+    while (pos - ptr >= 2)
+    {
+        pos -= 2;
+        memcpy(pos, &gDecPairs[2 * (value % 100)], 2);
+        value /= 100;
+    }
+    if (pos > ptr)
+        *--pos = '0' + value % 10;
+    return end;
+}
+
+// without leading zeros, padded with spaces to at least width
+static inline char* PutDec(char* ptr, UInt64 value, int width)
+{
+    char tmp[20];
+    char* pos = tmp + sizeof(tmp);
+    int n;
+    
+    while (value >= 100)
+    {
+        pos -= 2;
+        memcpy(pos, &gDecPairs[2 * (value % 100)], 2);
+        value /= 100;
+    }
+    if (value >= 10)
+    {
+        pos -= 2;
+        memcpy(pos, &gDecPairs[2 * value], 2);
+    }
+    else
+    {
+        *--pos = '0' + (char)value;
+    }
+    
+    n = (int)(tmp + sizeof(tmp) - pos);
+    while (width-- > n)
+        *ptr++ = ' ';
+    memcpy(ptr, pos, n);
+    return ptr + n;
+}
+
+static inline char* PutString(char* ptr, const char* string)
+{
+    size_t n = strlen(string);
+    memcpy(ptr, string, n);
+    return ptr + n;
+}
+
+#pragma mark - Lines
+
+static char* CandumpLine(PeakExporter* exporter, char* ptr, const PeakCaptureRecord* record)
+{
+    UInt32 i, len = record->dlc > 8 ? 8 : record->dlc;
+    
+    *ptr++ = '(';
+    ptr = PutDecFixed(ptr, record->ts / 1000000000ULL, 10);
+    *ptr++ = '.';
+    ptr = PutDecFixed(ptr, (record->ts % 1000000000ULL) / 1000ULL, 6);
+    *ptr++ = ')';
+    *ptr++ = ' ';
+    ptr = PutString(ptr, exporter->channel);
+    *ptr++ = ' ';
+    
+    // error frames carry CAN_ERR_FLAG in the 29 bit notation, as in SocketCAN
+    if (record->flags & PEAK_CAPTURE_ERR)
+        ptr = PutHexFixed(ptr, 0x20000000 | (record->canid & 0x1fffffff), 8);
+    else if (record->flags & PEAK_CAPTURE_EXT)
+        ptr = PutHexFixed(ptr, record->canid & 0x1fffffff, 8);
+    else
+    {
+        *ptr++ = gHexPairs[2 * ((record->canid >> 8) & 0x7) + 1];
+        ptr = PutHex2(ptr, (UInt8)record->canid);
+    }
+    *ptr++ = '#';
+    
+    if (record->flags & PEAK_CAPTURE_RTR)
+    {
+        *ptr++ = 'R';
+    }
+    else
+    {
+        for (i = 0; i < len; i++)
+            ptr = PutHex2(ptr, record->data[i]);
+    }
+    
+    *ptr++ = '\n';
+    return ptr;
+}
+
+static char* AscLine(PeakExporter* exporter, char* ptr, const PeakCaptureRecord* record)
+{
+    UInt64 rel = record->ts > exporter->startNs ? record->ts - exporter->startNs : 0;
+    UInt32 i, len = record->dlc > 8 ? 8 : record->dlc;
+    char* id;
+    
+    ptr = PutDec(ptr, rel / 1000000000ULL, 4);
+    *ptr++ = '.';
+    ptr = PutDecFixed(ptr, (rel % 1000000000ULL) / 1000ULL, 6);
+    *ptr++ = ' ';
+    ptr = PutString(ptr, exporter->channel);
+    
+    if (record->flags & PEAK_CAPTURE_ERR)
+    {
+        ptr = PutString(ptr, "  ErrorFrame\n");
+        return ptr;
+    }
+    
+    *ptr++ = ' ';
+    *ptr++ = ' ';
+    id = ptr;
+    ptr = PutHex(ptr, record->canid & 0x1fffffff);
+    if (record->flags & PEAK_CAPTURE_EXT)
+        *ptr++ = 'x';
+    while (ptr - id < 15)
+        *ptr++ = ' ';
+    
+    ptr = PutString(ptr, (record->flags & PEAK_CAPTURE_LOC) ? " Tx   " : " Rx   ");
+    
+    if (record->flags & PEAK_CAPTURE_RTR)
+    {
+        *ptr++ = 'r';
+    }
+    else
+    {
+        *ptr++ = 'd';
+        *ptr++ = ' ';
+        *ptr++ = '0' + len;
+        for (i = 0; i < len; i++)
+        {
+            *ptr++ = ' ';
+            ptr = PutHex2(ptr, record->data[i]);
+        }
+    }
+    
+    *ptr++ = '\n';
+    return ptr;
+}
+
+static char* CsvLine(PeakExporter* exporter, char* ptr, const PeakCaptureRecord* record)
+{
+    UInt32 i, len = record->dlc > 8 ? 8 : record->dlc;
+    
+    (void)exporter;
+    ptr = PutDec(ptr, record->ts / 1000000000ULL, 0);
+    *ptr++ = '.';
+    ptr = PutDecFixed(ptr, (record->ts % 1000000000ULL) / 1000ULL, 6);
+    *ptr++ = ',';
+    *ptr++ = '0';
+    *ptr++ = 'x';
+    ptr = PutHex(ptr, record->canid & 0x1fffffff);
+    *ptr++ = ',';
+    *ptr++ = (record->flags & PEAK_CAPTURE_EXT) ? '1' : '0';
+    *ptr++ = ',';
+    *ptr++ = (record->flags & PEAK_CAPTURE_RTR) ? '1' : '0';
+    *ptr++ = ',';
+    *ptr++ = (record->flags & PEAK_CAPTURE_ERR) ? '1' : '0';
+    *ptr++ = ',';
+    ptr = PutString(ptr, (record->flags & PEAK_CAPTURE_LOC) ? "Tx," : "Rx,");
+    *ptr++ = '0' + len;
+    *ptr++ = ',';
+    
+    if (!(record->flags & PEAK_CAPTURE_RTR))
+    {
+        for (i = 0; i < len; i++)
+        {
+            if (i)
+                *ptr++ = ' ';
+            ptr = PutHex2(ptr, record->data[i]);
+        }
+    }
+    
+    *ptr++ = '\n';
+    return ptr;
+}
+
+#pragma mark - Output
+
+static IOReturn Flush(PeakExporter* exporter)
+{
+    const char* ptr = exporter->buffer;
+    size_t length = exporter->used;
+    
+    if (exporter->error != kIOReturnSuccess)
+        return exporter->error;
+    
+    while (length > 0)
+    {
+        ssize_t n = write(exporter->fd, ptr, length);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Unable to write export (%s)\n", strerror(errno));
+            exporter->error = kIOReturnIOError;
+            return exporter->error;
+        }
+        ptr += n;
+        length -= n;
+    }
+    
+    exporter->bytes += exporter->used;
+    exporter->used = 0;
+    return kIOReturnSuccess;
+}
+
+static void Append(PeakExporter* exporter, const char* text)
+{
+    size_t n = strlen(text);
+    
+    if (exporter->used + n > PEAK_EXPORT_BUFFER_SIZE)
+        Flush(exporter);
+    if (n <= PEAK_EXPORT_BUFFER_SIZE)
+    {
+        memcpy(exporter->buffer + exporter->used, text, n);
+        exporter->used += n;
+    }
+}
+
+// ASC wants the wall clock of the first frame in its header
+static void AscDate(UInt64 ns, char* buffer, size_t size)
+{
+    time_t seconds = (time_t)(ns / 1000000000ULL);
+    struct tm tm;
+    char day[32], year[8];
+    
+    localtime_r(&seconds, &tm);
+    strftime(day, sizeof(day), "%a %b %d %I:%M:%S", &tm);
+    strftime(year, sizeof(year), "%Y", &tm);
+    snprintf(buffer, size, "%s.%03u %s %s", day, (unsigned)((ns / 1000000ULL) % 1000), tm.tm_hour < 12 ? "am" : "pm", year);
+}
+
+static void Start(PeakExporter* exporter, UInt64 firstNs)
+{
+    char date[64], line[192];
+    
+    exporter->started = 1;
+    exporter->startNs = firstNs;
+    
+    switch (exporter->format) {
+        case PEAK_EXPORT_ASC:
+            AscDate(firstNs, date, sizeof(date));
+            snprintf(line, sizeof(line), "date %s\nbase hex  timestamps absolute\nno internal events logged\n", date);
+            Append(exporter, line);
+            snprintf(line, sizeof(line), "// version 7.0.0\nBegin Triggerblock %s\n   0.000000 Start of measurement\n", date);
+            Append(exporter, line);
+            break;
+        case PEAK_EXPORT_CSV:
+            Append(exporter, "time,id,ext,rtr,err,dir,dlc,data\n");
+            break;
+        default:
+            break;
+    }
+}
+
+UInt32 PeakExportFormatForPath(const char* path)
+{
+    const char* dot = strrchr(path, '.');
+    
+    if (dot && strcasecmp(dot, ".log") == 0)
+        return PEAK_EXPORT_CANDUMP;
+    if (dot && strcasecmp(dot, ".asc") == 0)
+        return PEAK_EXPORT_ASC;
+    return PEAK_EXPORT_CSV;
+}
+
+IOReturn PeakExportOpenFd(PeakExporter* exporter, int fd, UInt32 format, const char* channel)
+{
+    if (format > PEAK_EXPORT_CSV)
+        return kIOReturnBadArgument;
+    
+    InitTables();
+    bzero(exporter, sizeof(PeakExporter));
+    exporter->fd = fd;
+    exporter->format = format;
+    
+    if (channel == NULL)
+        channel = (format == PEAK_EXPORT_ASC) ? "1" : "can0";
+    strncpy(exporter->channel, channel, sizeof(exporter->channel) - 1);
+    
+    exporter->buffer = malloc(PEAK_EXPORT_BUFFER_SIZE);
+    if (exporter->buffer == NULL)
+        return kIOReturnNoMemory;
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakExportOpen(PeakExporter* exporter, const char* path, UInt32 format, const char* channel)
+{
+    IOReturn kr;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    
+    if (fd < 0)
+    {
+        fprintf(stderr, "Unable to open export %s (%s)\n", path, strerror(errno));
+        return kIOReturnNotOpen;
+    }
+    
+    kr = PeakExportOpenFd(exporter, fd, format, channel);
+    if (kr != kIOReturnSuccess)
+    {
+        close(fd);
+        return kr;
+    }
+    
+    exporter->ownsFd = 1;
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakExportRecords(PeakExporter* exporter, const PeakCaptureRecord* records, UInt32 count)
+{
+    UInt32 i;
+    
+    if (count && !exporter->started)
+        Start(exporter, records[0].ts);
+    
+    for (i = 0; i < count; i++)
+    {
+        char* ptr;
+        
+        if (exporter->used + PEAK_EXPORT_MAX_LINE > PEAK_EXPORT_BUFFER_SIZE && Flush(exporter) != kIOReturnSuccess)
+            return exporter->error;
+        
+        ptr = exporter->buffer + exporter->used;
+        switch (exporter->format) {
+            case PEAK_EXPORT_CANDUMP: ptr = CandumpLine(exporter, ptr, &records[i]); break;
+            case PEAK_EXPORT_ASC:     ptr = AscLine(exporter, ptr, &records[i]); break;
+            default:                  ptr = CsvLine(exporter, ptr, &records[i]); break;
+        }
+        exporter->used = ptr - exporter->buffer;
+    }
+    
+    exporter->lines += count;
+    return exporter->error;
+}
+
+IOReturn PeakExportFrames(PeakExporter* exporter, const CanMsg* msgs, UInt32 count)
+{
+    PeakCaptureRecord records[256];
+    UInt32 i, n;
+    IOReturn kr = kIOReturnSuccess;
+    
+    while (count > 0 && kr == kIOReturnSuccess)
+    {
+        n = count < 256 ? count : 256;
+        for (i = 0; i < n; i++)
+            PeakCaptureRecordFromMsg(&records[i], &msgs[i]);
+        kr = PeakExportRecords(exporter, records, n);
+        msgs += n;
+        count -= n;
+    }
+    
+    return kr;
+}
+
+IOReturn PeakExportClose(PeakExporter* exporter)
+{
+    IOReturn kr;
+    
+    if (exporter->format == PEAK_EXPORT_ASC && exporter->started)
+        Append(exporter, "End TriggerBlock\n");
+    
+    kr = Flush(exporter);
+    
+    if (exporter->ownsFd && close(exporter->fd) != 0 && kr == kIOReturnSuccess)
+        kr = kIOReturnIOError;
+    
+    free(exporter->buffer);
+    exporter->buffer = NULL;
+    exporter->fd = -1;
+    return kr;
+}
+
+IOReturn PeakExportCapture(const char* capturePath, const char* path, UInt32 format, const char* channel)
+{
+    PeakIndexReader reader;
+    PeakExporter exporter;
+    UInt64 n;
+    IOReturn kr;
+    
+    kr = PeakIndexOpen(&reader, capturePath);
+    if (kr != kIOReturnSuccess)
+        return kr;
+    
+    kr = PeakExportOpen(&exporter, path, format, channel);
+    if (kr != kIOReturnSuccess)
+    {
+        PeakIndexClose(&reader);
+        return kr;
+    }
+    
+    // the mapped records are exported in place unless a later version made them larger
+    for (n = 0; n < reader.recordCount && kr == kIOReturnSuccess; n += 4096)
+    {
+        UInt32 count = reader.recordCount - n < 4096 ? (UInt32)(reader.recordCount - n) : 4096;
+        
+        if (reader.recordSize == sizeof(PeakCaptureRecord))
+        {
+            kr = PeakExportRecords(&exporter, PeakIndexRecord(&reader, n), count);
+        }
+        else
+        {
+            UInt32 i;
+            for (i = 0; i < count && kr == kIOReturnSuccess; i++)
+                kr = PeakExportRecords(&exporter, PeakIndexRecord(&reader, n + i), 1);
+        }
+    }
+    
+    if (PeakExportClose(&exporter) != kIOReturnSuccess && kr == kIOReturnSuccess)
+        kr = kIOReturnIOError;
+    PeakIndexClose(&reader);
+    return kr;
+}
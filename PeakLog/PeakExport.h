@@ -0,0 +1,65 @@
+/*
+    File:           PeakExport.h
+
+    Description:    Batch text export of frames as candump -L, Vector ASC and CSV through a large
+                    output buffer with table driven number formatting.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakExport_h
+#define PeakLog_PeakExport_h
+
+#include "PeakUSB.h"
+#include "PeakCapture.h"
+
+#define PEAK_EXPORT_CANDUMP         0   // candump -L: "(1436509052.249713) can0 123#DEADBEEF"
+#define PEAK_EXPORT_ASC             1   // Vector ASC, absolute hex, time relative to the first frame
+#define PEAK_EXPORT_CSV             2   // "time,id,ext,rtr,err,dir,dlc,data"
+
+#define PEAK_EXPORT_BUFFER_SIZE     (1 << 20)
+#define PEAK_EXPORT_MAX_LINE        128 // longest line any format produces
+
+// Lines are formatted straight into one buffer which is written whenever it is nearly full; nothing is
+// allocated per frame. The frames are taken in batches, either as CanMsgs or as capture records.
+typedef struct {
+    int         fd;
+    int         ownsFd;
+    UInt32      format;
+    char        channel[16];    // interface name for candump, channel number for ASC
+    char*       buffer;
+    size_t      used;
+    UInt64      startNs;        // first frame, ASC times are relative to it
+    int         started;
+    UInt64      lines;
+    UInt64      bytes;
+    IOReturn    error;          // first write error, later calls fail with it
+} PeakExporter;
+
+// Picks the format from the extension: .log candump, .asc ASC, anything else CSV.
+UInt32 PeakExportFormatForPath(const char* path);
+
+IOReturn PeakExportOpen(PeakExporter* exporter, const char* path, UInt32 format, const char* channel);
+IOReturn PeakExportOpenFd(PeakExporter* exporter, int fd, UInt32 format, const char* channel);
+IOReturn PeakExportFrames(PeakExporter* exporter, const CanMsg* msgs, UInt32 count);
+IOReturn PeakExportRecords(PeakExporter* exporter, const PeakCaptureRecord* records, UInt32 count);
+IOReturn PeakExportClose(PeakExporter* exporter);
+
+// Converts a whole capture file.
+IOReturn PeakExportCapture(const char* capturePath, const char* path, UInt32 format, const char* channel);
+
+#endif
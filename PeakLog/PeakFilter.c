@@ -0,0 +1,303 @@
+/*
+    File:           PeakFilter.c
+
+    Description:    Frame filters compiled from id ranges, id masks, flags and payload masks into a
+                    compact program the decoder evaluates before a frame is copied or dispatched.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "PeakFilter.h"
+
+#pragma mark - Terms
+
+void PeakFilterTermInit(PeakFilterTerm* term)
+{
+    bzero(term, sizeof(PeakFilterTerm));
+    term->high = PEAK_FILTER_MAX_ID;
+    term->maxLength = 8;
+}
+
+int PeakFilterTermAnd(PeakFilterTerm* a, const PeakFilterTerm* b)
+{
+    UInt32 i, common;
+    
+    if (b->low > a->low) a->low = b->low;
+    if (b->high < a->high) a->high = b->high;
+    if (a->low > a->high)
+        return 0;
+    
+    common = a->mask & b->mask;
+    if ((a->code & common) != (b->code & common))
+        return 0;
+    a->code = (a->code & a->mask) | (b->code & b->mask);
+    a->mask |= b->mask;
+    
+    common = a->flagsMask & b->flagsMask;
+    if ((a->flagsValue & common) != (b->flagsValue & common))
+        return 0;
+    a->flagsValue = (a->flagsValue & a->flagsMask) | (b->flagsValue & b->flagsMask);
+    a->flagsMask |= b->flagsMask;
+    
+    if (b->minLength > a->minLength) a->minLength = b->minLength;
+    if (b->maxLength < a->maxLength) a->maxLength = b->maxLength;
+    if (a->minLength > a->maxLength)
+        return 0;
+    
+    for (i = 0; i < 8; i++)
+    {
+        common = a->dataMask[i] & b->dataMask[i];
+        if ((a->dataValue[i] & common) != (b->dataValue[i] & common))
+            return 0;
+        a->dataValue[i] = (a->dataValue[i] & a->dataMask[i]) | (b->dataValue[i] & b->dataMask[i]);
+        a->dataMask[i] |= b->dataMask[i];
+    }
+    
+    return 1;
+}
+
+static UInt8 FlagsOf(const CanMsg* msg)
+{
+    return (msg->ext ? PEAK_FILTER_EXT : 0) | (msg->rtr ? PEAK_FILTER_RTR : 0) |
+           (msg->err ? PEAK_FILTER_ERR : 0) | (msg->loc ? PEAK_FILTER_LOC : 0);
+}
+
+int PeakFilterTermMatch(const PeakFilterTerm* term, const CanMsg* msg)
+{
+    UInt32 i, len, canid = msg->canid.ul;
+    
+    if (canid < term->low || canid > term->high || (canid & term->mask) != term->code)
+        return 0;
+    
+    if ((FlagsOf(msg) & term->flagsMask) != term->flagsValue)
+        return 0;
+    
+    if (msg->len < term->minLength || msg->len > term->maxLength)
+        return 0;
+    
+    // a byte the frame does not have matches no mask, whatever the buffer holds there
+    len = msg->len > 8 ? 8 : msg->len;
+    for (i = 0; i < 8; i++)
+    {
+        if ((term->dataMask[i] && i >= len) || (msg->data[i] & term->dataMask[i]) != term->dataValue[i])
+            return 0;
+    }
+    
+    return 1;
+}
+
+// only the identifier and the ext flag matter
+static int IsIdTerm(const PeakFilterTerm* term)
+{
+    UInt32 i;
+    
+    if ((term->flagsMask & ~PEAK_FILTER_EXT) || term->minLength > 0 || term->maxLength < 8)
+        return 0;
+    
+    for (i = 0; i < 8; i++)
+    {
+        if (term->dataMask[i])
+            return 0;
+    }
+    
+    // a range and a mask together are rare, keep them exact
+    return term->mask == 0 || (term->low == 0 && term->high == PEAK_FILTER_MAX_ID);
+}
+
+#pragma mark - Compiler
+
+static int CompareTerms(const void* a, const void* b)
+{
+    UInt32 la = ((const PeakFilterTerm*)a)->low, lb = ((const PeakFilterTerm*)b)->low;
+    return (la > lb) - (la < lb);
+}
+
+static int CompareRanges(const void* a, const void* b)
+{
+    UInt32 la = ((const UInt32*)a)[0], lb = ((const UInt32*)b)[0];
+    return (la > lb) - (la < lb);
+}
+
+PeakFilterProgram* PeakFilterCompile(const PeakFilterTerm* terms, UInt32 count)
+{
+    PeakFilterProgram* program = calloc(1, sizeof(PeakFilterProgram));
+    UInt32 i, id, n;
+    
+    if (program == NULL)
+        return NULL;
+    
+    if (terms == NULL)
+    {
+        program->acceptAll = 1;
+        return program;
+    }
+    
+    program->extRanges = malloc((count + 1) * 2 * sizeof(UInt32));
+    program->extMasks = malloc((count + 1) * 2 * sizeof(UInt32));
+    program->terms = malloc((count + 1) * sizeof(PeakFilterTerm));
+    program->termMaxHigh = malloc((count + 1) * sizeof(UInt32));
+    if (!program->extRanges || !program->extMasks || !program->terms || !program->termMaxHigh)
+    {
+        PeakFilterFree(program);
+        return NULL;
+    }
+    
+    for (i = 0; i < count; i++)
+    {
+        const PeakFilterTerm* term = &terms[i];
+        int wantsStd = !(term->flagsMask & PEAK_FILTER_EXT) || !(term->flagsValue & PEAK_FILTER_EXT);
+        int wantsExt = !(term->flagsMask & PEAK_FILTER_EXT) || (term->flagsValue & PEAK_FILTER_EXT);
+        
+        if (!IsIdTerm(term))
+        {
+            program->terms[program->termCount++] = *term;
+            continue;
+        }
+        
+        if (wantsStd && term->low <= 0x7ff)
+        {
+            UInt32 high = term->high < 0x7ff ? term->high : 0x7ff;
+            for (id = term->low; id <= high; id++)
+            {
+                if ((id & term->mask) == term->code)
+                    program->stdBitmap[id >> 5] |= 1u << (id & 31);
+            }
+        }
+        
+        // a mask over every bit is a single identifier, which goes with the ranges
+        if (wantsExt)
+        {
+            if (term->mask && (term->mask & PEAK_FILTER_MAX_ID) != PEAK_FILTER_MAX_ID)
+            {
+                program->extMasks[2 * program->extMaskCount]     = term->code;
+                program->extMasks[2 * program->extMaskCount + 1] = term->mask;
+                program->extMaskCount++;
+            }
+            else
+            {
+                program->extRanges[2 * program->extRangeCount]     = term->mask ? term->code & PEAK_FILTER_MAX_ID : term->low;
+                program->extRanges[2 * program->extRangeCount + 1] = term->mask ? term->code & PEAK_FILTER_MAX_ID : term->high;
+                program->extRangeCount++;
+            }
+        }
+    }
+    
+    // sort and merge overlapping or adjacent ranges, so one binary search decides
+    qsort(program->extRanges, program->extRangeCount, 2 * sizeof(UInt32), CompareRanges);
+    for (i = 0, n = 0; i < program->extRangeCount; i++)
+    {
+        UInt32 low = program->extRanges[2 * i], high = program->extRanges[2 * i + 1];
+        
+        if (n > 0 && low <= program->extRanges[2 * n - 1] + 1)
+        {
+            if (high > program->extRanges[2 * n - 1])
+                program->extRanges[2 * n - 1] = high;
+        }
+        else
+        {
+            program->extRanges[2 * n]     = low;
+            program->extRanges[2 * n + 1] = high;
+            n++;
+        }
+    }
+    program->extRangeCount = n;
+    
+    // the remaining terms are looked up like intervals: only those starting at or below the identifier
+    // and not all ending before it need a look
+    qsort(program->terms, program->termCount, sizeof(PeakFilterTerm), CompareTerms);
+    for (i = 0; i < program->termCount; i++)
+    {
+        UInt32 high = program->terms[i].high;
+        program->termMaxHigh[i] = (i > 0 && program->termMaxHigh[i - 1] > high) ? program->termMaxHigh[i - 1] : high;
+    }
+    
+    return program;
+}
+
+void PeakFilterFree(PeakFilterProgram* program)
+{
+    if (program == NULL)
+        return;
+    
+    free(program->extRanges);
+    free(program->extMasks);
+    free(program->terms);
+    free(program->termMaxHigh);
+    free(program);
+}
+
+#pragma mark - Evaluation
+
+int PeakFilterMatch(const PeakFilterProgram* program, const CanMsg* msg)
+{
+    UInt32 i, canid = msg->canid.ul;
+    
+    if (program->acceptAll)
+        return 1;
+    
+    if (!msg->ext)
+    {
+        if (canid <= 0x7ff && (program->stdBitmap[canid >> 5] & (1u << (canid & 31))))
+            return 1;
+    }
+    else
+    {
+        UInt32 lo = 0, hi = program->extRangeCount;
+        
+        // last range starting at or below canid
+        while (lo < hi)
+        {
+            UInt32 mid = lo + (hi - lo) / 2;
+            if (program->extRanges[2 * mid] <= canid)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo > 0 && canid <= program->extRanges[2 * lo - 1])
+            return 1;
+        
+        for (i = 0; i < program->extMaskCount; i++)
+        {
+            if ((canid & program->extMasks[2 * i + 1]) == program->extMasks[2 * i])
+                return 1;
+        }
+    }
+    
+    if (program->termCount)
+    {
+        UInt32 lo = 0, hi = program->termCount;
+        
+        while (lo < hi)
+        {
+            UInt32 mid = lo + (hi - lo) / 2;
+            if (program->terms[mid].low <= canid)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (i = lo; i > 0 && program->termMaxHigh[i - 1] >= canid; i--)
+        {
+            if (PeakFilterTermMatch(&program->terms[i - 1], msg))
+                return 1;
+        }
+    }
+    
+    return 0;
+}
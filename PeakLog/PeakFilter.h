@@ -0,0 +1,72 @@
+/*
+    File:           PeakFilter.h
+
+    Description:    Frame filters compiled from id ranges, id masks, flags and payload masks into a
+                    compact program the decoder evaluates before a frame is copied or dispatched.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakFilter_h
+#define PeakLog_PeakFilter_h
+
+#include "PeakUSB.h"
+
+#define PEAK_FILTER_EXT             0x01    // flags, as the bit fields in CanMsg
+#define PEAK_FILTER_RTR             0x02
+#define PEAK_FILTER_ERR             0x04
+#define PEAK_FILTER_LOC             0x08
+
+#define PEAK_FILTER_MAX_ID          0x1fffffff
+
+// A term matches a frame if all of its conditions hold, a filter passes a frame if any term matches.
+// PeakFilterTermInit sets up a term which matches everything.
+struct PeakFilterTerm {
+    UInt32  low, high;          // identifier range
+    UInt32  code, mask;         // (canid & mask) == code
+    UInt8   flagsMask;          // (flags & flagsMask) == flagsValue
+    UInt8   flagsValue;
+    UInt8   minLength, maxLength;
+    UInt8   dataMask[8];        // (data[i] & dataMask[i]) == dataValue[i], never past the length
+    UInt8   dataValue[8];
+};
+
+// Compiled form: identifier-only terms end up in a bitmap for the 11 bit identifiers and in sorted,
+// merged ranges and a mask list for the 29 bit ones; the other terms are checked one by one.
+typedef struct {
+    UInt32          acceptAll;
+    UInt32          stdBitmap[2048 / 32];
+    UInt32*         extRanges;      // low/high pairs, sorted and disjoint
+    UInt32          extRangeCount;
+    UInt32*         extMasks;       // code/mask pairs
+    UInt32          extMaskCount;
+    PeakFilterTerm* terms;          // terms with flag, length or payload conditions, sorted by low
+    UInt32*         termMaxHigh;    // largest high of terms[0..i]
+    UInt32          termCount;
+} PeakFilterProgram;
+
+void PeakFilterTermInit(PeakFilterTerm* term);
+// Narrows a to the frames matched by both terms, returns 0 if no frame can match both.
+int PeakFilterTermAnd(PeakFilterTerm* a, const PeakFilterTerm* b);
+int PeakFilterTermMatch(const PeakFilterTerm* term, const CanMsg* msg);
+
+// An empty term list compiles to a program rejecting everything, NULL terms to one accepting everything.
+PeakFilterProgram* PeakFilterCompile(const PeakFilterTerm* terms, UInt32 count);
+void PeakFilterFree(PeakFilterProgram* program);
+int PeakFilterMatch(const PeakFilterProgram* program, const CanMsg* msg);
+
+#endif
@@ -0,0 +1,184 @@
+/*
+    File:           PeakFrameStore.c
+
+    Description:    Struct-of-arrays circular store of received frames behind the log table, with
+                    O(1) append and eviction.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PeakFrameStore.h"
+
+#pragma mark - Setup
+
+IOReturn PeakFrameStoreCreate(PeakFrameStore* store, UInt32 capacity)
+{
+    bzero(store, sizeof(PeakFrameStore));
+    
+    if (capacity == 0 || (capacity & (capacity - 1)))
+        return kIOReturnBadArgument;
+    
+    store->ts    = malloc(capacity * sizeof(UInt64));
+    store->canid = malloc(capacity * sizeof(UInt32));
+    store->flags = malloc(capacity * sizeof(UInt8));
+    store->dlc   = malloc(capacity * sizeof(UInt8));
+    store->data  = malloc(capacity * sizeof(UInt64));
+    store->tag   = malloc(capacity * sizeof(UInt32));
+    
+    if (!store->ts || !store->canid || !store->flags || !store->dlc || !store->data || !store->tag)
+    {
+        PeakFrameStoreDestroy(store);
+        return kIOReturnNoMemory;
+    }
+    
+    store->mask = capacity - 1;
+    return kIOReturnSuccess;
+}
+
+void PeakFrameStoreDestroy(PeakFrameStore* store)
+{
+    free(store->ts);
+    free(store->canid);
+    free(store->flags);
+    free(store->dlc);
+    free(store->data);
+    free(store->tag);
+    bzero(store, sizeof(PeakFrameStore));
+}
+
+size_t PeakFrameStoreMemory(UInt32 capacity)
+{
+    return (size_t)capacity * (sizeof(UInt64) + sizeof(UInt32) + 2 * sizeof(UInt8) + sizeof(UInt64) + sizeof(UInt32));
+}
+
+#pragma mark - Append and evict
+
+void PeakFrameStoreAppend(PeakFrameStore* store, const CanMsg* msgs, const UInt32* tags, UInt32 count)
+{
+    UInt32 i;
+    
+    for (i = 0; i < count; i++)
+    {
+        const CanMsg* msg = &msgs[i];
+        UInt32 slot = (UInt32)(store->head & store->mask);
+        
+        store->ts[slot]    = msg->ts;
+        store->canid[slot] = msg->canid.ul;
+        store->flags[slot] = (msg->ext ? PEAK_STORE_EXT : 0) | (msg->rtr ? PEAK_STORE_RTR : 0) |
+                             (msg->err ? PEAK_STORE_ERR : 0) | (msg->loc ? PEAK_STORE_LOC : 0) |
+                             (msg->channel << PEAK_STORE_CHANNEL_SHIFT);
+        store->dlc[slot]   = msg->len;
+        store->data[slot]  = msg->ldata;
+        store->tag[slot]   = tags ? tags[i] : 0;
+        store->head++;
+    }
+    
+    // the oldest frames were overwritten
+    if (store->head - store->tail > (UInt64)store->mask + 1)
+    {
+        store->evicted += store->head - store->tail - (store->mask + 1);
+        store->tail = store->head - (store->mask + 1);
+    }
+}
+
+void PeakFrameStoreEvict(PeakFrameStore* store, UInt64 count)
+{
+    if (count > store->head - store->tail)
+        count = store->head - store->tail;
+    
+    store->tail += count;
+    store->evicted += count;
+}
+
+void PeakFrameStoreClear(PeakFrameStore* store)
+{
+    store->tail = store->head;
+}
+
+#pragma mark - Access
+
+UInt64 PeakFrameStoreCount(const PeakFrameStore* store)
+{
+    return store->head - store->tail;
+}
+
+UInt32 PeakFrameStoreCapacity(const PeakFrameStore* store)
+{
+    return store->mask + 1;
+}
+
+IOReturn PeakFrameStoreGet(const PeakFrameStore* store, UInt64 row, CanMsg* msg)
+{
+    UInt32 slot;
+    
+    if (row >= store->head - store->tail)
+        return kIOReturnBadArgument;
+    
+    slot = (UInt32)((store->tail + row) & store->mask);
+    bzero(msg, sizeof(CanMsg));
+    msg->ts         = store->ts[slot];
+    msg->canid.ul   = store->canid[slot];
+    msg->ext        = (store->flags[slot] & PEAK_STORE_EXT) != 0;
+    msg->rtr        = (store->flags[slot] & PEAK_STORE_RTR) != 0;
+    msg->err        = (store->flags[slot] & PEAK_STORE_ERR) != 0;
+    msg->loc        = (store->flags[slot] & PEAK_STORE_LOC) != 0;
+    msg->channel    = store->flags[slot] >> PEAK_STORE_CHANNEL_SHIFT;
+    msg->len        = store->dlc[slot];
+    msg->ldata      = store->data[slot];
+    return kIOReturnSuccess;
+}
+
+UInt32 PeakFrameStoreTag(const PeakFrameStore* store, UInt64 row)
+{
+    if (row >= store->head - store->tail)
+        return 0;
+    
+    return store->tag[(store->tail + row) & store->mask];
+}
+
+int PeakFrameStoreFormatData(const PeakFrameStore* store, UInt64 row, char* buffer, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    UInt32 slot, i, len;
+    const UInt8* data;
+    char line[8 * 5 + 1];
+    char* ptr = line;
+    
+    if (row >= store->head - store->tail)
+        return snprintf(buffer, size, "%s", "");
+    
+    slot = (UInt32)((store->tail + row) & store->mask);
+    data = (const UInt8*)&store->data[slot];
+    len = store->dlc[slot] > 8 ? 8 : store->dlc[slot];
+    
+    // " 0x%02x" for every byte, as the log always showed it
+    for (i = 0; i < len; i++)
+    {
+        *ptr++ = ' ';
+        *ptr++ = '0';
+        *ptr++ = 'x';
+        *ptr++ = hex[data[i] >> 4];
+        *ptr++ = hex[data[i] & 0xf];
+    }
+    *ptr = 0;
+    
+    return snprintf(buffer, size, "%s", line);
+}
@@ -0,0 +1,72 @@
+/*
+    File:           PeakFrameStore.h
+
+    Description:    Struct-of-arrays circular store of received frames behind the log table, with
+                    O(1) append and eviction.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakFrameStore_h
+#define PeakLog_PeakFrameStore_h
+
+#include "PeakUSB.h"
+
+// default number of frames kept, must be a power of two; 26 bytes each
+#define PEAK_STORE_DEFAULT_CAPACITY (1 << 22)
+
+#define PEAK_STORE_EXT              0x01    // flags, as the bit fields in CanMsg
+#define PEAK_STORE_RTR              0x02
+#define PEAK_STORE_ERR              0x04
+#define PEAK_STORE_LOC              0x08
+#define PEAK_STORE_CHANNEL_SHIFT    4       // the adapter in the upper half
+
+// Every field lives in its own array so the columns can be scanned without touching the others. Frames
+// are numbered in the order they were appended; the store keeps the numbers from tail up to head and
+// drops the oldest frames once it is full. Rows are counted from the oldest frame kept. The store is not
+// thread-safe, it belongs to the thread that displays it.
+typedef struct {
+    UInt64*  ts;        // ns since 1970
+    UInt32*  canid;
+    UInt8*   flags;     // PEAK_STORE_...
+    UInt8*   dlc;
+    UInt64*  data;      // payload bytes in memory order
+    UInt32*  tag;       // what the protocol decoder knew about the frame when it arrived
+    UInt32   mask;      // capacity - 1
+    UInt64   head;      // number of the next frame
+    UInt64   tail;      // number of the oldest frame kept
+    UInt64   evicted;   // frames dropped to make room
+} PeakFrameStore;
+
+IOReturn PeakFrameStoreCreate(PeakFrameStore* store, UInt32 capacity);
+void PeakFrameStoreDestroy(PeakFrameStore* store);
+size_t PeakFrameStoreMemory(UInt32 capacity);
+
+// tags may be NULL, the frames are tagged 0 then
+void PeakFrameStoreAppend(PeakFrameStore* store, const CanMsg* msgs, const UInt32* tags, UInt32 count);
+void PeakFrameStoreEvict(PeakFrameStore* store, UInt64 count);
+void PeakFrameStoreClear(PeakFrameStore* store);
+
+UInt64 PeakFrameStoreCount(const PeakFrameStore* store);
+UInt32 PeakFrameStoreCapacity(const PeakFrameStore* store);
+IOReturn PeakFrameStoreGet(const PeakFrameStore* store, UInt64 row, CanMsg* msg);
+UInt32 PeakFrameStoreTag(const PeakFrameStore* store, UInt64 row);
+
+// Display strings, formatted on demand for the rows on screen. Returns the length, like snprintf.
+int PeakFrameStoreFormatData(const PeakFrameStore* store, UInt64 row, char* buffer, size_t size);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+    File:           PeakHistogram.c
+
+    Description:    Log-linear latency histograms.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "PeakHistogram.h"
+
+#define SUB_COUNT   (1U << PEAK_HISTOGRAM_SUB_BITS)
+
+#pragma mark - Buckets
+
+static UInt32 BucketOf(UInt64 value)
+{
+    UInt32 exp;
+    
+    if (value < SUB_COUNT)
+        return (UInt32)value;
+    
+    exp = 63 - __builtin_clzll(value);
+    if (exp >= PEAK_HISTOGRAM_MAX_BITS)
+        return PEAK_HISTOGRAM_BUCKETS - 1;
+    
+    // the power of two picks the row, the next SUB_BITS bits below the leading one the column
+    return ((exp - PEAK_HISTOGRAM_SUB_BITS + 1) << PEAK_HISTOGRAM_SUB_BITS) + (UInt32)((value >> (exp - PEAK_HISTOGRAM_SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+static UInt64 HighestOf(UInt32 bucket)
+{
+    UInt32 row = bucket >> PEAK_HISTOGRAM_SUB_BITS, shift;
+    
+    if (row == 0)
+        return bucket;
+    
+    shift = row - 1;
+    return ((UInt64)(SUB_COUNT + (bucket & (SUB_COUNT - 1))) << shift) + (1ULL << shift) - 1;
+}
+
+#pragma mark - Recording
+
+void PeakHistogramReset(PeakHistogram* h)
+{
+    bzero(h, sizeof(PeakHistogram));
+    h->min = ~0ULL;
+}
+
+void PeakHistogramRecord(PeakHistogram* h, UInt64 value)
+{
+    h->counts[BucketOf(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+}
+
+void PeakHistogramAdd(PeakHistogram* dst, const PeakHistogram* src)
+{
+    UInt32 i;
+    
+    for (i = 0; i < PEAK_HISTOGRAM_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+void PeakHistogramSubtract(PeakHistogram* dst, const PeakHistogram* src)
+{
+    UInt32 i, first = PEAK_HISTOGRAM_BUCKETS, last = 0;
+    
+    // src is no earlier copy if dst was reset since, then all of dst is new
+    for (i = 0; i < PEAK_HISTOGRAM_BUCKETS; i++)
+        if (dst->counts[i] < src->counts[i])
+            return;
+    
+    for (i = 0; i < PEAK_HISTOGRAM_BUCKETS; i++)
+    {
+        dst->counts[i] -= src->counts[i];
+        if (dst->counts[i])
+        {
+            if (first == PEAK_HISTOGRAM_BUCKETS)
+                first = i;
+            last = i;
+        }
+    }
+    dst->count -= src->count;
+    dst->sum -= src->sum;
+    
+    // the extremes of the interval are only known to the bucket
+    dst->min = dst->count ? (first ? HighestOf(first - 1) + 1 : 0) : ~0ULL;
+    if (dst->count && dst->max > HighestOf(last))
+        dst->max = HighestOf(last);
+    else if (!dst->count)
+        dst->max = 0;
+}
+
+#pragma mark - Statistics
+
+UInt64 PeakHistogramQuantile(const PeakHistogram* h, double q)
+{
+    UInt64 rank, seen = 0;
+    UInt32 i;
+    
+    if (h->count == 0)
+        return 0;
+    
+    rank = (UInt64)(q * h->count);
+    if (rank >= h->count)
+        rank = h->count - 1;
+    
+    for (i = 0; i < PEAK_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if (seen > rank)
+            return HighestOf(i) < h->max ? HighestOf(i) : h->max;
+    }
+    return h->max;
+}
+
+void PeakHistogramGetStats(const PeakHistogram* h, PeakLatencyStats* stats)
+{
+    bzero(stats, sizeof(PeakLatencyStats));
+    if (h->count == 0)
+        return;
+    
+    stats->count  = h->count;
+    stats->minNs  = h->min;
+    stats->maxNs  = h->max;
+    stats->meanNs = (double)h->sum / h->count;
+    stats->p50Ns  = PeakHistogramQuantile(h, 0.5);
+    stats->p90Ns  = PeakHistogramQuantile(h, 0.9);
+    stats->p99Ns  = PeakHistogramQuantile(h, 0.99);
+    stats->p999Ns = PeakHistogramQuantile(h, 0.999);
+}
+
+#pragma mark - Formatting
+
+typedef struct {
+    char*   buffer;
+    UInt32  size;
+    UInt32  length;         // needed so far, may be more than size
+} Appender;
+
+static void Append(Appender* out, const char* format, ...)
+{
+    va_list args;
+    int n;
+    
+    va_start(args, format);
+    n = vsnprintf(out->length < out->size ? out->buffer + out->length : NULL,
+                  out->length < out->size ? out->size - out->length : 0, format, args);
+    va_end(args);
+    
+    if (n > 0)
+        out->length += n;
+}
+
+static const char* kStageNames[] = { "usb", "decode", "dequeue", "display", "capture" };
+
+static void AppendStage(Appender* out, const char* name, const PeakLatencyStats* l, UInt32 format, int last)
+{
+    if (format == PEAK_STATS_JSON)
+        Append(out, "\"%s\":{\"count\":%llu,\"min\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu,\"mean\":%.0f}%s",
+               name, l->count, l->minNs, l->p50Ns, l->p90Ns, l->p99Ns, l->p999Ns, l->maxNs, l->meanNs, last ? "" : ",");
+    else
+        Append(out, "%-8s %10llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, l->count, l->p50Ns / 1e3, l->p90Ns / 1e3,
+               l->p99Ns / 1e3, l->p999Ns / 1e3, l->maxNs / 1e3, l->meanNs / 1e3);
+}
+
+UInt32 PeakFormatInstrumentation(const PeakInstrumentStats* stats, UInt32 format, char* buffer, UInt32 size)
+{
+    const PeakLatencyStats* stages[] = { &stats->usb, &stats->decode, &stats->dequeue, &stats->display, &stats->capture };
+    double seconds = (stats->untilNs - stats->sinceNs) / 1e9;
+    Appender out = { buffer, size, 0 };
+    UInt32 i;
+    
+    if (size)
+        buffer[0] = 0;
+    
+    if (format == PEAK_STATS_JSON)
+    {
+        Append(&out, "{\"sinceNs\":%llu,\"untilNs\":%llu,\"latencyNs\":{", stats->sinceNs, stats->untilNs);
+        for (i = 0; i < 5; i++)
+            AppendStage(&out, kStageNames[i], stages[i], format, i == 4);
+        Append(&out, "},\"frames\":%llu,\"telegrams\":%llu,\"decodeNs\":%llu,\"ringFill\":%u,\"ringHighWater\":%u,"
+               "\"captureFill\":%u,\"readsInFlight\":%u,\"writesInFlight\":%u,\"channels\":%u,"
+               "\"dropped\":{\"adapter\":%llu,\"filtered\":%llu,\"ring\":%llu,\"capture\":%llu,\"late\":%llu}}",
+               stats->frames, stats->telegrams, stats->decodeNs, stats->ringFill, stats->ringHighWater,
+               stats->captureFill, stats->readsInFlight, stats->writesInFlight, stats->channels,
+               stats->adapterOverruns, stats->filtered, stats->ringDropped, stats->captureDropped, stats->late);
+    }
+    else
+    {
+        Append(&out, "%.1f s, %u channels, %llu frames in %llu telegrams, decode %.1f ms (%.0f ns/frame)\n",
+               seconds, stats->channels, stats->frames, stats->telegrams, stats->decodeNs / 1e6,
+               stats->frames ? (double)stats->decodeNs / stats->frames : 0.0);
+        Append(&out, "stage         count   p50 us    p90 us    p99 us  p99.9 us    max us   mean us\n");
+        for (i = 0; i < 5; i++)
+            AppendStage(&out, kStageNames[i], stages[i], format, i == 4);
+        Append(&out, "ring %u waiting, high water %u, capture %u waiting, %u reads and %u writes in flight\n",
+               stats->ringFill, stats->ringHighWater, stats->captureFill, stats->readsInFlight, stats->writesInFlight);
+        Append(&out, "dropped: adapter %llu, filtered %llu, ring %llu, capture %llu, late %llu\n",
+               stats->adapterOverruns, stats->filtered, stats->ringDropped, stats->captureDropped, stats->late);
+    }
+    
+    return out.length + 1;
+}
@@ -0,0 +1,57 @@
+/*
+    File:           PeakHistogram.h
+
+    Description:    Log-linear latency histograms with a fixed relative precision, in the manner of
+                    HdrHistogram, for the instrumentation of the receive path.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakHistogram_h
+#define PeakLog_PeakHistogram_h
+
+#include "PeakUSB.h"
+
+#define PEAK_HISTOGRAM_SUB_BITS     5       // 32 buckets per power of two, values within 3 %
+#define PEAK_HISTOGRAM_MAX_BITS     40      // up to 2^40 ns, about 18 minutes, larger values are clamped
+#define PEAK_HISTOGRAM_BUCKETS      ((PEAK_HISTOGRAM_MAX_BITS - PEAK_HISTOGRAM_SUB_BITS + 1) << PEAK_HISTOGRAM_SUB_BITS)
+
+// Values below 32 get a bucket each, above that every power of two is split into 32 buckets of equal
+// width. Recording is one bucket increment and no floating point. A histogram has a single writer; others
+// may read it while it is written and see a count or two of difference between the fields.
+typedef struct {
+    UInt64  counts[PEAK_HISTOGRAM_BUCKETS];
+    UInt64  count;
+    UInt64  sum;
+    UInt64  min;
+    UInt64  max;
+} PeakHistogram;
+
+void PeakHistogramReset(PeakHistogram* h);
+void PeakHistogramRecord(PeakHistogram* h, UInt64 value);
+
+// dst += src, and dst -= src for the values recorded since an earlier copy src of dst (dst stays as it
+// is if it was reset after the copy)
+void PeakHistogramAdd(PeakHistogram* dst, const PeakHistogram* src);
+void PeakHistogramSubtract(PeakHistogram* dst, const PeakHistogram* src);
+
+// The highest value equivalent to the one at fraction q (0 .. 1) of the recorded values, 0 if empty.
+UInt64 PeakHistogramQuantile(const PeakHistogram* h, double q);
+// Summary for the public statistics.
+void PeakHistogramGetStats(const PeakHistogram* h, PeakLatencyStats* stats);
+
+#endif
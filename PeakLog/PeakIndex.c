@@ -0,0 +1,668 @@
+/*
+    File:           PeakIndex.c
+
+    Description:    Sidecar index with time and CAN-ID lookups into capture files, built while
+                    recording or afterwards.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "PeakIndex.h"
+
+#pragma mark - Keys
+
+UInt32 PeakIndexKeyFromMsg(const CanMsg* msg)
+{
+    return PEAK_INDEX_KEY(msg->canid.ul, msg->ext);
+}
+
+UInt64 PeakIndexTimeFromMsg(const CanMsg* msg)
+{
+    return msg->ts;
+}
+
+static int CompareKeys(const void* a, const void* b)
+{
+    UInt32 ka = *(const UInt32*)a, kb = *(const UInt32*)b;
+    return (ka > kb) - (ka < kb);
+}
+
+static int CompareIds(const void* a, const void* b)
+{
+    return CompareKeys(&((const PeakIndexId*)a)->key, &((const PeakIndexId*)b)->key);
+}
+
+#pragma mark - Builder
+
+IOReturn PeakIndexBuilderInit(PeakIndexBuilder* builder)
+{
+    bzero(builder, sizeof(PeakIndexBuilder));
+    
+    builder->tableSize = 256;
+    builder->table = calloc(builder->tableSize, sizeof(PeakIndexPosting));
+    if (builder->table == NULL)
+        return kIOReturnNoMemory;
+    
+    return kIOReturnSuccess;
+}
+
+void PeakIndexBuilderFree(PeakIndexBuilder* builder)
+{
+    UInt32 i;
+    
+    if (builder->table)
+    {
+        for (i = 0; i < builder->tableSize; i++)
+            free(builder->table[i].blocks);
+        free(builder->table);
+    }
+    free(builder->blocks);
+    bzero(builder, sizeof(PeakIndexBuilder));
+}
+
+static PeakIndexPosting* Lookup(PeakIndexPosting* table, UInt32 tableSize, UInt32 key)
+{
+    UInt32 slot = (key * 2654435761u) & (tableSize - 1);
+    
+    // a slot is in use once it has seen a frame
+    while (table[slot].frames != 0 && table[slot].key != key)
+        slot = (slot + 1) & (tableSize - 1);
+    
+    return &table[slot];
+}
+
+static int GrowTable(PeakIndexBuilder* builder)
+{
+    UInt32 i, size = builder->tableSize * 2;
+    PeakIndexPosting* table = calloc(size, sizeof(PeakIndexPosting));
+    
+    if (table == NULL)
+        return 0;
+    
+    for (i = 0; i < builder->tableSize; i++)
+    {
+        if (builder->table[i].frames != 0)
+            *Lookup(table, size, builder->table[i].key) = builder->table[i];
+    }
+    
+    free(builder->table);
+    builder->table = table;
+    builder->tableSize = size;
+    return 1;
+}
+
+IOReturn PeakIndexBuilderAdd(PeakIndexBuilder* builder, const PeakCaptureRecord* records, UInt32 count)
+{
+    UInt32 i;
+    
+    for (i = 0; i < count && !builder->failed; i++)
+    {
+        const PeakCaptureRecord* record = &records[i];
+        UInt32 block = (UInt32)(builder->recordCount++ / PEAK_INDEX_BLOCK_RECORDS);
+        UInt32 key = PEAK_INDEX_KEY(record->canid, record->flags & PEAK_CAPTURE_EXT);
+        PeakIndexPosting* posting;
+        
+        if (block == builder->blockCount)
+        {
+            if (builder->blockCount == builder->blockCapacity)
+            {
+                UInt32 capacity = builder->blockCapacity ? builder->blockCapacity * 2 : 1024;
+                PeakIndexBlock* blocks = realloc(builder->blocks, capacity * sizeof(PeakIndexBlock));
+                if (blocks == NULL)
+                {
+                    builder->failed = 1;
+                    break;
+                }
+                builder->blocks = blocks;
+                builder->blockCapacity = capacity;
+            }
+            builder->blocks[block].minTs = record->ts;
+            builder->blockCount++;
+        }
+        
+        if (record->ts < builder->blocks[block].minTs)
+            builder->blocks[block].minTs = record->ts;
+        if (record->ts > builder->maxTs)
+            builder->maxTs = record->ts;
+        builder->blocks[block].maxTs = builder->maxTs;
+        
+        posting = Lookup(builder->table, builder->tableSize, key);
+        if (posting->frames == 0)
+        {
+            // keep the table at most half full
+            if (2 * (builder->idCount + 1) > builder->tableSize)
+            {
+                if (!GrowTable(builder))
+                {
+                    builder->failed = 1;
+                    break;
+                }
+                posting = Lookup(builder->table, builder->tableSize, key);
+            }
+            posting->key = key;
+            builder->idCount++;
+        }
+        
+        if (posting->count == 0 || posting->lastBlock != block)
+        {
+            if (posting->count == posting->capacity)
+            {
+                UInt32 capacity = posting->capacity ? posting->capacity * 2 : 16;
+                UInt32* blocks = realloc(posting->blocks, capacity * sizeof(UInt32));
+                if (blocks == NULL)
+                {
+                    builder->failed = 1;
+                    break;
+                }
+                posting->blocks = blocks;
+                posting->capacity = capacity;
+            }
+            posting->blocks[posting->count++] = block;
+            posting->lastBlock = block;
+        }
+        posting->frames++;
+    }
+    
+    return builder->failed ? kIOReturnNoMemory : kIOReturnSuccess;
+}
+
+// Lays out the index file in one malloc'ed buffer.
+static IOReturn Serialize(PeakIndexBuilder* builder, void** buffer, size_t* size)
+{
+    PeakIndexHeader* header;
+    PeakIndexId* ids;
+    UInt32* postings;
+    UInt64 postingCount = 0;
+    UInt32 i, n = 0;
+    
+    if (builder->failed)
+        return kIOReturnNoMemory;
+    
+    for (i = 0; i < builder->tableSize; i++)
+        postingCount += builder->table[i].count;
+    
+    *size = sizeof(PeakIndexHeader) + builder->blockCount * sizeof(PeakIndexBlock) +
+            builder->idCount * sizeof(PeakIndexId) + postingCount * sizeof(UInt32);
+    *buffer = calloc(1, *size);
+    if (*buffer == NULL)
+        return kIOReturnNoMemory;
+    
+    header = *buffer;
+    header->magic        = PEAK_INDEX_MAGIC;
+    header->version      = PEAK_INDEX_VERSION;
+    header->headerSize   = sizeof(PeakIndexHeader);
+    header->blockRecords = PEAK_INDEX_BLOCK_RECORDS;
+    header->blockCount   = builder->blockCount;
+    header->idCount      = builder->idCount;
+    header->recordCount  = builder->recordCount;
+    header->postingCount = postingCount;
+    
+    memcpy(header + 1, builder->blocks, builder->blockCount * sizeof(PeakIndexBlock));
+    ids = (PeakIndexId*)((UInt8*)(header + 1) + builder->blockCount * sizeof(PeakIndexBlock));
+    postings = (UInt32*)(ids + builder->idCount);
+    
+    for (i = 0; i < builder->tableSize; i++)
+    {
+        if (builder->table[i].frames != 0)
+        {
+            ids[n].key    = builder->table[i].key;
+            ids[n].count  = builder->table[i].count;
+            ids[n].frames = builder->table[i].frames;
+            n++;
+        }
+    }
+    qsort(ids, n, sizeof(PeakIndexId), CompareIds);
+    
+    postingCount = 0;
+    for (i = 0; i < n; i++)
+    {
+        PeakIndexPosting* posting = Lookup(builder->table, builder->tableSize, ids[i].key);
+        ids[i].first = postingCount;
+        memcpy(&postings[postingCount], posting->blocks, posting->count * sizeof(UInt32));
+        postingCount += posting->count;
+    }
+    
+    return kIOReturnSuccess;
+}
+
+static IOReturn WriteFile(const char* path, const void* buffer, size_t size)
+{
+    const UInt8* ptr = buffer;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    
+    if (fd < 0)
+        return kIOReturnNotOpen;
+    
+    while (size > 0)
+    {
+        ssize_t n = write(fd, ptr, size);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            unlink(path);
+            return kIOReturnIOError;
+        }
+        ptr += n;
+        size -= n;
+    }
+    
+    return close(fd) == 0 ? kIOReturnSuccess : kIOReturnIOError;
+}
+
+static char* IndexPath(const char* capturePath)
+{
+    char* path = malloc(strlen(capturePath) + sizeof(PEAK_INDEX_SUFFIX));
+    
+    if (path)
+    {
+        strcpy(path, capturePath);
+        strcat(path, PEAK_INDEX_SUFFIX);
+    }
+    return path;
+}
+
+IOReturn PeakIndexBuilderWrite(PeakIndexBuilder* builder, const char* capturePath)
+{
+    char* path = IndexPath(capturePath);
+    void* buffer;
+    size_t size;
+    IOReturn kr;
+    
+    if (path == NULL)
+        return kIOReturnNoMemory;
+    
+    kr = Serialize(builder, &buffer, &size);
+    if (kr == kIOReturnSuccess)
+    {
+        kr = WriteFile(path, buffer, size);
+        free(buffer);
+    }
+    
+    if (kr != kIOReturnSuccess)
+        fprintf(stderr, "Unable to write index %s (%08x)\n", path, kr);
+    
+    free(path);
+    return kr;
+}
+
+#pragma mark - Reader
+
+const PeakCaptureRecord* PeakIndexRecord(const PeakIndexReader* reader, UInt64 recordNo)
+{
+    return (const PeakCaptureRecord*)(reader->capture + reader->headerSize + recordNo * reader->recordSize);
+}
+
+static IOReturn MapCapture(PeakIndexReader* reader, const char* capturePath)
+{
+    struct stat st;
+    IOReturn kr;
+    int fd = open(capturePath, O_RDONLY);
+    
+    if (fd < 0)
+        return kIOReturnNotOpen;
+    
+    kr = PeakCaptureReadHeader(fd, &reader->header);
+    if (kr == kIOReturnSuccess && fstat(fd, &st) != 0)
+        kr = kIOReturnIOError;
+    
+    if (kr == kIOReturnSuccess)
+    {
+        reader->captureSize = st.st_size;
+        reader->headerSize = reader->header.headerSize;
+        reader->recordSize = reader->header.recordSize;
+        reader->recordCount = (reader->captureSize - reader->headerSize) / reader->recordSize;
+        
+        reader->capture = mmap(NULL, reader->captureSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (reader->capture == MAP_FAILED)
+        {
+            reader->capture = NULL;
+            kr = kIOReturnNoMemory;
+        }
+    }
+    
+    close(fd); // the mapping stays valid
+    return kr;
+}
+
+static int CheckIndex(const PeakIndexReader* reader, const PeakIndexHeader* header, size_t size)
+{
+    if (size < sizeof(PeakIndexHeader) || header->magic != PEAK_INDEX_MAGIC || header->version != PEAK_INDEX_VERSION)
+        return 0;
+    
+    if (header->headerSize != sizeof(PeakIndexHeader) || header->blockRecords != PEAK_INDEX_BLOCK_RECORDS)
+        return 0;
+    
+    if (size != sizeof(PeakIndexHeader) + header->blockCount * sizeof(PeakIndexBlock) +
+                header->idCount * sizeof(PeakIndexId) + header->postingCount * sizeof(UInt32))
+        return 0;
+    
+    // written before the capture grew, e.g. after a crash
+    return header->recordCount == reader->recordCount;
+}
+
+static IOReturn MapIndex(PeakIndexReader* reader, const char* path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    
+    if (fd < 0)
+        return kIOReturnNotOpen;
+    
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(PeakIndexHeader))
+    {
+        close(fd);
+        return kIOReturnIOError;
+    }
+    
+    reader->index = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    
+    if (reader->index == MAP_FAILED)
+    {
+        reader->index = NULL;
+        return kIOReturnNoMemory;
+    }
+    reader->indexSize = st.st_size;
+    reader->indexMapped = 1;
+    
+    if (!CheckIndex(reader, reader->index, reader->indexSize))
+    {
+        munmap(reader->index, reader->indexSize);
+        reader->index = NULL;
+        reader->indexMapped = 0;
+        return kIOReturnUnsupported;
+    }
+    
+    return kIOReturnSuccess;
+}
+
+static IOReturn BuildIndex(PeakIndexReader* reader, const char* path)
+{
+    PeakCaptureRecord chunk[PEAK_INDEX_BLOCK_RECORDS];
+    PeakIndexBuilder builder;
+    UInt64 n, i;
+    IOReturn kr;
+    
+    kr = PeakIndexBuilderInit(&builder);
+    
+    for (n = 0; n < reader->recordCount && kr == kIOReturnSuccess; n += PEAK_INDEX_BLOCK_RECORDS)
+    {
+        UInt32 count = reader->recordCount - n < PEAK_INDEX_BLOCK_RECORDS ? (UInt32)(reader->recordCount - n) : PEAK_INDEX_BLOCK_RECORDS;
+        
+        if (reader->recordSize == sizeof(PeakCaptureRecord))
+        {
+            kr = PeakIndexBuilderAdd(&builder, PeakIndexRecord(reader, n), count);
+        }
+        else
+        {
+            // records of later versions carry more than we know about
+            for (i = 0; i < count; i++)
+                memcpy(&chunk[i], PeakIndexRecord(reader, n + i), sizeof(PeakCaptureRecord));
+            kr = PeakIndexBuilderAdd(&builder, chunk, count);
+        }
+    }
+    
+    if (kr == kIOReturnSuccess)
+        kr = Serialize(&builder, &reader->index, &reader->indexSize);
+    
+    // saving is only a shortcut for the next time, a read-only directory is fine
+    if (kr == kIOReturnSuccess && WriteFile(path, reader->index, reader->indexSize) != kIOReturnSuccess)
+        fprintf(stderr, "Unable to save index %s\n", path);
+    
+    PeakIndexBuilderFree(&builder);
+    return kr;
+}
+
+IOReturn PeakIndexOpen(PeakIndexReader* reader, const char* capturePath)
+{
+    char* path;
+    IOReturn kr;
+    
+    bzero(reader, sizeof(PeakIndexReader));
+    
+    kr = MapCapture(reader, capturePath);
+    if (kr != kIOReturnSuccess)
+        return kr;
+    
+    path = IndexPath(capturePath);
+    if (path == NULL)
+    {
+        PeakIndexClose(reader);
+        return kIOReturnNoMemory;
+    }
+    
+    if (MapIndex(reader, path) != kIOReturnSuccess)
+        kr = BuildIndex(reader, path);
+    free(path);
+    
+    if (kr != kIOReturnSuccess)
+    {
+        PeakIndexClose(reader);
+        return kr;
+    }
+    
+    reader->indexHeader = reader->index;
+    reader->blocks = (const PeakIndexBlock*)(reader->indexHeader + 1);
+    reader->ids = (const PeakIndexId*)(reader->blocks + reader->indexHeader->blockCount);
+    reader->postings = (const UInt32*)(reader->ids + reader->indexHeader->idCount);
+    return kIOReturnSuccess;
+}
+
+void PeakIndexClose(PeakIndexReader* reader)
+{
+    if (reader->capture)
+        munmap((void*)reader->capture, reader->captureSize);
+    
+    if (reader->indexMapped)
+        munmap(reader->index, reader->indexSize);
+    else
+        free(reader->index);
+    
+    bzero(reader, sizeof(PeakIndexReader));
+}
+
+IOReturn PeakIndexRebuild(const char* capturePath)
+{
+    PeakIndexReader reader;
+    char* path = IndexPath(capturePath);
+    IOReturn kr;
+    
+    if (path == NULL)
+        return kIOReturnNoMemory;
+    
+    unlink(path);
+    free(path);
+    
+    kr = PeakIndexOpen(&reader, capturePath);
+    if (kr == kIOReturnSuccess)
+        PeakIndexClose(&reader);
+    
+    return kr;
+}
+
+#pragma mark - Queries
+
+UInt64 PeakIndexSeekTime(const PeakIndexReader* reader, UInt64 ns)
+{
+    UInt32 lo = 0, hi = reader->indexHeader->blockCount;
+    UInt64 first, last;
+    
+    // first block reaching ns, the running maximum never decreases
+    while (lo < hi)
+    {
+        UInt32 mid = lo + (hi - lo) / 2;
+        if (reader->blocks[mid].maxTs < ns)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    
+    if (lo == reader->indexHeader->blockCount)
+        return reader->recordCount;
+    
+    first = (UInt64)lo * PEAK_INDEX_BLOCK_RECORDS;
+    last = first + PEAK_INDEX_BLOCK_RECORDS;
+    if (last > reader->recordCount)
+        last = reader->recordCount;
+    
+    while (first < last)
+    {
+        UInt64 mid = first + (last - first) / 2;
+        if (PeakIndexRecord(reader, mid)->ts < ns)
+            first = mid + 1;
+        else
+            last = mid;
+    }
+    
+    return first;
+}
+
+static const PeakIndexId* FindId(const PeakIndexReader* reader, UInt32 key)
+{
+    return bsearch(&key, reader->ids, reader->indexHeader->idCount, sizeof(PeakIndexId), CompareKeys);
+}
+
+// Visits the records of one block from start on. Returns 1 once the query is done.
+static int ScanBlock(const PeakIndexReader* reader, UInt64 start, UInt64 toNs, const UInt32* keys, UInt32 keyCount,
+                     PeakIndexVisitFunc visit, void* refCon, UInt64* visited)
+{
+    UInt64 end = (start / PEAK_INDEX_BLOCK_RECORDS + 1) * PEAK_INDEX_BLOCK_RECORDS;
+    UInt64 n;
+    
+    if (end > reader->recordCount)
+        end = reader->recordCount;
+    
+    for (n = start; n < end; n++)
+    {
+        const PeakCaptureRecord* record = PeakIndexRecord(reader, n);
+        
+        if (record->ts > toNs)
+            return 1;
+        
+        if (keyCount)
+        {
+            UInt32 key = PEAK_INDEX_KEY(record->canid, record->flags & PEAK_CAPTURE_EXT);
+            if (bsearch(&key, keys, keyCount, sizeof(UInt32), CompareKeys) == NULL)
+                continue;
+        }
+        
+        (*visited)++;
+        if (visit && visit(refCon, record, n))
+            return 1;
+    }
+    
+    return 0;
+}
+
+UInt64 PeakIndexQuery(const PeakIndexReader* reader, UInt64 fromNs, UInt64 toNs, const UInt32* keys, UInt32 keyCount,
+                      PeakIndexVisitFunc visit, void* refCon)
+{
+    UInt64 start = PeakIndexSeekTime(reader, fromNs);
+    UInt32 firstBlock = (UInt32)(start / PEAK_INDEX_BLOCK_RECORDS);
+    UInt64 visited = 0;
+    UInt32 *sorted, *cursor, *remaining;
+    const UInt32** lists;
+    UInt32 i, lastBlock = 0, haveLast = 0;
+    
+    if (start >= reader->recordCount || fromNs > toNs)
+        return 0;
+    
+    if (keyCount == 0)
+    {
+        // every block from the start on
+        for (; start < reader->recordCount; start = (start / PEAK_INDEX_BLOCK_RECORDS + 1) * PEAK_INDEX_BLOCK_RECORDS)
+        {
+            if (ScanBlock(reader, start, toNs, NULL, 0, visit, refCon, &visited))
+                break;
+        }
+        return visited;
+    }
+    
+    sorted = malloc(keyCount * sizeof(UInt32) * 3);
+    lists = malloc(keyCount * sizeof(UInt32*));
+    if (sorted == NULL || lists == NULL)
+    {
+        free(sorted);
+        free(lists);
+        return 0;
+    }
+    cursor = sorted + keyCount;
+    remaining = cursor + keyCount;
+    
+    memcpy(sorted, keys, keyCount * sizeof(UInt32));
+    qsort(sorted, keyCount, sizeof(UInt32), CompareKeys);
+    
+    // position each posting list on the first block of the time range
+    for (i = 0; i < keyCount; i++)
+    {
+        const PeakIndexId* id = FindId(reader, sorted[i]);
+        UInt32 lo = 0, hi = id ? id->count : 0;
+        
+        lists[i] = id ? &reader->postings[id->first] : NULL;
+        while (lo < hi)
+        {
+            UInt32 mid = lo + (hi - lo) / 2;
+            if (lists[i][mid] < firstBlock)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        cursor[i] = lo;
+        remaining[i] = id ? id->count : 0;
+    }
+    
+    // merge the lists, each block is scanned once for all keys
+    for (;;)
+    {
+        UInt32 block = 0, found = 0;
+        
+        for (i = 0; i < keyCount; i++)
+        {
+            while (cursor[i] < remaining[i] && haveLast && lists[i][cursor[i]] <= lastBlock)
+                cursor[i]++;
+            if (cursor[i] < remaining[i] && (!found || lists[i][cursor[i]] < block))
+            {
+                block = lists[i][cursor[i]];
+                found = 1;
+            }
+        }
+        if (!found)
+            break;
+        
+        lastBlock = block;
+        haveLast = 1;
+        
+        if (ScanBlock(reader, block == firstBlock ? start : (UInt64)block * PEAK_INDEX_BLOCK_RECORDS, toNs,
+                      sorted, keyCount, visit, refCon, &visited))
+            break;
+    }
+    
+    free(sorted);
+    free(lists);
+    return visited;
+}
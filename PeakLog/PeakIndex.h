@@ -0,0 +1,140 @@
+/*
+    File:           PeakIndex.h
+
+    Description:    Sidecar index with time and CAN-ID lookups into capture files, built while
+                    recording or afterwards.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakIndex_h
+#define PeakLog_PeakIndex_h
+
+#include "PeakUSB.h"
+#include "PeakCapture.h"
+
+// The index of "capture.peakcap" lives next to it in "capture.peakcap.idx". The records are grouped in
+// blocks of PEAK_INDEX_BLOCK_RECORDS; for every block the index keeps its time span and for every
+// identifier the sorted list of blocks it occurs in.
+//
+//  PeakIndexHeader
+//  PeakIndexBlock  blocks[blockCount]
+//  PeakIndexId     ids[idCount]            sorted by key
+//  UInt32          postings[postingCount]  block numbers, ids[i].count entries from ids[i].first
+#define PEAK_INDEX_MAGIC            0x58494b50  // "PKIX" on disk
+#define PEAK_INDEX_VERSION          1
+#define PEAK_INDEX_BLOCK_RECORDS    1024
+#define PEAK_INDEX_SUFFIX           ".idx"
+
+// identifiers are looked up with the ext flag in the top bit, 0x123 and the 29 bit 0x123 are different
+#define PEAK_INDEX_KEY(canid, ext)  (((canid) & 0x1fffffff) | ((ext) ? 0x80000000 : 0))
+
+typedef struct {
+    UInt32  magic;
+    UInt16  version;
+    UInt16  headerSize;
+    UInt32  blockRecords;
+    UInt32  blockCount;
+    UInt32  idCount;
+    UInt32  reserved0;
+    UInt64  recordCount;    // records covered, the index is stale if the capture has more
+    UInt64  postingCount;
+    UInt8   reserved[24];
+} __attribute__ ((packed)) PeakIndexHeader;
+
+typedef struct {
+    UInt64  minTs;          // smallest timestamp in the block
+    UInt64  maxTs;          // largest timestamp up to the end of the block, never decreases
+} __attribute__ ((packed)) PeakIndexBlock;
+
+typedef struct {
+    UInt32  key;            // PEAK_INDEX_KEY
+    UInt32  count;          // blocks
+    UInt64  first;          // offset into the postings
+    UInt64  frames;         // records with this key
+} __attribute__ ((packed)) PeakIndexId;
+
+typedef struct {
+    UInt32  key;
+    UInt32  lastBlock;
+    UInt32  count;
+    UInt32  capacity;
+    UInt32* blocks;
+    UInt64  frames;
+} PeakIndexPosting;
+
+// Collects the index while the records are written, or when a capture is scanned afterwards.
+typedef struct PeakIndexBuilder {
+    UInt64              recordCount;
+    PeakIndexBlock*     blocks;
+    UInt32              blockCount;
+    UInt32              blockCapacity;
+    PeakIndexPosting*   table;          // open addressing on the key
+    UInt32              tableSize;      // power of two
+    UInt32              idCount;
+    UInt64              maxTs;
+    int                 failed;         // out of memory, the index is not written
+} PeakIndexBuilder;
+
+// mmap'ed capture and its index
+typedef struct {
+    const UInt8*            capture;
+    size_t                  captureSize;
+    UInt32                  headerSize;
+    UInt32                  recordSize;
+    UInt64                  recordCount;
+    PeakCaptureHeader       header;
+    void*                   index;
+    size_t                  indexSize;
+    int                     indexMapped;    // index is mmap'ed rather than built in memory
+    const PeakIndexHeader*  indexHeader;
+    const PeakIndexBlock*   blocks;
+    const PeakIndexId*      ids;
+    const UInt32*           postings;
+} PeakIndexReader;
+
+// Called for every record that matches a query, a non-zero return stops the query.
+typedef int (*PeakIndexVisitFunc)(void* refCon, const PeakCaptureRecord* record, UInt64 recordNo);
+
+IOReturn PeakIndexBuilderInit(PeakIndexBuilder* builder);
+IOReturn PeakIndexBuilderAdd(PeakIndexBuilder* builder, const PeakCaptureRecord* records, UInt32 count);
+IOReturn PeakIndexBuilderWrite(PeakIndexBuilder* builder, const char* path);
+void PeakIndexBuilderFree(PeakIndexBuilder* builder);
+
+// Rebuilds the index of a capture offline.
+IOReturn PeakIndexRebuild(const char* capturePath);
+
+// Maps the capture and its index, a missing or stale index is rebuilt (and saved if possible).
+IOReturn PeakIndexOpen(PeakIndexReader* reader, const char* capturePath);
+void PeakIndexClose(PeakIndexReader* reader);
+
+const PeakCaptureRecord* PeakIndexRecord(const PeakIndexReader* reader, UInt64 recordNo);
+
+// First record with a timestamp at or after ns, recordCount if there is none. Assumes the timestamps of
+// the capture do not go backwards, as for frames from a single adapter.
+UInt64 PeakIndexSeekTime(const PeakIndexReader* reader, UInt64 ns);
+
+// Visits the records in [fromNs, toNs] in file order, restricted to the keys unless keyCount is 0.
+// Returns the number of records visited.
+UInt64 PeakIndexQuery(const PeakIndexReader* reader, UInt64 fromNs, UInt64 toNs, const UInt32* keys, UInt32 keyCount,
+                      PeakIndexVisitFunc visit, void* refCon);
+
+// the same from the fields of a CanMsg
+UInt32 PeakIndexKeyFromMsg(const CanMsg* msg);
+UInt64 PeakIndexTimeFromMsg(const CanMsg* msg);
+
+#endif
@@ -0,0 +1,321 @@
+/*
+    File:           PeakLive.c
+
+    Description:    Shared-memory ring through which the decoder of an adapter publishes its live
+                    frames to any number of reader processes.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "PeakLive.h"
+
+#define PEAK_LIVE_POLL_NS           1000000ULL  // sleep between looks where there is no futex
+
+#pragma mark - Futex
+
+static void FutexWait(UInt32* word, UInt32 value, UInt64 timeoutNs)
+{
+#ifdef __linux__
+    struct timespec timeout = { (time_t)(timeoutNs / 1000000000ULL), (long)(timeoutNs % 1000000000ULL) };
+    
+    // the word is shared between processes, so no FUTEX_PRIVATE_FLAG; EINTR and EAGAIN are fine
+    syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+#else
+    struct timespec nap = { 0, (long)(timeoutNs < PEAK_LIVE_POLL_NS ? timeoutNs : PEAK_LIVE_POLL_NS) };
+    
+    if (__atomic_load_n(word, __ATOMIC_ACQUIRE) == value)
+        nanosleep(&nap, NULL);
+#endif
+}
+
+static void FutexWake(UInt32* word)
+{
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAKE, 0x7fffffff, NULL, NULL, 0);
+#else
+    (void)word;
+#endif
+}
+
+// readers build with this file alone, so no PeakMonotonicNs
+static UInt64 Now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (UInt64)now.tv_sec * 1000000000ULL + (UInt64)now.tv_nsec;
+}
+
+static size_t PageRound(size_t size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (size + page - 1) & ~(page - 1);
+}
+
+#pragma mark - Producer
+
+IOReturn PeakLiveCreate(PeakLive* live, const char* name, UInt32 channel, UInt32 capacity)
+{
+    size_t controlSize = PageRound(sizeof(PeakLiveControl));
+    PeakLiveControl* control;
+    void* base;
+    int fd;
+    
+    bzero(live, sizeof(PeakLive));
+    
+    if (capacity < 2 || (capacity & (capacity - 1)) || strlen(name) >= PEAK_LIVE_NAME_MAX)
+        return kIOReturnBadArgument;
+    
+    // a segment left behind by a producer that crashed is replaced, its readers keep the old one
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Unable to create shared memory %s (%s)\n", name, strerror(errno));
+        return kIOReturnNoResources;
+    }
+    
+    live->size = controlSize + (size_t)capacity * sizeof(CanMsg);
+    if (ftruncate(fd, (off_t)live->size) != 0)
+    {
+        fprintf(stderr, "Unable to size shared memory %s (%s)\n", name, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return kIOReturnNoSpace;
+    }
+    
+    base = mmap(NULL, live->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping stays valid
+    if (base == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return kIOReturnNoMemory;
+    }
+    
+    // the pages come zeroed, the magic goes in last so a reader never sees half a header
+    control = base;
+    control->version = PEAK_LIVE_VERSION;
+    control->headerSize = sizeof(PeakLiveControl);
+    control->capacity = capacity;
+    control->slotSize = sizeof(CanMsg);
+    control->slotsOffset = (UInt32)controlSize;
+    control->channel = channel;
+    __atomic_store_n(&control->magic, PEAK_LIVE_MAGIC, __ATOMIC_RELEASE);
+    
+    live->control = control;
+    live->slots = (CanMsg*)((UInt8*)base + controlSize);
+    live->mask = capacity - 1;
+    strcpy(live->name, name);
+    return kIOReturnSuccess;
+}
+
+void PeakLivePublish(PeakLive* live, const CanMsg* msg)
+{
+    UInt64 head = live->head;
+    
+    // readers check the head after reading a slot: the previous head must be out before the slot changes
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    live->slots[head & live->mask] = *msg;
+    
+    live->head = head + 1;
+    __atomic_store_n(&live->control->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void PeakLiveWake(PeakLive* live)
+{
+    PeakLiveControl* control = live->control;
+    
+    // a reader counts itself in before it looks at the word, so either it sees the bump or we see it
+    __atomic_add_fetch(&control->wake, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&control->waiters, __ATOMIC_SEQ_CST))
+        FutexWake(&control->wake);
+}
+
+void PeakLiveDestroy(PeakLive* live)
+{
+    if (live->control == NULL)
+        return;
+    
+    __atomic_store_n(&live->control->closed, 1, __ATOMIC_RELEASE);
+    PeakLiveWake(live);
+    shm_unlink(live->name);
+    munmap(live->control, live->size);
+    bzero(live, sizeof(PeakLive));
+}
+
+#pragma mark - Reader
+
+IOReturn PeakLiveOpen(PeakLiveReader* reader, const char* name)
+{
+    PeakLiveControl* control;
+    struct stat st;
+    void* slots;
+    IOReturn kr = kIOReturnSuccess;
+    int fd;
+    
+    bzero(reader, sizeof(PeakLiveReader));
+    
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return kIOReturnNoDevice; // nobody publishes under this name
+    
+    reader->controlSize = PageRound(sizeof(PeakLiveControl));
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < reader->controlSize)
+    {
+        close(fd);
+        return kIOReturnNoDevice; // still being created
+    }
+    
+    control = mmap(NULL, reader->controlSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (control == MAP_FAILED)
+    {
+        close(fd);
+        return kIOReturnNoMemory;
+    }
+    
+    if (__atomic_load_n(&control->magic, __ATOMIC_ACQUIRE) != PEAK_LIVE_MAGIC)
+        kr = kIOReturnNoDevice;
+    else if (control->version != PEAK_LIVE_VERSION || control->headerSize != sizeof(PeakLiveControl) || control->slotSize != sizeof(CanMsg))
+        kr = kIOReturnUnsupported;
+    else if (control->capacity < 2 || (control->capacity & (control->capacity - 1)) || control->slotsOffset < sizeof(PeakLiveControl) ||
+             (size_t)st.st_size < (size_t)control->slotsOffset + (size_t)control->capacity * sizeof(CanMsg))
+        kr = kIOReturnBadArgument;
+    
+    if (kr == kIOReturnSuccess)
+    {
+        // the slots are never written from here
+        reader->slotsSize = (size_t)control->capacity * sizeof(CanMsg);
+        slots = mmap(NULL, reader->slotsSize, PROT_READ, MAP_SHARED, fd, control->slotsOffset);
+        if (slots == MAP_FAILED)
+            kr = kIOReturnNoMemory;
+        else
+            reader->slots = slots;
+    }
+    close(fd);
+    
+    if (kr != kIOReturnSuccess)
+    {
+        munmap(control, reader->controlSize);
+        bzero(reader, sizeof(PeakLiveReader));
+        return kr;
+    }
+    
+    reader->control = control;
+    reader->mask = control->capacity - 1;
+    reader->cursor = __atomic_load_n(&control->head, __ATOMIC_ACQUIRE);
+    return kIOReturnSuccess;
+}
+
+void PeakLiveClose(PeakLiveReader* reader)
+{
+    if (reader->control == NULL)
+        return;
+    
+    munmap((void*)reader->slots, reader->slotsSize);
+    munmap(reader->control, reader->controlSize);
+    bzero(reader, sizeof(PeakLiveReader));
+}
+
+// the slot of frame head may be half way to it, so the frames before are capacity - 1 at most
+static UInt64 Oldest(const PeakLiveReader* reader, UInt64 head)
+{
+    return head > reader->mask ? head - reader->mask : 0;
+}
+
+UInt32 PeakLiveRead(PeakLiveReader* reader, const CanMsg** msgs, UInt32 max)
+{
+    UInt64 head = __atomic_load_n(&reader->control->head, __ATOMIC_ACQUIRE);
+    UInt64 oldest = Oldest(reader, head);
+    UInt64 count;
+    UInt32 slot;
+    
+    if (reader->cursor < oldest)
+    {
+        reader->missed += oldest - reader->cursor;
+        reader->cursor = oldest;
+    }
+    
+    // in place means no wrapping, the rest comes with the next read
+    slot = (UInt32)(reader->cursor & reader->mask);
+    count = head - reader->cursor;
+    if (count > reader->mask + 1 - slot)
+        count = reader->mask + 1 - slot;
+    if (count > max)
+        count = max;
+    
+    *msgs = &reader->slots[slot];
+    reader->span = (UInt32)count;
+    return (UInt32)count;
+}
+
+UInt32 PeakLiveRelease(PeakLiveReader* reader)
+{
+    UInt64 head, oldest;
+    UInt32 torn = 0;
+    
+    // the frames were read before this head, anything the producer has overwritten since shows in it
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&reader->control->head, __ATOMIC_RELAXED);
+    oldest = Oldest(reader, head);
+    
+    if (oldest > reader->cursor)
+        torn = oldest - reader->cursor < reader->span ? (UInt32)(oldest - reader->cursor) : reader->span;
+    
+    reader->missed += torn;
+    reader->frames += reader->span - torn;
+    reader->cursor += reader->span;
+    reader->span = 0;
+    return torn;
+}
+
+IOReturn PeakLiveWait(PeakLiveReader* reader, UInt64 timeoutNs)
+{
+    PeakLiveControl* control = reader->control;
+    UInt64 now = Now(), deadline = timeoutNs < ~0ULL - now ? now + timeoutNs : ~0ULL;
+    UInt32 wake;
+    
+    __atomic_add_fetch(&control->waiters, 1, __ATOMIC_SEQ_CST);
+    
+    while (now < deadline)
+    {
+        wake = __atomic_load_n(&control->wake, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&control->head, __ATOMIC_ACQUIRE) != reader->cursor || __atomic_load_n(&control->closed, __ATOMIC_ACQUIRE))
+            break;
+        
+        FutexWait(&control->wake, wake, deadline - now);
+        now = Now();
+    }
+    
+    __atomic_sub_fetch(&control->waiters, 1, __ATOMIC_SEQ_CST);
+    
+    if (__atomic_load_n(&control->head, __ATOMIC_ACQUIRE) != reader->cursor)
+        return kIOReturnSuccess;
+    
+    return __atomic_load_n(&control->closed, __ATOMIC_ACQUIRE) ? kIOReturnNotOpen : kIOReturnTimeout;
+}
@@ -0,0 +1,99 @@
+/*
+    File:           PeakLive.h
+
+    Description:    Shared-memory ring through which the decoder of an adapter publishes its live
+                    frames to any number of reader processes.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakLive_h
+#define PeakLog_PeakLive_h
+
+#include "PeakUSB.h"
+
+#define PEAK_LIVE_MAGIC             0x564c4b50  // "PKLV" in the control page
+#define PEAK_LIVE_VERSION           1
+#define PEAK_LIVE_PREFIX            "/PeakLog"  // the segment of channel n is PEAK_LIVE_PREFIX ".n"
+#define PEAK_LIVE_NAME_MAX          32
+#define PEAK_LIVE_DEFAULT_CAPACITY  65536       // frames, must be a power of two
+
+// The segment starts with this control page, the CanMsg slots follow at slotsOffset, which is a page
+// boundary so readers can map the slots read-only. Frame n lives in slot n & (capacity - 1) until frame
+// n + capacity replaces it; head counts the frames published so far. The producer never waits for
+// readers, a reader that falls behind by more than capacity - 1 frames loses the oldest ones.
+typedef struct {
+    UInt32  magic;
+    UInt16  version;
+    UInt16  headerSize;     // sizeof(PeakLiveControl)
+    UInt32  capacity;
+    UInt32  slotSize;       // sizeof(CanMsg)
+    UInt32  slotsOffset;
+    UInt32  channel;
+    UInt32  closed;         // set by the producer when it is done, the segment is already unlinked
+    UInt8   pad0[64 - 7 * sizeof(UInt32)];
+    UInt64  head;           // written by the producer only
+    UInt8   pad1[64 - sizeof(UInt64)];
+    UInt32  wake;           // futex word, bumped after each published buffer
+    UInt32  waiters;        // readers in PeakLiveWait
+    UInt8   pad2[64 - 2 * sizeof(UInt32)];
+} PeakLiveControl;
+
+// the producer's side, owned by the driver
+typedef struct {
+    PeakLiveControl*    control;
+    CanMsg*             slots;
+    UInt32              mask;
+    UInt64              head;           // own copy of control->head
+    size_t              size;           // of the mapping
+    char                name[PEAK_LIVE_NAME_MAX];
+} PeakLive;
+
+// One reader, each with its own cursor. PeakLiveRead hands out the frames in place; they may be
+// overwritten while the reader looks at them, PeakLiveRelease tells afterwards how many of them were.
+typedef struct {
+    PeakLiveControl*    control;        // mapped read/write for the wait counters
+    const CanMsg*       slots;          // mapped read-only
+    UInt32              mask;
+    UInt64              cursor;         // next frame to read
+    UInt32              span;           // frames handed out by the last PeakLiveRead
+    UInt64              frames;         // read and released intact
+    UInt64              missed;         // overwritten before or while they were read
+    size_t              controlSize;
+    size_t              slotsSize;
+} PeakLiveReader;
+
+// producer
+IOReturn PeakLiveCreate(PeakLive* live, const char* name, UInt32 channel, UInt32 capacity);
+void PeakLivePublish(PeakLive* live, const CanMsg* msg);
+// wakes the waiting readers, once after the frames of a buffer
+void PeakLiveWake(PeakLive* live);
+// marks the segment closed, wakes the readers and unlinks it; readers keep their mapping
+void PeakLiveDestroy(PeakLive* live);
+
+// reader, starting with the frames published after the open
+IOReturn PeakLiveOpen(PeakLiveReader* reader, const char* name);
+void PeakLiveClose(PeakLiveReader* reader);
+// up to max frames in place, 0 if there are no new ones; frames lapped before the read count as missed
+UInt32 PeakLiveRead(PeakLiveReader* reader, const CanMsg** msgs, UInt32 max);
+// done with the frames of the last read, returns how many of its first ones were overwritten meanwhile
+UInt32 PeakLiveRelease(PeakLiveReader* reader);
+// blocks until there are new frames (kIOReturnSuccess), timeoutNs passed (kIOReturnTimeout) or the
+// producer closed the segment (kIOReturnNotOpen); futex based on Linux, polling elsewhere
+IOReturn PeakLiveWait(PeakLiveReader* reader, UInt64 timeoutNs);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+    File:           PeakMerge.c
+
+    Description:    Merges the receive rings of several adapters into one stream ordered by time, with a
+                    bounded reorder window.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "PeakMerge.h"
+
+#pragma mark - Setup
+
+void PeakMergeInit(PeakMerge* merge, UInt64 windowNs)
+{
+    bzero(merge, sizeof(PeakMerge));
+    merge->windowNs = windowNs;
+}
+
+void PeakMergeSetWindow(PeakMerge* merge, UInt64 windowNs)
+{
+    __atomic_store_n(&merge->windowNs, windowNs, __ATOMIC_RELAXED);
+}
+
+#pragma mark - Adapter side
+
+void PeakMergeAttach(PeakMerge* merge, UInt32 channel, PeakRing* ring)
+{
+    if (channel >= PEAK_MAX_CHANNELS)
+        return;
+    
+    __atomic_store_n(&merge->rings[channel], ring, __ATOMIC_RELEASE);
+    __atomic_store_n(&merge->active[channel], 1, __ATOMIC_RELEASE);
+}
+
+void PeakMergeDetach(PeakMerge* merge, UInt32 channel)
+{
+    // after the last commit, the frames left in the ring are drained without waiting for more
+    if (channel < PEAK_MAX_CHANNELS)
+        __atomic_store_n(&merge->active[channel], 0, __ATOMIC_RELEASE);
+}
+
+#pragma mark - Consumer side
+
+UInt32 PeakMergeDrain(PeakMerge* merge, CanMsg* batch, UInt32 max, UInt64 nowNs)
+{
+    PeakRing* rings[PEAK_MAX_CHANNELS];
+    CanMsg* heads[PEAK_MAX_CHANNELS];
+    UInt64 windowNs = __atomic_load_n(&merge->windowNs, __ATOMIC_RELAXED);
+    UInt64 floor = nowNs > windowNs ? nowNs - windowNs : 0;
+    UInt64 limit = ~0ULL, quiet = ~0ULL, bound;
+    UInt32 i, best, count = 0;
+    CanMsg* newest;
+    
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+    {
+        rings[i] = __atomic_load_n(&merge->rings[i], __ATOMIC_ACQUIRE);
+        heads[i] = NULL;
+        if (rings[i] == NULL)
+            continue;
+        
+        // the flag first: a detached adapter has committed everything it will before clearing it
+        UInt32 active = __atomic_load_n(&merge->active[i], __ATOMIC_ACQUIRE);
+        
+        newest = PeakRingNewest(rings[i]);
+        if (newest && newest->mono > merge->seenNs[i])
+            merge->seenNs[i] = newest->mono;
+        heads[i] = PeakRingBorrow(rings[i]);
+        
+        // nothing the adapter commits later can be older than what it committed so far
+        if (active)
+        {
+            if (merge->seenNs[i] < quiet)
+                quiet = merge->seenNs[i];
+            bound = merge->seenNs[i] > floor ? merge->seenNs[i] : floor;
+            if (bound < limit)
+                limit = bound;
+        }
+    }
+    
+    while (count < max)
+    {
+        best = PEAK_MAX_CHANNELS;
+        for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+        {
+            if (heads[i] && (best == PEAK_MAX_CHANNELS || heads[i]->mono < heads[best]->mono))
+                best = i;
+        }
+        
+        if (best == PEAK_MAX_CHANNELS || heads[best]->mono > limit)
+            break;
+        
+        if (heads[best]->mono < merge->lastNs)
+        {
+            merge->stats.late++;
+            if (merge->lastNs - heads[best]->mono > merge->stats.maxLateNs)
+                merge->stats.maxLateNs = merge->lastNs - heads[best]->mono;
+        }
+        else
+        {
+            merge->lastNs = heads[best]->mono;
+        }
+        if (heads[best]->mono > quiet)
+            merge->stats.windowed++;
+        
+        batch[count++] = *heads[best];
+        PeakRingRelease(rings[best]);
+        heads[best] = PeakRingBorrow(rings[best]);
+    }
+    
+    merge->stats.frames += count;
+    return count;
+}
+
+UInt32 PeakMergeFill(const PeakMerge* merge)
+{
+    UInt32 i, fill = 0;
+    
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+    {
+        PeakRing* ring = __atomic_load_n(&merge->rings[i], __ATOMIC_ACQUIRE);
+        if (ring)
+            fill += PeakRingFill(ring);
+    }
+    return fill;
+}
+
+void PeakMergeGetStats(const PeakMerge* merge, PeakMergeStats* stats)
+{
+    *stats = merge->stats;
+}
@@ -0,0 +1,59 @@
+/*
+    File:           PeakMerge.h
+
+    Description:    Merges the receive rings of several adapters into one stream ordered by time, with a
+                    bounded reorder window.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakMerge_h
+#define PeakLog_PeakMerge_h
+
+#include "PeakRing.h"
+
+#define PEAK_MERGE_DEFAULT_WINDOW_NS    20000000ULL     // 20 ms, far more than the USB latency between adapters
+
+// Every ring is filled by one adapter in the order of its (monotonic) timestamps, so a frame can go out
+// once every attached adapter has delivered something younger, or once it is older than the window.
+// The oldest head of at most PEAK_MAX_CHANNELS rings is found by a linear scan, cheaper than a heap at
+// this size. Frames of a busy bus only wait for the other buses' next telegram, a quiet bus holds the
+// others back by the window. The rings are registered by the adapters' threads, everything else happens
+// on the consumer thread.
+typedef struct {
+    PeakRing*       rings[PEAK_MAX_CHANNELS];   // NULL until a channel is first attached
+    UInt32          active[PEAK_MAX_CHANNELS];  // the adapter is attached and may commit more frames
+    UInt64          seenNs[PEAK_MAX_CHANNELS];  // youngest frame committed to each ring so far
+    UInt64          windowNs;
+    UInt64          lastNs;                     // youngest frame handed out
+    PeakMergeStats  stats;
+} PeakMerge;
+
+void PeakMergeInit(PeakMerge* merge, UInt64 windowNs);
+void PeakMergeSetWindow(PeakMerge* merge, UInt64 windowNs);
+
+// adapter side, the ring stays registered for the channel after the detach
+void PeakMergeAttach(PeakMerge* merge, UInt32 channel, PeakRing* ring);
+void PeakMergeDetach(PeakMerge* merge, UInt32 channel);
+
+// consumer side, copies up to max frames in time order and returns their number
+UInt32 PeakMergeDrain(PeakMerge* merge, CanMsg* batch, UInt32 max, UInt64 nowNs);
+// frames waiting in all rings, including those held back by the window
+UInt32 PeakMergeFill(const PeakMerge* merge);
+void PeakMergeGetStats(const PeakMerge* merge, PeakMergeStats* stats);
+
+#endif
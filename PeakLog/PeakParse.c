@@ -0,0 +1,293 @@
+/*
+    File:           PeakParse.c
+
+    Description:    Parser for frame lists as they are pasted into the log window or kept in text
+                    files, handing the frames on in batches.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "PeakParse.h"
+#include "PeakBatch.h"
+#include "PeakTimebase.h"
+
+#define CAN_EXT_FLAG                0x80000000
+#define CAN_RTR_FLAG                0x40000000
+
+typedef struct {
+    const PeakParseConfig*  config;
+    PeakParseStats*         stats;
+    UInt32                  count;
+    CanMsg                  batch[PEAK_PARSE_BATCH];
+} Parser;
+
+void PeakParseConfigInit(PeakParseConfig* config)
+{
+    bzero(config, sizeof(PeakParseConfig));
+}
+
+#pragma mark - Parsing
+
+static inline int IsBlank(UInt8 c)
+{
+    return c == ' ' || c == '\t' || c == '\v' || c == '\f';
+}
+
+static inline int IsEnd(UInt8 c)
+{
+    return c == ';' || c == '\n' || c == '\r' || c == '#';
+}
+
+// 16 for anything but a hex digit
+static inline UInt32 Digit(UInt8 c)
+{
+    if ((UInt32)(c - '0') < 10)
+        return c - '0';
+    c |= 0x20;
+    if ((UInt32)(c - 'a') < 6)
+        return c - 'a' + 10;
+    return 16;
+}
+
+static IOReturn Hand(Parser* parser)
+{
+    IOReturn kr = kIOReturnSuccess;
+    
+    if (parser->count > 0 && parser->config->frames)
+        kr = parser->config->frames(parser->config->refCon, parser->batch, parser->count);
+    if (kr == kIOReturnSuccess)
+        parser->stats->frames += parser->count;
+    parser->count = 0;
+    return kr;
+}
+
+static void Report(Parser* parser, UInt64 line, UInt32 column, const char* format, ...)
+{
+    char message[PEAK_PARSE_MESSAGE_MAX];
+    va_list args;
+    
+    parser->stats->errors++;
+    if (parser->config->error == NULL)
+        return;
+    
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    parser->config->error(parser->config->refCon, (UInt32)line, column, message);
+}
+
+static IOReturn Parse(Parser* parser, const UInt8* ptr, const UInt8* end)
+{
+    const UInt32 base = parser->config->flags & PEAK_PARSE_DECIMAL ? 10 : 16;
+    const UInt8* lineStart = ptr;
+    UInt64 line = 1;
+    IOReturn kr;
+    
+    while (ptr < end)
+    {
+        CanMsg* msg = &parser->batch[parser->count];
+        UInt32 tokens = 0, failed = 0;
+        
+        // the tokens of one frame
+        for (;;)
+        {
+            const UInt8 *token, *digits, *stop;
+            UInt64 value = 0;
+            UInt32 radix = base, digit;
+            
+            while (ptr < end && IsBlank(*ptr))
+                ptr++;
+            if (ptr == end || IsEnd(*ptr))
+                break;
+            
+            token = ptr;
+            if (ptr + 1 < end && ptr[0] == '0' && (ptr[1] | 0x20) == 'x')
+            {
+                radix = 16;
+                ptr += 2;
+            }
+            for (digits = ptr; ptr < end && (digit = Digit(*ptr)) < radix; ptr++)
+            {
+                value = value * radix + digit;
+                if (value > 0xffffffff)
+                    value = 0x100000000ULL;
+            }
+            for (stop = ptr; stop < end && !IsBlank(*stop) && !IsEnd(*stop); stop++)
+                ;
+            
+            if (failed)
+            {
+                // only looking for the end of the frame
+            }
+            else if (ptr == digits || ptr != stop)
+            {
+                Report(parser, line, (UInt32)(token - lineStart) + 1, "%.*s is not a %s number", (int)(stop - token), token,
+                       radix == 16 ? "hex" : "decimal");
+                failed = 1;
+            }
+            else if (value > 0xffffffff)
+            {
+                Report(parser, line, (UInt32)(token - lineStart) + 1, "%.*s does not fit into 32 bits", (int)(stop - token), token);
+                failed = 1;
+            }
+            else if (tokens == 0)
+            {
+                bzero(msg, sizeof(CanMsg));
+                msg->ext = (value & CAN_EXT_FLAG) != 0;
+                msg->rtr = (value & CAN_RTR_FLAG) != 0;
+                msg->canid.ul = (UInt32)value & 0x3fffffff;
+                if (msg->canid.ul > (msg->ext ? 0x1fffffff : 0x7ff))
+                {
+                    Report(parser, line, (UInt32)(token - lineStart) + 1, msg->ext ? "identifier 0x%X has more than 29 bits" :
+                           "identifier 0x%X has more than 11 bits, 29 bit ones need 0x80000000", msg->canid.ul);
+                    failed = 1;
+                }
+            }
+            else if (tokens > 8)
+            {
+                Report(parser, line, (UInt32)(token - lineStart) + 1, "more than 8 data bytes");
+                failed = 1;
+            }
+            else if (value > 0xff)
+            {
+                Report(parser, line, (UInt32)(token - lineStart) + 1, "data byte 0x%llX is larger than 0xFF", value);
+                failed = 1;
+            }
+            else if (!msg->rtr)
+            {
+                msg->data[tokens - 1] = (UInt8)value;
+            }
+            
+            ptr = stop;
+            tokens++;
+        }
+        
+        if (tokens > 0 && !failed)
+        {
+            msg->len = (UInt8)(tokens - 1);
+            msg->loc = 1;
+            msg->channel = (UInt8)parser->config->channel;
+            if (++parser->count == PEAK_PARSE_BATCH && (kr = Hand(parser)) != kIOReturnSuccess)
+                return kr;
+        }
+        
+        if (ptr < end && *ptr == '#')
+        {
+            while (ptr < end && *ptr != '\n' && *ptr != '\r')
+                ptr++;
+        }
+        
+        // "\r\n" and a lone "\r" are one line break, like "\n"
+        if (ptr < end)
+        {
+            if (*ptr == '\n' || (*ptr == '\r' && (ptr + 1 == end || ptr[1] != '\n')))
+            {
+                line++;
+                lineStart = ptr + 1;
+            }
+            ptr++;
+        }
+    }
+    
+    parser->stats->lines = line - (lineStart == end && line > 1);
+    return Hand(parser);
+}
+
+IOReturn PeakParseText(const char* text, size_t length, const PeakParseConfig* config, PeakParseStats* stats)
+{
+    PeakParseStats ignored;
+    Parser parser;
+    
+    if (stats == NULL)
+        stats = &ignored;
+    bzero(stats, sizeof(PeakParseStats));
+    if (config->channel >= PEAK_MAX_CHANNELS)
+        return kIOReturnBadArgument;
+    
+    parser.config = config;
+    parser.stats = stats;
+    parser.count = 0;
+    return Parse(&parser, (const UInt8*)text, (const UInt8*)text + length);
+}
+
+IOReturn PeakParseFile(const char* path, const PeakParseConfig* config, PeakParseStats* stats)
+{
+    struct stat st;
+    void* text;
+    IOReturn kr;
+    int fd;
+    
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Unable to open frame list %s (%s)\n", path, strerror(errno));
+        return kIOReturnNotOpen;
+    }
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return kIOReturnIOError;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return PeakParseText("", 0, config, stats);
+    }
+    
+    text = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED)
+    {
+        fprintf(stderr, "Unable to map frame list %s (%s)\n", path, strerror(errno));
+        return kIOReturnNoMemory;
+    }
+    
+    madvise(text, (size_t)st.st_size, MADV_SEQUENTIAL);
+    kr = PeakParseText(text, (size_t)st.st_size, config, stats);
+    munmap(text, (size_t)st.st_size);
+    return kr;
+}
+
+#pragma mark - Sending
+
+IOReturn PeakParseSendQueued(CanMsg* msgs, UInt32 count, UInt32* queued)
+{
+    UInt64 mono = PeakMonotonicNs(), ts = PeakRealtimeNs();
+    UInt32 i;
+    
+    for (i = 0; i < count; i++)
+    {
+        msgs[i].mono = mono;
+        msgs[i].ts = ts;
+    }
+    return PeakSendBatch(msgs, count, 1, queued);
+}
+
+IOReturn PeakParseSend(void* refCon, CanMsg* msgs, UInt32 count)
+{
+    (void)refCon;
+    return PeakParseSendQueued(msgs, count, NULL);
+}
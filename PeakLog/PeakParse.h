@@ -0,0 +1,75 @@
+/*
+    File:           PeakParse.h
+
+    Description:    Parser for frame lists as they are pasted into the log window or kept in text
+                    files, handing the frames on in batches.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakParse_h
+#define PeakLog_PeakParse_h
+
+#include "PeakUSB.h"
+
+// One frame per line, lines end with a newline or ';'. A frame is its identifier followed by up to eight
+// data bytes, separated by blanks; 0x80000000 in the identifier marks a 29 bit one, 0x40000000 an RTR
+// frame whose length is the number of bytes given. Numbers are hex with or without 0x unless
+// PEAK_PARSE_DECIMAL is set, then only those with 0x are. '#' starts a comment up to the end of the line.
+//
+//  0x80000005 0xc0 0xff 0xee;  0x13 ba be
+//  0x40000006 0 0              # RTR, two bytes expected
+//
+// Lines with an error are reported and skipped, the others are still handed on.
+#define PEAK_PARSE_DECIMAL          0x01
+#define PEAK_PARSE_BATCH            256     // frames handed on at once
+#define PEAK_PARSE_MESSAGE_MAX      96
+
+// Takes the next batch of frames. The buffer is the parser's own, the frames may be changed (say stamped)
+// but not kept. Anything but kIOReturnSuccess stops parsing and is returned.
+typedef IOReturn (*PeakParseFramesFunc)(void* refCon, CanMsg* msgs, UInt32 count);
+// Line and column count from 1.
+typedef void (*PeakParseErrorFunc)(void* refCon, UInt32 line, UInt32 column, const char* message);
+
+typedef struct {
+    UInt32              flags;      // PEAK_PARSE_...
+    UInt32              channel;    // of the frames
+    PeakParseFramesFunc frames;
+    PeakParseErrorFunc  error;      // NULL if the errors are only counted
+    void*               refCon;
+} PeakParseConfig;
+
+typedef struct {
+    UInt64  lines;          // text lines
+    UInt64  frames;         // handed on
+    UInt64  errors;         // frames skipped
+} PeakParseStats;
+
+void PeakParseConfigInit(PeakParseConfig* config);
+
+// Nothing is copied or allocated, the text need not be terminated.
+IOReturn PeakParseText(const char* text, size_t length, const PeakParseConfig* config, PeakParseStats* stats);
+// The same on a mapped file.
+IOReturn PeakParseFile(const char* path, const PeakParseConfig* config, PeakParseStats* stats);
+
+// A PeakParseFramesFunc queueing the frames with PeakSendBatch, waiting while the transmit queue is full.
+// The frames are stamped with the time they were queued. refCon is not used.
+IOReturn PeakParseSend(void* refCon, CanMsg* msgs, UInt32 count);
+// The same, *queued tells how many frames from the first on were taken, also when it fails.
+IOReturn PeakParseSendQueued(CanMsg* msgs, UInt32 count, UInt32* queued);
+
+#endif
@@ -0,0 +1,272 @@
+/*
+    File:           PeakReplay.c
+
+    Description:    Replays a capture file through the transmit path, at the original timing, scaled,
+                    or as fast as possible.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "PeakReplay.h"
+#include "PeakBatch.h"
+
+#pragma mark - Clock
+
+// Sleeps until spinNs before the deadline and spins the rest, a sleep alone overshoots by the scheduler
+// latency. Returns early if the replay is stopped.
+static void WaitUntil(PeakReplay* replay, UInt64 dueNs)
+{
+    UInt64 now;
+    
+    while ((now = PeakMonotonicNs()) < dueNs)
+    {
+        if (dueNs - now > replay->config.spinNs)
+        {
+            UInt64 ns = dueNs - now - replay->config.spinNs;
+            struct timespec delay;
+            
+            if (ns > PEAK_REPLAY_SLEEP_NS)
+                ns = PEAK_REPLAY_SLEEP_NS;
+            delay.tv_sec = 0;
+            delay.tv_nsec = (long)ns;
+            nanosleep(&delay, NULL);
+            
+            if (!__atomic_load_n(&replay->running, __ATOMIC_ACQUIRE))
+                return;
+        }
+    }
+}
+
+UInt64 PeakReplayBucketLimit(UInt32 bucket)
+{
+    return 1000ULL << bucket;
+}
+
+static void CountJitter(PeakReplayStats* stats, UInt64 sentNs, UInt64 dueNs)
+{
+    UInt64 late;
+    UInt32 bucket = 0;
+    
+    if (sentNs < dueNs)
+    {
+        __atomic_add_fetch(&stats->early, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    
+    late = sentNs - dueNs;
+    while (bucket < PEAK_REPLAY_BUCKETS - 1 && late >= PeakReplayBucketLimit(bucket))
+        bucket++;
+    
+    __atomic_add_fetch(&stats->late[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->sumLateNs, late, __ATOMIC_RELAXED);
+    if (late > stats->maxLateNs)
+        __atomic_store_n(&stats->maxLateNs, late, __ATOMIC_RELAXED);
+}
+
+#pragma mark - Setup
+
+static IOReturn SendDriver(void* refCon, const CanMsg* msgs, UInt32 count)
+{
+    (void)refCon;
+    return PeakSendBatch(msgs, count, 1, NULL);
+}
+
+void PeakReplayConfigInit(PeakReplayConfig* config)
+{
+    bzero(config, sizeof(PeakReplayConfig));
+    config->speed = 1.0;
+    config->spinNs = PEAK_REPLAY_DEFAULT_SPIN_NS;
+    config->batchFrames = PEAK_REPLAY_MAX_BATCH;
+}
+
+IOReturn PeakReplayOpen(PeakReplay* replay, const char* path, const PeakReplayConfig* config)
+{
+    IOReturn kr;
+    
+    bzero(replay, sizeof(PeakReplay));
+    if (config->speed < 0 || config->batchFrames == 0 || config->batchFrames > PEAK_REPLAY_MAX_BATCH)
+        return kIOReturnBadArgument;
+    
+    kr = PeakIndexOpen(&replay->reader, path);
+    if (kr != kIOReturnSuccess)
+        return kr;
+    
+    replay->config = *config;
+    if (replay->config.send == NULL)
+        replay->config.send = SendDriver;
+    
+    replay->first = config->fromNs ? PeakIndexSeekTime(&replay->reader, config->fromNs) : 0;
+    replay->end = config->toNs ? PeakIndexSeekTime(&replay->reader, config->toNs + 1) : replay->reader.recordCount;
+    return kIOReturnSuccess;
+}
+
+void PeakReplayClose(PeakReplay* replay)
+{
+    PeakReplayStop(replay);
+    PeakIndexClose(&replay->reader);
+}
+
+#pragma mark - Replay
+
+static UInt64 DueNs(const PeakReplay* replay, UInt64 startNs, UInt64 baseTs, UInt64 ts)
+{
+    if (replay->config.speed == 0 || ts <= baseTs)
+        return startNs;
+    
+    return startNs + (UInt64)((ts - baseTs) / replay->config.speed);
+}
+
+// only reads running, a stop coming before it even started is kept
+static IOReturn Replay(PeakReplay* replay)
+{
+    const PeakCaptureRecord* record;
+    UInt64 i = replay->first, startNs, baseTs, sentNs;
+    UInt32 n, k;
+    IOReturn kr = kIOReturnSuccess;
+    
+    bzero(&replay->stats, sizeof(PeakReplayStats));
+    
+    if (i >= replay->end)
+    {
+        __atomic_store_n(&replay->running, 0, __ATOMIC_RELEASE);
+        return kIOReturnSuccess;
+    }
+    
+    baseTs = PeakIndexRecord(&replay->reader, i)->ts;
+    startNs = PeakMonotonicNs();
+    
+    while (i < replay->end && __atomic_load_n(&replay->running, __ATOMIC_ACQUIRE))
+    {
+        record = PeakIndexRecord(&replay->reader, i);
+        if (record->flags & PEAK_CAPTURE_ERR)
+        {
+            __atomic_add_fetch(&replay->stats.skipped, 1, __ATOMIC_RELAXED);
+            i++;
+            continue;
+        }
+        
+        WaitUntil(replay, DueNs(replay, startNs, baseTs, record->ts));
+        if (!__atomic_load_n(&replay->running, __ATOMIC_ACQUIRE))
+            break;
+        
+        // everything due by now goes out together, frames we are behind on as well
+        sentNs = PeakMonotonicNs();
+        for (n = 0; i < replay->end && n < replay->config.batchFrames; i++)
+        {
+            record = PeakIndexRecord(&replay->reader, i);
+            if (record->flags & PEAK_CAPTURE_ERR)
+            {
+                __atomic_add_fetch(&replay->stats.skipped, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            
+            replay->due[n] = DueNs(replay, startNs, baseTs, record->ts);
+            if (n > 0 && replay->due[n] > sentNs + replay->config.windowNs)
+                break;
+            PeakCaptureRecordToMsg(record, &replay->batch[n++]);
+        }
+        
+        kr = replay->config.send(replay->config.refCon, replay->batch, n);
+        if (kr != kIOReturnSuccess)
+        {
+            __atomic_add_fetch(&replay->stats.errors, n, __ATOMIC_RELAXED);
+            if (kr != kIOReturnNoSpace)
+                break;
+            kr = kIOReturnSuccess; // a full queue only costs these frames
+        }
+        else
+        {
+            __atomic_add_fetch(&replay->stats.frames, n, __ATOMIC_RELAXED);
+        }
+        
+        // as fast as possible has no schedule to keep
+        for (k = 0; k < n && replay->config.speed > 0; k++)
+            CountJitter(&replay->stats, sentNs, replay->due[k]);
+        __atomic_add_fetch(&replay->stats.batches, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&replay->stats.elapsedNs, PeakMonotonicNs() - startNs, __ATOMIC_RELAXED);
+    }
+    
+    __atomic_store_n(&replay->running, 0, __ATOMIC_RELEASE);
+    return kr;
+}
+
+IOReturn PeakReplayRun(PeakReplay* replay)
+{
+    __atomic_store_n(&replay->running, 1, __ATOMIC_RELEASE);
+    return Replay(replay);
+}
+
+// PeakReplayStart has set running already
+static void* ReplayThread(void* refCon)
+{
+    Replay(refCon);
+    return NULL;
+}
+
+IOReturn PeakReplayStart(PeakReplay* replay)
+{
+    if (replay->threaded)
+        return kIOReturnBusy;
+    
+    // set here already, so PeakReplayIsRunning is true as soon as we return
+    __atomic_store_n(&replay->running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&replay->thread, NULL, ReplayThread, replay) != 0)
+    {
+        __atomic_store_n(&replay->running, 0, __ATOMIC_RELEASE);
+        return kIOReturnNoResources;
+    }
+    
+    replay->threaded = 1;
+    return kIOReturnSuccess;
+}
+
+void PeakReplayStop(PeakReplay* replay)
+{
+    __atomic_store_n(&replay->running, 0, __ATOMIC_RELEASE);
+    
+    if (replay->threaded)
+    {
+        pthread_join(replay->thread, NULL);
+        replay->threaded = 0;
+    }
+}
+
+int PeakReplayIsRunning(PeakReplay* replay)
+{
+    return __atomic_load_n(&replay->running, __ATOMIC_ACQUIRE) != 0;
+}
+
+void PeakReplayGetStats(PeakReplay* replay, PeakReplayStats* stats)
+{
+    UInt32 i;
+    
+    stats->frames    = __atomic_load_n(&replay->stats.frames, __ATOMIC_RELAXED);
+    stats->batches   = __atomic_load_n(&replay->stats.batches, __ATOMIC_RELAXED);
+    stats->skipped   = __atomic_load_n(&replay->stats.skipped, __ATOMIC_RELAXED);
+    stats->errors    = __atomic_load_n(&replay->stats.errors, __ATOMIC_RELAXED);
+    stats->early     = __atomic_load_n(&replay->stats.early, __ATOMIC_RELAXED);
+    stats->maxLateNs = __atomic_load_n(&replay->stats.maxLateNs, __ATOMIC_RELAXED);
+    stats->sumLateNs = __atomic_load_n(&replay->stats.sumLateNs, __ATOMIC_RELAXED);
+    stats->elapsedNs = __atomic_load_n(&replay->stats.elapsedNs, __ATOMIC_RELAXED);
+    for (i = 0; i < PEAK_REPLAY_BUCKETS; i++)
+        stats->late[i] = __atomic_load_n(&replay->stats.late[i], __ATOMIC_RELAXED);
+}
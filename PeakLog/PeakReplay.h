@@ -0,0 +1,94 @@
+/*
+    File:           PeakReplay.h
+
+    Description:    Replays a capture file through the transmit path, at the original timing, scaled,
+                    or as fast as possible.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakReplay_h
+#define PeakLog_PeakReplay_h
+
+#include <pthread.h>
+
+#include "PeakUSB.h"
+#include "PeakIndex.h"
+
+#define PEAK_REPLAY_DEFAULT_SPIN_NS 200000ULL   // the last 200 us before a deadline are spun, not slept
+#define PEAK_REPLAY_SLEEP_NS        10000000ULL // longest single sleep, so a stop is noticed
+#define PEAK_REPLAY_MAX_BATCH       256         // frames handed to the transmit path at once
+#define PEAK_REPLAY_BUCKETS         24          // jitter histogram: bucket 0 below 1 us, bucket i below 2^i us
+
+// Takes count frames for transmission, may block while the transmit path is busy.
+typedef IOReturn (*PeakReplaySendFunc)(void* refCon, const CanMsg* msgs, UInt32 count);
+
+typedef struct {
+    double              speed;      // 1 original timing, 0.5 half speed, 2 twice as fast, 0 as fast as possible
+    UInt64              spinNs;     // sleep until this close to a deadline, then spin
+    UInt64              windowNs;   // frames due within this of the first one go out in the same batch
+    UInt32              batchFrames;
+    UInt64              fromNs;     // capture time range, 0 for either end means no limit
+    UInt64              toNs;
+    PeakReplaySendFunc  send;       // NULL sends with PeakSendBatch
+    void*               refCon;
+} PeakReplayConfig;
+
+typedef struct {
+    UInt64  frames;                         // frames sent
+    UInt64  batches;
+    UInt64  skipped;                        // error records, they are not frames
+    UInt64  errors;                         // frames the send function refused
+    UInt64  late[PEAK_REPLAY_BUCKETS];      // frames by how late they were sent against their schedule
+    UInt64  early;                          // frames sent ahead of their time because of windowNs
+    UInt64  maxLateNs;
+    UInt64  sumLateNs;
+    UInt64  elapsedNs;                      // since the first frame was due
+} PeakReplayStats;
+
+// The frames are scheduled relative to the first one against the monotonic clock, so the replay neither
+// drifts nor catches up in a burst after a slow send: a frame is due at start + (ts - first ts) / speed.
+typedef struct {
+    PeakIndexReader     reader;
+    PeakReplayConfig    config;
+    UInt64              first;      // record range
+    UInt64              end;
+    pthread_t           thread;
+    int                 threaded;
+    UInt32              running;    // cleared to stop
+    PeakReplayStats     stats;
+    CanMsg              batch[PEAK_REPLAY_MAX_BATCH];
+    UInt64              due[PEAK_REPLAY_MAX_BATCH];
+} PeakReplay;
+
+void PeakReplayConfigInit(PeakReplayConfig* config);
+
+IOReturn PeakReplayOpen(PeakReplay* replay, const char* path, const PeakReplayConfig* config);
+// Replays on the calling thread until the end of the range or PeakReplayStop.
+IOReturn PeakReplayRun(PeakReplay* replay);
+// The same on a thread of its own.
+IOReturn PeakReplayStart(PeakReplay* replay);
+// Stops a running replay and waits for its thread.
+void PeakReplayStop(PeakReplay* replay);
+int PeakReplayIsRunning(PeakReplay* replay);
+void PeakReplayClose(PeakReplay* replay);
+
+void PeakReplayGetStats(PeakReplay* replay, PeakReplayStats* stats);
+// upper limit of a jitter bucket in ns
+UInt64 PeakReplayBucketLimit(UInt32 bucket);
+
+#endif
@@ -0,0 +1,123 @@
+/*
+    File:           PeakRing.c
+
+    Description:    Preallocated CanMsg slab with a wait-free single-producer/single-consumer ring
+                    between the bulk decoder and the consumer of received frames.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "PeakRing.h"
+
+#pragma mark - Setup
+
+IOReturn PeakRingCreate(PeakRing* ring, UInt32 capacity)
+{
+    bzero(ring, sizeof(PeakRing));
+
+    if (capacity == 0 || (capacity & (capacity - 1)))
+        return kIOReturnBadArgument;
+
+    ring->slots = calloc(capacity, sizeof(CanMsg));
+    if (ring->slots == NULL)
+        return kIOReturnNoMemory;
+
+    ring->mask = capacity - 1;
+    return kIOReturnSuccess;
+}
+
+void PeakRingDestroy(PeakRing* ring)
+{
+    free(ring->slots);
+    bzero(ring, sizeof(PeakRing));
+}
+
+#pragma mark - Producer
+
+CanMsg* PeakRingReserve(PeakRing* ring)
+{
+    UInt32 head = ring->head; // own index, no ordering needed
+    UInt32 tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail > ring->mask)
+    {
+        __atomic_store_n(&ring->overflows, ring->overflows + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    return &ring->slots[head & ring->mask];
+}
+
+void PeakRingCommit(PeakRing* ring)
+{
+    UInt32 head = ring->head + 1;
+    UInt32 fill = head - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+    if (fill > ring->highWater)
+        __atomic_store_n(&ring->highWater, fill, __ATOMIC_RELAXED);
+
+    // publish the slot contents together with the new head
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+}
+
+#pragma mark - Consumer
+
+CanMsg* PeakRingBorrow(PeakRing* ring)
+{
+    UInt32 tail = ring->tail; // own index, no ordering needed
+
+    if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &ring->slots[tail & ring->mask];
+}
+
+void PeakRingRelease(PeakRing* ring)
+{
+    // hand the slot back to the producer after we are done reading it
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+CanMsg* PeakRingNewest(PeakRing* ring)
+{
+    UInt32 tail = ring->tail;
+    UInt32 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (tail == head)
+        return NULL;
+
+    return &ring->slots[(head - 1) & ring->mask];
+}
+
+#pragma mark - Statistics
+
+UInt32 PeakRingFill(const PeakRing* ring)
+{
+    UInt32 tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+}
+
+void PeakRingGetStats(const PeakRing* ring, PeakRingStats* stats)
+{
+    stats->capacity  = ring->mask + 1;
+    stats->fill      = PeakRingFill(ring);
+    stats->highWater = __atomic_load_n(&ring->highWater, __ATOMIC_RELAXED);
+    stats->overflows = __atomic_load_n(&ring->overflows, __ATOMIC_RELAXED);
+}
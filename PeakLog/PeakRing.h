@@ -0,0 +1,71 @@
+/*
+    File:           PeakRing.h
+
+    Description:    Preallocated CanMsg slab with a wait-free single-producer/single-consumer ring
+                    between the bulk decoder and the consumer of received frames.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakRing_h
+#define PeakLog_PeakRing_h
+
+#include "PeakUSB.h"
+
+// default number of CanMsg slots, must be a power of two
+#define PEAK_RING_DEFAULT_CAPACITY  8192
+
+// The slots are allocated once in PeakRingCreate and reused for the lifetime of the ring. The producer
+// (the bulk read completion) reserves a slot, fills it in place and commits it. The consumer borrows the
+// oldest committed slot and releases it when done; the slot must not be touched after the release.
+// Each index is only ever written by one side, so neither side needs a lock.
+typedef struct {
+    CanMsg*          slots;         // the slab
+    UInt32           mask;          // capacity - 1
+    UInt32           highWater;     // maximum fill level seen by the producer
+    UInt32           overflows;     // frames dropped because the ring was full
+    UInt8            pad0[64 - sizeof(CanMsg*) - 3 * sizeof(UInt32)];
+    UInt32           head;          // next slot to fill, written by the producer only
+    UInt8            pad1[64 - sizeof(UInt32)];
+    UInt32           tail;          // next slot to borrow, written by the consumer only
+    UInt8            pad2[64 - sizeof(UInt32)];
+} PeakRing;
+
+typedef struct {
+    UInt32  capacity;
+    UInt32  fill;
+    UInt32  highWater;
+    UInt32  overflows;
+} PeakRingStats;
+
+IOReturn PeakRingCreate(PeakRing* ring, UInt32 capacity);
+void PeakRingDestroy(PeakRing* ring);
+
+// producer side
+CanMsg* PeakRingReserve(PeakRing* ring);
+void PeakRingCommit(PeakRing* ring);
+
+// consumer side
+CanMsg* PeakRingBorrow(PeakRing* ring);
+void PeakRingRelease(PeakRing* ring);
+// the youngest committed slot, NULL if the ring is empty; it stays valid until it is released in turn
+CanMsg* PeakRingNewest(PeakRing* ring);
+
+UInt32 PeakRingFill(const PeakRing* ring);
+void PeakRingGetStats(const PeakRing* ring, PeakRingStats* stats);
+
+#endif
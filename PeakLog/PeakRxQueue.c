@@ -0,0 +1,165 @@
+/*
+    File:           PeakRxQueue.c
+
+    Description:    Keeps several bulk-IN reads in flight, each with its own buffer, and hands the
+                    completed buffers to the decoder in submission order.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "PeakRxQueue.h"
+
+#pragma mark - Setup
+
+IOReturn PeakRxQueueInit(PeakRxQueue* queue, UInt32 depth, PeakRxSubmitFunc submit, PeakRxDecodeFunc decode, void* refCon)
+{
+    bzero(queue, sizeof(PeakRxQueue));
+
+    if (depth == 0 || depth > PEAK_RX_MAX_DEPTH)
+        return kIOReturnBadArgument;
+
+    queue->depth = depth;
+    queue->count = depth + 1;
+    queue->submit = submit;
+    queue->decode = decode;
+    queue->refCon = refCon;
+    return kIOReturnSuccess;
+}
+
+#pragma mark - Transfer handling
+
+// with backoff set, a submit failing with no read in flight is retried before giving up
+static IOReturn Refill(PeakRxQueue* queue, int backoff)
+{
+    IOReturn kr = kIOReturnSuccess;
+    struct timespec pause;
+    UInt32 attempt = 0;
+
+    while (queue->inFlight < queue->depth)
+    {
+        PeakRxTransfer* transfer = &queue->transfers[queue->head];
+
+        if (transfer->state != PEAK_RX_IDLE)
+            break; // still waiting to be decoded
+
+        transfer->state = PEAK_RX_PENDING;
+        transfer->length = 0;
+        queue->inFlight++;
+
+        kr = queue->submit(queue->refCon, transfer);
+        if (kr == kIOReturnSuccess)
+        {
+            queue->head = (queue->head + 1) % queue->count;
+            continue;
+        }
+
+        transfer->state = PEAK_RX_IDLE;
+        queue->inFlight--;
+        queue->submitFailures++;
+
+        // a completion still to come tries again
+        if (queue->inFlight > 0 || !backoff)
+            break;
+
+        if (attempt == PEAK_RX_RETRIES)
+        {
+            queue->stalls++;
+            break;
+        }
+
+        pause.tv_sec = 0;
+        pause.tv_nsec = 1000000L << attempt++;
+        nanosleep(&pause, NULL);
+        queue->retries++;
+    }
+
+    return kr;
+}
+
+IOReturn PeakRxQueueStart(PeakRxQueue* queue)
+{
+    IOReturn kr;
+    UInt32 i;
+
+    for (i = 0; i < queue->count; i++)
+        queue->transfers[i].state = PEAK_RX_IDLE;
+
+    queue->head = queue->tail = queue->inFlight = 0;
+    kr = Refill(queue, 1);
+    return queue->inFlight ? kIOReturnSuccess : kr;
+}
+
+IOReturn PeakRxQueueComplete(PeakRxQueue* queue, PeakRxTransfer* transfer, IOReturn result, UInt32 length)
+{
+    IOReturn kr;
+
+    queue->inFlight--;
+    queue->completions++;
+
+    if (queue->inFlight == 0)
+        queue->dry++;
+
+    if (transfer != &queue->transfers[queue->tail])
+        queue->outOfOrder++;
+
+    if (result != kIOReturnSuccess)
+    {
+        queue->errors++;
+        length = 0;
+    }
+
+    transfer->length = length;
+    transfer->state = PEAK_RX_DONE;
+    queue->bytes += length;
+
+    // re-arm first, decoding can wait
+    Refill(queue, 0);
+
+    while (queue->transfers[queue->tail].state == PEAK_RX_DONE)
+    {
+        PeakRxTransfer* done = &queue->transfers[queue->tail];
+
+        if (done->length > 0)
+            queue->decode(queue->refCon, done->buffer, done->length);
+
+        done->state = PEAK_RX_IDLE;
+        queue->tail = (queue->tail + 1) % queue->count;
+    }
+
+    // buffers held back by an out of order completion are free again
+    kr = Refill(queue, 1);
+    return queue->inFlight ? kIOReturnSuccess : kr;
+}
+
+#pragma mark - Statistics
+
+void PeakRxQueueGetStats(const PeakRxQueue* queue, PeakRxQueueStats* stats)
+{
+    stats->depth          = queue->depth;
+    stats->inFlight       = queue->inFlight;
+    stats->completions    = queue->completions;
+    stats->bytes          = queue->bytes;
+    stats->dry            = queue->dry;
+    stats->outOfOrder     = queue->outOfOrder;
+    stats->errors         = queue->errors;
+    stats->submitFailures = queue->submitFailures;
+    stats->retries        = queue->retries;
+    stats->stalls         = queue->stalls;
+}
@@ -0,0 +1,94 @@
+/*
+    File:           PeakRxQueue.h
+
+    Description:    Keeps several bulk-IN reads in flight, each with its own buffer, and hands the
+                    completed buffers to the decoder in submission order.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakRxQueue_h
+#define PeakLog_PeakRxQueue_h
+
+#include "PeakUSB.h"
+
+#define PEAK_RX_BUFFER_SIZE     64      // size of a bulk-IN telegram
+#define PEAK_RX_DEFAULT_DEPTH   4       // reads kept in flight
+#define PEAK_RX_MAX_DEPTH       32
+#define PEAK_RX_RETRIES         8       // submits repeated with no read left in flight, 1 ms apart doubling
+
+// transfer states
+#define PEAK_RX_IDLE            0
+#define PEAK_RX_PENDING         1
+#define PEAK_RX_DONE            2
+
+typedef struct {
+    UInt8   buffer[PEAK_RX_BUFFER_SIZE];
+    UInt32  length;                     // bytes received
+    UInt32  state;
+    void*   userData;                   // owned by the transport, e.g. its native transfer
+} PeakRxTransfer;
+
+typedef IOReturn (*PeakRxSubmitFunc)(void* refCon, PeakRxTransfer* transfer);
+typedef void (*PeakRxDecodeFunc)(void* refCon, const UInt8* buffer, UInt32 length);
+
+// The queue owns depth + 1 buffers in a ring. When a read completes, the spare buffer is submitted right
+// away and only then the completed one is decoded, so the adapter always has depth reads to complete
+// while the host is busy decoding. Completions that arrive out of order are held back until all older
+// buffers are done. A submit that fails while other reads are in flight is tried again with the next
+// completion; with none left nothing would come by, so it is retried with a backoff. If that fails too
+// the queue has stalled, PeakRxQueueStart or PeakRxQueueComplete tell the transport.
+typedef struct {
+    PeakRxTransfer      transfers[PEAK_RX_MAX_DEPTH + 1];
+    UInt32              depth;
+    UInt32              count;          // depth + 1
+    UInt32              head;           // next buffer to submit
+    UInt32              tail;           // oldest submitted buffer, next to decode
+    UInt32              inFlight;
+    PeakRxSubmitFunc    submit;
+    PeakRxDecodeFunc    decode;
+    void*               refCon;
+    UInt64              completions;
+    UInt64              bytes;
+    UInt64              dry;            // completions which found no other read pending
+    UInt64              outOfOrder;
+    UInt64              errors;         // failed completions
+    UInt64              submitFailures;
+    UInt64              retries;        // submits repeated after a backoff
+    UInt64              stalls;         // times the retries ran out with no read in flight
+} PeakRxQueue;
+
+typedef struct {
+    UInt32  depth;
+    UInt32  inFlight;
+    UInt64  completions;
+    UInt64  bytes;
+    UInt64  dry;
+    UInt64  outOfOrder;
+    UInt64  errors;
+    UInt64  submitFailures;
+    UInt64  retries;
+    UInt64  stalls;
+} PeakRxQueueStats;
+
+IOReturn PeakRxQueueInit(PeakRxQueue* queue, UInt32 depth, PeakRxSubmitFunc submit, PeakRxDecodeFunc decode, void* refCon);
+// both return the error of the last submit if no read is in flight afterwards, reception has stopped then
+IOReturn PeakRxQueueStart(PeakRxQueue* queue);
+IOReturn PeakRxQueueComplete(PeakRxQueue* queue, PeakRxTransfer* transfer, IOReturn result, UInt32 length);
+void PeakRxQueueGetStats(const PeakRxQueue* queue, PeakRxQueueStats* stats);
+
+#endif
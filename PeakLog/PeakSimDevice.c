@@ -0,0 +1,338 @@
+/*
+    File:           PeakSimDevice.c
+
+    Description:    Software model of a PCAN-USB adapter producing bulk-IN telegrams at a configurable
+                    bus load, for the loopback transport.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "PeakSimDevice.h"
+#include "PeakRxQueue.h"
+#include "PeakBatch.h"
+
+#define SIM_EXT_KEY         0x80000000
+
+#pragma mark - Random numbers
+
+// xorshift64*, reproducible from the seed on every platform
+static UInt64 Next(PeakSimDevice* sim)
+{
+    sim->rng ^= sim->rng >> 12;
+    sim->rng ^= sim->rng << 25;
+    sim->rng ^= sim->rng >> 27;
+    return sim->rng * 2685821657736338717ULL;
+}
+
+static double Uniform(PeakSimDevice* sim)
+{
+    return (Next(sim) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static UInt32 Range(PeakSimDevice* sim, UInt32 low, UInt32 high)
+{
+    if (high <= low)
+        return low;
+    return low + (UInt32)(Next(sim) % ((UInt64)high - low + 1));
+}
+
+#pragma mark - Setup
+
+void PeakSimConfigInit(PeakSimConfig* config)
+{
+    UInt32 i;
+    
+    bzero(config, sizeof(PeakSimConfig));
+    config->frameRate = 2000;
+    config->idCount = 64;
+    config->stdIdMax = 0x7ff;
+    config->extIdMax = 0x1fffffff;
+    config->flushUs = 1000;
+    config->seed = 1;
+    for (i = 0; i < 9; i++)
+        config->dlcWeights[i] = 1;
+}
+
+IOReturn PeakSimDeviceCreate(PeakSimDevice* sim, const PeakSimConfig* config)
+{
+    double total = 0;
+    UInt32 i, sum = 0;
+    
+    bzero(sim, sizeof(PeakSimDevice));
+    if (config->frameRate <= 0 || config->idCount == 0 || config->idCount > PEAK_SIM_MAX_IDS
+        || config->stdIdMax > 0x7ff || config->extIdMax > 0x1fffffff)
+        return kIOReturnBadArgument;
+    
+    for (i = 0; i < 9; i++)
+    {
+        sum += config->dlcWeights[i];
+        sim->dlcCdf[i] = sum;
+    }
+    if (sum == 0)
+        return kIOReturnBadArgument;
+    
+    sim->ids = malloc(config->idCount * sizeof(UInt32));
+    sim->idCdf = malloc(config->idCount * sizeof(double));
+    if (sim->ids == NULL || sim->idCdf == NULL)
+    {
+        PeakSimDeviceDestroy(sim);
+        return kIOReturnNoMemory;
+    }
+    
+    sim->config = *config;
+    sim->rng = config->seed ? config->seed : 1;
+    
+    for (i = 0; i < config->idCount; i++)
+    {
+        if (Uniform(sim) < config->extRatio)
+            sim->ids[i] = SIM_EXT_KEY | Range(sim, config->extIdMin, config->extIdMax);
+        else
+            sim->ids[i] = Range(sim, config->stdIdMin, config->stdIdMax);
+        
+        // identifier i is the (i+1)th most popular one
+        total += config->skew > 0 ? pow(i + 1, -config->skew) : 1.0;
+        sim->idCdf[i] = total;
+    }
+    
+    sim->lastEpoch = config->startTicks >> 16;
+    return kIOReturnSuccess;
+}
+
+void PeakSimDeviceDestroy(PeakSimDevice* sim)
+{
+    free(sim->ids);
+    free(sim->idCdf);
+    sim->ids = NULL;
+    sim->idCdf = NULL;
+}
+
+#pragma mark - Bus
+
+static UInt64 TicksAt(const PeakSimDevice* sim, UInt64 ns)
+{
+    return sim->config.startTicks + sim->tickBase + (UInt64)(ns * (1.0 + sim->config.ppm * 1e-6) / PEAK_SIM_TICK_NS);
+}
+
+static void Draw(PeakSimDevice* sim)
+{
+    double u = Uniform(sim) * sim->idCdf[sim->config.idCount - 1];
+    UInt32 low = 0, high = sim->config.idCount - 1, dlc = (UInt32)(Next(sim) % sim->dlcCdf[8]);
+    
+    while (low < high)
+    {
+        UInt32 mid = (low + high) / 2;
+        if (sim->idCdf[mid] <= u)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    
+    sim->next.key = sim->ids[low];
+    sim->next.rtr = Uniform(sim) < sim->config.rtrRatio;
+    for (sim->next.dlc = 0; dlc >= sim->dlcCdf[sim->next.dlc]; sim->next.dlc++)
+        ;
+    sim->next.valid = 1;
+}
+
+// time on the bus of a frame at 1 MBit/s, without stuff bits, the spacing within a burst
+static UInt64 FrameNs(UInt32 ext, UInt32 dlc)
+{
+    return ((ext ? 67 : 47) + 8 * dlc) * 1000ULL;
+}
+
+static void Advance(PeakSimDevice* sim)
+{
+    UInt64 frames = ++sim->stats.frames;
+    
+    if (sim->config.burstEvery && frames % sim->config.burstEvery == 0)
+    {
+        sim->burstLeft = sim->config.burstLength;
+        sim->stats.bursts++;
+    }
+    
+    if (sim->burstLeft)
+    {
+        sim->burstLeft--;
+        sim->nowNs += FrameNs(sim->next.key & SIM_EXT_KEY, sim->next.rtr ? 0 : sim->next.dlc);
+    }
+    else
+    {
+        sim->nowNs += (UInt64)(1e9 / sim->config.frameRate);
+    }
+    
+    if (sim->config.busOffEvery && frames % sim->config.busOffEvery == 0)
+    {
+        sim->pending |= BUS_OFF;
+        sim->stats.busOffs++;
+    }
+    else if (sim->config.errorEvery && frames % sim->config.errorEvery == 0)
+    {
+        sim->pending |= (frames / sim->config.errorEvery) & 1 ? BUS_LIGHT : BUS_HEAVY;
+    }
+    
+    sim->next.valid = 0;
+}
+
+#pragma mark - Telegrams
+
+// A telegram holds the records of at most flushUs, the first one with a word timestamp and the others with
+// the low byte only, exactly as DecodeMessages expects them.
+UInt32 PeakSimDeviceFill(void* refCon, UInt8* telegram)
+{
+    PeakSimDevice* sim = refCon;
+    UInt32 length = 2, flushTicks = (UInt32)(sim->config.flushUs * 1000 / PEAK_SIM_TICK_NS);
+    UInt64 firstTicks = 0, ticks, epoch, lastNs = 0;
+    
+    if (sim->config.maxFrames && sim->stats.frames >= sim->config.maxFrames)
+        return 0;
+    
+    if (flushTicks == 0)
+        flushTicks = 1;
+    if (flushTicks > 255)
+        flushTicks = 255;
+    
+    // jump to just before the next 16 bit wrap, the timestamps move ahead by up to 2.8 s
+    if (sim->config.wrapEvery && sim->stats.telegrams && sim->stats.telegrams % sim->config.wrapEvery == 0)
+    {
+        ticks = TicksAt(sim, sim->nowNs);
+        if ((ticks & 0xffff) < 0xfff0)
+            sim->tickBase += 0xfff0 - (ticks & 0xffff);
+    }
+    
+    telegram[0] = 2;
+    telegram[1] = 0;
+    
+    while (!sim->config.maxFrames || sim->stats.frames < sim->config.maxFrames)
+    {
+        UInt32 tsLen = telegram[1] ? 1 : 2, dataLen = 0, j;
+        int isFrame = !sim->pending;
+        
+        ticks = TicksAt(sim, sim->nowNs);
+        if (telegram[1] && ticks - firstTicks > flushTicks)
+            break;
+        
+        if (!isFrame)
+        {
+            if (length + 3 + tsLen > PEAK_RX_BUFFER_SIZE)
+                break;
+            telegram[length++] = STLN_INTERNAL_DATA | STLN_WITH_TIMESTAMP;
+            telegram[length++] = 1;             // error status, the flags follow
+            telegram[length++] = sim->pending;
+        }
+        else
+        {
+            UInt32 ext, id;
+            
+            if (!sim->next.valid)
+                Draw(sim);
+            
+            ext = (sim->next.key & SIM_EXT_KEY) != 0;
+            id = sim->next.key & ~SIM_EXT_KEY;
+            dataLen = sim->next.rtr ? 0 : sim->next.dlc;
+            if (length + 1 + (ext ? 4 : 2) + tsLen + dataLen > PEAK_RX_BUFFER_SIZE)
+                break;
+            
+            telegram[length++] = sim->next.dlc | (ext ? STLN_EXTENDED_ID : 0) | (sim->next.rtr ? STLN_RTR : 0);
+            if (ext)
+            {
+                id <<= 3;
+                telegram[length++] = (UInt8)id;
+                telegram[length++] = (UInt8)(id >> 8);
+                telegram[length++] = (UInt8)(id >> 16);
+                telegram[length++] = (UInt8)(id >> 24);
+            }
+            else
+            {
+                id <<= 5;
+                telegram[length++] = (UInt8)id;
+                telegram[length++] = (UInt8)(id >> 8);
+            }
+        }
+        
+        if (tsLen == 2)
+        {
+            telegram[length++] = (UInt8)ticks;
+            telegram[length++] = (UInt8)(ticks >> 8);
+            firstTicks = ticks;
+        }
+        else
+        {
+            telegram[length++] = (UInt8)ticks;
+        }
+        
+        epoch = ticks >> 16;
+        if (epoch != sim->lastEpoch)
+        {
+            sim->stats.wraps += epoch - sim->lastEpoch;
+            sim->lastEpoch = epoch;
+        }
+        
+        lastNs = sim->nowNs;
+        telegram[1]++;
+        
+        if (isFrame)
+        {
+            // the sequence number, so the receiver can tell what got lost
+            for (j = 0; j < dataLen; j++)
+                telegram[length++] = (UInt8)(sim->stats.frames >> (8 * (j & 7)));
+            
+            if (sim->next.key & SIM_EXT_KEY)
+                sim->stats.extFrames++;
+            if (sim->next.rtr)
+                sim->stats.rtrFrames++;
+            Advance(sim);
+        }
+        else
+        {
+            // shares the time of the frame after it
+            sim->pending = 0;
+            sim->stats.statusRecords++;
+        }
+    }
+    
+    sim->stats.telegrams++;
+    sim->stats.bytes += length;
+    sim->stats.simNs = lastNs;
+    
+    if (sim->config.realtime)
+    {
+        UInt64 now = PeakMonotonicNs();
+        
+        if (sim->startNs == 0)
+            sim->startNs = now - lastNs;
+        
+        while (now < sim->startNs + lastNs)
+        {
+            UInt64 ns = sim->startNs + lastNs - now;
+            struct timespec delay = { (time_t)(ns / 1000000000ULL), (long)(ns % 1000000000ULL) };
+            nanosleep(&delay, NULL);
+            now = PeakMonotonicNs();
+        }
+    }
+    
+    return length;
+}
+
+void PeakSimDeviceGetStats(PeakSimDevice* sim, PeakSimStats* stats)
+{
+    *stats = sim->stats;
+}
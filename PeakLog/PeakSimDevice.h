@@ -0,0 +1,100 @@
+/*
+    File:           PeakSimDevice.h
+
+    Description:    Software model of a PCAN-USB adapter producing bulk-IN telegrams at a configurable
+                    bus load, for the loopback transport.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakSimDevice_h
+#define PeakLog_PeakSimDevice_h
+
+#include "PeakUSB.h"
+
+#define PEAK_SIM_MAX_IDS            65536
+#define PEAK_SIM_TICK_NS            (128000.0 / 3)  // one timestamp tick, PCAN_USB_TS_US_PER_TICK >> PCAN_USB_TS_DIV_SHIFTER
+
+// The bus is simulated on a clock of its own: frames are spaced 1/frameRate apart in simulated time, and
+// unless realtime is set, telegrams are produced as fast as they are asked for. Each frame carries its
+// sequence number in the first (up to) four data bytes, so a consumer can count what it lost.
+typedef struct {
+    double  frameRate;          // frames per second of simulated bus time
+    UInt32  idCount;            // identifiers, drawn once from the ranges below
+    UInt32  stdIdMin, stdIdMax;
+    UInt32  extIdMin, extIdMax;
+    double  extRatio;           // share of the identifiers with 29 bits
+    double  skew;               // Zipf exponent of the identifier popularity, 0 for uniform
+    double  rtrRatio;           // share of RTR frames
+    UInt32  dlcWeights[9];      // relative frequency of each length
+    UInt32  flushUs;            // the adapter sends a telegram at least this often, at most 255 ticks
+    UInt32  burstEvery;         // every burstEvery frames burstLength frames follow back to back, 0 for never
+    UInt32  burstLength;
+    UInt32  errorEvery;         // an error status record (bus light/heavy) every errorEvery frames, 0 for never
+    UInt32  busOffEvery;        // a bus-off status record every busOffEvery frames, 0 for never
+    UInt32  wrapEvery;          // every wrapEvery telegrams the tick counter jumps to just before a 16 bit wrap
+    UInt16  startTicks;         // initial tick counter
+    double  ppm;                // error of the adapter crystal, positive runs fast
+    UInt64  maxFrames;          // the source is exhausted after this many frames, 0 for never
+    UInt64  seed;
+    int     realtime;           // pace the telegrams to the simulated clock
+} PeakSimConfig;
+
+typedef struct {
+    UInt64  frames;
+    UInt64  extFrames;
+    UInt64  rtrFrames;
+    UInt64  statusRecords;
+    UInt64  busOffs;
+    UInt64  bursts;
+    UInt64  wraps;              // 16 bit tick wraps
+    UInt64  telegrams;
+    UInt64  bytes;
+    UInt64  simNs;              // simulated time of the last frame
+} PeakSimStats;
+
+typedef struct {
+    PeakSimConfig   config;
+    UInt32*         ids;        // PEAK_INDEX_KEY style, ext flag in the top bit
+    double*         idCdf;
+    UInt32          dlcCdf[9];
+    UInt64          rng;
+    UInt64          nowNs;      // simulated time of the next frame
+    UInt64          tickBase;   // ticks added by wrap jumps
+    UInt64          startNs;    // monotonic time of simulated time 0, realtime only
+    UInt32          burstLeft;
+    UInt64          lastEpoch;  // tick counter >> 16, for counting wraps
+    UInt8           pending;    // status record owed, the error flags
+    struct {
+        UInt32      key;
+        UInt8       rtr, dlc, valid;
+    } next;                     // drawn but not yet written
+    PeakSimStats    stats;
+} PeakSimDevice;
+
+void PeakSimConfigInit(PeakSimConfig* config);
+IOReturn PeakSimDeviceCreate(PeakSimDevice* sim, const PeakSimConfig* config);
+void PeakSimDeviceDestroy(PeakSimDevice* sim);
+
+// Writes the next telegram (at most PEAK_RX_BUFFER_SIZE bytes) and returns its length, 0 once maxFrames
+// have been produced. Matches PeakLoopbackSourceFunc, refCon being the PeakSimDevice:
+//   PeakLoopbackSetSource(adapter, PeakSimDeviceFill, &sim);
+UInt32 PeakSimDeviceFill(void* refCon, UInt8* telegram);
+
+void PeakSimDeviceGetStats(PeakSimDevice* sim, PeakSimStats* stats);
+
+#endif
@@ -0,0 +1,594 @@
+/*
+    File:           PeakStream.c
+
+    Description:    UNIX socket server streaming the received frames to local clients as SocketCAN
+                    can_frame or canfd_frame records.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "PeakStream.h"
+#include "PeakBatch.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL                0           // SO_NOSIGPIPE is set on the socket instead
+#endif
+
+#define CLIENT_FREE                 0
+#define CLIENT_PENDING              1           // waiting for a PeakStreamRequest
+#define CLIENT_ACTIVE               2
+#define CLIENT_DEAD                 3           // shut down, closed by the server thread
+
+#pragma mark - Records
+
+static UInt32 RecordSize(UInt32 flags)
+{
+    return (flags & PEAK_STREAM_FD ? sizeof(PeakCanFdFrame) : sizeof(PeakCanFrame)) + (flags & PEAK_STREAM_TIMESTAMP ? sizeof(UInt64) : 0);
+}
+
+static void Encode(UInt8* out, UInt32 flags, const CanMsg* msgs, UInt32 count)
+{
+    UInt32 i, canId, size = flags & PEAK_STREAM_FD ? sizeof(PeakCanFdFrame) : sizeof(PeakCanFrame);
+    
+    for (i = 0; i < count; i++)
+    {
+        const CanMsg* msg = &msgs[i];
+        
+        if (flags & PEAK_STREAM_TIMESTAMP)
+        {
+            memcpy(out, &msg->ts, sizeof(UInt64));
+            out += sizeof(UInt64);
+        }
+        
+        canId = msg->canid.ul;
+        if (msg->ext)
+            canId |= PEAK_CAN_EFF_FLAG;
+        if (msg->rtr)
+            canId |= PEAK_CAN_RTR_FLAG;
+        if (msg->err)
+            canId |= PEAK_CAN_ERR_FLAG;
+        
+        // both layouts start alike, the bytes past the length are zero as from a SocketCAN socket
+        bzero(out, size);
+        ((PeakCanFrame*)out)->canId = canId;
+        ((PeakCanFrame*)out)->len = msg->len;
+        if (!msg->rtr)
+            memcpy(((PeakCanFrame*)out)->data, msg->data, msg->len);
+        out += size;
+    }
+}
+
+#pragma mark - Clients
+
+static void Wake(PeakStream* stream)
+{
+    char c = 0;
+    
+    if (write(stream->wake[1], &c, 1) < 0)
+        return; // the pipe is full, the thread is woken anyway
+}
+
+// called with the lock held, the server thread closes the socket
+static void Disconnect(PeakStream* stream, PeakStreamClient* client)
+{
+    shutdown(client->fd, SHUT_RDWR);
+    client->state = CLIENT_DEAD;
+    stream->stats.disconnects++;
+    Wake(stream);
+}
+
+static void Queue(PeakStream* stream, PeakStreamClient* client, const UInt8* records, UInt32 count)
+{
+    UInt32 size = client->recordSize, drop, last, part;
+    
+    if (count > client->capacity - client->count)
+    {
+        switch (client->overflow)
+        {
+            case PEAK_STREAM_DISCONNECT:
+                stream->stats.dropped += count + client->count;
+                Disconnect(stream, client);
+                return;
+                
+            case PEAK_STREAM_DROP_NEWEST:
+                drop = count - (client->capacity - client->count);
+                stream->stats.dropped += drop;
+                count -= drop;
+                break;
+                
+            default:
+                if (count > client->capacity)
+                {
+                    drop = count - client->capacity;
+                    stream->stats.dropped += drop;
+                    records += drop * size;
+                    count = client->capacity;
+                }
+                drop = count - (client->capacity - client->count);
+                stream->stats.dropped += drop;
+                client->first = (client->first + drop) % client->capacity;
+                client->count -= drop;
+                break;
+        }
+    }
+    
+    // at most two pieces around the end of the ring
+    last = (client->first + client->count) % client->capacity;
+    part = client->capacity - last < count ? client->capacity - last : count;
+    memcpy(client->backlog + (size_t)last * size, records, (size_t)part * size);
+    memcpy(client->backlog, records + (size_t)part * size, (size_t)(count - part) * size);
+    client->count += count;
+}
+
+// Sends what is queued for the client and then records, in one sendmsg that never blocks. What the
+// socket does not take is queued, a record cut in two is finished from carry before anything else.
+static void Send(PeakStream* stream, PeakStreamClient* client, const UInt8* records, UInt32 count)
+{
+    struct iovec iov[4];
+    struct msghdr message;
+    UInt32 size = client->recordSize, ring, whole;
+    size_t sent;
+    ssize_t result;
+    int iovs = 0;
+    
+    if (client->carryEnd > client->carryStart)
+    {
+        iov[iovs].iov_base = client->carry + client->carryStart;
+        iov[iovs++].iov_len = client->carryEnd - client->carryStart;
+    }
+    if (client->count)
+    {
+        ring = client->capacity - client->first < client->count ? client->capacity - client->first : client->count;
+        iov[iovs].iov_base = client->backlog + (size_t)client->first * size;
+        iov[iovs++].iov_len = (size_t)ring * size;
+        if (ring < client->count)
+        {
+            iov[iovs].iov_base = client->backlog;
+            iov[iovs++].iov_len = (size_t)(client->count - ring) * size;
+        }
+    }
+    if (count)
+    {
+        iov[iovs].iov_base = (void*)records;
+        iov[iovs++].iov_len = (size_t)count * size;
+    }
+    if (iovs == 0)
+        return;
+    
+    bzero(&message, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = iovs;
+    result = sendmsg(client->fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+    stream->stats.sends++;
+    stream->stats.frames += count;
+    
+    if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+        Disconnect(stream, client);
+        return;
+    }
+    sent = result < 0 ? 0 : (size_t)result;
+    
+    // carry, then the backlog, then the new records
+    if (client->carryEnd > client->carryStart)
+    {
+        whole = client->carryEnd - client->carryStart;
+        if (sent < whole)
+        {
+            client->carryStart += (UInt32)sent;
+            Queue(stream, client, records, count);
+            return;
+        }
+        sent -= whole;
+        client->carryStart = client->carryEnd = 0;
+    }
+    
+    if (client->count)
+    {
+        whole = (UInt32)(sent / size);
+        if (whole < client->count)
+        {
+            client->first = (client->first + whole) % client->capacity;
+            client->count -= whole;
+            if (sent % size)
+            {
+                memcpy(client->carry, client->backlog + (size_t)client->first * size + sent % size, size - sent % size);
+                client->carryEnd = size - (UInt32)(sent % size);
+                client->first = (client->first + 1) % client->capacity;
+                client->count--;
+            }
+            Queue(stream, client, records, count);
+            return;
+        }
+        sent -= (size_t)client->count * size;
+        client->first = client->count = 0;
+    }
+    
+    whole = (UInt32)(sent / size);
+    if (sent % size)
+    {
+        memcpy(client->carry, records + (size_t)whole * size + sent % size, size - sent % size);
+        client->carryEnd = size - (UInt32)(sent % size);
+        whole++;
+    }
+    if (whole < count)
+        Queue(stream, client, records + (size_t)whole * size, count - whole);
+}
+
+static int Pending(const PeakStreamClient* client)
+{
+    return client->count || client->carryEnd > client->carryStart;
+}
+
+static void Deliver(PeakStream* stream, PeakStreamClient* client, const UInt8* records, UInt32 count)
+{
+    int pending = Pending(client);
+    
+    Send(stream, client, records, count);
+    
+    // the server thread may be polling without POLLOUT for this client
+    if (!pending && client->state == CLIENT_ACTIVE && Pending(client))
+        Wake(stream);
+}
+
+// called with the lock held; frames go out from here on
+static void Activate(PeakStream* stream, PeakStreamClient* client, UInt32 flags, UInt32 overflow, UInt32 backlog)
+{
+    client->flags = flags;
+    client->overflow = overflow;
+    client->recordSize = RecordSize(flags);
+    client->capacity = backlog ? backlog : stream->config.backlog;
+    client->first = client->count = 0;
+    client->carryStart = client->carryEnd = 0;
+    client->backlog = malloc((size_t)client->capacity * client->recordSize);
+    
+    if (client->backlog == NULL)
+        Disconnect(stream, client);
+    else
+        client->state = CLIENT_ACTIVE;
+}
+
+// called with the lock held, the request collects in carry; anything but a request means the defaults
+static void ReadRequest(PeakStream* stream, PeakStreamClient* client)
+{
+    PeakStreamRequest request;
+    ssize_t got = recv(client->fd, client->carry + client->carryEnd, sizeof(PeakStreamRequest) - client->carryEnd, MSG_DONTWAIT);
+    
+    if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+        Disconnect(stream, client);
+        return;
+    }
+    if (got > 0)
+        client->carryEnd += (UInt32)got;
+    if (client->carryEnd < sizeof(PeakStreamRequest))
+        return;
+    
+    memcpy(&request, client->carry, sizeof(PeakStreamRequest));
+    if (request.magic == PEAK_STREAM_MAGIC && request.flags <= (PEAK_STREAM_TIMESTAMP | PEAK_STREAM_FD) &&
+        request.overflow <= PEAK_STREAM_DISCONNECT && request.backlog <= PEAK_STREAM_MAX_BACKLOG)
+        Activate(stream, client, request.flags, request.overflow, request.backlog);
+    else
+        Activate(stream, client, stream->config.flags, stream->config.overflow, 0);
+}
+
+static void Accept(PeakStream* stream)
+{
+    PeakStreamClient* client = NULL;
+    int fd = accept(stream->listenFd, NULL, NULL), i;
+    
+    if (fd < 0)
+        return;
+    
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+    i = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &i, sizeof(i));
+#endif
+    
+    pthread_mutex_lock(&stream->lock);
+    for (i = 0; i < PEAK_STREAM_MAX_CLIENTS && client == NULL; i++)
+    {
+        if (stream->clients[i].state == CLIENT_FREE)
+            client = &stream->clients[i];
+    }
+    
+    if (client)
+    {
+        bzero(client, sizeof(PeakStreamClient));
+        client->fd = fd;
+        client->state = CLIENT_PENDING;
+        client->acceptedNs = PeakMonotonicNs();
+        stream->stats.connects++;
+        __atomic_add_fetch(&stream->stats.clients, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    
+    if (client == NULL)
+    {
+        fprintf(stderr, "Stream %s has %u clients already\n", stream->path, PEAK_STREAM_MAX_CLIENTS);
+        close(fd);
+    }
+}
+
+static void Release(PeakStream* stream, PeakStreamClient* client)
+{
+    close(client->fd);
+    free(client->backlog);
+    bzero(client, sizeof(PeakStreamClient));
+    client->fd = -1;
+    __atomic_sub_fetch(&stream->stats.clients, 1, __ATOMIC_RELAXED);
+}
+
+#pragma mark - Server thread
+
+static void* ServerThread(void* refCon)
+{
+    PeakStream* stream = refCon;
+    struct pollfd fds[PEAK_STREAM_MAX_CLIENTS + 2];
+    PeakStreamClient* polled[PEAK_STREAM_MAX_CLIENTS];
+    UInt64 now, deadline;
+    UInt32 i, n;
+    char scratch[4096];
+    int timeout;
+    
+    while (!__atomic_load_n(&stream->stopping, __ATOMIC_ACQUIRE))
+    {
+        fds[0].fd = stream->wake[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = stream->listenFd;
+        fds[1].events = POLLIN;
+        n = 2;
+        deadline = 0;
+        
+        pthread_mutex_lock(&stream->lock);
+        for (i = 0; i < PEAK_STREAM_MAX_CLIENTS; i++)
+        {
+            PeakStreamClient* client = &stream->clients[i];
+            
+            if (client->state == CLIENT_DEAD)
+                Release(stream, client);
+            if (client->state == CLIENT_FREE)
+                continue;
+            
+            if (client->state == CLIENT_PENDING && (deadline == 0 || client->acceptedNs + PEAK_STREAM_REQUEST_NS < deadline))
+                deadline = client->acceptedNs + PEAK_STREAM_REQUEST_NS;
+            
+            // anything a client sends after its request is read and ignored, so the socket never fills
+            fds[n].fd = client->fd;
+            fds[n].events = POLLIN | (Pending(client) ? POLLOUT : 0);
+            if (client->state == CLIENT_PENDING)
+                fds[n].events = POLLIN;
+            polled[n - 2] = client;
+            n++;
+        }
+        pthread_mutex_unlock(&stream->lock);
+        
+        now = PeakMonotonicNs();
+        timeout = deadline == 0 ? -1 : deadline > now ? (int)((deadline - now) / 1000000ULL) + 1 : 0;
+        if (poll(fds, n, timeout) < 0 && errno != EINTR)
+            break;
+        
+        if (fds[0].revents & POLLIN)
+        {
+            while (read(stream->wake[0], scratch, sizeof(scratch)) > 0)
+                ;
+        }
+        
+        now = PeakMonotonicNs();
+        pthread_mutex_lock(&stream->lock);
+        for (i = 2; i < n; i++)
+        {
+            PeakStreamClient* client = polled[i - 2];
+            
+            if (client->state == CLIENT_PENDING)
+            {
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                    ReadRequest(stream, client);
+                if (client->state == CLIENT_PENDING && now >= client->acceptedNs + PEAK_STREAM_REQUEST_NS)
+                    Activate(stream, client, stream->config.flags, stream->config.overflow, 0);
+            }
+            else if (client->state == CLIENT_ACTIVE)
+            {
+                if (fds[i].revents & (POLLHUP | POLLERR))
+                    Disconnect(stream, client);
+                else if ((fds[i].revents & POLLIN) && recv(client->fd, scratch, sizeof(scratch), MSG_DONTWAIT) == 0)
+                    Disconnect(stream, client);
+                else if (fds[i].revents & POLLOUT)
+                    Deliver(stream, client, NULL, 0);
+            }
+        }
+        pthread_mutex_unlock(&stream->lock);
+        
+        if (fds[1].revents & POLLIN)
+            Accept(stream);
+    }
+    
+    return NULL;
+}
+
+#pragma mark - Setup
+
+void PeakStreamConfigInit(PeakStreamConfig* config)
+{
+    bzero(config, sizeof(PeakStreamConfig));
+    config->overflow = PEAK_STREAM_DROP_OLDEST;
+    config->backlog = PEAK_STREAM_DEFAULT_BACKLOG;
+}
+
+IOReturn PeakStreamOpen(PeakStream* stream, const char* path, const PeakStreamConfig* config)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    UInt32 i;
+    
+    bzero(stream, sizeof(PeakStream));
+    stream->listenFd = stream->wake[0] = stream->wake[1] = -1;
+    for (i = 0; i < PEAK_STREAM_MAX_CLIENTS; i++)
+        stream->clients[i].fd = -1;
+    
+    if (strlen(path) >= sizeof(stream->path) || strlen(path) >= sizeof(addr.sun_path))
+        return kIOReturnBadArgument;
+    if (config->flags > (PEAK_STREAM_TIMESTAMP | PEAK_STREAM_FD) || config->overflow > PEAK_STREAM_DISCONNECT ||
+        config->backlog == 0 || config->backlog > PEAK_STREAM_MAX_BACKLOG)
+        return kIOReturnBadArgument;
+    
+    stream->config = *config;
+    strcpy(stream->path, path);
+    
+    for (i = 0; i < 4; i++)
+    {
+        stream->encoded[i] = malloc((size_t)PEAK_STREAM_BATCH * RecordSize(i));
+        if (stream->encoded[i] == NULL)
+        {
+            PeakStreamClose(stream);
+            return kIOReturnNoMemory;
+        }
+    }
+    
+    if (pipe(stream->wake) != 0)
+    {
+        stream->wake[0] = stream->wake[1] = -1;
+        PeakStreamClose(stream);
+        return kIOReturnNoResources;
+    }
+    fcntl(stream->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(stream->wake[1], F_SETFL, O_NONBLOCK);
+    
+    // a socket left behind by an earlier run is replaced, anything else at the path is not
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    
+    stream->listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (stream->listenFd < 0 || bind(stream->listenFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(stream->listenFd, PEAK_STREAM_MAX_CLIENTS) != 0)
+    {
+        fprintf(stderr, "Unable to listen on %s (%s)\n", path, strerror(errno));
+        if (stream->listenFd >= 0)
+            close(stream->listenFd);
+        stream->listenFd = -1;
+        stream->path[0] = 0; // not ours to unlink
+        PeakStreamClose(stream);
+        return kIOReturnNotOpen;
+    }
+    fcntl(stream->listenFd, F_SETFL, O_NONBLOCK);
+    
+    pthread_mutex_init(&stream->lock, NULL);
+    if (pthread_create(&stream->thread, NULL, ServerThread, stream) != 0)
+    {
+        pthread_mutex_destroy(&stream->lock);
+        PeakStreamClose(stream);
+        return kIOReturnNoResources;
+    }
+    return kIOReturnSuccess;
+}
+
+void PeakStreamClose(PeakStream* stream)
+{
+    UInt32 i;
+    
+    if (stream->thread)
+    {
+        __atomic_store_n(&stream->stopping, 1, __ATOMIC_RELEASE);
+        Wake(stream);
+        pthread_join(stream->thread, NULL);
+        
+        for (i = 0; i < PEAK_STREAM_MAX_CLIENTS; i++)
+        {
+            if (stream->clients[i].state != CLIENT_FREE)
+                Release(stream, &stream->clients[i]);
+        }
+        pthread_mutex_destroy(&stream->lock);
+    }
+    
+    if (stream->listenFd >= 0)
+    {
+        close(stream->listenFd);
+        unlink(stream->path);
+    }
+    if (stream->wake[0] >= 0)
+    {
+        close(stream->wake[0]);
+        close(stream->wake[1]);
+    }
+    for (i = 0; i < 4; i++)
+        free(stream->encoded[i]);
+    
+    bzero(stream, sizeof(PeakStream));
+    stream->listenFd = stream->wake[0] = stream->wake[1] = -1;
+}
+
+#pragma mark - Publishing
+
+void PeakStreamPublish(PeakStream* stream, const CanMsg* msgs, UInt32 count)
+{
+    UInt32 i, n, encoded;
+    
+    // nobody connected, nothing to lock
+    if (__atomic_load_n(&stream->stats.clients, __ATOMIC_RELAXED) == 0)
+        return;
+    
+    while (count)
+    {
+        n = count < PEAK_STREAM_BATCH ? count : PEAK_STREAM_BATCH;
+        encoded = 0; // formats done for this batch
+        
+        pthread_mutex_lock(&stream->lock);
+        for (i = 0; i < PEAK_STREAM_MAX_CLIENTS; i++)
+        {
+            PeakStreamClient* client = &stream->clients[i];
+            
+            if (client->state != CLIENT_ACTIVE)
+                continue;
+            
+            if (!(encoded & (1 << client->flags)))
+            {
+                Encode(stream->encoded[client->flags], client->flags, msgs, n);
+                encoded |= 1 << client->flags;
+            }
+            Deliver(stream, client, stream->encoded[client->flags], n);
+        }
+        pthread_mutex_unlock(&stream->lock);
+        
+        msgs += n;
+        count -= n;
+    }
+}
+
+void PeakStreamGetStats(PeakStream* stream, PeakStreamStats* stats)
+{
+    pthread_mutex_lock(&stream->lock);
+    *stats = stream->stats;
+    pthread_mutex_unlock(&stream->lock);
+}
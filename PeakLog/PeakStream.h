@@ -0,0 +1,141 @@
+/*
+    File:           PeakStream.h
+
+    Description:    UNIX socket server streaming the received frames to local clients as SocketCAN
+                    can_frame or canfd_frame records.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakStream_h
+#define PeakLog_PeakStream_h
+
+#include <pthread.h>
+
+#include "PeakUSB.h"
+
+#define PEAK_STREAM_MAGIC           0x54534b50  // "PKST", first field of a PeakStreamRequest
+#define PEAK_STREAM_MAX_CLIENTS     32
+#define PEAK_STREAM_BATCH           256         // frames encoded at once
+#define PEAK_STREAM_DEFAULT_BACKLOG 16384       // records queued for a client that does not keep up
+#define PEAK_STREAM_MAX_BACKLOG     1048576     // the most a client may ask for
+#define PEAK_STREAM_REQUEST_NS      50000000ULL // a new client gets this long to send a request
+
+// record format, flags of PeakStreamConfig and PeakStreamRequest
+#define PEAK_STREAM_TIMESTAMP       0x01        // a UInt64 in ns since 1970 precedes each frame
+#define PEAK_STREAM_FD              0x02        // PeakCanFdFrame (72 bytes) instead of PeakCanFrame (16)
+
+// what happens to frames for a client whose backlog is full
+#define PEAK_STREAM_DROP_OLDEST     0           // the oldest queued records make room
+#define PEAK_STREAM_DROP_NEWEST     1           // the new records are dropped
+#define PEAK_STREAM_DISCONNECT      2           // the client is disconnected
+
+// can_id flags as in linux/can.h
+#define PEAK_CAN_EFF_FLAG           0x80000000U
+#define PEAK_CAN_RTR_FLAG           0x40000000U
+#define PEAK_CAN_ERR_FLAG           0x20000000U
+
+// struct can_frame and struct canfd_frame of linux/can.h, in host byte order
+typedef struct {
+    UInt32  canId;          // identifier | PEAK_CAN_..._FLAG
+    UInt8   len;            // can_dlc
+    UInt8   pad;
+    UInt8   res0;
+    UInt8   len8Dlc;
+    UInt8   data[8];
+} __attribute__ ((packed)) PeakCanFrame;
+
+typedef struct {
+    UInt32  canId;
+    UInt8   len;
+    UInt8   flags;
+    UInt8   res0;
+    UInt8   res1;
+    UInt8   data[64];
+} __attribute__ ((packed)) PeakCanFdFrame;
+
+// A client that wants other settings than the server's defaults sends this right after connecting; the
+// server waits PEAK_STREAM_REQUEST_NS for it before the first frame goes out. Clients that send nothing
+// just read records.
+typedef struct {
+    UInt32  magic;          // PEAK_STREAM_MAGIC
+    UInt8   flags;          // PEAK_STREAM_TIMESTAMP, PEAK_STREAM_FD
+    UInt8   overflow;       // PEAK_STREAM_DROP_OLDEST, _DROP_NEWEST or _DISCONNECT
+    UInt16  reserved;
+    UInt32  backlog;        // records, 0 for the server's
+} __attribute__ ((packed)) PeakStreamRequest;
+
+// defaults for clients that send no request, typedef'd in PeakUSB.h
+struct PeakStreamConfig {
+    UInt32  flags;
+    UInt32  overflow;
+    UInt32  backlog;        // records
+};
+
+struct PeakStreamStats {
+    UInt32  clients;        // connected now
+    UInt64  connects;
+    UInt64  disconnects;    // by PEAK_STREAM_DISCONNECT or errors
+    UInt64  frames;         // records for the clients, summed over them, dropped ones included
+    UInt64  dropped;        // records lost to full backlogs
+    UInt64  sends;          // sendmsg calls
+};
+
+// Records for a client go straight to its socket, which never blocks. What the socket does not take
+// is kept in the client's backlog, a ring of whole records; a record the socket took only part of is
+// finished first from carry. The server thread accepts clients, reads their requests and sends the
+// backlogs as the sockets drain.
+typedef struct {
+    int                 fd;             // -1 while the slot is free
+    UInt32              state;
+    UInt32              flags;
+    UInt32              overflow;
+    UInt32              recordSize;
+    UInt64              acceptedNs;
+    UInt8*              backlog;
+    UInt32              capacity;       // records
+    UInt32              first;          // oldest queued record
+    UInt32              count;
+    UInt8               carry[sizeof(UInt64) + sizeof(PeakCanFdFrame)]; // collects the request while pending
+    UInt32              carryStart;
+    UInt32              carryEnd;
+} PeakStreamClient;
+
+typedef struct {
+    int                 listenFd;
+    int                 wake[2];        // pipe to the server thread
+    char                path[104];
+    pthread_t           thread;
+    pthread_mutex_t     lock;           // the clients and stats
+    UInt32              stopping;
+    PeakStreamConfig    config;
+    PeakStreamClient    clients[PEAK_STREAM_MAX_CLIENTS];
+    UInt8*              encoded[4];     // a batch in each record format
+    PeakStreamStats     stats;
+} PeakStream;
+
+void PeakStreamConfigInit(PeakStreamConfig* config);
+
+IOReturn PeakStreamOpen(PeakStream* stream, const char* path, const PeakStreamConfig* config);
+void PeakStreamClose(PeakStream* stream);
+
+// decoder side, any thread, once per bulk completion; never waits for a client
+void PeakStreamPublish(PeakStream* stream, const CanMsg* msgs, UInt32 count);
+
+void PeakStreamGetStats(PeakStream* stream, PeakStreamStats* stats);
+
+#endif
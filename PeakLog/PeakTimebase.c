@@ -0,0 +1,233 @@
+/*
+    File:           PeakTimebase.c
+
+    Description:    Maps adapter timestamp ticks onto the host clocks, tracking the offset and the drift of the
+                    adapter crystal with a windowed linear fit.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <time.h>
+
+#include "PeakTimebase.h"
+
+#define WALL_STEP_NS    1000000LL
+#define WALL_GAP_NS     20000LL     // the reads were preempted, the offset is off by up to the gap
+
+UInt64 PeakRealtimeNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (UInt64)now.tv_sec * 1000000000ULL + (UInt64)now.tv_nsec;
+}
+
+#pragma mark - Fit
+
+static UInt64 Project(const PeakTimebase* timebase, UInt64 ticks)
+{
+    UInt64 delta, step;
+    
+    // the fit is refreshed every interval, so delta * rateFrac stays far below 2^64
+    if (ticks >= timebase->baseTicks)
+    {
+        delta = ticks - timebase->baseTicks;
+        return timebase->baseNs + delta * timebase->rateInt + ((delta * timebase->rateFrac) >> 32);
+    }
+    
+    delta = timebase->baseTicks - ticks;
+    step = delta * timebase->rateInt + ((delta * timebase->rateFrac) >> 32);
+    return step < timebase->baseNs ? timebase->baseNs - step : 0;
+}
+
+static void SetRate(PeakTimebase* timebase, double rate)
+{
+    timebase->rateInt = (UInt64)rate;
+    timebase->rateFrac = (UInt64)((rate - (double)timebase->rateInt) * 4294967296.0);
+    timebase->ppm = (rate / timebase->nominal - 1.0) * 1e6;
+}
+
+// realtime - monotonic, read between two monotonic reads to halve the error of being preempted
+static void SampleWall(PeakTimebase* timebase)
+{
+    struct timespec before, real, after;
+    SInt64 offset, gap;
+    
+    clock_gettime(CLOCK_MONOTONIC, &before);
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &after);
+    
+    gap = ((SInt64)after.tv_sec - before.tv_sec) * 1000000000LL + (after.tv_nsec - before.tv_nsec);
+    if (timebase->wallOffset && gap > WALL_GAP_NS)
+        return;
+    
+    offset = ((SInt64)real.tv_sec * 1000000000LL + real.tv_nsec) -
+             ((SInt64)before.tv_sec * 1000000000LL + before.tv_nsec +
+              (SInt64)after.tv_sec * 1000000000LL + after.tv_nsec) / 2;
+    
+    if (timebase->wallOffset && llabs(offset - timebase->wallOffset) > WALL_STEP_NS)
+        timebase->wallSteps++;
+    timebase->wallOffset = offset;
+}
+
+static void Push(PeakTimebase* timebase, UInt64 ticks, UInt64 hostNs)
+{
+    timebase->samples[timebase->next].ticks = ticks;
+    timebase->samples[timebase->next].hostNs = hostNs;
+    timebase->next = (timebase->next + 1) % PEAK_TIMEBASE_WINDOW;
+    if (timebase->count < PEAK_TIMEBASE_WINDOW)
+        timebase->count++;
+}
+
+// the adapter has no history yet or its counter jumped: anchor the nominal rate on this completion
+static void Restart(PeakTimebase* timebase, UInt64 ticks, UInt64 hostNs)
+{
+    timebase->count = 0;
+    timebase->next = 0;
+    Push(timebase, ticks, hostNs);
+    
+    timebase->baseTicks = ticks;
+    timebase->baseNs = hostNs;
+    SetRate(timebase, timebase->nominal);
+    timebase->jitterNs = 0;
+    
+    timebase->intervalNs = hostNs;
+    timebase->bestLatency = LLONG_MAX;
+    SampleWall(timebase);
+}
+
+static void Fit(PeakTimebase* timebase)
+{
+    const PeakTimebaseSample* oldest = &timebase->samples[timebase->count < PEAK_TIMEBASE_WINDOW ? 0 : timebase->next];
+    const PeakTimebaseSample* newest = &timebase->samples[(timebase->next + PEAK_TIMEBASE_WINDOW - 1) % PEAK_TIMEBASE_WINDOW];
+    double x, y, mx = 0, my = 0, sxx = 0, sxy = 0, rate, low = 0, r, sum = 0, n = timebase->count;
+    UInt32 i;
+    
+    // relative to the oldest sample, so the doubles only hold the window
+    for (i = 0; i < timebase->count; i++)
+    {
+        mx += (double)(timebase->samples[i].ticks - oldest->ticks);
+        my += (double)(SInt64)(timebase->samples[i].hostNs - oldest->hostNs);
+    }
+    mx /= n;
+    my /= n;
+    
+    for (i = 0; i < timebase->count; i++)
+    {
+        x = (double)(timebase->samples[i].ticks - oldest->ticks) - mx;
+        y = (double)(SInt64)(timebase->samples[i].hostNs - oldest->hostNs) - my;
+        sxx += x * x;
+        sxy += x * y;
+    }
+    
+    // a few samples only see the latency jitter, trust the data sheet until the window has some length
+    rate = (timebase->count >= PEAK_TIMEBASE_WINDOW / 4 && sxx > 0) ? sxy / sxx : timebase->nominal;
+    if (rate > timebase->nominal * (1.0 + PEAK_TIMEBASE_MAX_PPM * 1e-6))
+        rate = timebase->nominal * (1.0 + PEAK_TIMEBASE_MAX_PPM * 1e-6);
+    if (rate < timebase->nominal * (1.0 - PEAK_TIMEBASE_MAX_PPM * 1e-6))
+        rate = timebase->nominal * (1.0 - PEAK_TIMEBASE_MAX_PPM * 1e-6);
+    
+    // the line goes through the lowest latency, the spread around the mean is the jitter
+    for (i = 0; i < timebase->count; i++)
+    {
+        x = (double)(timebase->samples[i].ticks - oldest->ticks);
+        y = (double)(SInt64)(timebase->samples[i].hostNs - oldest->hostNs);
+        r = y - rate * x;
+        if (i == 0 || r < low)
+            low = r;
+        sum += (r - (my - rate * mx)) * (r - (my - rate * mx));
+    }
+    
+    timebase->baseTicks = newest->ticks;
+    timebase->baseNs = oldest->hostNs + (SInt64)llround(low + rate * (double)(newest->ticks - oldest->ticks));
+    timebase->jitterNs = sqrt(sum / n);
+    SetRate(timebase, rate);
+}
+
+#pragma mark - Entry points
+
+void PeakTimebaseInit(PeakTimebase* timebase, double nsPerTick)
+{
+    bzero(timebase, sizeof(PeakTimebase));
+    timebase->nominal = nsPerTick;
+    timebase->bestLatency = LLONG_MAX;
+    SetRate(timebase, nsPerTick);
+}
+
+void PeakTimebaseComplete(PeakTimebase* timebase, UInt64 ticks, UInt64 hostNs)
+{
+    SInt64 latency;
+    
+    timebase->completions++;
+    if (timebase->count == 0)
+    {
+        Restart(timebase, ticks, hostNs);
+        return;
+    }
+    
+    // ticks ahead of the host clock mean the counter jumped, a late completion may just be a busy host
+    latency = (SInt64)(hostNs - Project(timebase, ticks));
+    if (latency < -PEAK_TIMEBASE_RESET_NS)
+    {
+        timebase->resets++;
+        Restart(timebase, ticks, hostNs);
+        return;
+    }
+    
+    if (latency < timebase->bestLatency)
+    {
+        timebase->best.ticks = ticks;
+        timebase->best.hostNs = hostNs;
+        timebase->bestLatency = latency;
+    }
+    
+    if (hostNs - timebase->intervalNs >= PEAK_TIMEBASE_INTERVAL_NS)
+    {
+        // late for a whole interval, the counter went back
+        if (timebase->bestLatency > PEAK_TIMEBASE_RESET_NS)
+        {
+            timebase->resets++;
+            Restart(timebase, timebase->best.ticks, timebase->best.hostNs);
+            return;
+        }
+        
+        Push(timebase, timebase->best.ticks, timebase->best.hostNs);
+        Fit(timebase);
+        SampleWall(timebase);
+        timebase->intervalNs = hostNs;
+        timebase->bestLatency = LLONG_MAX;
+    }
+}
+
+UInt64 PeakTimebaseMonotonic(PeakTimebase* timebase, UInt64 ticks)
+{
+    UInt64 ns = Project(timebase, ticks);
+    
+    // a new fit may put the line a little earlier, hold the time until it catches up
+    if (ns < timebase->lastNs)
+        ns = timebase->lastNs;
+    timebase->lastNs = ns;
+    return ns;
+}
+
+UInt64 PeakTimebaseWall(const PeakTimebase* timebase, UInt64 monotonicNs)
+{
+    return monotonicNs + timebase->wallOffset;
+}
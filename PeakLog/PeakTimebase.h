@@ -0,0 +1,76 @@
+/*
+    File:           PeakTimebase.h
+
+    Description:    Maps adapter timestamp ticks onto the host clocks, tracking the offset and the drift of the
+                    adapter crystal with a windowed linear fit.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakTimebase_h
+#define PeakLog_PeakTimebase_h
+
+#include "PeakUSB.h"
+
+#define PEAK_TIMEBASE_WINDOW        64                      // samples in the fit, 16 s at the default interval
+#define PEAK_TIMEBASE_INTERVAL_NS   250000000ULL            // one sample per interval, the best completion in it
+#define PEAK_TIMEBASE_RESET_NS      100000000LL             // ticks this far ahead, or an interval this late, restart the fit
+#define PEAK_TIMEBASE_MAX_PPM       1000.0                  // the fitted rate stays this close to the nominal one
+
+typedef struct {
+    UInt64  ticks;
+    UInt64  hostNs;
+} PeakTimebaseSample;
+
+// Every bulk completion pairs the newest tick count in the telegram with CLOCK_MONOTONIC. The adapter
+// stamped the frame before the host saw it, so host - adapter time is a latency that is never negative
+// and mostly small: each interval keeps its lowest latency pair, the rate is the least squares slope over
+// the window and the offset puts the line on the lowest pair. Between fits a frame costs one multiply with
+// a 32.32 fixed point rate, and the result never runs backwards.
+typedef struct {
+    double              nominal;        // ns per tick by the data sheet
+    UInt64              baseTicks;      // ns = baseNs + (ticks - baseTicks) * rate
+    UInt64              baseNs;
+    UInt64              rateInt;        // ns per tick, integer part
+    UInt64              rateFrac;       // and fraction in 1/2^32 ns
+    UInt64              lastNs;         // latest time handed out
+    SInt64              wallOffset;     // CLOCK_REALTIME - CLOCK_MONOTONIC
+    PeakTimebaseSample  samples[PEAK_TIMEBASE_WINDOW];
+    UInt32              count;          // valid samples
+    UInt32              next;           // oldest sample, overwritten next
+    PeakTimebaseSample  best;           // lowest latency completion of the current interval
+    SInt64              bestLatency;
+    UInt64              intervalNs;     // start of the current interval
+    UInt64              completions;
+    UInt64              resets;
+    UInt64              wallSteps;      // changes of the wall offset by more than a millisecond
+    double              ppm;            // fitted rate against the nominal one
+    double              jitterNs;       // rms residual of the fit
+} PeakTimebase;
+
+UInt64 PeakRealtimeNs(void);
+
+void PeakTimebaseInit(PeakTimebase* timebase, double nsPerTick);
+// A bulk completion at hostNs (CLOCK_MONOTONIC) whose newest record carries ticks.
+void PeakTimebaseComplete(PeakTimebase* timebase, UInt64 ticks, UInt64 hostNs);
+
+// Device timeline: the ticks on the CLOCK_MONOTONIC scale, never decreasing.
+UInt64 PeakTimebaseMonotonic(PeakTimebase* timebase, UInt64 ticks);
+// Wall clock of a device time, follows steps of CLOCK_REALTIME.
+UInt64 PeakTimebaseWall(const PeakTimebase* timebase, UInt64 monotonicNs);
+
+#endif
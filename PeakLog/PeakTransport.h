@@ -0,0 +1,83 @@
+/*
+    File:           PeakTransport.h
+
+    Description:    USB transport abstraction underneath the PeakInit/PeakStart/PeakStop/PeakSend
+                    entry points, implemented by the IOKit, libusb and loopback backends.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakTransport_h
+#define PeakLog_PeakTransport_h
+
+#include "PeakUSB.h"
+#include "PeakRxQueue.h"
+
+// A backend finds and opens the adapters and moves bytes over their pipes, everything above that (init
+// sequence, decoding, timestamps, queues) lives in PeakDriver.c. run() is called from PeakStart and
+// blocks in the backend's event loop until stop() is called. Every adapter gets a PeakTransport of its
+// own, a copy of the backend's with its own context, and a thread of its own; all completions of an
+// adapter must be reported from its thread, the decoder reads directly from the buffer the backend
+// received into.
+struct PeakTransport {
+    const char* name;
+    IOReturn (*run)(PeakTransport* transport);
+    void     (*stop)(PeakTransport* transport);
+    IOReturn (*ctrlWrite)(PeakTransport* transport, const PCAN_USB_PARAM* param);
+    IOReturn (*ctrlRead)(PeakTransport* transport, const PCAN_USB_PARAM* param, UInt8 reply[16]);
+    IOReturn (*submitRead)(PeakTransport* transport, PeakRxTransfer* transfer);
+    IOReturn (*submitWrite)(PeakTransport* transport, const UInt8* buffer, UInt32 length, void* refCon);
+    void*    context;                   // backend private
+    void*    device;                    // driver private, set by PeakTransportAttached
+};
+
+// available backends
+extern PeakTransport gPeakIOKitTransport;       // OSX only
+extern PeakTransport gPeakLibusbTransport;      // everything else
+extern PeakTransport gPeakLoopbackTransport;
+
+// loopback backend: telegrams in bulk-IN format, the source fills a 64 byte buffer and returns its length,
+// 0 when exhausted
+typedef UInt32 (*PeakLoopbackSourceFunc)(void* refCon, UInt8* telegram);
+
+typedef struct {
+    UInt64  injected;                   // telegrams queued, including echoed ones
+    UInt64  dropped;                    // telegrams lost because the queue was full
+    UInt64  completions;                // reads completed
+    UInt64  writes;
+    UInt64  echoed;                     // frames transmitted and received back
+    UInt64  rejected;                   // echoed frames the acceptance registers did not pass
+} PeakLoopbackStats;
+
+// number of simulated adapters, 1 .. PEAK_MAX_CHANNELS, applies to the next PeakStart
+IOReturn PeakLoopbackSetAdapters(UInt32 count);
+IOReturn PeakLoopbackInject(UInt32 adapter, const UInt8* telegram, UInt32 length);
+// the next read fails with result instead of delivering a telegram
+IOReturn PeakLoopbackInjectError(UInt32 adapter, IOReturn result);
+void PeakLoopbackSetSource(UInt32 adapter, PeakLoopbackSourceFunc source, void* refCon);
+void PeakLoopbackGetStats(UInt32 adapter, PeakLoopbackStats* stats);
+// the last PEAK_LOOPBACK_CTRL_LOG control writes, oldest first, returns how many were copied
+#define PEAK_LOOPBACK_CTRL_LOG      64
+UInt32 PeakLoopbackGetCtrlWrites(UInt32 adapter, PCAN_USB_PARAM* params, UInt32 max);
+
+// called by the backends
+IOReturn PeakTransportAttached(PeakTransport* transport);
+void PeakTransportDetached(PeakTransport* transport);
+void PeakTransportReadComplete(PeakTransport* transport, PeakRxTransfer* transfer, IOReturn result, UInt32 length);
+void PeakTransportWriteComplete(PeakTransport* transport, void* refCon, IOReturn result);
+
+#endif
@@ -0,0 +1,357 @@
+/*
+    File:           PeakTrigger.c
+
+    Description:    Trigger capture: a history of the last frames in memory, and the windows around
+                    matching frames, error status records or missing identifiers picked for the file.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "PeakTrigger.h"
+
+#pragma mark - Setup
+
+void PeakTriggerConfigInit(PeakTriggerConfig* config)
+{
+    bzero(config, sizeof(PeakTriggerConfig));
+    config->historyFrames = PEAK_TRIGGER_DEFAULT_HISTORY;
+    config->preNs = PEAK_TRIGGER_DEFAULT_PRE_NS;
+    config->postNs = PEAK_TRIGGER_DEFAULT_POST_NS;
+    config->errorFrames = 1;
+    config->statusMask = BUS_HEAVY | BUS_OFF;
+}
+
+static void Rearm(PeakTrigger* trigger)
+{
+    UInt32 i;
+    
+    trigger->armed = 1;
+    trigger->windows = 0;
+    
+    // the timeouts count from the next feed on
+    for (i = 0; i < trigger->config.timeoutCount; i++)
+    {
+        trigger->watches[i].lastNs = 0;
+        trigger->watches[i].fired = 0;
+    }
+}
+
+IOReturn PeakTriggerCreate(PeakTrigger* trigger, const PeakTriggerConfig* config)
+{
+    UInt64 capacity = 1;
+    UInt32 i, canid;
+    
+    bzero(trigger, sizeof(PeakTrigger));
+    
+    if (config->historyFrames == 0 || config->timeoutCount > PEAK_TRIGGER_MAX_TIMEOUTS)
+        return kIOReturnBadArgument;
+    if ((config->termCount && config->terms == NULL) || (config->timeoutCount && config->timeouts == NULL))
+        return kIOReturnBadArgument;
+    
+    for (i = 0; i < config->timeoutCount; i++)
+    {
+        canid = config->timeouts[i].canid;
+        if (config->timeouts[i].timeoutNs == 0 || (!(canid & PEAK_TRIGGER_EXT) && canid > 0x7ff) || (canid & ~PEAK_TRIGGER_EXT) > 0x1fffffff)
+            return kIOReturnBadArgument;
+        
+        trigger->watches[i].canid = canid;
+        trigger->watches[i].timeoutNs = config->timeouts[i].timeoutNs;
+        if (canid & PEAK_TRIGGER_EXT)
+            trigger->extWatches++;
+        else
+            trigger->stdWatch[canid] = (UInt8)(i + 1);
+    }
+    
+    if (config->termCount)
+    {
+        trigger->program = PeakFilterCompile(config->terms, config->termCount);
+        if (trigger->program == NULL)
+            return kIOReturnNoMemory;
+    }
+    
+    while (capacity < config->historyFrames)
+        capacity <<= 1;
+    
+    // touched here, so no page is faulted in on the writer thread when the history fills up
+    trigger->history = malloc(capacity * sizeof(CanMsg));
+    if (trigger->history == NULL)
+    {
+        PeakFilterFree(trigger->program);
+        trigger->program = NULL;
+        return kIOReturnNoMemory;
+    }
+    memset(trigger->history, 0, capacity * sizeof(CanMsg));
+    trigger->mask = capacity - 1;
+    
+    // the terms and timeouts live on in the program and the watches
+    trigger->config = *config;
+    trigger->config.terms = NULL;
+    trigger->config.timeouts = NULL;
+    
+    Rearm(trigger);
+    trigger->stats.armed = 1;
+    return kIOReturnSuccess;
+}
+
+void PeakTriggerDestroy(PeakTrigger* trigger)
+{
+    free(trigger->history);
+    PeakFilterFree(trigger->program);
+    bzero(trigger, sizeof(PeakTrigger));
+}
+
+void PeakTriggerArm(PeakTrigger* trigger)
+{
+    __atomic_add_fetch(&trigger->armRequests, 1, __ATOMIC_RELEASE);
+}
+
+#pragma mark - Decoder side
+
+void PeakTriggerNoteStatus(PeakTrigger* trigger, UInt32 channel, UInt64 monoNs, UInt8 function, UInt8 number)
+{
+    UInt32 cause;
+    
+    if (function == 5 && trigger->config.errorFrames)
+        cause = PEAK_TRIGGER_ERROR;
+    else if (function == 1 && (number & trigger->config.statusMask))
+        cause = PEAK_TRIGGER_STATUS;
+    else
+        return;
+    
+    if (channel >= PEAK_MAX_CHANNELS)
+        return;
+    
+    // one record per channel waits for the writer, the oldest, as it opens the window earliest
+    if (__atomic_load_n(&trigger->statusNs[channel], __ATOMIC_RELAXED) != __atomic_load_n(&trigger->statusSeen[channel], __ATOMIC_ACQUIRE))
+        return;
+    
+    trigger->statusCause[channel] = cause;
+    __atomic_store_n(&trigger->statusNs[channel], monoNs ? monoNs : 1, __ATOMIC_RELEASE);
+}
+
+#pragma mark - Writer side
+
+// the first frame at or after atNs in [low, head), the history is in merge order
+static UInt64 Search(const PeakTrigger* trigger, UInt64 low, UInt64 atNs)
+{
+    UInt64 high = trigger->head, middle;
+    
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+        if (trigger->history[middle & trigger->mask].mono < atNs)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+static PeakTriggerWindow* LastWindow(PeakTrigger* trigger)
+{
+    return &trigger->pending[(trigger->pendingFirst + trigger->open - 1) % PEAK_TRIGGER_MAX_PENDING];
+}
+
+static void Push(PeakTrigger* trigger, UInt64 first, UInt64 endNs)
+{
+    trigger->open++;
+    LastWindow(trigger)->first = first;
+    LastWindow(trigger)->endNs = endNs;
+}
+
+static void Pop(PeakTrigger* trigger)
+{
+    trigger->pendingFirst = (trigger->pendingFirst + 1) % PEAK_TRIGGER_MAX_PENDING;
+    trigger->open--;
+}
+
+static void Fire(PeakTrigger* trigger, UInt64 atNs, UInt32 cause)
+{
+    UInt64 oldest, startNs;
+    
+    trigger->stats.causes[cause]++;
+    
+    // overlapping the last window, which grows instead, or continues if it was written up to its end
+    if (trigger->stats.windows > 0 && atNs <= trigger->endNs + trigger->config.preNs)
+    {
+        if (atNs + trigger->config.postNs > trigger->endNs)
+        {
+            trigger->endNs = atNs + trigger->config.postNs;
+            if (trigger->open)
+                LastWindow(trigger)->endNs = trigger->endNs;
+            else
+                Push(trigger, trigger->next, trigger->endNs);
+        }
+        trigger->stats.merged++;
+        trigger->stats.lastNs = atNs;
+        return;
+    }
+    
+    if (!trigger->armed || (trigger->windows > 0 && atNs < trigger->startNs + trigger->config.holdoffNs) ||
+        trigger->open == PEAK_TRIGGER_MAX_PENDING)
+    {
+        trigger->stats.suppressed++;
+        return;
+    }
+    
+    // the windows before end earlier, their frames are not written again
+    startNs = atNs > trigger->config.preNs ? atNs - trigger->config.preNs : 0;
+    oldest = trigger->head > trigger->mask ? trigger->head - trigger->mask - 1 : 0;
+    if (oldest < trigger->next)
+        oldest = trigger->next;
+    
+    trigger->startNs = atNs;
+    trigger->endNs = atNs + trigger->config.postNs;
+    Push(trigger, Search(trigger, oldest, startNs), trigger->endNs);
+    trigger->windows++;
+    trigger->stats.windows++;
+    trigger->stats.lastNs = atNs;
+    
+    if (trigger->config.maxWindows && trigger->windows >= trigger->config.maxWindows)
+        trigger->armed = 0;
+}
+
+static PeakTriggerWatch* Watch(PeakTrigger* trigger, const CanMsg* msg)
+{
+    UInt32 i, canid;
+    
+    if (!msg->ext)
+        return msg->canid.ul < 2048 && trigger->stdWatch[msg->canid.ul] ? &trigger->watches[trigger->stdWatch[msg->canid.ul] - 1] : NULL;
+    
+    if (trigger->extWatches == 0)
+        return NULL;
+    
+    canid = msg->canid.ul | PEAK_TRIGGER_EXT;
+    for (i = 0; i < trigger->config.timeoutCount; i++)
+    {
+        if (trigger->watches[i].canid == canid)
+            return &trigger->watches[i];
+    }
+    return NULL;
+}
+
+void PeakTriggerFeed(PeakTrigger* trigger, const CanMsg* msgs, UInt32 count, UInt64 horizonNs)
+{
+    UInt32 i, requests = __atomic_load_n(&trigger->armRequests, __ATOMIC_ACQUIRE);
+    UInt64 statusNs;
+    PeakTriggerWatch* watch;
+    
+    if (requests != trigger->armSeen)
+    {
+        trigger->armSeen = requests;
+        Rearm(trigger);
+    }
+    
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+    {
+        statusNs = __atomic_load_n(&trigger->statusNs[i], __ATOMIC_ACQUIRE);
+        if (statusNs != trigger->statusSeen[i])
+        {
+            Fire(trigger, statusNs, trigger->statusCause[i]);
+            __atomic_store_n(&trigger->statusSeen[i], statusNs, __ATOMIC_RELEASE);
+        }
+    }
+    
+    for (i = 0; i < count; i++)
+    {
+        const CanMsg* msg = &msgs[i];
+        
+        trigger->history[trigger->head & trigger->mask] = *msg;
+        trigger->head++;
+        
+        if (trigger->program && PeakFilterMatch(trigger->program, msg))
+            Fire(trigger, msg->mono, PEAK_TRIGGER_MATCH);
+        if (msg->err && trigger->config.errorFrames)
+            Fire(trigger, msg->mono, PEAK_TRIGGER_ERROR);
+        
+        if (trigger->config.timeoutCount && (watch = Watch(trigger, msg)) != NULL)
+        {
+            // a gap the horizon has not caught yet
+            if (watch->lastNs && !watch->fired && msg->mono > watch->lastNs + watch->timeoutNs)
+                Fire(trigger, watch->lastNs + watch->timeoutNs, PEAK_TRIGGER_TIMEOUT);
+            watch->lastNs = msg->mono;
+            watch->fired = 0;
+        }
+    }
+    trigger->stats.frames += count;
+    
+    if (horizonNs)
+    {
+        for (i = 0; i < trigger->config.timeoutCount; i++)
+        {
+            watch = &trigger->watches[i];
+            if (watch->lastNs == 0)
+            {
+                watch->lastNs = horizonNs;
+            }
+            else if (!watch->fired && horizonNs > watch->lastNs + watch->timeoutNs)
+            {
+                watch->fired = 1;
+                Fire(trigger, watch->lastNs + watch->timeoutNs, PEAK_TRIGGER_TIMEOUT);
+            }
+        }
+        
+        // a quiet bus brings no frame past the end
+        while (trigger->open && horizonNs > trigger->pending[trigger->pendingFirst].endNs && trigger->next == trigger->head)
+            Pop(trigger);
+    }
+    
+    trigger->stats.armed = trigger->armed;
+    trigger->stats.open = trigger->open != 0;
+}
+
+UInt32 PeakTriggerTake(PeakTrigger* trigger, CanMsg* msgs, UInt32 max)
+{
+    UInt64 oldest = trigger->head > trigger->mask ? trigger->head - trigger->mask - 1 : 0;
+    UInt32 n = 0;
+    
+    while (trigger->open && n < max)
+    {
+        PeakTriggerWindow* window = &trigger->pending[trigger->pendingFirst];
+        
+        if (trigger->next < window->first)
+            trigger->next = window->first;
+        if (trigger->next < oldest)
+        {
+            trigger->stats.lost += oldest - trigger->next;
+            trigger->next = oldest;
+        }
+        
+        while (n < max && trigger->next < trigger->head && trigger->history[trigger->next & trigger->mask].mono <= window->endNs)
+            msgs[n++] = trigger->history[trigger->next++ & trigger->mask];
+        
+        // the window is done once a frame past its end is in
+        if (trigger->next == trigger->head || trigger->history[trigger->next & trigger->mask].mono <= window->endNs)
+            break;
+        Pop(trigger);
+    }
+    
+    trigger->stats.taken += n;
+    trigger->stats.open = trigger->open != 0;
+    return n;
+}
+
+#pragma mark - Statistics
+
+// the counters are single words written by the writer thread only
+void PeakTriggerGetStats(PeakTrigger* trigger, PeakTriggerStats* stats)
+{
+    memcpy(stats, &trigger->stats, sizeof(PeakTriggerStats));
+}
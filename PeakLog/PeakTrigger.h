@@ -0,0 +1,137 @@
+/*
+    File:           PeakTrigger.h
+
+    Description:    Trigger capture: a history of the last frames in memory, and the windows around
+                    matching frames, error status records or missing identifiers picked for the file.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakTrigger_h
+#define PeakLog_PeakTrigger_h
+
+#include "PeakUSB.h"
+#include "PeakFilter.h"
+
+#define PEAK_TRIGGER_DEFAULT_HISTORY    262144          // frames, 10 MB, rounded up to a power of two
+#define PEAK_TRIGGER_DEFAULT_PRE_NS     5000000000ULL
+#define PEAK_TRIGGER_DEFAULT_POST_NS    5000000000ULL
+#define PEAK_TRIGGER_MAX_TIMEOUTS       64
+#define PEAK_TRIGGER_MAX_PENDING        64              // windows opened but not yet handed out
+#define PEAK_TRIGGER_EXT                0x80000000      // or'ed into 29 bit identifiers of timeouts
+
+// causes, index of PeakTriggerStats.causes
+#define PEAK_TRIGGER_MATCH              0               // a frame matching the terms
+#define PEAK_TRIGGER_ERROR              1               // an error frame or error status record
+#define PEAK_TRIGGER_STATUS             2               // a status record with a bit of statusMask
+#define PEAK_TRIGGER_TIMEOUT            3               // an identifier missing for longer than its timeout
+#define PEAK_TRIGGER_CAUSES             4
+
+typedef struct {
+    UInt32  canid;          // | PEAK_TRIGGER_EXT for 29 bit ones
+    UInt64  timeoutNs;      // from the previous frame, or from arming for the first
+} PeakTriggerTimeout;
+
+// A trigger at time t writes the frames from t - preNs to t + postNs. A trigger while a window is
+// open extends it to its own t + postNs, and a window reaching into the previous one continues it, so
+// no frame is written twice. Windows start holdoffNs apart at least, triggers in between are counted as
+// suppressed. After maxWindows windows the trigger disarms until PeakTriggerArm. Typedef'd in PeakUSB.h.
+struct PeakTriggerConfig {
+    UInt32                      historyFrames;
+    UInt64                      preNs;
+    UInt64                      postNs;
+    UInt64                      holdoffNs;
+    UInt32                      maxWindows;         // 0 for no limit
+    const PeakFilterTerm*       terms;              // copied, NULL for none
+    UInt32                      termCount;
+    UInt32                      errorFrames;        // error frames and error status records trigger
+    UInt8                       statusMask;         // BUS_OFF, BUS_HEAVY, ... of status records that trigger
+    const PeakTriggerTimeout*   timeouts;           // copied
+    UInt32                      timeoutCount;
+};
+
+struct PeakTriggerStats {
+    UInt64  windows;        // written or being written
+    UInt64  merged;         // triggers that extended an open window
+    UInt64  suppressed;     // by the holdoff, while disarmed or with PEAK_TRIGGER_MAX_PENDING windows pending
+    UInt64  causes[PEAK_TRIGGER_CAUSES];
+    UInt64  frames;         // through the history
+    UInt64  taken;          // handed out for the file
+    UInt64  lost;           // overwritten in the history before they were handed out
+    UInt64  lastNs;         // mono of the last trigger that opened or extended a window
+    UInt32  armed;
+    UInt32  open;           // a window is being written
+};
+
+typedef struct {
+    UInt32  canid;          // with PEAK_TRIGGER_EXT
+    UInt64  timeoutNs;
+    UInt64  lastNs;
+    UInt32  fired;          // until the identifier shows up again
+} PeakTriggerWatch;
+
+// a window still to be handed out, one feed may open several
+typedef struct {
+    UInt64  first;          // history index of its first frame
+    UInt64  endNs;
+} PeakTriggerWindow;
+
+// Runs on the capture's writer thread: PeakTriggerFeed takes the merged frames into the history and
+// checks them, PeakTriggerTake hands out the frames of the windows in order. The decoders only report
+// status records, through PeakTriggerNoteStatus.
+typedef struct PeakTrigger {
+    PeakTriggerConfig   config;
+    CanMsg*             history;
+    UInt64              mask;
+    UInt64              head;               // frames fed
+    UInt64              next;               // next frame to hand out
+    UInt64              endNs;              // of the last window
+    UInt64              startNs;            // of the last window
+    PeakTriggerWindow   pending[PEAK_TRIGGER_MAX_PENDING];
+    UInt32              pendingFirst;       // the one being handed out
+    UInt64              windows;            // since arming
+    UInt32              armed;
+    UInt32              armRequests;        // bumped by PeakTriggerArm
+    UInt32              armSeen;
+    UInt32              open;               // pending windows
+    PeakFilterProgram*  program;
+    PeakTriggerWatch    watches[PEAK_TRIGGER_MAX_TIMEOUTS];
+    UInt8               stdWatch[2048];     // index + 1 into watches for 11 bit identifiers
+    UInt32              extWatches;         // any 29 bit ones
+    UInt64              statusNs[PEAK_MAX_CHANNELS];    // the oldest record not yet seen, written by the decoders
+    UInt32              statusCause[PEAK_MAX_CHANNELS];
+    UInt64              statusSeen[PEAK_MAX_CHANNELS];  // written by the writer
+    PeakTriggerStats    stats;
+} PeakTrigger;
+
+void PeakTriggerConfigInit(PeakTriggerConfig* config);
+
+IOReturn PeakTriggerCreate(PeakTrigger* trigger, const PeakTriggerConfig* config);
+void PeakTriggerDestroy(PeakTrigger* trigger);
+// any thread; the next trigger opens a window again
+void PeakTriggerArm(PeakTrigger* trigger);
+
+// decoder side, a status record of PCAN function 1 or 5 with its number bits
+void PeakTriggerNoteStatus(PeakTrigger* trigger, UInt32 channel, UInt64 monoNs, UInt8 function, UInt8 number);
+
+// writer side; horizonNs is the time up to which all frames have been fed, for the timeouts, 0 if unknown
+void PeakTriggerFeed(PeakTrigger* trigger, const CanMsg* msgs, UInt32 count, UInt64 horizonNs);
+UInt32 PeakTriggerTake(PeakTrigger* trigger, CanMsg* msgs, UInt32 max);
+
+void PeakTriggerGetStats(PeakTrigger* trigger, PeakTriggerStats* stats);
+
+#endif
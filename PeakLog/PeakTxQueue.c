@@ -0,0 +1,275 @@
+/*
+    File:           PeakTxQueue.c
+
+    Description:    Bounded transmit queue packing as many frames as fit into each 64 byte bulk-OUT
+                    telegram, with several telegrams in flight.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "PeakTxQueue.h"
+
+#pragma mark - Encoding
+
+// the length field has four bits, the adapter sends no more than eight bytes whatever it says
+static UInt32 DataLength(const CanMsg* msg)
+{
+    return msg->len > 8 ? 8 : msg->len;
+}
+
+static UInt32 RecordSize(const CanMsg* msg)
+{
+    return 1 + (msg->ext ? 4 : 2) + (msg->rtr ? 0 : DataLength(msg));
+}
+
+static UInt8* EncodeRecord(UInt8* ucMsgPtr, const CanMsg* msg)
+{
+    UInt32 i, len = DataLength(msg);
+    CanId tc;
+    tc.ul = msg->canid.ul;
+    
+    UInt8* pucStatusLen = ucMsgPtr++;
+    *pucStatusLen = (UInt8)len;
+    
+    if (msg->rtr)
+        *pucStatusLen |= STLN_RTR; // add RTR flag
+    
+    if (msg->ext)
+    {
+        *pucStatusLen |= STLN_EXTENDED_ID;
+        tc.ul <<= 3;
+        *ucMsgPtr++ = tc.uc[0];
+        *ucMsgPtr++ = tc.uc[1];
+        *ucMsgPtr++ = tc.uc[2];
+        *ucMsgPtr++ = tc.uc[3];
+    }
+    else
+    {
+        tc.ul <<= 5;
+        *ucMsgPtr++ = tc.uc[0];
+        *ucMsgPtr++ = tc.uc[1];
+    }
+    
+    if (!msg->rtr)
+    {
+        for(i = 0; i < len; i++)
+            *ucMsgPtr++ = msg->data[i];
+    }
+    
+    return ucMsgPtr;
+}
+
+// Layout as in the linux driver: magic 2, record count, the records and the telegram counter in the
+// last byte of the buffer. The adapter takes at most 255 records, far more than fit anyway.
+UInt32 PeakTxEncode(const CanMsg* msgs, UInt32 count, UInt8 telegram[PEAK_TX_BUFFER_SIZE], UInt8 telegramCount)
+{
+    UInt8* ucMsgPtr = telegram + 2;
+    UInt8* ucEndPtr = telegram + PEAK_TX_BUFFER_SIZE - 1;
+    UInt32 packed = 0;
+    
+    bzero(telegram, PEAK_TX_BUFFER_SIZE);
+    
+    while (packed < count && ucMsgPtr + RecordSize(&msgs[packed]) <= ucEndPtr)
+        ucMsgPtr = EncodeRecord(ucMsgPtr, &msgs[packed++]);
+    
+    telegram[0] = 2; // starts with a magic value
+    telegram[1] = (UInt8)packed;
+    telegram[PEAK_TX_BUFFER_SIZE - 1] = telegramCount;
+    return packed;
+}
+
+#pragma mark - Setup
+
+IOReturn PeakTxQueueCreate(PeakTxQueue* queue, UInt32 depth)
+{
+    if (depth == 0 || depth > PEAK_TX_MAX_DEPTH)
+        return kIOReturnBadArgument;
+    
+    bzero(queue, sizeof(PeakTxQueue));
+    queue->depth = depth;
+    
+    if (pthread_mutex_init(&queue->lock, NULL) != 0)
+        return kIOReturnNoResources;
+    
+    if (pthread_cond_init(&queue->space, NULL) != 0)
+    {
+        pthread_mutex_destroy(&queue->lock);
+        return kIOReturnNoResources;
+    }
+    
+    return kIOReturnSuccess;
+}
+
+void PeakTxQueueAttach(PeakTxQueue* queue, PeakTxSubmitFunc submit, void* refCon)
+{
+    UInt32 i;
+    
+    pthread_mutex_lock(&queue->lock);
+    queue->submit = submit;
+    queue->refCon = refCon;
+    queue->head = queue->tail = 0;
+    queue->inFlight = 0;
+    for (i = 0; i < PEAK_TX_MAX_DEPTH; i++)
+        queue->telegrams[i].busy = 0;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void PeakTxQueueDetach(PeakTxQueue* queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->submit = NULL;
+    queue->head = queue->tail = 0;
+    // wake up blocked senders, they find no device
+    pthread_cond_broadcast(&queue->space);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+#pragma mark - Transmit
+
+// Packs queued frames into free telegrams and submits them, called with the lock held. Submitting under
+// the lock keeps the telegrams on the wire in the order of the frames.
+static void Pump(PeakTxQueue* queue)
+{
+    CanMsg pending[PEAK_TX_BUFFER_SIZE / 3]; // the smallest record is three bytes
+    UInt32 i, n, packed;
+    IOReturn kr;
+    
+    while (queue->submit != NULL && queue->head != queue->tail && queue->inFlight < queue->depth)
+    {
+        PeakTxTelegram* telegram = NULL;
+        for (i = 0; i < queue->depth; i++)
+        {
+            if (!queue->telegrams[i].busy)
+            {
+                telegram = &queue->telegrams[i];
+                break;
+            }
+        }
+        if (telegram == NULL)
+            break;
+        
+        // the frames may wrap around the end of the queue
+        n = queue->head - queue->tail;
+        if (n > sizeof(pending) / sizeof(CanMsg))
+            n = sizeof(pending) / sizeof(CanMsg);
+        for (i = 0; i < n; i++)
+            pending[i] = queue->frames[(queue->tail + i) & (PEAK_TX_QUEUE_FRAMES - 1)];
+        
+        if (queue->telegramCount++ > 200) queue->telegramCount = 1;
+        packed = PeakTxEncode(pending, n, telegram->buffer, queue->telegramCount);
+        
+        telegram->busy = 1;
+        queue->inFlight++;
+        queue->tail += packed;
+        
+        kr = queue->submit(queue->refCon, telegram->buffer, PEAK_TX_BUFFER_SIZE, telegram);
+        if (kr != kIOReturnSuccess)
+        {
+            // the frames are lost, like a failed write of the single frame before
+            printf("Unable to submit bulk write (%08x)\n", kr);
+            telegram->busy = 0;
+            queue->inFlight--;
+            queue->errors++;
+        }
+        else
+        {
+            queue->frameCount += packed;
+            queue->telegramsSent++;
+        }
+        
+        pthread_cond_broadcast(&queue->space);
+    }
+}
+
+IOReturn PeakTxQueueSend(PeakTxQueue* queue, const CanMsg* msgs, UInt32 count, int wait, UInt32* queued)
+{
+    IOReturn kr = kIOReturnSuccess;
+    UInt32 done = 0;
+    
+    pthread_mutex_lock(&queue->lock);
+    
+    while (done < count)
+    {
+        if (queue->submit == NULL)
+        {
+            kr = kIOReturnNoDevice;
+            break;
+        }
+        
+        if (queue->head - queue->tail == PEAK_TX_QUEUE_FRAMES)
+        {
+            if (!wait)
+            {
+                queue->rejected++;
+                kr = kIOReturnNoSpace;
+                break;
+            }
+            queue->blocked++;
+            pthread_cond_wait(&queue->space, &queue->lock);
+            continue;
+        }
+        
+        while (done < count && queue->head - queue->tail < PEAK_TX_QUEUE_FRAMES)
+            queue->frames[queue->head++ & (PEAK_TX_QUEUE_FRAMES - 1)] = msgs[done++];
+        
+        Pump(queue);
+    }
+    
+    pthread_mutex_unlock(&queue->lock);
+    
+    if (queued)
+        *queued = done;
+    
+    return kr;
+}
+
+void PeakTxQueueComplete(PeakTxQueue* queue, void* context, IOReturn result)
+{
+    PeakTxTelegram* telegram = context;
+    
+    pthread_mutex_lock(&queue->lock);
+    
+    if (result != kIOReturnSuccess)
+        queue->errors++;
+    
+    if (telegram != NULL && telegram->busy)
+    {
+        telegram->busy = 0;
+        queue->inFlight--;
+    }
+    
+    Pump(queue);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+#pragma mark - Statistics
+
+void PeakTxQueueGetStats(PeakTxQueue* queue, PeakTxQueueStats* stats)
+{
+    pthread_mutex_lock(&queue->lock);
+    stats->queued    = queue->head - queue->tail;
+    stats->inFlight  = queue->inFlight;
+    stats->frames    = queue->frameCount;
+    stats->telegrams = queue->telegramsSent;
+    stats->blocked   = queue->blocked;
+    stats->rejected  = queue->rejected;
+    stats->errors    = queue->errors;
+    pthread_mutex_unlock(&queue->lock);
+}
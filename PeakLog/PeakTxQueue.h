@@ -0,0 +1,87 @@
+/*
+    File:           PeakTxQueue.h
+
+    Description:    Bounded transmit queue packing as many frames as fit into each 64 byte bulk-OUT
+                    telegram, with several telegrams in flight.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakTxQueue_h
+#define PeakLog_PeakTxQueue_h
+
+#include <pthread.h>
+
+#include "PeakUSB.h"
+
+#define PEAK_TX_BUFFER_SIZE     64      // size of a bulk-OUT telegram
+#define PEAK_TX_DEFAULT_DEPTH   4       // telegrams in flight
+#define PEAK_TX_MAX_DEPTH       16
+#define PEAK_TX_QUEUE_FRAMES    1024    // frames waiting to be packed, must be a power of two
+
+typedef IOReturn (*PeakTxSubmitFunc)(void* refCon, const UInt8* buffer, UInt32 length, void* context);
+
+typedef struct {
+    UInt8   buffer[PEAK_TX_BUFFER_SIZE];
+    UInt32  busy;
+} PeakTxTelegram;
+
+// Frames are queued by any thread and packed into telegrams whenever a telegram buffer is free, i.e.
+// right away if fewer than depth writes are in flight and from the write completion otherwise. A
+// telegram buffer is not reused before its write completed.
+typedef struct {
+    pthread_mutex_t     lock;
+    pthread_cond_t      space;          // signalled when frames leave the queue
+    CanMsg              frames[PEAK_TX_QUEUE_FRAMES];
+    UInt32              head, tail;
+    PeakTxTelegram      telegrams[PEAK_TX_MAX_DEPTH];
+    UInt32              depth;
+    UInt32              inFlight;
+    UInt8               telegramCount;
+    PeakTxSubmitFunc    submit;         // NULL while no device is attached
+    void*               refCon;
+    UInt64              frameCount;     // frames written
+    UInt64              telegramsSent;
+    UInt64              blocked;        // callers that had to wait for space
+    UInt64              rejected;       // calls that found the queue full and did not wait
+    UInt64              errors;
+} PeakTxQueue;
+
+typedef struct {
+    UInt32  queued;
+    UInt32  inFlight;
+    UInt64  frames;
+    UInt64  telegrams;
+    UInt64  blocked;
+    UInt64  rejected;
+    UInt64  errors;
+} PeakTxQueueStats;
+
+// Packs frames from msgs into one telegram, returns the number of frames consumed.
+UInt32 PeakTxEncode(const CanMsg* msgs, UInt32 count, UInt8 telegram[PEAK_TX_BUFFER_SIZE], UInt8 telegramCount);
+
+IOReturn PeakTxQueueCreate(PeakTxQueue* queue, UInt32 depth);
+void PeakTxQueueAttach(PeakTxQueue* queue, PeakTxSubmitFunc submit, void* refCon);
+void PeakTxQueueDetach(PeakTxQueue* queue);
+
+// Queues count frames. If the queue is full it either waits for space or returns kIOReturnNoSpace with
+// *queued telling how many frames made it in.
+IOReturn PeakTxQueueSend(PeakTxQueue* queue, const CanMsg* msgs, UInt32 count, int wait, UInt32* queued);
+void PeakTxQueueComplete(PeakTxQueue* queue, void* context, IOReturn result);
+void PeakTxQueueGetStats(PeakTxQueue* queue, PeakTxQueueStats* stats);
+
+#endif
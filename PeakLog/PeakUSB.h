@@ -24,13 +24,43 @@
 #ifndef PeakLog_PeakUSB_h
 #define PeakLog_PeakUSB_h
 
+#ifdef __APPLE__
 #include <CoreFoundation/CoreFoundation.h>
+#else
+// the frame and protocol definitions are shared with code that builds without the OSX frameworks
+#include <stdint.h>
+typedef uint8_t  UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+typedef int8_t   SInt8;
+typedef int16_t  SInt16;
+typedef int32_t  SInt32;
+typedef int64_t  SInt64;
+typedef int      IOReturn;
+#define kIOReturnSuccess        0
+#define kIOReturnError          ((IOReturn)0xe00002bc)
+#define kIOReturnNoMemory       ((IOReturn)0xe00002bd)
+#define kIOReturnNoResources    ((IOReturn)0xe00002be)
+#define kIOReturnNoDevice       ((IOReturn)0xe00002c0)
+#define kIOReturnBadArgument    ((IOReturn)0xe00002c2)
+#define kIOReturnUnsupported    ((IOReturn)0xe00002c7)
+#define kIOReturnIOError        ((IOReturn)0xe00002ca)
+#define kIOReturnNotOpen        ((IOReturn)0xe00002cd)
+#define kIOReturnBusy           ((IOReturn)0xe00002d5)
+#define kIOReturnTimeout        ((IOReturn)0xe00002d6)
+#define kIOReturnNoSpace        ((IOReturn)0xe00002db)
+#define kIOReturnAborted        ((IOReturn)0xe00002eb)
+#endif
 #include <sys/time.h>
 
 // peak vendor and device id
 #define kPeakVendorID		0x0c72
 #define kPeakProductID		0x000c
 
+// adapters used at the same time, each one is a channel
+#define PEAK_MAX_CHANNELS   8
+
 // enumeration of the four usb pipes
 #define kPeakUsbCtrlOutputPipe  1
 #define kPeakUsbCtrlInputPipe   2
@@ -95,12 +125,15 @@ typedef union {
 
 typedef struct {
     CanId canid; // 11 Bit/29 Bit
-    struct timeval ts;
+    UInt32 delay; // ns from mono to the USB completion that brought the frame, for the latency statistics
+    UInt64 ts;   // ns since 1970, the adapter time on the corrected wall clock
+    UInt64 mono; // ns, the adapter time on the CLOCK_MONOTONIC scale, never decreasing
     UInt8 ext:1; // CAN2.0B message if 1
     UInt8 rtr:1; // RTR frame if 1
     UInt8 err:1; // Error frame if 1
     UInt8 loc:1; // Origin of frame: 0 = CAN-Bus, 1 = PeakLog
     UInt8 len:4; // Length of data (0-8 bytes)
+    UInt8 channel; // Adapter the frame was received on or is sent to, 0 .. PEAK_MAX_CHANNELS - 1
     union {
         UInt8 data[8];
         UInt16 sdata[4];
@@ -122,7 +155,7 @@ typedef struct
 {
 	UInt64  ullCumulatedTicks;         // sum of all ticks
 	UInt64  ullOldCumulatedTicks;      // old ...
-	struct timeval StartTime;          // time of first receive
+	UInt8   ucStarted;                 // set at the first receive
 	UInt16  wStartTicks;               // ticks at first init
 	UInt16  wLastTickValue;            // Last aquired tick count
 	UInt16  wOldLastTickValue;         // old ...
@@ -140,9 +173,190 @@ static const PCAN_USB_PARAM PCAN_CTRL_READ_QUARTZ = { 2, 1, { 0, 0, 0, 0, 0, 0,
 static const PCAN_USB_PARAM PCAN_CTRL_READ_DEVICENO = { 4, 1, { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } };
 static const PCAN_USB_PARAM PCAN_CTRL_READ_SNR = { 6, 1, { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } };
 
+// Notifications posted by the driver: "CanMsg" (object is the PeakBatcher to drain), "CanStatus" (object
+// is the status record, only valid during the call), "CanDevice" (frames/sec, NULL if the device is gone)
+// and "CanStats" (the PeakInstrumentStats of the last second, only valid during the call).
+// On OSX they also go to the local CFNotificationCenter.
+typedef void (*PeakObserverFunc)(void* refCon, const char* name, const void* object);
+
+typedef struct PeakTransport PeakTransport;
+typedef struct PeakFilterTerm PeakFilterTerm;
+typedef struct PeakStreamConfig PeakStreamConfig;
+typedef struct PeakStreamStats PeakStreamStats;
+typedef struct PeakTriggerConfig PeakTriggerConfig;
+typedef struct PeakTriggerStats PeakTriggerStats;
+
+typedef struct {
+    UInt32  queued;         // frames waiting for a telegram
+    UInt32  inFlight;       // telegrams submitted and not yet completed
+    UInt64  frames;         // frames written
+    UInt64  telegrams;      // bulk writes
+    UInt64  rejected;       // sends refused with kIOReturnNoSpace
+    UInt64  errors;
+} PeakTxStats;
+
+typedef struct {
+    UInt64  telegrams;      // bulk reads decoded
+    UInt64  frames;
+    UInt64  statusRecords;
+    UInt64  filtered;       // frames the filter program dropped
+    UInt32  overflows;      // frames lost because the receive ring was full
+    UInt32  highWater;      // most frames waiting in the receive ring
+    UInt64  malformed;      // bulk reads dropped because their records did not fit the length
+    UInt64  stalls;         // times no bulk read could be re-armed, reception stopped then
+    UInt64  readErrors;     // bulk reads that failed and were re-armed
+} PeakRxStats;
+
+typedef struct {
+    UInt64  frames;         // frames received while an identifier set is programmed
+    UInt64  dropped;        // of those, passed by the adapter but not in the set
+    double  falsePositives; // dropped / frames
+    UInt64  stdPassed;      // identifiers the registers let through
+    UInt64  extPassed;
+    UInt32  wanted;         // identifiers in the set
+    UInt8   single;         // single or dual filter mode
+} PeakAcceptanceStats;
+
+typedef struct {
+    UInt64  completions;    // bulk completions seen by the fit
+    UInt64  resets;         // restarts of the fit after the tick counter jumped
+    UInt64  wallSteps;      // steps of the wall clock over a millisecond
+    double  ppm;            // host ns per adapter tick against the data sheet
+    double  jitterNs;       // rms residual of the fit
+    SInt64  wallOffsetNs;   // CLOCK_REALTIME - CLOCK_MONOTONIC
+} PeakClockStats;
+
+typedef struct {
+    UInt64  frames;         // frames handed out in time order
+    UInt64  windowed;       // of those, released by the window while another adapter was quiet
+    UInt64  late;           // handed out after a younger frame, their adapter lagged behind by more than the window
+    UInt64  maxLateNs;      // how far the worst of them was out of order
+} PeakMergeStats;
+
+typedef struct {
+    UInt32  canid;
+    UInt8   ext;
+    UInt8   len;            // of the last frame
+    UInt64  frames;
+    double  rate;           // frames/s over the last periods, falling while the identifier is quiet
+    UInt64  minPeriodNs;    // time between two frames
+    UInt64  maxPeriodNs;
+    double  meanPeriodNs;
+    double  jitterNs;       // standard deviation of the period
+} PeakIdStats;
+
+typedef struct {
+    UInt32  bitsPerSecond;  // of the configured CAN_BAUD_ code
+    UInt32  ids;            // identifiers seen
+    UInt64  untracked;      // frames of 29 bit identifiers beyond the table, counted in the load only
+    UInt64  frames;
+    UInt64  bits;           // on the wire, with worst case bit stuffing and the interframe space
+    double  load;           // percent of the bitrate over the last one to two seconds
+} PeakBusLoad;
+
+typedef struct {
+    UInt64  count;
+    UInt64  minNs;
+    UInt64  p50Ns;
+    UInt64  p90Ns;
+    UInt64  p99Ns;
+    UInt64  p999Ns;
+    UInt64  maxNs;
+    double  meanNs;
+} PeakLatencyStats;
+
+// Where the time of the receive path goes, see PeakGetInstrumentation. The latencies follow a frame from
+// the adapter timestamp through the stages; every stage but decode is measured from the USB completion.
+typedef struct {
+    UInt64              sinceNs;        // PeakMonotonicNs at the start of the interval
+    UInt64              untilNs;        // and at its end
+    PeakLatencyStats    usb;            // adapter timestamp to USB completion, per frame
+    PeakLatencyStats    decode;         // USB completion to decode done, per telegram
+    PeakLatencyStats    dequeue;        // USB completion to the consumer draining the frame, per frame
+    PeakLatencyStats    display;        // USB completion to PeakNoteDisplayed, per frame
+    PeakLatencyStats    capture;        // USB completion to the capture write, per block, its oldest frame
+    UInt64              frames;         // received
+    UInt64              telegrams;
+    UInt64              decodeNs;       // time spent decoding
+    UInt32              ringFill;       // frames waiting for the consumer, all channels
+    UInt32              ringHighWater;  // most frames waiting in one channel's ring
+    UInt32              captureFill;    // frames waiting for the capture writer
+    UInt32              readsInFlight;
+    UInt32              writesInFlight;
+    UInt32              channels;
+    UInt64              adapterOverruns;    // overrun status records of the adapters' queues
+    UInt64              filtered;       // frames dropped by the filter program or the exact acceptance set
+    UInt64              ringDropped;    // frames lost because a receive ring was full
+    UInt64              captureDropped; // frames lost because the capture writer fell behind
+    UInt64              late;           // frames the merge passed on out of order
+} PeakInstrumentStats;
+
+#define PEAK_STATS_TEXT             0
+#define PEAK_STATS_JSON             1
+
+// Every adapter found is a channel of its own, 0 .. PEAK_MAX_CHANNELS - 1, tagged on the frames it
+// receives; frames are sent on the channel they are tagged with. PeakInit applies to all adapters and to
+// those found later.
 IOReturn PeakInit(UInt16 bitrate);
+IOReturn PeakInitChannel(UInt32 channel, UInt16 bitrate);
+UInt32 PeakChannelCount(void);
 IOReturn PeakStart(void);
 IOReturn PeakStop(void);
 IOReturn PeakSend(CanMsg* msg);
+// Queues count frames packed into as few telegrams as possible. With wait set the call blocks while the
+// transmit queue is full, otherwise it returns kIOReturnNoSpace and *queued tells how many were taken.
+IOReturn PeakSendBatch(const CanMsg* msgs, UInt32 count, int wait, UInt32* queued);
+IOReturn PeakGetTxStats(PeakTxStats* stats);
+// the sum of all adapters, or of one
+IOReturn PeakGetRxStats(PeakRxStats* stats);
+IOReturn PeakGetChannelRxStats(UInt32 channel, PeakRxStats* stats);
+// How the adapter clock is mapped onto the host clocks, see PeakTimebase.h.
+IOReturn PeakGetClockStats(UInt32 channel, PeakClockStats* stats);
+// The adapters' frames are merged in time order, a frame waits at most windowNs for the other adapters
+// (see PeakMerge.h). Frames arriving later than that are passed on out of order and counted as late.
+IOReturn PeakSetMergeWindow(UInt64 windowNs);
+IOReturn PeakGetMergeStats(PeakMergeStats* stats);
+// Per identifier statistics and bus load of a channel since its adapter was attached (see
+// PeakBusStats.h). PeakGetIdStats fills up to max entries in the order the identifiers first appeared and
+// returns how many there are.
+IOReturn PeakGetBusLoad(UInt32 channel, PeakBusLoad* load);
+UInt32 PeakGetIdStats(UInt32 channel, PeakIdStats* stats, UInt32 max);
+// Counters and latencies since PeakStart. Once a second the driver also posts "CanStats" with those of
+// the last second. The consumer reports frames it has shown with PeakNoteDisplayed, from its own thread.
+IOReturn PeakGetInstrumentation(PeakInstrumentStats* stats);
+void PeakNoteDisplayed(const CanMsg* msgs, UInt32 count);
+// Formats stats as PEAK_STATS_TEXT or _JSON into buffer, returns the length the whole text needs.
+UInt32 PeakFormatInstrumentation(const PeakInstrumentStats* stats, UInt32 format, char* buffer, UInt32 size);
+// Records every received frame to a capture file (see PeakCapture.h) until PeakStopCapture, or to a
+// compressed archive if the path ends in .peakarc (see PeakArchive.h).
+IOReturn PeakStartCapture(const char* path);
+// The same, but only the windows around the triggers of config go to the file (see PeakTrigger.h). The
+// last frames are kept in memory for the part before a trigger, the decoders never wait for the file.
+IOReturn PeakStartTriggerCapture(const char* path, const PeakTriggerConfig* config);
+IOReturn PeakArmTrigger(void);
+IOReturn PeakGetTriggerStats(PeakTriggerStats* stats);
+IOReturn PeakStopCapture(void);
+// Publishes the received frames of each adapter, before the display filter, to a shared-memory ring named
+// prefix.channel (see PeakLive.h) that other processes read, until PeakStopSharing.
+IOReturn PeakStartSharing(const char* prefix, UInt32 capacity);
+IOReturn PeakStopSharing(void);
+// Streams the received frames, before the display filter, to the clients of a UNIX socket at path as
+// SocketCAN can_frame records (see PeakStream.h); config holds the defaults for the clients, NULL for
+// PeakStreamConfigInit's. A slow client loses frames as it chose, the receive path never waits for it.
+IOReturn PeakStartStreaming(const char* path, const PeakStreamConfig* config);
+IOReturn PeakStopStreaming(void);
+IOReturn PeakGetStreamStats(PeakStreamStats* stats);
+// Frames are passed on if any term matches (see PeakFilter.h), NULL passes everything. The new filter
+// applies from the next received buffer on; PeakFilterFrame checks a frame against it.
+IOReturn PeakSetFilter(const PeakFilterTerm* terms, UInt32 count);
+int PeakFilterFrame(const CanMsg* msg);
+// Programs the SJA1000 acceptance filter to pass the identifiers in ids (29 bit ones or'ed with
+// PEAK_ACCEPTANCE_EXT, mode PEAK_ACCEPTANCE_SINGLE, _DUAL or _BEST, see PeakAcceptance.h). Frames the
+// coarse hardware filter lets through anyway are dropped on the host, before capture. NULL passes everything.
+IOReturn PeakSetAcceptance(const UInt32* ids, UInt32 count, UInt32 mode);
+IOReturn PeakGetAcceptanceStats(PeakAcceptanceStats* stats);
+IOReturn PeakSetReadDepth(UInt32 depth);
+IOReturn PeakSetTransport(PeakTransport* transport);
+void PeakSetObserver(PeakObserverFunc observer, void* refCon);
 
 #endif
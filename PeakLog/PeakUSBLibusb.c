@@ -0,0 +1,517 @@
+/*
+    File:           PeakUSBLibusb.c
+
+    Description:    libusb-1.0 transport of the user-space driver for PEAK PCAN-USB CAN to USB Adapters,
+                    used where IOKit is not available. Bulk reads are pre-submitted asynchronous
+                    transfers completed on the thread running PeakStart.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __APPLE__
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <libusb.h>
+
+#include "PeakUSB.h"
+#include "PeakTransport.h"
+
+// endpoints behind the four IOKit pipe refs
+#define kPeakEpCtrlOut          0x01    // kPeakUsbCtrlInputPipe
+#define kPeakEpCtrlIn           0x81    // kPeakUsbCtrlOutputPipe
+#define kPeakEpBulkIn           0x82    // kPeakUsbBulkReadPipe
+#define kPeakEpBulkOut          0x02    // kPeakUsbBulkWritePipe
+
+#define PEAK_LIBUSB_TIMEOUT     1000    // ms, synchronous ctrl transfers
+#define PEAK_LIBUSB_WRITES      16      // bulk writes in flight
+
+#pragma mark Globals
+
+typedef struct LibusbDevice LibusbDevice;
+
+typedef struct {
+    struct libusb_transfer* transfer;
+    PeakRxTransfer*         owner;
+    LibusbDevice*           device;
+} LibusbRead;
+
+typedef struct {
+    struct libusb_transfer* transfer;
+    void*                   refCon;
+    LibusbDevice*           device;
+    int                     busy;       // submitted, under the device lock
+} LibusbWrite;
+
+// Every adapter has a libusb context and an event thread of its own, so the completions of one adapter
+// never wait for another one's decoder. Reads are submitted from the event thread only, writes from any
+// thread calling PeakSend; the lock guards the write slots, the pending count and the handle against
+// the close.
+struct LibusbDevice {
+    PeakTransport           transport;  // a copy of gPeakLibusbTransport pointing back here
+    pthread_t               thread;
+    int                     used;       // the slot has a thread, which clears done when it is over
+    volatile int            done;
+    UInt8                   bus;
+    UInt8                   address;
+    libusb_context*         context;
+    libusb_device_handle*   handle;
+    int                     lost;       // device vanished, close from the event loop
+    pthread_mutex_t         lock;
+    int                     closing;    // no more submits, the completions are only counted
+    int                     pending;    // transfers submitted and not completed
+    LibusbRead              reads[PEAK_RX_MAX_DEPTH + 1];
+    int                     readCount;
+    LibusbWrite             writes[PEAK_LIBUSB_WRITES];
+};
+
+static volatile int                 gRunning = 0;
+static LibusbDevice                 gDevices[PEAK_MAX_CHANNELS];
+
+static IOReturn ErrorFromLibusb(int err)
+{
+    switch (err) {
+        case LIBUSB_SUCCESS:            return kIOReturnSuccess;
+        case LIBUSB_ERROR_NO_DEVICE:    return kIOReturnNoDevice;
+        case LIBUSB_ERROR_TIMEOUT:      return kIOReturnTimeout;
+        case LIBUSB_ERROR_BUSY:         return kIOReturnBusy;
+        case LIBUSB_ERROR_NO_MEM:       return kIOReturnNoMemory;
+        case LIBUSB_ERROR_INVALID_PARAM: return kIOReturnBadArgument;
+        case LIBUSB_ERROR_IO:           return kIOReturnIOError;
+        default:                        return kIOReturnError;
+    }
+}
+
+static IOReturn ErrorFromStatus(enum libusb_transfer_status status)
+{
+    switch (status) {
+        case LIBUSB_TRANSFER_COMPLETED: return kIOReturnSuccess;
+        case LIBUSB_TRANSFER_TIMED_OUT: return kIOReturnTimeout;
+        case LIBUSB_TRANSFER_CANCELLED: return kIOReturnAborted;
+        case LIBUSB_TRANSFER_NO_DEVICE: return kIOReturnNoDevice;
+        default:                        return kIOReturnIOError;
+    }
+}
+
+#pragma mark - Synchronous ctrl I/O functions
+
+static IOReturn WriteToCtrlPipe(PeakTransport *transport, const PCAN_USB_PARAM *param)
+{
+    LibusbDevice *device = transport->context;
+    int transferred;
+    
+    if (device->handle == NULL)
+        return kIOReturnNoDevice;
+    
+    return ErrorFromLibusb(libusb_bulk_transfer(device->handle, kPeakEpCtrlOut, (unsigned char*)param, sizeof(PCAN_USB_PARAM), &transferred, PEAK_LIBUSB_TIMEOUT));
+}
+
+static IOReturn ReadFromCtrlPipe(PeakTransport *transport, const PCAN_USB_PARAM *param, UInt8 buffer[16])
+{
+    LibusbDevice *device = transport->context;
+    int i, numBytesRead = 0;
+    IOReturn kr = WriteToCtrlPipe(transport, param);
+    
+    if (kr == kIOReturnSuccess)
+    {
+        usleep(5);
+        
+        kr = ErrorFromLibusb(libusb_bulk_transfer(device->handle, kPeakEpCtrlIn, buffer, 16, &numBytesRead, PEAK_LIBUSB_TIMEOUT));
+        if (kr == kIOReturnSuccess)
+        {
+            for (i = 0; i < 16; i++)
+                printf("%02X ", buffer[i]);
+            printf(" (%ld)\n", (long)numBytesRead);
+        } else {
+            printf("Unable to perform ctrl read (%08x)\n", kr);
+        }
+    }
+    
+    return kr;
+}
+
+#pragma mark - Asynchronous bulk I/O functions
+
+static void LIBUSB_CALL BulkReadCompletion(struct libusb_transfer *transfer)
+{
+    LibusbRead *read = (LibusbRead *) transfer->user_data;
+    LibusbDevice *device = read->device;
+    IOReturn result = ErrorFromStatus(transfer->status);
+    int closing;
+    
+    pthread_mutex_lock(&device->lock);
+    device->pending--;
+    closing = device->closing;
+    pthread_mutex_unlock(&device->lock);
+    
+    // a halted endpoint fails every read again, close it as the IOKit backend does
+    if (result == kIOReturnNoDevice || transfer->status == LIBUSB_TRANSFER_STALL)
+        device->lost = 1;
+    
+    // a read completing while the device closes, cancelled or not, is not re-armed and nobody waits for it
+    if (!closing && result != kIOReturnAborted)
+        PeakTransportReadComplete(&device->transport, read->owner, result, (UInt32)transfer->actual_length);
+}
+
+static IOReturn ReadFromBulkPipe(PeakTransport *transport, PeakRxTransfer *rx)
+{
+    LibusbDevice *device = transport->context;
+    LibusbRead *read = (LibusbRead *) rx->userData;
+    int err;
+    
+    // the event thread is the only one to close, the handle cannot go away under us
+    if (device->handle == NULL || device->closing)
+        return kIOReturnNoDevice;
+    
+    // one native transfer per receive buffer, allocated on first use and kept until the device closes
+    if (read == NULL)
+    {
+        if (device->readCount == PEAK_RX_MAX_DEPTH + 1)
+            return kIOReturnNoMemory;
+        
+        read = &device->reads[device->readCount];
+        if ((read->transfer = libusb_alloc_transfer(0)) == NULL)
+            return kIOReturnNoMemory;
+        
+        read->owner = rx;
+        read->device = device;
+        device->readCount++;
+        rx->userData = read;
+    }
+    
+    // libusb receives straight into the buffer the decoder will read from
+    libusb_fill_bulk_transfer(read->transfer, device->handle, kPeakEpBulkIn, rx->buffer, sizeof(rx->buffer), BulkReadCompletion, read, 0);
+    
+    pthread_mutex_lock(&device->lock);
+    err = libusb_submit_transfer(read->transfer);
+    if (err == LIBUSB_SUCCESS)
+        device->pending++;
+    pthread_mutex_unlock(&device->lock);
+    
+    return ErrorFromLibusb(err);
+}
+
+static void LIBUSB_CALL BulkWriteCompletion(struct libusb_transfer *transfer)
+{
+    LibusbWrite *write = (LibusbWrite *) transfer->user_data;
+    LibusbDevice *device = write->device;
+    IOReturn result = ErrorFromStatus(transfer->status);
+    
+    pthread_mutex_lock(&device->lock);
+    device->pending--;
+    write->busy = 0;
+    pthread_mutex_unlock(&device->lock);
+    
+    if (result == kIOReturnNoDevice)
+        device->lost = 1;
+    
+    PeakTransportWriteComplete(&device->transport, write->refCon, result);
+}
+
+static IOReturn WriteToBulkPipe(PeakTransport *transport, const UInt8 *buffer, UInt32 length, void *refCon)
+{
+    LibusbDevice *device = transport->context;
+    LibusbWrite *write = NULL;
+    int i, err;
+    
+    pthread_mutex_lock(&device->lock);
+    if (device->handle == NULL || device->closing)
+    {
+        pthread_mutex_unlock(&device->lock);
+        return kIOReturnNoDevice;
+    }
+    
+    for (i = 0; i < PEAK_LIBUSB_WRITES && write == NULL; i++)
+        if (!device->writes[i].busy)
+            write = &device->writes[i];
+    
+    if (write == NULL)
+    {
+        pthread_mutex_unlock(&device->lock);
+        return kIOReturnNoResources;
+    }
+    
+    if (write->transfer == NULL && (write->transfer = libusb_alloc_transfer(0)) == NULL)
+    {
+        pthread_mutex_unlock(&device->lock);
+        return kIOReturnNoMemory;
+    }
+    
+    // the caller keeps the buffer alive until the completion, which waits for the lock
+    libusb_fill_bulk_transfer(write->transfer, device->handle, kPeakEpBulkOut, (unsigned char*)buffer, (int)length, BulkWriteCompletion, write, PEAK_LIBUSB_TIMEOUT);
+    write->refCon = refCon;
+    write->device = device;
+    
+    err = libusb_submit_transfer(write->transfer);
+    if (err == LIBUSB_SUCCESS)
+    {
+        write->busy = 1;
+        device->pending++;
+    }
+    pthread_mutex_unlock(&device->lock);
+    
+    if (err != LIBUSB_SUCCESS)
+        printf("Unable to perform asynchronous bulk write (%08x)\n", ErrorFromLibusb(err));
+    return ErrorFromLibusb(err);
+}
+
+#pragma mark - USB device handling stuff
+
+static int IsAdapter(libusb_device *dev)
+{
+    struct libusb_device_descriptor desc;
+    
+    return libusb_get_device_descriptor(dev, &desc) == LIBUSB_SUCCESS &&
+           desc.idVendor == kPeakVendorID && desc.idProduct == kPeakProductID;
+}
+
+// opens the adapter at bus and address in the device's own context
+static IOReturn OpenDevice(LibusbDevice *device)
+{
+    libusb_device **list;
+    ssize_t i, count;
+    int err = LIBUSB_ERROR_NO_DEVICE;
+    
+    count = libusb_get_device_list(device->context, &list);
+    for (i = 0; i < count; i++)
+    {
+        if (libusb_get_bus_number(list[i]) == device->bus && libusb_get_device_address(list[i]) == device->address)
+        {
+            err = libusb_open(list[i], &device->handle);
+            break;
+        }
+    }
+    if (count >= 0)
+        libusb_free_device_list(list, 1);
+    
+    if (err != LIBUSB_SUCCESS)
+    {
+        device->handle = NULL;
+        return ErrorFromLibusb(err);
+    }
+    
+    libusb_set_auto_detach_kernel_driver(device->handle, 1); // the pcan/peak_usb kernel module may own it
+    
+    err = libusb_claim_interface(device->handle, 0);
+    if (err != LIBUSB_SUCCESS)
+    {
+        printf("Unable to claim interface (%s)\n", libusb_error_name(err));
+        libusb_close(device->handle);
+        device->handle = NULL;
+        return ErrorFromLibusb(err);
+    }
+    
+    device->lost = 0;
+    printf("Device added on bus %u address %u.\n", device->bus, device->address);
+    return kIOReturnSuccess;
+}
+
+static void CloseDevice(LibusbDevice *device)
+{
+    struct timeval tv = { 0, 100000 };
+    int i, pending;
+    
+    if (device->handle == NULL)
+        return;
+    
+    // from here on nothing is submitted, so the pending count only goes down
+    pthread_mutex_lock(&device->lock);
+    device->closing = 1;
+    for (i = 0; i < device->readCount; i++)
+        libusb_cancel_transfer(device->reads[i].transfer);
+    for (i = 0; i < PEAK_LIBUSB_WRITES; i++)
+        if (device->writes[i].busy)
+            libusb_cancel_transfer(device->writes[i].transfer);
+    pending = device->pending;
+    pthread_mutex_unlock(&device->lock);
+    
+    // transfers may only be freed after their completion has run, cancelled or completed, however long
+    // that takes; a vanished device completes them with LIBUSB_TRANSFER_NO_DEVICE
+    while (pending > 0)
+    {
+        libusb_handle_events_timeout_completed(device->context, &tv, NULL);
+        pthread_mutex_lock(&device->lock);
+        pending = device->pending;
+        pthread_mutex_unlock(&device->lock);
+    }
+    
+    for (i = 0; i < device->readCount; i++)
+    {
+        device->reads[i].owner->userData = NULL;
+        libusb_free_transfer(device->reads[i].transfer);
+        bzero(&device->reads[i], sizeof(LibusbRead));
+    }
+    device->readCount = 0;
+    
+    for (i = 0; i < PEAK_LIBUSB_WRITES; i++)
+    {
+        libusb_free_transfer(device->writes[i].transfer);
+        bzero(&device->writes[i], sizeof(LibusbWrite));
+    }
+    
+    pthread_mutex_lock(&device->lock);
+    libusb_release_interface(device->handle, 0);
+    libusb_close(device->handle);
+    device->handle = NULL;
+    device->closing = 0;
+    pthread_mutex_unlock(&device->lock);
+    printf("Device removed from bus %u address %u.\n", device->bus, device->address);
+}
+
+// the event loop of one adapter, until it is unplugged or the transport stops
+static void* DeviceThread(void *arg)
+{
+    LibusbDevice *device = arg;
+    struct timeval tv = { 0, 100000 };
+    int err = libusb_init(&device->context);
+    
+    if (err != LIBUSB_SUCCESS)
+    {
+        fprintf(stderr, "libusb_init failed (%s)\n", libusb_error_name(err));
+        device->done = 1;
+        return NULL;
+    }
+    
+    if (OpenDevice(device) == kIOReturnSuccess && PeakTransportAttached(&device->transport) == kIOReturnSuccess)
+    {
+        while (gRunning && !device->lost)
+            libusb_handle_events_timeout_completed(device->context, &tv, NULL);
+        
+        CloseDevice(device);
+        PeakTransportDetached(&device->transport);
+    }
+    else
+    {
+        CloseDevice(device);
+    }
+    
+    libusb_exit(device->context);
+    device->context = NULL;
+    device->done = 1;
+    return NULL;
+}
+
+// starts a thread for every adapter not seen before, and reaps the threads of those that went away
+static void ScanDevices(libusb_context *context, PeakTransport *transport)
+{
+    libusb_device **list;
+    ssize_t i, count;
+    int j, known;
+    
+    for (j = 0; j < PEAK_MAX_CHANNELS; j++)
+    {
+        if (gDevices[j].used && gDevices[j].done)
+        {
+            pthread_join(gDevices[j].thread, NULL);
+            pthread_mutex_destroy(&gDevices[j].lock);
+            gDevices[j].used = 0;
+        }
+    }
+    
+    count = libusb_get_device_list(context, &list);
+    for (i = 0; i < count; i++)
+    {
+        UInt8 bus = libusb_get_bus_number(list[i]), address = libusb_get_device_address(list[i]);
+        LibusbDevice *device = NULL;
+        
+        if (!IsAdapter(list[i]))
+            continue;
+        
+        for (j = 0, known = 0; j < PEAK_MAX_CHANNELS; j++)
+        {
+            if (gDevices[j].used && gDevices[j].bus == bus && gDevices[j].address == address)
+                known = 1;
+            else if (!gDevices[j].used && device == NULL)
+                device = &gDevices[j];
+        }
+        if (known || device == NULL)
+            continue;
+        
+        bzero(device, sizeof(LibusbDevice));
+        device->transport = *transport;
+        device->transport.context = device;
+        device->bus = bus;
+        device->address = address;
+        pthread_mutex_init(&device->lock, NULL);
+        if (pthread_create(&device->thread, NULL, DeviceThread, device) == 0)
+            device->used = 1;
+        else
+            pthread_mutex_destroy(&device->lock);
+    }
+    if (count >= 0)
+        libusb_free_device_list(list, 1);
+}
+
+#pragma mark - Transport
+
+static void LibusbStop(PeakTransport *transport)
+{
+    (void)transport;
+    gRunning = 0; // the event loops wake up at least every 100ms
+}
+
+static IOReturn LibusbRun(PeakTransport *transport)
+{
+    libusb_context *context = NULL;
+    int j, err = libusb_init(&context);
+    
+    if (err != LIBUSB_SUCCESS)
+    {
+        fprintf(stderr, "libusb_init failed (%s)\n", libusb_error_name(err));
+        return ErrorFromLibusb(err);
+    }
+    
+    fprintf(stderr, "Looking for devices matching vendor ID=%d and product ID=%d.\n", kPeakVendorID, kPeakProductID);
+    
+    gRunning = 1;
+    while (gRunning)
+    {
+        // no hotplug on every platform, so poll for adapters once a second
+        ScanDevices(context, transport);
+        sleep(1);
+    }
+    
+    for (j = 0; j < PEAK_MAX_CHANNELS; j++)
+    {
+        if (gDevices[j].used)
+        {
+            pthread_join(gDevices[j].thread, NULL);
+            pthread_mutex_destroy(&gDevices[j].lock);
+            gDevices[j].used = 0;
+        }
+    }
+    
+    libusb_exit(context);
+    return kIOReturnSuccess;
+}
+
+PeakTransport gPeakLibusbTransport = {
+    "libusb",
+    LibusbRun,
+    LibusbStop,
+    WriteToCtrlPipe,
+    ReadFromCtrlPipe,
+    ReadFromBulkPipe,
+    WriteToBulkPipe,
+    NULL,
+    NULL
+};
+
+#endif
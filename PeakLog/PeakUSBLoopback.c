@@ -0,0 +1,483 @@
+/*
+    File:           PeakUSBLoopback.c
+
+    Description:    Loopback transport standing in for a PCAN-USB adapter. Injected bulk-IN telegrams
+                    complete the pending reads, transmitted frames are echoed back as received ones.
+                    Lets the whole receive path run without hardware, with up to PEAK_MAX_CHANNELS
+                    adapters on a thread each.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "PeakUSB.h"
+#include "PeakTransport.h"
+#include "PeakAcceptance.h"
+
+#define PEAK_LOOPBACK_TELEGRAMS     1024    // injected telegrams waiting for a read
+#define PEAK_LOOPBACK_WRITES        64      // write completions waiting for the event loop
+#define PEAK_LOOPBACK_TICKS         24      // device ticks between two echoed frames
+
+#pragma mark Globals
+
+typedef struct {
+    UInt8   data[PEAK_RX_BUFFER_SIZE];
+    UInt32  length;
+    IOReturn result;    // the read completes with this, and no data if it failed
+} LoopbackTelegram;
+
+typedef struct {
+    PeakTransport           transport;      // a copy of gPeakLoopbackTransport pointing back here
+    pthread_t               thread;
+    pthread_mutex_t         lock;
+    pthread_cond_t          wakeup;
+    int                     running;
+    LoopbackTelegram        telegrams[PEAK_LOOPBACK_TELEGRAMS];
+    UInt32                  telegramHead, telegramTail;
+    PeakRxTransfer*         reads[PEAK_RX_MAX_DEPTH + 1];
+    UInt32                  readHead, readTail;
+    void*                   writes[PEAK_LOOPBACK_WRITES];
+    UInt32                  writeHead, writeTail;
+    PeakLoopbackSourceFunc  source;
+    void*                   sourceRefCon;
+    UInt16                  ticks;
+    PeakLoopbackStats       stats;
+    PCAN_USB_PARAM          ctrlLog[PEAK_LOOPBACK_CTRL_LOG];
+    UInt32                  ctrlCount;
+    PeakAcceptance          acceptance;
+} LoopbackDevice;
+
+static LoopbackDevice               gDevices[PEAK_MAX_CHANNELS];
+static UInt32                       gAdapters = 1;
+static pthread_once_t               gOnce = PTHREAD_ONCE_INIT;
+
+static void InitDevices(void)
+{
+    UInt32 i;
+    
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+    {
+        LoopbackDevice *device = &gDevices[i];
+        
+        pthread_mutex_init(&device->lock, NULL);
+        pthread_cond_init(&device->wakeup, NULL);
+        PeakAcceptanceOpen(&device->acceptance);
+    }
+}
+
+static LoopbackDevice* GetDevice(UInt32 adapter)
+{
+    pthread_once(&gOnce, InitDevices);
+    return adapter < PEAK_MAX_CHANNELS ? &gDevices[adapter] : NULL;
+}
+
+IOReturn PeakLoopbackSetAdapters(UInt32 count)
+{
+    if (count == 0 || count > PEAK_MAX_CHANNELS)
+        return kIOReturnBadArgument;
+    
+    gAdapters = count;
+    return kIOReturnSuccess;
+}
+
+#pragma mark - Telegram queue
+
+// must be called with the device lock held
+static IOReturn Enqueue(LoopbackDevice *device, const UInt8 *telegram, UInt32 length)
+{
+    LoopbackTelegram *t;
+    
+    if (device->telegramHead - device->telegramTail == PEAK_LOOPBACK_TELEGRAMS)
+    {
+        device->stats.dropped++;
+        return kIOReturnNoSpace;
+    }
+    
+    t = &device->telegrams[device->telegramHead++ % PEAK_LOOPBACK_TELEGRAMS];
+    memcpy(t->data, telegram, length);
+    t->length = length;
+    t->result = kIOReturnSuccess;
+    device->stats.injected++;
+    pthread_cond_signal(&device->wakeup);
+    return kIOReturnSuccess;
+}
+
+IOReturn PeakLoopbackInject(UInt32 adapter, const UInt8* telegram, UInt32 length)
+{
+    LoopbackDevice *device = GetDevice(adapter);
+    IOReturn kr;
+    
+    if (device == NULL || length == 0 || length > PEAK_RX_BUFFER_SIZE)
+        return kIOReturnBadArgument;
+    
+    pthread_mutex_lock(&device->lock);
+    kr = Enqueue(device, telegram, length);
+    pthread_mutex_unlock(&device->lock);
+    return kr;
+}
+
+IOReturn PeakLoopbackInjectError(UInt32 adapter, IOReturn result)
+{
+    LoopbackDevice *device = GetDevice(adapter);
+    UInt8 none = 0;
+    IOReturn kr;
+    
+    if (device == NULL || result == kIOReturnSuccess)
+        return kIOReturnBadArgument;
+    
+    pthread_mutex_lock(&device->lock);
+    kr = Enqueue(device, &none, 0);
+    if (kr == kIOReturnSuccess)
+        device->telegrams[(device->telegramHead - 1) % PEAK_LOOPBACK_TELEGRAMS].result = result;
+    pthread_mutex_unlock(&device->lock);
+    return kr;
+}
+
+void PeakLoopbackSetSource(UInt32 adapter, PeakLoopbackSourceFunc source, void* refCon)
+{
+    LoopbackDevice *device = GetDevice(adapter);
+    
+    if (device == NULL)
+        return;
+    
+    pthread_mutex_lock(&device->lock);
+    device->sourceRefCon = refCon;
+    device->source = source;
+    pthread_cond_signal(&device->wakeup);
+    pthread_mutex_unlock(&device->lock);
+}
+
+void PeakLoopbackGetStats(UInt32 adapter, PeakLoopbackStats* stats)
+{
+    LoopbackDevice *device = GetDevice(adapter);
+    
+    if (device == NULL)
+    {
+        bzero(stats, sizeof(PeakLoopbackStats));
+        return;
+    }
+    
+    pthread_mutex_lock(&device->lock);
+    *stats = device->stats;
+    pthread_mutex_unlock(&device->lock);
+}
+
+UInt32 PeakLoopbackGetCtrlWrites(UInt32 adapter, PCAN_USB_PARAM* params, UInt32 max)
+{
+    LoopbackDevice *device = GetDevice(adapter);
+    UInt32 i, n, first;
+    
+    if (device == NULL)
+        return 0;
+    
+    pthread_mutex_lock(&device->lock);
+    n = device->ctrlCount < PEAK_LOOPBACK_CTRL_LOG ? device->ctrlCount : PEAK_LOOPBACK_CTRL_LOG;
+    if (n > max)
+        n = max;
+    first = device->ctrlCount - n;
+    for (i = 0; i < n; i++)
+        params[i] = device->ctrlLog[(first + i) % PEAK_LOOPBACK_CTRL_LOG];
+    pthread_mutex_unlock(&device->lock);
+    return n;
+}
+
+#pragma mark - Echo
+
+// the id of a bulk-OUT record as the controller sees it
+static int Accepted(LoopbackDevice *device, UInt8 ucStatusLen, const UInt8 *record)
+{
+    CanMsg msg;
+    UInt32 dataLen;
+    
+    bzero(&msg, sizeof(CanMsg));
+    msg.ext = (ucStatusLen & STLN_EXTENDED_ID) != 0;
+    msg.rtr = (ucStatusLen & STLN_RTR) != 0;
+    msg.len = ucStatusLen & STLN_DATA_LENGTH;
+    dataLen = msg.rtr ? 0 : (msg.len > 8 ? 8 : msg.len);
+    if (msg.ext)
+    {
+        msg.canid.ul = (record[0] | record[1] << 8 | record[2] << 16 | (UInt32)record[3] << 24) >> 3;
+        memcpy(msg.data, record + 4, dataLen);
+    }
+    else
+    {
+        msg.canid.ul = (record[0] | record[1] << 8) >> 5;
+        memcpy(msg.data, record + 2, dataLen);
+    }
+    
+    return PeakAcceptanceMatch(&device->acceptance, &msg);
+}
+
+// Re-encodes the records of a bulk-OUT telegram as bulk-IN records, which carry a timestamp after the
+// id. The result may need more than one telegram. Must be called with the device lock held.
+static void Echo(LoopbackDevice *device, const UInt8 *tx, UInt32 length)
+{
+    UInt8 rx[PEAK_RX_BUFFER_SIZE];
+    UInt32 rxLen = 2, i, count = tx[1];
+    const UInt8 *ptr = tx + 2, *end = tx + length;
+    
+    rx[0] = 2;
+    rx[1] = 0;
+    
+    for (i = 0; i < count; i++)
+    {
+        UInt8 ucStatusLen = *ptr;
+        UInt32 idLen = (ucStatusLen & STLN_EXTENDED_ID) ? 4 : 2;
+        UInt32 dataLen = (ucStatusLen & STLN_RTR) ? 0 : (ucStatusLen & STLN_DATA_LENGTH);
+        UInt32 tsLen = rx[1] ? 1 : 2;
+        
+        if (dataLen > 8)
+            dataLen = 8;
+        if (ptr + 1 + idLen + dataLen > end)
+            break;
+        
+        if (!Accepted(device, ucStatusLen, ptr + 1))
+        {
+            ptr += 1 + idLen + dataLen;
+            device->stats.rejected++;
+            continue;
+        }
+        
+        if (rxLen + 1 + idLen + tsLen + dataLen > sizeof(rx))
+        {
+            Enqueue(device, rx, rxLen);
+            rx[1] = 0;
+            rxLen = 2;
+            tsLen = 2;
+        }
+        
+        device->ticks += PEAK_LOOPBACK_TICKS;
+        rx[rxLen++] = ucStatusLen;
+        memcpy(&rx[rxLen], ptr + 1, idLen);
+        rxLen += idLen;
+        if (tsLen == 2)
+        {
+            rx[rxLen++] = (UInt8)(device->ticks & 0xff);
+            rx[rxLen++] = (UInt8)(device->ticks >> 8);
+        }
+        else
+        {
+            rx[rxLen++] = (UInt8)(device->ticks & 0xff);
+        }
+        memcpy(&rx[rxLen], ptr + 1 + idLen, dataLen);
+        rxLen += dataLen;
+        rx[1]++;
+        
+        ptr += 1 + idLen + dataLen;
+        device->stats.echoed++;
+    }
+    
+    if (rx[1])
+        Enqueue(device, rx, rxLen);
+}
+
+#pragma mark - Transport functions
+
+static IOReturn LoopbackCtrlWrite(PeakTransport *transport, const PCAN_USB_PARAM *param)
+{
+    LoopbackDevice *device = transport->context;
+    
+    // recorded, and register writes go to the simulated acceptance filter
+    pthread_mutex_lock(&device->lock);
+    device->ctrlLog[device->ctrlCount++ % PEAK_LOOPBACK_CTRL_LOG] = *param;
+    PeakAcceptanceApplyParam(&device->acceptance, param);
+    pthread_mutex_unlock(&device->lock);
+    return kIOReturnSuccess;
+}
+
+static IOReturn LoopbackCtrlRead(PeakTransport *transport, const PCAN_USB_PARAM *param, UInt8 buffer[16])
+{
+    LoopbackDevice *device = transport->context;
+    
+    bzero(buffer, 16);
+    buffer[0] = param->Function;
+    buffer[1] = param->Number;
+    
+    // every adapter has a serial and device number of its own
+    if (param->Function == PCAN_CTRL_READ_SNR.Function && param->Number == PCAN_CTRL_READ_SNR.Number)
+        buffer[2] = (UInt8)(device - gDevices) + 1;
+    else if (param->Function == PCAN_CTRL_READ_DEVICENO.Function && param->Number == PCAN_CTRL_READ_DEVICENO.Number)
+        buffer[2] = (UInt8)(device - gDevices);
+    return kIOReturnSuccess;
+}
+
+static IOReturn LoopbackSubmitRead(PeakTransport *transport, PeakRxTransfer *transfer)
+{
+    LoopbackDevice *device = transport->context;
+    
+    pthread_mutex_lock(&device->lock);
+    device->reads[device->readHead++ % (PEAK_RX_MAX_DEPTH + 1)] = transfer;
+    pthread_cond_signal(&device->wakeup);
+    pthread_mutex_unlock(&device->lock);
+    return kIOReturnSuccess;
+}
+
+static IOReturn LoopbackSubmitWrite(PeakTransport *transport, const UInt8 *buffer, UInt32 length, void *refCon)
+{
+    LoopbackDevice *device = transport->context;
+    IOReturn kr = kIOReturnSuccess;
+    
+    if (length < 2 || length > PEAK_RX_BUFFER_SIZE || buffer[0] != 2)
+        return kIOReturnBadArgument;
+    
+    pthread_mutex_lock(&device->lock);
+    if (device->writeHead - device->writeTail == PEAK_LOOPBACK_WRITES)
+    {
+        kr = kIOReturnNoResources;
+    }
+    else
+    {
+        Echo(device, buffer, length);
+        device->writes[device->writeHead++ % PEAK_LOOPBACK_WRITES] = refCon;
+        device->stats.writes++;
+        pthread_cond_signal(&device->wakeup);
+    }
+    pthread_mutex_unlock(&device->lock);
+    return kr;
+}
+
+// the event loop of one adapter
+static void* DeviceThread(void *arg)
+{
+    LoopbackDevice *device = arg;
+    PeakTransport *transport = &device->transport;
+    
+    if (PeakTransportAttached(transport) != kIOReturnSuccess)
+        return NULL;
+    
+    pthread_mutex_lock(&device->lock);
+    while (device->running)
+    {
+        if (device->writeTail != device->writeHead)
+        {
+            void *refCon = device->writes[device->writeTail++ % PEAK_LOOPBACK_WRITES];
+            pthread_mutex_unlock(&device->lock);
+            PeakTransportWriteComplete(transport, refCon, kIOReturnSuccess);
+            pthread_mutex_lock(&device->lock);
+        }
+        else if (device->readTail != device->readHead && (device->telegramTail != device->telegramHead || device->source))
+        {
+            PeakRxTransfer *transfer = device->reads[device->readTail++ % (PEAK_RX_MAX_DEPTH + 1)];
+            IOReturn result = kIOReturnSuccess;
+            UInt32 length;
+            
+            if (device->telegramTail != device->telegramHead)
+            {
+                LoopbackTelegram *t = &device->telegrams[device->telegramTail++ % PEAK_LOOPBACK_TELEGRAMS];
+                memcpy(transfer->buffer, t->data, t->length);
+                length = t->length;
+                result = t->result;
+                pthread_mutex_unlock(&device->lock);
+            }
+            else
+            {
+                // the source fills the transfer buffer directly, as fast as the driver takes it
+                PeakLoopbackSourceFunc source = device->source;
+                void *refCon = device->sourceRefCon;
+                pthread_mutex_unlock(&device->lock);
+                length = source(refCon, transfer->buffer);
+            }
+            
+            if (length == 0 && result == kIOReturnSuccess)
+            {
+                // source exhausted, give the read back and wait for injected telegrams
+                pthread_mutex_lock(&device->lock);
+                device->readTail--;
+                device->source = NULL;
+                continue;
+            }
+            
+            PeakTransportReadComplete(transport, transfer, result, length);
+            pthread_mutex_lock(&device->lock);
+            device->stats.completions++;
+        }
+        else
+        {
+            pthread_cond_wait(&device->wakeup, &device->lock);
+        }
+    }
+    pthread_mutex_unlock(&device->lock);
+    
+    PeakTransportDetached(transport);
+    return NULL;
+}
+
+static void LoopbackStop(PeakTransport *transport)
+{
+    UInt32 i;
+    
+    (void)transport; // stops every simulated adapter, not just this one
+    
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+    {
+        LoopbackDevice *device = GetDevice(i);
+        
+        pthread_mutex_lock(&device->lock);
+        device->running = 0;
+        pthread_cond_signal(&device->wakeup);
+        pthread_mutex_unlock(&device->lock);
+    }
+}
+
+static IOReturn LoopbackRun(PeakTransport *transport)
+{
+    UInt32 i, count = gAdapters, started = 0;
+    
+    for (i = 0; i < count; i++)
+    {
+        LoopbackDevice *device = GetDevice(i);
+        
+        pthread_mutex_lock(&device->lock);
+        device->transport = *transport;
+        device->transport.context = device;
+        device->running = 1;
+        device->readHead = device->readTail = 0;
+        pthread_mutex_unlock(&device->lock);
+    }
+    
+    // the first adapter runs on the caller's thread
+    for (i = 1; i < count; i++)
+    {
+        if (pthread_create(&gDevices[i].thread, NULL, DeviceThread, &gDevices[i]) != 0)
+        {
+            fprintf(stderr, "Unable to start loopback adapter %u.\n", (unsigned)i);
+            break;
+        }
+        started++;
+    }
+    
+    DeviceThread(&gDevices[0]);
+    
+    for (i = 1; i <= started; i++)
+        pthread_join(gDevices[i].thread, NULL);
+    return kIOReturnSuccess;
+}
+
+PeakTransport gPeakLoopbackTransport = {
+    "loopback",
+    LoopbackRun,
+    LoopbackStop,
+    LoopbackCtrlWrite,
+    LoopbackCtrlRead,
+    LoopbackSubmitRead,
+    LoopbackSubmitWrite,
+    NULL,
+    NULL
+};
@@ -1,8 +1,8 @@
 /*
     File:           PeakUSBUserspaceDriver.c
  
-    Description:    User-space driver using IOKitLib and IOUSBLib for PEAK PCAN-USB CAN to USB Adapters.
-                    Based on USBPrivateDataSample and the pcan linux driver.
+    Description:    IOKitLib and IOUSBLib transport of the user-space driver for PEAK PCAN-USB CAN to
+                    USB Adapters. Based on USBPrivateDataSample and the pcan linux driver.
  
     Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
  
@@ -29,264 +29,59 @@
 #include <IOKit/IOCFPlugIn.h>
 #include <IOKit/usb/IOUSBLib.h>
 
+#include <pthread.h>
+
 #include "PeakUSB.h"
+#include "PeakTransport.h"
+
+#define PEAK_IOKIT_WRITES       16      // bulk writes in flight
 
 #pragma mark Globals
 
-typedef struct MyPrivateData {
+typedef struct MyPrivateData MyPrivateData;
+
+typedef struct {
+    MyPrivateData*          device;
+    void*                   refCon;
+    int                     busy;
+} IOKitWrite;
+
+// Every adapter gets a thread with a run loop of its own, which receives its completions.
+struct MyPrivateData {
     io_object_t				notification;
     IOUSBDeviceInterface	**deviceInterface;
     CFStringRef				deviceName;
-} MyPrivateData;
+    PeakTransport           transport;          // a copy of gPeakIOKitTransport pointing back here
+    IOUSBInterfaceInterface **interface;
+    pthread_t               thread;
+    CFRunLoopRef            runLoop;
+    volatile int            stopping;
+    IOKitWrite              writes[PEAK_IOKIT_WRITES];
+};
 
-static CFNotificationCenterRef      gNotificationCenter = NULL;
 static IONotificationPortRef        gNotifyPort;
 static io_iterator_t                gAddedIter;
 static CFRunLoopRef                 gRunLoop;
+static MyPrivateData*               gDevices[PEAK_MAX_CHANNELS];  // adapters with a thread
 
-//FIXME put into MyPrivateData, if feasible
-static char                         gBufferReceive[64], gBufferSend[64];
-static UInt8                        gTelegramCount;
-static int                          gMsgCounter = 0;
-static time_t                       gLast = 0;
-static IOUSBInterfaceInterface**    gInterface = NULL;
-static PCAN_USB_TIME                gUsbTime;
-static UInt16                       gLastBitrate = CAN_BAUD_125K;
-
-#pragma mark - Timestamp magic
-
-static void calcTimevalFromTicks(struct timeval *tv)
-{
-	register PCAN_USB_TIME *t = &gUsbTime;
-	UInt64 llx;
-	UInt32 nb_s, nb_us;
-    
-	llx = t->ullCumulatedTicks - t->wStartTicks; // subtract initial offset
-	llx *= PCAN_USB_TS_US_PER_TICK;
-	llx >>= PCAN_USB_TS_DIV_SHIFTER;
-
-	nb_s = (UInt32) llx / 1000000;
-	nb_us = (UInt32)((UInt64)llx - (nb_s * 1000000));
-	
-	tv->tv_usec = t->StartTime.tv_usec + nb_us;
-	if (tv->tv_usec > 1000000)
-	{
-		tv->tv_usec -= 1000000;
-		nb_s++;
-	}
-	
-	tv->tv_sec = t->StartTime.tv_sec + nb_s;
-}
-
-static void updateTimeStampFromWord(CanMsg* msg, UInt16 wTimeStamp, UInt8 ucStep)
-{
-	register PCAN_USB_TIME *t = &gUsbTime;
-    
-	if ((!t->StartTime.tv_sec) && (!t->StartTime.tv_usec))
-	{
-        gettimeofday(&t->StartTime, NULL);
-		t->wStartTicks          = wTimeStamp;
-		t->wOldLastTickValue    = wTimeStamp;
-		t->ullCumulatedTicks    = wTimeStamp;
-		t->ullOldCumulatedTicks = wTimeStamp;
-	}
-    
-	// correction for status timestamp in the same telegram which is more recent, restore old contents
-	if (ucStep)
-	{
-		t->ullCumulatedTicks = t->ullOldCumulatedTicks;
-		t->wLastTickValue    = t->wOldLastTickValue;
-	}
-    
-	// store current values for old ...
-	t->ullOldCumulatedTicks = t->ullCumulatedTicks;
-	t->wOldLastTickValue    = t->wLastTickValue;
-    
-	if (wTimeStamp < t->wLastTickValue)  // handle wrap, enhance tolerance
-		t->ullCumulatedTicks += 0x10000LL;
-    
-	t->ullCumulatedTicks &= ~0xFFFFLL;   // mask in new 16 bit value - do not cumulate cause of error propagation
-	t->ullCumulatedTicks |= wTimeStamp;
-    
-	t->wLastTickValue   = wTimeStamp;      // store for wrap recognition
-	t->ucLastTickValue  = (UInt8)(wTimeStamp & 0xff); // each update for 16 bit tick updates the 8 bit tick, too
-    
-    calcTimevalFromTicks(&msg->ts);
-}
+#pragma mark - Synchronous ctrl I/O functions
 
-static void updateTimeStampFromByte(CanMsg* msg, UInt8 ucTimeStamp)
+static IOReturn WriteToCtrlPipe(PeakTransport *transport, const PCAN_USB_PARAM *param)
 {
-	register PCAN_USB_TIME *t = &gUsbTime;
-    
-	if (ucTimeStamp < t->ucLastTickValue)  // handle wrap
-	{
-		t->ullCumulatedTicks += 0x100;
-		t->wLastTickValue    += 0x100;
-	}
-    
-	t->ullCumulatedTicks &= ~0xFFULL;      // mask in new 8 bit value - do not cumulate cause of error propagation
-	t->ullCumulatedTicks |= ucTimeStamp;
-    
-	t->wLastTickValue    &= ~0xFF;         // correction for word timestamp, too
-	t->wLastTickValue    |= ucTimeStamp;
-    
-	t->ucLastTickValue    = ucTimeStamp;   // store for wrap recognition
+    IOUSBInterfaceInterface **interface = ((MyPrivateData *) transport->context)->interface;
+    if (interface == NULL)
+        return kIOReturnNoDevice;
     
-    calcTimevalFromTicks(&msg->ts);
+    return (*interface)->WritePipe(interface, kPeakUsbCtrlInputPipe, (void*)param, sizeof(PCAN_USB_PARAM));
 }
 
-#pragma mark - Buffer decoding
-
-void DecodeMessages(void)
+static IOReturn ReadFromCtrlPipe(PeakTransport *transport, const PCAN_USB_PARAM *param, UInt8 buffer[16])
 {
-    UInt8 i, j;
-    UInt8* ucMsgPtr = (UInt8*)&gBufferReceive[0];
-    CanTimeStamp ts;
-    
-    UInt8 ucPrefix = *ucMsgPtr++; // ignore
-    assert(ucPrefix == 2);
-    UInt8 ucMessageLen = *ucMsgPtr++;
-    
-    for(i = 0; i < ucMessageLen; i++)
-    {
-        UInt8 ucStatusLen = *ucMsgPtr++;
-        CanMsg* msg = malloc(sizeof(CanMsg));
-
-        if (!(ucStatusLen & STLN_INTERNAL_DATA)) // real message
-        {
-            msg->len = ucStatusLen & STLN_DATA_LENGTH;
-            if (msg->len > 8) msg->len = 8;
-            msg->rtr = (ucStatusLen & STLN_RTR) > 0;
-            msg->ext = (ucStatusLen & STLN_EXTENDED_ID) > 0;
-            msg->err = 0;
-            
-            if (ucStatusLen & STLN_EXTENDED_ID)
-			{
-				msg->canid.uc[0] = *ucMsgPtr++;
-				msg->canid.uc[1] = *ucMsgPtr++;
-				msg->canid.uc[2] = *ucMsgPtr++;
-				msg->canid.uc[3] = *ucMsgPtr++;
-				msg->canid.ul >>= 3;
-			}
-			else
-			{
-				msg->canid.ul = 0;
-				msg->canid.uc[0] = *ucMsgPtr++;
-				msg->canid.uc[1] = *ucMsgPtr++;
-				msg->canid.ul >>= 5;
-			}
-            
-            if(i == 0) // only the first packet supplies a word timestamp
-            {
-                ts.uc[0] = *ucMsgPtr++;
-                ts.uc[1] = *ucMsgPtr++;
-                updateTimeStampFromWord(msg, ts.uw, i);
-            } else {
-                updateTimeStampFromByte(msg, *ucMsgPtr++);
-            }
-#ifdef DEBUG
-            printf("Timestamp:%lu Flags:0x%02x Id:0x%02x Len:%d Rtr:%s Ext:%s\n", (unsigned long)msg->ts.tv_sec, ucStatusLen, (unsigned)msg->canid.ul, msg->len, (msg->rtr) ? "yes" : "no", (msg->ext) ? "yes" : "no");
-#endif
-            for(j = 0; j < msg->len; j++)
-                msg->data[j] = *ucMsgPtr++;
-            
-            gMsgCounter++;
-            
-            CFNotificationCenterPostNotification (gNotificationCenter, CFSTR("CanMsg"), msg, NULL, true);
-        }
-        else
-        {
-            // internal data & errors
-            UInt8 ucFunction = *ucMsgPtr++;
-            UInt8 ucNumber = *ucMsgPtr++;
-            
-            msg->canid.uc[0] = ucFunction;
-            msg->canid.uc[1] = ucNumber;
-            
-            if (ucStatusLen & STLN_WITH_TIMESTAMP)
-            {
-                if(i == 0) { // only the first packet supplies a word timestamp
-                    ts.uc[0] = *ucMsgPtr++;
-                    ts.uc[1] = *ucMsgPtr++;
-                    updateTimeStampFromWord(msg, ts.uw, i);
-                } else {
-                    updateTimeStampFromByte(msg, *ucMsgPtr++);
-                }
-            }
-            
-            switch (ucFunction) {
-                case 1:
-                    {
-                        if (ucNumber & CAN_RECEIVE_QUEUE_OVERRUN)
-                            printf("CAN_RECEIVE_QUEUE_OVERRUN\n");
-                        
-                        if (ucNumber & QUEUE_OVERRUN)
-                            printf("CAN_QUEUE_OVERRUN\n");
-                        
-                        if (ucNumber & BUS_OFF)
-                            printf("BUS_OFF\n");
-                        
-                        if (ucNumber & BUS_HEAVY)
-                            printf("BUS_HEAVY\n");
-                        
-                        if (ucNumber & BUS_LIGHT)
-                            printf("BUS_LIGHT\n");
-#ifdef DEBUG                        
-                        if (ucNumber == 0)
-                            printf("No error\n");
-#endif
-                    }
-                    break;
-                case 2: // get_analog_value, remove bytes
-                    ucMsgPtr++;
-                    ucMsgPtr++;
-                    break;
-                case 3: // get_bus_load, remove byte
-                    ucMsgPtr++;
-                    break;
-                case 4:
-                    ts.uc[0] = *ucMsgPtr++;
-                    ts.uc[1] = *ucMsgPtr++;
-                    updateTimeStampFromWord(msg, ts.uw, i);
-                    break;
-                case 5: // ErrorFrame/ErrorBusEvent.
-                    if (ucNumber & QUEUE_XMT_FULL)
-                    {
-                        printf("QUEUE_XMT_FULL signaled, ucNumber = 0x%02x\n", ucNumber);
-                        //dev->wCANStatus |= CAN_ERR_QXMTFULL; // fatal error!
-                        //dev->dwErrorCounter++;
-                    }
-                    
-                    //j = 0;
-                    //while (ucLen--)
-                    //    msg.Msg.DATA[j++] = *ucMsgPtr++;
-                    break;
-            }
-            CFNotificationCenterPostNotification (gNotificationCenter, CFSTR("CanStatus"), msg, NULL, true);
-#ifdef DEBUG            
-            printf("Status Function:%d Number:%d Timestamp:%06lu.%06u\n", ucFunction, ucNumber, msg->ts.tv_sec, msg->ts.tv_usec);
-#endif
-        }
-    }
+    IOUSBInterfaceInterface **interface = ((MyPrivateData *) transport->context)->interface;
+    if (interface == NULL)
+        return kIOReturnNoDevice;
     
-    time_t now = time(NULL);
-    if(now > gLast) {
-        gLast = now;
-        CFNotificationCenterPostNotification (gNotificationCenter, CFSTR("CanDevice"), &gMsgCounter, NULL, true);
-        gMsgCounter = 0;
-    }
-}
-
-#pragma mark - Synchronous ctrl I/O functions
-
-IOReturn WriteToCtrlPipe(IOUSBInterfaceInterface **interface, const PCAN_USB_PARAM param)
-{
-    return (*interface)->WritePipe(interface, kPeakUsbCtrlInputPipe, (void*)&param, sizeof(PCAN_USB_PARAM));
-}
-
-IOReturn ReadFromCtrlPipe(IOUSBInterfaceInterface **interface, const PCAN_USB_PARAM param)
-{
-    IOReturn kr = (*interface)->WritePipe(interface, kPeakUsbCtrlInputPipe, (void*)&param, sizeof(PCAN_USB_PARAM));
+    IOReturn kr = (*interface)->WritePipe(interface, kPeakUsbCtrlInputPipe, (void*)param, sizeof(PCAN_USB_PARAM));
     UInt32 numBytesRead = 16;
     int i;
     
@@ -294,11 +89,11 @@ IOReturn ReadFromCtrlPipe(IOUSBInterfaceInterface **interface, const PCAN_USB_PA
     {
         usleep(5);
 
-        kr = (*interface)->ReadPipe(interface, kPeakUsbCtrlOutputPipe, gBufferReceive, &numBytesRead);
+        kr = (*interface)->ReadPipe(interface, kPeakUsbCtrlOutputPipe, buffer, &numBytesRead);
         if (kr == kIOReturnSuccess)
         {
             for (i = 0; i < 16; i++)
-                printf("%02X ", (UInt8)gBufferReceive[i]);
+                printf("%02X ", buffer[i]);
             printf(" (%ld)\n", (long)numBytesRead);
         } else {
             printf("Unable to perform ctrl read (%08x)\n", kr);
@@ -311,18 +106,33 @@ IOReturn ReadFromCtrlPipe(IOUSBInterfaceInterface **interface, const PCAN_USB_PA
 
 #pragma mark - Asynchronous bulk I/O functions
 
+static void CloseInterface(MyPrivateData *device)
+{
+    IOUSBInterfaceInterface **interface = device->interface;
+    
+    // several transfers may fail on the same interface, close it only once
+    if (interface == NULL)
+        return;
+    
+    device->interface = NULL;
+    (void) (*interface)->USBInterfaceClose(interface);
+    (void) (*interface)->Release(interface);
+}
+
 void BulkWriteCompletion(void *refCon, IOReturn result, void *arg0)
 {
-    IOUSBInterfaceInterface **interface = (IOUSBInterfaceInterface **) refCon;
+    IOKitWrite *write = (IOKitWrite *) refCon;
+    MyPrivateData *device = write->device;
 #ifdef DEBUG
     UInt64 numBytesWritten = (UInt64) arg0;
     printf("Asynchronous bulk write complete\n");
 #endif
+    __atomic_store_n(&write->busy, 0, __ATOMIC_RELEASE);
+    PeakTransportWriteComplete(&device->transport, write->refCon, result);
+    
     if (result != kIOReturnSuccess)
     {
-        printf("error from asynchronous bulk write (%08x)\n", result);
-        (void) (*interface)->USBInterfaceClose(interface);
-        (void) (*interface)->Release(interface);
+        CloseInterface(device);
         return;
     }
 #ifdef DEBUG
@@ -330,122 +140,67 @@ void BulkWriteCompletion(void *refCon, IOReturn result, void *arg0)
 #endif
 }
 
-IOReturn WriteToBulkPipe(IOUSBInterfaceInterface **interface)
+static IOReturn WriteToBulkPipe(PeakTransport *transport, const UInt8 *buffer, UInt32 length, void *refCon)
 {
-    IOReturn kr = (*interface)->WritePipeAsync(interface, kPeakUsbBulkWritePipe, gBufferSend, sizeof(gBufferSend), BulkWriteCompletion, (void *) interface);
+    MyPrivateData *device = transport->context;
+    IOUSBInterfaceInterface **interface = device->interface;
+    IOKitWrite *write = NULL;
+    int i;
+    
+    if (interface == NULL)
+        return kIOReturnNoDevice;
+    
+    // the completion has to find its adapter, so the driver's refCon travels in a write of our own
+    for (i = 0; i < PEAK_IOKIT_WRITES && write == NULL; i++)
+        if (!__atomic_load_n(&device->writes[i].busy, __ATOMIC_ACQUIRE))
+            write = &device->writes[i];
+    
+    if (write == NULL)
+        return kIOReturnNoResources;
+    
+    write->device = device;
+    write->refCon = refCon;
+    write->busy = 1;
+    
+    IOReturn kr = (*interface)->WritePipeAsync(interface, kPeakUsbBulkWritePipe, (void*)buffer, length, BulkWriteCompletion, write);
     
     if (kr != kIOReturnSuccess)
     {
         printf("Unable to perform asynchronous bulk write (%08x)\n", kr);
-        (void) (*interface)->USBInterfaceClose(interface);
-        (void) (*interface)->Release(interface);
+        write->busy = 0;
+        CloseInterface(device);
     }
     
     return kr;
 }
 
-void ReadFromBulkPipe(IOUSBInterfaceInterface **interface);
-
 void BulkReadCompletion(void *refCon, IOReturn result, void *arg0)
 {
-    IOUSBInterfaceInterface **interface = (IOUSBInterfaceInterface **) refCon;
+    PeakRxTransfer *transfer = (PeakRxTransfer *) refCon;
+    MyPrivateData *device = (MyPrivateData *) transfer->userData;
     UInt64 numBytesRead = (UInt64) arg0;
     
-#ifdef DEBUG
-    printf("Asynchronous bulk read complete (%ld)\n", (long)numBytesRead);
-#endif
+    // the driver decodes straight out of the transfer buffer
+    PeakTransportReadComplete(&device->transport, transfer, result, (UInt32)numBytesRead);
     
-    if (result != kIOReturnSuccess) {
-        printf("Error from async bulk read (%08x)\n", result);
-        (void) (*interface)->USBInterfaceClose(interface);
-        (void) (*interface)->Release(interface);
-        return;
-    }
-    
-    if(numBytesRead > 0) {
-        DecodeMessages();
-#ifdef DEBUG
-        printf("Decoded message\n");
-        int i;
-        for (i = 0; i < numBytesRead; i++) {
-            printf("%02X ", (UInt8)gBufferReceive[i]);
-            if(i == 31) printf("\n");
-        }
-        printf("\n");
-#endif        
-    }
-    
-    ReadFromBulkPipe(interface);
-}
-
-void ReadFromBulkPipe(IOUSBInterfaceInterface **interface)
-{
-    UInt32 numBytesRead = 64;
-    IOReturn kr = (*interface)->ReadPipeAsync(interface, kPeakUsbBulkReadPipe, gBufferReceive, numBytesRead, BulkReadCompletion, (void*)interface);
-    
-    if (kr != kIOReturnSuccess)
-    {
-        printf("Unable to read async interface (%08x)\n", kr);
-    }
+    if (result != kIOReturnSuccess)
+        CloseInterface(device);
 }
 
-#pragma mark - Entry points and USB device handling stuff
-
-IOReturn PeakInit(UInt16 bitrate)
+static IOReturn ReadFromBulkPipe(PeakTransport *transport, PeakRxTransfer *transfer)
 {
-    gLastBitrate = bitrate;
-    
-    if(gInterface == NULL)
+    MyPrivateData *device = transport->context;
+    IOUSBInterfaceInterface **interface = device->interface;
+    if (interface == NULL)
         return kIOReturnNoDevice;
     
-    IOUSBInterfaceInterface **interface = gInterface;
-    PCAN_USB_PARAM br = { 1, 2, { (bitrate & 0xff), (bitrate >> 8), 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } };
-    
-    IOReturn kr = WriteToCtrlPipe(interface, PCAN_CTRL_CANOFF);
-    if (kr != kIOReturnSuccess)
-    {
-        printf("Unable to perform PCAN_CTRL_CANOFF (%08x)\n", kr);
-        return kr;
-    }
-    
-    kr = WriteToCtrlPipe(interface, PCAN_CTRL_SJA1000INIT);
-    if (kr != kIOReturnSuccess)
-    {
-        printf("Unable to perform PCAN_CTRL_SJA1000INIT (%08x)\n", kr);
-        return kr;
-    }
-    
-    kr = WriteToCtrlPipe(interface, br);
-    if (kr != kIOReturnSuccess)
-    {
-        printf("Unable to perform PCAN_CTRL_BITRATE_... (%08x)\n", kr);
-        return kr;
-    }
-    
-    kr = WriteToCtrlPipe(interface, PCAN_CTRL_SILENTOFF);
-    if (kr != kIOReturnSuccess)
-    {
-        printf("Unable to perform PCAN_CTRL_SILENTOFF (%08x)\n", kr);
-        return kr;
-    }
-    
-    kr = WriteToCtrlPipe(interface, PCAN_CTRL_EXTVCCOFF);
-    if (kr != kIOReturnSuccess)
-    {
-        printf("Unable to perform PCAN_CTRL_EXTVCCOFF (%08x)\n", kr);
-        return kr;
-    }
+    transfer->userData = device;
     
-    kr = WriteToCtrlPipe(interface, PCAN_CTRL_CANON);
-    if (kr != kIOReturnSuccess)
-    {
-        printf("Unable to perform PCAN_CTRL_CANON (%08x)\n", kr);
-        return kr;
-    }
-    
-    return kr;
+    return (*interface)->ReadPipeAsync(interface, kPeakUsbBulkReadPipe, transfer->buffer, sizeof(transfer->buffer), BulkReadCompletion, (void*)transfer);
 }
 
+#pragma mark - USB device handling stuff
+
 IOReturn ConfigureDevice(IOUSBDeviceInterface **dev)
 {
     UInt8 numConfig;
@@ -475,8 +230,9 @@ IOReturn ConfigureDevice(IOUSBDeviceInterface **dev)
     return kIOReturnSuccess;
 }
 
-IOReturn FindInterfaces(IOUSBDeviceInterface **device)
+IOReturn FindInterfaces(MyPrivateData *privateDataRef)
 {
+    IOUSBDeviceInterface **device = privateDataRef->deviceInterface;
     IOReturn kr;
     IOUSBFindInterfaceRequest request;
     io_iterator_t iterator;
@@ -630,24 +386,19 @@ IOReturn FindInterfaces(IOUSBDeviceInterface **device)
         printf("Asynchronous event source added to run loop\n");
         
         // set interface before init
-        gInterface = interface;
+        privateDataRef->interface = interface;
         
-        kr = PeakInit(gLastBitrate);
+        // init the adapter and start reading from the bulk input interface
+        kr = PeakTransportAttached(&privateDataRef->transport);
         
         if (kr != kIOReturnSuccess)
         {
+            privateDataRef->interface = NULL;
             (void) (*interface)->USBInterfaceClose(interface);
             (void) (*interface)->Release(interface);
             break;
         }
         
-        ReadFromCtrlPipe(interface, PCAN_CTRL_READ_SNR);
-        ReadFromCtrlPipe(interface, PCAN_CTRL_READ_QUARTZ);
-        ReadFromCtrlPipe(interface, PCAN_CTRL_READ_DEVICENO);
-        ReadFromCtrlPipe(interface, PCAN_CTRL_READ_BITRATE);
-        
-        ReadFromBulkPipe(interface); // start reading from the bulk input interface
-        
         //just use first interface, so exit loop
         break;
     }
@@ -655,6 +406,48 @@ IOReturn FindInterfaces(IOUSBDeviceInterface **device)
 }
 
 
+//================================================================================================
+//
+//	DeviceThread
+//
+//	The completions of an adapter are delivered on the run loop of its own thread, which opens the
+//	interface and runs until the adapter is removed or the transport stops.
+//
+//================================================================================================
+static void *DeviceThread(void *arg)
+{
+    MyPrivateData *privateDataRef = (MyPrivateData *) arg;
+    
+    privateDataRef->runLoop = CFRunLoopGetCurrent();
+    
+    if (FindInterfaces(privateDataRef) == kIOReturnSuccess)
+    {
+        // woken up by StopDevice, the timeout covers a stop before the run loop was entered
+        while (!privateDataRef->stopping)
+            CFRunLoopRunInMode(kCFRunLoopDefaultMode, 1.0, false);
+        
+        CloseInterface(privateDataRef);
+        PeakTransportDetached(&privateDataRef->transport);
+    }
+    return NULL;
+}
+
+static void StopDevice(MyPrivateData *privateDataRef)
+{
+    int i;
+    
+    privateDataRef->stopping = 1;
+    if (privateDataRef->runLoop)
+        CFRunLoopStop(privateDataRef->runLoop);
+    pthread_join(privateDataRef->thread, NULL);
+    
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+    {
+        if (gDevices[i] == privateDataRef)
+            gDevices[i] = NULL;
+    }
+}
+
 //================================================================================================
 //
 //	DeviceNotification
@@ -679,12 +472,13 @@ void DeviceNotification(void *refCon, io_service_t service, natural_t messageTyp
         // Free the data we're no longer using now that the device is going away
         CFRelease(privateDataRef->deviceName);
         
+        // the interface is closed on the adapter's own thread
+        StopDevice(privateDataRef);
+        
         if (privateDataRef->deviceInterface) {
             kr = (*privateDataRef->deviceInterface)->Release(privateDataRef->deviceInterface);
         }
         
-        CFNotificationCenterPostNotification (gNotificationCenter, CFSTR("CanDevice"), NULL, NULL, true);
-        
         kr = IOObjectRelease(privateDataRef->notification);
         
         free(privateDataRef);
@@ -714,6 +508,7 @@ void DeviceAdded(void *refCon, io_iterator_t iterator)
     IOCFPlugInInterface	**plugInInterface = NULL;
     SInt32				score;
     HRESULT 			res;
+    int                 i;
     
     while ((usbDevice = IOIteratorNext(iterator)))
     {
@@ -782,7 +577,20 @@ void DeviceAdded(void *refCon, io_iterator_t iterator)
             continue;
         }
         
-        kr = FindInterfaces(privateDataRef->deviceInterface);
+        privateDataRef->transport = gPeakIOKitTransport;
+        privateDataRef->transport.context = privateDataRef;
+        
+        for (i = 0; i < PEAK_MAX_CHANNELS && gDevices[i] != NULL; i++)
+            ;
+        
+        if (i == PEAK_MAX_CHANNELS || pthread_create(&privateDataRef->thread, NULL, DeviceThread, privateDataRef) != 0)
+        {
+            printf("Unable to start a thread for the device\n");
+            (void) (*privateDataRef->deviceInterface)->USBDeviceClose(privateDataRef->deviceInterface);
+            (void) (*privateDataRef->deviceInterface)->Release(privateDataRef->deviceInterface);
+            continue;
+        }
+        gDevices[i] = privateDataRef;
         
         // Register for an interest notification of this device being removed. Use a reference to our
         // private data as the refCon which will be passed to the notification callback.
@@ -798,80 +606,25 @@ void DeviceAdded(void *refCon, io_iterator_t iterator)
             printf("IOServiceAddInterestNotification returned 0x%08x.\n", kr);
         }
         
-        // Notify AppDelegate to remove the 'no device' info and display the message counter
-        CFNotificationCenterPostNotification (gNotificationCenter, CFSTR("CanDevice"), &gMsgCounter, NULL, true);
-        
         // Done with this USB device; release the reference added by IOIteratorNext
         kr = IOObjectRelease(usbDevice);
     }
 }
 
-IOReturn PeakSend(CanMsg* msg)
-{
-    int i;
-    CanId tc;
-    tc.ul = msg->canid.ul;
-    bzero(gBufferSend, sizeof(gBufferSend));
-    UInt8* ucMsgPtr = (UInt8*)&gBufferSend[0];
-    
-    UInt8* pucStatusLen;
-	UInt8* pucMsgCountPtr;
-    
-    *ucMsgPtr++ = 2; // starts with a magic value
-    pucMsgCountPtr = ucMsgPtr++;
-    pucStatusLen = ucMsgPtr++;
-    *pucStatusLen = msg->len & STLN_DATA_LENGTH;
-    
-    if (msg->rtr)
-        *pucStatusLen |= STLN_RTR; // add RTR flag
-    
-    if (msg->ext)
-    {
-        *pucStatusLen |= STLN_EXTENDED_ID;
-        tc.ul <<= 3;
-        *ucMsgPtr++ = tc.uc[0];
-        *ucMsgPtr++ = tc.uc[1];
-        *ucMsgPtr++ = tc.uc[2];
-        *ucMsgPtr++ = tc.uc[3];
-    }
-    else
-    {
-        tc.ul <<= 5;
-        *ucMsgPtr++ = tc.uc[0];
-        *ucMsgPtr++ = tc.uc[1];
-    }
-    
-    if (!msg->rtr)
-    {
-        for(i = 0; i < msg->len; i++)
-            *ucMsgPtr++ = msg->data[i];
-    }
-    
-    // FIXME this part is somewhat hinky, I could not fully recover the linux driver functionality here
-    if(gTelegramCount++ > 200) gTelegramCount = 1;
-    *ucMsgPtr++ = gTelegramCount;
-    *pucMsgCountPtr = 1;
-    *ucMsgPtr++ = 0;
-    
-    if(gInterface)
-        WriteToBulkPipe(gInterface);
-    
-    return kIOReturnSuccess;
-}
+#pragma mark - Transport
 
 //================================================================================================
-//	PeakStop
+//	IOKitStop
 //================================================================================================
-IOReturn PeakStop(void)
+static void IOKitStop(PeakTransport *transport)
 {
     CFRunLoopStop(gRunLoop);
-    return kIOReturnSuccess;
 }
 
 //================================================================================================
-//	PeakStart
+//	IOKitRun
 //================================================================================================
-IOReturn PeakStart(void)
+static IOReturn IOKitRun(PeakTransport *transport)
 {
     CFMutableDictionaryRef 	matchingDict;
     CFRunLoopSourceRef		runLoopSource;
@@ -879,6 +632,7 @@ IOReturn PeakStart(void)
     kern_return_t			kr;
     SInt32					usbVendor = kPeakVendorID;
     SInt32					usbProduct = kPeakProductID;
+    int                     i;
     
     fprintf(stderr, "Looking for devices matching vendor ID=%d and product ID=%d.\n", (int)usbVendor, usbProduct);
     
@@ -917,8 +671,6 @@ IOReturn PeakStart(void)
                          numberRef);
     CFRelease(numberRef);
     numberRef = NULL;
-
-    gNotificationCenter = CFNotificationCenterGetLocalCenter();
     
     // Create a notification port and add its run loop event source to our run loop
     // This is how async notifications get set up.
@@ -945,7 +697,26 @@ IOReturn PeakStart(void)
     fprintf(stderr, "Starting run loop.\n");
     
     CFRunLoopRun();
+    
+    // the adapters' threads end with the transport
+    for (i = 0; i < PEAK_MAX_CHANNELS; i++)
+    {
+        if (gDevices[i])
+            StopDevice(gDevices[i]);
+    }
         
     fprintf(stderr, "Stopped run loop.\n");
     return kIOReturnSuccess;
 }
+
+PeakTransport gPeakIOKitTransport = {
+    "IOKit",
+    IOKitRun,
+    IOKitStop,
+    WriteToCtrlPipe,
+    ReadFromCtrlPipe,
+    ReadFromBulkPipe,
+    WriteToBulkPipe,
+    NULL,
+    NULL
+};
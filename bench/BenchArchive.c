@@ -0,0 +1,181 @@
+/*
+    File:           BenchArchive.c
+
+    Description:    Compression ratio and encode and decode throughput of the archive format against
+                    capture records.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "PeakBench.h"
+#include "PeakTest.h"
+#include "PeakArchive.h"
+#include "PeakCapture.h"
+#include "PeakBatch.h"
+
+// A trace of 120 periodic identifiers, a third of them extended, every 1 to 100 ms with 2 us of jitter;
+// the payloads are a counter, slowly moving signals and a checksum byte that changes at random. The
+// records cases are the capture format as reference: converting the frames into 24 byte records and
+// deflating those. The archive cases write the trace to a scratch archive in pieces of 4096 frames as
+// the capture writer does and read all chunks back, with these payloads and with random ones.
+
+#define TRACE           262144      // four chunks
+#define IDS             120
+
+static CanMsg gTrace[TRACE];
+static CanMsg gRead[PEAK_ARCHIVE_CHUNK_FRAMES];
+static PeakCaptureRecord gRecords[PEAK_CAPTURE_MERGE_FRAMES];
+
+static void BuildTrace(int randomPayloads)
+{
+    UInt64 due[IDS], period[IDS], seed = 1, ts;
+    UInt32 i, id, next, counter[IDS];
+    
+    for (id = 0; id < IDS; id++)
+    {
+        period[id] = (1 + PeakTestNext(&seed) % 100) * 1000000ULL;
+        due[id] = 1436509052000000000ULL + PeakTestNext(&seed) % period[id];
+        counter[id] = 0;
+    }
+    
+    for (i = 0; i < TRACE; i++)
+    {
+        CanMsg* msg = &gTrace[i];
+        
+        for (id = 0, next = 0; id < IDS; id++)
+            next = due[id] < due[next] ? id : next;
+        ts = due[next];
+        due[next] += period[next];
+        
+        bzero(msg, sizeof(CanMsg));
+        msg->ext = next % 3 == 0;
+        msg->canid.ul = msg->ext ? 0x18da0000 + next : 0x100 + next;
+        msg->len = 8;
+        msg->ts = ts + PeakTestNext(&seed) % 2000;
+        msg->mono = msg->ts;
+        if (randomPayloads)
+        {
+            msg->ldata = PeakTestNext(&seed) << 32;
+            msg->ldata |= PeakTestNext(&seed);
+            continue;
+        }
+        msg->data[0] = (UInt8)counter[next]++;
+        msg->data[1] = (UInt8)(counter[next] >> 6);
+        msg->data[2] = (UInt8)(next * 7);
+        msg->data[3] = (UInt8)(counter[next] >> 10);
+        msg->data[7] = (UInt8)PeakTestNext(&seed);
+    }
+}
+
+static void BenchRecords(void)
+{
+    static UInt8 packed[PEAK_CAPTURE_MERGE_FRAMES * sizeof(PeakCaptureRecord) + 1024];
+    PeakBenchRun bench;
+    UInt64 i, rounds = PeakBenchCount(200), frames = 0, bytes = 0;
+    UInt32 j, offset;
+    uLongf size;
+    
+    PeakBenchBegin(&bench, "archive", "records");
+    for (i = 0; i < rounds * (TRACE / PEAK_CAPTURE_MERGE_FRAMES); i++)
+    {
+        offset = (UInt32)(i % (TRACE / PEAK_CAPTURE_MERGE_FRAMES)) * PEAK_CAPTURE_MERGE_FRAMES;
+        for (j = 0; j < PEAK_CAPTURE_MERGE_FRAMES; j++)
+            PeakCaptureRecordFromMsg(&gRecords[j], &gTrace[offset + j]);
+        frames += PEAK_CAPTURE_MERGE_FRAMES;
+    }
+    PeakBenchEnd(&bench, frames, "frame", "\"bytes_per_frame\": %u", (UInt32)sizeof(PeakCaptureRecord));
+    
+    PeakBenchBegin(&bench, "archive", "deflate-records");
+    for (i = 0, frames = 0; i < TRACE / PEAK_CAPTURE_MERGE_FRAMES; i++)
+    {
+        for (j = 0; j < PEAK_CAPTURE_MERGE_FRAMES; j++)
+            PeakCaptureRecordFromMsg(&gRecords[j], &gTrace[i * PEAK_CAPTURE_MERGE_FRAMES + j]);
+        size = sizeof(packed);
+        compress2(packed, &size, (const Bytef*)gRecords, sizeof(gRecords), PEAK_ARCHIVE_LEVEL);
+        bytes += size;
+        frames += PEAK_CAPTURE_MERGE_FRAMES;
+    }
+    PeakBenchEnd(&bench, frames, "frame", "\"bytes_per_frame\": %.2f", (double)bytes / frames);
+}
+
+static void BenchWrite(const char* name, const char* path)
+{
+    PeakArchiveWriter writer;
+    PeakArchiveStats stats;
+    PeakBenchRun bench;
+    UInt32 i;
+    
+    PeakBenchBegin(&bench, "archive", name);
+    if (PeakArchiveWriterOpen(&writer, path, CAN_BAUD_1M, 0, 0) != kIOReturnSuccess)
+        return;
+    for (i = 0; i < TRACE; i += PEAK_CAPTURE_MERGE_FRAMES)
+        PeakArchiveWriterAppend(&writer, &gTrace[i], PEAK_CAPTURE_MERGE_FRAMES);
+    PeakArchiveWriterFlush(&writer);
+    stats = writer.stats;
+    PeakArchiveWriterClose(&writer);
+    PeakBenchEnd(&bench, stats.frames, "frame", "\"chunks\": %llu, \"bytes_per_frame\": %.2f, \"columns_per_frame\": %.2f, \"ratio_to_records\": %.2f, \"encode_ns_per_frame\": %.1f",
+                 (unsigned long long)stats.chunks, (double)stats.bytes / stats.frames, (double)stats.columnBytes / stats.frames,
+                 (double)stats.rawBytes / stats.bytes, (double)stats.encodeNs / stats.frames);
+}
+
+static void BenchRead(const char* name, const char* path)
+{
+    PeakArchiveReader reader;
+    PeakBenchRun bench;
+    UInt64 i, rounds = PeakBenchCount(5), frames = 0, mismatches = 0;
+    UInt32 c, j, count;
+    
+    if (PeakArchiveOpen(&reader, path) != kIOReturnSuccess)
+        return;
+    PeakBenchBegin(&bench, "archive", name);
+    for (i = 0; i < rounds; i++)
+    {
+        for (c = 0; c < reader.chunkCount; c++)
+        {
+            if (PeakArchiveReadChunk(&reader, c, gRead, &count) != kIOReturnSuccess)
+                break;
+            for (j = 0; j < count; j += 997)
+                mismatches += gRead[j].ldata != gTrace[reader.directory[c].firstFrame + j].ldata;
+            frames += count;
+        }
+    }
+    PeakBenchEnd(&bench, frames, "frame", "\"chunks\": %u, \"mismatches\": %llu", reader.chunkCount, (unsigned long long)mismatches);
+    PeakArchiveClose(&reader);
+}
+
+void BenchArchive(void)
+{
+    char path[256];
+    
+    PeakTestTempPath(path, sizeof(path), "bench.peakarc");
+    
+    BuildTrace(0);
+    BenchRecords();
+    BenchWrite("encode", path);
+    BenchRead("decode", path);
+    
+    BuildTrace(1);
+    BenchWrite("encode-random-payloads", path);
+    BenchRead("decode-random-payloads", path);
+    
+    unlink(path);
+}
@@ -0,0 +1,172 @@
+/*
+    File:           BenchBatch.c
+
+    Description:    Frames per second delivered to a consumer that is woken for every frame, as before
+                    the batcher, and for batches.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "PeakBench.h"
+#include "PeakBatch.h"
+
+// The consumer is woken through a semaphore as the main queue would be by dispatch_async, and applies
+// what it got to a table of the log window's size, evicting from the front as -appendMsg: does.
+// Per frame: one wakeup, one drain of a single frame and one eviction for every frame, as before the
+// batcher. Batched: the batcher's flushes and the display tick, one bulk eviction per batch. The
+// flushes are not spaced by a tick here, a tick of 33 ms would only measure the ring's capacity.
+
+#define WINDOW          1000
+#define PER_READ        5       // frames of one bulk read
+
+typedef struct {
+    PeakRing    ring;
+    PeakMerge   merge;
+    PeakBatcher batcher;
+    sem_t       wake;
+    int         batched;
+    UInt64      frames;
+    UInt64      wakeups;
+    CanMsg      window[WINDOW];
+    UInt32      count;
+} Delivery;
+
+static void Flush(void* refCon)
+{
+    sem_post(&((Delivery*)refCon)->wake);
+}
+
+static void* Producer(void* arg)
+{
+    Delivery* delivery = arg;
+    UInt64 i, now;
+    CanMsg* msg;
+    UInt32 j;
+    
+    for (i = 0; i < delivery->frames; i += PER_READ)
+    {
+        now = PeakMonotonicNs();
+        for (j = 0; j < PER_READ; j++)
+        {
+            while ((msg = PeakRingReserve(&delivery->ring)) == NULL)
+                sched_yield();
+            bzero(msg, sizeof(CanMsg));
+            msg->canid.ul = (UInt32)(i + j);
+            msg->len = 8;
+            msg->mono = now;
+            PeakRingCommit(&delivery->ring);
+            if (!delivery->batched)
+                sem_post(&delivery->wake);
+        }
+        if (delivery->batched)
+            PeakBatcherCompletion(&delivery->batcher, now);
+    }
+    return NULL;
+}
+
+// the new frames go to the end of the table, the oldest ones make room for them
+static void Apply(Delivery* delivery, const CanMsg* batch, UInt32 count)
+{
+    UInt32 evict;
+    
+    if (count > WINDOW)
+    {
+        batch += count - WINDOW;
+        count = WINDOW;
+    }
+    evict = delivery->count + count > WINDOW ? delivery->count + count - WINDOW : 0;
+    if (evict)
+    {
+        memmove(delivery->window, delivery->window + evict, (delivery->count - evict) * sizeof(CanMsg));
+        delivery->count -= evict;
+    }
+    memcpy(delivery->window + delivery->count, batch, count * sizeof(CanMsg));
+    delivery->count += count;
+}
+
+static void BenchDelivery(const char* name, int batched)
+{
+    static Delivery delivery;
+    static CanMsg batch[PEAK_BATCH_MAX_FRAMES];
+    struct timespec deadline;
+    PeakBenchRun bench;
+    pthread_t thread;
+    UInt64 seen = 0, now;
+    UInt32 n;
+    
+    bzero(&delivery, sizeof(Delivery));
+    PeakRingCreate(&delivery.ring, PEAK_RING_DEFAULT_CAPACITY);
+    PeakMergeInit(&delivery.merge, PEAK_MERGE_DEFAULT_WINDOW_NS);
+    PeakMergeAttach(&delivery.merge, 0, &delivery.ring);
+    PeakBatcherInit(&delivery.batcher, &delivery.merge, Flush, &delivery);
+    PeakBatcherSetTick(&delivery.batcher, 0);
+    sem_init(&delivery.wake, 0, 0);
+    delivery.batched = batched;
+    delivery.frames = PeakBenchCount(batched ? 20000000 : 2000000);
+    
+    PeakBenchBegin(&bench, "batch", name);
+    pthread_create(&thread, NULL, Producer, &delivery);
+    while (seen < delivery.frames)
+    {
+        if (batched)
+        {
+            // the display tick picks up whatever the flushes left
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += PEAK_BATCH_DEFAULT_TICK_NS;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            while (sem_timedwait(&delivery.wake, &deadline) != 0 && errno == EINTR)
+                ;
+        }
+        else
+        {
+            sem_wait(&delivery.wake);
+        }
+        delivery.wakeups++;
+        
+        now = PeakMonotonicNs();
+        do
+        {
+            n = PeakBatcherDrain(&delivery.batcher, batch, batched ? PEAK_BATCH_MAX_FRAMES : 1, now);
+            if (n)
+                Apply(&delivery, batch, n);
+            seen += n;
+        } while (batched && n == PEAK_BATCH_MAX_FRAMES);
+    }
+    pthread_join(thread, NULL);
+    PeakBenchEnd(&bench, seen, "frame", "\"wakeups\": %llu, \"frames_per_wakeup\": %.1f, \"coalesced\": %llu",
+                 (unsigned long long)delivery.wakeups, (double)seen / delivery.wakeups,
+                 (unsigned long long)delivery.batcher.coalesced);
+    
+    sem_destroy(&delivery.wake);
+    PeakRingDestroy(&delivery.ring);
+}
+
+void BenchBatch(void)
+{
+    BenchDelivery("per-frame", 0);
+    BenchDelivery("batched", 1);
+}
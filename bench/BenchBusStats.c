@@ -0,0 +1,134 @@
+/*
+    File:           BenchBusStats.c
+
+    Description:    The per identifier statistics on a 1 Mbit/s bus at full load with 2000 identifiers,
+                    and polling them.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "PeakBench.h"
+#include "PeakTest.h"
+#include "PeakBusStats.h"
+#include "PeakBatch.h"
+
+// A 1 Mbit/s bus at full load with 2000 identifiers, 1500 standard and 500 extended ones, the frames back
+// to back with the time each takes on the wire and the identifiers in a shuffled order. The update cases
+// feed the statistics as the decoder does and report how much of a CPU that load takes; the snapshot
+// case is one poll of the load and of all 2000 identifiers, as the UI does ten times a second.
+
+#define IDS             2000
+#define EXT_IDS         500
+#define SEQUENCE        65536
+
+static CanMsg gFrames[IDS];
+static UInt16 gSequence[SEQUENCE];
+static PeakIdStats gIds[PEAK_BUS_STD_IDS + PEAK_BUS_EXT_MAX];
+
+static void BuildBus(UInt32 first, UInt32 count)
+{
+    UInt64 seed = 1;
+    UInt32 i;
+    
+    bzero(gFrames, sizeof(gFrames));
+    for (i = 0; i < IDS; i++)
+    {
+        gFrames[i].ext = i >= IDS - EXT_IDS;
+        gFrames[i].canid.ul = gFrames[i].ext ? 0x18da0000 + (i - (IDS - EXT_IDS)) * 97 : i;
+        gFrames[i].len = (UInt8)(1 + i % 8);
+    }
+    for (i = 0; i < SEQUENCE; i++)
+        gSequence[i] = (UInt16)(first + PeakTestNext(&seed) % count);
+}
+
+// the statistics of count identifiers from first on, for as long as the bus takes for the frames
+static void BenchUpdate(const char* name, UInt32 first, UInt32 count)
+{
+    PeakBusStats* stats;
+    PeakBusLoad load;
+    PeakBenchRun bench;
+    UInt64 i, mono = 1000000000ULL, frames = PeakBenchCount(20000000), elapsedNs;
+    CanMsg* msg;
+    
+    if (PeakBusStatsCreate(&stats) != kIOReturnSuccess)
+        return;
+    PeakBusStatsSetBitrate(stats, CAN_BAUD_1M);
+    BuildBus(first, count);
+    
+    PeakBenchBegin(&bench, "busstats", name);
+    for (i = 0; i < frames; i++)
+    {
+        msg = &gFrames[gSequence[i & (SEQUENCE - 1)]];
+        msg->mono = mono;
+        PeakBusStatsUpdate(stats, msg);
+        mono += PeakBusStatsFrameBits(msg) * 1000ULL;
+    }
+    elapsedNs = PeakMonotonicNs() - bench.startNs;
+    PeakBusStatsGetLoad(stats, mono, &load);
+    PeakBenchEnd(&bench, frames, "frame", "\"ids\": %u, \"load\": %.1f, \"simulated_seconds\": %.1f, \"bus_frames_per_sec\": %.0f, \"cpu_share\": %.5f",
+                 load.ids, load.load, (mono - 1000000000ULL) / 1e9, frames * 1e9 / (mono - 1000000000ULL),
+                 (double)elapsedNs / (mono - 1000000000ULL));
+    
+    PeakBusStatsFree(stats);
+}
+
+static void BenchSnapshot(void)
+{
+    PeakBusStats* stats;
+    PeakBusLoad load;
+    PeakBenchRun bench;
+    UInt64 i, mono = 1000000000ULL, snapshots = PeakBenchCount(20000), elapsedNs;
+    double sum = 0;
+    UInt32 ids = 0;
+    CanMsg* msg;
+    
+    if (PeakBusStatsCreate(&stats) != kIOReturnSuccess)
+        return;
+    PeakBusStatsSetBitrate(stats, CAN_BAUD_1M);
+    BuildBus(0, IDS);
+    for (i = 0; i < 1000000; i++)
+    {
+        msg = &gFrames[i < IDS ? i : gSequence[i & (SEQUENCE - 1)]];
+        msg->mono = mono;
+        PeakBusStatsUpdate(stats, msg);
+        mono += PeakBusStatsFrameBits(msg) * 1000ULL;
+    }
+    
+    PeakBenchBegin(&bench, "busstats", "snapshot-2000-ids");
+    for (i = 0; i < snapshots; i++)
+    {
+        PeakBusStatsGetLoad(stats, mono, &load);
+        ids = PeakBusStatsGetIds(stats, mono, gIds, PEAK_BUS_STD_IDS + PEAK_BUS_EXT_MAX);
+        sum += gIds[i % ids].rate;
+    }
+    elapsedNs = PeakMonotonicNs() - bench.startNs;
+    PeakBenchEnd(&bench, snapshots, "snapshot", "\"ids\": %u, \"cpu_share_at_10hz\": %.6f, \"mean_rate\": %.1f",
+                 ids, (double)elapsedNs / snapshots * 10 / 1e9, sum / snapshots);
+    
+    PeakBusStatsFree(stats);
+}
+
+void BenchBusStats(void)
+{
+    BenchUpdate("update-full-load-1mbit", 0, IDS);
+    BenchUpdate("update-std-only", 0, IDS - EXT_IDS);
+    BenchUpdate("update-ext-only", IDS - EXT_IDS, EXT_IDS);
+    BenchSnapshot();
+}
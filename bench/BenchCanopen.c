@@ -0,0 +1,206 @@
+/*
+    File:           BenchCanopen.c
+
+    Description:    The CANopen decoder over a synthetic bus trace of 16 drives, tracking and describing
+                    every frame.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "PeakBench.h"
+#include "PeakCanopen.h"
+
+// A synthetic CANopen bus of 16 drives: every cycle a SYNC, four TPDOs and an RPDO per node and a
+// heartbeat from one node, every tenth cycle an EMCY, and in between the master reads an object from
+// each node in turn, expedited, segmented or as a block upload of 32 segments. The trace is built once;
+// the track case follows the SDO transfers alone, the decode cases also describe every frame into a
+// preallocated line, with the PDO mappings loaded and without them.
+
+#define NODES           16
+#define TRACE           65536
+
+static CanMsg gTrace[TRACE];
+static UInt32 gTraceCount = 0;
+static UInt32 gTransfers = 0;
+
+static CanMsg* Add(UInt32 canid, UInt8 len)
+{
+    CanMsg* msg = &gTrace[gTraceCount++];
+    
+    bzero(msg, sizeof(CanMsg));
+    msg->canid.ul = canid;
+    msg->len = len;
+    return msg;
+}
+
+static void Sdo(UInt32 canid, UInt8 cs, UInt16 index, UInt8 subindex, UInt32 value)
+{
+    CanMsg* msg = Add(canid, 8);
+    
+    msg->data[0] = cs;
+    msg->data[1] = (UInt8)index;
+    msg->data[2] = (UInt8)(index >> 8);
+    msg->data[3] = subindex;
+    memcpy(&msg->data[4], &value, 4);
+}
+
+static void Transfer(UInt32 node, UInt32 kind)
+{
+    UInt32 i;
+    
+    switch (kind)
+    {
+        case 0: // expedited upload
+            Sdo(0x600 + node, 0x40, 0x1018, 1, 0);
+            Sdo(0x580 + node, 0x43, 0x1018, 1, 0x00000175);
+            break;
+        case 1: // segmented upload of 20 bytes
+            Sdo(0x600 + node, 0x40, 0x1008, 0, 0);
+            Sdo(0x580 + node, 0x41, 0x1008, 0, 20);
+            for (i = 0; i < 3; i++)
+            {
+                Sdo(0x600 + node, 0x60 | (i & 1) << 4, 0, 0, 0);
+                Add(0x580 + node, 8)->data[0] = (UInt8)((i & 1) << 4 | (i == 2 ? 0x03 : 0));
+            }
+            break;
+        case 2: // block upload of 32 segments
+            Sdo(0x600 + node, 0xA0, 0x1F50, 1, 32);
+            Sdo(0x580 + node, 0xC6, 0x1F50, 1, 224);
+            Sdo(0x600 + node, 0xA3, 0, 0, 0);
+            for (i = 1; i <= 32; i++)
+                Add(0x580 + node, 8)->data[0] = (UInt8)(i | (i == 32 ? 0x80 : 0));
+            Sdo(0x600 + node, 0xA2, 32, 0, 0);
+            Sdo(0x580 + node, 0xC1, 0x5A5A, 0, 0);
+            Sdo(0x600 + node, 0xA1, 0, 0, 0);
+            break;
+    }
+    gTransfers++;
+}
+
+static void BuildTrace(void)
+{
+    UInt32 cycle, node, pdo;
+    CanMsg* msg;
+    
+    for (cycle = 0; gTraceCount < TRACE - 128; cycle++)
+    {
+        Add(0x080, 1)->data[0] = (UInt8)cycle;
+        for (node = 1; node <= NODES; node++)
+        {
+            for (pdo = 0; pdo < 4; pdo++)
+            {
+                msg = Add(0x180 + 0x100 * pdo + node, 8);
+                msg->ldata = (UInt64)cycle * 0x0001000300050007ULL + node;
+            }
+            Add(0x200 + node, 6)->ldata = cycle * 17;
+        }
+        Add(0x700 + cycle % NODES + 1, 1)->data[0] = 0x05;
+        if (cycle % 10 == 0)
+        {
+            msg = Add(0x080 + cycle % NODES + 1, 8);
+            msg->data[0] = 0x10;
+            msg->data[1] = 0x82;
+            msg->data[2] = 0x11;
+        }
+        Transfer(cycle % NODES + 1, cycle % 3);
+    }
+}
+
+static void Map(PeakCanopenDecoder* decoder)
+{
+    static const struct { const char* name; UInt8 bits; UInt8 type; } tpdo[4][4] = {
+        { { "statusword", 16, PEAK_CANOPEN_UNSIGNED }, { "position", 32, PEAK_CANOPEN_SIGNED }, { "mode", 8, PEAK_CANOPEN_SIGNED }, { "errors", 8, PEAK_CANOPEN_UNSIGNED } },
+        { { "velocity", 32, PEAK_CANOPEN_SIGNED }, { "torque", 16, PEAK_CANOPEN_SIGNED }, { "current", 16, PEAK_CANOPEN_UNSIGNED } },
+        { { "temperature", 32, PEAK_CANOPEN_REAL }, { "voltage", 32, PEAK_CANOPEN_REAL } },
+        { { "inputs", 32, PEAK_CANOPEN_UNSIGNED }, { "analog1", 16, PEAK_CANOPEN_SIGNED }, { "analog2", 16, PEAK_CANOPEN_SIGNED } },
+    };
+    PeakCanopenField fields[4], rpdo;
+    UInt32 node, pdo, i, offset;
+    
+    bzero(&rpdo, sizeof(rpdo));
+    strcpy(rpdo.name, "controlword");
+    rpdo.bits = 16;
+    for (node = 1; node <= NODES; node++)
+    {
+        for (pdo = 0; pdo < 4; pdo++)
+        {
+            bzero(fields, sizeof(fields));
+            for (i = 0, offset = 0; i < 4 && tpdo[pdo][i].name; i++)
+            {
+                strcpy(fields[i].name, tpdo[pdo][i].name);
+                fields[i].offset = (UInt8)offset;
+                fields[i].bits = tpdo[pdo][i].bits;
+                fields[i].type = tpdo[pdo][i].type;
+                offset += fields[i].bits;
+            }
+            PeakCanopenSetMapping(decoder, (UInt16)(0x180 + 0x100 * pdo + node), fields, i);
+        }
+        PeakCanopenSetMapping(decoder, (UInt16)(0x200 + node), &rpdo, 1);
+    }
+}
+
+static void BenchTrack(void)
+{
+    PeakCanopenDecoder* decoder;
+    PeakBenchRun bench;
+    UInt64 i, frames = PeakBenchCount(50000000), tagged = 0, errors = 0;
+    UInt32 tag;
+    
+    if (PeakCanopenCreate(&decoder) != kIOReturnSuccess)
+        return;
+    PeakBenchBegin(&bench, "canopen", "track");
+    for (i = 0; i < frames; i++)
+    {
+        tag = PeakCanopenTrack(decoder, &gTrace[i % gTraceCount]);
+        tagged += tag != 0;
+        errors += (tag & PEAK_CANOPEN_TAG_ERROR) != 0;
+    }
+    PeakBenchEnd(&bench, frames, "frame", "\"trace_frames\": %u, \"transfers\": %u, \"tagged\": %.3f, \"errors\": %llu",
+                 gTraceCount, gTransfers, (double)tagged / frames, (unsigned long long)errors);
+    PeakCanopenFree(decoder);
+}
+
+static void BenchDescribe(const char* name, int mapped)
+{
+    PeakCanopenDecoder* decoder;
+    char descr[PEAK_CANOPEN_DESCR_MAX];
+    PeakBenchRun bench;
+    UInt64 i, frames = PeakBenchCount(10000000), bytes = 0;
+    
+    if (PeakCanopenCreate(&decoder) != kIOReturnSuccess)
+        return;
+    if (mapped)
+        Map(decoder);
+    PeakBenchBegin(&bench, "canopen", name);
+    for (i = 0; i < frames; i++)
+        bytes += PeakCanopenDecode(decoder, &gTrace[i % gTraceCount], descr, sizeof(descr));
+    PeakBenchEnd(&bench, frames, "frame", "\"mappings\": %u, \"bytes_per_frame\": %.1f", decoder->pdoCount, (double)bytes / frames);
+    PeakCanopenFree(decoder);
+}
+
+void BenchCanopen(void)
+{
+    if (gTraceCount == 0)
+        BuildTrace();
+    
+    BenchTrack();
+    BenchDescribe("decode-unmapped", 0);
+    BenchDescribe("decode-mapped", 1);
+}
@@ -0,0 +1,88 @@
+/*
+    File:           BenchCapture.c
+
+    Description:    Sustained capture writes in frames and megabytes per second, from one adapter and
+                    from four merged.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "PeakBench.h"
+#include "PeakTest.h"
+#include "PeakCapture.h"
+#include "PeakBatch.h"
+#include "PeakIndex.h"
+
+// The decoder's side appends as fast as the writer takes the frames, it only waits while the ring is
+// nearly full so nothing is dropped. The clock runs from the open to the close, which includes the
+// fsync, so the rate is the one the disk sustains.
+
+#define HEADROOM        1024        // frames left free in every ring
+
+static void BenchSustained(const char* name, UInt32 channels)
+{
+    static PeakCapture capture;
+    PeakCaptureStats stats;
+    PeakBenchRun bench;
+    char path[256], index[300];
+    UInt64 i, frames = PeakBenchCount(4000000);
+    double seconds;
+    UInt32 channel;
+    CanMsg msg;
+    
+    PeakTestTempPath(path, sizeof(path), "capture.pcap");
+    snprintf(index, sizeof(index), "%s%s", path, PEAK_INDEX_SUFFIX);
+    PeakCaptureCreate(&capture);
+    for (channel = 0; channel < channels; channel++)
+        PeakCaptureAddChannel(&capture, channel);
+    bzero(&msg, sizeof(CanMsg));
+    msg.len = 8;
+    
+    PeakBenchBegin(&bench, "capture", name);
+    if (PeakCaptureOpen(&capture, path, 0x0014, 1, 0) != kIOReturnSuccess)
+        return;
+    for (i = 0; i < frames; i++)
+    {
+        channel = (UInt32)(i % channels);
+        while (PeakRingFill(&capture.rings[channel]) > PEAK_CAPTURE_RING_CAPACITY - HEADROOM)
+            sched_yield();
+        msg.canid.ul = 0x100 + (i & 0x3ff);
+        msg.ldata = i;
+        msg.channel = channel;
+        msg.ts = msg.mono = 1000000000ULL + i * 100;
+        PeakCaptureAppend(&capture, &msg);
+    }
+    PeakCaptureClose(&capture);
+    PeakCaptureGetStats(&capture, &stats);
+    seconds = (PeakMonotonicNs() - bench.startNs) / 1e9;
+    PeakBenchEnd(&bench, stats.frames, "frame", "\"mb_per_sec\": %.1f, \"writes\": %llu, \"dropped\": %u, \"errors\": %u",
+                 stats.bytes / seconds / 1e6, (unsigned long long)stats.writes, stats.dropped, stats.errors);
+    
+    unlink(path);
+    unlink(index);
+}
+
+void BenchCapture(void)
+{
+    BenchSustained("sustained-1ch", 1);
+    BenchSustained("sustained-4ch", 4);
+}
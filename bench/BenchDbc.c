@@ -0,0 +1,178 @@
+/*
+    File:           BenchDbc.c
+
+    Description:    Decoding a 1 Mbit/s bus trace with a database of 300 messages, in batches and frame
+                    by frame, and loading the database.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "PeakBench.h"
+#include "PeakTest.h"
+#include "PeakDbc.h"
+#include "PeakBusStats.h"
+
+// A database of 300 messages, 200 standard and 100 extended ones with two to eight signals each, every
+// third message Motorola, every tenth one multiplexed, written to a scratch file and loaded once. The
+// trace is a 1 Mbit/s bus of those messages in a shuffled order, the time each frame takes on the wire
+// added up as in the busstats suite. The batch case decodes it in batches of PEAK_DBC_BATCH frames as the
+// display does, the frame case one frame after the other, and both report signals per second and the
+// share of a CPU the full bus takes.
+
+#define MESSAGES        300
+#define EXT_MESSAGES    100
+#define TRACE           65536
+
+static CanMsg gTrace[TRACE];
+static UInt64 gTraceNs = 0;         // on the wire
+static PeakDbc gDbc;
+
+static UInt32 MessageId(UInt32 m)
+{
+    return m < MESSAGES - EXT_MESSAGES ? 0x100 + m : 0x18f00000 + (m - (MESSAGES - EXT_MESSAGES)) * 256;
+}
+
+static int WriteDatabase(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    UInt32 m, s, signals;
+    
+    if (file == NULL)
+        return 0;
+    fprintf(file, "VERSION \"\"\n\nBU_: ECU\n\n");
+    for (m = 0; m < MESSAGES; m++)
+    {
+        signals = 2 + m % 7;
+        fprintf(file, "BO_ %u Message%u: 8 ECU\n", m < MESSAGES - EXT_MESSAGES ? MessageId(m) : MessageId(m) | PEAK_DBC_EXT, m);
+        for (s = 0; s < signals; s++)
+        {
+            const char* mux = m % 10 == 0 ? (s == 0 ? " M" : s % 2 ? " m1" : " m2") : "";
+            
+            fprintf(file, " SG_ Signal%u%s : %u|8@%c%c (%g,%d) [0|0] \"unit\" Vector__XXX\n", s, mux,
+                    m % 3 == 0 ? s * 8 + 7 : s * 8, m % 3 == 0 ? '0' : '1', s % 2 ? '-' : '+', 0.5 + s, -(int)s);
+        }
+        fprintf(file, "\n");
+    }
+    return fclose(file) == 0;
+}
+
+static void BuildTrace(void)
+{
+    UInt64 seed = 1;
+    UInt32 i, m;
+    
+    for (i = 0; i < TRACE; i++)
+    {
+        m = (UInt32)(PeakTestNext(&seed) % MESSAGES);
+        bzero(&gTrace[i], sizeof(CanMsg));
+        gTrace[i].canid.ul = MessageId(m);
+        gTrace[i].ext = m >= MESSAGES - EXT_MESSAGES;
+        gTrace[i].len = 8;
+        gTrace[i].ldata = PeakTestNext(&seed) << 32;
+        gTrace[i].ldata |= PeakTestNext(&seed);
+        gTrace[i].data[0] = (UInt8)(1 + i % 2);
+        gTraceNs += PeakBusStatsFrameBits(&gTrace[i]) * 1000ULL;
+    }
+}
+
+static void BenchDecodeBatch(void)
+{
+    const PeakDbcBlock* blocks;
+    PeakBenchRun bench;
+    UInt64 i, batches = PeakBenchCount(2000), frames = 0, signals = 0, elapsedNs;
+    UInt32 b, n, offset;
+    double sum = 0;
+    
+    PeakBenchBegin(&bench, "dbc", "decode-batch");
+    for (i = 0; i < batches; i++)
+    {
+        offset = (UInt32)(i * PEAK_DBC_BATCH % TRACE);
+        n = PeakDbcDecodeBatch(&gDbc, gTrace + offset, PEAK_DBC_BATCH, &blocks);
+        for (b = 0; b < n; b++)
+        {
+            sum += blocks[b].values[0];
+            signals += blocks[b].count * gDbc.messages[blocks[b].message].signalCount;
+        }
+        frames += PEAK_DBC_BATCH;
+    }
+    elapsedNs = PeakMonotonicNs() - bench.startNs;
+    PeakBenchEnd(&bench, signals, "signal", "\"frames\": %llu, \"signals_per_sec\": %.0f, \"bus_frames_per_sec\": %.0f, \"cpu_share_1mbit\": %.5f, \"checksum\": %.1f",
+                 (unsigned long long)frames, signals * 1e9 / elapsedNs, TRACE * 1e9 / gTraceNs,
+                 (double)elapsedNs / frames * TRACE / gTraceNs, sum);
+}
+
+static void BenchDecodeFrame(void)
+{
+    double values[8], sum = 0;
+    PeakBenchRun bench;
+    UInt64 i, frames = PeakBenchCount(10000000), signals = 0, elapsedNs;
+    
+    PeakBenchBegin(&bench, "dbc", "decode-frame");
+    for (i = 0; i < frames; i++)
+    {
+        signals += PeakDbcDecodeFrame(&gDbc, &gTrace[i % TRACE], values);
+        sum += isnan(values[1]) ? 0 : values[1];
+    }
+    elapsedNs = PeakMonotonicNs() - bench.startNs;
+    PeakBenchEnd(&bench, signals, "signal", "\"frames\": %llu, \"signals_per_sec\": %.0f, \"cpu_share_1mbit\": %.5f, \"checksum\": %.1f",
+                 (unsigned long long)frames, signals * 1e9 / elapsedNs, (double)elapsedNs / frames * TRACE / gTraceNs, sum);
+}
+
+static void BenchLoad(const char* path)
+{
+    PeakBenchRun bench;
+    UInt64 i, loads = PeakBenchCount(200);
+    UInt32 signalCount = 0;
+    PeakDbc dbc;
+    
+    PeakBenchBegin(&bench, "dbc", "load-300-messages");
+    for (i = 0; i < loads; i++)
+    {
+        if (PeakDbcLoad(&dbc, path) != kIOReturnSuccess)
+            return;
+        signalCount = dbc.signalCount;
+        PeakDbcFree(&dbc);
+    }
+    PeakBenchEnd(&bench, loads, "load", "\"messages\": %u, \"signals\": %u", MESSAGES, signalCount);
+}
+
+void BenchDbc(void)
+{
+    char path[256];
+    
+    PeakTestTempPath(path, sizeof(path), "bench.dbc");
+    if (!WriteDatabase(path) || PeakDbcLoad(&gDbc, path) != kIOReturnSuccess)
+    {
+        fprintf(stderr, "Unable to write %s\n", path);
+        unlink(path);
+        return;
+    }
+    if (gTraceNs == 0)
+        BuildTrace();
+    
+    BenchDecodeBatch();
+    BenchDecodeFrame();
+    BenchLoad(path);
+    
+    unlink(path);
+    PeakDbcFree(&gDbc);
+}
@@ -0,0 +1,284 @@
+/*
+    File:           BenchDecode.c
+
+    Description:    The receive path over fixed corpora of standard, extended, mixed, maximum record and
+                    status heavy telegrams, the timestamps, the transmit encoding and the log line
+                    formatting.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "PeakBench.h"
+#include "PeakTest.h"
+#include "PeakBatch.h"
+#include "PeakTimebase.h"
+#include "PeakSimDevice.h"
+#include "PeakTxQueue.h"
+#include "PeakTransport.h"
+
+// Fixed synthetic corpora of 1024 telegrams each, built once with the test telegram writer:
+//
+//   std            standard identifiers, eight bytes
+//   ext            extended identifiers, eight bytes
+//   mixed          a third extended, every tenth one a remote frame, all lengths
+//   max-records    remote frames with standard identifiers, the most records a telegram holds
+//   status-heavy   every other record an error status record
+//
+// The decode cases feed a corpus through the loopback transport round after round and measure the
+// receive path from the bulk completion to the consumer, DecodeMessages with its timestamps, the ring,
+// the merge and the batcher; the loopback is started inside the measurement so its threads are counted
+// in the cycles. The ticks stand still, so the merge hands the frames on at once. The other cases run
+// on the calling thread: the timebase as the decoder uses it, the encoding of PeakSend and PeakSendBatch,
+// and the cells of a log line with the formats of LogLine.m, for the corpora that have frames to send.
+
+#define TELEGRAMS       1024
+#define CORPORA         5
+
+typedef struct {
+    const char*         name;
+    PeakTestTelegram    telegrams[TELEGRAMS];
+    CanMsg              frames[TELEGRAMS];      // the frames of the corpus, for encoding and formatting
+    UInt64              frameCount;             // in all telegrams
+    UInt64              statusCount;
+} Corpus;
+
+static Corpus gCorpora[CORPORA];
+
+static void CorpusFrame(CanMsg* msg, UInt32 corpus, UInt32 i)
+{
+    bzero(msg, sizeof(CanMsg));
+    msg->canid.ul = 0x100 + (i & 0x3ff);
+    msg->len = 8;
+    msg->ldata = i * 0x0101010101010101ULL;
+    switch (corpus)
+    {
+        case 1:
+            msg->ext = 1;
+            msg->canid.ul = 0x18ff0000 + (i & 0xffff);
+            break;
+        case 2:
+            msg->ext = i % 3 == 0;
+            msg->rtr = i % 10 == 0;
+            msg->len = i % 9;
+            if (msg->ext)
+                msg->canid.ul = 0x18ff0000 + (i & 0xffff);
+            break;
+        case 3:
+            msg->rtr = 1;
+            msg->len = 0;
+            break;
+    }
+}
+
+static void BuildCorpora(void)
+{
+    static const char* names[CORPORA] = { "std", "ext", "mixed", "max-records", "status-heavy" };
+    PeakTestTelegram* telegram;
+    Corpus* corpus;
+    UInt32 c, t, i, f;
+    CanMsg msg;
+    
+    for (c = 0; c < CORPORA; c++)
+    {
+        corpus = &gCorpora[c];
+        corpus->name = names[c];
+        for (t = 0, f = 0; t < TELEGRAMS; t++)
+        {
+            telegram = &corpus->telegrams[t];
+            PeakTestTelegramBegin(telegram, 0);
+            for (i = 0; ; i++, f++)
+            {
+                CorpusFrame(&msg, c, f);
+                if (c == 4 && i % 2 == 1)
+                {
+                    if (!PeakTestTelegramStatus(telegram, 1, 0, 0))
+                        break;
+                    corpus->statusCount++;
+                    continue;
+                }
+                if (!PeakTestTelegramFrame(telegram, &msg, 0))
+                    break;
+                corpus->frameCount++;
+            }
+        }
+        for (i = 0; i < TELEGRAMS; i++)
+            CorpusFrame(&corpus->frames[i], c, i);
+    }
+}
+
+#pragma mark - Decode
+
+typedef struct {
+    const Corpus*   corpus;
+    UInt64          left;           // telegrams still to hand out
+    UInt64          next;
+} Feed;
+
+static UInt32 FeedTelegram(void* refCon, UInt8* buffer)
+{
+    Feed* feed = refCon;
+    const PeakTestTelegram* telegram;
+    
+    if (__atomic_load_n(&feed->left, __ATOMIC_ACQUIRE) == 0)
+        return 0;
+    telegram = &feed->corpus->telegrams[feed->next++ % TELEGRAMS];
+    memcpy(buffer, telegram->data, telegram->length);
+    __atomic_sub_fetch(&feed->left, 1, __ATOMIC_RELEASE);
+    return telegram->length;
+}
+
+static void BenchDecodeCorpus(const Corpus* corpus)
+{
+    static CanMsg batch[4096];
+    static Feed feed;
+    struct timespec pause = { 0, 100000 };
+    PeakRxStats before, after;
+    PeakBenchRun bench;
+    UInt64 rounds = PeakBenchCount(corpus == &gCorpora[3] ? 100 : 200), telegrams = rounds * TELEGRAMS;
+    UInt64 frames, deadline;
+    char name[64];
+    
+    snprintf(name, sizeof(name), "decode-%s", corpus->name);
+    bzero(&feed, sizeof(Feed));
+    feed.corpus = corpus;
+    feed.left = telegrams;
+    
+    PeakBenchBegin(&bench, "decode", name);
+    if (PeakTestStartLoopback(1) != kIOReturnSuccess)
+        return;
+    PeakGetRxStats(&before);
+    PeakLoopbackSetSource(0, FeedTelegram, &feed);
+    deadline = PeakMonotonicNs() + 120000000000ULL;
+    for (PeakGetRxStats(&after); after.telegrams - before.telegrams < telegrams && PeakMonotonicNs() < deadline; PeakGetRxStats(&after))
+    {
+        if (PeakTestReceive(batch, 4096, 0, 0) == 0)
+            nanosleep(&pause, NULL);
+    }
+    frames = after.frames - before.frames; // including the ones the ring had no room for
+    PeakBenchEnd(&bench, frames, "frame", "\"corpus\": \"%s\", \"telegrams\": %llu, \"frames_per_telegram\": %.2f, \"status_records\": %llu, \"overflows\": %u",
+                 corpus->name, (unsigned long long)(after.telegrams - before.telegrams),
+                 (double)frames / (after.telegrams - before.telegrams),
+                 (unsigned long long)(after.statusRecords - before.statusRecords), after.overflows - before.overflows);
+    
+    PeakLoopbackSetSource(0, NULL, NULL);
+    PeakTestStopLoopback();
+}
+
+#pragma mark - Timestamps
+
+// one completion for every telegram of five frames, the device and wall time of every frame
+static void BenchTimestamps(void)
+{
+    PeakTimebase timebase;
+    PeakBenchRun bench;
+    UInt64 i, ticks = 0, hostNs = 1000000000ULL, sum = 0, frames = PeakBenchCount(50000000);
+    
+    PeakTimebaseInit(&timebase, PEAK_SIM_TICK_NS);
+    PeakBenchBegin(&bench, "decode", "timestamps");
+    for (i = 0; i < frames; i++)
+    {
+        ticks += 3;
+        if (i % 5 == 0)
+        {
+            hostNs += 128000;
+            PeakTimebaseComplete(&timebase, ticks, hostNs);
+        }
+        sum += PeakTimebaseWall(&timebase, PeakTimebaseMonotonic(&timebase, ticks));
+    }
+    PeakBenchEnd(&bench, frames, "frame", "\"completions\": %llu, \"checksum\": %llu",
+                 (unsigned long long)timebase.completions, (unsigned long long)(sum & 0xffff));
+}
+
+#pragma mark - Encode
+
+// one frame per telegram as PeakSend writes it, and packed as PeakSendBatch does
+static void BenchEncode(const Corpus* corpus, int packed)
+{
+    UInt8 telegram[PEAK_TX_BUFFER_SIZE];
+    PeakBenchRun bench;
+    UInt64 frames = PeakBenchCount(packed ? 50000000 : 20000000), i, telegrams = 0, sum = 0;
+    UInt32 n;
+    char name[64];
+    
+    snprintf(name, sizeof(name), "encode-%s-%s", packed ? "packed" : "single", corpus->name);
+    PeakBenchBegin(&bench, "decode", name);
+    for (i = 0; i < frames; i += n, telegrams++)
+    {
+        n = PeakTxEncode(&corpus->frames[i % TELEGRAMS], packed ? TELEGRAMS - (UInt32)(i % TELEGRAMS) : 1, telegram, (UInt8)telegrams);
+        sum += telegram[1];
+    }
+    PeakBenchEnd(&bench, i, "frame", "\"corpus\": \"%s\", \"telegrams\": %llu, \"frames_per_telegram\": %.2f, \"checksum\": %llu",
+                 corpus->name, (unsigned long long)telegrams, (double)i / telegrams, (unsigned long long)(sum & 0xffff));
+}
+
+#pragma mark - Format
+
+// the cells of a log line with the formats of LogLine.m, into one buffer
+static UInt32 FormatLine(const CanMsg* msg, char* line, UInt32 size)
+{
+    UInt64 ts = msg->ts;
+    UInt32 n, j;
+    
+    n = (UInt32)snprintf(line, size, "%06llu.%06llu\t%s%s%s\t0x%03x (%d)\t%d\t",
+                         (unsigned long long)(ts / 1000000000ULL), (unsigned long long)((ts % 1000000000ULL) / 1000ULL),
+                         msg->err ? "Err|" : "", msg->rtr ? "Rtr|" : "", msg->ext ? "Ext" : "Basic",
+                         (unsigned)msg->canid.ul, (int)msg->canid.ul, (int)msg->len);
+    for (j = 0; j < msg->len && n < size; j++)
+        n += (UInt32)snprintf(line + n, size - n, " 0x%02x", msg->data[j]);
+    return n;
+}
+
+static void BenchFormat(const Corpus* corpus)
+{
+    static CanMsg frames[TELEGRAMS];
+    char line[256];
+    PeakBenchRun bench;
+    UInt64 i, count = PeakBenchCount(1000000), bytes = 0;
+    char name[64];
+    
+    memcpy(frames, corpus->frames, sizeof(frames));
+    for (i = 0; i < TELEGRAMS; i++)
+        frames[i].ts = 1350000000000000000ULL + i * 123457ULL;
+    
+    snprintf(name, sizeof(name), "format-%s", corpus->name);
+    PeakBenchBegin(&bench, "decode", name);
+    for (i = 0; i < count; i++)
+        bytes += FormatLine(&frames[i % TELEGRAMS], line, sizeof(line));
+    PeakBenchEnd(&bench, count, "frame", "\"corpus\": \"%s\", \"bytes_per_line\": %.1f",
+                 corpus->name, (double)bytes / count);
+}
+
+void BenchDecode(void)
+{
+    UInt32 c;
+    
+    BuildCorpora();
+    for (c = 0; c < CORPORA; c++)
+        BenchDecodeCorpus(&gCorpora[c]);
+    BenchTimestamps();
+    for (c = 0; c < 4; c++)
+    {
+        BenchEncode(&gCorpora[c], 0);
+        BenchEncode(&gCorpora[c], 1);
+    }
+    for (c = 0; c < 4; c++)
+        BenchFormat(&gCorpora[c]);
+}
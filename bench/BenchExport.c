@@ -0,0 +1,144 @@
+/*
+    File:           BenchExport.c
+
+    Description:    Lines per second of the text export in every format, against formatting each field
+                    on its own as the log window does.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "PeakBench.h"
+#include "PeakExport.h"
+#include "PeakBatch.h"
+
+// Lines per second of every format into /dev/null, so the disk is left out. The formatter case is the
+// C counterpart of the log window's paths: a string of its own for the timestamp and the identifier
+// from a format, and the payload grown by one " 0x%02x" per byte, as TimestampFormatter,
+// CanidFormatter and -[LogLine data] build them with stringWithFormat: and appendFormat:.
+
+#define RECORDS         65536
+
+static PeakCaptureRecord gRecords[RECORDS];
+
+static void Records(void)
+{
+    UInt32 i;
+    
+    bzero(gRecords, sizeof(gRecords));
+    for (i = 0; i < RECORDS; i++)
+    {
+        gRecords[i].ts = 1436509052000000000ULL + (UInt64)i * 123457;
+        gRecords[i].canid = i % 7 == 0 ? 0x18ff0000 + i : 0x100 + (i & 0x3ff);
+        gRecords[i].flags = i % 7 == 0 ? PEAK_CAPTURE_EXT : 0;
+        gRecords[i].dlc = i % 9;
+        memcpy(gRecords[i].data, &gRecords[i].ts, 8);
+    }
+}
+
+static void BenchFormat(const char* name, UInt32 format)
+{
+    PeakExporter exporter;
+    PeakBenchRun bench;
+    UInt64 n, lines = PeakBenchCount(10000000);
+    int fd = open("/dev/null", O_WRONLY);
+    
+    if (fd < 0 || PeakExportOpenFd(&exporter, fd, format, NULL) != kIOReturnSuccess)
+        return;
+    
+    PeakBenchBegin(&bench, "export", name);
+    for (n = 0; n < lines; n += RECORDS)
+        PeakExportRecords(&exporter, gRecords, lines - n < RECORDS ? (UInt32)(lines - n) : RECORDS);
+    PeakExportClose(&exporter);
+    PeakBenchEnd(&bench, exporter.lines, "line", "\"mb_per_sec\": %.1f, \"bytes_per_line\": %.1f",
+                 exporter.bytes / ((PeakMonotonicNs() - bench.startNs) / 1e3), (double)exporter.bytes / exporter.lines);
+    close(fd);
+}
+
+// appendFormat: on a mutable string, it grows with every byte
+static char* AppendFormat(char* string, size_t* length, UInt8 value)
+{
+    char piece[8];
+    int n = snprintf(piece, sizeof(piece), " 0x%02x", value);
+    char* grown = realloc(string, *length + n + 1);
+    
+    if (grown == NULL)
+        return string;
+    memcpy(grown + *length, piece, n + 1);
+    *length += n;
+    return grown;
+}
+
+static void BenchFormatters(void)
+{
+    static char buffer[PEAK_EXPORT_BUFFER_SIZE];
+    PeakBenchRun bench;
+    UInt64 n, lines = PeakBenchCount(2000000), bytes = 0;
+    size_t used = 0, length;
+    char *ts, *canid, *data;
+    UInt32 i;
+    int fd = open("/dev/null", O_WRONLY);
+    
+    if (fd < 0)
+        return;
+    
+    PeakBenchBegin(&bench, "export", "formatters");
+    for (n = 0; n < lines; n++)
+    {
+        const PeakCaptureRecord* record = &gRecords[n % RECORDS];
+        
+        ts = malloc(32);
+        canid = malloc(32);
+        if (ts == NULL || canid == NULL)
+            break;
+        snprintf(ts, 32, "%06llu.%06llu", (unsigned long long)(record->ts / 1000000000ULL),
+                 (unsigned long long)((record->ts % 1000000000ULL) / 1000ULL));
+        snprintf(canid, 32, "0x%03x (%d)", record->canid, record->canid);
+        data = calloc(1, 1);
+        length = 0;
+        for (i = 0; i < record->dlc && i < 8; i++)
+            data = AppendFormat(data, &length, record->data[i]);
+        
+        if (used + PEAK_EXPORT_MAX_LINE * 2 > sizeof(buffer))
+        {
+            bytes += write(fd, buffer, used) > 0 ? used : 0;
+            used = 0;
+        }
+        used += snprintf(buffer + used, sizeof(buffer) - used, "%s %s %u%s\n", ts, canid, record->dlc, data);
+        free(ts);
+        free(canid);
+        free(data);
+    }
+    bytes += write(fd, buffer, used) > 0 ? used : 0;
+    PeakBenchEnd(&bench, n, "line", "\"mb_per_sec\": %.1f, \"bytes_per_line\": %.1f",
+                 bytes / ((PeakMonotonicNs() - bench.startNs) / 1e3), (double)bytes / n);
+    close(fd);
+}
+
+void BenchExport(void)
+{
+    Records();
+    BenchFormatters();
+    BenchFormat("candump", PEAK_EXPORT_CANDUMP);
+    BenchFormat("asc", PEAK_EXPORT_ASC);
+    BenchFormat("csv", PEAK_EXPORT_CSV);
+}
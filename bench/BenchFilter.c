@@ -0,0 +1,192 @@
+/*
+    File:           BenchFilter.c
+
+    Description:    Frame filter per frame for 1, 100 and 10000 terms, compiled against checking every
+                    term, and swapping the filter while the decoders are busy.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PeakBench.h"
+#include "PeakTest.h"
+#include "PeakFilter.h"
+#include "PeakTransport.h"
+
+// Filters of 1, 100 and 10000 terms, a mix of standard and extended ranges, masks and terms with flag,
+// length and payload conditions, against frames with random identifiers. The linear case checks the
+// terms one by one as the predicate did. The swap case replaces the filter while two adapters keep their
+// decoders busy, each swap waits for both to leave the buffer they are in.
+
+#define FRAMES          4096
+
+static CanMsg gFrames[FRAMES];
+
+static void Frames(UInt64* seed)
+{
+    UInt32 i;
+    
+    bzero(gFrames, sizeof(gFrames));
+    for (i = 0; i < FRAMES; i++)
+    {
+        gFrames[i].ext = (PeakTestNext(seed) & 3) == 0;
+        gFrames[i].canid.ul = gFrames[i].ext ? (UInt32)(PeakTestNext(seed) % (PEAK_FILTER_MAX_ID + 1)) : (UInt32)(PeakTestNext(seed) % 0x800);
+        gFrames[i].len = (UInt8)(PeakTestNext(seed) % 9);
+        gFrames[i].ldata = ((UInt64)PeakTestNext(seed) << 32) | PeakTestNext(seed);
+    }
+}
+
+static void Term(PeakFilterTerm* term, UInt64* seed)
+{
+    UInt32 span;
+    
+    PeakFilterTermInit(term);
+    switch (PeakTestNext(seed) % 5) {
+        case 0:
+            term->low = (UInt32)(PeakTestNext(seed) % 0x800);
+            term->high = term->low + (UInt32)(PeakTestNext(seed) % 4);
+            term->flagsMask = PEAK_FILTER_EXT;
+            break;
+        case 1:
+            span = (UInt32)(PeakTestNext(seed) % 256);
+            term->low = (UInt32)(PeakTestNext(seed) % (PEAK_FILTER_MAX_ID - span));
+            term->high = term->low + span;
+            term->flagsMask = term->flagsValue = PEAK_FILTER_EXT;
+            break;
+        case 2:
+            term->mask = 0x1fffffff;
+            term->code = (UInt32)(PeakTestNext(seed) % (PEAK_FILTER_MAX_ID + 1));
+            term->flagsMask = term->flagsValue = PEAK_FILTER_EXT;
+            break;
+        case 3:
+            term->low = term->high = (UInt32)(PeakTestNext(seed) % 0x800);
+            term->flagsMask = PEAK_FILTER_RTR;
+            break;
+        default:
+            term->low = (UInt32)(PeakTestNext(seed) % 0x800);
+            term->high = term->low + 2;
+            term->dataMask[0] = 0xff;
+            term->dataValue[0] = (UInt8)PeakTestNext(seed);
+            break;
+    }
+}
+
+static void BenchTerms(UInt32 count)
+{
+    PeakFilterTerm* terms = malloc(count * sizeof(PeakFilterTerm));
+    PeakFilterProgram* program;
+    PeakBenchRun bench;
+    UInt64 seed = count, n, passed, frames = PeakBenchCount(count > 100 ? 5000000 : 20000000);
+    UInt64 linear = PeakBenchCount(count > 100 ? 20000 : 2000000);
+    char name[32];
+    UInt32 j;
+    
+    if (terms == NULL)
+        return;
+    for (j = 0; j < count; j++)
+        Term(&terms[j], &seed);
+    Frames(&seed);
+    program = PeakFilterCompile(terms, count);
+    
+    snprintf(name, sizeof(name), "compiled-%u", count);
+    PeakBenchBegin(&bench, "filter", name);
+    for (n = 0, passed = 0; n < frames; n++)
+        passed += PeakFilterMatch(program, &gFrames[n & (FRAMES - 1)]);
+    PeakBenchEnd(&bench, frames, "frame", "\"terms\": %u, \"ext_ranges\": %u, \"ext_masks\": %u, \"checked_terms\": %u, \"passed\": %.4f",
+                 count, program->extRangeCount, program->extMaskCount, program->termCount, (double)passed / frames);
+    
+    snprintf(name, sizeof(name), "linear-%u", count);
+    PeakBenchBegin(&bench, "filter", name);
+    for (n = 0, passed = 0; n < linear; n++)
+    {
+        const CanMsg* msg = &gFrames[n & (FRAMES - 1)];
+        for (j = 0; j < count && !PeakFilterTermMatch(&terms[j], msg); j++)
+            ;
+        passed += j < count;
+    }
+    PeakBenchEnd(&bench, linear, "frame", "\"terms\": %u, \"passed\": %.4f", count, (double)passed / linear);
+    
+    PeakFilterFree(program);
+    free(terms);
+}
+
+static UInt32 gBusy = 0;
+
+// full telegrams for as long as the swaps go on
+static UInt32 Busy(void* refCon, UInt8* buffer)
+{
+    PeakTestTelegram* telegram = refCon;
+    
+    if (!__atomic_load_n(&gBusy, __ATOMIC_ACQUIRE))
+        return 0;
+    memcpy(buffer, telegram->data, telegram->length);
+    return telegram->length;
+}
+
+static void BenchSwap(void)
+{
+    static CanMsg batch[4096];
+    static PeakTestTelegram telegram;
+    PeakFilterTerm term;
+    PeakRxStats before, after;
+    PeakBenchRun bench;
+    UInt64 i, swaps = PeakBenchCount(20000);
+    CanMsg msg;
+    
+    bzero(&msg, sizeof(CanMsg));
+    msg.canid.ul = 0x100;
+    msg.len = 8;
+    PeakTestTelegramBegin(&telegram, 0);
+    while (PeakTestTelegramFrame(&telegram, &msg, 0))
+        msg.canid.ul++;
+    PeakFilterTermInit(&term);
+    term.low = 0x100;
+    term.high = 0x102;
+    
+    if (PeakTestStartLoopback(2) != kIOReturnSuccess)
+        return;
+    __atomic_store_n(&gBusy, 1, __ATOMIC_RELEASE);
+    PeakLoopbackSetSource(0, Busy, &telegram);
+    PeakLoopbackSetSource(1, Busy, &telegram);
+    PeakGetRxStats(&before);
+    
+    PeakBenchBegin(&bench, "filter", "swap-busy-2");
+    for (i = 0; i < swaps; i++)
+    {
+        PeakSetFilter(i & 1 ? NULL : &term, 1);
+        if ((i & 63) == 0)
+            PeakTestReceive(batch, 4096, 0, 0);
+    }
+    PeakGetRxStats(&after);
+    PeakBenchEnd(&bench, swaps, "swap", "\"telegrams_meanwhile\": %llu",
+                 (unsigned long long)(after.telegrams - before.telegrams));
+    
+    __atomic_store_n(&gBusy, 0, __ATOMIC_RELEASE);
+    PeakSetFilter(NULL, 0);
+    PeakTestStopLoopback();
+}
+
+void BenchFilter(void)
+{
+    BenchTerms(1);
+    BenchTerms(100);
+    BenchTerms(10000);
+    BenchSwap();
+}
@@ -0,0 +1,147 @@
+/*
+    File:           BenchFrameStore.c
+
+    Description:    Frames per second into the columnar frame store against the 1000 row window it
+                    replaced, its memory per frame, and the rows formatted per redraw.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "PeakBench.h"
+#include "PeakFrameStore.h"
+
+// Frames arrive in batches of 64 as the display tick hands them over. The window case is the log as it
+// was: an array of whole frames of 1000 rows that moves everything up for every frame it evicts. The
+// store keeps the default capacity and runs full for most of the measurement. Redraws format the data
+// column of 40 visible rows at random positions.
+
+#define BATCH           64
+#define WINDOW          1000
+#define VISIBLE         40
+
+static CanMsg gBatch[BATCH];
+
+static void Batch(UInt64 n)
+{
+    UInt32 i;
+    
+    for (i = 0; i < BATCH; i++)
+    {
+        gBatch[i].ts = 1000000000ULL + (n + i) * 1000;
+        gBatch[i].canid.ul = 0x100 + (UInt32)((n + i) & 0x3ff);
+        gBatch[i].len = 8;
+        gBatch[i].ldata = n + i;
+    }
+}
+
+static void BenchWindow(void)
+{
+    static CanMsg window[WINDOW];
+    PeakBenchRun bench;
+    UInt64 n, frames = PeakBenchCount(2000000);
+    UInt32 count = 0, i;
+    
+    bzero(gBatch, sizeof(gBatch));
+    PeakBenchBegin(&bench, "store", "window-1000");
+    for (n = 0; n < frames; n += BATCH)
+    {
+        Batch(n);
+        for (i = 0; i < BATCH; i++)
+        {
+            if (count == WINDOW)
+            {
+                memmove(window, window + 1, (WINDOW - 1) * sizeof(CanMsg));
+                count--;
+            }
+            window[count++] = gBatch[i];
+        }
+    }
+    PeakBenchEnd(&bench, n, "frame", "\"capacity\": %u, \"bytes_per_frame\": %u",
+                 WINDOW, (unsigned)sizeof(CanMsg));
+}
+
+static void BenchAppend(void)
+{
+    static PeakFrameStore store;
+    PeakBenchRun bench;
+    UInt64 n, frames = PeakBenchCount(50000000);
+    
+    bzero(gBatch, sizeof(gBatch));
+    if (PeakFrameStoreCreate(&store, PEAK_STORE_DEFAULT_CAPACITY) != kIOReturnSuccess)
+        return;
+    
+    PeakBenchBegin(&bench, "store", "append");
+    for (n = 0; n < frames; n += BATCH)
+    {
+        Batch(n);
+        PeakFrameStoreAppend(&store, gBatch, NULL, BATCH);
+    }
+    PeakBenchEnd(&bench, n, "frame", "\"capacity\": %u, \"bytes_per_frame\": %.1f, \"memory_mb\": %.1f, \"evicted\": %llu",
+                 PeakFrameStoreCapacity(&store), (double)PeakFrameStoreMemory(1),
+                 PeakFrameStoreMemory(PeakFrameStoreCapacity(&store)) / 1e6, (unsigned long long)store.evicted);
+    
+    PeakFrameStoreDestroy(&store);
+}
+
+static void BenchRedraw(void)
+{
+    static PeakFrameStore store;
+    PeakBenchRun bench;
+    UInt64 n, seed = 1, rows, redraws = PeakBenchCount(200000), bytes = 0;
+    char buffer[64];
+    CanMsg msg;
+    UInt32 i;
+    
+    bzero(gBatch, sizeof(gBatch));
+    if (PeakFrameStoreCreate(&store, PEAK_STORE_DEFAULT_CAPACITY) != kIOReturnSuccess)
+        return;
+    for (n = 0; n < PEAK_STORE_DEFAULT_CAPACITY; n += BATCH)
+    {
+        Batch(n);
+        PeakFrameStoreAppend(&store, gBatch, NULL, BATCH);
+    }
+    rows = PeakFrameStoreCount(&store);
+    
+    // the table asks for every column of the visible rows, the data column as a string
+    PeakBenchBegin(&bench, "store", "redraw-40-rows");
+    for (n = 0; n < redraws; n++)
+    {
+        UInt64 top;
+        
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        top = (seed >> 33) % (rows - VISIBLE);
+        for (i = 0; i < VISIBLE; i++)
+        {
+            PeakFrameStoreGet(&store, top + i, &msg);
+            bytes += PeakFrameStoreFormatData(&store, top + i, buffer, sizeof(buffer)) + msg.len;
+        }
+    }
+    PeakBenchEnd(&bench, redraws * VISIBLE, "row", "\"rows\": %llu, \"bytes\": %llu",
+                 (unsigned long long)rows, (unsigned long long)bytes);
+    
+    PeakFrameStoreDestroy(&store);
+}
+
+void BenchFrameStore(void)
+{
+    BenchWindow();
+    BenchAppend();
+    BenchRedraw();
+}
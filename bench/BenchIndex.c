@@ -0,0 +1,165 @@
+/*
+    File:           BenchIndex.c
+
+    Description:    Capture index over a synthetic capture: the rebuild, seeks by time, and time range
+                    and identifier queries against a scan of the whole file.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "PeakBench.h"
+#include "PeakTest.h"
+#include "PeakIndex.h"
+
+// A synthetic capture of 10M frames, 100M with -s 10: one frame every 10 us from 1000 standard
+// identifiers, and every 100000th one the extended RARE_ID. Writing it is not measured. The queries
+// run against the mapped file after the rebuild, so they see it from the page cache.
+
+#define RARE_ID         0x18ff50e5
+#define TS(i)           (1000000000ULL + (UInt64)(i) * 10000)
+#define CHUNK           65536
+
+static PeakCaptureRecord gChunk[CHUNK];
+
+static int WriteCapture(const char* path, UInt64 records)
+{
+    PeakCaptureHeader header;
+    UInt64 i;
+    UInt32 n;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    
+    if (fd < 0)
+        return 0;
+    bzero(&header, sizeof(header));
+    header.magic = PEAK_CAPTURE_MAGIC;
+    header.version = PEAK_CAPTURE_VERSION;
+    header.headerSize = sizeof(PeakCaptureHeader);
+    header.recordSize = sizeof(PeakCaptureRecord);
+    if (write(fd, &header, sizeof(header)) != sizeof(header))
+        records = 0;
+    
+    bzero(gChunk, sizeof(gChunk));
+    for (i = 0; i < records; i += n)
+    {
+        for (n = 0; n < CHUNK && i + n < records; n++)
+        {
+            gChunk[n].ts = TS(i + n);
+            gChunk[n].canid = (i + n) % 100000 == 0 ? RARE_ID : 0x100 + (UInt32)((i + n) % 1000);
+            gChunk[n].flags = (i + n) % 100000 == 0 ? PEAK_CAPTURE_EXT : 0;
+            gChunk[n].dlc = 8;
+        }
+        if (write(fd, gChunk, n * sizeof(PeakCaptureRecord)) != (ssize_t)(n * sizeof(PeakCaptureRecord)))
+            break;
+    }
+    close(fd);
+    return i >= records;
+}
+
+void BenchIndex(void)
+{
+    PeakIndexReader reader;
+    PeakBenchRun bench;
+    char path[256], index[300];
+    UInt64 records = PeakBenchCount(10000000), seed = 1, visited, i, queries;
+    UInt32 keys[4];
+    
+    PeakTestTempPath(path, sizeof(path), "index.pcap");
+    snprintf(index, sizeof(index), "%s%s", path, PEAK_INDEX_SUFFIX);
+    if (!WriteCapture(path, records))
+    {
+        fprintf(stderr, "Unable to write %s\n", path);
+        unlink(path);
+        return;
+    }
+    
+    PeakBenchBegin(&bench, "index", "rebuild");
+    PeakIndexRebuild(path);
+    PeakBenchEnd(&bench, records, "record", NULL);
+    
+    if (PeakIndexOpen(&reader, path) != kIOReturnSuccess)
+    {
+        unlink(path);
+        unlink(index);
+        return;
+    }
+    
+    queries = PeakBenchCount(1000000);
+    PeakBenchBegin(&bench, "index", "seek-time");
+    for (i = 0, visited = 0; i < queries; i++)
+        visited += PeakIndexSeekTime(&reader, TS(PeakTestNext(&seed) % records)) < records;
+    PeakBenchEnd(&bench, queries, "query", "\"records\": %llu, \"found\": %llu",
+                 (unsigned long long)records, (unsigned long long)visited);
+    
+    // the frames of 10 ms anywhere in the capture
+    queries = PeakBenchCount(100000);
+    PeakBenchBegin(&bench, "index", "time-range-10ms");
+    for (i = 0, visited = 0; i < queries; i++)
+    {
+        UInt64 from = TS(PeakTestNext(&seed) % records);
+        visited += PeakIndexQuery(&reader, from, from + 10000000ULL - 1, NULL, 0, NULL, NULL);
+    }
+    PeakBenchEnd(&bench, queries, "query", "\"records\": %llu, \"results_per_query\": %.1f",
+                 (unsigned long long)records, (double)visited / queries);
+    
+    // the rare identifier over the whole capture, only its blocks are read
+    queries = PeakBenchCount(1000);
+    keys[0] = PEAK_INDEX_KEY(RARE_ID, 1);
+    PeakBenchBegin(&bench, "index", "rare-id");
+    for (i = 0, visited = 0; i < queries; i++)
+        visited += PeakIndexQuery(&reader, 0, ~0ULL, keys, 1, NULL, NULL);
+    PeakBenchEnd(&bench, queries, "query", "\"records\": %llu, \"results_per_query\": %.1f",
+                 (unsigned long long)records, (double)visited / queries);
+    
+    // four common identifiers in one second, every block of the range holds them
+    queries = PeakBenchCount(1000);
+    keys[0] = PEAK_INDEX_KEY(0x100, 0);
+    keys[1] = PEAK_INDEX_KEY(0x200, 0);
+    keys[2] = PEAK_INDEX_KEY(0x300, 0);
+    keys[3] = PEAK_INDEX_KEY(0x400, 0);
+    PeakBenchBegin(&bench, "index", "id-set-1s");
+    for (i = 0, visited = 0; i < queries; i++)
+    {
+        UInt64 from = TS(PeakTestNext(&seed) % records);
+        visited += PeakIndexQuery(&reader, from, from + 1000000000ULL - 1, keys, 4, NULL, NULL);
+    }
+    PeakBenchEnd(&bench, queries, "query", "\"records\": %llu, \"results_per_query\": %.1f",
+                 (unsigned long long)records, (double)visited / queries);
+    
+    // the same identifier without the index, every record of the capture
+    queries = PeakBenchCount(3);
+    PeakBenchBegin(&bench, "index", "rare-id-scan");
+    for (i = 0, visited = 0; i < queries; i++)
+    {
+        UInt64 n;
+        for (n = 0; n < reader.recordCount; n++)
+        {
+            const PeakCaptureRecord* record = PeakIndexRecord(&reader, n);
+            visited += record->canid == RARE_ID && (record->flags & PEAK_CAPTURE_EXT);
+        }
+    }
+    PeakBenchEnd(&bench, queries, "query", "\"records\": %llu, \"results_per_query\": %.1f",
+                 (unsigned long long)records, (double)visited / queries);
+    
+    PeakIndexClose(&reader);
+    unlink(path);
+    unlink(index);
+}
@@ -0,0 +1,151 @@
+/*
+    File:           BenchInstrument.c
+
+    Description:    The cost of the receive path instrumentation per frame, of a snapshot, and of the
+                    text and JSON dumps.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "PeakBench.h"
+#include "PeakTest.h"
+#include "PeakHistogram.h"
+#include "PeakBatch.h"
+
+// What the instrumentation costs the receive path. The record case is one histogram update with latencies
+// spread from 1 us to 20 ms. The per-frame case does for every frame what the decoder, the batcher and
+// PeakNoteDisplayed add: the USB latency, the dequeue and display latencies, the decode latency once per
+// telegram of four frames, and a clock read for every batch of 64 frames noted as displayed; the clock
+// case is what such a read costs. The snapshot and format cases are the periodic side,
+// PeakGetInstrumentation and the text and JSON dumps of its result.
+
+static PeakHistogram gUsb, gDecode, gDequeue, gDisplay;
+
+static void BenchRecord(void)
+{
+    static UInt64 latencies[4096];
+    PeakBenchRun bench;
+    UInt64 i, seed = 1, values = PeakBenchCount(200000000);
+    
+    for (i = 0; i < 4096; i++)
+        latencies[i] = 1000 + PeakTestNext(&seed) % 20000000;
+    PeakHistogramReset(&gUsb);
+    
+    PeakBenchBegin(&bench, "instrument", "record");
+    for (i = 0; i < values; i++)
+        PeakHistogramRecord(&gUsb, latencies[i & 4095]);
+    PeakBenchEnd(&bench, values, "value", "\"p99_ns\": %llu", (unsigned long long)PeakHistogramQuantile(&gUsb, 0.99));
+}
+
+static void BenchPerFrame(void)
+{
+    static UInt64 latencies[4096];
+    PeakBenchRun bench;
+    UInt64 i, seed = 1, now = 0, frames = PeakBenchCount(100000000);
+    
+    for (i = 0; i < 4096; i++)
+        latencies[i] = 100000 + PeakTestNext(&seed) % 900000;
+    PeakHistogramReset(&gUsb);
+    PeakHistogramReset(&gDecode);
+    PeakHistogramReset(&gDequeue);
+    PeakHistogramReset(&gDisplay);
+    
+    PeakBenchBegin(&bench, "instrument", "per-frame");
+    for (i = 0; i < frames; i++)
+    {
+        // the decoder reads the clock at the end of a telegram for the batcher anyway
+        if (i % 4 == 0)
+            PeakHistogramRecord(&gDecode, latencies[(i + 3) & 4095] >> 4);
+        PeakHistogramRecord(&gUsb, latencies[i & 4095]);
+        PeakHistogramRecord(&gDequeue, latencies[(i + 1) & 4095]);
+        if (i % 64 == 0)
+            now = PeakMonotonicNs();
+        PeakHistogramRecord(&gDisplay, latencies[(i + 2) & 4095] + (now & 1));
+    }
+    PeakBenchEnd(&bench, frames, "frame", "\"records_per_frame\": 3.25, \"clock_reads_per_frame\": %.4f", 1.0 / 64);
+}
+
+static void BenchClock(void)
+{
+    PeakBenchRun bench;
+    UInt64 i, sum = 0, reads = PeakBenchCount(20000000);
+    
+    PeakBenchBegin(&bench, "instrument", "clock");
+    for (i = 0; i < reads; i++)
+        sum += PeakMonotonicNs();
+    PeakBenchEnd(&bench, reads, "read", "\"checksum\": %llu", (unsigned long long)(sum & 0xffff));
+}
+
+static void BenchSnapshot(void)
+{
+    PeakInstrumentStats stats;
+    PeakBenchRun bench;
+    UInt64 i, snapshots = PeakBenchCount(200000);
+    
+    PeakBenchBegin(&bench, "instrument", "snapshot");
+    for (i = 0; i < snapshots; i++)
+        PeakGetInstrumentation(&stats);
+    PeakBenchEnd(&bench, snapshots, "snapshot", "\"stages\": 5, \"buckets\": %u", PEAK_HISTOGRAM_BUCKETS);
+}
+
+static void BenchFormat(UInt32 format)
+{
+    PeakInstrumentStats stats;
+    PeakLatencyStats* stages[] = { &stats.usb, &stats.decode, &stats.dequeue, &stats.display, &stats.capture };
+    char buffer[2048];
+    PeakBenchRun bench;
+    UInt64 i, bytes = 0, dumps = PeakBenchCount(200000);
+    UInt32 s;
+    
+    // a busy second of two adapters
+    bzero(&stats, sizeof(PeakInstrumentStats));
+    stats.sinceNs = 1000000000ULL;
+    stats.untilNs = 2000000000ULL;
+    stats.frames = 15800;
+    stats.telegrams = 3950;
+    stats.decodeNs = 11850000;
+    stats.channels = 2;
+    for (s = 0; s < 5; s++)
+    {
+        stages[s]->count = stats.frames;
+        stages[s]->minNs = 45000 + s * 1000;
+        stages[s]->p50Ns = 310000 + s * 20000;
+        stages[s]->p90Ns = 780000 + s * 40000;
+        stages[s]->p99Ns = 1900000 + s * 100000;
+        stages[s]->p999Ns = 8700000 + s * 300000;
+        stages[s]->maxNs = 21000000 + s * 1000000;
+        stages[s]->meanNs = 402311.5 + s * 1000;
+    }
+    
+    PeakBenchBegin(&bench, "instrument", format == PEAK_STATS_JSON ? "format-json" : "format-text");
+    for (i = 0; i < dumps; i++)
+        bytes += PeakFormatInstrumentation(&stats, format, buffer, sizeof(buffer));
+    PeakBenchEnd(&bench, dumps, "dump", "\"bytes\": %.0f", (double)bytes / dumps);
+}
+
+void BenchInstrument(void)
+{
+    BenchRecord();
+    BenchPerFrame();
+    BenchClock();
+    BenchSnapshot();
+    BenchFormat(PEAK_STATS_TEXT);
+    BenchFormat(PEAK_STATS_JSON);
+}
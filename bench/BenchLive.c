@@ -0,0 +1,155 @@
+/*
+    File:           BenchLive.c
+
+    Description:    Publishing frames into the shared-memory ring and following them with 1, 4 and 16
+                    readers.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "PeakBench.h"
+#include "PeakLive.h"
+#include "PeakBatch.h"
+
+// The publish case is the cost the decoder pays per frame, in buffers of 19 frames with one wake each
+// and nobody reading. In the readers cases the producer publishes the buffers at 1 million frames per
+// second, a full bus of short frames, while 1, 4 and 16 reader threads with a cursor each follow them
+// through PeakLiveWait, PeakLiveRead and PeakLiveRelease; they report the aggregate frames read per
+// second and how many the readers missed because the producer lapped them.
+
+#define FRAMES_PER_BUFFER   19
+#define READERS_MAX         16
+#define FRAME_NS            1000        // between published frames in the readers cases
+
+typedef struct {
+    PeakLiveReader  reader;
+    UInt64          sum;
+} Reader;
+
+static Reader gReaders[READERS_MAX];
+
+// one buffer every FRAMES_PER_BUFFER * frameNs, as fast as it goes for 0
+static void PublishBuffers(PeakLive* live, UInt64 frames, UInt64 frameNs)
+{
+    UInt64 i, startNs = PeakMonotonicNs();
+    CanMsg msg;
+    
+    bzero(&msg, sizeof(msg));
+    msg.len = 8;
+    for (i = 0; i < frames; i++)
+    {
+        msg.canid.ul = 0x100 + (UInt32)(i & 0x3ff);
+        msg.ldata = i;
+        PeakLivePublish(live, &msg);
+        if (i % FRAMES_PER_BUFFER != FRAMES_PER_BUFFER - 1)
+            continue;
+        PeakLiveWake(live);
+        while (PeakMonotonicNs() - startNs < (i + 1) * frameNs)
+            ;
+    }
+    PeakLiveWake(live);
+}
+
+static void* Follow(void* refCon)
+{
+    Reader* reader = refCon;
+    const CanMsg* msgs;
+    UInt32 i, n;
+    
+    for (;;)
+    {
+        n = PeakLiveRead(&reader->reader, &msgs, 4096);
+        if (n == 0)
+        {
+            if (PeakLiveWait(&reader->reader, 1000000000ULL) != kIOReturnSuccess)
+                break;
+            continue;
+        }
+        for (i = 0; i < n; i++)
+            reader->sum += msgs[i].ldata;
+        PeakLiveRelease(&reader->reader);
+    }
+    return NULL;
+}
+
+static void BenchPublish(const char* name)
+{
+    PeakBenchRun bench;
+    PeakLive live;
+    UInt64 frames = PeakBenchCount(20000000);
+    
+    if (PeakLiveCreate(&live, name, 0, PEAK_LIVE_DEFAULT_CAPACITY) != kIOReturnSuccess)
+        return;
+    PeakBenchBegin(&bench, "live", "publish");
+    PublishBuffers(&live, frames, 0);
+    PeakBenchEnd(&bench, frames, "frame", "\"frames_per_buffer\": %u, \"capacity\": %u", FRAMES_PER_BUFFER, PEAK_LIVE_DEFAULT_CAPACITY);
+    PeakLiveDestroy(&live);
+}
+
+static void BenchReaders(const char* name, const char* benchName, UInt32 count)
+{
+    pthread_t threads[READERS_MAX];
+    PeakBenchRun bench;
+    PeakLive live;
+    UInt64 frames = PeakBenchCount(1000000), read = 0, missed = 0, elapsedNs;
+    UInt32 i;
+    
+    if (PeakLiveCreate(&live, name, 0, PEAK_LIVE_DEFAULT_CAPACITY) != kIOReturnSuccess)
+        return;
+    for (i = 0; i < count; i++)
+    {
+        bzero(&gReaders[i], sizeof(Reader));
+        if (PeakLiveOpen(&gReaders[i].reader, name) != kIOReturnSuccess)
+            break;
+    }
+    count = i;
+    
+    PeakBenchBegin(&bench, "live", benchName);
+    for (i = 0; i < count; i++)
+        pthread_create(&threads[i], NULL, Follow, &gReaders[i]);
+    PublishBuffers(&live, frames, FRAME_NS);
+    
+    // the readers drain what is left and see the segment closed
+    PeakLiveDestroy(&live);
+    for (i = 0; i < count; i++)
+    {
+        pthread_join(threads[i], NULL);
+        read += gReaders[i].reader.frames;
+        missed += gReaders[i].reader.missed;
+        PeakLiveClose(&gReaders[i].reader);
+    }
+    elapsedNs = PeakMonotonicNs() - bench.startNs;
+    PeakBenchEnd(&bench, read, "frame", "\"readers\": %u, \"published\": %llu, \"missed\": %llu, \"aggregate_frames_per_sec\": %.0f",
+                 count, (unsigned long long)frames, (unsigned long long)missed, read * 1e9 / elapsedNs);
+}
+
+void BenchLive(void)
+{
+    char name[PEAK_LIVE_NAME_MAX];
+    
+    snprintf(name, sizeof(name), "/PeakBench-%d", (int)getpid());
+    
+    BenchPublish(name);
+    BenchReaders(name, "readers-1", 1);
+    BenchReaders(name, "readers-4", 4);
+    BenchReaders(name, "readers-16", 16);
+}
@@ -0,0 +1,151 @@
+/*
+    File:           BenchMerge.c
+
+    Description:    The time ordered merge over up to eight rings, and up to eight loopback adapters
+                    decoded on their own threads and merged into one stream.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "PeakBench.h"
+#include "PeakTest.h"
+#include "PeakMerge.h"
+#include "PeakBatch.h"
+#include "PeakTransport.h"
+
+// The merge alone over 1, 2, 4 and 8 rings, filled round robin with frames in time order and drained
+// in batches as the consumer does; the cost per frame is the scan over the heads. Then 1, 4 and 8
+// loopback adapters, each decoded on its own thread, with full telegrams as fast as the decoders take
+// them, merged into one stream; this is the scaling of the whole receive path on this machine.
+
+#define FILL            1024
+
+static PeakRing gRings[PEAK_MAX_CHANNELS];
+
+static void BenchDrain(UInt32 count)
+{
+    static CanMsg batch[FILL];
+    PeakMerge merge;
+    PeakMergeStats stats;
+    PeakBenchRun bench;
+    UInt64 i, mono = 1000, frames = PeakBenchCount(20000000), drained = 0;
+    UInt32 j, n;
+    CanMsg* msg;
+    char name[64];
+    
+    PeakMergeInit(&merge, PEAK_MERGE_DEFAULT_WINDOW_NS);
+    for (j = 0; j < count; j++)
+    {
+        PeakRingCreate(&gRings[j], PEAK_RING_DEFAULT_CAPACITY);
+        PeakMergeAttach(&merge, j, &gRings[j]);
+    }
+    
+    snprintf(name, sizeof(name), "drain-%u-rings", count);
+    PeakBenchBegin(&bench, "merge", name);
+    for (i = 0; i < frames; i += FILL)
+    {
+        for (j = 0; j < FILL; j++)
+        {
+            msg = PeakRingReserve(&gRings[j % count]);
+            msg->channel = (UInt8)(j % count);
+            msg->mono = mono++;
+            PeakRingCommit(&gRings[j % count]);
+        }
+        while ((n = PeakMergeDrain(&merge, batch, FILL, mono)) > 0)
+            drained += n;
+    }
+    PeakMergeGetStats(&merge, &stats);
+    PeakBenchEnd(&bench, drained, "frame", "\"rings\": %u, \"late\": %llu", count, (unsigned long long)stats.late);
+    
+    for (j = 0; j < count; j++)
+        PeakRingDestroy(&gRings[j]);
+}
+
+static UInt32 gBusy = 0;
+
+static UInt32 Busy(void* refCon, UInt8* buffer)
+{
+    PeakTestTelegram* telegram = refCon;
+    
+    if (!__atomic_load_n(&gBusy, __ATOMIC_ACQUIRE))
+        return 0;
+    memcpy(buffer, telegram->data, telegram->length);
+    return telegram->length;
+}
+
+static void BenchAdapters(UInt32 count)
+{
+    static CanMsg batch[4096];
+    static PeakTestTelegram telegram;
+    struct timespec pause = { 0, 100000 };
+    PeakMergeStats before, after;
+    PeakRxStats rxBefore, rxAfter;
+    PeakBenchRun bench;
+    UInt64 frames = PeakBenchCount(2000000), received = 0, deadline;
+    UInt32 a, n;
+    CanMsg msg;
+    char name[64];
+    
+    bzero(&msg, sizeof(CanMsg));
+    msg.canid.ul = 0x100;
+    msg.len = 8;
+    PeakTestTelegramBegin(&telegram, 0);
+    while (PeakTestTelegramFrame(&telegram, &msg, 0))
+        msg.canid.ul++;
+    
+    snprintf(name, sizeof(name), "loopback-%u-adapters", count);
+    PeakBenchBegin(&bench, "merge", name);
+    if (PeakTestStartLoopback(count) != kIOReturnSuccess)
+        return;
+    PeakGetMergeStats(&before);
+    PeakGetRxStats(&rxBefore);
+    __atomic_store_n(&gBusy, 1, __ATOMIC_RELEASE);
+    for (a = 0; a < count; a++)
+        PeakLoopbackSetSource(a, Busy, &telegram);
+    
+    deadline = PeakMonotonicNs() + 60000000000ULL;
+    while (received < frames && PeakMonotonicNs() < deadline)
+    {
+        n = PeakTestReceive(batch, 4096, 0, 0);
+        if (n == 0)
+            nanosleep(&pause, NULL);
+        received += n;
+    }
+    __atomic_store_n(&gBusy, 0, __ATOMIC_RELEASE);
+    PeakGetMergeStats(&after);
+    PeakGetRxStats(&rxAfter);
+    PeakBenchEnd(&bench, received, "frame", "\"adapters\": %u, \"windowed\": %llu, \"late\": %llu, \"max_late_ns\": %llu, \"overflows\": %u",
+                 count, (unsigned long long)(after.windowed - before.windowed), (unsigned long long)(after.late - before.late),
+                 (unsigned long long)after.maxLateNs, rxAfter.overflows - rxBefore.overflows);
+    
+    PeakTestStopLoopback();
+}
+
+void BenchMerge(void)
+{
+    BenchDrain(1);
+    BenchDrain(2);
+    BenchDrain(4);
+    BenchDrain(8);
+    BenchAdapters(1);
+    BenchAdapters(4);
+    BenchAdapters(8);
+}
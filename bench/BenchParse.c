@@ -0,0 +1,172 @@
+/*
+    File:           BenchParse.c
+
+    Description:    Parsing a 50000 line test script from memory and from a file, and sending it through
+                    the loopback adapter.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "PeakBench.h"
+#include "PeakTest.h"
+#include "PeakParse.h"
+#include "PeakBatch.h"
+
+// A test script of 50000 lines as the README describes them: mostly standard frames with eight bytes,
+// every fifth one extended, every twentieth an RTR frame, a comment now and then and some frames two to a
+// line. The text cases parse it from memory and from a mapped file and hand the batches to a callback
+// that only counts them; the send case queues them through the loopback adapter with PeakParseSend and
+// waits until the transmit queue is empty.
+
+#define LINES           50000
+
+static char gScript[LINES * 48];
+static UInt32 gScriptLength = 0;
+
+static void BuildScript(void)
+{
+    UInt32 i, j;
+    
+    for (i = 0; i < LINES; i++)
+    {
+        char* line = gScript + gScriptLength;
+        UInt32 n, size = sizeof(gScript) - gScriptLength;
+        
+        if (i % 20 == 0)
+            n = snprintf(line, size, "0x40000%03x 0 0 0 0\n", 0x100 + i % 0x100);
+        else if (i % 5 == 0)
+            n = snprintf(line, size, "0x80%06x 0x%02x 0x%02x 0x%02x 0x%02x\n", 0x10000 + i, i & 0xff, (i >> 8) & 0xff, 0x5a, 0xa5);
+        else if (i % 7 == 0)
+            n = snprintf(line, size, "%x %x %x; %x %x  # two\n", 0x200 + i % 0x400, i & 0xff, 0x11, 0x300 + i % 0x100, 0x22);
+        else
+        {
+            n = snprintf(line, size, "%03x", i % 0x7ff);
+            for (j = 0; j < 8; j++)
+                n += snprintf(line + n, size - n, " %02x", (i * 7 + j) & 0xff);
+            n += snprintf(line + n, size - n, "\n");
+        }
+        gScriptLength += n;
+    }
+}
+
+static IOReturn Count(void* refCon, CanMsg* msgs, UInt32 count)
+{
+    *(UInt64*)refCon += msgs[count - 1].len;
+    return kIOReturnSuccess;
+}
+
+static void BenchText(void)
+{
+    PeakParseConfig config;
+    PeakParseStats stats;
+    PeakBenchRun bench;
+    UInt64 i, rounds = PeakBenchCount(100), lines = 0, frames = 0, sink = 0, elapsedNs;
+    
+    PeakParseConfigInit(&config);
+    config.frames = Count;
+    config.refCon = &sink;
+    
+    PeakBenchBegin(&bench, "parse", "text");
+    for (i = 0; i < rounds; i++)
+    {
+        PeakParseText(gScript, gScriptLength, &config, &stats);
+        lines += stats.lines;
+        frames += stats.frames;
+    }
+    elapsedNs = PeakMonotonicNs() - bench.startNs;
+    PeakBenchEnd(&bench, lines, "line", "\"frames_per_line\": %.3f, \"errors\": %llu, \"mb_per_sec\": %.1f, \"ms_per_script\": %.2f",
+                 (double)frames / lines, (unsigned long long)stats.errors, (double)gScriptLength * rounds * 1000 / elapsedNs,
+                 elapsedNs / 1e6 / rounds);
+}
+
+static void BenchFile(void)
+{
+    PeakParseConfig config;
+    PeakParseStats stats;
+    PeakBenchRun bench;
+    UInt64 i, rounds = PeakBenchCount(100), lines = 0, sink = 0;
+    char path[256];
+    FILE* file;
+    
+    PeakTestTempPath(path, sizeof(path), "frames.txt");
+    file = fopen(path, "w");
+    if (file == NULL)
+        return;
+    fwrite(gScript, 1, gScriptLength, file);
+    fclose(file);
+    
+    PeakParseConfigInit(&config);
+    config.frames = Count;
+    config.refCon = &sink;
+    
+    PeakBenchBegin(&bench, "parse", "file");
+    for (i = 0; i < rounds; i++)
+    {
+        if (PeakParseFile(path, &config, &stats) != kIOReturnSuccess)
+            break;
+        lines += stats.lines;
+    }
+    PeakBenchEnd(&bench, lines, "line", "\"bytes\": %u", gScriptLength);
+    unlink(path);
+}
+
+static void BenchSend(void)
+{
+    struct timespec pause = { 0, 100000 };
+    PeakParseConfig config;
+    PeakParseStats stats;
+    PeakTxStats tx;
+    PeakBenchRun bench;
+    UInt64 i, rounds = PeakBenchCount(10), lines = 0, frames = 0, startNs;
+    
+    PeakParseConfigInit(&config);
+    config.frames = PeakParseSend;
+    
+    PeakBenchBegin(&bench, "parse", "send-loopback");
+    if (PeakTestStartLoopback(1) != kIOReturnSuccess)
+        return;
+    for (i = 0; i < rounds; i++)
+    {
+        if (PeakParseText(gScript, gScriptLength, &config, &stats) != kIOReturnSuccess)
+            break;
+        lines += stats.lines;
+        frames += stats.frames;
+    }
+    
+    // until the adapter has taken the last of them
+    startNs = PeakMonotonicNs();
+    while (PeakGetTxStats(&tx) == kIOReturnSuccess && tx.queued + tx.inFlight > 0 && PeakMonotonicNs() - startNs < 5000000000ULL)
+        nanosleep(&pause, NULL);
+    PeakBenchEnd(&bench, lines, "line", "\"frames\": %llu, \"transmitted\": %llu, \"frames_per_telegram\": %.1f",
+                 (unsigned long long)frames, (unsigned long long)tx.frames, tx.telegrams ? (double)tx.frames / tx.telegrams : 0.0);
+    PeakTestStopLoopback();
+}
+
+void BenchParse(void)
+{
+    if (gScriptLength == 0)
+        BuildScript();
+    
+    BenchText();
+    BenchFile();
+    BenchSend();
+}
@@ -0,0 +1,140 @@
+/*
+    File:           BenchReplay.c
+
+    Description:    Capture replay throughput as fast as possible, and send-time jitter at the original
+                    timing with and without the final spin.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "PeakBench.h"
+#include "PeakTest.h"
+#include "PeakReplay.h"
+#include "PeakBatch.h"
+
+// The replay against a send function that only counts: as fast as possible over 1M frames, which
+// measures the scheduler and the record conversion, and a 1 kHz capture at the original timing with the
+// default spin and with sleeping alone, for the jitter. Writing the captures is not measured.
+
+#define CHUNK           65536
+
+static PeakCaptureRecord gChunk[CHUNK];
+
+static IOReturn Send(void* refCon, const CanMsg* msgs, UInt32 count)
+{
+    *(UInt64*)refCon += count;
+    (void)msgs;
+    return kIOReturnSuccess;
+}
+
+static int WriteCapture(const char* path, UInt64 records, UInt64 stepNs)
+{
+    PeakCaptureHeader header;
+    UInt64 i;
+    UInt32 n;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    
+    if (fd < 0)
+        return 0;
+    bzero(&header, sizeof(header));
+    header.magic = PEAK_CAPTURE_MAGIC;
+    header.version = PEAK_CAPTURE_VERSION;
+    header.headerSize = sizeof(PeakCaptureHeader);
+    header.recordSize = sizeof(PeakCaptureRecord);
+    if (write(fd, &header, sizeof(header)) != sizeof(header))
+        records = 0;
+    
+    bzero(gChunk, sizeof(gChunk));
+    for (i = 0; i < records; i += n)
+    {
+        for (n = 0; n < CHUNK && i + n < records; n++)
+        {
+            gChunk[n].ts = 1000000000ULL + (i + n) * stepNs;
+            gChunk[n].canid = 0x100 + (UInt32)((i + n) % 1000);
+            gChunk[n].dlc = 8;
+        }
+        if (write(fd, gChunk, n * sizeof(PeakCaptureRecord)) != (ssize_t)(n * sizeof(PeakCaptureRecord)))
+            break;
+    }
+    close(fd);
+    return i >= records;
+}
+
+// the upper limit of the bucket that holds the given share of the frames
+static UInt64 Percentile(const PeakReplayStats* stats, double share)
+{
+    UInt64 total = 0, seen = 0;
+    UInt32 i;
+    
+    for (i = 0; i < PEAK_REPLAY_BUCKETS; i++)
+        total += stats->late[i];
+    for (i = 0; i < PEAK_REPLAY_BUCKETS; i++)
+    {
+        seen += stats->late[i];
+        if (seen >= total * share)
+            return PeakReplayBucketLimit(i);
+    }
+    return PeakReplayBucketLimit(PEAK_REPLAY_BUCKETS - 1);
+}
+
+static void BenchReplay1(const char* name, const char* path, double speed, UInt64 spinNs)
+{
+    static PeakReplay replay;
+    PeakReplayConfig config;
+    PeakReplayStats stats;
+    PeakBenchRun bench;
+    UInt64 sent = 0;
+    
+    PeakReplayConfigInit(&config);
+    config.speed = speed;
+    config.spinNs = spinNs;
+    config.send = Send;
+    config.refCon = &sent;
+    if (PeakReplayOpen(&replay, path, &config) != kIOReturnSuccess)
+        return;
+    
+    PeakBenchBegin(&bench, "replay", name);
+    PeakReplayRun(&replay);
+    PeakReplayGetStats(&replay, &stats);
+    PeakBenchEnd(&bench, stats.frames, "frame", "\"batches\": %llu, \"mean_late_ns\": %.0f, \"p99_late_ns_below\": %llu, \"max_late_ns\": %llu",
+                 (unsigned long long)stats.batches, stats.frames ? (double)stats.sumLateNs / stats.frames : 0.0,
+                 (unsigned long long)(speed > 0 ? Percentile(&stats, 0.99) : 0), (unsigned long long)stats.maxLateNs);
+    PeakReplayClose(&replay);
+}
+
+void BenchReplay(void)
+{
+    char path[256];
+    
+    PeakTestTempPath(path, sizeof(path), "replay-fast.pcap");
+    if (WriteCapture(path, PeakBenchCount(1000000), 10000))
+        BenchReplay1("as-fast-as-possible", path, 0, PEAK_REPLAY_DEFAULT_SPIN_NS);
+    PeakTestRemove(path);
+    
+    PeakTestTempPath(path, sizeof(path), "replay-1khz.pcap");
+    if (WriteCapture(path, PeakBenchCount(1000), 1000000))
+    {
+        BenchReplay1("timed-1khz-spin", path, 1, PEAK_REPLAY_DEFAULT_SPIN_NS);
+        BenchReplay1("timed-1khz-sleep", path, 1, 0);
+    }
+    PeakTestRemove(path);
+}
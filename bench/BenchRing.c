@@ -0,0 +1,154 @@
+/*
+    File:           BenchRing.c
+
+    Description:    Throughput of the SPSC frame ring on its own and behind the decoder, fed with
+                    synthetic 64 byte bulk packets through the loopback transport.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "PeakBench.h"
+#include "PeakTest.h"
+#include "PeakRing.h"
+#include "PeakTransport.h"
+
+#pragma mark - Ring alone
+
+typedef struct {
+    PeakRing    ring;
+    UInt64      frames;
+} RingRun;
+
+static void* Producer(void* arg)
+{
+    RingRun* run = arg;
+    UInt64 i;
+    CanMsg* msg;
+    
+    for (i = 0; i < run->frames; i++)
+    {
+        while ((msg = PeakRingReserve(&run->ring)) == NULL)
+            sched_yield();
+        msg->canid.ul = (UInt32)i;
+        PeakRingCommit(&run->ring);
+    }
+    return NULL;
+}
+
+static void BenchSpsc(void)
+{
+    static RingRun run;
+    PeakBenchRun bench;
+    pthread_t thread;
+    UInt64 seen = 0, sum = 0;
+    CanMsg* msg;
+    
+    PeakRingCreate(&run.ring, PEAK_RING_DEFAULT_CAPACITY);
+    run.frames = PeakBenchCount(20000000);
+    
+    PeakBenchBegin(&bench, "ring", "spsc");
+    pthread_create(&thread, NULL, Producer, &run);
+    while (seen < run.frames)
+    {
+        if ((msg = PeakRingBorrow(&run.ring)) == NULL)
+        {
+            sched_yield();
+            continue;
+        }
+        sum += msg->canid.ul;
+        PeakRingRelease(&run.ring);
+        seen++;
+    }
+    pthread_join(thread, NULL);
+    PeakBenchEnd(&bench, seen, "frame", "\"capacity\": %u, \"high_water\": %u", PEAK_RING_DEFAULT_CAPACITY, run.ring.highWater);
+    
+    PeakRingDestroy(&run.ring);
+    (void)sum;
+}
+
+#pragma mark - Behind the decoder
+
+// the same telegram over and over, five standard frames of eight bytes in 63 bytes, the ticks moving on
+typedef struct {
+    PeakTestTelegram    telegram;
+    UInt64              left;       // packets
+    UInt16              ticks;
+} PacketSource;
+
+static UInt32 FillPacket(void* refCon, UInt8* buffer)
+{
+    PacketSource* source = refCon;
+    
+    if (source->left == 0)
+        return 0;
+    source->left--;
+    
+    memcpy(buffer, source->telegram.data, source->telegram.length);
+    buffer[5] = (UInt8)source->ticks;
+    buffer[6] = (UInt8)(source->ticks >> 8);
+    source->ticks += 5 * 3;
+    return source->telegram.length;
+}
+
+static void BenchReceive(void)
+{
+    static CanMsg batch[PEAK_RING_DEFAULT_CAPACITY];
+    static PacketSource source;
+    PeakBenchRun bench;
+    PeakRxStats before, after;
+    CanMsg msg;
+    UInt64 packets = PeakBenchCount(1000000), frames = 0, want;
+    UInt32 i, n;
+    
+    bzero(&msg, sizeof(CanMsg));
+    msg.len = 8;
+    PeakTestTelegramBegin(&source.telegram, 0);
+    for (i = 0; PeakTestTelegramFrame(&source.telegram, &msg, 3); i++)
+        msg.canid.ul = 0x100 + i;
+    source.left = packets;
+    want = packets * source.telegram.data[1];
+    
+    if (PeakTestStartLoopback(1) != kIOReturnSuccess)
+        return;
+    PeakGetRxStats(&before);
+    
+    // the consumer drains as fast as it can, what it cannot keep up with counts as overflows
+    PeakBenchBegin(&bench, "ring", "rx-64byte");
+    PeakLoopbackSetSource(0, FillPacket, &source);
+    for (;;)
+    {
+        n = PeakTestReceive(batch, PEAK_RING_DEFAULT_CAPACITY, 1, 1000000000ULL);
+        frames += n;
+        PeakGetRxStats(&after);
+        if (frames + after.overflows - before.overflows >= want || n == 0)
+            break;
+    }
+    PeakBenchEnd(&bench, after.frames - before.frames, "frame", "\"packets\": %llu, \"consumed\": %llu, \"overflows\": %u",
+                 (unsigned long long)packets, (unsigned long long)frames, after.overflows - before.overflows);
+    
+    PeakTestStopLoopback();
+}
+
+void BenchRing(void)
+{
+    BenchSpsc();
+    BenchReceive();
+}
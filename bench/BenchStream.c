@@ -0,0 +1,200 @@
+/*
+    File:           BenchStream.c
+
+    Description:    Streaming frames to local UNIX socket clients in batches, against a write per frame.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "PeakBench.h"
+#include "PeakTest.h"
+#include "PeakStream.h"
+#include "PeakBatch.h"
+
+// The frames go out in buffers of 19, as many as a bulk transfer of the adapter holds. The idle case
+// is the cost of a stream nobody is connected to. The clients cases have 1 and 4 local clients read
+// can_frame records as fast as they can, and one case adds a fifth client that never reads and drops
+// its records; they report the frames each reading client got per second. The write-per-frame case is
+// the reference without batching: one write of 16 bytes per frame to a socket a thread reads from.
+
+#define FRAMES_PER_BUFFER   19
+#define CLIENTS_MAX         5
+
+typedef struct {
+    int         fd;
+    pthread_t   thread;
+    UInt64      bytes;
+} Client;
+
+static CanMsg gFrames[FRAMES_PER_BUFFER * 64];
+static Client gClients[CLIENTS_MAX];
+
+static void BuildFrames(void)
+{
+    UInt32 i;
+    
+    bzero(gFrames, sizeof(gFrames));
+    for (i = 0; i < sizeof(gFrames) / sizeof(gFrames[0]); i++)
+    {
+        gFrames[i].canid.ul = 0x100 + i % 0x400;
+        gFrames[i].len = 8;
+        gFrames[i].ldata = i;
+    }
+}
+
+static void* Drain(void* refCon)
+{
+    UInt8 buffer[65536];
+    Client* client = refCon;
+    ssize_t got;
+    
+    while ((got = recv(client->fd, buffer, sizeof(buffer), 0)) > 0)
+        client->bytes += (UInt64)got;
+    return NULL;
+}
+
+static int Connect(const char* path)
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void Publish(PeakStream* stream, UInt64 frames)
+{
+    UInt64 i;
+    
+    for (i = 0; i < frames; i += FRAMES_PER_BUFFER)
+        PeakStreamPublish(stream, &gFrames[i % (sizeof(gFrames) / sizeof(gFrames[0]))], FRAMES_PER_BUFFER);
+}
+
+static void BenchIdle(const char* path)
+{
+    PeakStreamConfig config;
+    PeakStream stream;
+    PeakBenchRun bench;
+    UInt64 frames = PeakBenchCount(100000000);
+    
+    PeakStreamConfigInit(&config);
+    if (PeakStreamOpen(&stream, path, &config) != kIOReturnSuccess)
+        return;
+    PeakBenchBegin(&bench, "stream", "idle");
+    Publish(&stream, frames);
+    PeakBenchEnd(&bench, frames, "frame", "\"frames_per_buffer\": %u", FRAMES_PER_BUFFER);
+    PeakStreamClose(&stream);
+}
+
+static void BenchClients(const char* path, const char* name, UInt32 reading, UInt32 idle)
+{
+    struct timespec settle = { 0, (long)(2 * PEAK_STREAM_REQUEST_NS) };
+    PeakStreamConfig config;
+    PeakStreamStats stats;
+    PeakStream stream;
+    PeakBenchRun bench;
+    UInt64 frames = PeakBenchCount(4000000), received = 0, elapsedNs;
+    UInt32 i, count = reading + idle;
+    
+    PeakStreamConfigInit(&config);
+    if (PeakStreamOpen(&stream, path, &config) != kIOReturnSuccess)
+        return;
+    for (i = 0; i < count; i++)
+    {
+        bzero(&gClients[i], sizeof(Client));
+        gClients[i].fd = Connect(path);
+    }
+    nanosleep(&settle, NULL);
+    
+    PeakBenchBegin(&bench, "stream", name);
+    for (i = 0; i < reading; i++)
+        pthread_create(&gClients[i].thread, NULL, Drain, &gClients[i]);
+    Publish(&stream, frames);
+    PeakStreamGetStats(&stream, &stats);
+    
+    // the clients read what the sockets still hold and see them closed
+    PeakStreamClose(&stream);
+    for (i = 0; i < reading; i++)
+    {
+        pthread_join(gClients[i].thread, NULL);
+        received += gClients[i].bytes / sizeof(PeakCanFrame);
+    }
+    elapsedNs = PeakMonotonicNs() - bench.startNs;
+    for (i = 0; i < count; i++)
+        close(gClients[i].fd);
+    
+    PeakBenchEnd(&bench, received, "frame", "\"clients\": %u, \"idle_clients\": %u, \"published\": %llu, \"dropped\": %llu, \"frames_per_send\": %.1f, \"frames_per_sec_per_client\": %.0f",
+                 reading, idle, (unsigned long long)frames, (unsigned long long)stats.dropped,
+                 stats.sends ? (double)stats.frames / stats.sends : 0.0, reading ? received * 1e9 / elapsedNs / reading : 0.0);
+}
+
+static void BenchWritePerFrame(void)
+{
+    PeakCanFrame record;
+    PeakBenchRun bench;
+    UInt64 i, frames = PeakBenchCount(2000000);
+    int fds[2];
+    
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        return;
+    bzero(&gClients[0], sizeof(Client));
+    gClients[0].fd = fds[1];
+    bzero(&record, sizeof(record));
+    record.len = 8;
+    
+    PeakBenchBegin(&bench, "stream", "write-per-frame");
+    pthread_create(&gClients[0].thread, NULL, Drain, &gClients[0]);
+    for (i = 0; i < frames; i++)
+    {
+        record.canId = gFrames[i % (sizeof(gFrames) / sizeof(gFrames[0]))].canid.ul;
+        if (write(fds[0], &record, sizeof(record)) != sizeof(record))
+            break;
+    }
+    close(fds[0]);
+    pthread_join(gClients[0].thread, NULL);
+    PeakBenchEnd(&bench, gClients[0].bytes / sizeof(PeakCanFrame), "frame", "\"clients\": 1");
+    close(fds[1]);
+}
+
+void BenchStream(void)
+{
+    char path[256];
+    
+    PeakTestTempPath(path, sizeof(path), "bench.sock");
+    BuildFrames();
+    
+    BenchIdle(path);
+    BenchClients(path, "clients-1", 1, 0);
+    BenchClients(path, "clients-4", 4, 0);
+    BenchClients(path, "clients-4-idle-1", 4, 1);
+    BenchWritePerFrame();
+}
@@ -0,0 +1,138 @@
+/*
+    File:           BenchTimebase.c
+
+    Description:    Frame times from the fixed point timebase against the former per frame division, the
+                    cost of a completion, and the accuracy over a simulated day of crystal drift.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "PeakBench.h"
+#include "PeakTest.h"
+#include "PeakTimebase.h"
+#include "PeakSimDevice.h"
+
+// The time of a frame as the decoder gets it, from the fixed point rate, against the multiply, shift and
+// divisions by 1000000 calcTimevalFromTicks did for every frame. The completion case feeds one sample
+// per completion, a fit every interval. The drift case runs a simulated day of an adapter whose crystal
+// is 50 ppm fast, with a completion every 10 ms of 100 us to 1 ms latency and every fiftieth one held up
+// by up to 20 ms, and reports how far the frames' times were from the truth every second.
+
+#define TS_US_PER_TICK      44739243    // PCAN_USB_TS_US_PER_TICK
+#define TS_DIV_SHIFTER      20
+
+// the former per frame conversion, relative to the start time
+static void TimevalFromTicks(struct timeval* tv, const struct timeval* start, UInt64 ticks)
+{
+    UInt64 llx = ticks * TS_US_PER_TICK >> TS_DIV_SHIFTER;
+    UInt32 nb_s = (UInt32)llx / 1000000, nb_us = (UInt32)(llx - (UInt64)nb_s * 1000000);
+    
+    tv->tv_usec = start->tv_usec + nb_us;
+    if (tv->tv_usec > 1000000)
+    {
+        tv->tv_usec -= 1000000;
+        nb_s++;
+    }
+    tv->tv_sec = start->tv_sec + nb_s;
+}
+
+static void BenchFrames(void)
+{
+    PeakTimebase timebase;
+    struct timeval start = { 1350000000, 123456 }, tv;
+    PeakBenchRun bench;
+    UInt64 i, sum = 0, frames = PeakBenchCount(100000000);
+    
+    PeakTimebaseInit(&timebase, PEAK_SIM_TICK_NS);
+    PeakTimebaseComplete(&timebase, 0, 1000000000ULL);
+    
+    PeakBenchBegin(&bench, "timebase", "monotonic-fixed-point");
+    for (i = 0; i < frames; i++)
+        sum += PeakTimebaseMonotonic(&timebase, i * 7);
+    PeakBenchEnd(&bench, frames, "frame", "\"checksum\": %llu", (unsigned long long)(sum & 0xffff));
+    
+    sum = 0;
+    PeakBenchBegin(&bench, "timebase", "timeval-division");
+    for (i = 0; i < frames; i++)
+    {
+        TimevalFromTicks(&tv, &start, i * 7);
+        sum += (UInt64)tv.tv_sec + (UInt64)tv.tv_usec;
+    }
+    PeakBenchEnd(&bench, frames, "frame", "\"checksum\": %llu", (unsigned long long)(sum & 0xffff));
+}
+
+static void BenchCompletions(void)
+{
+    PeakTimebase timebase;
+    PeakBenchRun bench;
+    UInt64 i, seed = 1, completions = PeakBenchCount(20000000);
+    
+    PeakTimebaseInit(&timebase, PEAK_SIM_TICK_NS);
+    PeakBenchBegin(&bench, "timebase", "completion");
+    for (i = 0; i < completions; i++)
+        PeakTimebaseComplete(&timebase, i * 24, 1000000000ULL + i * 1024000 + 100000 + PeakTestNext(&seed) % 900000);
+    PeakBenchEnd(&bench, completions, "completion", "\"ppm\": %.3f, \"resets\": %llu",
+                 timebase.ppm, (unsigned long long)timebase.resets);
+}
+
+static void BenchDrift(void)
+{
+    PeakTimebase timebase;
+    PeakBenchRun bench;
+    UInt64 t, ticks, latency, seed = 1, start = 1000000000ULL, end = start + PeakBenchCount(86400) * 1000000000ULL;
+    UInt64 completions = 0, checks = 0;
+    SInt64 error, worst = 0;
+    double sum = 0, nominal;
+    
+    PeakTimebaseInit(&timebase, PEAK_SIM_TICK_NS);
+    PeakBenchBegin(&bench, "timebase", "drift-50ppm");
+    for (t = start; t < end; t += 10000000, completions++)
+    {
+        ticks = (UInt64)((double)(t - start) * (1.0 + 50e-6) / PEAK_SIM_TICK_NS);
+        latency = 100000 + PeakTestNext(&seed) % 900000;
+        if (PeakTestNext(&seed) % 50 == 0)
+            latency += PeakTestNext(&seed) % 20000000;
+        PeakTimebaseComplete(&timebase, ticks, t + latency);
+        
+        // once the first window is full
+        if (t - start >= 20000000000ULL && (t - start) % 1000000000ULL == 0)
+        {
+            error = (SInt64)(PeakTimebaseMonotonic(&timebase, ticks) - t);
+            sum += (double)error * error;
+            if (llabs(error) > llabs(worst))
+                worst = error;
+            checks++;
+        }
+    }
+    nominal = (double)(end - start) * 50e-6;
+    PeakBenchEnd(&bench, completions, "completion", "\"simulated_seconds\": %llu, \"rms_error_ns\": %.0f, \"max_error_ns\": %lld, \"nominal_error_ns\": %.0f, \"ppm\": %.3f, \"resets\": %llu",
+                 (unsigned long long)((end - start) / 1000000000ULL), checks ? sqrt(sum / checks) : 0.0, (long long)worst,
+                 nominal, timebase.ppm, (unsigned long long)timebase.resets);
+}
+
+void BenchTimebase(void)
+{
+    BenchFrames();
+    BenchCompletions();
+    BenchDrift();
+}
@@ -0,0 +1,195 @@
+/*
+    File:           BenchTrigger.c
+
+    Description:    Feeding a 1 Mbit/s trace through the trigger history and taking the frames of its
+                    windows, with nothing firing, with match windows and with identifier timeouts.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "PeakBench.h"
+#include "PeakTest.h"
+#include "PeakTrigger.h"
+#include "PeakCapture.h"
+#include "PeakBusStats.h"
+#include "PeakBatch.h"
+
+// A trace of 64 identifiers at 1 Mbit/s, each frame as long on the wire as PeakBusStatsFrameBits says,
+// fed in batches of PEAK_CAPTURE_MERGE_FRAMES as the capture writer does, with what the windows hold
+// taken after each batch. The idle case has a term and eight timeouts that never fire, the cost every
+// frame pays while nothing happens. In the windows case a frame every 100 ms of bus time matches, with
+// 10 ms before and 15 ms after it written, a quarter of the trace. The timeouts case watches 64
+// identifiers, one of which goes missing now and then. All report the share of a CPU a full bus takes.
+
+#define TRACE           262144
+#define IDS             64
+
+static CanMsg gTrace[TRACE];
+static CanMsg gTaken[PEAK_CAPTURE_MERGE_FRAMES * 4];
+static UInt64 gTraceNs = 0;         // on the wire
+
+static UInt32 TraceId(UInt32 n)
+{
+    return n % 4 == 3 ? 0x18da0000 + n : 0x100 + n;
+}
+
+static void BuildTrace(void)
+{
+    UInt64 seed = 1, ns = 1000000000ULL;
+    UInt32 i, n;
+    
+    for (i = 0; i < TRACE; i++)
+    {
+        CanMsg* msg = &gTrace[i];
+        
+        n = (UInt32)(PeakTestNext(&seed) % IDS);
+        bzero(msg, sizeof(CanMsg));
+        msg->canid.ul = TraceId(n);
+        msg->ext = n % 4 == 3;
+        msg->len = 8;
+        msg->ldata = PeakTestNext(&seed);
+        msg->mono = msg->ts = ns;
+        ns += PeakBusStatsFrameBits(msg) * 1000ULL;
+    }
+    gTraceNs = ns - 1000000000ULL;
+}
+
+// the trace over and over, its time moving on with each round
+static void Run(const char* name, PeakTrigger* trigger, UInt64 rounds, UInt32 matchEveryNs)
+{
+    static CanMsg batch[PEAK_CAPTURE_MERGE_FRAMES];
+    PeakTriggerStats stats;
+    PeakBenchRun bench;
+    UInt64 r, offsetNs, nextMatchNs = matchEveryNs, frames = 0, taken = 0, elapsedNs;
+    UInt32 i, j, n;
+    
+    PeakBenchBegin(&bench, "trigger", name);
+    for (r = 0; r < rounds; r++)
+    {
+        offsetNs = r * gTraceNs;
+        for (i = 0; i < TRACE; i += PEAK_CAPTURE_MERGE_FRAMES)
+        {
+            for (j = 0; j < PEAK_CAPTURE_MERGE_FRAMES; j++)
+            {
+                batch[j] = gTrace[i + j];
+                batch[j].mono += offsetNs;
+                if (matchEveryNs && batch[j].mono - 1000000000ULL >= nextMatchNs)
+                {
+                    batch[j].canid.ul = 0x7ff;
+                    batch[j].ext = 0;
+                    nextMatchNs += matchEveryNs;
+                }
+            }
+            PeakTriggerFeed(trigger, batch, PEAK_CAPTURE_MERGE_FRAMES, batch[PEAK_CAPTURE_MERGE_FRAMES - 1].mono);
+            while ((n = PeakTriggerTake(trigger, gTaken, sizeof(gTaken) / sizeof(gTaken[0]))) > 0)
+                taken += n;
+            frames += PEAK_CAPTURE_MERGE_FRAMES;
+        }
+    }
+    elapsedNs = PeakMonotonicNs() - bench.startNs;
+    PeakTriggerGetStats(trigger, &stats);
+    PeakBenchEnd(&bench, frames, "frame", "\"windows\": %llu, \"merged\": %llu, \"timeouts\": %llu, \"taken_share\": %.3f, \"lost\": %llu, \"cpu_share_1mbit\": %.5f",
+                 (unsigned long long)stats.windows, (unsigned long long)stats.merged, (unsigned long long)stats.causes[PEAK_TRIGGER_TIMEOUT],
+                 (double)taken / frames, (unsigned long long)stats.lost, (double)elapsedNs / (rounds * gTraceNs));
+}
+
+static void BenchIdle(void)
+{
+    PeakTriggerTimeout timeouts[8];
+    PeakTriggerConfig config;
+    PeakFilterTerm term;
+    PeakTrigger trigger;
+    UInt32 i;
+    
+    PeakFilterTermInit(&term);
+    term.low = term.high = 0x7ff;
+    term.flagsMask = PEAK_FILTER_EXT;
+    for (i = 0; i < 8; i++)
+    {
+        timeouts[i].canid = i % 4 == 3 ? PEAK_TRIGGER_EXT | TraceId(i) : TraceId(i);
+        timeouts[i].timeoutNs = 1000000000ULL;
+    }
+    
+    PeakTriggerConfigInit(&config);
+    config.terms = &term;
+    config.termCount = 1;
+    config.timeouts = timeouts;
+    config.timeoutCount = 8;
+    if (PeakTriggerCreate(&trigger, &config) != kIOReturnSuccess)
+        return;
+    Run("idle", &trigger, PeakBenchCount(40), 0);
+    PeakTriggerDestroy(&trigger);
+}
+
+static void BenchWindows(void)
+{
+    PeakTriggerConfig config;
+    PeakFilterTerm term;
+    PeakTrigger trigger;
+    
+    PeakFilterTermInit(&term);
+    term.low = term.high = 0x7ff;
+    term.flagsMask = PEAK_FILTER_EXT;
+    
+    PeakTriggerConfigInit(&config);
+    config.preNs = 10000000ULL;
+    config.postNs = 15000000ULL;
+    config.terms = &term;
+    config.termCount = 1;
+    if (PeakTriggerCreate(&trigger, &config) != kIOReturnSuccess)
+        return;
+    Run("windows", &trigger, PeakBenchCount(40), 100000000);
+    PeakTriggerDestroy(&trigger);
+}
+
+static void BenchTimeouts(void)
+{
+    PeakTriggerTimeout timeouts[IDS];
+    PeakTriggerConfig config;
+    PeakTrigger trigger;
+    UInt32 i;
+    
+    // every identifier shows up about every 8 ms, 30 ms without one happens now and then
+    for (i = 0; i < IDS; i++)
+    {
+        timeouts[i].canid = i % 4 == 3 ? PEAK_TRIGGER_EXT | TraceId(i) : TraceId(i);
+        timeouts[i].timeoutNs = 30000000ULL;
+    }
+    
+    PeakTriggerConfigInit(&config);
+    config.preNs = 1000000ULL;
+    config.postNs = 1000000ULL;
+    config.timeouts = timeouts;
+    config.timeoutCount = IDS;
+    if (PeakTriggerCreate(&trigger, &config) != kIOReturnSuccess)
+        return;
+    Run("timeouts", &trigger, PeakBenchCount(40), 0);
+    PeakTriggerDestroy(&trigger);
+}
+
+void BenchTrigger(void)
+{
+    if (gTraceNs == 0)
+        BuildTrace();
+    
+    BenchIdle();
+    BenchWindows();
+    BenchTimeouts();
+}
@@ -0,0 +1,198 @@
+/*
+    File:           BenchTx.c
+
+    Description:    Transmit throughput against a stand-in endpoint, one frame per write as before the
+                    queue and packed by the queue with several writes in flight.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "PeakBench.h"
+#include "PeakTxQueue.h"
+
+// A stand-in endpoint on a thread of its own takes the submitted telegrams and completes them in order,
+// as fast as it can. Before the queue every frame was a telegram of its own with one write at a time;
+// the queue packs what is waiting and keeps several writes in flight.
+
+#define ENDPOINT_SLOTS      32
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  wakeup;
+    void*           contexts[ENDPOINT_SLOTS];
+    UInt32          head, tail;
+    int             running;
+    PeakTxQueue*    queue;          // completed through the queue, or
+    sem_t           done;           // posted for every single write
+    UInt64          telegrams;
+    UInt64          bytes;
+} Endpoint;
+
+static IOReturn Submit(void* refCon, const UInt8* buffer, UInt32 length, void* context)
+{
+    Endpoint* endpoint = refCon;
+    IOReturn kr = kIOReturnSuccess;
+    
+    pthread_mutex_lock(&endpoint->lock);
+    if (endpoint->head - endpoint->tail == ENDPOINT_SLOTS)
+    {
+        kr = kIOReturnNoResources;
+    }
+    else
+    {
+        endpoint->contexts[endpoint->head++ % ENDPOINT_SLOTS] = context;
+        endpoint->telegrams++;
+        endpoint->bytes += length;
+        (void)buffer;
+        pthread_cond_signal(&endpoint->wakeup);
+    }
+    pthread_mutex_unlock(&endpoint->lock);
+    return kr;
+}
+
+static void* EndpointThread(void* arg)
+{
+    Endpoint* endpoint = arg;
+    void* context;
+    
+    pthread_mutex_lock(&endpoint->lock);
+    while (endpoint->running || endpoint->head != endpoint->tail)
+    {
+        if (endpoint->head == endpoint->tail)
+        {
+            pthread_cond_wait(&endpoint->wakeup, &endpoint->lock);
+            continue;
+        }
+        context = endpoint->contexts[endpoint->tail++ % ENDPOINT_SLOTS];
+        pthread_mutex_unlock(&endpoint->lock);
+        if (endpoint->queue)
+            PeakTxQueueComplete(endpoint->queue, context, kIOReturnSuccess);
+        else
+            sem_post(&endpoint->done);
+        pthread_mutex_lock(&endpoint->lock);
+    }
+    pthread_mutex_unlock(&endpoint->lock);
+    return NULL;
+}
+
+static void EndpointStart(Endpoint* endpoint, pthread_t* thread, PeakTxQueue* queue)
+{
+    bzero(endpoint, sizeof(Endpoint));
+    pthread_mutex_init(&endpoint->lock, NULL);
+    pthread_cond_init(&endpoint->wakeup, NULL);
+    sem_init(&endpoint->done, 0, 0);
+    endpoint->queue = queue;
+    endpoint->running = 1;
+    pthread_create(thread, NULL, EndpointThread, endpoint);
+}
+
+static void EndpointStop(Endpoint* endpoint, pthread_t thread)
+{
+    pthread_mutex_lock(&endpoint->lock);
+    endpoint->running = 0;
+    pthread_cond_signal(&endpoint->wakeup);
+    pthread_mutex_unlock(&endpoint->lock);
+    pthread_join(thread, NULL);
+    sem_destroy(&endpoint->done);
+    pthread_cond_destroy(&endpoint->wakeup);
+    pthread_mutex_destroy(&endpoint->lock);
+}
+
+// standard identifiers with eight bytes, or a mix of extended ones and all lengths
+static void Frames(CanMsg* msgs, UInt32 count, int mixed)
+{
+    UInt32 i;
+    
+    bzero(msgs, count * sizeof(CanMsg));
+    for (i = 0; i < count; i++)
+    {
+        msgs[i].canid.ul = 0x100 + (i & 0x3ff);
+        msgs[i].len = 8;
+        msgs[i].ldata = i * 0x0101010101010101ULL;
+        if (mixed)
+        {
+            msgs[i].ext = (i % 3) == 0;
+            msgs[i].len = i % 9;
+        }
+    }
+}
+
+static void BenchSingle(void)
+{
+    static CanMsg msgs[1024];
+    static Endpoint endpoint;
+    UInt8 telegram[PEAK_TX_BUFFER_SIZE];
+    PeakBenchRun bench;
+    pthread_t thread;
+    UInt64 i, frames = PeakBenchCount(500000);
+    
+    Frames(msgs, 1024, 0);
+    EndpointStart(&endpoint, &thread, NULL);
+    
+    PeakBenchBegin(&bench, "tx", "single-write");
+    for (i = 0; i < frames; i++)
+    {
+        PeakTxEncode(&msgs[i & 1023], 1, telegram, (UInt8)(i % 200 + 1));
+        Submit(&endpoint, telegram, PEAK_TX_BUFFER_SIZE, NULL);
+        sem_wait(&endpoint.done);
+    }
+    PeakBenchEnd(&bench, frames, "frame", "\"telegrams\": %llu, \"frames_per_telegram\": 1.0",
+                 (unsigned long long)endpoint.telegrams);
+    
+    EndpointStop(&endpoint, thread);
+}
+
+static void BenchPacked(const char* name, int mixed)
+{
+    static CanMsg msgs[1024];
+    static PeakTxQueue queue;
+    static Endpoint endpoint;
+    PeakTxQueueStats stats;
+    PeakBenchRun bench;
+    pthread_t thread;
+    UInt64 i, frames = PeakBenchCount(5000000);
+    
+    Frames(msgs, 1024, mixed);
+    PeakTxQueueCreate(&queue, PEAK_TX_DEFAULT_DEPTH);
+    EndpointStart(&endpoint, &thread, &queue);
+    PeakTxQueueAttach(&queue, Submit, &endpoint);
+    
+    // callers hand over 64 frames at a time and wait for space, as a paste or a replay does
+    PeakBenchBegin(&bench, "tx", name);
+    for (i = 0; i < frames; i += 64)
+        PeakTxQueueSend(&queue, &msgs[i & 1023], frames - i < 64 ? (UInt32)(frames - i) : 64, 1, NULL);
+    for (PeakTxQueueGetStats(&queue, &stats); stats.queued || stats.inFlight; PeakTxQueueGetStats(&queue, &stats))
+        sched_yield();
+    PeakBenchEnd(&bench, stats.frames, "frame", "\"telegrams\": %llu, \"frames_per_telegram\": %.2f, \"blocked\": %llu",
+                 (unsigned long long)stats.telegrams, (double)stats.frames / stats.telegrams,
+                 (unsigned long long)stats.blocked);
+    
+    PeakTxQueueDetach(&queue);
+    EndpointStop(&endpoint, thread);
+}
+
+void BenchTx(void)
+{
+    BenchSingle();
+    BenchPacked("packed-std8", 0);
+    BenchPacked("packed-mixed", 1);
+}
@@ -0,0 +1,245 @@
+/*
+    File:           PeakBench.c
+
+    Description:    Benchmark suites of the portable sources, reported as JSON so runs can be
+                    compared against each other.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "PeakBench.h"
+#include "PeakBatch.h"
+
+// Usage: PeakBench [-s scale] [suite ...]
+//
+// Runs the given suites, all of them without arguments, and writes one JSON document to stdout:
+//
+//   { "scale": 1, "benchmarks": [ { "suite": "ring", "case": "spsc", "items": 20000000, "unit": "frame",
+//     "seconds": 0.41, "ns_per_item": 20.5, "items_per_sec": 48780487, "allocs_per_item": 0,
+//     "cycles_per_item": null, ... }, ... ] }
+//
+// Progress and whatever the driver prints go to stderr. -s scales the item counts of all suites.
+
+typedef struct {
+    const char* name;
+    void        (*run)(void);
+} BenchSuite;
+
+static const BenchSuite gSuites[] = {
+    { "ring",       BenchRing },
+    { "batch",      BenchBatch },
+    { "tx",         BenchTx },
+    { "capture",    BenchCapture },
+    { "index",      BenchIndex },
+    { "store",      BenchFrameStore },
+    { "export",     BenchExport },
+    { "filter",     BenchFilter },
+    { "replay",     BenchReplay },
+    { "decode",     BenchDecode },
+    { "timebase",   BenchTimebase },
+    { "merge",      BenchMerge },
+    { "instrument", BenchInstrument },
+    { "busstats",   BenchBusStats },
+    { "canopen",    BenchCanopen },
+    { "dbc",        BenchDbc },
+    { "archive",    BenchArchive },
+    { "parse",      BenchParse },
+    { "live",       BenchLive },
+    { "stream",     BenchStream },
+    { "trigger",    BenchTrigger },
+};
+
+#define SUITES      (sizeof(gSuites) / sizeof(gSuites[0]))
+
+static FILE*                        gOut = NULL;        // the JSON, stdout itself goes to stderr
+static double                       gScale = 1.0;
+static int                          gRecords = 0;       // written so far, for the separators
+static UInt64                       gAllocs = 0;
+
+#pragma mark - Allocations
+
+// the link wraps the calls made by the driver sources and the suites, see the Makefile
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void __real_free(void* ptr);
+
+void* __wrap_malloc(size_t size)
+{
+    __atomic_add_fetch(&gAllocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size)
+{
+    __atomic_add_fetch(&gAllocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+    __atomic_add_fetch(&gAllocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void* ptr)
+{
+    __real_free(ptr);
+}
+
+UInt64 PeakBenchAllocs(void)
+{
+    return __atomic_load_n(&gAllocs, __ATOMIC_RELAXED);
+}
+
+#pragma mark - Measurements
+
+// the cycles of this process and the threads it starts from now on, -1 where perf events are not allowed
+static int OpenCycles(void)
+{
+    struct perf_event_attr attr;
+    
+    bzero(&attr, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void PeakBenchBegin(PeakBenchRun* run, const char* suite, const char* name)
+{
+    fprintf(stderr, "%s/%s\n", suite, name);
+    run->suite = suite;
+    run->name = name;
+    run->cycles = OpenCycles();
+    if (run->cycles >= 0)
+    {
+        ioctl(run->cycles, PERF_EVENT_IOC_RESET, 0);
+        ioctl(run->cycles, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    run->startAllocs = PeakBenchAllocs();
+    run->startNs = PeakMonotonicNs();
+}
+
+void PeakBenchEnd(PeakBenchRun* run, UInt64 items, const char* unit, const char* extra, ...)
+{
+    UInt64 ns = PeakMonotonicNs() - run->startNs, allocs = PeakBenchAllocs() - run->startAllocs, cycles = 0;
+    int haveCycles = 0;
+    va_list args;
+    
+    if (run->cycles >= 0)
+    {
+        ioctl(run->cycles, PERF_EVENT_IOC_DISABLE, 0);
+        haveCycles = read(run->cycles, &cycles, sizeof(cycles)) == sizeof(cycles);
+        close(run->cycles);
+    }
+    if (items == 0)
+        items = 1;
+    if (ns == 0)
+        ns = 1;
+    
+    fprintf(gOut, "%s\n    { \"suite\": \"%s\", \"case\": \"%s\", \"items\": %llu, \"unit\": \"%s\", \"seconds\": %.6f, "
+           "\"ns_per_item\": %.3f, \"items_per_sec\": %.0f, \"allocs_per_item\": %.6f, ",
+           gRecords++ ? "," : "", run->suite, run->name, (unsigned long long)items, unit, ns / 1e9,
+           (double)ns / items, items * 1e9 / ns, (double)allocs / items);
+    if (haveCycles)
+        fprintf(gOut, "\"cycles_per_item\": %.2f", (double)cycles / items);
+    else
+        fprintf(gOut, "\"cycles_per_item\": null");
+    
+    if (extra)
+    {
+        fprintf(gOut, ", ");
+        va_start(args, extra);
+        vfprintf(gOut, extra, args);
+        va_end(args);
+    }
+    fprintf(gOut, " }");
+    fflush(gOut);
+}
+
+UInt64 PeakBenchCount(UInt64 count)
+{
+    UInt64 scaled = (UInt64)(count * gScale);
+    return scaled ? scaled : 1;
+}
+
+#pragma mark - Main
+
+int main(int argc, char** argv)
+{
+    UInt32 i;
+    int arg = 1, first, found;
+    
+    if (arg + 1 < argc && strcmp(argv[arg], "-s") == 0)
+    {
+        gScale = atof(argv[arg + 1]);
+        if (gScale <= 0)
+        {
+            fprintf(stderr, "Unable to use scale %s.\n", argv[arg + 1]);
+            return 1;
+        }
+        arg += 2;
+    }
+    first = arg;
+    
+    for (; arg < argc; arg++)
+    {
+        for (i = 0, found = 0; i < SUITES; i++)
+            found |= strcmp(argv[arg], gSuites[i].name) == 0;
+        if (!found)
+        {
+            fprintf(stderr, "No suite %s, there are:", argv[arg]);
+            for (i = 0; i < SUITES; i++)
+                fprintf(stderr, " %s", gSuites[i].name);
+            fprintf(stderr, "\n");
+            return 1;
+        }
+    }
+    
+    // the driver prints its messages to stdout
+    fflush(stdout);
+    gOut = fdopen(dup(STDOUT_FILENO), "w");
+    if (gOut == NULL)
+        return 1;
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    
+    fprintf(gOut, "{ \"scale\": %g, \"benchmarks\": [", gScale);
+    for (i = 0; i < SUITES; i++)
+    {
+        for (arg = first, found = first == argc; arg < argc; arg++)
+            found |= strcmp(argv[arg], gSuites[i].name) == 0;
+        if (found)
+            gSuites[i].run();
+    }
+    fprintf(gOut, "\n] }\n");
+    fclose(gOut);
+    return 0;
+}
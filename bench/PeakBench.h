@@ -0,0 +1,71 @@
+/*
+    File:           PeakBench.h
+
+    Description:    Benchmark suites of the portable sources, reported as JSON so runs can be
+                    compared against each other.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakBench_h
+#define PeakLog_PeakBench_h
+
+#include "PeakUSB.h"
+
+// One measurement: PeakBenchBegin starts the clock, the allocation count and the cycle counter (where
+// perf counters are available), PeakBenchEnd stops them and reports per item of the given unit.
+typedef struct {
+    const char* suite;
+    const char* name;
+    UInt64      startNs;
+    UInt64      startAllocs;
+    int         cycles;         // perf event, -1 if not available
+} PeakBenchRun;
+
+void PeakBenchBegin(PeakBenchRun* run, const char* suite, const char* name);
+// extra is a printf format for further "key": value pairs of the record, NULL for none
+void PeakBenchEnd(PeakBenchRun* run, UInt64 items, const char* unit, const char* extra, ...);
+
+// count scaled by the -s option, at least 1
+UInt64 PeakBenchCount(UInt64 count);
+// malloc, calloc and realloc calls made by the driver sources and the suites so far
+UInt64 PeakBenchAllocs(void);
+
+// the suites, see PeakBench.c for the table
+void BenchRing(void);
+void BenchBatch(void);
+void BenchTx(void);
+void BenchCapture(void);
+void BenchIndex(void);
+void BenchFrameStore(void);
+void BenchExport(void);
+void BenchFilter(void);
+void BenchReplay(void);
+void BenchDecode(void);
+void BenchTimebase(void);
+void BenchMerge(void);
+void BenchInstrument(void);
+void BenchBusStats(void);
+void BenchCanopen(void);
+void BenchDbc(void);
+void BenchArchive(void);
+void BenchParse(void);
+void BenchLive(void);
+void BenchStream(void);
+void BenchTrigger(void);
+
+#endif
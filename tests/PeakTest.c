@@ -0,0 +1,238 @@
+/*
+    File:           PeakTest.c
+
+    Description:    Minimal unit test support for the portable sources: checks that count failures,
+                    and the loopback driver running on a thread of its own.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "PeakTest.h"
+#include "PeakBatch.h"
+#include "PeakTransport.h"
+#include "PeakIndex.h"
+
+int gPeakTestFailures = 0;
+
+static PeakBatcher*                 gBatcher = NULL;    // set by the first "CanMsg" notification
+static UInt32                       gStatus = 0;
+static UInt32                       gBusOffs = 0;
+static pthread_t                    gThread;
+static int                          gRunning = 0;
+
+#pragma mark - Checks
+
+void PeakTestRun(const char* name, void (*test)(void))
+{
+    int before = gPeakTestFailures;
+    
+    test();
+    fprintf(stderr, "%-48s %s\n", name, gPeakTestFailures == before ? "ok" : "FAILED");
+}
+
+int PeakTestResult(const char* file)
+{
+    if (gPeakTestFailures)
+        fprintf(stderr, "%s: %d check(s) failed\n", file, gPeakTestFailures);
+    return gPeakTestFailures != 0;
+}
+
+#pragma mark - Fixtures
+
+void PeakTestTempPath(char* path, UInt32 size, const char* name)
+{
+    const char* dir = getenv("TMPDIR");
+    
+    snprintf(path, size, "%s/PeakLog-%d-%s", dir && dir[0] ? dir : "/tmp", (int)getpid(), name);
+}
+
+void PeakTestRemove(const char* path)
+{
+    char index[512];
+    
+    snprintf(index, sizeof(index), "%s%s", path, PEAK_INDEX_SUFFIX);
+    unlink(path);
+    unlink(index);
+}
+
+UInt64 PeakTestNext(UInt64* seed)
+{
+    *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return *seed >> 33;
+}
+
+#pragma mark - Telegrams
+
+void PeakTestTelegramBegin(PeakTestTelegram* telegram, UInt16 ticks)
+{
+    bzero(telegram, sizeof(PeakTestTelegram));
+    telegram->data[0] = 2;
+    telegram->length = 2;
+    telegram->ticks = ticks;
+}
+
+// the word timestamp for the first record, the low byte after it
+static void PutTicks(PeakTestTelegram* telegram)
+{
+    telegram->data[telegram->length++] = (UInt8)telegram->ticks;
+    if (telegram->data[1] == 0)
+        telegram->data[telegram->length++] = (UInt8)(telegram->ticks >> 8);
+}
+
+int PeakTestTelegramFrame(PeakTestTelegram* telegram, const CanMsg* msg, UInt16 advance)
+{
+    UInt32 len = msg->len > 8 ? 8 : msg->len, dataLen = msg->rtr ? 0 : len, id, j;
+    UInt32 size = 1 + (msg->ext ? 4 : 2) + (telegram->data[1] ? 1 : 2) + dataLen;
+    
+    if (telegram->length + size > sizeof(telegram->data) || telegram->data[1] == 255)
+        return 0;
+    
+    telegram->ticks += advance;
+    telegram->data[telegram->length++] = (UInt8)(len | (msg->ext ? STLN_EXTENDED_ID : 0) | (msg->rtr ? STLN_RTR : 0));
+    id = msg->canid.ul << (msg->ext ? 3 : 5);
+    telegram->data[telegram->length++] = (UInt8)id;
+    telegram->data[telegram->length++] = (UInt8)(id >> 8);
+    if (msg->ext)
+    {
+        telegram->data[telegram->length++] = (UInt8)(id >> 16);
+        telegram->data[telegram->length++] = (UInt8)(id >> 24);
+    }
+    PutTicks(telegram);
+    for (j = 0; j < dataLen; j++)
+        telegram->data[telegram->length++] = msg->data[j];
+    telegram->data[1]++;
+    return 1;
+}
+
+int PeakTestTelegramStatus(PeakTestTelegram* telegram, UInt8 function, UInt8 number, UInt16 advance)
+{
+    if (telegram->length + 3 + (telegram->data[1] ? 1 : 2) > sizeof(telegram->data) || telegram->data[1] == 255)
+        return 0;
+    
+    telegram->ticks += advance;
+    telegram->data[telegram->length++] = STLN_INTERNAL_DATA | STLN_WITH_TIMESTAMP;
+    telegram->data[telegram->length++] = function;
+    telegram->data[telegram->length++] = number;
+    PutTicks(telegram);
+    telegram->data[1]++;
+    return 1;
+}
+
+#pragma mark - Loopback driver
+
+static void Observer(void* refCon, const char* name, const void* object)
+{
+    (void)refCon;
+    
+    if (strcmp(name, "CanMsg") == 0)
+        __atomic_store_n(&gBatcher, (PeakBatcher*)object, __ATOMIC_RELEASE);
+    else if (strcmp(name, "CanStatus") == 0)
+    {
+        const CanMsg* msg = object;
+        
+        __atomic_add_fetch(&gStatus, 1, __ATOMIC_RELAXED);
+        if (msg->canid.uc[0] == 1 && (msg->canid.uc[1] & BUS_OFF))
+            __atomic_add_fetch(&gBusOffs, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void* DriverThread(void* arg)
+{
+    (void)arg;
+    PeakStart();
+    return NULL;
+}
+
+IOReturn PeakTestStartLoopback(UInt32 count)
+{
+    struct timespec pause = { 0, 1000000 };
+    UInt64 startNs;
+    
+    if (gRunning)
+        return kIOReturnBusy;
+    
+    gBatcher = NULL;
+    gStatus = 0;
+    gBusOffs = 0;
+    PeakLoopbackSetAdapters(count);
+    PeakSetObserver(Observer, NULL);
+    PeakSetTransport(&gPeakLoopbackTransport);
+    if (pthread_create(&gThread, NULL, DriverThread, NULL) != 0)
+        return kIOReturnNoResources;
+    gRunning = 1;
+    
+    startNs = PeakMonotonicNs();
+    while (PeakChannelCount() < count)
+    {
+        if (PeakMonotonicNs() - startNs > 5000000000ULL)
+        {
+            PeakTestStopLoopback();
+            return kIOReturnTimeout;
+        }
+        nanosleep(&pause, NULL);
+    }
+    return kIOReturnSuccess;
+}
+
+void PeakTestStopLoopback(void)
+{
+    struct timespec pause = { 0, 1000000 };
+    
+    if (!gRunning)
+        return;
+    
+    PeakStop();
+    pthread_join(gThread, NULL);
+    while (PeakChannelCount() > 0)
+        nanosleep(&pause, NULL);
+    gRunning = 0;
+}
+
+UInt32 PeakTestReceive(CanMsg* msgs, UInt32 max, UInt32 want, UInt64 timeoutNs)
+{
+    struct timespec pause = { 0, 1000000 };
+    UInt64 startNs = PeakMonotonicNs();
+    UInt32 count = 0;
+    
+    for (;;)
+    {
+        PeakBatcher* batcher = __atomic_load_n(&gBatcher, __ATOMIC_ACQUIRE);
+        
+        if (batcher)
+            count += PeakBatcherDrain(batcher, msgs + count, max - count, PeakMonotonicNs());
+        if (count >= want || count == max || PeakMonotonicNs() - startNs > timeoutNs)
+            return count;
+        nanosleep(&pause, NULL);
+    }
+}
+
+UInt32 PeakTestStatusCount(void)
+{
+    return __atomic_load_n(&gStatus, __ATOMIC_RELAXED);
+}
+
+UInt32 PeakTestBusOffCount(void)
+{
+    return __atomic_load_n(&gBusOffs, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,77 @@
+/*
+    File:           PeakTest.h
+
+    Description:    Minimal unit test support for the portable sources: checks that count failures,
+                    and the loopback driver running on a thread of its own.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PeakLog_PeakTest_h
+#define PeakLog_PeakTest_h
+
+#include <stdio.h>
+
+#include "PeakUSB.h"
+
+extern int gPeakTestFailures;
+
+// a failed check is reported and counted, the test goes on
+#define CHECK(cond) \
+    do { if (!(cond)) { fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); gPeakTestFailures++; } } while (0)
+
+#define CHECK_EQ(a, b) \
+    do { unsigned long long _a = (unsigned long long)(a), _b = (unsigned long long)(b); \
+         if (_a != _b) { fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed, %llu != %llu\n", __FILE__, __LINE__, #a, #b, _a, _b); gPeakTestFailures++; } } while (0)
+
+#define RUN(test) PeakTestRun(#test, test)
+
+void PeakTestRun(const char* name, void (*test)(void));
+// 0 if every check passed, for main to return
+int PeakTestResult(const char* file);
+
+// A scratch file in $TMPDIR, the process id in its name so that runs side by side do not clash;
+// PeakTestRemove deletes a capture file together with its index.
+void PeakTestTempPath(char* path, UInt32 size, const char* name);
+void PeakTestRemove(const char* path);
+// a repeatable pseudo-random sequence for generated traces, 31 bits per call
+UInt64 PeakTestNext(UInt64* seed);
+
+// A canned telegram in bulk-IN format: PeakTestTelegramBegin starts one, each PeakTestTelegramFrame
+// appends a record with the timestamp in the form the position asks for (word for the first record,
+// byte after it), and returns 0 once the 64 bytes are full.
+typedef struct {
+    UInt8   data[64];
+    UInt32  length;
+    UInt16  ticks;
+} PeakTestTelegram;
+
+void PeakTestTelegramBegin(PeakTestTelegram* telegram, UInt16 ticks);
+int PeakTestTelegramFrame(PeakTestTelegram* telegram, const CanMsg* msg, UInt16 advance);
+int PeakTestTelegramStatus(PeakTestTelegram* telegram, UInt8 function, UInt8 number, UInt16 advance);
+
+// The loopback transport with count adapters, PeakStart running on a thread of its own; returns once
+// every adapter is attached. Received frames are collected as the observer sees them.
+IOReturn PeakTestStartLoopback(UInt32 count);
+void PeakTestStopLoopback(void);
+// drains the received frames into msgs, waits up to timeoutNs for at least want of them
+UInt32 PeakTestReceive(CanMsg* msgs, UInt32 max, UInt32 want, UInt64 timeoutNs);
+// status records seen by the observer since the start, and those of them reporting bus-off
+UInt32 PeakTestStatusCount(void);
+UInt32 PeakTestBusOffCount(void);
+
+#endif
@@ -0,0 +1,337 @@
+/*
+    File:           TestAcceptance.c
+
+    Description:    Acceptance register computation checked exhaustively against random identifier sets,
+                    the control writes carrying them, and the host-side exact filter behind them on the
+                    loopback adapter.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "PeakTest.h"
+#include "PeakAcceptance.h"
+#include "PeakTransport.h"
+
+#define SETS            200
+#define SET_MAX         24
+#define PROBES          4096
+
+static CanMsg gReceived[1024];
+
+static void Frame(CanMsg* msg, UInt32 id, int ext, int rtr)
+{
+    bzero(msg, sizeof(CanMsg));
+    msg->canid.ul = id;
+    msg->ext = ext;
+    msg->rtr = rtr;
+}
+
+static int Passes(const PeakAcceptance* acc, UInt32 id, int ext)
+{
+    CanMsg msg;
+    
+    // for some RTR bit, with no payload to compare
+    Frame(&msg, id, ext, 0);
+    if (PeakAcceptanceMatch(acc, &msg))
+        return 1;
+    msg.rtr = 1;
+    return PeakAcceptanceMatch(acc, &msg);
+}
+
+// a set of identifiers close to each other now and then, as real ones are
+static UInt32 RandomSet(UInt64* seed, UInt32* ids, UInt32 kind)
+{
+    UInt32 i, count = 1 + (UInt32)(PeakTestNext(seed) % SET_MAX);
+    UInt32 base = (UInt32)PeakTestNext(seed);
+    
+    for (i = 0; i < count; i++)
+    {
+        int ext = kind == 1 || (kind == 2 && PeakTestNext(seed) & 1);
+        UInt32 id = PeakTestNext(seed) & 1 ? base + (UInt32)(PeakTestNext(seed) % 64) : (UInt32)PeakTestNext(seed);
+        
+        ids[i] = ext ? PEAK_ACCEPTANCE_EXT | (id & 0x1fffffff) : id & 0x7ff;
+    }
+    return count;
+}
+
+static int InSet(const UInt32* ids, UInt32 count, UInt32 id, int ext)
+{
+    UInt32 i, want = ext ? PEAK_ACCEPTANCE_EXT | id : id;
+    
+    for (i = 0; i < count; i++)
+    {
+        if (ids[i] == want)
+            return 1;
+    }
+    return 0;
+}
+
+static void TestOpen(void)
+{
+    PeakAcceptance acc;
+    UInt64 stdIds, extIds;
+    UInt32 id = 0x123;
+    CanMsg msg;
+    
+    PeakAcceptanceOpen(&acc);
+    PeakAcceptancePassed(&acc, &stdIds, &extIds);
+    CHECK_EQ(stdIds, 2048);
+    CHECK_EQ(extIds, 1ULL << 29);
+    Frame(&msg, 0x1fffffff, 1, 1);
+    CHECK(PeakAcceptanceMatch(&acc, &msg));
+    
+    // an empty set opens the filter, a bad identifier or mode is refused
+    CHECK_EQ(PeakAcceptanceCompute(&acc, NULL, 0, PEAK_ACCEPTANCE_BEST), kIOReturnSuccess);
+    CHECK_EQ(acc.mask[0], 0xff);
+    CHECK_EQ(PeakAcceptanceCompute(&acc, &id, 1, PEAK_ACCEPTANCE_BEST + 1), kIOReturnBadArgument);
+    id = 0x800;
+    CHECK_EQ(PeakAcceptanceCompute(&acc, &id, 1, PEAK_ACCEPTANCE_SINGLE), kIOReturnBadArgument);
+}
+
+// Every 11 bit identifier and every prefix the dual filters compare for 29 bit ones, against what the
+// registers claim to pass and against the wanted set.
+static void TestComputeStd(void)
+{
+    UInt32 ids[SET_MAX], count, set, mode, id, prefix;
+    UInt64 seed = 11, stdIds, extIds, stdCount, extCount;
+    PeakAcceptance acc, single;
+    
+    for (set = 0; set < SETS; set++)
+    {
+        count = RandomSet(&seed, ids, set % 3);
+        for (mode = PEAK_ACCEPTANCE_SINGLE; mode <= PEAK_ACCEPTANCE_BEST; mode++)
+        {
+            CHECK_EQ(PeakAcceptanceCompute(&acc, ids, count, mode), kIOReturnSuccess);
+            if (mode != PEAK_ACCEPTANCE_BEST)
+                CHECK_EQ(acc.single, mode == PEAK_ACCEPTANCE_SINGLE);
+            PeakAcceptancePassed(&acc, &stdIds, &extIds);
+            
+            stdCount = 0;
+            for (id = 0; id < 2048; id++)
+            {
+                if (Passes(&acc, id, 0))
+                    stdCount++;
+                else if (InSet(ids, count, id, 0))
+                    CHECK(!"wanted 11 bit identifier rejected");
+            }
+            CHECK_EQ(stdCount, stdIds);
+            
+            // dual filters compare ID.28-13 only
+            if (!acc.single)
+            {
+                extCount = 0;
+                for (prefix = 0; prefix < 65536; prefix++)
+                    extCount += Passes(&acc, prefix << 13, 1);
+                CHECK_EQ(extCount << 13, extIds);
+            }
+            
+            // best picks whichever passes less
+            if (mode == PEAK_ACCEPTANCE_SINGLE)
+                single = acc;
+            if (mode == PEAK_ACCEPTANCE_BEST)
+            {
+                UInt64 singleStd, singleExt;
+                
+                PeakAcceptancePassed(&single, &singleStd, &singleExt);
+                CHECK(stdIds / 2048.0 + extIds / 536870912.0 <= singleStd / 2048.0 + singleExt / 536870912.0);
+            }
+        }
+    }
+}
+
+// The tightest single filter for 29 bit identifiers fixes exactly the bits they all agree on; random
+// identifiers and the wanted ones with a bit flipped are checked against that. 11 bit frames are
+// compared with ID.28-18 there.
+static void TestComputeExt(void)
+{
+    UInt32 ids[SET_MAX], count, set, i, probe, id, differ;
+    UInt64 seed = 29, stdIds, extIds;
+    PeakAcceptance acc;
+    
+    for (set = 0; set < SETS; set++)
+    {
+        count = RandomSet(&seed, ids, 1);
+        CHECK_EQ(PeakAcceptanceCompute(&acc, ids, count, PEAK_ACCEPTANCE_SINGLE), kIOReturnSuccess);
+        CHECK(acc.single);
+        
+        differ = 0;
+        for (i = 0; i < count; i++)
+            differ |= (ids[i] ^ ids[0]) & 0x1fffffff;
+        PeakAcceptancePassed(&acc, &stdIds, &extIds);
+        CHECK_EQ(stdIds, 1ULL << __builtin_popcount(differ & 0x1ffc0000));
+        CHECK_EQ(extIds, 1ULL << __builtin_popcount(differ));
+        
+        for (i = 0; i < count; i++)
+            CHECK(Passes(&acc, ids[i] & 0x1fffffff, 1));
+        
+        for (probe = 0; probe < PROBES; probe++)
+        {
+            if (probe & 1)
+                id = (ids[probe % count] ^ (1U << (probe / 2 % 29))) & 0x1fffffff;
+            else
+                id = (UInt32)PeakTestNext(&seed) & 0x1fffffff;
+            CHECK_EQ(Passes(&acc, id, 1), ((id ^ ids[0]) & ~differ & 0x1fffffff) == 0);
+        }
+    }
+}
+
+static void TestParams(void)
+{
+    PCAN_USB_PARAM params[PEAK_ACCEPTANCE_PARAMS];
+    UInt32 ids[SET_MAX], count, set, mode, i, n;
+    PeakAcceptance acc, applied;
+    UInt64 seed = 7;
+    
+    for (set = 0; set < SETS; set++)
+    {
+        count = RandomSet(&seed, ids, set % 3);
+        for (mode = PEAK_ACCEPTANCE_SINGLE; mode <= PEAK_ACCEPTANCE_DUAL; mode++)
+        {
+            CHECK_EQ(PeakAcceptanceCompute(&acc, ids, count, mode), kIOReturnSuccess);
+            n = PeakAcceptanceParams(&acc, params);
+            CHECK_EQ(n, PEAK_ACCEPTANCE_PARAMS);
+            
+            // MOD keeps the controller in reset mode
+            CHECK_EQ(params[0].Param[0], SJA1000_MOD);
+            CHECK(params[0].Param[1] & SJA1000_MOD_RM);
+            
+            memset(&applied, 0x5a, sizeof(applied));
+            for (i = 0; i < n; i++)
+            {
+                CHECK_EQ(params[i].Function, PCAN_USB_FUNCTION_REGISTER);
+                CHECK(PeakAcceptanceApplyParam(&applied, &params[i]));
+            }
+            CHECK(memcmp(applied.code, acc.code, 4) == 0);
+            CHECK(memcmp(applied.mask, acc.mask, 4) == 0);
+            CHECK_EQ(applied.single, acc.single);
+        }
+    }
+    
+    // none of the other control writes touch the registers
+    CHECK(!PeakAcceptanceApplyParam(&applied, &PCAN_CTRL_CANON));
+    CHECK(!PeakAcceptanceApplyParam(&applied, &PCAN_CTRL_BITRATE125KHZ));
+    CHECK(!PeakAcceptanceApplyParam(&applied, &PCAN_CTRL_SILENTOFF));
+}
+
+// the registers go out after SJA1000INIT has put the controller into reset mode, before the bitrate
+static void TestCtrlWrites(void)
+{
+    static const UInt32 ids[] = { 0x100, 0x101, 0x103, PEAK_ACCEPTANCE_EXT | 0x18da00f1 };
+    PCAN_USB_PARAM log[PEAK_LOOPBACK_CTRL_LOG], params[PEAK_ACCEPTANCE_PARAMS];
+    PeakAcceptance acc;
+    UInt32 n, i, init = ~0U;
+    
+    CHECK_EQ(PeakSetAcceptance(ids, 4, PEAK_ACCEPTANCE_DUAL), kIOReturnSuccess);
+    CHECK_EQ(PeakAcceptanceCompute(&acc, ids, 4, PEAK_ACCEPTANCE_DUAL), kIOReturnSuccess);
+    PeakAcceptanceParams(&acc, params);
+    
+    // the MOD write of a dual filter looks just like SJA1000INIT, which follows CANOFF
+    n = PeakLoopbackGetCtrlWrites(0, log, PEAK_LOOPBACK_CTRL_LOG);
+    for (i = 1; i < n; i++)
+    {
+        if (memcmp(&log[i - 1], &PCAN_CTRL_CANOFF, sizeof(PCAN_USB_PARAM)) == 0 &&
+            memcmp(&log[i], &PCAN_CTRL_SJA1000INIT, sizeof(PCAN_USB_PARAM)) == 0)
+            init = i;
+    }
+    CHECK(init != ~0U && init + 1 + PEAK_ACCEPTANCE_PARAMS < n);
+    if (init == ~0U || init + 1 + PEAK_ACCEPTANCE_PARAMS >= n)
+        return;
+    
+    for (i = 0; i < PEAK_ACCEPTANCE_PARAMS; i++)
+        CHECK(memcmp(&log[init + 1 + i], &params[i], sizeof(PCAN_USB_PARAM)) == 0);
+    CHECK_EQ(log[init + 1 + PEAK_ACCEPTANCE_PARAMS].Function, PCAN_CTRL_BITRATE125KHZ.Function);
+    CHECK_EQ(log[init + 1 + PEAK_ACCEPTANCE_PARAMS].Number, PCAN_CTRL_BITRATE125KHZ.Number);
+}
+
+// Frames sent through the loopback adapter come back if its registers pass them; of those the host
+// keeps the wanted ones and counts the rest as false positives.
+static void TestHostDrops(void)
+{
+    static const UInt32 ids[] = { 0x100, 0x101, 0x103, PEAK_ACCEPTANCE_EXT | 0x18da00f1 };
+    PeakLoopbackStats before, after;
+    UInt32 i, n, wanted = 0, passed = 0, sent = 0;
+    PeakAcceptanceStats stats;
+    PeakAcceptance acc;
+    UInt64 stdIds, extIds;
+    CanMsg msg;
+    
+    CHECK_EQ(PeakSetAcceptance(ids, 4, PEAK_ACCEPTANCE_SINGLE), kIOReturnSuccess);
+    CHECK_EQ(PeakAcceptanceCompute(&acc, ids, 4, PEAK_ACCEPTANCE_SINGLE), kIOReturnSuccess);
+    PeakLoopbackGetStats(0, &before);
+    
+    for (i = 0; i < 64; i++)
+    {
+        if (i < 32)
+            Frame(&msg, 0x0f0 + i, 0, 0);
+        else
+            Frame(&msg, 0x18da00e0 + i - 32, 1, 0);
+        msg.len = 1;
+        msg.data[0] = (UInt8)i;
+        CHECK_EQ(PeakSend(&msg), kIOReturnSuccess);
+        sent++;
+        passed += PeakAcceptanceMatch(&acc, &msg);
+        wanted += InSet(ids, 4, msg.canid.ul, msg.ext);
+    }
+    CHECK_EQ(wanted, 4);
+    
+    n = PeakTestReceive(gReceived, 1024, wanted, 2000000000ULL);
+    CHECK_EQ(n, wanted);
+    CHECK_EQ(PeakTestReceive(gReceived + n, 1024 - n, 1, 50000000ULL), 0);
+    for (i = 0; i < n; i++)
+        CHECK(InSet(ids, 4, gReceived[i].canid.ul, gReceived[i].ext));
+    
+    PeakLoopbackGetStats(0, &after);
+    CHECK_EQ(after.echoed - before.echoed, passed);
+    CHECK_EQ(after.rejected - before.rejected, sent - passed);
+    
+    PeakGetAcceptanceStats(&stats);
+    CHECK_EQ(stats.wanted, 4);
+    CHECK(stats.single);
+    CHECK_EQ(stats.frames, passed);
+    CHECK_EQ(stats.dropped, passed - wanted);
+    CHECK(passed > wanted);
+    CHECK(stats.falsePositives == (double)(passed - wanted) / passed);
+    PeakAcceptancePassed(&acc, &stdIds, &extIds);
+    CHECK_EQ(stats.stdPassed, stdIds);
+    CHECK_EQ(stats.extPassed, extIds);
+    
+    // passing everything again
+    CHECK_EQ(PeakSetAcceptance(NULL, 0, PEAK_ACCEPTANCE_BEST), kIOReturnSuccess);
+    PeakGetAcceptanceStats(&stats);
+    CHECK_EQ(stats.wanted, 0);
+    CHECK_EQ(stats.stdPassed, 2048);
+}
+
+int main(void)
+{
+    RUN(TestOpen);
+    RUN(TestComputeStd);
+    RUN(TestComputeExt);
+    RUN(TestParams);
+    
+    if (PeakTestStartLoopback(1) != kIOReturnSuccess)
+    {
+        fprintf(stderr, "Unable to start the loopback driver.\n");
+        return 1;
+    }
+    RUN(TestCtrlWrites);
+    RUN(TestHostDrops);
+    PeakTestStopLoopback();
+    return PeakTestResult(__FILE__);
+}
@@ -0,0 +1,377 @@
+/*
+    File:           TestArchive.c
+
+    Description:    The archive format: round trips through wide and narrow chunks, seeking, recovery of
+                    an unclosed file, corrupt chunks, conversion of captures and the capture writer.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "PeakTest.h"
+#include "PeakArchive.h"
+#include "PeakCapture.h"
+
+#define FRAMES          150000      // two full chunks and a partial one
+
+static CanMsg gFrames[FRAMES];
+static CanMsg gRead[PEAK_ARCHIVE_CHUNK_FRAMES];
+
+// ids identifiers, a third of them extended, lengths changing from frame to frame of the same identifier,
+// remote, error and own frames, two channels and timestamps that go back a little now and then
+static void Frames(UInt32 count, UInt32 ids, UInt32 channels)
+{
+    UInt64 seed = 1, ts = 1436509052000000000ULL;
+    UInt32 i, id;
+    
+    for (i = 0; i < count; i++)
+    {
+        CanMsg* msg = &gFrames[i];
+        
+        id = (UInt32)(PeakTestNext(&seed) % ids);
+        bzero(msg, sizeof(CanMsg));
+        msg->ext = id % 3 == 0;
+        msg->canid.ul = msg->ext ? 0x18da0000 + id : id;
+        msg->len = (UInt8)(PeakTestNext(&seed) % 9);
+        msg->rtr = i % 97 == 0;
+        msg->err = i % 1013 == 0;
+        msg->loc = i % 31 == 0;
+        msg->channel = (UInt8)(i % channels);
+        ts += 100000 + PeakTestNext(&seed) % 2000;
+        msg->ts = i % 50 == 0 ? ts - 5000 : ts;
+        msg->mono = msg->ts;
+        if (!msg->rtr)
+        {
+            msg->ldata = (UInt64)(i / 16) * 0x0001000100010001ULL + id;
+            if (msg->len < 8)
+                msg->ldata &= (1ULL << 8 * msg->len) - 1;
+        }
+    }
+}
+
+// the fields an archive keeps, payload bytes past the length zero
+static int SameFrame(const CanMsg* a, const CanMsg* b)
+{
+    return a->canid.ul == b->canid.ul && a->ext == b->ext && a->rtr == b->rtr && a->err == b->err &&
+           a->loc == b->loc && a->len == b->len && a->channel == b->channel && a->ts == b->ts && a->ldata == b->ldata;
+}
+
+static IOReturn Write(const char* path, UInt32 count)
+{
+    PeakArchiveWriter writer;
+    UInt32 i, n;
+    IOReturn kr;
+    
+    kr = PeakArchiveWriterOpen(&writer, path, 0x0014, 1234, 5);
+    if (kr != kIOReturnSuccess)
+        return kr;
+    
+    // in pieces as the capture writer hands them over
+    for (i = 0; i < count && kr == kIOReturnSuccess; i += n)
+    {
+        n = count - i < 4093 ? count - i : 4093;
+        kr = PeakArchiveWriterAppend(&writer, &gFrames[i], n);
+    }
+    if (kr == kIOReturnSuccess)
+        return PeakArchiveWriterClose(&writer);
+    PeakArchiveWriterClose(&writer);
+    return kr;
+}
+
+// reads back every chunk, returns the frames that match gFrames
+static UInt32 Verify(PeakArchiveReader* reader)
+{
+    UInt32 c, i, count, matching = 0;
+    
+    for (c = 0; c < reader->chunkCount; c++)
+    {
+        CHECK_EQ(PeakArchiveReadChunk(reader, c, gRead, &count), kIOReturnSuccess);
+        CHECK_EQ(reader->directory[c].firstFrame, matching);
+        for (i = 0; i < count; i++)
+        {
+            if (!SameFrame(&gRead[i], &gFrames[reader->directory[c].firstFrame + i]))
+                break;
+            matching++;
+        }
+    }
+    return matching;
+}
+
+static void TestRoundTrip(void)
+{
+    PeakArchiveReader reader;
+    char path[256];
+    UInt32 count;
+    
+    // more than 256 identifiers, the wide key index
+    PeakTestTempPath(path, sizeof(path), "round.peakarc");
+    Frames(FRAMES, 600, 2);
+    CHECK_EQ(Write(path, FRAMES), kIOReturnSuccess);
+    
+    CHECK_EQ(PeakArchiveOpen(&reader, path), kIOReturnSuccess);
+    CHECK_EQ(reader.header.bitrate, 0x0014);
+    CHECK_EQ(reader.header.serial, 1234);
+    CHECK_EQ(reader.header.deviceNo, 5);
+    CHECK_EQ(reader.chunkCount, 3);
+    CHECK_EQ(reader.frameCount, FRAMES);
+    CHECK(!reader.recovered);
+    CHECK_EQ(Verify(&reader), FRAMES);
+    CHECK_EQ(PeakArchiveReadChunk(&reader, 3, gRead, &count), kIOReturnBadArgument);
+    PeakArchiveClose(&reader);
+    unlink(path);
+}
+
+static void TestNarrow(void)
+{
+    PeakArchiveReader reader;
+    PeakArchiveChunk chunk;
+    char path[256];
+    
+    // a byte per key index, no channel column
+    PeakTestTempPath(path, sizeof(path), "narrow.peakarc");
+    Frames(5000, 40, 1);
+    CHECK_EQ(Write(path, 5000), kIOReturnSuccess);
+    
+    CHECK_EQ(PeakArchiveOpen(&reader, path), kIOReturnSuccess);
+    CHECK_EQ(reader.chunkCount, 1);
+    CHECK_EQ(pread(reader.fd, &chunk, sizeof(chunk), (off_t)reader.directory[0].offset), sizeof(chunk));
+    CHECK_EQ(chunk.flags & PEAK_ARCHIVE_CHANNELS, 0);
+    CHECK_EQ(chunk.frames, 5000);
+    CHECK(chunk.size < 5000 * sizeof(PeakCaptureRecord) / 2);
+    CHECK_EQ(Verify(&reader), 5000);
+    PeakArchiveClose(&reader);
+    unlink(path);
+}
+
+static void TestEmpty(void)
+{
+    PeakArchiveReader reader;
+    char path[256];
+    
+    PeakTestTempPath(path, sizeof(path), "empty.peakarc");
+    CHECK_EQ(Write(path, 0), kIOReturnSuccess);
+    CHECK_EQ(PeakArchiveOpen(&reader, path), kIOReturnSuccess);
+    CHECK_EQ(reader.chunkCount, 0);
+    CHECK_EQ(reader.frameCount, 0);
+    CHECK_EQ(PeakArchiveSeekTime(&reader, 0), 0);
+    PeakArchiveClose(&reader);
+    unlink(path);
+}
+
+static void TestSeek(void)
+{
+    PeakArchiveReader reader;
+    char path[256];
+    UInt32 c, count;
+    UInt64 ts;
+    
+    PeakTestTempPath(path, sizeof(path), "seek.peakarc");
+    Frames(FRAMES, 600, 2);
+    CHECK_EQ(Write(path, FRAMES), kIOReturnSuccess);
+    CHECK_EQ(PeakArchiveOpen(&reader, path), kIOReturnSuccess);
+    
+    CHECK_EQ(PeakArchiveSeekTime(&reader, 0), 0);
+    CHECK_EQ(PeakArchiveSeekTime(&reader, gFrames[FRAMES - 1].ts + 1), reader.chunkCount);
+    
+    // the chunk found holds the frame, none before it reaches that time
+    for (c = 0; c < reader.chunkCount; c++)
+    {
+        ts = gFrames[reader.directory[c].firstFrame + 1000].ts;
+        CHECK_EQ(PeakArchiveSeekTime(&reader, ts), c);
+        CHECK_EQ(PeakArchiveReadChunk(&reader, c, gRead, &count), kIOReturnSuccess);
+        CHECK_EQ(gRead[1000].ts, ts);
+    }
+    PeakArchiveClose(&reader);
+    unlink(path);
+}
+
+static void TestRecover(void)
+{
+    PeakArchiveReader reader;
+    PeakArchiveTrailer trailer;
+    char path[256];
+    struct stat st;
+    int fd;
+    
+    PeakTestTempPath(path, sizeof(path), "recover.peakarc");
+    Frames(FRAMES, 600, 2);
+    CHECK_EQ(Write(path, FRAMES), kIOReturnSuccess);
+    
+    // as if it ended in the middle of writing the last chunk
+    fd = open(path, O_RDWR);
+    CHECK(fd >= 0);
+    if (fd < 0)
+        return;
+    CHECK_EQ(fstat(fd, &st), 0);
+    CHECK_EQ(pread(fd, &trailer, sizeof(trailer), st.st_size - sizeof(trailer)), sizeof(trailer));
+    CHECK_EQ(trailer.magic, PEAK_ARCHIVE_DIR_MAGIC);
+    CHECK_EQ(ftruncate(fd, (off_t)trailer.directory - 100), 0);
+    close(fd);
+    
+    CHECK_EQ(PeakArchiveOpen(&reader, path), kIOReturnSuccess);
+    CHECK(reader.recovered);
+    CHECK_EQ(reader.chunkCount, 2);
+    CHECK_EQ(reader.frameCount, 2 * PEAK_ARCHIVE_CHUNK_FRAMES);
+    CHECK_EQ(Verify(&reader), 2 * PEAK_ARCHIVE_CHUNK_FRAMES);
+    PeakArchiveClose(&reader);
+    unlink(path);
+}
+
+static void TestCorrupt(void)
+{
+    PeakArchiveReader reader;
+    PeakArchiveHeader header;
+    char path[256];
+    UInt32 count;
+    UInt8 byte;
+    int fd;
+    
+    PeakTestTempPath(path, sizeof(path), "corrupt.peakarc");
+    CHECK_EQ(PeakArchiveOpen(&reader, path), kIOReturnNotOpen);
+    
+    Frames(FRAMES, 600, 2);
+    CHECK_EQ(Write(path, FRAMES), kIOReturnSuccess);
+    CHECK_EQ(PeakArchiveOpen(&reader, path), kIOReturnSuccess);
+    
+    // a flipped bit in the second chunk's deflated bytes fails its CRC, the others still read
+    fd = open(path, O_RDWR);
+    CHECK(fd >= 0);
+    if (fd < 0)
+        return;
+    CHECK_EQ(pread(fd, &byte, 1, (off_t)reader.directory[1].offset + sizeof(PeakArchiveChunk) + 100), 1);
+    byte ^= 0x10;
+    CHECK_EQ(pwrite(fd, &byte, 1, (off_t)reader.directory[1].offset + sizeof(PeakArchiveChunk) + 100), 1);
+    
+    CHECK_EQ(PeakArchiveReadChunk(&reader, 1, gRead, &count), kIOReturnIOError);
+    CHECK_EQ(count, 0);
+    CHECK_EQ(PeakArchiveReadChunk(&reader, 2, gRead, &count), kIOReturnSuccess);
+    CHECK(SameFrame(&gRead[0], &gFrames[2 * PEAK_ARCHIVE_CHUNK_FRAMES]));
+    PeakArchiveClose(&reader);
+    
+    // not an archive at all
+    CHECK_EQ(pread(fd, &header, sizeof(header), 0), sizeof(header));
+    header.magic = PEAK_CAPTURE_MAGIC;
+    CHECK_EQ(pwrite(fd, &header, sizeof(header), 0), sizeof(header));
+    close(fd);
+    CHECK_EQ(PeakArchiveOpen(&reader, path), kIOReturnBadArgument);
+    unlink(path);
+}
+
+static void TestFromCapture(void)
+{
+    static PeakCaptureRecord records[1000];
+    PeakArchiveReader reader;
+    PeakCaptureHeader header;
+    char capture[256], archive[256];
+    UInt32 i;
+    int fd;
+    
+    PeakTestTempPath(capture, sizeof(capture), "convert.pcap");
+    PeakTestTempPath(archive, sizeof(archive), "convert.peakarc");
+    Frames(1000, 100, 2);
+    
+    bzero(&header, sizeof(header));
+    header.magic = PEAK_CAPTURE_MAGIC;
+    header.version = PEAK_CAPTURE_VERSION;
+    header.headerSize = sizeof(PeakCaptureHeader);
+    header.recordSize = sizeof(PeakCaptureRecord);
+    header.bitrate = 0x001c;
+    header.serial = 42;
+    header.startNs = 1436509052000000000LL;
+    for (i = 0; i < 1000; i++)
+        PeakCaptureRecordFromMsg(&records[i], &gFrames[i]);
+    
+    // with half a record at the end, as an interrupted capture leaves it
+    fd = open(capture, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0);
+    if (fd < 0)
+        return;
+    CHECK_EQ(write(fd, &header, sizeof(header)), sizeof(header));
+    CHECK_EQ(write(fd, records, sizeof(records)), sizeof(records));
+    CHECK_EQ(write(fd, records, sizeof(PeakCaptureRecord) / 2), sizeof(PeakCaptureRecord) / 2);
+    close(fd);
+    
+    CHECK_EQ(PeakArchiveFromCapture(capture, archive), kIOReturnSuccess);
+    CHECK_EQ(PeakArchiveOpen(&reader, archive), kIOReturnSuccess);
+    CHECK_EQ(reader.header.startNs, header.startNs);
+    CHECK_EQ(reader.header.bitrate, 0x001c);
+    CHECK_EQ(reader.header.serial, 42);
+    CHECK_EQ(reader.frameCount, 1000);
+    CHECK_EQ(Verify(&reader), 1000);
+    PeakArchiveClose(&reader);
+    
+    CHECK_EQ(PeakArchiveFromCapture(archive, capture), kIOReturnBadArgument);
+    unlink(capture);
+    unlink(archive);
+}
+
+// the capture writer thread feeding the archive
+static void TestCapture(void)
+{
+    static PeakCapture capture;
+    PeakArchiveReader reader;
+    PeakCaptureStats stats;
+    char path[256];
+    UInt32 i, count;
+    
+    PeakTestTempPath(path, sizeof(path), "capture.peakarc");
+    Frames(20000, 200, 1);
+    CHECK_EQ(PeakCaptureCreate(&capture), kIOReturnSuccess);
+    CHECK_EQ(PeakCaptureAddChannel(&capture, 0), kIOReturnSuccess);
+    CHECK_EQ(PeakCaptureOpen(&capture, path, 0x0014, 7, 0), kIOReturnSuccess);
+    for (i = 0; i < 20000; i++)
+    {
+        // in time order, the merge of a single channel keeps it
+        gFrames[i].ts = gFrames[i].mono = 1000000 + i * 1000ULL;
+        PeakCaptureAppend(&capture, &gFrames[i]);
+        if (i % 4096 == 4095)
+            usleep(20000);
+    }
+    PeakCaptureClose(&capture);
+    PeakCaptureGetStats(&capture, &stats);
+    CHECK_EQ(stats.frames, 20000);
+    CHECK_EQ(stats.dropped, 0);
+    
+    CHECK_EQ(PeakArchiveOpen(&reader, path), kIOReturnSuccess);
+    CHECK_EQ(reader.header.serial, 7);
+    CHECK_EQ(reader.frameCount, 20000);
+    count = 0;
+    if (reader.chunkCount > 0)
+        CHECK_EQ(PeakArchiveReadChunk(&reader, 0, gRead, &count), kIOReturnSuccess);
+    CHECK(count > 0 && SameFrame(&gRead[count - 1], &gFrames[count - 1]));
+    CHECK_EQ(Verify(&reader), 20000);
+    PeakArchiveClose(&reader);
+    unlink(path);
+}
+
+int main(void)
+{
+    RUN(TestRoundTrip);
+    RUN(TestNarrow);
+    RUN(TestEmpty);
+    RUN(TestSeek);
+    RUN(TestRecover);
+    RUN(TestCorrupt);
+    RUN(TestFromCapture);
+    RUN(TestCapture);
+    return PeakTestResult(__FILE__);
+}
@@ -0,0 +1,172 @@
+/*
+    File:           TestBatch.c
+
+    Description:    Unit tests of the batcher coalescing bulk read completions into flushes for the
+                    consumer.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "PeakTest.h"
+#include "PeakBatch.h"
+
+typedef struct {
+    PeakRing    ring;
+    PeakMerge   merge;
+    PeakBatcher batcher;
+    UInt32      flushes;
+} Pipe;
+
+static void Flush(void* refCon)
+{
+    ((Pipe*)refCon)->flushes++;
+}
+
+static void PipeCreate(Pipe* pipe, UInt64 tickNs)
+{
+    bzero(pipe, sizeof(Pipe));
+    PeakRingCreate(&pipe->ring, 64);
+    PeakMergeInit(&pipe->merge, PEAK_MERGE_DEFAULT_WINDOW_NS);
+    PeakMergeAttach(&pipe->merge, 0, &pipe->ring);
+    PeakBatcherInit(&pipe->batcher, &pipe->merge, Flush, pipe);
+    PeakBatcherSetTick(&pipe->batcher, tickNs);
+}
+
+// a bulk read bringing count frames, the adapter time is monoNs
+static void Read(Pipe* pipe, UInt32 count, UInt64 monoNs)
+{
+    CanMsg* msg;
+    
+    while (count--)
+    {
+        if ((msg = PeakRingReserve(&pipe->ring)) == NULL)
+            return;
+        bzero(msg, sizeof(CanMsg));
+        msg->canid.ul = PeakRingFill(&pipe->ring);
+        msg->mono = monoNs++;
+        msg->delay = 100;
+        PeakRingCommit(&pipe->ring);
+    }
+    PeakBatcherCompletion(&pipe->batcher, monoNs + 100);
+}
+
+static void TestEmpty(void)
+{
+    Pipe pipe;
+    CanMsg batch[4];
+    
+    PipeCreate(&pipe, 1000);
+    
+    // a completion without frames asks for nothing
+    PeakBatcherCompletion(&pipe.batcher, 5000);
+    CHECK_EQ(pipe.flushes, 0);
+    CHECK_EQ(pipe.batcher.requests, 0);
+    CHECK_EQ(PeakBatcherDrain(&pipe.batcher, batch, 4, 5000), 0);
+    CHECK_EQ(pipe.batcher.batches, 0);
+    CHECK_EQ(pipe.batcher.lastFlushNs, 0);
+    PeakRingDestroy(&pipe.ring);
+}
+
+static void TestCoalesce(void)
+{
+    Pipe pipe;
+    CanMsg batch[64];
+    UInt32 i, n;
+    
+    PipeCreate(&pipe, 1000);
+    
+    // the first completion flushes, the ones before the drain fold into it
+    Read(&pipe, 5, 10000);
+    CHECK_EQ(pipe.flushes, 1);
+    Read(&pipe, 5, 10100);
+    Read(&pipe, 5, 10200);
+    CHECK_EQ(pipe.flushes, 1);
+    CHECK_EQ(pipe.batcher.coalesced, 2);
+    
+    // one drain takes all of them in order
+    n = PeakBatcherDrain(&pipe.batcher, batch, 64, 10500);
+    CHECK_EQ(n, 15);
+    for (i = 1; i < n; i++)
+        CHECK(batch[i].mono > batch[i - 1].mono);
+    CHECK_EQ(pipe.batcher.batches, 1);
+    CHECK_EQ(pipe.batcher.frames, 15);
+    CHECK_EQ(pipe.batcher.lastFlushNs, 10500);
+    CHECK_EQ(pipe.batcher.dequeue.count, 15);
+    
+    // within the tick of the drain the consumer's timer is left to come by
+    Read(&pipe, 5, 11000);
+    CHECK_EQ(pipe.flushes, 1);
+    CHECK_EQ(pipe.batcher.coalesced, 3);
+    
+    // after it the next completion flushes again
+    Read(&pipe, 5, 11500);
+    CHECK_EQ(pipe.flushes, 2);
+    CHECK_EQ(pipe.batcher.requests, 2);
+    PeakRingDestroy(&pipe.ring);
+}
+
+static void TestEveryCompletion(void)
+{
+    Pipe pipe;
+    CanMsg batch[64];
+    UInt32 i;
+    
+    // with a tick of 0 every completion after a drain flushes
+    PipeCreate(&pipe, 0);
+    for (i = 0; i < 10; i++)
+    {
+        Read(&pipe, 3, 1000 * (i + 1));
+        CHECK_EQ(pipe.flushes, i + 1);
+        CHECK_EQ(PeakBatcherDrain(&pipe.batcher, batch, 64, 1000 * (i + 1) + 500), 3);
+    }
+    CHECK_EQ(pipe.batcher.coalesced, 0);
+    CHECK_EQ(pipe.batcher.batches, 10);
+    PeakRingDestroy(&pipe.ring);
+}
+
+static void TestPartialDrain(void)
+{
+    Pipe pipe;
+    CanMsg batch[64];
+    
+    PipeCreate(&pipe, 0);
+    Read(&pipe, 20, 1000);
+    
+    // a drain limited by max leaves the rest for the next one
+    CHECK_EQ(PeakBatcherDrain(&pipe.batcher, batch, 8, 2000), 8);
+    CHECK_EQ(batch[0].mono, 1000);
+    CHECK_EQ(PeakRingFill(&pipe.ring), 12);
+    
+    // the drain cleared the request, so the next completion asks again
+    Read(&pipe, 1, 3000);
+    CHECK_EQ(pipe.flushes, 2);
+    CHECK_EQ(PeakBatcherDrain(&pipe.batcher, batch, 64, 4000), 13);
+    CHECK_EQ(batch[0].mono, 1008);
+    CHECK_EQ(pipe.batcher.frames, 21);
+    PeakRingDestroy(&pipe.ring);
+}
+
+int main(void)
+{
+    RUN(TestEmpty);
+    RUN(TestCoalesce);
+    RUN(TestEveryCompletion);
+    RUN(TestPartialDrain);
+    return PeakTestResult(__FILE__);
+}
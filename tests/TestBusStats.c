@@ -0,0 +1,275 @@
+/*
+    File:           TestBusStats.c
+
+    Description:    Unit tests of the per identifier bus statistics: frame lengths on the wire, periods
+                    and jitter, the identifier tables, the bus load, and the counts the driver keeps per
+                    adapter.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "PeakTest.h"
+#include "PeakBusStats.h"
+#include "PeakTransport.h"
+
+static PeakBusStats* gStats = NULL;
+static PeakIdStats gIds[PEAK_BUS_STD_IDS + PEAK_BUS_EXT_MAX];
+
+static void Frame(CanMsg* msg, UInt32 canid, int ext, UInt8 len, UInt64 mono)
+{
+    bzero(msg, sizeof(CanMsg));
+    msg->canid.ul = canid;
+    msg->ext = ext;
+    msg->len = len;
+    msg->mono = mono;
+}
+
+static void Update(UInt32 canid, int ext, UInt8 len, UInt64 mono)
+{
+    CanMsg msg;
+    
+    Frame(&msg, canid, ext, len, mono);
+    PeakBusStatsUpdate(gStats, &msg);
+}
+
+static void TestCreate(void)
+{
+    PeakBusLoad load;
+    
+    // a new table has no bitrate and so no load yet
+    Update(0x100, 0, 8, 1000000000ULL);
+    Update(0x100, 0, 8, 1001000000ULL);
+    PeakBusStatsGetLoad(gStats, 1001000000ULL, &load);
+    CHECK_EQ(load.bitsPerSecond, 0);
+    CHECK_EQ(load.frames, 2);
+    CHECK_EQ(load.ids, 1);
+    CHECK(load.load == 0);
+}
+
+static void TestFrameBits(void)
+{
+    CanMsg msg;
+    
+    // the worst case bit stuffing over SOF to CRC, then the fixed tail
+    Frame(&msg, 0x123, 0, 8, 0);
+    CHECK_EQ(PeakBusStatsFrameBits(&msg), 135);
+    Frame(&msg, 0x123, 1, 8, 0);
+    CHECK_EQ(PeakBusStatsFrameBits(&msg), 160);
+    Frame(&msg, 0x123, 0, 0, 0);
+    CHECK_EQ(PeakBusStatsFrameBits(&msg), 55);
+    
+    // a remote frame carries the length but no data
+    Frame(&msg, 0x123, 0, 8, 0);
+    msg.rtr = 1;
+    CHECK_EQ(PeakBusStatsFrameBits(&msg), 55);
+    
+    CHECK_EQ(PeakBusStatsBitsPerSecond(CAN_BAUD_1M), 1000000);
+    CHECK_EQ(PeakBusStatsBitsPerSecond(CAN_BAUD_125K), 125000);
+    CHECK_EQ(PeakBusStatsBitsPerSecond(CAN_BAUD_5K), 5000);
+    CHECK_EQ(PeakBusStatsBitsPerSecond(0x1234), 0);
+}
+
+static void TestPeriod(void)
+{
+    UInt64 t;
+    UInt32 i;
+    
+    // every 10 ms exactly
+    PeakBusStatsReset(gStats);
+    for (i = 0, t = 1000000000ULL; i < 101; i++, t += 10000000)
+        Update(0x100, 0, 8, t);
+    t -= 10000000;
+    
+    CHECK_EQ(PeakBusStatsGetIds(gStats, t, gIds, 16), 1);
+    CHECK_EQ(gIds[0].canid, 0x100);
+    CHECK_EQ(gIds[0].ext, 0);
+    CHECK_EQ(gIds[0].len, 8);
+    CHECK_EQ(gIds[0].frames, 101);
+    CHECK_EQ(gIds[0].minPeriodNs, 10000000);
+    CHECK_EQ(gIds[0].maxPeriodNs, 10000000);
+    CHECK(fabs(gIds[0].meanPeriodNs - 10000000) < 1);
+    CHECK(gIds[0].jitterNs < 1);
+    CHECK(fabs(gIds[0].rate - 100) < 0.01);
+    
+    // gone quiet for a second, the rate falls with it
+    PeakBusStatsGetIds(gStats, t + 1000000000ULL, gIds, 16);
+    CHECK(fabs(gIds[0].rate - 1) < 0.001);
+}
+
+static void TestJitter(void)
+{
+    UInt64 t = 1000000000ULL;
+    UInt32 i;
+    
+    // 9 and 11 ms in turn, 100 periods: the sample deviation is 1 ms * sqrt(100 / 99)
+    PeakBusStatsReset(gStats);
+    Update(0x200, 0, 4, t);
+    for (i = 0; i < 100; i++)
+    {
+        t += i & 1 ? 11000000 : 9000000;
+        Update(0x200, 0, 4, t);
+    }
+    
+    CHECK_EQ(PeakBusStatsGetIds(gStats, t, gIds, 16), 1);
+    CHECK_EQ(gIds[0].minPeriodNs, 9000000);
+    CHECK_EQ(gIds[0].maxPeriodNs, 11000000);
+    CHECK(fabs(gIds[0].meanPeriodNs - 10000000) < 1);
+    CHECK(fabs(gIds[0].jitterNs - 1000000 * sqrt(100.0 / 99)) < 1);
+    
+    // the recent period follows both, a change of the schedule shows after some frames
+    for (i = 0; i < 200; i++)
+    {
+        t += 20000000;
+        Update(0x200, 0, 4, t);
+    }
+    PeakBusStatsGetIds(gStats, t, gIds, 16);
+    CHECK(fabs(gIds[0].rate - 50) < 0.1);
+}
+
+static void TestIdentifiers(void)
+{
+    PeakBusLoad load;
+    UInt32 i, n;
+    
+    // the same number as standard and as extended identifier are two entries, in order of appearance
+    PeakBusStatsReset(gStats);
+    Update(0x7ff, 0, 1, 1000);
+    Update(0x7ff, 1, 2, 2000);
+    Update(0x7ff, 0, 3, 3000);
+    CHECK_EQ(PeakBusStatsGetIds(gStats, 3000, gIds, 16), 2);
+    CHECK_EQ(gIds[0].ext, 0);
+    CHECK_EQ(gIds[0].frames, 2);
+    CHECK_EQ(gIds[0].len, 3);
+    CHECK_EQ(gIds[1].ext, 1);
+    CHECK_EQ(gIds[1].canid, 0x7ff);
+    CHECK_EQ(gIds[1].frames, 1);
+    
+    // the extended table takes three quarters of its slots, the rest only counts in the load
+    PeakBusStatsReset(gStats);
+    for (i = 0; i < PEAK_BUS_EXT_MAX + 100; i++)
+        Update(0x18000000 + i * 4096, 1, 8, 1000 + i);
+    for (i = 0; i < PEAK_BUS_EXT_MAX + 100; i++)
+        Update(0x18000000 + i * 4096, 1, 8, 1000000 + i);
+    n = PeakBusStatsGetIds(gStats, 2000000, gIds, PEAK_BUS_STD_IDS + PEAK_BUS_EXT_MAX);
+    CHECK_EQ(n, PEAK_BUS_EXT_MAX);
+    for (i = 0; i < n; i++)
+    {
+        if (gIds[i].canid != 0x18000000 + i * 4096 || gIds[i].frames != 2)
+        {
+            CHECK(0);
+            break;
+        }
+    }
+    PeakBusStatsGetLoad(gStats, 2000000, &load);
+    CHECK_EQ(load.ids, PEAK_BUS_EXT_MAX);
+    CHECK_EQ(load.untracked, 200);
+    CHECK_EQ(load.frames, 2 * (PEAK_BUS_EXT_MAX + 100));
+    CHECK_EQ(load.bits, 160ULL * load.frames);
+    
+    // a reset keeps the bitrate
+    PeakBusStatsSetBitrate(gStats, CAN_BAUD_500K);
+    PeakBusStatsReset(gStats);
+    PeakBusStatsGetLoad(gStats, 0, &load);
+    CHECK_EQ(load.bitsPerSecond, 500000);
+    CHECK_EQ(load.ids, 0);
+}
+
+static void TestLoad(void)
+{
+    PeakBusLoad load;
+    UInt64 t = 1000000000ULL;
+    UInt32 i;
+    
+    // back to back standard frames of eight bytes at 1 Mbit/s, 135 us each, for three seconds
+    PeakBusStatsReset(gStats);
+    PeakBusStatsSetBitrate(gStats, CAN_BAUD_1M);
+    for (i = 0; i < 3000000000ULL / 135000; i++, t += 135000)
+        Update(0x100 + i % 16, 0, 8, t);
+    PeakBusStatsGetLoad(gStats, t, &load);
+    CHECK_EQ(load.bitsPerSecond, 1000000);
+    CHECK(load.load > 99 && load.load < 101);
+    
+    // half of that, and nothing for a second after
+    PeakBusStatsReset(gStats);
+    for (i = 0; i < 3000000000ULL / 270000; i++, t += 270000)
+        Update(0x100, 0, 8, t);
+    PeakBusStatsGetLoad(gStats, t, &load);
+    CHECK(load.load > 49 && load.load < 51);
+    PeakBusStatsGetLoad(gStats, t + 1000000000ULL, &load);
+    CHECK(load.load < 40);
+    
+    // no bitrate, no load
+    PeakBusStatsSetBitrate(gStats, 0x1234);
+    PeakBusStatsGetLoad(gStats, t, &load);
+    CHECK(load.load == 0);
+}
+
+// the driver counts every frame of an adapter, by identifier
+static void TestDriver(void)
+{
+    static CanMsg received[64];
+    PeakTestTelegram telegram;
+    PeakBusLoad load;
+    CanMsg msg;
+    UInt32 i;
+    
+    if (PeakTestStartLoopback(1) != kIOReturnSuccess)
+    {
+        CHECK(0);
+        return;
+    }
+    
+    PeakTestTelegramBegin(&telegram, 0);
+    for (i = 0; i < 4; i++)
+    {
+        Frame(&msg, 0x300 + (i & 1), i >= 2, 8, 0);
+        PeakTestTelegramFrame(&telegram, &msg, 0);
+    }
+    CHECK_EQ(PeakLoopbackInject(0, telegram.data, telegram.length), kIOReturnSuccess);
+    CHECK_EQ(PeakTestReceive(received, 64, 4, 2000000000ULL), 4);
+    
+    CHECK_EQ(PeakGetBusLoad(0, &load), kIOReturnSuccess);
+    CHECK_EQ(load.frames, 4);
+    CHECK_EQ(load.ids, 4);
+    CHECK_EQ(load.bits, 2 * 135 + 2 * 160);
+    CHECK_EQ(PeakGetIdStats(0, gIds, 16), 4);
+    CHECK_EQ(gIds[0].canid, 0x300);
+    CHECK_EQ(gIds[3].canid, 0x301);
+    CHECK_EQ(gIds[3].ext, 1);
+    CHECK_EQ(PeakGetIdStats(1, gIds, 16), 0);
+    PeakTestStopLoopback();
+}
+
+int main(void)
+{
+    if (PeakBusStatsCreate(&gStats) != kIOReturnSuccess)
+        return 1;
+    
+    RUN(TestCreate);
+    RUN(TestFrameBits);
+    RUN(TestPeriod);
+    RUN(TestJitter);
+    RUN(TestIdentifiers);
+    RUN(TestLoad);
+    RUN(TestDriver);
+    
+    PeakBusStatsFree(gStats);
+    return PeakTestResult(__FILE__);
+}
@@ -0,0 +1,388 @@
+/*
+    File:           TestCanopen.c
+
+    Description:    Unit tests of the CANopen decoder: the services of the predefined connection set,
+                    expedited, segmented and block SDO transfers, node guarding, PDO mappings and their
+                    files, and the longest description.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "PeakTest.h"
+#include "PeakCanopen.h"
+
+static PeakCanopenDecoder* gDecoder = NULL;
+static char gDescr[PEAK_CANOPEN_DESCR_MAX];
+
+static void Frame(CanMsg* msg, UInt32 canid, UInt8 len, const UInt8* data)
+{
+    bzero(msg, sizeof(CanMsg));
+    msg->canid.ul = canid;
+    msg->len = len;
+    if (data)
+        memcpy(msg->data, data, len);
+}
+
+// tracks and describes a frame, returns its tag
+static UInt32 Decode(UInt32 canid, UInt8 len, const UInt8* data)
+{
+    CanMsg msg;
+    UInt32 tag;
+    
+    Frame(&msg, canid, len, data);
+    tag = PeakCanopenTrack(gDecoder, &msg);
+    PeakCanopenDescribe(gDecoder, &msg, tag, gDescr, sizeof(gDescr));
+    return tag;
+}
+
+static int Is(const char* expected)
+{
+    if (strcmp(gDescr, expected) == 0)
+        return 1;
+    fprintf(stderr, "\"%s\" != \"%s\"\n", gDescr, expected);
+    return 0;
+}
+
+static void TestServices(void)
+{
+    static const UInt8 start[] = { 0x01, 0x05 }, resetAll[] = { 0x81, 0x00 }, sync[] = { 0x07 };
+    static const UInt8 emcy[] = { 0x10, 0x81, 0x11, 0, 0, 0, 0, 0 }, boot[] = { 0x00 }, operational[] = { 0x05 };
+    static const UInt8 lss[] = { 0x11, 0x22 };
+    UInt32 low, high;
+    CanMsg msg;
+    
+    PeakCanopenReset(gDecoder);
+    Decode(0x000, 2, start);
+    CHECK(Is("NMT start node 5"));
+    Decode(0x000, 2, resetAll);
+    CHECK(Is("NMT reset node all nodes"));
+    Decode(0x080, 1, sync);
+    CHECK(Is("SYNC counter 7"));
+    Decode(0x085, 8, emcy);
+    CHECK(Is("EMCY node 5: 0x8110 CAN overrun, register 0x11"));
+    Decode(0x705, 1, boot);
+    CHECK(Is("Heartbeat node 5: boot-up"));
+    Decode(0x77F, 1, operational);
+    CHECK(Is("Heartbeat node 127: operational"));
+    Decode(0x7E5, 2, lss);
+    CHECK(Is("LSS master configure node-ID 34"));
+    Decode(0x000, 1, start);
+    CHECK(Is("NMT invalid length"));
+    
+    // identifiers outside the predefined connection set and extended frames are no CANopen ones
+    CHECK_EQ(Decode(0x7F0, 0, NULL), 0);
+    CHECK(Is(""));
+    Frame(&msg, 0x705, 1, boot);
+    msg.ext = 1;
+    CHECK_EQ(PeakCanopenDescribe(gDecoder, &msg, 0, gDescr, sizeof(gDescr)), 0);
+    
+    // the filter panel's ranges
+    PeakCanopenTypeRange(PEAK_CANOPEN_TYPE_PDO, &low, &high);
+    CHECK_EQ(low, 0x181);
+    CHECK_EQ(high, 0x57F);
+    PeakCanopenTypeRange(PEAK_CANOPEN_TYPE_LSS, &low, &high);
+    CHECK_EQ(low, 0x7E4);
+    CHECK_EQ(high, 0x7E5);
+    PeakCanopenTypeRange(99, &low, &high);
+    CHECK_EQ(low, 0x000);
+    CHECK_EQ(high, 0x080);
+}
+
+static void TestExpedited(void)
+{
+    static const UInt8 download[] = { 0x23, 0x00, 0x10, 0x01, 0x78, 0x56, 0x34, 0x12 };
+    static const UInt8 confirmed[] = { 0x60, 0x00, 0x10, 0x01, 0, 0, 0, 0 };
+    static const UInt8 upload[] = { 0x4B, 0x17, 0x10, 0x00, 0xE8, 0x03, 0, 0 };
+    static const UInt8 abort[] = { 0x80, 0x00, 0x20, 0x03, 0x11, 0x00, 0x09, 0x06 };
+    
+    PeakCanopenReset(gDecoder);
+    CHECK_EQ(Decode(0x605, 8, download), 0);
+    CHECK(Is("SDO node 5 download 0x1000:01 = 305419896 (0x12345678)"));
+    Decode(0x585, 8, confirmed);
+    CHECK(Is("SDO node 5 download 0x1000:01 confirmed"));
+    
+    // two bytes of the four
+    Decode(0x585, 8, upload);
+    CHECK(Is("SDO node 5 upload 0x1017:00 = 1000 (0x03E8)"));
+    
+    Decode(0x585, 8, abort);
+    CHECK(Is("SDO node 5 abort 0x2000:03 0x06090011 subindex does not exist"));
+    Decode(0x585, 4, abort);
+    CHECK(Is("SDO node 5 invalid length"));
+}
+
+static void TestSegmented(void)
+{
+    static const UInt8 request[] = { 0x40, 0x08, 0x10, 0x00, 0, 0, 0, 0 };
+    static const UInt8 response[] = { 0x41, 0x08, 0x10, 0x00, 20, 0, 0, 0 };
+    static const UInt8 next0[] = { 0x60, 0, 0, 0, 0, 0, 0, 0 }, next1[] = { 0x70, 0, 0, 0, 0, 0, 0, 0 };
+    static const UInt8 segment0[] = { 0x00, 'P', 'C', 'A', 'N', '-', 'U', 'S' };
+    static const UInt8 segment1[] = { 0x10, 'B', ' ', 'a', 'd', 'a', 'p', 't' };
+    static const UInt8 last0[] = { 0x03, 'e', 'r', ' ', 'v', '2', '0', 0 };
+    static const UInt8 reset[] = { 0x81, 0x05 };
+    UInt32 tag;
+    
+    PeakCanopenReset(gDecoder);
+    Decode(0x605, 8, request);
+    CHECK(Is("SDO node 5 upload 0x1008:00 request"));
+    Decode(0x585, 8, response);
+    CHECK(Is("SDO node 5 upload 0x1008:00 segmented, 20 bytes"));
+    
+    // the segments are tagged with the object of their transfer
+    tag = Decode(0x605, 8, next0);
+    CHECK_EQ(tag, 0x10080000 | PEAK_CANOPEN_TAG_SDO);
+    CHECK(Is("SDO node 5 upload 0x1008:00 request, toggle 0"));
+    Decode(0x585, 8, segment0);
+    CHECK(Is("SDO node 5 upload 0x1008:00 segment, toggle 0, 7 bytes"));
+    Decode(0x605, 8, next1);
+    Decode(0x585, 8, segment1);
+    CHECK(Is("SDO node 5 upload 0x1008:00 segment, toggle 1, 7 bytes"));
+    Decode(0x605, 8, next0);
+    tag = Decode(0x585, 8, last0);
+    CHECK_EQ(tag & PEAK_CANOPEN_TAG_ERROR, 0);
+    CHECK(Is("SDO node 5 upload 0x1008:00 segment, toggle 0, 6 bytes, last"));
+    
+    // a toggle bit out of turn
+    Decode(0x605, 8, request);
+    Decode(0x585, 8, response);
+    Decode(0x605, 8, next0);
+    tag = Decode(0x585, 8, segment1);
+    CHECK(tag & PEAK_CANOPEN_TAG_ERROR);
+    CHECK(Is("SDO node 5 upload 0x1008:00 segment, toggle 1, 7 bytes, toggle error"));
+    
+    // a reset of the node ends its transfer, what follows is out of place
+    Decode(0x605, 8, request);
+    Decode(0x585, 8, response);
+    Decode(0x000, 2, reset);
+    tag = Decode(0x585, 8, segment0);
+    CHECK(tag & PEAK_CANOPEN_TAG_ERROR);
+}
+
+static void TestBlock(void)
+{
+    static const UInt8 initiate[] = { 0xC6, 0x50, 0x1F, 0x01, 10, 0, 0, 0 };
+    static const UInt8 confirmed[] = { 0xA4, 0x50, 0x1F, 0x01, 2, 0, 0, 0 };
+    static const UInt8 seg1[] = { 0x01, 1, 2, 3, 4, 5, 6, 7 }, seg2[] = { 0x02, 1, 2, 3, 4, 5, 6, 7 };
+    static const UInt8 last[] = { 0x81, 1, 2, 3, 4, 5, 6, 7 }, wrong[] = { 0x03, 1, 2, 3, 4, 5, 6, 7 };
+    static const UInt8 ack2[] = { 0xA2, 2, 2, 0, 0, 0, 0, 0 }, ack1[] = { 0xA2, 1, 2, 0, 0, 0, 0, 0 };
+    static const UInt8 end[] = { 0xD1, 0x34, 0x12, 0, 0, 0, 0, 0 }, endConfirmed[] = { 0xA1, 0, 0, 0, 0, 0, 0, 0 };
+    UInt32 tag;
+    
+    PeakCanopenReset(gDecoder);
+    Decode(0x605, 8, initiate);
+    CHECK(Is("SDO node 5 block download 0x1F50:01, 10 bytes"));
+    Decode(0x585, 8, confirmed);
+    CHECK(Is("SDO node 5 block download 0x1F50:01 confirmed, blksize 2"));
+    
+    // a sub-block of two segments, then one with the last
+    tag = Decode(0x605, 8, seg1);
+    CHECK_EQ(tag, 0x1F500100 | PEAK_CANOPEN_TAG_SDO | PEAK_CANOPEN_TAG_BLOCK);
+    CHECK(Is("SDO node 5 block download 0x1F50:01 segment 1"));
+    Decode(0x605, 8, seg2);
+    Decode(0x585, 8, ack2);
+    CHECK(Is("SDO node 5 block download ack seqno 2, blksize 2"));
+    tag = Decode(0x605, 8, last);
+    CHECK_EQ(tag & PEAK_CANOPEN_TAG_ERROR, 0);
+    CHECK(Is("SDO node 5 block download 0x1F50:01 segment 1, last"));
+    Decode(0x585, 8, ack1);
+    
+    // the end is no segment
+    tag = Decode(0x605, 8, end);
+    CHECK_EQ(tag & PEAK_CANOPEN_TAG_BLOCK, 0);
+    CHECK(Is("SDO node 5 block download end, crc 0x1234"));
+    Decode(0x585, 8, endConfirmed);
+    CHECK(Is("SDO node 5 block download end confirmed"));
+    
+    // a sequence number skipped
+    Decode(0x605, 8, initiate);
+    Decode(0x585, 8, confirmed);
+    Decode(0x605, 8, seg1);
+    tag = Decode(0x605, 8, wrong);
+    CHECK(tag & PEAK_CANOPEN_TAG_ERROR);
+    CHECK(Is("SDO node 5 block download 0x1F50:01 segment 3, out of sequence"));
+}
+
+static void TestGuarding(void)
+{
+    static const UInt8 state[] = { 0x85 };
+    CanMsg msg;
+    UInt32 tag;
+    
+    // a heartbeat until the master asks by RTR, from then on the replies of node guarding
+    PeakCanopenReset(gDecoder);
+    CHECK_EQ(Decode(0x705, 1, state), 0);
+    Frame(&msg, 0x705, 1, NULL);
+    msg.rtr = 1;
+    PeakCanopenDecode(gDecoder, &msg, gDescr, sizeof(gDescr));
+    CHECK(Is("Node guarding request node 5"));
+    tag = Decode(0x705, 1, state);
+    CHECK_EQ(tag, PEAK_CANOPEN_TAG_GUARD);
+    CHECK(Is("Node guarding node 5: operational, toggle 1"));
+}
+
+static void TestPdo(void)
+{
+    PeakCanopenField fields[4];
+    static const UInt8 data[] = { 0x34, 0x12, 0xFE, 0xFF, 0xFF, 0xFF, 0x80, 0xF6 };
+    static const UInt8 real[] = { 0x00, 0x00, 0xC0, 0x3F };
+    CanMsg msg;
+    
+    bzero(fields, sizeof(fields));
+    strcpy(fields[0].name, "status");
+    fields[0].bits = 16;
+    strcpy(fields[1].name, "position");
+    fields[1].offset = 16;
+    fields[1].bits = 32;
+    fields[1].type = PEAK_CANOPEN_SIGNED;
+    strcpy(fields[2].name, "flags");
+    fields[2].offset = 48;
+    fields[2].bits = 8;
+    strcpy(fields[3].name, "temp");
+    fields[3].offset = 56;
+    fields[3].bits = 8;
+    fields[3].type = PEAK_CANOPEN_SIGNED;
+    
+    PeakCanopenReset(gDecoder);
+    Decode(0x185, 8, data);
+    CHECK(Is("TPDO1 node 5"));
+    CHECK_EQ(PeakCanopenSetMapping(gDecoder, 0x185, fields, 4), kIOReturnSuccess);
+    Decode(0x185, 8, data);
+    CHECK(Is("TPDO1 node 5: status=4660 position=-2 flags=128 temp=-10"));
+    
+    // fields past the frame's bytes are unknown
+    Decode(0x185, 4, data);
+    CHECK(Is("TPDO1 node 5: status=4660 position=? flags=? temp=?"));
+    Frame(&msg, 0x185, 8, NULL);
+    msg.rtr = 1;
+    PeakCanopenDescribe(gDecoder, &msg, 0, gDescr, sizeof(gDescr));
+    CHECK(Is("TPDO1 node 5 request"));
+    
+    strcpy(fields[0].name, "speed");
+    fields[0].bits = 32;
+    fields[0].type = PEAK_CANOPEN_REAL;
+    CHECK_EQ(PeakCanopenSetMapping(gDecoder, 0x205, fields, 1), kIOReturnSuccess);
+    Decode(0x205, 4, real);
+    CHECK(Is("RPDO1 node 5: speed=1.5"));
+    
+    // a removed mapping makes room, the others keep theirs
+    CHECK_EQ(gDecoder->pdoCount, 2);
+    CHECK_EQ(PeakCanopenSetMapping(gDecoder, 0x185, NULL, 0), kIOReturnSuccess);
+    CHECK_EQ(gDecoder->pdoCount, 1);
+    Decode(0x185, 8, data);
+    CHECK(Is("TPDO1 node 5"));
+    Decode(0x205, 4, real);
+    CHECK(Is("RPDO1 node 5: speed=1.5"));
+    
+    // fields past the eight bytes, and reals of other sizes
+    fields[1].offset = 40;
+    CHECK_EQ(PeakCanopenSetMapping(gDecoder, 0x185, &fields[1], 1), kIOReturnBadArgument);
+    fields[0].bits = 16;
+    CHECK_EQ(PeakCanopenSetMapping(gDecoder, 0x185, fields, 1), kIOReturnBadArgument);
+    CHECK_EQ(PeakCanopenSetMapping(gDecoder, 0x800, fields, 0), kIOReturnBadArgument);
+    CHECK_EQ(PeakCanopenSetMapping(gDecoder, 0x205, NULL, 0), kIOReturnSuccess);
+}
+
+// sixteen overlapping fields of 64 bits with the longest names and values fit a description
+static void TestLongestPdo(void)
+{
+    PeakCanopenField fields[PEAK_CANOPEN_PDO_FIELDS];
+    static const UInt8 data[] = { 0, 0, 0, 0, 0, 0, 0, 0x80 };
+    char expected[PEAK_CANOPEN_DESCR_MAX], *ptr;
+    UInt32 i, length;
+    
+    bzero(fields, sizeof(fields));
+    ptr = expected + sprintf(expected, "RPDO4 node 127:");
+    for (i = 0; i < PEAK_CANOPEN_PDO_FIELDS; i++)
+    {
+        snprintf(fields[i].name, PEAK_CANOPEN_NAME, "field%010u", i);
+        fields[i].bits = 64;
+        fields[i].type = PEAK_CANOPEN_SIGNED;
+        ptr += sprintf(ptr, " %s=-9223372036854775808", fields[i].name);
+    }
+    CHECK_EQ(PeakCanopenSetMapping(gDecoder, 0x57F, fields, PEAK_CANOPEN_PDO_FIELDS), kIOReturnSuccess);
+    
+    length = (UInt32)strlen(expected);
+    CHECK_EQ(Decode(0x57F, 8, data), 0);
+    CHECK_EQ(strlen(gDescr), length);
+    CHECK(Is(expected));
+    
+    // and a short buffer gets what fits
+    CHECK_EQ(PeakCanopenDescribe(gDecoder, &(CanMsg){ .canid.ul = 0x77F, .len = 1 }, 0, gDescr, 10), 9);
+    CHECK(Is("Heartbeat"));
+    CHECK_EQ(PeakCanopenSetMapping(gDecoder, 0x57F, NULL, 0), kIOReturnSuccess);
+}
+
+static void TestLoadMapping(void)
+{
+    static const UInt8 data[] = { 0x01, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0, 0 };
+    char path[256];
+    FILE* file;
+    
+    PeakTestTempPath(path, sizeof(path), "TestCanopen.map");
+    file = fopen(path, "w");
+    CHECK(file != NULL);
+    if (file == NULL)
+        return;
+    fprintf(file, "# drive 1\n\n0x181 statusword:16 position:32:s   # mapped by 0x1A00\n0x281 control:16:u\n");
+    fclose(file);
+    
+    PeakCanopenReset(gDecoder);
+    CHECK_EQ(PeakCanopenLoadMapping(gDecoder, path), kIOReturnSuccess);
+    Decode(0x181, 8, data);
+    CHECK(Is("TPDO1 node 1: statusword=1 position=-1"));
+    Decode(0x281, 2, data);
+    CHECK(Is("TPDO2 node 1: control=1"));
+    
+    // the lines before a bad one are taken
+    file = fopen(path, "w");
+    fprintf(file, "0x182 a:8\n0x183 b:8:x\n0x184 c:8\n");
+    fclose(file);
+    CHECK_EQ(PeakCanopenLoadMapping(gDecoder, path), kIOReturnBadArgument);
+    CHECK(gDecoder->pdoOf[0x182] != 0);
+    CHECK_EQ(gDecoder->pdoOf[0x183], 0);
+    CHECK_EQ(gDecoder->pdoOf[0x184], 0);
+    
+    file = fopen(path, "w");
+    fprintf(file, "0x900 a:8\n");
+    fclose(file);
+    CHECK_EQ(PeakCanopenLoadMapping(gDecoder, path), kIOReturnBadArgument);
+    
+    unlink(path);
+    CHECK_EQ(PeakCanopenLoadMapping(gDecoder, path), kIOReturnNotOpen);
+}
+
+int main(void)
+{
+    if (PeakCanopenCreate(&gDecoder) != kIOReturnSuccess)
+        return 1;
+    
+    RUN(TestServices);
+    RUN(TestExpedited);
+    RUN(TestSegmented);
+    RUN(TestBlock);
+    RUN(TestGuarding);
+    RUN(TestPdo);
+    RUN(TestLongestPdo);
+    RUN(TestLoadMapping);
+    
+    PeakCanopenFree(gDecoder);
+    return PeakTestResult(__FILE__);
+}
@@ -0,0 +1,197 @@
+/*
+    File:           TestCapture.c
+
+    Description:    Unit tests of the capture records and files: the bytes past the length, the header,
+                    merged order across adapters and reopening.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "PeakTest.h"
+#include "PeakCapture.h"
+#include "PeakIndex.h"
+
+static PeakCaptureRecord gRecords[1024];
+
+static void Frame(CanMsg* msg, UInt32 channel, UInt64 mono, UInt8 len)
+{
+    memset(msg, 0xaa, sizeof(CanMsg));
+    msg->canid.ul = 0x100 + channel;
+    msg->ext = 0;
+    msg->rtr = 0;
+    msg->err = 0;
+    msg->loc = 0;
+    msg->len = len;
+    msg->channel = channel;
+    msg->ts = mono;
+    msg->mono = mono;
+    msg->delay = 0;
+}
+
+static void TestRecord(void)
+{
+    PeakCaptureRecord record;
+    CanMsg msg, back;
+    UInt32 i;
+    
+    Frame(&msg, 1, 123456789, 3);
+    msg.ext = 1;
+    msg.loc = 1;
+    msg.data[0] = 1;
+    msg.data[1] = 2;
+    msg.data[2] = 3;
+    PeakCaptureRecordFromMsg(&record, &msg);
+    CHECK_EQ(record.ts, 123456789);
+    CHECK_EQ(record.canid, 0x101);
+    CHECK_EQ(record.flags, PEAK_CAPTURE_EXT | PEAK_CAPTURE_LOC);
+    CHECK_EQ(record.dlc, 3);
+    CHECK_EQ(record.channel, 1);
+    CHECK_EQ(record.reserved, 0);
+    
+    // only the frame's bytes are kept, the rest of the buffer is zero
+    CHECK_EQ(record.data[2], 3);
+    for (i = 3; i < 8; i++)
+        CHECK_EQ(record.data[i], 0);
+    
+    PeakCaptureRecordToMsg(&record, &back);
+    CHECK_EQ(back.canid.ul, 0x101);
+    CHECK(back.ext && back.loc && !back.rtr && !back.err);
+    CHECK_EQ(back.len, 3);
+    CHECK_EQ(back.data[0], 1);
+    CHECK_EQ(back.data[7], 0);
+    
+    // a length field above eight keeps all eight bytes and is read back as eight
+    Frame(&msg, 0, 1, 15);
+    PeakCaptureRecordFromMsg(&record, &msg);
+    CHECK_EQ(record.dlc, 15);
+    CHECK_EQ(record.data[7], 0xaa);
+    PeakCaptureRecordToMsg(&record, &back);
+    CHECK_EQ(back.len, 8);
+}
+
+static void TestWrite(void)
+{
+    static PeakCapture capture;
+    PeakCaptureHeader header;
+    PeakCaptureStats stats;
+    char path[256];
+    struct stat st;
+    CanMsg msg;
+    UInt32 i, j;
+    int fd;
+    
+    PeakTestTempPath(path, sizeof(path), "write.pcap");
+    CHECK_EQ(PeakCaptureCreate(&capture), kIOReturnSuccess);
+    CHECK_EQ(PeakCaptureAddChannel(&capture, 0), kIOReturnSuccess);
+    CHECK_EQ(PeakCaptureAddChannel(&capture, 1), kIOReturnSuccess);
+    CHECK_EQ(PeakCaptureAddChannel(&capture, PEAK_MAX_CHANNELS), kIOReturnBadArgument);
+    CHECK_EQ(PeakCaptureOpen(&capture, path, 0x001c, 1234, 5), kIOReturnSuccess);
+    CHECK(PeakCaptureIsOpen(&capture));
+    CHECK_EQ(PeakCaptureOpen(&capture, path, 0x001c, 1234, 5), kIOReturnBusy);
+    
+    // two adapters with interleaved times, and one without a ring
+    for (i = 0; i < 500; i++)
+    {
+        Frame(&msg, 0, 1000 + 2 * i, (UInt8)(i % 9));
+        PeakCaptureAppend(&capture, &msg);
+        Frame(&msg, 1, 1001 + 2 * i, (UInt8)(i % 9));
+        PeakCaptureAppend(&capture, &msg);
+    }
+    Frame(&msg, 2, 5000, 8);
+    PeakCaptureAppend(&capture, &msg);
+    PeakCaptureClose(&capture);
+    CHECK(!PeakCaptureIsOpen(&capture));
+    
+    PeakCaptureGetStats(&capture, &stats);
+    CHECK_EQ(stats.frames, 1000);
+    CHECK_EQ(stats.bytes, 1000 * sizeof(PeakCaptureRecord));
+    CHECK_EQ(stats.dropped, 1);
+    CHECK_EQ(stats.errors, 0);
+    
+    // appended while closed, not written anywhere
+    PeakCaptureAppend(&capture, &msg);
+    
+    fd = open(path, O_RDONLY);
+    CHECK(fd >= 0);
+    if (fd < 0)
+        return;
+    CHECK_EQ(PeakCaptureReadHeader(fd, &header), kIOReturnSuccess);
+    CHECK_EQ(header.version, PEAK_CAPTURE_VERSION);
+    CHECK_EQ(header.bitrate, 0x001c);
+    CHECK_EQ(header.serial, 1234);
+    CHECK_EQ(header.deviceNo, 5);
+    CHECK_EQ(fstat(fd, &st), 0);
+    CHECK_EQ(st.st_size, sizeof(PeakCaptureHeader) + 1000 * sizeof(PeakCaptureRecord));
+    CHECK_EQ(pread(fd, gRecords, 1000 * sizeof(PeakCaptureRecord), header.headerSize), 1000 * sizeof(PeakCaptureRecord));
+    close(fd);
+    
+    // merged in time order, without the bytes past the length
+    for (i = 0; i < 1000; i++)
+    {
+        CHECK_EQ(gRecords[i].ts, 1000 + i);
+        CHECK_EQ(gRecords[i].channel, i & 1);
+        CHECK_EQ(gRecords[i].dlc, (i / 2) % 9);
+        for (j = gRecords[i].dlc; j < 8; j++)
+            CHECK_EQ(gRecords[i].data[j], 0);
+    }
+    PeakTestRemove(path);
+}
+
+static void TestReopen(void)
+{
+    static PeakCapture capture;
+    PeakCaptureStats stats;
+    char path[256], bad[256];
+    CanMsg msg;
+    
+    PeakTestTempPath(path, sizeof(path), "reopen.pcap");
+    PeakTestTempPath(bad, sizeof(bad), "missing/reopen.pcap");
+    PeakCaptureCreate(&capture);
+    PeakCaptureAddChannel(&capture, 0);
+    CHECK_EQ(PeakCaptureOpen(&capture, bad, 0, 0, 0), kIOReturnNotOpen);
+    CHECK(!PeakCaptureIsOpen(&capture));
+    
+    // the same capture writes one file after the other, each with its own frames and stats
+    CHECK_EQ(PeakCaptureOpen(&capture, path, 0, 0, 0), kIOReturnSuccess);
+    Frame(&msg, 0, 10, 8);
+    PeakCaptureAppend(&capture, &msg);
+    PeakCaptureClose(&capture);
+    
+    CHECK_EQ(PeakCaptureOpen(&capture, path, 0, 0, 0), kIOReturnSuccess);
+    Frame(&msg, 0, 20, 8);
+    PeakCaptureAppend(&capture, &msg);
+    Frame(&msg, 0, 21, 8);
+    PeakCaptureAppend(&capture, &msg);
+    PeakCaptureClose(&capture);
+    PeakCaptureGetStats(&capture, &stats);
+    CHECK_EQ(stats.frames, 2);
+    CHECK_EQ(stats.writes, 1);
+    PeakTestRemove(path);
+}
+
+int main(void)
+{
+    RUN(TestRecord);
+    RUN(TestWrite);
+    RUN(TestReopen);
+    return PeakTestResult(__FILE__);
+}
@@ -0,0 +1,362 @@
+/*
+    File:           TestDbc.c
+
+    Description:    The DBC parser and decoder: Intel and Motorola layouts, signed, float and
+                    multiplexed signals, the batch columns and the load errors.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "PeakTest.h"
+#include "PeakDbc.h"
+
+// Intel and Motorola, signed and scaled signals, a multiplexed message, an extended one with a name
+// longer than PEAK_DBC_NAME and a float, a double with a signal that does not fit, and the pseudo
+// message of the signals without one.
+static const char* gDatabase =
+    "VERSION \"\"\n"
+    "\n"
+    "BU_: ECU\n"
+    "\n"
+    "BO_ 256 Engine: 8 ECU\n"
+    " SG_ Speed : 0|16@1+ (0.1,0) [0|6553.5] \"km/h\" Vector__XXX\n"
+    " SG_ Temp : 16|8@1- (1,-40) [-168|87] \"degC\" Vector__XXX\n"
+    " SG_ Torque : 39|16@0- (0.5,0) [-16384|16383.5] \"Nm\" Vector__XXX\n"
+    " SG_ Level : 48|4@1+ (1,0) [0|15] \"\" Vector__XXX\n"
+    "\n"
+    "BO_ 512 Mux : 4 ECU\n"
+    " SG_ Mode M : 0|8@1+ (1,0) [0|255] \"\" Vector__XXX\n"
+    " SG_ Voltage m1 : 8|16@1+ (0.01,0) [0|655.35] \"V\" Vector__XXX\n"
+    " SG_ Current m2 : 8|16@1- (1,0) [-32768|32767] \"A\" Vector__XXX\n"
+    "\n"
+    "BO_ 2566844926 FuelEconomyOfTheEngineAndTheTransmission: 8 ECU\n"
+    " SG_ Rate : 0|32@1- (1,0) [0|0] \"l/h\" Vector__XXX\n"
+    "\n"
+    "BO_ 768 Precise: 8 ECU\n"
+    " SG_ Value : 0|64@1- (1,0) [0|0] \"\" Vector__XXX\n"
+    " SG_ Bad : 60|8@1+ (1,0) [0|255] \"\" Vector__XXX\n"
+    "\n"
+    "BO_ 3221225472 VECTOR__INDEPENDENT_SIG_MSG: 0 Vector__XXX\n"
+    " SG_ Orphan : 0|8@1+ (1,0) [0|0] \"\" Vector__XXX\n"
+    "\n"
+    "CM_ SG_ 256 Speed \"Vehicle speed\";\n"
+    "SIG_VALTYPE_ 2566844926 Rate : 1;\n"
+    "SIG_VALTYPE_ 768 Value : 2;\n";
+
+static PeakDbc gDbc;
+
+static int WriteFile(const char* path, const char* text)
+{
+    FILE* file = fopen(path, "w");
+    
+    if (file == NULL)
+        return 0;
+    fputs(text, file);
+    return fclose(file) == 0;
+}
+
+static void Frame(CanMsg* msg, UInt32 canid, UInt8 ext, UInt8 len, const UInt8* data)
+{
+    bzero(msg, sizeof(CanMsg));
+    msg->canid.ul = canid;
+    msg->ext = ext;
+    msg->len = len;
+    if (data)
+        memcpy(msg->data, data, len);
+}
+
+static int Near(double value, double expected)
+{
+    if (fabs(value - expected) < 1e-9)
+        return 1;
+    fprintf(stderr, "%.17g != %.17g\n", value, expected);
+    return 0;
+}
+
+// both NAN or the same value
+static int Same(double a, double b)
+{
+    return (isnan(a) && isnan(b)) || a == b;
+}
+
+static void TestLoad(void)
+{
+    const PeakDbcMessage* msg;
+    CanMsg frame;
+    
+    CHECK_EQ(gDbc.messageCount, 4);
+    CHECK_EQ(gDbc.maxSignals, 4);
+    CHECK_EQ(gDbc.signalCount, 4 + 3 + 1 + 1);
+    
+    Frame(&frame, 0x100, 0, 8, NULL);
+    msg = PeakDbcLookup(&gDbc, &frame);
+    CHECK(msg != NULL && strcmp(msg->name, "Engine") == 0);
+    CHECK(msg != NULL && msg->signalCount == 4 && msg->motorola && msg->muxer == -1);
+    CHECK(msg != NULL && strcmp(msg->signals[0].unit, "km/h") == 0);
+    
+    // "Mux :" with the blank before the colon
+    Frame(&frame, 0x200, 0, 4, NULL);
+    msg = PeakDbcLookup(&gDbc, &frame);
+    CHECK(msg != NULL && strcmp(msg->name, "Mux") == 0 && msg->dlc == 4 && msg->muxer == 0);
+    CHECK(msg != NULL && msg->signals[1].mux == 1 && msg->signals[2].mux == 2);
+    
+    // the long name is cut to PEAK_DBC_NAME - 1 characters
+    Frame(&frame, 0x18FEF1FE, 1, 8, NULL);
+    msg = PeakDbcLookup(&gDbc, &frame);
+    CHECK(msg != NULL && strlen(msg->name) == PEAK_DBC_NAME - 1);
+    CHECK(msg != NULL && strncmp(msg->name, "FuelEconomyOfTheEngineAndTheTransmission", PEAK_DBC_NAME - 1) == 0);
+    CHECK(msg != NULL && msg->signals[0].type == PEAK_DBC_FLOAT);
+    
+    // Bad does not fit into eight bytes
+    Frame(&frame, 0x300, 0, 8, NULL);
+    msg = PeakDbcLookup(&gDbc, &frame);
+    CHECK(msg != NULL && msg->signalCount == 1 && msg->signals[0].type == PEAK_DBC_DOUBLE);
+    
+    // the same identifier with the other format, remote and error frames, unknown ones
+    Frame(&frame, 0x100, 1, 8, NULL);
+    CHECK(PeakDbcLookup(&gDbc, &frame) == NULL);
+    Frame(&frame, 0x2FE, 0, 8, NULL);
+    CHECK(PeakDbcLookup(&gDbc, &frame) == NULL);
+    Frame(&frame, 0x100, 0, 0, NULL);
+    frame.rtr = 1;
+    CHECK(PeakDbcLookup(&gDbc, &frame) == NULL);
+    Frame(&frame, 0x100, 0, 8, NULL);
+    frame.err = 1;
+    CHECK(PeakDbcLookup(&gDbc, &frame) == NULL);
+    Frame(&frame, 0x18FEF1FF, 1, 8, NULL);
+    CHECK(PeakDbcLookup(&gDbc, &frame) == NULL);
+}
+
+static void TestFrame(void)
+{
+    static const UInt8 engine[] = { 0xD2, 0x04, 0xF6, 0x00, 0xFF, 0x38, 0xA7, 0x00 };
+    double values[4];
+    CanMsg frame;
+    
+    // Speed 1234, Temp -10, Torque -200 big endian in bytes 4 and 5, Level the low nibble of byte 6
+    Frame(&frame, 0x100, 0, 8, engine);
+    CHECK_EQ(PeakDbcDecodeFrame(&gDbc, &frame, values), 4);
+    CHECK(Near(values[0], 123.4));
+    CHECK(Near(values[1], -50));
+    CHECK(Near(values[2], -100));
+    CHECK(Near(values[3], 7));
+    
+    // too short for Level only
+    frame.len = 6;
+    CHECK_EQ(PeakDbcDecodeFrame(&gDbc, &frame, values), 4);
+    CHECK(Near(values[2], -100));
+    CHECK(isnan(values[3]));
+    
+    frame.len = 1;
+    CHECK_EQ(PeakDbcDecodeFrame(&gDbc, &frame, values), 4);
+    CHECK(isnan(values[0]) && isnan(values[1]) && isnan(values[2]) && isnan(values[3]));
+    
+    Frame(&frame, 0x101, 0, 8, engine);
+    CHECK_EQ(PeakDbcDecodeFrame(&gDbc, &frame, values), 0);
+}
+
+static void TestMultiplexed(void)
+{
+    static const UInt8 mode1[] = { 0x01, 0x10, 0x27, 0x00 }, mode2[] = { 0x02, 0x9C, 0xFF, 0x00 }, mode3[] = { 0x03, 0x01, 0x00, 0x00 };
+    double values[3];
+    CanMsg frame;
+    
+    Frame(&frame, 0x200, 0, 4, mode1);
+    CHECK_EQ(PeakDbcDecodeFrame(&gDbc, &frame, values), 3);
+    CHECK(Near(values[0], 1));
+    CHECK(Near(values[1], 100));
+    CHECK(isnan(values[2]));
+    
+    Frame(&frame, 0x200, 0, 4, mode2);
+    PeakDbcDecodeFrame(&gDbc, &frame, values);
+    CHECK(Near(values[0], 2));
+    CHECK(isnan(values[1]));
+    CHECK(Near(values[2], -100));
+    
+    Frame(&frame, 0x200, 0, 4, mode3);
+    PeakDbcDecodeFrame(&gDbc, &frame, values);
+    CHECK(isnan(values[1]) && isnan(values[2]));
+    
+    // without the switch no multiplexed signal
+    Frame(&frame, 0x200, 0, 0, NULL);
+    PeakDbcDecodeFrame(&gDbc, &frame, values);
+    CHECK(isnan(values[0]) && isnan(values[1]) && isnan(values[2]));
+}
+
+static void TestFloat(void)
+{
+    float rate = 3.5f;
+    double value = -2.25, values[1];
+    CanMsg frame;
+    
+    Frame(&frame, 0x18FEF1FE, 1, 8, NULL);
+    memcpy(frame.data, &rate, sizeof(float));
+    CHECK_EQ(PeakDbcDecodeFrame(&gDbc, &frame, values), 1);
+    CHECK(Near(values[0], 3.5));
+    
+    Frame(&frame, 0x300, 0, 8, NULL);
+    memcpy(frame.data, &value, sizeof(double));
+    CHECK_EQ(PeakDbcDecodeFrame(&gDbc, &frame, values), 1);
+    CHECK(Near(values[0], -2.25));
+}
+
+static void TestDescribe(void)
+{
+    static const UInt8 engine[] = { 0xD2, 0x04, 0xF6, 0x00, 0xFF, 0x38, 0xA7, 0x00 };
+    static const UInt8 mode1[] = { 0x01, 0x10, 0x27, 0x00 };
+    char buffer[128];
+    CanMsg frame;
+    
+    Frame(&frame, 0x100, 0, 8, engine);
+    CHECK_EQ(PeakDbcDescribe(&gDbc, &frame, buffer, sizeof(buffer)), strlen(buffer));
+    CHECK(strcmp(buffer, "Engine: Speed=123.4 km/h Temp=-50 degC Torque=-100 Nm Level=7") == 0);
+    
+    // missing signals are left out
+    Frame(&frame, 0x200, 0, 4, mode1);
+    PeakDbcDescribe(&gDbc, &frame, buffer, sizeof(buffer));
+    CHECK(strcmp(buffer, "Mux: Mode=1 Voltage=100 V") == 0);
+    
+    // cut to the buffer
+    Frame(&frame, 0x100, 0, 8, engine);
+    CHECK_EQ(PeakDbcDescribe(&gDbc, &frame, buffer, 10), 9);
+    CHECK(strcmp(buffer, "Engine: S") == 0);
+    CHECK_EQ(PeakDbcDescribe(&gDbc, &frame, buffer, 1), 0);
+    CHECK_EQ(buffer[0], 0);
+    
+    Frame(&frame, 0x101, 0, 8, engine);
+    strcpy(buffer, "stale");
+    CHECK_EQ(PeakDbcDescribe(&gDbc, &frame, buffer, sizeof(buffer)), 0);
+    CHECK_EQ(buffer[0], 0);
+}
+
+// every column of every block holds what PeakDbcDecodeFrame makes of the frame in that row
+static void CheckBatch(const CanMsg* msgs, UInt32 count)
+{
+    const PeakDbcBlock* blocks;
+    double values[4];
+    UInt32 b, i, s, n, rows = 0, known = 0, mismatches = 0;
+    
+    for (i = 0; i < count; i++)
+        known += PeakDbcLookup(&gDbc, &msgs[i]) != NULL;
+    
+    n = PeakDbcDecodeBatch(&gDbc, msgs, count, &blocks);
+    for (b = 0; b < n; b++)
+    {
+        const PeakDbcMessage* msg = &gDbc.messages[blocks[b].message];
+        
+        for (i = 0; i < blocks[b].count; i++)
+        {
+            CHECK(PeakDbcLookup(&gDbc, &msgs[blocks[b].rows[i]]) == msg);
+            CHECK(i == 0 || blocks[b].rows[i] > blocks[b].rows[i - 1]);
+            PeakDbcDecodeFrame(&gDbc, &msgs[blocks[b].rows[i]], values);
+            for (s = 0; s < msg->signalCount; s++)
+                mismatches += !Same(blocks[b].values[s * blocks[b].count + i], values[s]);
+        }
+        rows += blocks[b].count;
+    }
+    CHECK_EQ(rows, known);
+    CHECK_EQ(mismatches, 0);
+}
+
+static void TestBatch(void)
+{
+    static CanMsg msgs[PEAK_DBC_BATCH + 16];
+    UInt32 i;
+    
+    for (i = 0; i < PEAK_DBC_BATCH + 16; i++)
+    {
+        switch (i % 6)
+        {
+            case 0: Frame(&msgs[i], 0x100, 0, (UInt8)(i % 9), NULL); break;
+            case 1: Frame(&msgs[i], 0x200, 0, 4, NULL); break;
+            case 2: Frame(&msgs[i], 0x18FEF1FE, 1, 8, NULL); break;
+            case 3: Frame(&msgs[i], 0x300, 0, 8, NULL); break;
+            case 4: Frame(&msgs[i], 0x100 + i % 3, 0, 8, NULL); break;
+            case 5: Frame(&msgs[i], 0x100, 0, 8, NULL); msgs[i].rtr = i % 2; break;
+        }
+        msgs[i].ldata = (UInt64)i * 0x9E3779B97F4A7C15ULL;
+        if (i % 6 == 1)
+            msgs[i].data[0] = (UInt8)(i % 4);
+        if (i % 6 == 2)
+        {
+            float rate = (float)i / 4;
+            memcpy(msgs[i].data, &rate, sizeof(float));
+        }
+    }
+    
+    CheckBatch(msgs, 200);
+    CheckBatch(msgs + 7, 1);
+    CheckBatch(msgs + 4, 1);
+    CheckBatch(msgs, PEAK_DBC_BATCH);
+    // the second batch must not see the counts of the first
+    CheckBatch(msgs + 3, 300);
+}
+
+static void TestErrors(void)
+{
+    const PeakDbcBlock* blocks;
+    char path[256];
+    PeakDbc dbc;
+    CanMsg frame;
+    double values[1];
+    
+    PeakTestTempPath(path, sizeof(path), "missing.dbc");
+    CHECK_EQ(PeakDbcLoad(&dbc, path), kIOReturnNotOpen);
+    
+    PeakTestTempPath(path, sizeof(path), "empty.dbc");
+    CHECK(WriteFile(path, "VERSION \"\"\n\nBU_: ECU\n\nBO_ 3221225472 VECTOR__INDEPENDENT_SIG_MSG: 0 Vector__XXX\n"));
+    CHECK_EQ(PeakDbcLoad(&dbc, path), kIOReturnBadArgument);
+    unlink(path);
+    
+    // a failed load leaves an empty database behind
+    CHECK(dbc.messages == NULL && dbc.messageCount == 0);
+    Frame(&frame, 0x100, 0, 8, NULL);
+    CHECK(PeakDbcLookup(&dbc, &frame) == NULL);
+    CHECK_EQ(PeakDbcDecodeFrame(&dbc, &frame, values), 0);
+    CHECK_EQ(PeakDbcDecodeBatch(&dbc, &frame, 1, &blocks), 0);
+    PeakDbcFree(&dbc);
+}
+
+int main(void)
+{
+    char path[256];
+    
+    PeakTestTempPath(path, sizeof(path), "test.dbc");
+    if (!WriteFile(path, gDatabase) || PeakDbcLoad(&gDbc, path) != kIOReturnSuccess)
+    {
+        fprintf(stderr, "Unable to load %s\n", path);
+        unlink(path);
+        return 1;
+    }
+    unlink(path);
+    
+    RUN(TestLoad);
+    RUN(TestFrame);
+    RUN(TestMultiplexed);
+    RUN(TestFloat);
+    RUN(TestDescribe);
+    RUN(TestBatch);
+    RUN(TestErrors);
+    
+    PeakDbcFree(&gDbc);
+    return PeakTestResult(__FILE__);
+}
@@ -0,0 +1,191 @@
+/*
+    File:           TestDecode.c
+
+    Description:    Decoding of bulk-IN telegrams injected through the loopback transport, intact ones
+                    and ones whose records do not fit their length.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "PeakTest.h"
+#include "PeakBatch.h"
+#include "PeakTransport.h"
+
+static CanMsg gReceived[256];
+
+static void Frame(CanMsg* msg, UInt32 id, int ext, int rtr, UInt8 len)
+{
+    UInt8 j;
+    
+    bzero(msg, sizeof(CanMsg));
+    msg->canid.ul = id;
+    msg->ext = ext;
+    msg->rtr = rtr;
+    msg->len = len;
+    for (j = 0; j < len; j++)
+        msg->data[j] = (UInt8)(id + j);
+}
+
+// injects the telegram, or its first length bytes, and waits until the decoder has taken it
+static void Inject(const PeakTestTelegram* telegram, UInt32 length)
+{
+    PeakRxStats before, after;
+    UInt64 startNs = PeakMonotonicNs();
+    
+    PeakGetRxStats(&before);
+    CHECK_EQ(PeakLoopbackInject(0, telegram->data, length), kIOReturnSuccess);
+    do
+    {
+        PeakGetRxStats(&after);
+    } while (after.telegrams == before.telegrams && after.malformed == before.malformed &&
+             PeakMonotonicNs() - startNs < 1000000000ULL);
+}
+
+static void TestFrames(void)
+{
+    PeakTestTelegram telegram;
+    PeakRxStats before, after;
+    CanMsg msg;
+    UInt32 n;
+    
+    PeakGetRxStats(&before);
+    PeakTestTelegramBegin(&telegram, 100);
+    Frame(&msg, 0x123, 0, 0, 8);
+    CHECK(PeakTestTelegramFrame(&telegram, &msg, 0));
+    Frame(&msg, 0x1abcdef0, 1, 0, 3);
+    CHECK(PeakTestTelegramFrame(&telegram, &msg, 10));
+    Frame(&msg, 0x7ff, 0, 1, 2);
+    CHECK(PeakTestTelegramFrame(&telegram, &msg, 10));
+    Inject(&telegram, telegram.length);
+    
+    n = PeakTestReceive(gReceived, 256, 3, 1000000000ULL);
+    CHECK_EQ(n, 3);
+    if (n != 3)
+        return;
+    CHECK_EQ(gReceived[0].canid.ul, 0x123);
+    CHECK_EQ(gReceived[0].len, 8);
+    CHECK_EQ(gReceived[0].data[7], 0x123 + 7 - 0x100);
+    CHECK_EQ(gReceived[1].canid.ul, 0x1abcdef0);
+    CHECK(gReceived[1].ext);
+    CHECK_EQ(gReceived[1].len, 3);
+    CHECK_EQ(gReceived[1].data[2], 0xf2);
+    CHECK_EQ(gReceived[2].canid.ul, 0x7ff);
+    CHECK(gReceived[2].rtr);
+    CHECK_EQ(gReceived[2].len, 2);
+    
+    PeakGetRxStats(&after);
+    CHECK_EQ(after.telegrams - before.telegrams, 1);
+    CHECK_EQ(after.frames - before.frames, 3);
+    CHECK_EQ(after.malformed - before.malformed, 0);
+}
+
+static void TestMalformed(void)
+{
+    PeakTestTelegram telegram, broken;
+    PeakRxStats before, after;
+    CanMsg msg;
+    UInt32 statusBefore = PeakTestStatusCount();
+    
+    PeakGetRxStats(&before);
+    PeakTestTelegramBegin(&telegram, 200);
+    Frame(&msg, 0x100, 0, 0, 8);
+    PeakTestTelegramFrame(&telegram, &msg, 0);
+    Frame(&msg, 0x101, 1, 0, 8);
+    PeakTestTelegramFrame(&telegram, &msg, 5);
+    
+    // the last record cut short, by its last data byte and in the middle of the id
+    Inject(&telegram, telegram.length - 1);
+    Inject(&telegram, 2 + 1 + 2 + 2 + 8 + 3);
+    
+    // a wrong prefix
+    broken = telegram;
+    broken.data[0] = 3;
+    Inject(&broken, broken.length);
+    
+    // more records counted than there are
+    broken = telegram;
+    broken.data[1] = 3;
+    Inject(&broken, broken.length);
+    
+    // no room for the header
+    Inject(&telegram, 1);
+    
+    // a bus load status record without its value
+    PeakTestTelegramBegin(&broken, 300);
+    PeakTestTelegramStatus(&broken, 3, 0, 0);
+    Inject(&broken, broken.length);
+    
+    PeakGetRxStats(&after);
+    CHECK_EQ(after.malformed - before.malformed, 6);
+    CHECK_EQ(after.telegrams - before.telegrams, 0);
+    CHECK_EQ(after.frames - before.frames, 0);
+    CHECK_EQ(after.statusRecords - before.statusRecords, 0);
+    CHECK_EQ(PeakTestReceive(gReceived, 256, 1, 50000000ULL), 0);
+    
+    // the intact telegram still decodes, and so does one with a complete status record
+    Inject(&telegram, telegram.length);
+    CHECK_EQ(PeakTestReceive(gReceived, 256, 2, 1000000000ULL), 2);
+    CHECK_EQ(gReceived[0].canid.ul, 0x100);
+    CHECK_EQ(gReceived[1].canid.ul, 0x101);
+    
+    broken.data[broken.length++] = 40;
+    Inject(&broken, broken.length);
+    PeakGetRxStats(&after);
+    CHECK_EQ(after.malformed - before.malformed, 6);
+    CHECK_EQ(after.telegrams - before.telegrams, 2);
+    CHECK_EQ(PeakTestStatusCount() - statusBefore, 1);
+}
+
+static void TestFailedRead(void)
+{
+    PeakTestTelegram telegram;
+    PeakRxStats before, after;
+    CanMsg msg;
+    
+    // the reads after a failed one are decoded, the failed one is counted and re-armed
+    PeakGetRxStats(&before);
+    CHECK_EQ(PeakLoopbackInjectError(0, kIOReturnIOError), kIOReturnSuccess);
+    PeakTestTelegramBegin(&telegram, 400);
+    Frame(&msg, 0x222, 0, 0, 8);
+    PeakTestTelegramFrame(&telegram, &msg, 0);
+    Inject(&telegram, telegram.length);
+    
+    CHECK_EQ(PeakTestReceive(gReceived, 256, 1, 1000000000ULL), 1);
+    CHECK_EQ(gReceived[0].canid.ul, 0x222);
+    PeakGetRxStats(&after);
+    CHECK_EQ(after.readErrors - before.readErrors, 1);
+    CHECK_EQ(after.telegrams - before.telegrams, 1);
+    CHECK_EQ(after.stalls - before.stalls, 0);
+    
+    CHECK_EQ(PeakLoopbackInjectError(0, kIOReturnSuccess), kIOReturnBadArgument);
+}
+
+int main(void)
+{
+    if (PeakTestStartLoopback(1) != kIOReturnSuccess)
+    {
+        fprintf(stderr, "Unable to start the loopback driver.\n");
+        return 1;
+    }
+    RUN(TestFrames);
+    RUN(TestMalformed);
+    RUN(TestFailedRead);
+    PeakTestStopLoopback();
+    return PeakTestResult(__FILE__);
+}
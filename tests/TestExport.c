@@ -0,0 +1,239 @@
+/*
+    File:           TestExport.c
+
+    Description:    Unit tests of the text export: the lines of every format, CanMsgs and capture files,
+                    and output larger than the buffer.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "PeakTest.h"
+#include "PeakExport.h"
+#include "PeakIndex.h"
+
+static PeakCaptureRecord gRecords[4];
+static char gText[1 << 16];
+
+// a standard frame, an extended one sent by us with a length above eight, a remote and an error frame
+static void Records(void)
+{
+    bzero(gRecords, sizeof(gRecords));
+    gRecords[0].ts = 1436509052249713000ULL;
+    gRecords[0].canid = 0x123;
+    gRecords[0].dlc = 4;
+    memcpy(gRecords[0].data, "\xde\xad\xbe\xef", 4);
+    gRecords[1].ts = 1436509053000001999ULL;
+    gRecords[1].canid = 0x18ff50e5;
+    gRecords[1].flags = PEAK_CAPTURE_EXT | PEAK_CAPTURE_LOC;
+    gRecords[1].dlc = 12;
+    memset(gRecords[1].data, 0x5a, 8);
+    gRecords[2].ts = 1436509053500000000ULL;
+    gRecords[2].canid = 0x7ff;
+    gRecords[2].flags = PEAK_CAPTURE_RTR;
+    gRecords[2].dlc = 2;
+    gRecords[3].ts = 1436509054000000000ULL;
+    gRecords[3].canid = 0x4;
+    gRecords[3].flags = PEAK_CAPTURE_ERR;
+    gRecords[3].dlc = 8;
+}
+
+// the file's text into gText, removed afterwards
+static size_t ReadBack(const char* path)
+{
+    ssize_t n;
+    int fd = open(path, O_RDONLY);
+    
+    CHECK(fd >= 0);
+    n = fd >= 0 ? read(fd, gText, sizeof(gText) - 1) : 0;
+    if (n < 0)
+        n = 0;
+    gText[n] = 0;
+    if (fd >= 0)
+        close(fd);
+    unlink(path);
+    return n;
+}
+
+static UInt64 CountLines(const char* path)
+{
+    UInt64 lines = 0;
+    ssize_t n, i;
+    int fd = open(path, O_RDONLY);
+    
+    while (fd >= 0 && (n = read(fd, gText, sizeof(gText))) > 0)
+    {
+        for (i = 0; i < n; i++)
+            lines += gText[i] == '\n';
+    }
+    if (fd >= 0)
+        close(fd);
+    return lines;
+}
+
+static void Export(UInt32 format)
+{
+    PeakExporter exporter;
+    char path[256];
+    
+    PeakTestTempPath(path, sizeof(path), "lines");
+    Records();
+    CHECK_EQ(PeakExportOpen(&exporter, path, format, NULL), kIOReturnSuccess);
+    CHECK_EQ(PeakExportRecords(&exporter, gRecords, 4), kIOReturnSuccess);
+    CHECK_EQ(exporter.lines, 4);
+    CHECK_EQ(PeakExportClose(&exporter), kIOReturnSuccess);
+    ReadBack(path);
+}
+
+static void TestFormatForPath(void)
+{
+    PeakExporter exporter;
+    
+    CHECK_EQ(PeakExportFormatForPath("capture.log"), PEAK_EXPORT_CANDUMP);
+    CHECK_EQ(PeakExportFormatForPath("capture.ASC"), PEAK_EXPORT_ASC);
+    CHECK_EQ(PeakExportFormatForPath("capture.csv"), PEAK_EXPORT_CSV);
+    CHECK_EQ(PeakExportFormatForPath("capture"), PEAK_EXPORT_CSV);
+    CHECK_EQ(PeakExportOpenFd(&exporter, 1, PEAK_EXPORT_CSV + 1, NULL), kIOReturnBadArgument);
+}
+
+static void TestCandump(void)
+{
+    Export(PEAK_EXPORT_CANDUMP);
+    CHECK(strcmp(gText,
+                 "(1436509052.249713) can0 123#DEADBEEF\n"
+                 "(1436509053.000001) can0 18FF50E5#5A5A5A5A5A5A5A5A\n"
+                 "(1436509053.500000) can0 7FF#R\n"
+                 "(1436509054.000000) can0 20000004#0000000000000000\n") == 0);
+}
+
+static void TestAsc(void)
+{
+    const char* lines;
+    
+    // the date line depends on the time zone, the frames do not
+    Export(PEAK_EXPORT_ASC);
+    CHECK(strncmp(gText, "date ", 5) == 0);
+    lines = strstr(gText, "   0.000000 Start of measurement\n");
+    CHECK(lines != NULL);
+    if (lines == NULL)
+        return;
+    CHECK(strcmp(lines,
+                 "   0.000000 Start of measurement\n"
+                 "   0.000000 1  123             Rx   d 4 DE AD BE EF\n"
+                 "   0.750288 1  18FF50E5x       Tx   d 8 5A 5A 5A 5A 5A 5A 5A 5A\n"
+                 "   1.250287 1  7FF             Rx   r\n"
+                 "   1.750287 1  ErrorFrame\n"
+                 "End TriggerBlock\n") == 0);
+}
+
+static void TestCsv(void)
+{
+    Export(PEAK_EXPORT_CSV);
+    CHECK(strcmp(gText,
+                 "time,id,ext,rtr,err,dir,dlc,data\n"
+                 "1436509052.249713,0x123,0,0,0,Rx,4,DE AD BE EF\n"
+                 "1436509053.000001,0x18FF50E5,1,0,0,Tx,8,5A 5A 5A 5A 5A 5A 5A 5A\n"
+                 "1436509053.500000,0x7FF,0,1,0,Rx,2,\n"
+                 "1436509054.000000,0x4,0,0,1,Rx,8,00 00 00 00 00 00 00 00\n") == 0);
+}
+
+static void TestFrames(void)
+{
+    PeakExporter exporter;
+    char path[256];
+    CanMsg msg;
+    
+    // from CanMsgs, only the bytes of the length, on the channel given
+    PeakTestTempPath(path, sizeof(path), "frames.log");
+    bzero(&msg, sizeof(CanMsg));
+    msg.ts = 2000000000ULL;
+    msg.canid.ul = 0x42;
+    msg.len = 3;
+    msg.ldata = 0x0706050403020100ULL;
+    CHECK_EQ(PeakExportOpen(&exporter, path, PeakExportFormatForPath(path), "vcan1"), kIOReturnSuccess);
+    CHECK_EQ(PeakExportFrames(&exporter, &msg, 1), kIOReturnSuccess);
+    CHECK_EQ(PeakExportClose(&exporter), kIOReturnSuccess);
+    ReadBack(path);
+    CHECK(strcmp(gText, "(0000000002.000000) vcan1 042#000102\n") == 0);
+}
+
+static void TestLargeExport(void)
+{
+    static PeakCaptureRecord records[4096];
+    PeakCaptureHeader header;
+    PeakExporter exporter;
+    char capturePath[256], path[256], index[300];
+    struct stat st;
+    UInt32 i, round;
+    int fd;
+    
+    // more than the buffer holds, through a capture file and its mapped records
+    PeakTestTempPath(capturePath, sizeof(capturePath), "large.pcap");
+    PeakTestTempPath(path, sizeof(path), "large.csv");
+    snprintf(index, sizeof(index), "%s%s", capturePath, PEAK_INDEX_SUFFIX);
+    bzero(&header, sizeof(header));
+    header.magic = PEAK_CAPTURE_MAGIC;
+    header.version = PEAK_CAPTURE_VERSION;
+    header.headerSize = sizeof(PeakCaptureHeader);
+    header.recordSize = sizeof(PeakCaptureRecord);
+    bzero(records, sizeof(records));
+    for (i = 0; i < 4096; i++)
+    {
+        records[i].canid = 0x100;
+        records[i].dlc = 8;
+    }
+    fd = open(capturePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK_EQ(write(fd, &header, sizeof(header)), sizeof(header));
+    for (round = 0; round < 10; round++)
+    {
+        for (i = 0; i < 4096; i++)
+            records[i].ts = 1000000000ULL * (round * 4096 + i);
+        CHECK_EQ(write(fd, records, sizeof(records)), sizeof(records));
+    }
+    close(fd);
+    
+    CHECK_EQ(PeakExportCapture(capturePath, path, PEAK_EXPORT_CSV, NULL), kIOReturnSuccess);
+    CHECK_EQ(stat(path, &st), 0);
+    CHECK(st.st_size > PEAK_EXPORT_BUFFER_SIZE);
+    
+    // every line is there, the header and 40960 frames
+    CHECK_EQ(CountLines(path), 1 + 40960);
+    
+    // a write error is kept and returned
+    CHECK_EQ(PeakExportOpenFd(&exporter, -1, PEAK_EXPORT_CSV, NULL), kIOReturnSuccess);
+    CHECK_EQ(PeakExportRecords(&exporter, records, 1), kIOReturnSuccess);
+    CHECK_EQ(PeakExportClose(&exporter), kIOReturnIOError);
+    
+    unlink(capturePath);
+    unlink(index);
+    unlink(path);
+}
+
+int main(void)
+{
+    RUN(TestFormatForPath);
+    RUN(TestCandump);
+    RUN(TestAsc);
+    RUN(TestCsv);
+    RUN(TestFrames);
+    RUN(TestLargeExport);
+    return PeakTestResult(__FILE__);
+}
@@ -0,0 +1,337 @@
+/*
+    File:           TestFilter.c
+
+    Description:    Unit tests of the frame filter: terms, payload bytes past the length, the compiled
+                    program against its terms, and swapping programs while the decoders are busy.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <sched.h>
+
+#include "PeakTest.h"
+#include "PeakFilter.h"
+#include "PeakBatch.h"
+#include "PeakTransport.h"
+
+static CanMsg gReceived[4096];
+
+static void Frame(CanMsg* msg, UInt32 id, int ext, UInt8 len)
+{
+    bzero(msg, sizeof(CanMsg));
+    msg->canid.ul = id;
+    msg->ext = ext;
+    msg->len = len;
+}
+
+static void TestTermMatch(void)
+{
+    PeakFilterTerm term;
+    CanMsg msg;
+    
+    PeakFilterTermInit(&term);
+    Frame(&msg, 0x123, 0, 8);
+    CHECK(PeakFilterTermMatch(&term, &msg));
+    
+    term.low = 0x100;
+    term.high = 0x1ff;
+    CHECK(PeakFilterTermMatch(&term, &msg));
+    msg.canid.ul = 0x200;
+    CHECK(!PeakFilterTermMatch(&term, &msg));
+    
+    PeakFilterTermInit(&term);
+    term.code = 0x180;
+    term.mask = 0x780;
+    msg.canid.ul = 0x1a5;
+    CHECK(PeakFilterTermMatch(&term, &msg));
+    msg.canid.ul = 0x225;
+    CHECK(!PeakFilterTermMatch(&term, &msg));
+    
+    PeakFilterTermInit(&term);
+    term.flagsMask = PEAK_FILTER_EXT | PEAK_FILTER_RTR;
+    term.flagsValue = PEAK_FILTER_EXT;
+    msg.ext = 1;
+    CHECK(PeakFilterTermMatch(&term, &msg));
+    msg.rtr = 1;
+    CHECK(!PeakFilterTermMatch(&term, &msg));
+    
+    PeakFilterTermInit(&term);
+    term.minLength = 2;
+    term.maxLength = 4;
+    msg.len = 1;
+    CHECK(!PeakFilterTermMatch(&term, &msg));
+    msg.len = 4;
+    CHECK(PeakFilterTermMatch(&term, &msg));
+}
+
+static void TestDataPastLength(void)
+{
+    PeakFilterProgram* program;
+    PeakFilterTerm term;
+    CanMsg msg;
+    
+    // byte 5 must be 0, a frame of three bytes does not have it whatever is left in the buffer
+    PeakFilterTermInit(&term);
+    term.dataMask[5] = 0xff;
+    program = PeakFilterCompile(&term, 1);
+    CHECK(program != NULL);
+    if (program == NULL)
+        return;
+    
+    Frame(&msg, 0x100, 0, 3);
+    CHECK(!PeakFilterTermMatch(&term, &msg));
+    CHECK(!PeakFilterMatch(program, &msg));
+    
+    msg.len = 6;
+    CHECK(PeakFilterTermMatch(&term, &msg));
+    CHECK(PeakFilterMatch(program, &msg));
+    msg.data[5] = 1;
+    CHECK(!PeakFilterMatch(program, &msg));
+    PeakFilterFree(program);
+    
+    // a byte within the length is checked as before
+    PeakFilterTermInit(&term);
+    term.dataMask[0] = 0xf0;
+    term.dataValue[0] = 0x20;
+    program = PeakFilterCompile(&term, 1);
+    Frame(&msg, 0x100, 0, 1);
+    msg.data[0] = 0x2f;
+    CHECK(PeakFilterMatch(program, &msg));
+    msg.len = 0;
+    CHECK(!PeakFilterMatch(program, &msg));
+    PeakFilterFree(program);
+}
+
+static void TestTermAnd(void)
+{
+    PeakFilterTerm a, b;
+    
+    PeakFilterTermInit(&a);
+    PeakFilterTermInit(&b);
+    a.low = 0x100;
+    a.high = 0x200;
+    b.low = 0x180;
+    b.high = 0x300;
+    b.dataMask[0] = 0xff;
+    b.dataValue[0] = 0x42;
+    CHECK(PeakFilterTermAnd(&a, &b));
+    CHECK_EQ(a.low, 0x180);
+    CHECK_EQ(a.high, 0x200);
+    CHECK_EQ(a.dataMask[0], 0xff);
+    CHECK_EQ(a.dataValue[0], 0x42);
+    
+    // no frame has both values
+    PeakFilterTermInit(&b);
+    b.dataMask[0] = 0x0f;
+    b.dataValue[0] = 0x03;
+    CHECK(!PeakFilterTermAnd(&a, &b));
+    
+    PeakFilterTermInit(&a);
+    PeakFilterTermInit(&b);
+    a.high = 0x10;
+    b.low = 0x20;
+    CHECK(!PeakFilterTermAnd(&a, &b));
+}
+
+static void TestAcceptReject(void)
+{
+    PeakFilterProgram *all = PeakFilterCompile(NULL, 0), *none = PeakFilterCompile(&(PeakFilterTerm){ 0 }, 0);
+    CanMsg msg;
+    
+    Frame(&msg, 0x1abcdef0, 1, 8);
+    CHECK(PeakFilterMatch(all, &msg));
+    CHECK(!PeakFilterMatch(none, &msg));
+    PeakFilterFree(all);
+    PeakFilterFree(none);
+}
+
+// a random term of every kind the compiler tells apart
+static void RandomTerm(PeakFilterTerm* term, UInt64* seed)
+{
+    UInt32 kind = (UInt32)(PeakTestNext(seed) % 6), span;
+    
+    PeakFilterTermInit(term);
+    switch (kind) {
+        case 0: // standard range
+            term->low = (UInt32)(PeakTestNext(seed) % 0x800);
+            term->high = term->low + (UInt32)(PeakTestNext(seed) % 16);
+            term->flagsMask = PEAK_FILTER_EXT;
+            break;
+        case 1: // extended range
+            span = (UInt32)(PeakTestNext(seed) % 4096);
+            term->low = (UInt32)(PeakTestNext(seed) % (PEAK_FILTER_MAX_ID - span));
+            term->high = term->low + span;
+            term->flagsMask = PEAK_FILTER_EXT;
+            term->flagsValue = PEAK_FILTER_EXT;
+            break;
+        case 2: // mask, either format
+            term->mask = 0x1fffff00;
+            term->code = (UInt32)(PeakTestNext(seed) % 0x800) << 8 & term->mask;
+            break;
+        case 3: // range with a flag
+            term->low = (UInt32)(PeakTestNext(seed) % 0x800);
+            term->high = term->low + 64;
+            term->flagsMask = PEAK_FILTER_RTR;
+            term->flagsValue = PeakTestNext(seed) & 1 ? PEAK_FILTER_RTR : 0;
+            break;
+        case 4: // range with a length
+            term->low = (UInt32)(PeakTestNext(seed) % 0x800);
+            term->high = term->low + 64;
+            term->minLength = (UInt8)(PeakTestNext(seed) % 5);
+            break;
+        default: // range with a payload byte
+            term->low = (UInt32)(PeakTestNext(seed) % 0x800);
+            term->high = term->low + 128;
+            term->dataMask[PeakTestNext(seed) % 8] = 0x0f;
+            break;
+    }
+}
+
+static void TestCompiledAgreesWithTerms(void)
+{
+    static PeakFilterTerm terms[300];
+    PeakFilterProgram* program;
+    UInt64 seed = 7;
+    UInt32 i, j, matches = 0;
+    CanMsg msg;
+    int any;
+    
+    for (i = 0; i < 300; i++)
+        RandomTerm(&terms[i], &seed);
+    program = PeakFilterCompile(terms, 300);
+    CHECK(program != NULL);
+    if (program == NULL)
+        return;
+    
+    // whatever the compiler put where, it passes exactly the frames one of the terms matches
+    for (i = 0; i < 200000; i++)
+    {
+        Frame(&msg, 0, (PeakTestNext(&seed) & 3) == 0, (UInt8)(PeakTestNext(&seed) % 9));
+        msg.canid.ul = msg.ext ? (UInt32)(PeakTestNext(&seed) % (PEAK_FILTER_MAX_ID + 1)) : (UInt32)(PeakTestNext(&seed) % 0x800);
+        msg.rtr = (PeakTestNext(&seed) & 7) == 0;
+        msg.ldata = ((UInt64)PeakTestNext(&seed) << 32) | PeakTestNext(&seed);
+        for (j = 0, any = 0; j < 300 && !any; j++)
+            any = PeakFilterTermMatch(&terms[j], &msg);
+        CHECK_EQ(PeakFilterMatch(program, &msg), any);
+        matches += any;
+    }
+    CHECK(matches > 1000);
+    PeakFilterFree(program);
+}
+
+#pragma mark - Swapping under load
+
+static UInt32 gRunning = 0;
+
+// one full telegram after the other, as fast as the decoder takes them; the adapter clock stands still
+// so the frames are not stamped ahead of the host's
+static UInt32 Source(void* refCon, UInt8* buffer)
+{
+    PeakTestTelegram telegram;
+    CanMsg msg;
+    
+    (void)refCon;
+    if (!__atomic_load_n(&gRunning, __ATOMIC_ACQUIRE))
+        return 0;
+    
+    PeakTestTelegramBegin(&telegram, 0);
+    Frame(&msg, 0x100, 0, 8);
+    while (PeakTestTelegramFrame(&telegram, &msg, 0))
+        msg.canid.ul ^= 0x300;
+    memcpy(buffer, telegram.data, telegram.length);
+    return telegram.length;
+}
+
+static void Inject(UInt32 adapter, UInt32 id)
+{
+    PeakTestTelegram telegram;
+    CanMsg msg;
+    
+    PeakTestTelegramBegin(&telegram, 0);
+    Frame(&msg, id, 0, 2);
+    PeakTestTelegramFrame(&telegram, &msg, 0);
+    CHECK_EQ(PeakLoopbackInject(adapter, telegram.data, telegram.length), kIOReturnSuccess);
+}
+
+static void TestSwapUnderLoad(void)
+{
+    PeakFilterTerm term;
+    PeakRxStats before, after;
+    UInt64 startNs;
+    UInt32 i, n;
+    CanMsg msg;
+    
+    PeakFilterTermInit(&term);
+    term.low = term.high = 0x200;
+    
+    // both decoders are always inside a buffer, every swap still gets through
+    __atomic_store_n(&gRunning, 1, __ATOMIC_RELEASE);
+    PeakLoopbackSetSource(0, Source, NULL);
+    PeakLoopbackSetSource(1, Source, NULL);
+    PeakGetRxStats(&before);
+    startNs = PeakMonotonicNs();
+    for (i = 0, after = before; i < 200 || after.telegrams - before.telegrams < 2000; i++)
+    {
+        CHECK_EQ(PeakSetFilter(i & 1 ? NULL : &term, 1), kIOReturnSuccess);
+        PeakTestReceive(gReceived, 4096, 0, 0);
+        PeakGetRxStats(&after);
+        if (PeakMonotonicNs() - startNs > 10000000000ULL)
+            break;
+    }
+    CHECK(after.telegrams - before.telegrams >= 2000);
+    
+    __atomic_store_n(&gRunning, 0, __ATOMIC_RELEASE);
+    while (PeakTestReceive(gReceived, 4096, 4096, 200000000ULL))
+        ;
+    
+    // the last filter decides what comes through, and what PeakFilterFrame says
+    CHECK_EQ(PeakSetFilter(&term, 1), kIOReturnSuccess);
+    Inject(0, 0x100);
+    Inject(1, 0x200);
+    Inject(0, 0x200);
+    n = PeakTestReceive(gReceived, 4096, 2, 1000000000ULL);
+    CHECK_EQ(n, 2);
+    CHECK_EQ(PeakTestReceive(gReceived + n, 4096 - n, 1, 50000000ULL), 0);
+    for (i = 0; i < n; i++)
+        CHECK_EQ(gReceived[i].canid.ul, 0x200);
+    
+    Frame(&msg, 0x100, 0, 0);
+    CHECK(!PeakFilterFrame(&msg));
+    msg.canid.ul = 0x200;
+    CHECK(PeakFilterFrame(&msg));
+    CHECK_EQ(PeakSetFilter(NULL, 0), kIOReturnSuccess);
+    msg.canid.ul = 0x100;
+    CHECK(PeakFilterFrame(&msg));
+}
+
+int main(void)
+{
+    RUN(TestTermMatch);
+    RUN(TestDataPastLength);
+    RUN(TestTermAnd);
+    RUN(TestAcceptReject);
+    RUN(TestCompiledAgreesWithTerms);
+    if (PeakTestStartLoopback(2) != kIOReturnSuccess)
+    {
+        fprintf(stderr, "Unable to start the loopback driver.\n");
+        return 1;
+    }
+    RUN(TestSwapUnderLoad);
+    PeakTestStopLoopback();
+    return PeakTestResult(__FILE__);
+}
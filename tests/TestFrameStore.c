@@ -0,0 +1,171 @@
+/*
+    File:           TestFrameStore.c
+
+    Description:    Unit tests of the columnar frame store: round trips through the columns, eviction
+                    when full and on request, and the display strings.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "PeakTest.h"
+#include "PeakFrameStore.h"
+
+static void Frame(CanMsg* msg, UInt64 n)
+{
+    bzero(msg, sizeof(CanMsg));
+    msg->ts = 1000 + n;
+    msg->canid.ul = 0x100 + (UInt32)n;
+    msg->ext = n & 1;
+    msg->rtr = (n & 2) != 0;
+    msg->channel = n & 3;
+    msg->len = n % 9;
+    msg->ldata = n * 0x0101010101010101ULL;
+}
+
+static void TestCreate(void)
+{
+    PeakFrameStore store;
+    
+    CHECK_EQ(PeakFrameStoreCreate(&store, 0), kIOReturnBadArgument);
+    CHECK_EQ(PeakFrameStoreCreate(&store, 1000), kIOReturnBadArgument);
+    CHECK_EQ(PeakFrameStoreCreate(&store, 1024), kIOReturnSuccess);
+    CHECK_EQ(PeakFrameStoreCapacity(&store), 1024);
+    CHECK_EQ(PeakFrameStoreCount(&store), 0);
+    CHECK_EQ(PeakFrameStoreMemory(1024), 1024 * 26);
+    PeakFrameStoreDestroy(&store);
+}
+
+static void TestRoundTrip(void)
+{
+    PeakFrameStore store;
+    CanMsg msgs[16], msg;
+    UInt32 tags[16], i;
+    
+    PeakFrameStoreCreate(&store, 16);
+    for (i = 0; i < 16; i++)
+    {
+        Frame(&msgs[i], i);
+        tags[i] = 100 + i;
+    }
+    PeakFrameStoreAppend(&store, msgs, tags, 10);
+    CHECK_EQ(PeakFrameStoreCount(&store), 10);
+    
+    for (i = 0; i < 10; i++)
+    {
+        CHECK_EQ(PeakFrameStoreGet(&store, i, &msg), kIOReturnSuccess);
+        CHECK_EQ(msg.ts, msgs[i].ts);
+        CHECK_EQ(msg.canid.ul, msgs[i].canid.ul);
+        CHECK_EQ(msg.ext, msgs[i].ext);
+        CHECK_EQ(msg.rtr, msgs[i].rtr);
+        CHECK_EQ(msg.channel, msgs[i].channel);
+        CHECK_EQ(msg.len, msgs[i].len);
+        CHECK_EQ(msg.ldata, msgs[i].ldata);
+        CHECK_EQ(PeakFrameStoreTag(&store, i), 100 + i);
+    }
+    CHECK_EQ(PeakFrameStoreGet(&store, 10, &msg), kIOReturnBadArgument);
+    CHECK_EQ(PeakFrameStoreTag(&store, 10), 0);
+    
+    // without tags the frames are tagged 0
+    PeakFrameStoreAppend(&store, msgs, NULL, 1);
+    CHECK_EQ(PeakFrameStoreTag(&store, 10), 0);
+    PeakFrameStoreDestroy(&store);
+}
+
+static void TestEviction(void)
+{
+    PeakFrameStore store;
+    CanMsg msgs[40], msg;
+    UInt32 i;
+    
+    PeakFrameStoreCreate(&store, 8);
+    for (i = 0; i < 40; i++)
+        Frame(&msgs[i], i);
+    
+    // once full the oldest frames make room, the rows start at the oldest one kept
+    PeakFrameStoreAppend(&store, msgs, NULL, 5);
+    PeakFrameStoreAppend(&store, msgs + 5, NULL, 6);
+    CHECK_EQ(PeakFrameStoreCount(&store), 8);
+    CHECK_EQ(store.evicted, 3);
+    PeakFrameStoreGet(&store, 0, &msg);
+    CHECK_EQ(msg.ts, msgs[3].ts);
+    PeakFrameStoreGet(&store, 7, &msg);
+    CHECK_EQ(msg.ts, msgs[10].ts);
+    
+    // more than the capacity in one go keeps the newest
+    PeakFrameStoreAppend(&store, msgs + 11, NULL, 29);
+    CHECK_EQ(PeakFrameStoreCount(&store), 8);
+    CHECK_EQ(store.evicted, 32);
+    PeakFrameStoreGet(&store, 0, &msg);
+    CHECK_EQ(msg.ts, msgs[32].ts);
+    
+    PeakFrameStoreEvict(&store, 5);
+    CHECK_EQ(PeakFrameStoreCount(&store), 3);
+    PeakFrameStoreGet(&store, 0, &msg);
+    CHECK_EQ(msg.ts, msgs[37].ts);
+    PeakFrameStoreEvict(&store, 100);
+    CHECK_EQ(PeakFrameStoreCount(&store), 0);
+    CHECK_EQ(store.evicted, 40);
+    
+    PeakFrameStoreAppend(&store, msgs, NULL, 4);
+    PeakFrameStoreClear(&store);
+    CHECK_EQ(PeakFrameStoreCount(&store), 0);
+    PeakFrameStoreDestroy(&store);
+}
+
+static void TestFormat(void)
+{
+    PeakFrameStore store;
+    char buffer[64];
+    CanMsg msg;
+    
+    PeakFrameStoreCreate(&store, 4);
+    bzero(&msg, sizeof(CanMsg));
+    msg.len = 3;
+    msg.data[0] = 0x01;
+    msg.data[1] = 0xab;
+    msg.data[2] = 0xf0;
+    msg.data[3] = 0x55;
+    PeakFrameStoreAppend(&store, &msg, NULL, 1);
+    CHECK_EQ(PeakFrameStoreFormatData(&store, 0, buffer, sizeof(buffer)), 15);
+    CHECK(strcmp(buffer, " 0x01 0xab 0xf0") == 0);
+    
+    // cut to the buffer like snprintf, the length is still the whole one
+    CHECK_EQ(PeakFrameStoreFormatData(&store, 0, buffer, 6), 15);
+    CHECK(strcmp(buffer, " 0x01") == 0);
+    
+    // no more than eight bytes whatever the length says, nothing for an empty frame or a row not kept
+    msg.len = 15;
+    PeakFrameStoreAppend(&store, &msg, NULL, 1);
+    CHECK_EQ(PeakFrameStoreFormatData(&store, 1, buffer, sizeof(buffer)), 40);
+    msg.len = 0;
+    PeakFrameStoreAppend(&store, &msg, NULL, 1);
+    CHECK_EQ(PeakFrameStoreFormatData(&store, 2, buffer, sizeof(buffer)), 0);
+    CHECK_EQ(buffer[0], 0);
+    CHECK_EQ(PeakFrameStoreFormatData(&store, 3, buffer, sizeof(buffer)), 0);
+    PeakFrameStoreDestroy(&store);
+}
+
+int main(void)
+{
+    RUN(TestCreate);
+    RUN(TestRoundTrip);
+    RUN(TestEviction);
+    RUN(TestFormat);
+    return PeakTestResult(__FILE__);
+}
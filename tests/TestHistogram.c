@@ -0,0 +1,232 @@
+/*
+    File:           TestHistogram.c
+
+    Description:    Unit tests of the latency histograms: exact small values, quantiles within a bucket,
+                    clamping, intervals, the text and JSON dump, and the stages counted on the receive
+                    path.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "PeakTest.h"
+#include "PeakHistogram.h"
+#include "PeakTransport.h"
+
+static PeakHistogram gHistogram, gCopy;
+
+static int Compare(const void* a, const void* b)
+{
+    UInt64 x = *(const UInt64*)a, y = *(const UInt64*)b;
+    
+    return x < y ? -1 : x > y;
+}
+
+static void TestSmall(void)
+{
+    UInt64 v;
+    
+    // below 32 every value has a bucket of its own
+    PeakHistogramReset(&gHistogram);
+    CHECK_EQ(PeakHistogramQuantile(&gHistogram, 0.5), 0);
+    for (v = 0; v < 32; v++)
+        PeakHistogramRecord(&gHistogram, v);
+    CHECK_EQ(gHistogram.count, 32);
+    CHECK_EQ(gHistogram.min, 0);
+    CHECK_EQ(gHistogram.max, 31);
+    CHECK_EQ(gHistogram.sum, 31 * 32 / 2);
+    CHECK_EQ(PeakHistogramQuantile(&gHistogram, 0), 0);
+    CHECK_EQ(PeakHistogramQuantile(&gHistogram, 0.5), 16);
+    CHECK_EQ(PeakHistogramQuantile(&gHistogram, 1), 31);
+}
+
+static void TestPrecision(void)
+{
+    static UInt64 values[10000];
+    PeakLatencyStats stats;
+    const double q[] = { 0.01, 0.25, 0.5, 0.9, 0.99, 0.999 };
+    UInt64 seed = 1, exact, got;
+    UInt32 i;
+    
+    // from 1 ns to about a second, evenly spread over the powers of two
+    PeakHistogramReset(&gHistogram);
+    for (i = 0; i < 10000; i++)
+    {
+        values[i] = (PeakTestNext(&seed) & ((1ULL << (PeakTestNext(&seed) % 30)) - 1)) + 1;
+        PeakHistogramRecord(&gHistogram, values[i]);
+    }
+    qsort(values, 10000, sizeof(UInt64), Compare);
+    
+    // a quantile is the highest value of the bucket the exact one falls into, at most 1/32 above it
+    for (i = 0; i < sizeof(q) / sizeof(q[0]); i++)
+    {
+        exact = values[(UInt32)(q[i] * 10000)];
+        got = PeakHistogramQuantile(&gHistogram, q[i]);
+        CHECK(got >= exact);
+        CHECK(got - exact <= exact / 32);
+    }
+    
+    PeakHistogramGetStats(&gHistogram, &stats);
+    CHECK_EQ(stats.count, 10000);
+    CHECK_EQ(stats.minNs, values[0]);
+    CHECK_EQ(stats.maxNs, values[9999]);
+    CHECK(stats.p50Ns <= stats.p90Ns && stats.p90Ns <= stats.p99Ns && stats.p99Ns <= stats.p999Ns && stats.p999Ns <= stats.maxNs);
+}
+
+static void TestClamp(void)
+{
+    // values past 2^40 ns go into the last bucket, the maximum stays exact
+    PeakHistogramReset(&gHistogram);
+    PeakHistogramRecord(&gHistogram, 1ULL << 45);
+    PeakHistogramRecord(&gHistogram, ~0ULL);
+    CHECK_EQ(gHistogram.counts[PEAK_HISTOGRAM_BUCKETS - 1], 2);
+    CHECK_EQ(gHistogram.max, ~0ULL);
+    CHECK(PeakHistogramQuantile(&gHistogram, 0.5) >= (1ULL << PEAK_HISTOGRAM_MAX_BITS) - 1);
+}
+
+static void TestInterval(void)
+{
+    UInt32 i;
+    
+    PeakHistogramReset(&gHistogram);
+    for (i = 0; i < 100; i++)
+        PeakHistogramRecord(&gHistogram, 10);
+    gCopy = gHistogram;
+    for (i = 0; i < 50; i++)
+        PeakHistogramRecord(&gHistogram, 1000 + i);
+    
+    // what was recorded since the copy, the extremes to the bucket
+    PeakHistogramSubtract(&gHistogram, &gCopy);
+    CHECK_EQ(gHistogram.count, 50);
+    CHECK_EQ(gHistogram.sum, 50 * 1000 + 49 * 50 / 2);
+    CHECK_EQ(gHistogram.counts[10], 0);
+    CHECK(gHistogram.min <= 1000 && gHistogram.min > 1000 - 1000 / 32);
+    CHECK(gHistogram.max >= 1049 && gHistogram.max <= 1049 + 1049 / 32);
+    
+    // and everything again once added back
+    PeakHistogramAdd(&gHistogram, &gCopy);
+    CHECK_EQ(gHistogram.count, 150);
+    CHECK_EQ(gHistogram.min, 10);
+    
+    // a histogram reset after the copy is all new
+    PeakHistogramReset(&gHistogram);
+    PeakHistogramRecord(&gHistogram, 5);
+    PeakHistogramSubtract(&gHistogram, &gCopy);
+    CHECK_EQ(gHistogram.count, 1);
+    CHECK_EQ(gHistogram.min, 5);
+    
+    // nothing since the copy
+    gCopy = gHistogram;
+    PeakHistogramSubtract(&gHistogram, &gCopy);
+    CHECK_EQ(gHistogram.count, 0);
+    CHECK_EQ(gHistogram.max, 0);
+    CHECK_EQ(PeakHistogramQuantile(&gHistogram, 0.99), 0);
+}
+
+static void TestFormat(void)
+{
+    PeakInstrumentStats stats;
+    char buffer[4096], small[16];
+    UInt32 needed;
+    
+    bzero(&stats, sizeof(PeakInstrumentStats));
+    stats.sinceNs = 1000000000ULL;
+    stats.untilNs = 2000000000ULL;
+    stats.frames = 1234;
+    stats.telegrams = 300;
+    stats.channels = 2;
+    stats.ringDropped = 7;
+    stats.usb.count = 1234;
+    stats.usb.p99Ns = 250000;
+    
+    needed = PeakFormatInstrumentation(&stats, PEAK_STATS_JSON, buffer, sizeof(buffer));
+    CHECK_EQ(needed, strlen(buffer) + 1);
+    CHECK(buffer[0] == '{' && buffer[needed - 2] == '}');
+    CHECK(strstr(buffer, "\"usb\":{\"count\":1234,") != NULL);
+    CHECK(strstr(buffer, "\"p99\":250000") != NULL);
+    CHECK(strstr(buffer, "\"frames\":1234,\"telegrams\":300") != NULL);
+    CHECK(strstr(buffer, "\"ring\":7") != NULL);
+    
+    needed = PeakFormatInstrumentation(&stats, PEAK_STATS_TEXT, buffer, sizeof(buffer));
+    CHECK_EQ(needed, strlen(buffer) + 1);
+    CHECK(strncmp(buffer, "1.0 s, 2 channels, 1234 frames in 300 telegrams", 47) == 0);
+    CHECK(strstr(buffer, "ring 7") != NULL);
+    
+    // a buffer too small is cut short and still terminated, the length is that of the whole text
+    CHECK_EQ(PeakFormatInstrumentation(&stats, PEAK_STATS_TEXT, small, sizeof(small)), needed);
+    CHECK_EQ(strlen(small), sizeof(small) - 1);
+    CHECK_EQ(PeakFormatInstrumentation(&stats, PEAK_STATS_TEXT, NULL, 0), needed);
+}
+
+// the stages of the receive path are counted for every frame that goes through them
+static void TestReceivePath(void)
+{
+    static CanMsg received[256];
+    PeakTestTelegram telegram;
+    PeakInstrumentStats stats;
+    CanMsg msg;
+    UInt32 t, n;
+    
+    if (PeakTestStartLoopback(1) != kIOReturnSuccess)
+    {
+        CHECK(0);
+        return;
+    }
+    
+    bzero(&msg, sizeof(CanMsg));
+    msg.canid.ul = 0x123;
+    msg.len = 8;
+    for (t = 0; t < 10; t++)
+    {
+        PeakTestTelegramBegin(&telegram, 0);
+        PeakTestTelegramFrame(&telegram, &msg, 0);
+        PeakTestTelegramFrame(&telegram, &msg, 0);
+        PeakTestTelegramFrame(&telegram, &msg, 0);
+        CHECK_EQ(PeakLoopbackInject(0, telegram.data, telegram.length), kIOReturnSuccess);
+    }
+    n = PeakTestReceive(received, 256, 30, 2000000000ULL);
+    CHECK_EQ(n, 30);
+    PeakNoteDisplayed(received, n);
+    
+    CHECK_EQ(PeakGetInstrumentation(&stats), kIOReturnSuccess);
+    CHECK_EQ(stats.channels, 1);
+    CHECK_EQ(stats.frames, 30);
+    CHECK_EQ(stats.telegrams, 10);
+    CHECK_EQ(stats.usb.count, 30);
+    CHECK_EQ(stats.decode.count, 10);
+    CHECK_EQ(stats.dequeue.count, 30);
+    CHECK_EQ(stats.display.count, 30);
+    CHECK_EQ(stats.ringFill, 0);
+    CHECK_EQ(stats.ringDropped, 0);
+    CHECK(stats.decodeNs > 0);
+    CHECK(stats.dequeue.minNs >= stats.decode.minNs);
+    CHECK(stats.untilNs > stats.sinceNs);
+    PeakTestStopLoopback();
+}
+
+int main(void)
+{
+    RUN(TestSmall);
+    RUN(TestPrecision);
+    RUN(TestClamp);
+    RUN(TestInterval);
+    RUN(TestFormat);
+    RUN(TestReceivePath);
+    return PeakTestResult(__FILE__);
+}
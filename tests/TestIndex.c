@@ -0,0 +1,253 @@
+/*
+    File:           TestIndex.c
+
+    Description:    Unit tests of the capture index: rebuilding, saved and stale indexes, time and
+                    identifier queries, and the index collected while capturing.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "PeakTest.h"
+#include "PeakIndex.h"
+
+// Record i is at 1 s + i us. Every 5000th one is the extended RARE_ID, the others go round 50 standard
+// identifiers from 0x100.
+#define RARE_ID     0x18ff50e5
+#define TS(i)       (1000000000ULL + (UInt64)(i) * 1000)
+
+static PeakCaptureRecord gRecords[PEAK_INDEX_BLOCK_RECORDS];
+
+static void IndexPath(char* index, UInt32 size, const char* path)
+{
+    snprintf(index, size, "%s%s", path, PEAK_INDEX_SUFFIX);
+}
+
+static void Record(PeakCaptureRecord* record, UInt64 i)
+{
+    bzero(record, sizeof(PeakCaptureRecord));
+    record->ts = TS(i);
+    record->canid = i % 5000 == 0 ? RARE_ID : 0x100 + (UInt32)(i % 50);
+    record->flags = i % 5000 == 0 ? PEAK_CAPTURE_EXT : 0;
+    record->dlc = 8;
+    memcpy(record->data, &i, 8);
+}
+
+// records from..to-1, a new file with its header if from is 0
+static void WriteCapture(const char* path, UInt64 from, UInt64 to)
+{
+    PeakCaptureHeader header;
+    UInt64 i;
+    UInt32 n;
+    int fd = open(path, O_WRONLY | O_CREAT | (from ? O_APPEND : O_TRUNC), 0644);
+    
+    CHECK(fd >= 0);
+    if (fd < 0)
+        return;
+    if (from == 0)
+    {
+        bzero(&header, sizeof(header));
+        header.magic = PEAK_CAPTURE_MAGIC;
+        header.version = PEAK_CAPTURE_VERSION;
+        header.headerSize = sizeof(PeakCaptureHeader);
+        header.recordSize = sizeof(PeakCaptureRecord);
+        CHECK_EQ(write(fd, &header, sizeof(header)), sizeof(header));
+    }
+    for (i = from; i < to; i += n)
+    {
+        for (n = 0; n < PEAK_INDEX_BLOCK_RECORDS && i + n < to; n++)
+            Record(&gRecords[n], i + n);
+        CHECK_EQ(write(fd, gRecords, n * sizeof(PeakCaptureRecord)), n * sizeof(PeakCaptureRecord));
+    }
+    close(fd);
+}
+
+typedef struct {
+    UInt64  count;
+    UInt64  last;       // record number of the last visit
+    UInt64  stopAfter;  // 0 for never
+    int     ordered;
+} Visits;
+
+static int Visit(void* refCon, const PeakCaptureRecord* record, UInt64 recordNo)
+{
+    Visits* visits = refCon;
+    UInt64 i;
+    
+    memcpy(&i, record->data, 8);
+    if (i != recordNo || (visits->count && recordNo <= visits->last))
+        visits->ordered = 0;
+    visits->last = recordNo;
+    visits->count++;
+    return visits->stopAfter && visits->count == visits->stopAfter;
+}
+
+static UInt64 Query(const PeakIndexReader* reader, UInt64 fromNs, UInt64 toNs, const UInt32* keys, UInt32 keyCount)
+{
+    Visits visits = { 0, 0, 0, 1 };
+    UInt64 n = PeakIndexQuery(reader, fromNs, toNs, keys, keyCount, Visit, &visits);
+    
+    CHECK_EQ(n, visits.count);
+    CHECK(visits.ordered);
+    return n;
+}
+
+static void TestRebuild(void)
+{
+    PeakIndexReader reader;
+    char path[256], index[300];
+    UInt32 keys[3];
+    
+    PeakTestTempPath(path, sizeof(path), "rebuild.pcap");
+    IndexPath(index, sizeof(index), path);
+    WriteCapture(path, 0, 10000);
+    
+    // no index yet, it is built and saved for the next time
+    CHECK_EQ(PeakIndexOpen(&reader, path), kIOReturnSuccess);
+    CHECK_EQ(reader.recordCount, 10000);
+    CHECK(!reader.indexMapped);
+    CHECK_EQ(reader.indexHeader->blockCount, (10000 + PEAK_INDEX_BLOCK_RECORDS - 1) / PEAK_INDEX_BLOCK_RECORDS);
+    CHECK_EQ(reader.indexHeader->idCount, 51);
+    CHECK_EQ(access(index, R_OK), 0);
+    
+    CHECK_EQ(PeakIndexSeekTime(&reader, 0), 0);
+    CHECK_EQ(PeakIndexSeekTime(&reader, TS(1234)), 1234);
+    CHECK_EQ(PeakIndexSeekTime(&reader, TS(1234) - 1), 1234);
+    CHECK_EQ(PeakIndexSeekTime(&reader, TS(9999) + 1), 10000);
+    
+    // a time range, an identifier, both, and the extended flag as part of the key
+    CHECK_EQ(Query(&reader, TS(100), TS(199), NULL, 0), 100);
+    keys[0] = PEAK_INDEX_KEY(RARE_ID, 1);
+    CHECK_EQ(Query(&reader, 0, ~0ULL, keys, 1), 2);
+    keys[0] = PEAK_INDEX_KEY(RARE_ID, 0);
+    CHECK_EQ(Query(&reader, 0, ~0ULL, keys, 1), 0);
+    keys[0] = PEAK_INDEX_KEY(0x100, 0);
+    CHECK_EQ(Query(&reader, 0, ~0ULL, keys, 1), 198);
+    CHECK_EQ(Query(&reader, TS(2000), TS(2999), keys, 1), 20);
+    keys[1] = PEAK_INDEX_KEY(0x101, 0);
+    keys[2] = PEAK_INDEX_KEY(RARE_ID, 1);
+    CHECK_EQ(Query(&reader, TS(4000), TS(5999), keys, 3), 40 + 40 - 1 + 1);
+    CHECK_EQ(Query(&reader, TS(200), TS(100), NULL, 0), 0);
+    PeakIndexClose(&reader);
+    
+    // the saved one is mapped and answers the same
+    CHECK_EQ(PeakIndexOpen(&reader, path), kIOReturnSuccess);
+    CHECK(reader.indexMapped);
+    keys[0] = PEAK_INDEX_KEY(0x100, 0);
+    CHECK_EQ(Query(&reader, 0, ~0ULL, keys, 1), 198);
+    PeakIndexClose(&reader);
+    PeakTestRemove(path);
+}
+
+static void TestStop(void)
+{
+    PeakIndexReader reader;
+    Visits visits = { 0, 0, 3, 1 };
+    UInt32 key = PEAK_INDEX_KEY(0x105, 0);
+    char path[256];
+    
+    PeakTestTempPath(path, sizeof(path), "stop.pcap");
+    WriteCapture(path, 0, 3000);
+    CHECK_EQ(PeakIndexOpen(&reader, path), kIOReturnSuccess);
+    
+    // the visitor ends the query
+    CHECK_EQ(PeakIndexQuery(&reader, 0, ~0ULL, &key, 1, Visit, &visits), 3);
+    CHECK_EQ(visits.last, 105);
+    CHECK_EQ(PeakIndexQuery(&reader, 0, ~0ULL, &key, 1, NULL, NULL), 60);
+    PeakIndexClose(&reader);
+    PeakTestRemove(path);
+}
+
+static void TestStale(void)
+{
+    PeakIndexReader reader;
+    UInt32 key = PEAK_INDEX_KEY(RARE_ID, 1);
+    char path[256];
+    
+    PeakTestTempPath(path, sizeof(path), "stale.pcap");
+    WriteCapture(path, 0, 4000);
+    CHECK_EQ(PeakIndexRebuild(path), kIOReturnSuccess);
+    
+    // the capture grew after its index was written, e.g. after a crash
+    WriteCapture(path, 4000, 6000);
+    CHECK_EQ(PeakIndexOpen(&reader, path), kIOReturnSuccess);
+    CHECK(!reader.indexMapped);
+    CHECK_EQ(reader.indexHeader->recordCount, 6000);
+    CHECK_EQ(Query(&reader, 0, ~0ULL, &key, 1), 2);
+    PeakIndexClose(&reader);
+    PeakTestRemove(path);
+}
+
+static void TestWhileCapturing(void)
+{
+    static PeakCapture capture;
+    PeakIndexReader reader;
+    UInt32 key = PEAK_INDEX_KEY(0x7ff, 0);
+    char path[256];
+    CanMsg msg;
+    UInt32 i;
+    
+    // the writer thread collects the index, the reader maps it as it is
+    PeakTestTempPath(path, sizeof(path), "capture.pcap");
+    PeakCaptureCreate(&capture);
+    PeakCaptureAddChannel(&capture, 0);
+    CHECK_EQ(PeakCaptureOpen(&capture, path, 0, 0, 0), kIOReturnSuccess);
+    bzero(&msg, sizeof(CanMsg));
+    for (i = 0; i < 5000; i++)
+    {
+        msg.canid.ul = i % 100 == 0 ? 0x7ff : 0x100;
+        msg.ts = msg.mono = TS(i);
+        PeakCaptureAppend(&capture, &msg);
+    }
+    PeakCaptureClose(&capture);
+    
+    CHECK_EQ(PeakIndexOpen(&reader, path), kIOReturnSuccess);
+    CHECK(reader.indexMapped);
+    CHECK_EQ(reader.recordCount, 5000);
+    CHECK_EQ(PeakIndexQuery(&reader, 0, ~0ULL, &key, 1, NULL, NULL), 50);
+    CHECK_EQ(PeakIndexSeekTime(&reader, TS(4321)), 4321);
+    PeakIndexClose(&reader);
+    PeakTestRemove(path);
+}
+
+static void TestNotCapture(void)
+{
+    PeakIndexReader reader;
+    char path[256];
+    int fd;
+    
+    PeakTestTempPath(path, sizeof(path), "garbage.pcap");
+    CHECK_EQ(PeakIndexOpen(&reader, path), kIOReturnNotOpen);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK_EQ(write(fd, gRecords, sizeof(gRecords)), sizeof(gRecords));
+    close(fd);
+    CHECK_EQ(PeakIndexOpen(&reader, path), kIOReturnBadArgument);
+    PeakTestRemove(path);
+}
+
+int main(void)
+{
+    RUN(TestRebuild);
+    RUN(TestStop);
+    RUN(TestStale);
+    RUN(TestWhileCapturing);
+    RUN(TestNotCapture);
+    return PeakTestResult(__FILE__);
+}
@@ -0,0 +1,283 @@
+/*
+    File:           TestLive.c
+
+    Description:    Tests of the shared-memory ring of live frames: creating and opening a segment,
+                    reading in place, lapped readers, waiting, and the driver sharing the frames of a
+                    loopback adapter.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "PeakTest.h"
+#include "PeakLive.h"
+#include "PeakBatch.h"
+
+static void SegmentName(char* name, size_t size, const char* suffix)
+{
+    snprintf(name, size, "/TestLive-%d%s", (int)getpid(), suffix);
+}
+
+static void Publish(PeakLive* live, UInt32 first, UInt32 count)
+{
+    CanMsg msg;
+    UInt32 i;
+    
+    bzero(&msg, sizeof(msg));
+    msg.len = 8;
+    for (i = first; i < first + count; i++)
+    {
+        msg.canid.ul = 0x100 + i;
+        msg.ldata = i;
+        PeakLivePublish(live, &msg);
+    }
+    PeakLiveWake(live);
+}
+
+static void TestCreateOpen(void)
+{
+    char name[PEAK_LIVE_NAME_MAX];
+    PeakLiveReader reader;
+    PeakLive live;
+    
+    SegmentName(name, sizeof(name), "");
+    CHECK_EQ(PeakLiveCreate(&live, name, 3, 0), kIOReturnBadArgument);
+    CHECK_EQ(PeakLiveCreate(&live, name, 3, 12), kIOReturnBadArgument);
+    CHECK_EQ(PeakLiveCreate(&live, "/TestLive-a-name-longer-than-the-limit", 3, 16), kIOReturnBadArgument);
+    CHECK_EQ(PeakLiveOpen(&reader, name), kIOReturnNoDevice);
+    
+    CHECK_EQ(PeakLiveCreate(&live, name, 3, 16), kIOReturnSuccess);
+    CHECK_EQ(live.control->magic, PEAK_LIVE_MAGIC);
+    CHECK_EQ(live.control->capacity, 16);
+    CHECK_EQ(live.control->channel, 3);
+    CHECK_EQ(live.control->slotsOffset % sysconf(_SC_PAGESIZE), 0);
+    
+    CHECK_EQ(PeakLiveOpen(&reader, name), kIOReturnSuccess);
+    CHECK_EQ(reader.mask, 15);
+    CHECK_EQ(reader.cursor, 0);
+    PeakLiveClose(&reader);
+    
+    // a reader starts with the frames published after it opened
+    Publish(&live, 0, 5);
+    CHECK_EQ(PeakLiveOpen(&reader, name), kIOReturnSuccess);
+    CHECK_EQ(reader.cursor, 5);
+    PeakLiveClose(&reader);
+    
+    PeakLiveDestroy(&live);
+    CHECK_EQ(PeakLiveOpen(&reader, name), kIOReturnNoDevice);
+}
+
+static void TestRead(void)
+{
+    char name[PEAK_LIVE_NAME_MAX];
+    PeakLiveReader reader;
+    const CanMsg* msgs;
+    PeakLive live;
+    UInt32 i, n;
+    
+    SegmentName(name, sizeof(name), "");
+    CHECK_EQ(PeakLiveCreate(&live, name, 0, 16), kIOReturnSuccess);
+    CHECK_EQ(PeakLiveOpen(&reader, name), kIOReturnSuccess);
+    CHECK_EQ(PeakLiveRead(&reader, &msgs, 16), 0);
+    CHECK_EQ(PeakLiveRelease(&reader), 0);
+    
+    Publish(&live, 0, 5);
+    n = PeakLiveRead(&reader, &msgs, 16);
+    CHECK_EQ(n, 5);
+    for (i = 0; i < n; i++)
+    {
+        CHECK_EQ(msgs[i].canid.ul, 0x100 + i);
+        CHECK_EQ(msgs[i].ldata, i);
+    }
+    CHECK_EQ(PeakLiveRelease(&reader), 0);
+    CHECK_EQ(reader.frames, 5);
+    
+    // no more than max, and a read never wraps: the rest comes with the next one
+    Publish(&live, 5, 14);
+    CHECK_EQ(PeakLiveRead(&reader, &msgs, 4), 4);
+    CHECK_EQ(msgs[0].ldata, 5);
+    PeakLiveRelease(&reader);
+    CHECK_EQ(PeakLiveRead(&reader, &msgs, 16), 7);
+    CHECK_EQ(msgs[6].ldata, 15);
+    PeakLiveRelease(&reader);
+    CHECK_EQ(PeakLiveRead(&reader, &msgs, 16), 3);
+    CHECK_EQ(msgs[0].ldata, 16);
+    CHECK_EQ(msgs[2].ldata, 18);
+    PeakLiveRelease(&reader);
+    CHECK_EQ(reader.frames, 19);
+    CHECK_EQ(reader.missed, 0);
+    
+    PeakLiveClose(&reader);
+    PeakLiveDestroy(&live);
+}
+
+static void TestLapped(void)
+{
+    char name[PEAK_LIVE_NAME_MAX];
+    PeakLiveReader reader;
+    const CanMsg* msgs;
+    PeakLive live;
+    UInt32 n;
+    
+    SegmentName(name, sizeof(name), "");
+    CHECK_EQ(PeakLiveCreate(&live, name, 0, 16), kIOReturnSuccess);
+    CHECK_EQ(PeakLiveOpen(&reader, name), kIOReturnSuccess);
+    
+    // 40 frames into 16 slots: the reader skips to the oldest 15 that are certainly intact
+    Publish(&live, 0, 40);
+    n = PeakLiveRead(&reader, &msgs, 64);
+    CHECK_EQ(reader.missed, 25);
+    CHECK_EQ(msgs[0].ldata, 25);
+    PeakLiveRelease(&reader);
+    n += PeakLiveRead(&reader, &msgs, 64);
+    PeakLiveRelease(&reader);
+    CHECK_EQ(n, 15);
+    CHECK_EQ(reader.frames, 15);
+    
+    // overwritten while the reader looked at them: the first 6 of the 8 up to the end of the slots
+    Publish(&live, 40, 10);
+    CHECK_EQ(PeakLiveRead(&reader, &msgs, 10), 8);
+    Publish(&live, 50, 11);
+    CHECK_EQ(PeakLiveRelease(&reader), 6);
+    CHECK_EQ(reader.missed, 31);
+    CHECK_EQ(reader.frames, 17);
+    
+    PeakLiveClose(&reader);
+    PeakLiveDestroy(&live);
+}
+
+static void* PublishLater(void* refCon)
+{
+    struct timespec pause = { 0, 20000000 };
+    
+    nanosleep(&pause, NULL);
+    Publish(refCon, 0, 1);
+    return NULL;
+}
+
+static void TestWait(void)
+{
+    char name[PEAK_LIVE_NAME_MAX];
+    PeakLiveReader reader;
+    const CanMsg* msgs;
+    pthread_t thread;
+    PeakLive live;
+    UInt64 startNs;
+    
+    SegmentName(name, sizeof(name), "");
+    CHECK_EQ(PeakLiveCreate(&live, name, 0, 16), kIOReturnSuccess);
+    CHECK_EQ(PeakLiveOpen(&reader, name), kIOReturnSuccess);
+    
+    startNs = PeakMonotonicNs();
+    CHECK_EQ(PeakLiveWait(&reader, 10000000), kIOReturnTimeout);
+    CHECK(PeakMonotonicNs() - startNs >= 10000000);
+    
+    // woken by the producer well before the timeout
+    pthread_create(&thread, NULL, PublishLater, &live);
+    startNs = PeakMonotonicNs();
+    CHECK_EQ(PeakLiveWait(&reader, 5000000000ULL), kIOReturnSuccess);
+    CHECK(PeakMonotonicNs() - startNs < 2000000000ULL);
+    pthread_join(thread, NULL);
+    CHECK_EQ(PeakLiveRead(&reader, &msgs, 16), 1);
+    PeakLiveRelease(&reader);
+    
+    // the frames still there come first, then the closed segment
+    Publish(&live, 1, 1);
+    PeakLiveDestroy(&live);
+    CHECK_EQ(PeakLiveWait(&reader, 10000000), kIOReturnSuccess);
+    CHECK_EQ(PeakLiveRead(&reader, &msgs, 16), 1);
+    CHECK_EQ(msgs[0].ldata, 1);
+    PeakLiveRelease(&reader);
+    CHECK_EQ(PeakLiveWait(&reader, 10000000), kIOReturnNotOpen);
+    PeakLiveClose(&reader);
+}
+
+static void TestSharing(void)
+{
+    char prefix[PEAK_LIVE_NAME_MAX], name[PEAK_LIVE_NAME_MAX + 16];
+    CanMsg msg, received[100];
+    PeakLiveReader reader;
+    const CanMsg* msgs;
+    UInt32 i, n = 0;
+    UInt64 startNs;
+    
+    SegmentName(prefix, sizeof(prefix), "-share");
+    snprintf(name, sizeof(name), "%s.0", prefix);
+    
+    CHECK_EQ(PeakTestStartLoopback(1), kIOReturnSuccess);
+    CHECK_EQ(PeakStartSharing("no-slash", 1024), kIOReturnBadArgument);
+    CHECK_EQ(PeakStartSharing(prefix, 1000), kIOReturnBadArgument);
+    CHECK_EQ(PeakStopSharing(), kIOReturnNotOpen);
+    CHECK_EQ(PeakLiveOpen(&reader, name), kIOReturnNoDevice);
+    
+    // the adapter is attached already, its segment comes with the start
+    CHECK_EQ(PeakStartSharing(prefix, 1024), kIOReturnSuccess);
+    CHECK_EQ(PeakStartSharing(prefix, 1024), kIOReturnBusy);
+    CHECK_EQ(PeakLiveOpen(&reader, name), kIOReturnSuccess);
+    CHECK_EQ(reader.control->capacity, 1024);
+    
+    // the loopback adapter echoes what is sent, the decoder publishes it
+    bzero(&msg, sizeof(msg));
+    msg.len = 2;
+    for (i = 0; i < 100; i++)
+    {
+        msg.canid.ul = 0x200 + i;
+        msg.data[0] = (UInt8)i;
+        CHECK_EQ(PeakSend(&msg), kIOReturnSuccess);
+    }
+    CHECK_EQ(PeakTestReceive(received, 100, 100, 2000000000ULL), 100);
+    
+    startNs = PeakMonotonicNs();
+    while (n < 100 && PeakLiveWait(&reader, 100000000) == kIOReturnSuccess && PeakMonotonicNs() - startNs < 2000000000ULL)
+    {
+        UInt32 count = PeakLiveRead(&reader, &msgs, 100 - n);
+        
+        for (i = 0; i < count; i++)
+        {
+            CHECK_EQ(msgs[i].canid.ul, 0x200 + n + i);
+            CHECK_EQ(msgs[i].data[0], (UInt8)(n + i));
+            CHECK_EQ(msgs[i].channel, 0);
+        }
+        CHECK_EQ(PeakLiveRelease(&reader), 0);
+        n += count;
+    }
+    CHECK_EQ(n, 100);
+    CHECK_EQ(reader.missed, 0);
+    
+    // the segment is closed and gone, the reader keeps its mapping until it lets go
+    CHECK_EQ(PeakStopSharing(), kIOReturnSuccess);
+    CHECK_EQ(PeakLiveWait(&reader, 10000000), kIOReturnNotOpen);
+    PeakLiveClose(&reader);
+    CHECK_EQ(PeakLiveOpen(&reader, name), kIOReturnNoDevice);
+    CHECK_EQ(PeakStopSharing(), kIOReturnNotOpen);
+    PeakTestStopLoopback();
+}
+
+int main(void)
+{
+    RUN(TestCreateOpen);
+    RUN(TestRead);
+    RUN(TestLapped);
+    RUN(TestWait);
+    RUN(TestSharing);
+    return PeakTestResult(__FILE__);
+}
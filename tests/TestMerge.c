@@ -0,0 +1,237 @@
+/*
+    File:           TestMerge.c
+
+    Description:    Unit tests of the time ordered merge of the adapters' rings: order, the window for
+                    quiet adapters, late frames and detaching, and three loopback adapters merged into
+                    one stream.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "PeakTest.h"
+#include "PeakMerge.h"
+#include "PeakBatch.h"
+#include "PeakTransport.h"
+
+#define WINDOW      1000
+
+static PeakRing gRings[4];
+static CanMsg gBatch[1024];
+
+static void Setup(PeakMerge* merge, UInt32 count)
+{
+    UInt32 i;
+    
+    PeakMergeInit(merge, WINDOW);
+    for (i = 0; i < count; i++)
+    {
+        PeakRingDestroy(&gRings[i]);
+        CHECK_EQ(PeakRingCreate(&gRings[i], 256), kIOReturnSuccess);
+        PeakMergeAttach(merge, i, &gRings[i]);
+    }
+}
+
+static void Commit(UInt32 channel, UInt64 mono)
+{
+    CanMsg* msg = PeakRingReserve(&gRings[channel]);
+    
+    CHECK(msg != NULL);
+    if (msg == NULL)
+        return;
+    bzero(msg, sizeof(CanMsg));
+    msg->channel = (UInt8)channel;
+    msg->mono = mono;
+    PeakRingCommit(&gRings[channel]);
+}
+
+static void TestOrder(void)
+{
+    PeakMerge merge;
+    PeakMergeStats stats;
+    UInt32 i, n;
+    
+    // three adapters with interleaved times, each in its own order
+    Setup(&merge, 3);
+    for (i = 0; i < 30; i++)
+        Commit(i % 3, 100 + i * 10);
+    Commit(0, 1000);
+    Commit(1, 1000);
+    Commit(2, 1000);
+    
+    // everything up to the oldest of the newest frames goes out, in time order, tagged with the channel
+    n = PeakMergeDrain(&merge, gBatch, 1024, 0);
+    CHECK_EQ(n, 33);
+    for (i = 0; i < 30; i++)
+    {
+        CHECK_EQ(gBatch[i].mono, 100 + i * 10);
+        CHECK_EQ(gBatch[i].channel, i % 3);
+    }
+    CHECK_EQ(PeakMergeFill(&merge), 0);
+    PeakMergeGetStats(&merge, &stats);
+    CHECK_EQ(stats.frames, 33);
+    CHECK_EQ(stats.late, 0);
+    CHECK_EQ(stats.windowed, 0);
+}
+
+static void TestMax(void)
+{
+    PeakMerge merge;
+    UInt32 i;
+    
+    Setup(&merge, 2);
+    for (i = 0; i < 10; i++)
+        Commit(i & 1, 100 + i);
+    CHECK_EQ(PeakMergeDrain(&merge, gBatch, 4, 0), 4);
+    CHECK_EQ(gBatch[3].mono, 103);
+    CHECK_EQ(PeakMergeFill(&merge), 6);
+    
+    // the newest frame of the second ring waits for the first one to catch up
+    CHECK_EQ(PeakMergeDrain(&merge, gBatch, 1024, 0), 5);
+    CHECK_EQ(gBatch[0].mono, 104);
+    CHECK_EQ(gBatch[4].mono, 108);
+}
+
+static void TestQuietAdapter(void)
+{
+    PeakMerge merge;
+    PeakMergeStats stats;
+    
+    // the second adapter has not sent anything, so the first one's frames wait for the window
+    Setup(&merge, 2);
+    Commit(0, 5000);
+    Commit(0, 5500);
+    CHECK_EQ(PeakMergeDrain(&merge, gBatch, 1024, 5500), 0);
+    CHECK_EQ(PeakMergeDrain(&merge, gBatch, 1024, 6000), 1);
+    CHECK_EQ(gBatch[0].mono, 5000);
+    CHECK_EQ(PeakMergeDrain(&merge, gBatch, 1024, 6500), 1);
+    PeakMergeGetStats(&merge, &stats);
+    CHECK_EQ(stats.windowed, 2);
+    
+    // a frame of the second one within the window still goes out in order
+    Commit(0, 7000);
+    Commit(1, 6900);
+    CHECK_EQ(PeakMergeDrain(&merge, gBatch, 1024, 7000), 1);
+    CHECK_EQ(gBatch[0].mono, 6900);
+    CHECK_EQ(PeakMergeDrain(&merge, gBatch, 1024, 8000), 1);
+    CHECK_EQ(gBatch[0].mono, 7000);
+}
+
+static void TestLate(void)
+{
+    PeakMerge merge;
+    PeakMergeStats stats;
+    
+    // a frame that arrives after the window let younger ones through is passed on and counted
+    Setup(&merge, 2);
+    Commit(0, 5000);
+    CHECK_EQ(PeakMergeDrain(&merge, gBatch, 1024, 6000), 1);
+    Commit(1, 4700);
+    Commit(0, 6000);
+    CHECK_EQ(PeakMergeDrain(&merge, gBatch, 1024, 6000), 1);
+    CHECK_EQ(gBatch[0].mono, 4700);
+    PeakMergeGetStats(&merge, &stats);
+    CHECK_EQ(stats.late, 1);
+    CHECK_EQ(stats.maxLateNs, 300);
+}
+
+static void TestDetach(void)
+{
+    PeakMerge merge;
+    
+    // a detached adapter holds nobody back, what it left is drained
+    Setup(&merge, 2);
+    Commit(0, 5000);
+    Commit(1, 4000);
+    PeakMergeDetach(&merge, 1);
+    CHECK_EQ(PeakMergeDrain(&merge, gBatch, 1024, 5000), 2);
+    CHECK_EQ(gBatch[0].mono, 4000);
+    CHECK_EQ(gBatch[1].mono, 5000);
+    
+    // and attaching it again makes it count again
+    PeakMergeAttach(&merge, 1, &gRings[1]);
+    Commit(0, 6000);
+    CHECK_EQ(PeakMergeDrain(&merge, gBatch, 1024, 6000), 0);
+}
+
+// three loopback adapters, each decoded on its own thread, come out as one stream in time order
+static void TestAdapters(void)
+{
+    static CanMsg received[4096];
+    PeakTestTelegram telegram;
+    CanMsg msg;
+    UInt32 a, t, n, seen[3] = { 0, 0, 0 }, channel[3] = { ~0U, ~0U, ~0U };
+    int ordered = 1;
+    
+    if (PeakTestStartLoopback(3) != kIOReturnSuccess)
+    {
+        CHECK(0);
+        return;
+    }
+    CHECK_EQ(PeakChannelCount(), 3);
+    
+    bzero(&msg, sizeof(CanMsg));
+    msg.len = 8;
+    for (t = 0; t < 20; t++)
+    {
+        for (a = 0; a < 3; a++)
+        {
+            msg.canid.ul = 0x100 * (a + 1) + t;
+            PeakTestTelegramBegin(&telegram, 0);
+            PeakTestTelegramFrame(&telegram, &msg, 0);
+            PeakTestTelegramFrame(&telegram, &msg, 0);
+            CHECK_EQ(PeakLoopbackInject(a, telegram.data, telegram.length), kIOReturnSuccess);
+        }
+    }
+    
+    n = PeakTestReceive(received, 4096, 120, 2000000000ULL);
+    CHECK_EQ(n, 120);
+    
+    // the channels go by the order the adapters attached in, each adapter keeps its own
+    for (t = 0; t < n; t++)
+    {
+        a = (received[t].canid.ul >> 8) - 1;
+        if (a >= 3 || received[t].channel >= 3)
+        {
+            CHECK(0);
+            continue;
+        }
+        if (channel[a] == ~0U)
+            channel[a] = received[t].channel;
+        CHECK_EQ(received[t].channel, channel[a]);
+        seen[received[t].channel]++;
+        if (t > 0 && received[t].mono < received[t - 1].mono)
+            ordered = 0;
+    }
+    CHECK(ordered);
+    CHECK_EQ(seen[0], 40);
+    CHECK_EQ(seen[1], 40);
+    CHECK_EQ(seen[2], 40);
+    PeakTestStopLoopback();
+}
+
+int main(void)
+{
+    RUN(TestOrder);
+    RUN(TestMax);
+    RUN(TestQuietAdapter);
+    RUN(TestLate);
+    RUN(TestDetach);
+    RUN(TestAdapters);
+    return PeakTestResult(__FILE__);
+}
@@ -0,0 +1,319 @@
+/*
+    File:           TestParse.c
+
+    Description:    The frame list parser: the README format, decimal numbers, the diagnostics, batches,
+                    files and sending through the loopback adapter.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "PeakTest.h"
+#include "PeakParse.h"
+
+#define FRAMES_MAX      2048
+#define ERRORS_MAX      16
+
+typedef struct {
+    UInt32  line;
+    UInt32  column;
+    char    message[PEAK_PARSE_MESSAGE_MAX];
+} ParseError;
+
+static CanMsg gFrames[FRAMES_MAX];
+static UInt32 gFrameCount = 0;
+static UInt32 gBatches[16];
+static UInt32 gBatchCount = 0;
+static UInt32 gFailAt = 0;          // the batch to refuse, counting from 1, 0 for none
+static ParseError gErrors[ERRORS_MAX];
+static UInt32 gErrorCount = 0;
+
+static IOReturn Collect(void* refCon, CanMsg* msgs, UInt32 count)
+{
+    (void)refCon;
+    if (gBatchCount < 16)
+        gBatches[gBatchCount] = count;
+    if (++gBatchCount == gFailAt)
+        return kIOReturnAborted;
+    if (gFrameCount + count <= FRAMES_MAX)
+        memcpy(&gFrames[gFrameCount], msgs, count * sizeof(CanMsg));
+    gFrameCount += count;
+    return kIOReturnSuccess;
+}
+
+static void CollectError(void* refCon, UInt32 line, UInt32 column, const char* message)
+{
+    (void)refCon;
+    if (gErrorCount < ERRORS_MAX)
+    {
+        gErrors[gErrorCount].line = line;
+        gErrors[gErrorCount].column = column;
+        snprintf(gErrors[gErrorCount].message, PEAK_PARSE_MESSAGE_MAX, "%s", message);
+    }
+    gErrorCount++;
+}
+
+static IOReturn Parse(const char* text, UInt32 flags, PeakParseStats* stats)
+{
+    PeakParseConfig config;
+    
+    gFrameCount = gBatchCount = gErrorCount = 0;
+    PeakParseConfigInit(&config);
+    config.flags = flags;
+    config.frames = Collect;
+    config.error = CollectError;
+    return PeakParseText(text, strlen(text), &config, stats);
+}
+
+static int IsFrame(const CanMsg* msg, UInt32 canid, UInt8 ext, UInt8 rtr, UInt8 len, UInt64 ldata)
+{
+    if (msg->canid.ul == canid && msg->ext == ext && msg->rtr == rtr && msg->len == len && msg->ldata == ldata && msg->loc)
+        return 1;
+    fprintf(stderr, "0x%X ext %u rtr %u len %u 0x%llx\n", msg->canid.ul, msg->ext, msg->rtr, msg->len, (unsigned long long)msg->ldata);
+    return 0;
+}
+
+static int IsError(UInt32 i, UInt32 line, UInt32 column, const char* message)
+{
+    if (i < gErrorCount && gErrors[i].line == line && gErrors[i].column == column && strcmp(gErrors[i].message, message) == 0)
+        return 1;
+    if (i < gErrorCount)
+        fprintf(stderr, "%u:%u: %s\n", gErrors[i].line, gErrors[i].column, gErrors[i].message);
+    return 0;
+}
+
+// the example of PeakParse.h
+static void TestFormat(void)
+{
+    PeakParseStats stats;
+    
+    CHECK_EQ(Parse("0x80000005 0xc0 0xff 0xee;  0x13 ba be\n0x40000006 0 0              # RTR, two bytes expected\n", 0, &stats), kIOReturnSuccess);
+    CHECK_EQ(stats.lines, 2);
+    CHECK_EQ(stats.frames, 3);
+    CHECK_EQ(stats.errors, 0);
+    CHECK_EQ(gFrameCount, 3);
+    CHECK(IsFrame(&gFrames[0], 5, 1, 0, 3, 0xeeffc0));
+    CHECK(IsFrame(&gFrames[1], 0x13, 0, 0, 2, 0xbeba));
+    CHECK(IsFrame(&gFrames[2], 6, 0, 1, 2, 0));
+    
+    // line breaks of all kinds, blank lines and comments alone, a zero length frame
+    CHECK_EQ(Parse("1 2\r\n\r\n# nothing\r3\n\n7ff\t0X0A  0Xb", 0, &stats), kIOReturnSuccess);
+    CHECK_EQ(stats.lines, 6);
+    CHECK_EQ(gFrameCount, 3);
+    CHECK(IsFrame(&gFrames[0], 1, 0, 0, 1, 2));
+    CHECK(IsFrame(&gFrames[1], 3, 0, 0, 0, 0));
+    CHECK(IsFrame(&gFrames[2], 0x7ff, 0, 0, 2, 0x0b0a));
+    
+    CHECK_EQ(Parse("", 0, &stats), kIOReturnSuccess);
+    CHECK_EQ(stats.frames, 0);
+    CHECK_EQ(gBatchCount, 0);
+}
+
+static void TestDecimal(void)
+{
+    PeakParseStats stats;
+    
+    CHECK_EQ(Parse("256 1 2 0x10\n2147483653 255\n", PEAK_PARSE_DECIMAL, &stats), kIOReturnSuccess);
+    CHECK_EQ(gFrameCount, 2);
+    CHECK(IsFrame(&gFrames[0], 256, 0, 0, 3, 0x100201));
+    CHECK(IsFrame(&gFrames[1], 5, 1, 0, 1, 0xff));
+    
+    CHECK_EQ(Parse("10 ff\n", PEAK_PARSE_DECIMAL, &stats), kIOReturnSuccess);
+    CHECK_EQ(gFrameCount, 0);
+    CHECK(IsError(0, 1, 4, "ff is not a decimal number"));
+}
+
+static void TestErrors(void)
+{
+    PeakParseConfig config;
+    PeakParseStats stats;
+    
+    CHECK_EQ(Parse("100 1 2\n"
+                   "100 zz 1\n"
+                   "800 1\n"
+                   "100 1 2 3 4 5 6 7 8 9\n"
+                   "100 100\n"
+                   "1ffffffff\n"
+                   "a0000000; 9fffffff 1\n"
+                   "0x 1\n"
+                   "12g\n", 0, &stats), kIOReturnSuccess);
+    CHECK_EQ(stats.lines, 9);
+    CHECK_EQ(stats.frames, 2);
+    CHECK_EQ(stats.errors, 8);
+    CHECK_EQ(gErrorCount, 8);
+    CHECK(IsFrame(&gFrames[0], 0x100, 0, 0, 2, 0x0201));
+    CHECK(IsFrame(&gFrames[1], 0x1fffffff, 1, 0, 1, 1));
+    CHECK(IsError(0, 2, 5, "zz is not a hex number"));
+    CHECK(IsError(1, 3, 1, "identifier 0x800 has more than 11 bits, 29 bit ones need 0x80000000"));
+    CHECK(IsError(2, 4, 21, "more than 8 data bytes"));
+    CHECK(IsError(3, 5, 5, "data byte 0x100 is larger than 0xFF"));
+    CHECK(IsError(4, 6, 1, "1ffffffff does not fit into 32 bits"));
+    CHECK(IsError(5, 7, 1, "identifier 0x20000000 has more than 29 bits"));
+    CHECK(IsError(6, 8, 1, "0x is not a hex number"));
+    CHECK(IsError(7, 9, 1, "12g is not a hex number"));
+    
+    // only counted without an error function
+    PeakParseConfigInit(&config);
+    config.frames = Collect;
+    gFrameCount = gBatchCount = gErrorCount = 0;
+    CHECK_EQ(PeakParseText("zz\n1\n", 5, &config, &stats), kIOReturnSuccess);
+    CHECK_EQ(stats.errors, 1);
+    CHECK_EQ(stats.frames, 1);
+    CHECK_EQ(gErrorCount, 0);
+    
+    config.channel = PEAK_MAX_CHANNELS;
+    CHECK_EQ(PeakParseText("1\n", 2, &config, &stats), kIOReturnBadArgument);
+}
+
+static void TestBatches(void)
+{
+    static char text[1000 * 16];
+    PeakParseStats stats;
+    UInt32 i, length = 0;
+    
+    for (i = 0; i < 1000; i++)
+        length += snprintf(text + length, sizeof(text) - length, "%x %x %x\n", i & 0x7ff, i & 0xff, (i >> 8) & 0xff);
+    
+    CHECK_EQ(Parse(text, 0, &stats), kIOReturnSuccess);
+    CHECK_EQ(stats.lines, 1000);
+    CHECK_EQ(stats.frames, 1000);
+    CHECK_EQ(gBatchCount, 4);
+    CHECK_EQ(gBatches[0], PEAK_PARSE_BATCH);
+    CHECK_EQ(gBatches[3], 1000 - 3 * PEAK_PARSE_BATCH);
+    for (i = 0; i < 1000; i++)
+        CHECK_EQ(gFrames[i].ldata, (i & 0xff) | ((i >> 8) & 0xff) << 8);
+    
+    // a refused batch stops the parser
+    gFailAt = 2;
+    CHECK_EQ(Parse(text, 0, &stats), kIOReturnAborted);
+    CHECK_EQ(gBatchCount, 2);
+    CHECK_EQ(stats.frames, PEAK_PARSE_BATCH);
+    gFailAt = 0;
+}
+
+static void TestLength(void)
+{
+    PeakParseConfig config;
+    PeakParseStats stats;
+    
+    // nothing past the length is read
+    PeakParseConfigInit(&config);
+    config.frames = Collect;
+    config.channel = 2;
+    gFrameCount = gBatchCount = 0;
+    CHECK_EQ(PeakParseText("123 45 67", 6, &config, &stats), kIOReturnSuccess);
+    CHECK_EQ(gFrameCount, 1);
+    CHECK(IsFrame(&gFrames[0], 0x123, 0, 0, 1, 0x45));
+    CHECK_EQ(gFrames[0].channel, 2);
+    CHECK_EQ(stats.lines, 1);
+}
+
+static void TestFile(void)
+{
+    PeakParseConfig config;
+    PeakParseStats stats;
+    char path[256];
+    FILE* file;
+    
+    PeakTestTempPath(path, sizeof(path), "frames.txt");
+    file = fopen(path, "w");
+    CHECK(file != NULL);
+    if (file == NULL)
+        return;
+    fputs("# a test script\n0x100 1 2 3\n0x80000100 4\n0x40000100 0 0 0\n", file);
+    fclose(file);
+    
+    PeakParseConfigInit(&config);
+    config.frames = Collect;
+    gFrameCount = gBatchCount = 0;
+    CHECK_EQ(PeakParseFile(path, &config, &stats), kIOReturnSuccess);
+    CHECK_EQ(stats.lines, 4);
+    CHECK_EQ(gFrameCount, 3);
+    CHECK(IsFrame(&gFrames[1], 0x100, 1, 0, 1, 4));
+    CHECK(IsFrame(&gFrames[2], 0x100, 0, 1, 3, 0));
+    
+    file = fopen(path, "w");
+    if (file)
+        fclose(file);
+    gFrameCount = 0;
+    CHECK_EQ(PeakParseFile(path, &config, &stats), kIOReturnSuccess);
+    CHECK_EQ(stats.frames, 0);
+    unlink(path);
+    
+    CHECK_EQ(PeakParseFile(path, &config, &stats), kIOReturnNotOpen);
+}
+
+// parsed frames through the loopback adapter, which echoes them back
+static void TestSend(void)
+{
+    static char text[500 * 32];
+    static CanMsg received[500];
+    PeakParseConfig config;
+    PeakParseStats stats;
+    CanMsg msgs[4];
+    UInt32 i, length = 0, queued, n;
+    
+    for (i = 0; i < 500; i++)
+        length += snprintf(text + length, sizeof(text) - length, "%x %x %x;", 0x80000000 | (0x100000 + i), i & 0xff, 0x55);
+    
+    CHECK_EQ(PeakTestStartLoopback(1), kIOReturnSuccess);
+    PeakParseConfigInit(&config);
+    config.frames = PeakParseSend;
+    CHECK_EQ(PeakParseText(text, length, &config, &stats), kIOReturnSuccess);
+    CHECK_EQ(stats.frames, 500);
+    
+    n = PeakTestReceive(received, 500, 500, 2000000000ULL);
+    CHECK_EQ(n, 500);
+    for (i = 0; i < n; i++)
+    {
+        CHECK_EQ(received[i].canid.ul, 0x100000 + i);
+        CHECK(received[i].ext && received[i].len == 2);
+        CHECK_EQ(received[i].ldata, 0x5500 | (i & 0xff));
+    }
+    
+    // the adapter of channel 1 does not exist, the frames before it are queued
+    bzero(msgs, sizeof(msgs));
+    for (i = 0; i < 4; i++)
+    {
+        msgs[i].canid.ul = 0x10 + i;
+        msgs[i].len = 1;
+        msgs[i].channel = i < 3 ? 0 : 1;
+    }
+    queued = 99;
+    CHECK_EQ(PeakParseSendQueued(msgs, 4, &queued), kIOReturnNoDevice);
+    CHECK_EQ(queued, 3);
+    CHECK(msgs[3].mono != 0 && msgs[3].ts != 0);
+    CHECK_EQ(PeakTestReceive(received, 500, 3, 2000000000ULL), 3);
+    CHECK_EQ(PeakParseSendQueued(&msgs[3], 1, &queued), kIOReturnNoDevice);
+    CHECK_EQ(queued, 0);
+    PeakTestStopLoopback();
+}
+
+int main(void)
+{
+    RUN(TestFormat);
+    RUN(TestDecimal);
+    RUN(TestErrors);
+    RUN(TestBatches);
+    RUN(TestLength);
+    RUN(TestFile);
+    RUN(TestSend);
+    return PeakTestResult(__FILE__);
+}
@@ -0,0 +1,363 @@
+/*
+    File:           TestReplay.c
+
+    Description:    Unit tests of the capture replay against a stand-in endpoint that timestamps what it
+                    is handed: original and scaled timing, batching, ranges, send errors and stopping.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "PeakTest.h"
+#include "PeakReplay.h"
+#include "PeakBatch.h"
+
+// a stand-in endpoint that timestamps every frame it is handed
+typedef struct {
+    UInt32      count;
+    UInt32      calls;
+    UInt32      largest;        // most frames in one call
+    UInt32      refuse;         // calls to refuse with kr
+    IOReturn    kr;
+    UInt32      ids[4096];
+    UInt64      atNs[4096];
+} Endpoint;
+
+static Endpoint gEndpoint;
+
+static IOReturn Send(void* refCon, const CanMsg* msgs, UInt32 count)
+{
+    Endpoint* endpoint = refCon;
+    UInt64 now = PeakMonotonicNs();
+    UInt32 i;
+    
+    endpoint->calls++;
+    if (endpoint->refuse)
+    {
+        endpoint->refuse--;
+        return endpoint->kr;
+    }
+    if (count > endpoint->largest)
+        endpoint->largest = count;
+    for (i = 0; i < count && endpoint->count < 4096; i++)
+    {
+        endpoint->ids[endpoint->count] = msgs[i].canid.ul;
+        endpoint->atNs[endpoint->count++] = now;
+    }
+    return kIOReturnSuccess;
+}
+
+// count frames stepNs apart from 1 s, frame i with id i; every errEvery-th one an error record
+static void WriteCapture(const char* path, UInt32 count, UInt64 stepNs, UInt32 errEvery)
+{
+    static PeakCaptureRecord records[4096];
+    PeakCaptureHeader header;
+    UInt32 i;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    
+    CHECK(fd >= 0);
+    if (fd < 0)
+        return;
+    bzero(&header, sizeof(header));
+    header.magic = PEAK_CAPTURE_MAGIC;
+    header.version = PEAK_CAPTURE_VERSION;
+    header.headerSize = sizeof(PeakCaptureHeader);
+    header.recordSize = sizeof(PeakCaptureRecord);
+    CHECK_EQ(write(fd, &header, sizeof(header)), sizeof(header));
+    
+    bzero(records, sizeof(records));
+    for (i = 0; i < count; i++)
+    {
+        records[i].ts = 1000000000ULL + i * stepNs;
+        records[i].canid = i;
+        records[i].dlc = 8;
+        records[i].flags = errEvery && i % errEvery == errEvery - 1 ? PEAK_CAPTURE_ERR : 0;
+    }
+    CHECK_EQ(write(fd, records, count * sizeof(PeakCaptureRecord)), count * sizeof(PeakCaptureRecord));
+    close(fd);
+}
+
+static void Config(PeakReplayConfig* config, double speed)
+{
+    PeakReplayConfigInit(config);
+    config->speed = speed;
+    config->send = Send;
+    config->refCon = &gEndpoint;
+    bzero(&gEndpoint, sizeof(Endpoint));
+}
+
+static void TestOpen(void)
+{
+    static PeakReplay replay;
+    PeakReplayConfig config;
+    char path[256];
+    
+    PeakTestTempPath(path, sizeof(path), "open.pcap");
+    WriteCapture(path, 10, 1000, 0);
+    
+    Config(&config, -1);
+    CHECK_EQ(PeakReplayOpen(&replay, path, &config), kIOReturnBadArgument);
+    Config(&config, 1);
+    config.batchFrames = 0;
+    CHECK_EQ(PeakReplayOpen(&replay, path, &config), kIOReturnBadArgument);
+    config.batchFrames = PEAK_REPLAY_MAX_BATCH + 1;
+    CHECK_EQ(PeakReplayOpen(&replay, path, &config), kIOReturnBadArgument);
+    
+    Config(&config, 1);
+    PeakTestTempPath(path, sizeof(path), "missing.pcap");
+    CHECK_EQ(PeakReplayOpen(&replay, path, &config), kIOReturnNotOpen);
+    
+    CHECK_EQ(PeakReplayBucketLimit(0), 1000);
+    CHECK_EQ(PeakReplayBucketLimit(10), 1024000);
+    PeakTestTempPath(path, sizeof(path), "open.pcap");
+    PeakTestRemove(path);
+}
+
+static void TestAsFastAsPossible(void)
+{
+    static PeakReplay replay;
+    PeakReplayConfig config;
+    PeakReplayStats stats;
+    char path[256];
+    UInt32 i, j, late = 0;
+    
+    PeakTestTempPath(path, sizeof(path), "fast.pcap");
+    WriteCapture(path, 1000, 1000000, 100);
+    Config(&config, 0);
+    config.batchFrames = 64;
+    CHECK_EQ(PeakReplayOpen(&replay, path, &config), kIOReturnSuccess);
+    CHECK_EQ(PeakReplayRun(&replay), kIOReturnSuccess);
+    CHECK(!PeakReplayIsRunning(&replay));
+    PeakReplayGetStats(&replay, &stats);
+    
+    // a second of traffic in no time, in order, without the error records, batches as large as allowed
+    CHECK_EQ(stats.frames, 990);
+    CHECK_EQ(stats.skipped, 10);
+    CHECK_EQ(stats.errors, 0);
+    CHECK(stats.elapsedNs < 500000000ULL);
+    CHECK_EQ(gEndpoint.count, 990);
+    CHECK_EQ(gEndpoint.largest, 64);
+    CHECK_EQ(stats.batches, gEndpoint.calls);
+    for (i = 0, j = 0; i < 1000; i++)
+    {
+        if (i % 100 != 99)
+            CHECK_EQ(gEndpoint.ids[j++], i);
+    }
+    
+    // no schedule, no jitter
+    for (i = 0; i < PEAK_REPLAY_BUCKETS; i++)
+        late += stats.late[i];
+    CHECK_EQ(late, 0);
+    CHECK_EQ(stats.early, 0);
+    PeakReplayClose(&replay);
+    PeakTestRemove(path);
+}
+
+// frames 2 ms apart are sent no earlier than their time, and not much later
+static void Timed(double speed)
+{
+    static PeakReplay replay;
+    PeakReplayConfig config;
+    PeakReplayStats stats;
+    char path[256];
+    UInt64 due, counted = 0;
+    UInt32 i;
+    
+    PeakTestTempPath(path, sizeof(path), "timed.pcap");
+    WriteCapture(path, 50, 2000000, 0);
+    Config(&config, speed);
+    CHECK_EQ(PeakReplayOpen(&replay, path, &config), kIOReturnSuccess);
+    CHECK_EQ(PeakReplayRun(&replay), kIOReturnSuccess);
+    PeakReplayGetStats(&replay, &stats);
+    
+    CHECK_EQ(stats.frames, 50);
+    CHECK_EQ(gEndpoint.count, 50);
+    // against the first frame, which may itself have left up to 100 us after the start
+    for (i = 1; i < gEndpoint.count; i++)
+    {
+        due = (UInt64)(i * 2000000 / speed);
+        CHECK(gEndpoint.atNs[i] - gEndpoint.atNs[0] + 100000 >= due);
+    }
+    CHECK(stats.elapsedNs >= (UInt64)(49 * 2000000 / speed));
+    CHECK(stats.elapsedNs < (UInt64)(49 * 2000000 / speed) + 200000000ULL);
+    
+    // every frame is in the histogram once, none of them later than the worst
+    for (i = 0; i < PEAK_REPLAY_BUCKETS; i++)
+        counted += stats.late[i];
+    CHECK_EQ(counted + stats.early, 50);
+    CHECK_EQ(stats.early, 0);
+    CHECK(stats.sumLateNs <= stats.maxLateNs * 50);
+    PeakReplayClose(&replay);
+    PeakTestRemove(path);
+}
+
+static void TestOriginalTiming(void)
+{
+    Timed(1);
+}
+
+static void TestScaledTiming(void)
+{
+    Timed(2);
+    Timed(0.5);
+}
+
+static void TestWindow(void)
+{
+    static PeakReplay replay;
+    PeakReplayConfig config;
+    PeakReplayStats stats;
+    char path[256];
+    
+    // frames 100 us apart with a window of 1 ms go out ten or so at a time, ahead of their time
+    PeakTestTempPath(path, sizeof(path), "window.pcap");
+    WriteCapture(path, 200, 100000, 0);
+    Config(&config, 1);
+    config.windowNs = 1000000;
+    CHECK_EQ(PeakReplayOpen(&replay, path, &config), kIOReturnSuccess);
+    CHECK_EQ(PeakReplayRun(&replay), kIOReturnSuccess);
+    PeakReplayGetStats(&replay, &stats);
+    CHECK_EQ(stats.frames, 200);
+    CHECK(stats.batches <= 40);
+    CHECK(stats.early > 100);
+    PeakReplayClose(&replay);
+    PeakTestRemove(path);
+}
+
+static void TestRange(void)
+{
+    static PeakReplay replay;
+    PeakReplayConfig config;
+    PeakReplayStats stats;
+    char path[256];
+    
+    // frames 10..19 of a capture with one every millisecond
+    PeakTestTempPath(path, sizeof(path), "range.pcap");
+    WriteCapture(path, 100, 1000000, 0);
+    Config(&config, 0);
+    config.fromNs = 1010000000ULL;
+    config.toNs = 1019000000ULL;
+    CHECK_EQ(PeakReplayOpen(&replay, path, &config), kIOReturnSuccess);
+    CHECK_EQ(PeakReplayRun(&replay), kIOReturnSuccess);
+    PeakReplayGetStats(&replay, &stats);
+    CHECK_EQ(stats.frames, 10);
+    CHECK_EQ(gEndpoint.ids[0], 10);
+    CHECK_EQ(gEndpoint.ids[9], 19);
+    PeakReplayClose(&replay);
+    
+    // an empty range ends at once
+    config.fromNs = 2000000000ULL;
+    config.toNs = 0;
+    CHECK_EQ(PeakReplayOpen(&replay, path, &config), kIOReturnSuccess);
+    CHECK_EQ(PeakReplayRun(&replay), kIOReturnSuccess);
+    PeakReplayGetStats(&replay, &stats);
+    CHECK_EQ(stats.frames, 0);
+    CHECK_EQ(stats.batches, 0);
+    PeakReplayClose(&replay);
+    PeakTestRemove(path);
+}
+
+static void TestSendErrors(void)
+{
+    static PeakReplay replay;
+    PeakReplayConfig config;
+    PeakReplayStats stats;
+    char path[256];
+    
+    PeakTestTempPath(path, sizeof(path), "errors.pcap");
+    WriteCapture(path, 100, 1000, 0);
+    
+    // a full transmit path costs the frames of that call, the replay goes on
+    Config(&config, 0);
+    config.batchFrames = 10;
+    gEndpoint.refuse = 2;
+    gEndpoint.kr = kIOReturnNoSpace;
+    CHECK_EQ(PeakReplayOpen(&replay, path, &config), kIOReturnSuccess);
+    CHECK_EQ(PeakReplayRun(&replay), kIOReturnSuccess);
+    PeakReplayGetStats(&replay, &stats);
+    CHECK_EQ(stats.errors, 20);
+    CHECK_EQ(stats.frames, 80);
+    CHECK_EQ(gEndpoint.ids[0], 20);
+    PeakReplayClose(&replay);
+    
+    // any other error ends it
+    Config(&config, 0);
+    config.batchFrames = 10;
+    gEndpoint.refuse = 1;
+    gEndpoint.kr = kIOReturnNotOpen;
+    CHECK_EQ(PeakReplayOpen(&replay, path, &config), kIOReturnSuccess);
+    CHECK_EQ(PeakReplayRun(&replay), kIOReturnNotOpen);
+    PeakReplayGetStats(&replay, &stats);
+    CHECK_EQ(stats.errors, 10);
+    CHECK_EQ(stats.frames, 0);
+    CHECK_EQ(gEndpoint.calls, 1);
+    PeakReplayClose(&replay);
+    PeakTestRemove(path);
+}
+
+static void TestStop(void)
+{
+    static PeakReplay replay;
+    PeakReplayConfig config;
+    PeakReplayStats stats;
+    struct timespec delay = { 0, 30000000 };
+    char path[256];
+    UInt64 startNs;
+    
+    // ten seconds of traffic, stopped after a few frames without waiting for the next one
+    PeakTestTempPath(path, sizeof(path), "stop.pcap");
+    WriteCapture(path, 100, 100000000, 0);
+    Config(&config, 1);
+    CHECK_EQ(PeakReplayOpen(&replay, path, &config), kIOReturnSuccess);
+    CHECK_EQ(PeakReplayStart(&replay), kIOReturnSuccess);
+    CHECK(PeakReplayIsRunning(&replay));
+    CHECK_EQ(PeakReplayStart(&replay), kIOReturnBusy);
+    nanosleep(&delay, NULL);
+    
+    startNs = PeakMonotonicNs();
+    PeakReplayStop(&replay);
+    CHECK(PeakMonotonicNs() - startNs < 5 * PEAK_REPLAY_SLEEP_NS);
+    CHECK(!PeakReplayIsRunning(&replay));
+    PeakReplayGetStats(&replay, &stats);
+    CHECK(stats.frames >= 1 && stats.frames < 10);
+    
+    // stopped before the thread got going, it must not start over
+    CHECK_EQ(PeakReplayStart(&replay), kIOReturnSuccess);
+    startNs = PeakMonotonicNs();
+    PeakReplayStop(&replay);
+    CHECK(PeakMonotonicNs() - startNs < 5 * PEAK_REPLAY_SLEEP_NS);
+    PeakReplayGetStats(&replay, &stats);
+    CHECK(stats.frames < 10);
+    PeakReplayClose(&replay);
+    PeakTestRemove(path);
+}
+
+int main(void)
+{
+    RUN(TestOpen);
+    RUN(TestAsFastAsPossible);
+    RUN(TestOriginalTiming);
+    RUN(TestScaledTiming);
+    RUN(TestWindow);
+    RUN(TestRange);
+    RUN(TestSendErrors);
+    RUN(TestStop);
+    return PeakTestResult(__FILE__);
+}
@@ -0,0 +1,250 @@
+/*
+    File:           TestRing.c
+
+    Description:    Unit tests of the SPSC frame ring between the decoder and its consumer.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sched.h>
+#include <pthread.h>
+
+#include "PeakTest.h"
+#include "PeakRing.h"
+
+static void Put(PeakRing* ring, UInt32 id)
+{
+    CanMsg* msg = PeakRingReserve(ring);
+    
+    CHECK(msg != NULL);
+    if (msg == NULL)
+        return;
+    msg->canid.ul = id;
+    PeakRingCommit(ring);
+}
+
+static void TestCreate(void)
+{
+    PeakRing ring;
+    
+    CHECK_EQ(PeakRingCreate(&ring, 0), kIOReturnBadArgument);
+    CHECK_EQ(PeakRingCreate(&ring, 12), kIOReturnBadArgument);
+    CHECK_EQ(PeakRingCreate(&ring, 16), kIOReturnSuccess);
+    CHECK(PeakRingBorrow(&ring) == NULL);
+    CHECK(PeakRingNewest(&ring) == NULL);
+    CHECK_EQ(PeakRingFill(&ring), 0);
+    PeakRingDestroy(&ring);
+}
+
+static void TestReserveCommit(void)
+{
+    PeakRing ring;
+    CanMsg* msg;
+    
+    PeakRingCreate(&ring, 16);
+    
+    // a reserved slot stays invisible until it is committed
+    msg = PeakRingReserve(&ring);
+    CHECK(msg != NULL);
+    msg->canid.ul = 0x123;
+    CHECK(PeakRingBorrow(&ring) == NULL);
+    CHECK_EQ(PeakRingFill(&ring), 0);
+    
+    PeakRingCommit(&ring);
+    CHECK_EQ(PeakRingFill(&ring), 1);
+    
+    // reserving again without a commit hands out the same slot
+    CHECK(PeakRingReserve(&ring) == PeakRingReserve(&ring));
+    PeakRingDestroy(&ring);
+}
+
+static void TestBorrowRelease(void)
+{
+    PeakRing ring;
+    CanMsg* msg;
+    UInt32 i;
+    
+    PeakRingCreate(&ring, 16);
+    for (i = 0; i < 5; i++)
+        Put(&ring, i);
+    
+    CHECK_EQ(PeakRingNewest(&ring)->canid.ul, 4);
+    
+    // borrowing without a release keeps returning the oldest slot
+    msg = PeakRingBorrow(&ring);
+    CHECK(msg != NULL && msg == PeakRingBorrow(&ring));
+    
+    for (i = 0; i < 5; i++)
+    {
+        msg = PeakRingBorrow(&ring);
+        CHECK(msg != NULL);
+        if (msg == NULL)
+            break;
+        CHECK_EQ(msg->canid.ul, i);
+        PeakRingRelease(&ring);
+        CHECK_EQ(PeakRingFill(&ring), 4 - i);
+    }
+    CHECK(PeakRingBorrow(&ring) == NULL);
+    CHECK(PeakRingNewest(&ring) == NULL);
+    PeakRingDestroy(&ring);
+}
+
+static void TestOverflow(void)
+{
+    PeakRing ring;
+    PeakRingStats stats;
+    UInt32 i;
+    
+    PeakRingCreate(&ring, 8);
+    for (i = 0; i < 8; i++)
+        Put(&ring, i);
+    
+    // full: nothing reserved, every attempt counted
+    CHECK(PeakRingReserve(&ring) == NULL);
+    CHECK(PeakRingReserve(&ring) == NULL);
+    CHECK(PeakRingReserve(&ring) == NULL);
+    
+    PeakRingGetStats(&ring, &stats);
+    CHECK_EQ(stats.capacity, 8);
+    CHECK_EQ(stats.fill, 8);
+    CHECK_EQ(stats.overflows, 3);
+    
+    // the frames already in the ring are untouched
+    CHECK_EQ(PeakRingBorrow(&ring)->canid.ul, 0);
+    PeakRingRelease(&ring);
+    CHECK(PeakRingReserve(&ring) != NULL);
+    PeakRingDestroy(&ring);
+}
+
+static void TestHighWater(void)
+{
+    PeakRing ring;
+    PeakRingStats stats;
+    UInt32 i;
+    
+    PeakRingCreate(&ring, 16);
+    for (i = 0; i < 6; i++)
+        Put(&ring, i);
+    for (i = 0; i < 6; i++)
+    {
+        PeakRingBorrow(&ring);
+        PeakRingRelease(&ring);
+    }
+    for (i = 0; i < 3; i++)
+        Put(&ring, i);
+    
+    // the maximum stays, the fill follows the consumer
+    PeakRingGetStats(&ring, &stats);
+    CHECK_EQ(stats.highWater, 6);
+    CHECK_EQ(stats.fill, 3);
+    CHECK_EQ(stats.overflows, 0);
+    PeakRingDestroy(&ring);
+}
+
+static void TestWraparound(void)
+{
+    PeakRing ring;
+    CanMsg* msg;
+    UInt32 i, next = 0, expect = 0;
+    
+    PeakRingCreate(&ring, 8);
+    
+    // the indices run past the capacity many times, and past 2^32 by starting close to it
+    ring.head = ring.tail = 0xfffffff0;
+    for (i = 0; i < 1000; i++)
+    {
+        while (PeakRingFill(&ring) < 5)
+            Put(&ring, next++);
+        while (PeakRingFill(&ring) > 2)
+        {
+            msg = PeakRingBorrow(&ring);
+            CHECK(msg != NULL);
+            if (msg == NULL)
+                break;
+            if (msg->canid.ul != expect)
+            {
+                CHECK_EQ(msg->canid.ul, expect);
+                break;
+            }
+            expect++;
+            PeakRingRelease(&ring);
+        }
+    }
+    CHECK(ring.head < 0x1000);
+    CHECK_EQ(ring.overflows, 0);
+    PeakRingDestroy(&ring);
+}
+
+#define THREAD_FRAMES   2000000
+
+static void* Producer(void* arg)
+{
+    PeakRing* ring = arg;
+    UInt32 i;
+    CanMsg* msg;
+    
+    for (i = 0; i < THREAD_FRAMES; i++)
+    {
+        while ((msg = PeakRingReserve(ring)) == NULL)
+            sched_yield(); // a single core only gets the consumer going this way
+        msg->canid.ul = i;
+        msg->data[0] = (UInt8)i;
+        PeakRingCommit(ring);
+    }
+    return NULL;
+}
+
+static void TestThreads(void)
+{
+    PeakRing ring;
+    pthread_t thread;
+    CanMsg* msg;
+    UInt32 i = 0, bad = 0;
+    
+    // the consumer must see every frame, in order and completely written
+    PeakRingCreate(&ring, 256);
+    pthread_create(&thread, NULL, Producer, &ring);
+    while (i < THREAD_FRAMES)
+    {
+        if ((msg = PeakRingBorrow(&ring)) == NULL)
+        {
+            sched_yield();
+            continue;
+        }
+        if (msg->canid.ul != i || msg->data[0] != (UInt8)i)
+            bad++;
+        PeakRingRelease(&ring);
+        i++;
+    }
+    pthread_join(thread, NULL);
+    CHECK_EQ(bad, 0);
+    CHECK(PeakRingBorrow(&ring) == NULL);
+    CHECK(ring.highWater <= 256);
+    PeakRingDestroy(&ring);
+}
+
+int main(void)
+{
+    RUN(TestCreate);
+    RUN(TestReserveCommit);
+    RUN(TestBorrowRelease);
+    RUN(TestOverflow);
+    RUN(TestHighWater);
+    RUN(TestWraparound);
+    RUN(TestThreads);
+    return PeakTestResult(__FILE__);
+}
@@ -0,0 +1,247 @@
+/*
+    File:           TestRxQueue.c
+
+    Description:    Unit tests of the bulk read queue against a stand-in endpoint: re-arming before
+                    decode, in order completion, and recovery from failed submits.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "PeakTest.h"
+#include "PeakRxQueue.h"
+
+// a stand-in endpoint: the submitted reads in order, completed by the tests
+typedef struct {
+    PeakRxQueue*    queue;
+    PeakRxTransfer* pending[PEAK_RX_MAX_DEPTH + 1];
+    UInt32          count;
+    UInt32          fail;               // submits to refuse
+    UInt8           decoded[64];        // first byte of every decoded buffer
+    UInt32          decodedCount;
+    UInt32          inFlightAtDecode;   // the lowest seen by the decoder
+} Endpoint;
+
+static IOReturn Submit(void* refCon, PeakRxTransfer* transfer)
+{
+    Endpoint* endpoint = refCon;
+    
+    if (endpoint->fail)
+    {
+        endpoint->fail--;
+        return kIOReturnNoResources;
+    }
+    endpoint->pending[endpoint->count++] = transfer;
+    return kIOReturnSuccess;
+}
+
+static void Decode(void* refCon, const UInt8* buffer, UInt32 length)
+{
+    Endpoint* endpoint = refCon;
+    
+    CHECK(length > 0);
+    endpoint->decoded[endpoint->decodedCount++] = buffer[0];
+    if (endpoint->queue->inFlight < endpoint->inFlightAtDecode)
+        endpoint->inFlightAtDecode = endpoint->queue->inFlight;
+}
+
+static void Setup(Endpoint* endpoint, PeakRxQueue* queue, UInt32 depth)
+{
+    bzero(endpoint, sizeof(Endpoint));
+    endpoint->queue = queue;
+    endpoint->inFlightAtDecode = ~0U;
+    CHECK_EQ(PeakRxQueueInit(queue, depth, Submit, Decode, endpoint), kIOReturnSuccess);
+}
+
+// completes the index-th pending read with one byte, value
+static IOReturn Complete(Endpoint* endpoint, UInt32 index, UInt8 value)
+{
+    PeakRxTransfer* transfer = endpoint->pending[index];
+    
+    memmove(&endpoint->pending[index], &endpoint->pending[index + 1], (endpoint->count - index - 1) * sizeof(PeakRxTransfer*));
+    endpoint->count--;
+    transfer->buffer[0] = value;
+    return PeakRxQueueComplete(endpoint->queue, transfer, kIOReturnSuccess, 1);
+}
+
+static void TestInit(void)
+{
+    PeakRxQueue queue;
+    
+    CHECK_EQ(PeakRxQueueInit(&queue, 0, Submit, Decode, NULL), kIOReturnBadArgument);
+    CHECK_EQ(PeakRxQueueInit(&queue, PEAK_RX_MAX_DEPTH + 1, Submit, Decode, NULL), kIOReturnBadArgument);
+}
+
+static void TestRearmBeforeDecode(void)
+{
+    static PeakRxQueue queue;
+    Endpoint endpoint;
+    UInt32 i;
+    
+    Setup(&endpoint, &queue, 4);
+    CHECK_EQ(PeakRxQueueStart(&queue), kIOReturnSuccess);
+    CHECK_EQ(endpoint.count, 4);
+    
+    // every completion finds the spare buffer submitted by the time its buffer is decoded
+    for (i = 0; i < 20; i++)
+        CHECK_EQ(Complete(&endpoint, 0, (UInt8)i), kIOReturnSuccess);
+    CHECK_EQ(endpoint.decodedCount, 20);
+    for (i = 0; i < 20; i++)
+        CHECK_EQ(endpoint.decoded[i], i);
+    CHECK_EQ(endpoint.inFlightAtDecode, 4);
+    CHECK_EQ(endpoint.count, 4);
+    CHECK_EQ(queue.completions, 20);
+    CHECK_EQ(queue.bytes, 20);
+    CHECK_EQ(queue.dry, 0);
+}
+
+static void TestOutOfOrder(void)
+{
+    static PeakRxQueue queue;
+    Endpoint endpoint;
+    
+    Setup(&endpoint, &queue, 3);
+    PeakRxQueueStart(&queue);
+    
+    // the younger reads are held back until the oldest one is done
+    Complete(&endpoint, 2, 3);
+    Complete(&endpoint, 1, 2);
+    CHECK_EQ(endpoint.decodedCount, 0);
+    CHECK_EQ(queue.outOfOrder, 2);
+    
+    Complete(&endpoint, 0, 1);
+    CHECK_EQ(endpoint.decodedCount, 3);
+    CHECK_EQ(endpoint.decoded[0], 1);
+    CHECK_EQ(endpoint.decoded[1], 2);
+    CHECK_EQ(endpoint.decoded[2], 3);
+    
+    // and their buffers are submitted again
+    CHECK_EQ(endpoint.count, 3);
+    CHECK_EQ(queue.inFlight, 3);
+}
+
+static void TestDry(void)
+{
+    static PeakRxQueue queue;
+    Endpoint endpoint;
+    
+    // a single read always leaves the adapter without one until it is re-armed
+    Setup(&endpoint, &queue, 1);
+    PeakRxQueueStart(&queue);
+    Complete(&endpoint, 0, 1);
+    Complete(&endpoint, 0, 2);
+    CHECK_EQ(queue.dry, 2);
+    CHECK_EQ(endpoint.decodedCount, 2);
+}
+
+static void TestFailedCompletion(void)
+{
+    static PeakRxQueue queue;
+    Endpoint endpoint;
+    PeakRxTransfer* transfer;
+    
+    Setup(&endpoint, &queue, 2);
+    PeakRxQueueStart(&queue);
+    
+    // an error is counted and nothing decoded, the read is armed again
+    transfer = endpoint.pending[0];
+    endpoint.pending[0] = endpoint.pending[1];
+    endpoint.count--;
+    CHECK_EQ(PeakRxQueueComplete(&queue, transfer, kIOReturnNoResources, 64), kIOReturnSuccess);
+    CHECK_EQ(queue.errors, 1);
+    CHECK_EQ(queue.bytes, 0);
+    CHECK_EQ(endpoint.decodedCount, 0);
+    CHECK_EQ(endpoint.count, 2);
+}
+
+static void TestSubmitFailure(void)
+{
+    static PeakRxQueue queue;
+    Endpoint endpoint;
+    
+    Setup(&endpoint, &queue, 2);
+    PeakRxQueueStart(&queue);
+    
+    // with another read in flight the next completion tries again, no waiting
+    endpoint.fail = 2;
+    CHECK_EQ(Complete(&endpoint, 0, 1), kIOReturnSuccess);
+    CHECK_EQ(queue.submitFailures, 2);
+    CHECK_EQ(queue.retries, 0);
+    CHECK_EQ(queue.inFlight, 1);
+    CHECK_EQ(Complete(&endpoint, 0, 2), kIOReturnSuccess);
+    CHECK_EQ(queue.inFlight, 2);
+    CHECK_EQ(endpoint.decodedCount, 2);
+}
+
+static void TestRetry(void)
+{
+    static PeakRxQueue queue;
+    Endpoint endpoint;
+    
+    Setup(&endpoint, &queue, 1);
+    PeakRxQueueStart(&queue);
+    
+    // the only read fails to re-arm a few times, the backoff gets it going again
+    endpoint.fail = 3;
+    CHECK_EQ(Complete(&endpoint, 0, 1), kIOReturnSuccess);
+    CHECK_EQ(queue.submitFailures, 3);
+    CHECK_EQ(queue.retries, 2);
+    CHECK_EQ(queue.stalls, 0);
+    CHECK_EQ(queue.inFlight, 1);
+    CHECK_EQ(Complete(&endpoint, 0, 2), kIOReturnSuccess);
+    CHECK_EQ(endpoint.decodedCount, 2);
+}
+
+static void TestStall(void)
+{
+    static PeakRxQueue queue;
+    Endpoint endpoint;
+    
+    Setup(&endpoint, &queue, 2);
+    PeakRxQueueStart(&queue);
+    Complete(&endpoint, 0, 1);
+    
+    // once the retries for the last read run out the transport is told, reception has stopped
+    endpoint.fail = ~0U;
+    CHECK_EQ(Complete(&endpoint, 0, 2), kIOReturnSuccess);
+    CHECK_EQ(queue.retries, 0);
+    CHECK_EQ(Complete(&endpoint, 0, 3), kIOReturnNoResources);
+    CHECK_EQ(queue.inFlight, 0);
+    CHECK_EQ(queue.retries, PEAK_RX_RETRIES);
+    CHECK_EQ(queue.stalls, 1);
+    CHECK_EQ(endpoint.decodedCount, 3);
+    
+    // and so does a start that cannot submit anything
+    Setup(&endpoint, &queue, 2);
+    endpoint.fail = ~0U;
+    CHECK_EQ(PeakRxQueueStart(&queue), kIOReturnNoResources);
+    CHECK_EQ(queue.stalls, 1);
+}
+
+int main(void)
+{
+    RUN(TestInit);
+    RUN(TestRearmBeforeDecode);
+    RUN(TestOutOfOrder);
+    RUN(TestDry);
+    RUN(TestFailedCompletion);
+    RUN(TestSubmitFailure);
+    RUN(TestRetry);
+    RUN(TestStall);
+    return PeakTestResult(__FILE__);
+}
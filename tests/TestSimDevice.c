@@ -0,0 +1,294 @@
+/*
+    File:           TestSimDevice.c
+
+    Description:    Telegrams of the simulated adapter walked byte by byte and through the decoder.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "PeakTest.h"
+#include "PeakSimDevice.h"
+#include "PeakBatch.h"
+#include "PeakTransport.h"
+
+#define FRAMES          20500       // not a multiple of any event period, none is owed at the end
+#define BURST_EVERY     1000
+#define BURST_LENGTH    20
+
+static CanMsg gReceived[FRAMES];
+
+// what a telegram walk finds, the timestamps unwrapped
+typedef struct {
+    UInt64  frames, extFrames, rtrFrames;
+    UInt64  statusRecords, busOffs;
+    UInt64  wraps, backwards, shortGaps, jumps;
+    UInt64  gaps;               // frames whose payload is not their sequence number
+    UInt64  ticks, frameTicks;  // of the last record and the last frame
+    UInt32  telegrams, tooLong, malformed;
+    int     started;
+} Walk;
+
+static void SimConfig(PeakSimConfig* config)
+{
+    PeakSimConfigInit(config);
+    config->extRatio = 0.3;
+    config->rtrRatio = 0.1;
+    config->burstEvery = BURST_EVERY;
+    config->burstLength = BURST_LENGTH;
+    config->errorEvery = 700;
+    config->busOffEvery = 5000;
+    config->wrapEvery = 200;
+    config->startTicks = 0xff00;
+    config->maxFrames = FRAMES;
+}
+
+// low bytes of the counter from the telegram, carried over from the last record
+static void Ticks(Walk* walk, UInt32 value, UInt32 bits)
+{
+    UInt64 mask = (1ULL << bits) - 1, ticks = (walk->ticks & ~mask) | value;
+    
+    if (walk->started)
+    {
+        if (ticks < walk->ticks)
+            ticks += mask + 1;
+        walk->wraps += (ticks >> 16) - (walk->ticks >> 16);
+    }
+    walk->ticks = ticks;
+    walk->started = 1;
+}
+
+// Checks one telegram byte by byte, as the adapter documents the bulk-IN format.
+static void WalkTelegram(Walk* walk, const UInt8* telegram, UInt32 length)
+{
+    UInt32 pos = 2, r, j, dataLen;
+    
+    if (length > PEAK_RX_BUFFER_SIZE)
+        walk->tooLong++;
+    if (length < 2 || telegram[0] != 2 || telegram[1] == 0)
+    {
+        walk->malformed++;
+        return;
+    }
+    
+    for (r = 0; r < telegram[1]; r++)
+    {
+        UInt8 statusLen = telegram[pos++];
+        int status = (statusLen & STLN_INTERNAL_DATA) != 0;
+        int ext = (statusLen & STLN_EXTENDED_ID) != 0, rtr = (statusLen & STLN_RTR) != 0;
+        
+        if (status)
+        {
+            if (telegram[pos] == 1 && (telegram[pos + 1] & BUS_OFF))
+                walk->busOffs++;
+            walk->statusRecords++;
+            pos += 2;
+        }
+        else
+        {
+            pos += ext ? 4 : 2;
+        }
+        
+        // a word for the first record, the low byte after it
+        if (r == 0)
+        {
+            Ticks(walk, telegram[pos] | telegram[pos + 1] << 8, 16);
+            pos += 2;
+        }
+        else
+        {
+            Ticks(walk, telegram[pos++], 8);
+        }
+        
+        if (status)
+            continue;
+        
+        if (walk->frames > 0 && walk->ticks < walk->frameTicks)
+            walk->backwards++;
+        if (walk->frames > 0 && walk->ticks - walk->frameTicks <= 5)
+            walk->shortGaps++;
+        if (walk->frames > 0 && walk->ticks - walk->frameTicks >= 0x8000)
+            walk->jumps++;
+        walk->frameTicks = walk->ticks;
+        
+        dataLen = rtr ? 0 : statusLen & STLN_DATA_LENGTH;
+        for (j = 0; j < dataLen; j++)
+        {
+            if (telegram[pos + j] != (UInt8)(walk->frames >> (8 * j)))
+            {
+                walk->gaps++;
+                break;
+            }
+        }
+        pos += dataLen;
+        walk->frames++;
+        walk->extFrames += ext;
+        walk->rtrFrames += rtr;
+    }
+    
+    if (pos != length)
+        walk->malformed++;
+    walk->telegrams++;
+}
+
+static void TestCreate(void)
+{
+    PeakSimConfig config;
+    PeakSimDevice sim;
+    
+    PeakSimConfigInit(&config);
+    config.frameRate = 0;
+    CHECK_EQ(PeakSimDeviceCreate(&sim, &config), kIOReturnBadArgument);
+    PeakSimConfigInit(&config);
+    config.stdIdMax = 0x800;
+    CHECK_EQ(PeakSimDeviceCreate(&sim, &config), kIOReturnBadArgument);
+    PeakSimConfigInit(&config);
+    bzero(config.dlcWeights, sizeof(config.dlcWeights));
+    CHECK_EQ(PeakSimDeviceCreate(&sim, &config), kIOReturnBadArgument);
+    PeakSimConfigInit(&config);
+    config.idCount = PEAK_SIM_MAX_IDS + 1;
+    CHECK_EQ(PeakSimDeviceCreate(&sim, &config), kIOReturnBadArgument);
+}
+
+static void TestTelegrams(void)
+{
+    UInt8 telegram[PEAK_RX_BUFFER_SIZE + 16], first[PEAK_RX_BUFFER_SIZE + 16];
+    UInt32 length, firstLength = 0;
+    PeakSimConfig config;
+    PeakSimStats stats;
+    PeakSimDevice sim;
+    UInt64 bytes = 0;
+    Walk walk;
+    
+    SimConfig(&config);
+    CHECK_EQ(PeakSimDeviceCreate(&sim, &config), kIOReturnSuccess);
+    bzero(&walk, sizeof(walk));
+    while ((length = PeakSimDeviceFill(&sim, telegram)) > 0)
+    {
+        if (firstLength == 0)
+            memcpy(first, telegram, firstLength = length);
+        WalkTelegram(&walk, telegram, length);
+        bytes += length;
+    }
+    PeakSimDeviceGetStats(&sim, &stats);
+    
+    CHECK_EQ(walk.tooLong, 0);
+    CHECK_EQ(walk.malformed, 0);
+    CHECK_EQ(walk.gaps, 0);
+    CHECK_EQ(walk.backwards, 0);
+    CHECK_EQ(walk.frames, FRAMES);
+    CHECK_EQ(walk.frames, stats.frames);
+    CHECK_EQ(walk.extFrames, stats.extFrames);
+    CHECK_EQ(walk.rtrFrames, stats.rtrFrames);
+    CHECK(stats.extFrames > FRAMES / 10 && stats.rtrFrames > FRAMES / 20);
+    CHECK_EQ(walk.telegrams, stats.telegrams);
+    CHECK_EQ(bytes, stats.bytes);
+    
+    // an error record every 700 frames unless a bus-off takes its place
+    CHECK_EQ(stats.busOffs, FRAMES / 5000);
+    CHECK_EQ(walk.busOffs, stats.busOffs);
+    CHECK_EQ(walk.statusRecords, stats.statusRecords);
+    CHECK_EQ(stats.statusRecords, FRAMES / 700 + FRAMES / 5000 - FRAMES / 35000);
+    
+    // the frames of a burst follow each other within a few ticks, the others 500 us apart, unless a jump
+    // to the next wrap falls into the burst
+    CHECK_EQ(stats.bursts, FRAMES / BURST_EVERY);
+    CHECK(walk.shortGaps <= stats.bursts * BURST_LENGTH);
+    CHECK(walk.shortGaps + walk.jumps >= stats.bursts * BURST_LENGTH);
+    
+    // the counter starts just before a wrap and jumps to the next one every 200 telegrams
+    CHECK(stats.wraps > stats.telegrams / 200);
+    CHECK_EQ(walk.wraps, stats.wraps);
+    PeakSimDeviceDestroy(&sim);
+    
+    // the same seed gives the same bus
+    CHECK_EQ(PeakSimDeviceCreate(&sim, &config), kIOReturnSuccess);
+    CHECK_EQ(PeakSimDeviceFill(&sim, telegram), firstLength);
+    CHECK(memcmp(telegram, first, firstLength) == 0);
+    PeakSimDeviceDestroy(&sim);
+}
+
+// Through the loopback adapter and the driver's decoder, paced to a 50000 frames/s bus.
+static void TestDecoded(void)
+{
+    UInt32 n = 0, i, statusBefore, busOffsBefore, ext = 0, rtr = 0, gaps = 0, backwards = 0;
+    PeakRxStats before, after;
+    PeakSimConfig config;
+    PeakSimStats stats;
+    PeakSimDevice sim;
+    UInt64 deadline;
+    
+    SimConfig(&config);
+    config.frameRate = 50000;
+    config.realtime = 1;
+    CHECK_EQ(PeakSimDeviceCreate(&sim, &config), kIOReturnSuccess);
+    
+    CHECK_EQ(PeakTestStartLoopback(1), kIOReturnSuccess);
+    PeakGetRxStats(&before);
+    statusBefore = PeakTestStatusCount();
+    busOffsBefore = PeakTestBusOffCount();
+    PeakLoopbackSetSource(0, PeakSimDeviceFill, &sim);
+    
+    deadline = PeakMonotonicNs() + 10000000000ULL;
+    while (n < FRAMES && PeakMonotonicNs() < deadline)
+        n += PeakTestReceive(gReceived + n, FRAMES - n, FRAMES - n, 100000000ULL);
+    PeakGetRxStats(&after);
+    PeakSimDeviceGetStats(&sim, &stats);
+    
+    CHECK_EQ(n, FRAMES);
+    CHECK_EQ(after.overflows - before.overflows, 0);
+    CHECK_EQ(after.malformed - before.malformed, 0);
+    CHECK_EQ(after.telegrams - before.telegrams, stats.telegrams);
+    for (i = 0; i < n; i++)
+    {
+        UInt32 j, dataLen = gReceived[i].rtr ? 0 : gReceived[i].len;
+        
+        for (j = 0; j < dataLen; j++)
+        {
+            if (gReceived[i].data[j] != (UInt8)((UInt64)i >> (8 * j)))
+            {
+                gaps++;
+                break;
+            }
+        }
+        ext += gReceived[i].ext;
+        rtr += gReceived[i].rtr;
+        if (i > 0 && gReceived[i].mono < gReceived[i - 1].mono)
+            backwards++;
+    }
+    CHECK_EQ(gaps, 0);
+    CHECK_EQ(ext, stats.extFrames);
+    CHECK_EQ(rtr, stats.rtrFrames);
+    CHECK_EQ(backwards, 0);
+    CHECK(stats.wraps > 0);
+    
+    CHECK_EQ(after.statusRecords - before.statusRecords, stats.statusRecords);
+    CHECK_EQ(PeakTestStatusCount() - statusBefore, stats.statusRecords);
+    CHECK_EQ(PeakTestBusOffCount() - busOffsBefore, stats.busOffs);
+    
+    PeakTestStopLoopback();
+    PeakSimDeviceDestroy(&sim);
+}
+
+int main(void)
+{
+    RUN(TestCreate);
+    RUN(TestTelegrams);
+    RUN(TestDecoded);
+    return PeakTestResult(__FILE__);
+}
@@ -0,0 +1,403 @@
+/*
+    File:           TestStream.c
+
+    Description:    Tests of the UNIX socket stream: SocketCAN records with and without timestamps,
+                    client requests, the three overflow policies and the driver streaming the frames of
+                    a loopback adapter.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "PeakTest.h"
+#include "PeakStream.h"
+
+#define FLOOD           100000
+
+static UInt8 gReceived[FLOOD * sizeof(PeakCanFrame)];
+
+// longer than a client gets to send its request, so it is active with the settings it asked for
+static void Settle(void)
+{
+    struct timespec pause = { 0, (long)(2 * PEAK_STREAM_REQUEST_NS) };
+    nanosleep(&pause, NULL);
+}
+
+static int Connect(const char* path, const PeakStreamRequest* request)
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (request && send(fd, request, sizeof(PeakStreamRequest), 0) != sizeof(PeakStreamRequest))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void Request(PeakStreamRequest* request, UInt8 flags, UInt8 overflow, UInt32 backlog)
+{
+    bzero(request, sizeof(PeakStreamRequest));
+    request->magic = PEAK_STREAM_MAGIC;
+    request->flags = flags;
+    request->overflow = overflow;
+    request->backlog = backlog;
+}
+
+// reads until the server closes the socket or sends nothing for quietMs, returns the bytes
+static size_t ReadAll(int fd, UInt8* buffer, size_t max, int quietMs, int* closed)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    size_t length = 0;
+    ssize_t got;
+    
+    *closed = 0;
+    while (length < max && poll(&pfd, 1, quietMs) > 0)
+    {
+        got = recv(fd, buffer + length, max - length, 0);
+        if (got <= 0)
+        {
+            *closed = 1;
+            break;
+        }
+        length += (size_t)got;
+    }
+    return length;
+}
+
+static void Frames(CanMsg* msgs, UInt32 first, UInt32 count)
+{
+    UInt32 i;
+    
+    bzero(msgs, count * sizeof(CanMsg));
+    for (i = 0; i < count; i++)
+    {
+        msgs[i].canid.ul = 0x100 + (first + i) % 0x400;
+        msgs[i].len = 8;
+        msgs[i].ldata = first + i;
+        msgs[i].ts = 1436509052000000000ULL + (first + i) * 1000ULL;
+    }
+}
+
+static UInt64 Sequence(UInt32 n)
+{
+    PeakCanFrame* frame = (PeakCanFrame*)gReceived + n;
+    UInt64 value;
+    
+    memcpy(&value, frame->data, sizeof(value));
+    return value;
+}
+
+static void TestOpen(void)
+{
+    PeakStreamConfig config;
+    PeakStream stream;
+    char path[256];
+    FILE* file;
+    
+    PeakTestTempPath(path, sizeof(path), "sock");
+    PeakStreamConfigInit(&config);
+    CHECK_EQ(config.overflow, PEAK_STREAM_DROP_OLDEST);
+    CHECK_EQ(config.backlog, PEAK_STREAM_DEFAULT_BACKLOG);
+    
+    config.backlog = 0;
+    CHECK_EQ(PeakStreamOpen(&stream, path, &config), kIOReturnBadArgument);
+    config.backlog = PEAK_STREAM_MAX_BACKLOG + 1;
+    CHECK_EQ(PeakStreamOpen(&stream, path, &config), kIOReturnBadArgument);
+    PeakStreamConfigInit(&config);
+    config.flags = 4;
+    CHECK_EQ(PeakStreamOpen(&stream, path, &config), kIOReturnBadArgument);
+    config.flags = 0;
+    config.overflow = 3;
+    CHECK_EQ(PeakStreamOpen(&stream, path, &config), kIOReturnBadArgument);
+    config.overflow = PEAK_STREAM_DROP_OLDEST;
+    CHECK_EQ(PeakStreamOpen(&stream, "/tmp/a-path-that-does-not-fit-into-the-sun-path-of-a-sockaddr-un-because-it-goes-on-and-on-and-on-and-on-and-on", &config),
+             kIOReturnBadArgument);
+    
+    // a socket left behind is replaced, the socket goes with the close
+    CHECK_EQ(PeakStreamOpen(&stream, path, &config), kIOReturnSuccess);
+    PeakStreamClose(&stream);
+    CHECK_EQ(PeakStreamOpen(&stream, path, &config), kIOReturnSuccess);
+    PeakStreamClose(&stream);
+    CHECK(access(path, F_OK) != 0);
+    
+    // anything else at the path is not
+    file = fopen(path, "w");
+    fclose(file);
+    CHECK_EQ(PeakStreamOpen(&stream, path, &config), kIOReturnNotOpen);
+    CHECK_EQ(access(path, F_OK), 0);
+    unlink(path);
+}
+
+static void TestCanFrame(void)
+{
+    PeakStreamConfig config;
+    PeakStreamStats stats;
+    PeakStream stream;
+    PeakCanFrame* frames = (PeakCanFrame*)gReceived;
+    CanMsg msgs[4];
+    char path[256];
+    int fd, closed;
+    
+    PeakTestTempPath(path, sizeof(path), "sock");
+    PeakStreamConfigInit(&config);
+    CHECK_EQ(PeakStreamOpen(&stream, path, &config), kIOReturnSuccess);
+    
+    // nobody connected
+    Frames(msgs, 0, 4);
+    PeakStreamPublish(&stream, msgs, 4);
+    PeakStreamGetStats(&stream, &stats);
+    CHECK_EQ(stats.frames, 0);
+    
+    // a client that sends no request gets the defaults
+    fd = Connect(path, NULL);
+    CHECK(fd >= 0);
+    Settle();
+    
+    msgs[0].canid.ul = 0x123;
+    msgs[0].len = 3;
+    msgs[0].ldata = 0x1122334455667788ULL;
+    msgs[1].canid.ul = 0x18da00f1;
+    msgs[1].ext = 1;
+    msgs[2].canid.ul = 0x7ff;
+    msgs[2].rtr = 1;
+    msgs[2].len = 4;
+    msgs[3].canid.ul = 0x4;
+    msgs[3].err = 1;
+    PeakStreamPublish(&stream, msgs, 4);
+    
+    CHECK_EQ(ReadAll(fd, gReceived, sizeof(gReceived), 100, &closed), 4 * sizeof(PeakCanFrame));
+    CHECK_EQ(frames[0].canId, 0x123);
+    CHECK_EQ(frames[0].len, 3);
+    CHECK(frames[0].data[0] == 0x88 && frames[0].data[2] == 0x66 && frames[0].data[3] == 0 && frames[0].data[7] == 0);
+    CHECK_EQ(frames[1].canId, 0x18da00f1 | PEAK_CAN_EFF_FLAG);
+    CHECK_EQ(frames[1].data[0], 1);
+    CHECK_EQ(frames[2].canId, 0x7ff | PEAK_CAN_RTR_FLAG);
+    CHECK_EQ(frames[2].len, 4);
+    CHECK_EQ(frames[2].data[0], 0);
+    CHECK_EQ(frames[3].canId, 0x4 | PEAK_CAN_ERR_FLAG);
+    CHECK_EQ(frames[3].data[0], 3);
+    
+    PeakStreamGetStats(&stream, &stats);
+    CHECK_EQ(stats.clients, 1);
+    CHECK_EQ(stats.connects, 1);
+    CHECK_EQ(stats.frames, 4);
+    CHECK_EQ(stats.sends, 1);
+    CHECK_EQ(stats.dropped, 0);
+    
+    // a client that goes away is noticed by the server thread
+    close(fd);
+    Settle();
+    PeakStreamGetStats(&stream, &stats);
+    CHECK_EQ(stats.clients, 0);
+    CHECK_EQ(stats.disconnects, 1);
+    
+    PeakStreamClose(&stream);
+}
+
+static void TestFdTimestamp(void)
+{
+    UInt32 size = sizeof(UInt64) + sizeof(PeakCanFdFrame), i;
+    PeakStreamConfig config;
+    PeakStreamRequest request;
+    PeakStream stream;
+    PeakCanFdFrame frame;
+    CanMsg msgs[300];
+    char path[256];
+    int fd, plain, closed;
+    UInt64 ts;
+    
+    PeakTestTempPath(path, sizeof(path), "sock");
+    PeakStreamConfigInit(&config);
+    CHECK_EQ(PeakStreamOpen(&stream, path, &config), kIOReturnSuccess);
+    
+    // more than a batch, each client in its own format
+    Request(&request, PEAK_STREAM_TIMESTAMP | PEAK_STREAM_FD, PEAK_STREAM_DROP_OLDEST, 0);
+    fd = Connect(path, &request);
+    plain = Connect(path, NULL);
+    CHECK(fd >= 0 && plain >= 0);
+    Settle();
+    
+    Frames(msgs, 0, 300);
+    msgs[5].len = 2;
+    PeakStreamPublish(&stream, msgs, 300);
+    
+    CHECK_EQ(ReadAll(fd, gReceived, sizeof(gReceived), 100, &closed), 300 * size);
+    for (i = 0; i < 300; i++)
+    {
+        memcpy(&ts, gReceived + i * size, sizeof(ts));
+        memcpy(&frame, gReceived + i * size + sizeof(ts), sizeof(frame));
+        CHECK_EQ(ts, msgs[i].ts);
+        CHECK_EQ(frame.canId, msgs[i].canid.ul);
+        CHECK_EQ(frame.len, msgs[i].len);
+        CHECK_EQ(frame.data[0], msgs[i].data[0]);
+        CHECK_EQ(frame.data[8], 0);
+    }
+    memcpy(&frame, gReceived + 5 * size + sizeof(ts), sizeof(frame));
+    CHECK(frame.data[1] == 0 && frame.data[2] == 0);
+    
+    CHECK_EQ(ReadAll(plain, gReceived, sizeof(gReceived), 100, &closed), 300 * sizeof(PeakCanFrame));
+    for (i = 0; i < 300; i++)
+        CHECK_EQ(Sequence(i), i);
+    
+    close(fd);
+    close(plain);
+    PeakStreamClose(&stream);
+}
+
+// FLOOD frames to a client that reads nothing until the end, with a backlog of 64 records
+static void Flood(UInt8 overflow, UInt32* received, int* closed, PeakStreamStats* stats)
+{
+    static CanMsg msgs[FLOOD];
+    PeakStreamConfig config;
+    PeakStreamRequest request;
+    PeakStream stream;
+    char path[256];
+    UInt32 i;
+    int fd;
+    
+    PeakTestTempPath(path, sizeof(path), "sock");
+    PeakStreamConfigInit(&config);
+    CHECK_EQ(PeakStreamOpen(&stream, path, &config), kIOReturnSuccess);
+    
+    Request(&request, 0, overflow, 64);
+    fd = Connect(path, &request);
+    CHECK(fd >= 0);
+    Settle();
+    
+    Frames(msgs, 0, FLOOD);
+    for (i = 0; i < FLOOD; i += 19)
+        PeakStreamPublish(&stream, msgs + i, FLOOD - i < 19 ? FLOOD - i : 19);
+    PeakStreamGetStats(&stream, stats);
+    
+    *received = (UInt32)(ReadAll(fd, gReceived, sizeof(gReceived), 200, closed) / sizeof(PeakCanFrame));
+    close(fd);
+    PeakStreamClose(&stream);
+}
+
+static void TestOverflow(void)
+{
+    PeakStreamStats stats;
+    UInt32 received, i, gap;
+    int closed;
+    
+    // the first frames, as many as the socket and the backlog took
+    Flood(PEAK_STREAM_DROP_NEWEST, &received, &closed, &stats);
+    CHECK(received > 64 && received < FLOOD);
+    CHECK_EQ(stats.frames, FLOOD);
+    CHECK_EQ(stats.dropped, FLOOD - received);
+    CHECK_EQ(stats.disconnects, 0);
+    CHECK(!closed);
+    for (i = 0; i < received; i++)
+        CHECK_EQ(Sequence(i), i);
+    
+    // what the socket took, then the last 64
+    Flood(PEAK_STREAM_DROP_OLDEST, &received, &closed, &stats);
+    CHECK(received > 64 && received < FLOOD);
+    CHECK_EQ(stats.dropped, FLOOD - received);
+    for (gap = 0; gap < received && Sequence(gap) == gap; gap++)
+        ;
+    CHECK(gap < received);
+    CHECK_EQ(received - gap, 64);
+    for (i = gap; i < received; i++)
+        CHECK_EQ(Sequence(i), FLOOD - received + i);
+    
+    // what the socket took, then the end
+    Flood(PEAK_STREAM_DISCONNECT, &received, &closed, &stats);
+    CHECK(received < FLOOD);
+    CHECK_EQ(stats.disconnects, 1);
+    CHECK(closed);
+    for (i = 0; i < received; i++)
+        CHECK_EQ(Sequence(i), i);
+}
+
+static void TestDriver(void)
+{
+    PeakStreamStats stats;
+    CanMsg msg, received[50];
+    char path[256];
+    UInt32 i;
+    int fd, closed;
+    
+    PeakTestTempPath(path, sizeof(path), "driver");
+    CHECK_EQ(PeakTestStartLoopback(1), kIOReturnSuccess);
+    CHECK_EQ(PeakGetStreamStats(&stats), kIOReturnNotOpen);
+    CHECK_EQ(PeakStopStreaming(), kIOReturnNotOpen);
+    CHECK_EQ(PeakStartStreaming(path, NULL), kIOReturnSuccess);
+    CHECK_EQ(PeakStartStreaming(path, NULL), kIOReturnBusy);
+    
+    fd = Connect(path, NULL);
+    CHECK(fd >= 0);
+    Settle();
+    
+    // the loopback adapter echoes what is sent, the decoder streams it
+    bzero(&msg, sizeof(msg));
+    msg.len = 8;
+    for (i = 0; i < 50; i++)
+    {
+        msg.canid.ul = 0x300 + i;
+        msg.ldata = i;
+        CHECK_EQ(PeakSend(&msg), kIOReturnSuccess);
+    }
+    CHECK_EQ(PeakTestReceive(received, 50, 50, 2000000000ULL), 50);
+    
+    CHECK_EQ(ReadAll(fd, gReceived, sizeof(gReceived), 200, &closed), 50 * sizeof(PeakCanFrame));
+    for (i = 0; i < 50; i++)
+    {
+        CHECK_EQ(((PeakCanFrame*)gReceived)[i].canId, 0x300 + i);
+        CHECK_EQ(Sequence(i), i);
+    }
+    CHECK_EQ(PeakGetStreamStats(&stats), kIOReturnSuccess);
+    CHECK_EQ(stats.clients, 1);
+    CHECK_EQ(stats.frames, 50);
+    
+    // the clients are closed with the stream
+    CHECK_EQ(PeakStopStreaming(), kIOReturnSuccess);
+    CHECK_EQ(ReadAll(fd, gReceived, sizeof(gReceived), 1000, &closed), 0);
+    CHECK(closed);
+    CHECK(access(path, F_OK) != 0);
+    close(fd);
+    PeakTestStopLoopback();
+}
+
+int main(void)
+{
+    RUN(TestOpen);
+    RUN(TestCanFrame);
+    RUN(TestFdTimestamp);
+    RUN(TestOverflow);
+    RUN(TestDriver);
+    return PeakTestResult(__FILE__);
+}
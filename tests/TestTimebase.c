@@ -0,0 +1,179 @@
+/*
+    File:           TestTimebase.c
+
+    Description:    Unit tests of the drift corrected timebase against a simulated adapter: the nominal
+                    anchor, counter jumps, times that never run backwards, a day of crystal drift and a
+                    stalled host.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "PeakTest.h"
+#include "PeakTimebase.h"
+#include "PeakBatch.h"
+#include "PeakSimDevice.h"
+
+// A simulated adapter: its crystal runs ppm fast, a frame stamped at host time t completes after a
+// latency of 100 us plus up to 900 us, and one completion in fifty is held up by up to 20 ms more.
+
+typedef struct {
+    double  ppm;
+    UInt64  seed;
+    UInt64  hostNs;         // host time of the adapter's tick 0
+} Adapter;
+
+static UInt64 Ticks(const Adapter* adapter, UInt64 t)
+{
+    return (UInt64)((double)(t - adapter->hostNs) * (1.0 + adapter->ppm * 1e-6) / PEAK_SIM_TICK_NS);
+}
+
+static UInt64 Latency(Adapter* adapter)
+{
+    UInt64 latency = 100000 + PeakTestNext(&adapter->seed) % 900000;
+    
+    if (PeakTestNext(&adapter->seed) % 50 == 0)
+        latency += PeakTestNext(&adapter->seed) % 20000000;
+    return latency;
+}
+
+static SInt64 Error(PeakTimebase* timebase, const Adapter* adapter, UInt64 t)
+{
+    return (SInt64)(PeakTimebaseMonotonic(timebase, Ticks(adapter, t)) - t);
+}
+
+// the rate is 32.32 fixed point, a tick of 128/3 us is off by a fraction of a ns
+static int Near(UInt64 a, UInt64 b, UInt64 ns)
+{
+    return a > b ? a - b <= ns : b - a <= ns;
+}
+
+static void TestNominal(void)
+{
+    PeakTimebase timebase;
+    
+    // the first completion anchors the nominal rate
+    PeakTimebaseInit(&timebase, PEAK_SIM_TICK_NS);
+    PeakTimebaseComplete(&timebase, 1000, 5000000000ULL);
+    CHECK_EQ(timebase.count, 1);
+    CHECK_EQ(PeakTimebaseMonotonic(&timebase, 1000), 5000000000ULL);
+    CHECK(Near(PeakTimebaseMonotonic(&timebase, 1003), 5000128000ULL, 2));
+    CHECK(Near(PeakTimebaseMonotonic(&timebase, 1000 + 3 * 1000000), 5000000000ULL + 128000ULL * 1000000, 2));
+    CHECK(timebase.ppm > -0.001 && timebase.ppm < 0.001);
+    
+    // and so does one after a jump of the counter far ahead of the host clock
+    PeakTimebaseInit(&timebase, PEAK_SIM_TICK_NS);
+    PeakTimebaseComplete(&timebase, 1000, 5000000000ULL);
+    PeakTimebaseComplete(&timebase, 1000 + 3 * 100000, 5000000000ULL + 1000000);
+    CHECK_EQ(timebase.resets, 1);
+    CHECK_EQ(PeakTimebaseMonotonic(&timebase, 1000 + 3 * 100000), 5000000000ULL + 1000000);
+}
+
+static void TestNeverBackwards(void)
+{
+    PeakTimebase timebase;
+    Adapter adapter = { -300, 7, 1000000000ULL };
+    UInt64 t, ns, last = 0;
+    int backwards = 0;
+    
+    // the adapter is slow, so every fit moves the line back a little; the times handed out hold still
+    PeakTimebaseInit(&timebase, PEAK_SIM_TICK_NS);
+    for (t = adapter.hostNs; t < adapter.hostNs + 30000000000ULL; t += 1000000)
+    {
+        PeakTimebaseComplete(&timebase, Ticks(&adapter, t), t + Latency(&adapter));
+        ns = PeakTimebaseMonotonic(&timebase, Ticks(&adapter, t));
+        if (ns < last)
+            backwards++;
+        last = ns;
+    }
+    CHECK_EQ(backwards, 0);
+    CHECK_EQ(timebase.resets, 0);
+    // the rate is in ns per tick, a slow crystal has more of them
+    CHECK(timebase.ppm > 290 && timebase.ppm < 310);
+}
+
+// A day with a crystal 50 ppm fast: the nominal rate alone would be 4.3 s ahead by the end, the fit
+// stays within the lowest latency and a little jitter of the true time all day.
+static void TestDriftDay(void)
+{
+    PeakTimebase timebase;
+    Adapter adapter = { 50, 1, 1000000000ULL };
+    UInt64 t, end = adapter.hostNs + 86400ULL * 1000000000ULL;
+    SInt64 error, worst = 0;
+    UInt32 checks = 0;
+    
+    PeakTimebaseInit(&timebase, PEAK_SIM_TICK_NS);
+    for (t = adapter.hostNs; t < end; t += 10000000)
+    {
+        PeakTimebaseComplete(&timebase, Ticks(&adapter, t), t + Latency(&adapter));
+        
+        // once the first window is full, every minute
+        if (t - adapter.hostNs >= 20000000000ULL && (t - adapter.hostNs) % 60000000000ULL == 0)
+        {
+            error = Error(&timebase, &adapter, t);
+            if (llabs(error) > llabs(worst))
+                worst = error;
+            checks++;
+        }
+    }
+    CHECK_EQ(checks, 1439);
+    CHECK(llabs(worst) < 500000);
+    CHECK(timebase.ppm > -56 && timebase.ppm < -44);
+    CHECK_EQ(timebase.resets, 0);
+    CHECK(timebase.jitterNs < 1000000);
+    if (llabs(worst) >= 500000)
+        fprintf(stderr, "worst error %lld ns, %.3f ppm\n", (long long)worst, timebase.ppm);
+}
+
+static void TestHostStall(void)
+{
+    PeakTimebase timebase;
+    Adapter adapter = { 0, 3, 1000000000ULL };
+    UInt64 t;
+    
+    // completions that are late by a whole second for a while do not move the line, nor restart it
+    PeakTimebaseInit(&timebase, PEAK_SIM_TICK_NS);
+    for (t = adapter.hostNs; t < adapter.hostNs + 20000000000ULL; t += 1000000)
+        PeakTimebaseComplete(&timebase, Ticks(&adapter, t), t + Latency(&adapter));
+    for (; t < adapter.hostNs + 20100000000ULL; t += 1000000)
+        PeakTimebaseComplete(&timebase, Ticks(&adapter, t), t + 1000000000ULL);
+    CHECK_EQ(timebase.resets, 0);
+    CHECK(llabs(Error(&timebase, &adapter, t)) < 1000000);
+}
+
+static void TestWall(void)
+{
+    PeakTimebase timebase;
+    UInt64 mono = PeakMonotonicNs(), real = PeakRealtimeNs();
+    
+    PeakTimebaseInit(&timebase, PEAK_SIM_TICK_NS);
+    PeakTimebaseComplete(&timebase, 0, mono);
+    CHECK(llabs((SInt64)(PeakTimebaseWall(&timebase, mono) - real)) < 10000000);
+    CHECK_EQ(PeakTimebaseWall(&timebase, mono + 5) - PeakTimebaseWall(&timebase, mono), 5);
+}
+
+int main(void)
+{
+    RUN(TestNominal);
+    RUN(TestNeverBackwards);
+    RUN(TestDriftDay);
+    RUN(TestHostStall);
+    RUN(TestWall);
+    return PeakTestResult(__FILE__);
+}
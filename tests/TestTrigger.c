@@ -0,0 +1,578 @@
+/*
+    File:           TestTrigger.c
+
+    Description:    Tests of the trigger capture: pre- and post-trigger windows, merging, holdoff, the
+                    window limit and re-arming, timeouts, status records, and a simulated adapter
+                    through the loopback transport.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "PeakTest.h"
+#include "PeakTrigger.h"
+#include "PeakCapture.h"
+#include "PeakIndex.h"
+#include "PeakSimDevice.h"
+#include "PeakTransport.h"
+#include "PeakBatch.h"
+
+#define MS              1000000ULL
+#define BASE_NS         1000000000ULL       // mono of frame 0
+#define FRAMES_MAX      4096
+#define SIM_RATE        20000               // frames per second of the simulated bus
+
+static CanMsg gFrames[FRAMES_MAX];
+static CanMsg gTaken[FRAMES_MAX];
+static UInt32 gTakenCount;
+static PeakCaptureRecord gRecords[65536];
+
+// one frame per millisecond, identifier 0x100, its number in ldata
+static void Frames(UInt32 count)
+{
+    UInt32 i;
+    
+    bzero(gFrames, count * sizeof(CanMsg));
+    for (i = 0; i < count; i++)
+    {
+        gFrames[i].canid.ul = 0x100;
+        gFrames[i].len = 8;
+        gFrames[i].ldata = i;
+        gFrames[i].mono = BASE_NS + i * MS;
+        gFrames[i].ts = gFrames[i].mono;
+    }
+}
+
+// as the capture writer does: a batch in, then what the windows hold out
+static void FeedAndTake(PeakTrigger* trigger, UInt32 first, UInt32 count)
+{
+    UInt32 i, n;
+    
+    for (i = first; i < first + count; i += 10)
+    {
+        n = first + count - i < 10 ? first + count - i : 10;
+        PeakTriggerFeed(trigger, &gFrames[i], n, gFrames[i + n - 1].mono);
+        gTakenCount += PeakTriggerTake(trigger, gTaken + gTakenCount, FRAMES_MAX - gTakenCount);
+    }
+}
+
+// the frames taken are exactly first..last of each range, in order
+static int TakenAre(const UInt32* ranges, UInt32 rangeCount)
+{
+    UInt32 r, i, n = 0;
+    
+    for (r = 0; r < rangeCount; r++)
+    {
+        for (i = ranges[2 * r]; i <= ranges[2 * r + 1]; i++, n++)
+        {
+            if (n >= gTakenCount || gTaken[n].ldata != i)
+                return 0;
+        }
+    }
+    return n == gTakenCount;
+}
+
+static void Config(PeakTriggerConfig* config, const PeakFilterTerm* term)
+{
+    PeakTriggerConfigInit(config);
+    config->historyFrames = FRAMES_MAX;
+    config->preNs = 10 * MS;
+    config->postNs = 20 * MS;
+    config->terms = term;
+    config->termCount = term ? 1 : 0;
+}
+
+static void MatchTerm(PeakFilterTerm* term, UInt32 canid)
+{
+    PeakFilterTermInit(term);
+    term->low = term->high = canid;
+    term->flagsMask = PEAK_FILTER_EXT;
+}
+
+static void TestCreate(void)
+{
+    PeakTriggerTimeout timeouts[PEAK_TRIGGER_MAX_TIMEOUTS + 1];
+    PeakTriggerConfig config;
+    PeakTrigger trigger;
+    
+    PeakTriggerConfigInit(&config);
+    CHECK_EQ(config.historyFrames, PEAK_TRIGGER_DEFAULT_HISTORY);
+    CHECK_EQ(config.statusMask, BUS_HEAVY | BUS_OFF);
+    
+    config.historyFrames = 0;
+    CHECK_EQ(PeakTriggerCreate(&trigger, &config), kIOReturnBadArgument);
+    config.historyFrames = 1000;
+    config.termCount = 1;
+    CHECK_EQ(PeakTriggerCreate(&trigger, &config), kIOReturnBadArgument);
+    config.termCount = 0;
+    
+    bzero(timeouts, sizeof(timeouts));
+    config.timeouts = timeouts;
+    config.timeoutCount = PEAK_TRIGGER_MAX_TIMEOUTS + 1;
+    CHECK_EQ(PeakTriggerCreate(&trigger, &config), kIOReturnBadArgument);
+    config.timeoutCount = 1;
+    timeouts[0].canid = 0x123;
+    CHECK_EQ(PeakTriggerCreate(&trigger, &config), kIOReturnBadArgument);
+    timeouts[0].timeoutNs = MS;
+    timeouts[0].canid = 0x800;
+    CHECK_EQ(PeakTriggerCreate(&trigger, &config), kIOReturnBadArgument);
+    timeouts[0].canid = PEAK_TRIGGER_EXT | 0x20000000;
+    CHECK_EQ(PeakTriggerCreate(&trigger, &config), kIOReturnBadArgument);
+    
+    // the history is a power of two, armed from the start
+    timeouts[0].canid = PEAK_TRIGGER_EXT | 0x1fffffff;
+    CHECK_EQ(PeakTriggerCreate(&trigger, &config), kIOReturnSuccess);
+    CHECK_EQ(trigger.mask, 1023);
+    CHECK(trigger.armed);
+    CHECK(trigger.config.timeouts == NULL);
+    CHECK_EQ(PeakTriggerTake(&trigger, gTaken, FRAMES_MAX), 0);
+    PeakTriggerDestroy(&trigger);
+}
+
+static void TestWindow(void)
+{
+    static const UInt32 window[] = { 40, 70 };
+    PeakTriggerConfig config;
+    PeakTriggerStats stats;
+    PeakFilterTerm term;
+    PeakTrigger trigger;
+    
+    // nothing but the window around frame 50
+    MatchTerm(&term, 0x7ff);
+    Config(&config, &term);
+    CHECK_EQ(PeakTriggerCreate(&trigger, &config), kIOReturnSuccess);
+    Frames(200);
+    gFrames[50].canid.ul = 0x7ff;
+    gTakenCount = 0;
+    FeedAndTake(&trigger, 0, 200);
+    
+    CHECK(TakenAre(window, 1));
+    PeakTriggerGetStats(&trigger, &stats);
+    CHECK_EQ(stats.windows, 1);
+    CHECK_EQ(stats.causes[PEAK_TRIGGER_MATCH], 1);
+    CHECK_EQ(stats.frames, 200);
+    CHECK_EQ(stats.taken, 31);
+    CHECK_EQ(stats.lastNs, gFrames[50].mono);
+    CHECK(!stats.open && stats.armed);
+    PeakTriggerDestroy(&trigger);
+}
+
+static void TestMerge(void)
+{
+    static const UInt32 windows[] = { 40, 105, 140, 170 };
+    PeakTriggerConfig config;
+    PeakTriggerStats stats;
+    PeakFilterTerm term;
+    PeakTrigger trigger;
+    
+    // 60 falls into the window of 50, 85 into the pre-trigger time after it, 150 is a window of its own
+    MatchTerm(&term, 0x7ff);
+    Config(&config, &term);
+    CHECK_EQ(PeakTriggerCreate(&trigger, &config), kIOReturnSuccess);
+    Frames(300);
+    gFrames[50].canid.ul = gFrames[60].canid.ul = gFrames[85].canid.ul = gFrames[150].canid.ul = 0x7ff;
+    gTakenCount = 0;
+    FeedAndTake(&trigger, 0, 300);
+    
+    CHECK(TakenAre(windows, 2));
+    PeakTriggerGetStats(&trigger, &stats);
+    CHECK_EQ(stats.windows, 2);
+    CHECK_EQ(stats.merged, 2);
+    CHECK_EQ(stats.causes[PEAK_TRIGGER_MATCH], 4);
+    PeakTriggerDestroy(&trigger);
+}
+
+static void TestOneBatch(void)
+{
+    static const UInt32 windows[] = { 40, 70, 140, 170, 240, 270 };
+    PeakTriggerConfig config;
+    PeakTriggerStats stats;
+    PeakFilterTerm term;
+    PeakTrigger trigger;
+    
+    // three windows opened by one feed are all handed out, the last one taken in two
+    MatchTerm(&term, 0x7ff);
+    Config(&config, &term);
+    CHECK_EQ(PeakTriggerCreate(&trigger, &config), kIOReturnSuccess);
+    Frames(300);
+    gFrames[50].canid.ul = gFrames[150].canid.ul = gFrames[250].canid.ul = 0x7ff;
+    PeakTriggerFeed(&trigger, gFrames, 300, gFrames[299].mono);
+    gTakenCount = PeakTriggerTake(&trigger, gTaken, 50);
+    CHECK_EQ(gTakenCount, 50);
+    gTakenCount += PeakTriggerTake(&trigger, gTaken + gTakenCount, FRAMES_MAX - gTakenCount);
+    
+    CHECK(TakenAre(windows, 3));
+    PeakTriggerGetStats(&trigger, &stats);
+    CHECK_EQ(stats.windows, 3);
+    CHECK_EQ(stats.merged, 0);
+    CHECK(!stats.open);
+    PeakTriggerDestroy(&trigger);
+}
+
+static void TestHoldoff(void)
+{
+    static const UInt32 windows[] = { 40, 70, 150, 180 };
+    PeakTriggerConfig config;
+    PeakTriggerStats stats;
+    PeakFilterTerm term;
+    PeakTrigger trigger;
+    
+    // 100 would be a window of its own, but it is less than 100 ms after the one of 50
+    MatchTerm(&term, 0x7ff);
+    Config(&config, &term);
+    config.holdoffNs = 100 * MS;
+    CHECK_EQ(PeakTriggerCreate(&trigger, &config), kIOReturnSuccess);
+    Frames(300);
+    gFrames[50].canid.ul = gFrames[100].canid.ul = gFrames[160].canid.ul = 0x7ff;
+    gTakenCount = 0;
+    FeedAndTake(&trigger, 0, 300);
+    
+    CHECK(TakenAre(windows, 2));
+    PeakTriggerGetStats(&trigger, &stats);
+    CHECK_EQ(stats.windows, 2);
+    CHECK_EQ(stats.suppressed, 1);
+    CHECK_EQ(stats.merged, 0);
+    PeakTriggerDestroy(&trigger);
+}
+
+static void TestRearm(void)
+{
+    static const UInt32 windows[] = { 40, 70, 140, 170, 440, 470 };
+    PeakTriggerConfig config;
+    PeakTriggerStats stats;
+    PeakFilterTerm term;
+    PeakTrigger trigger;
+    
+    // after two windows the trigger disarms, 250 and 350 are suppressed until it is armed again
+    MatchTerm(&term, 0x7ff);
+    Config(&config, &term);
+    config.maxWindows = 2;
+    CHECK_EQ(PeakTriggerCreate(&trigger, &config), kIOReturnSuccess);
+    Frames(500);
+    gFrames[50].canid.ul = gFrames[150].canid.ul = gFrames[250].canid.ul = gFrames[350].canid.ul = gFrames[450].canid.ul = 0x7ff;
+    gTakenCount = 0;
+    FeedAndTake(&trigger, 0, 400);
+    
+    PeakTriggerGetStats(&trigger, &stats);
+    CHECK_EQ(stats.windows, 2);
+    CHECK_EQ(stats.suppressed, 2);
+    CHECK(!stats.armed);
+    
+    PeakTriggerArm(&trigger);
+    FeedAndTake(&trigger, 400, 100);
+    CHECK(TakenAre(windows, 3));
+    PeakTriggerGetStats(&trigger, &stats);
+    CHECK_EQ(stats.windows, 3);
+    CHECK(stats.armed);
+    PeakTriggerDestroy(&trigger);
+}
+
+static void TestTimeout(void)
+{
+    static const UInt32 windows[] = { 43, 73 };
+    PeakTriggerTimeout timeouts[2];
+    PeakTriggerConfig config;
+    PeakTriggerStats stats;
+    PeakTrigger trigger;
+    UInt32 i;
+    
+    // 0x123 comes every other frame but is missing from 50 to 70, 0x18da00f1 every 4 ms
+    bzero(timeouts, sizeof(timeouts));
+    timeouts[0].canid = 0x123;
+    timeouts[0].timeoutNs = 5 * MS;
+    timeouts[1].canid = PEAK_TRIGGER_EXT | 0x18da00f1;
+    timeouts[1].timeoutNs = 5 * MS;
+    Config(&config, NULL);
+    config.timeouts = timeouts;
+    config.timeoutCount = 2;
+    CHECK_EQ(PeakTriggerCreate(&trigger, &config), kIOReturnSuccess);
+    
+    Frames(300);
+    for (i = 0; i < 300; i++)
+    {
+        if (i % 2 == 0 && (i < 50 || i > 70))
+            gFrames[i].canid.ul = 0x123;
+        else if (i % 4 == 1)
+        {
+            gFrames[i].canid.ul = 0x18da00f1;
+            gFrames[i].ext = 1;
+        }
+    }
+    gTakenCount = 0;
+    FeedAndTake(&trigger, 0, 300);
+    
+    // once for the gap, at the time 0x123 was due
+    CHECK(TakenAre(windows, 1));
+    PeakTriggerGetStats(&trigger, &stats);
+    CHECK_EQ(stats.causes[PEAK_TRIGGER_TIMEOUT], 1);
+    CHECK_EQ(stats.lastNs, gFrames[48].mono + 5 * MS);
+    
+    // arming starts the timeouts over; then a quiet bus fires both through the horizon alone, once
+    PeakTriggerArm(&trigger);
+    PeakTriggerFeed(&trigger, NULL, 0, gFrames[299].mono + 100 * MS);
+    PeakTriggerGetStats(&trigger, &stats);
+    CHECK_EQ(stats.causes[PEAK_TRIGGER_TIMEOUT], 1);
+    PeakTriggerFeed(&trigger, NULL, 0, gFrames[299].mono + 200 * MS);
+    PeakTriggerGetStats(&trigger, &stats);
+    CHECK_EQ(stats.causes[PEAK_TRIGGER_TIMEOUT], 3);
+    PeakTriggerFeed(&trigger, NULL, 0, gFrames[299].mono + 300 * MS);
+    PeakTriggerGetStats(&trigger, &stats);
+    CHECK_EQ(stats.causes[PEAK_TRIGGER_TIMEOUT], 3);
+    PeakTriggerDestroy(&trigger);
+}
+
+static void TestStatus(void)
+{
+    static const UInt32 windows[] = { 20, 50, 90, 120 };
+    PeakTriggerConfig config;
+    PeakTriggerStats stats;
+    PeakTrigger trigger;
+    
+    Config(&config, NULL);
+    CHECK_EQ(PeakTriggerCreate(&trigger, &config), kIOReturnSuccess);
+    Frames(200);
+    gTakenCount = 0;
+    
+    // a bus light record is not in the mask, bus off is; the record waits for the next feed
+    FeedAndTake(&trigger, 0, 40);
+    PeakTriggerNoteStatus(&trigger, 0, gFrames[30].mono, 1, BUS_LIGHT);
+    PeakTriggerNoteStatus(&trigger, 1, gFrames[30].mono, 1, BUS_OFF);
+    PeakTriggerNoteStatus(&trigger, PEAK_MAX_CHANNELS, gFrames[30].mono, 1, BUS_OFF);
+    FeedAndTake(&trigger, 40, 40);
+    
+    // an error frame
+    gFrames[100].err = 1;
+    FeedAndTake(&trigger, 80, 120);
+    
+    CHECK(TakenAre(windows, 2));
+    PeakTriggerGetStats(&trigger, &stats);
+    CHECK_EQ(stats.causes[PEAK_TRIGGER_STATUS], 1);
+    CHECK_EQ(stats.causes[PEAK_TRIGGER_ERROR], 1);
+    CHECK_EQ(stats.windows, 2);
+    PeakTriggerDestroy(&trigger);
+}
+
+static void TestLost(void)
+{
+    PeakTriggerConfig config;
+    PeakTriggerStats stats;
+    PeakFilterTerm term;
+    PeakTrigger trigger;
+    UInt32 n;
+    
+    // a history of 16 frames and a writer that does not take until 100 frames later
+    MatchTerm(&term, 0x7ff);
+    Config(&config, &term);
+    config.historyFrames = 16;
+    config.postNs = 1000 * MS;
+    CHECK_EQ(PeakTriggerCreate(&trigger, &config), kIOReturnSuccess);
+    Frames(200);
+    gFrames[50].canid.ul = 0x7ff;
+    PeakTriggerFeed(&trigger, gFrames, 150, 0);
+    n = PeakTriggerTake(&trigger, gTaken, FRAMES_MAX);
+    
+    CHECK_EQ(n, 16);
+    CHECK_EQ(gTaken[0].ldata, 134);
+    PeakTriggerGetStats(&trigger, &stats);
+    CHECK_EQ(stats.lost, 134 - 40);
+    CHECK(stats.open);
+    PeakTriggerDestroy(&trigger);
+}
+
+#pragma mark - Simulated adapter
+
+// the records of the capture at path, 0 if it cannot be read
+static UInt32 ReadCapture(const char* path)
+{
+    PeakCaptureHeader header;
+    struct stat st;
+    ssize_t got;
+    int fd = open(path, O_RDONLY);
+    
+    if (fd < 0)
+        return 0;
+    if (PeakCaptureReadHeader(fd, &header) != kIOReturnSuccess || fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return 0;
+    }
+    got = pread(fd, gRecords, sizeof(gRecords), header.headerSize);
+    close(fd);
+    return got < 0 ? 0 : (UInt32)(got / sizeof(PeakCaptureRecord));
+}
+
+static UInt64 Sequence(const PeakCaptureRecord* record)
+{
+    UInt64 value;
+    
+    memcpy(&value, record->data, sizeof(value));
+    return value;
+}
+
+// drains the receive side until the adapter has delivered frames frames since *start
+static void Run(PeakRxStats* start, UInt64 frames)
+{
+    static CanMsg batch[4096];
+    struct timespec pause = { 0, 1000000 };
+    PeakRxStats rx;
+    UInt64 deadline = PeakMonotonicNs() + 30000000000ULL;
+    
+    for (PeakGetRxStats(&rx); rx.frames - start->frames < frames && PeakMonotonicNs() < deadline; PeakGetRxStats(&rx))
+    {
+        if (PeakTestReceive(batch, 4096, 0, 0) == 0)
+            nanosleep(&pause, NULL);
+    }
+}
+
+static void SimConfig(PeakSimConfig* config, UInt32 busOffEvery, UInt64 maxFrames)
+{
+    UInt32 i;
+    
+    // eight data bytes, so the whole sequence number is in the frame
+    PeakSimConfigInit(config);
+    config->frameRate = SIM_RATE;
+    for (i = 0; i < 8; i++)
+        config->dlcWeights[i] = 0;
+    config->busOffEvery = busOffEvery;
+    config->maxFrames = maxFrames;
+    config->realtime = 1;
+}
+
+static void TestSimWindows(void)
+{
+    static PeakSimDevice sim;
+    PeakSimConfig simConfig;
+    PeakTriggerConfig config;
+    PeakTriggerStats stats;
+    PeakRxStats rx;
+    char path[256];
+    UInt32 n, i, start, runs = 0;
+    UInt64 bus;
+    
+    // a bus off after every 4000 frames, the record shares the time of the frame after it
+    PeakTestTempPath(path, sizeof(path), "sim.pcap");
+    SimConfig(&simConfig, 4000, 20000);
+    CHECK_EQ(PeakSimDeviceCreate(&sim, &simConfig), kIOReturnSuccess);
+    PeakTriggerConfigInit(&config);
+    config.historyFrames = 65536;
+    config.preNs = 20 * MS;
+    config.postNs = 30 * MS;
+    config.statusMask = BUS_OFF;
+    
+    CHECK_EQ(PeakTestStartLoopback(1), kIOReturnSuccess);
+    CHECK_EQ(PeakGetTriggerStats(&stats), kIOReturnNotOpen);
+    CHECK_EQ(PeakArmTrigger(), kIOReturnNotOpen);
+    CHECK_EQ(PeakStartTriggerCapture(path, NULL), kIOReturnBadArgument);
+    CHECK_EQ(PeakStartTriggerCapture(path, &config), kIOReturnSuccess);
+    PeakGetRxStats(&rx);
+    PeakLoopbackSetSource(0, PeakSimDeviceFill, &sim);
+    Run(&rx, 20000);
+    PeakLoopbackSetSource(0, NULL, NULL);
+    
+    // the trigger stays with the capture until the next one, with every frame fed by the close
+    CHECK_EQ(PeakStopCapture(), kIOReturnSuccess);
+    CHECK_EQ(PeakGetTriggerStats(&stats), kIOReturnSuccess);
+    PeakTestStopLoopback();
+    
+    CHECK_EQ(stats.windows, 4);
+    CHECK_EQ(stats.causes[PEAK_TRIGGER_STATUS], 4);
+    CHECK_EQ(stats.frames, 20000);
+    CHECK_EQ(stats.lost, 0);
+    
+    // each window a run of consecutive frames from 20 ms before the bus off to 30 ms after it
+    n = ReadCapture(path);
+    CHECK_EQ(n, stats.taken);
+    for (i = 0; i < n; i = start)
+    {
+        for (start = i + 1; start < n && Sequence(&gRecords[start]) == Sequence(&gRecords[start - 1]) + 1; start++)
+            ;
+        bus = (runs + 1) * 4000ULL;
+        CHECK(Sequence(&gRecords[i]) >= bus - 20 * SIM_RATE / 1000 - 20 && Sequence(&gRecords[i]) <= bus - 20 * SIM_RATE / 1000 + 20);
+        CHECK(Sequence(&gRecords[start - 1]) >= bus + 30 * SIM_RATE / 1000 - 20 && Sequence(&gRecords[start - 1]) <= bus + 30 * SIM_RATE / 1000 + 20);
+        CHECK(gRecords[start - 1].ts - gRecords[i].ts <= 50 * MS);
+        runs++;
+    }
+    CHECK_EQ(runs, 4);
+    
+    PeakTestRemove(path);
+    PeakSimDeviceDestroy(&sim);
+}
+
+static void TestSimRearm(void)
+{
+    static PeakSimDevice sim;
+    PeakSimConfig simConfig;
+    PeakTriggerConfig config;
+    PeakTriggerStats stats;
+    PeakRxStats rx;
+    char path[256];
+    
+    // one window only, until PeakArmTrigger
+    PeakTestTempPath(path, sizeof(path), "rearm.pcap");
+    SimConfig(&simConfig, 2000, 0);
+    CHECK_EQ(PeakSimDeviceCreate(&sim, &simConfig), kIOReturnSuccess);
+    PeakTriggerConfigInit(&config);
+    config.historyFrames = 65536;
+    config.preNs = 5 * MS;
+    config.postNs = 5 * MS;
+    config.maxWindows = 1;
+    config.statusMask = BUS_OFF;
+    
+    CHECK_EQ(PeakTestStartLoopback(1), kIOReturnSuccess);
+    CHECK_EQ(PeakStartTriggerCapture(path, &config), kIOReturnSuccess);
+    PeakGetRxStats(&rx);
+    PeakLoopbackSetSource(0, PeakSimDeviceFill, &sim);
+    Run(&rx, 7000);
+    CHECK_EQ(PeakGetTriggerStats(&stats), kIOReturnSuccess);
+    CHECK_EQ(stats.windows, 1);
+    CHECK(stats.suppressed >= 2);
+    CHECK(!stats.armed);
+    
+    CHECK_EQ(PeakArmTrigger(), kIOReturnSuccess);
+    Run(&rx, 11000);
+    PeakLoopbackSetSource(0, NULL, NULL);
+    CHECK_EQ(PeakGetTriggerStats(&stats), kIOReturnSuccess);
+    CHECK_EQ(stats.windows, 2);
+    CHECK(!stats.armed);
+    CHECK_EQ(PeakStopCapture(), kIOReturnSuccess);
+    PeakTestStopLoopback();
+    
+    PeakTestRemove(path);
+    PeakSimDeviceDestroy(&sim);
+}
+
+int main(void)
+{
+    RUN(TestCreate);
+    RUN(TestWindow);
+    RUN(TestMerge);
+    RUN(TestOneBatch);
+    RUN(TestHoldoff);
+    RUN(TestRearm);
+    RUN(TestTimeout);
+    RUN(TestStatus);
+    RUN(TestLost);
+    RUN(TestSimWindows);
+    RUN(TestSimRearm);
+    return PeakTestResult(__FILE__);
+}
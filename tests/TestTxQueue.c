@@ -0,0 +1,319 @@
+/*
+    File:           TestTxQueue.c
+
+    Description:    Unit tests of the transmit queue: packing frames into telegrams, the telegram
+                    counter, and backpressure on the callers, against a stand-in endpoint.
+
+    Copyright:      © Copyright 2012 Marc Delling. All rights reserved.
+
+    Disclaimer:     IMPORTANT: THE SOFTWARE IS PROVIDED ON AN "AS IS" BASIS. THE AUTHOR MAKES NO
+                    WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                    WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                    PURPOSE, REGARDING THE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                    COMBINATION WITH YOUR PRODUCTS.
+
+                    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                    GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                    ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                    OF SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                    (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF THE AUTHOR HAS
+                    BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "PeakTest.h"
+#include "PeakTxQueue.h"
+
+// a stand-in endpoint keeping the submitted telegrams, completed by the tests
+typedef struct {
+    UInt8   telegrams[64][PEAK_TX_BUFFER_SIZE];
+    void*   contexts[64];
+    UInt32  count;
+    UInt32  completed;
+    UInt32  fail;                   // submits to refuse
+} Endpoint;
+
+static IOReturn Submit(void* refCon, const UInt8* buffer, UInt32 length, void* context)
+{
+    Endpoint* endpoint = refCon;
+    
+    CHECK_EQ(length, PEAK_TX_BUFFER_SIZE);
+    if (endpoint->fail)
+    {
+        endpoint->fail--;
+        return kIOReturnNoResources;
+    }
+    if (endpoint->count == 64)
+        return kIOReturnNoResources;
+    memcpy(endpoint->telegrams[endpoint->count], buffer, PEAK_TX_BUFFER_SIZE);
+    endpoint->contexts[endpoint->count++] = context;
+    return kIOReturnSuccess;
+}
+
+static void CompleteNext(PeakTxQueue* queue, Endpoint* endpoint)
+{
+    CHECK(endpoint->completed < endpoint->count);
+    if (endpoint->completed < endpoint->count)
+        PeakTxQueueComplete(queue, endpoint->contexts[endpoint->completed++], kIOReturnSuccess);
+}
+
+static void Frames(CanMsg* msgs, UInt32 count, int ext, UInt8 len)
+{
+    UInt32 i, j;
+    
+    bzero(msgs, count * sizeof(CanMsg));
+    for (i = 0; i < count; i++)
+    {
+        msgs[i].canid.ul = 0x100 + i;
+        msgs[i].ext = ext;
+        msgs[i].len = len;
+        for (j = 0; j < 8; j++)
+            msgs[i].data[j] = (UInt8)(i + j);
+    }
+}
+
+// the identifiers of the records of a telegram in order, returns their number
+static UInt32 Ids(const UInt8* telegram, UInt32* ids)
+{
+    const UInt8* ptr = telegram + 2;
+    UInt32 i;
+    
+    for (i = 0; i < telegram[1]; i++)
+    {
+        UInt8 ucStatusLen = *ptr;
+        
+        if (ucStatusLen & STLN_EXTENDED_ID)
+        {
+            ids[i] = (ptr[1] | ptr[2] << 8 | ptr[3] << 16 | (UInt32)ptr[4] << 24) >> 3;
+            ptr += 5;
+        }
+        else
+        {
+            ids[i] = (ptr[1] | ptr[2] << 8) >> 5;
+            ptr += 3;
+        }
+        if (!(ucStatusLen & STLN_RTR))
+            ptr += ucStatusLen & STLN_DATA_LENGTH;
+    }
+    return telegram[1];
+}
+
+static void TestEncode(void)
+{
+    UInt8 telegram[PEAK_TX_BUFFER_SIZE];
+    CanMsg msgs[16];
+    
+    // eleven bytes a standard frame with eight data bytes, five fit between the header and the counter
+    Frames(msgs, 16, 0, 8);
+    CHECK_EQ(PeakTxEncode(msgs, 16, telegram, 7), 5);
+    CHECK_EQ(telegram[0], 2);
+    CHECK_EQ(telegram[1], 5);
+    CHECK_EQ(telegram[2], 8);
+    CHECK_EQ(telegram[3], (UInt8)(0x100 << 5));
+    CHECK_EQ(telegram[4], (UInt8)((0x100 << 5) >> 8));
+    CHECK_EQ(telegram[5], 0);
+    CHECK_EQ(telegram[12], 7);
+    CHECK_EQ(telegram[PEAK_TX_BUFFER_SIZE - 1], 7);
+    
+    // thirteen bytes extended, four fit
+    Frames(msgs, 16, 1, 8);
+    CHECK_EQ(PeakTxEncode(msgs, 16, telegram, 1), 4);
+    CHECK_EQ(telegram[2], STLN_EXTENDED_ID | 8);
+    CHECK_EQ(telegram[3] | telegram[4] << 8, 0x100 << 3);
+    
+    // remote frames carry no data, three bytes each
+    Frames(msgs, 16, 0, 8);
+    msgs[0].rtr = 1;
+    CHECK_EQ(PeakTxEncode(msgs, 1, telegram, 1), 1);
+    CHECK_EQ(telegram[2], STLN_RTR | 8);
+    CHECK_EQ(telegram[5], 0);
+}
+
+static void TestEncodeLength(void)
+{
+    UInt8 telegram[PEAK_TX_BUFFER_SIZE];
+    CanMsg msgs[8];
+    UInt32 i;
+    
+    // a length field over eight is sent as eight, and sizes the record as such
+    Frames(msgs, 8, 0, 15);
+    CHECK_EQ(PeakTxEncode(msgs, 8, telegram, 1), 5);
+    for (i = 0; i < 5; i++)
+    {
+        CHECK_EQ(telegram[2 + 11 * i], 8);
+        CHECK_EQ(telegram[2 + 11 * i + 10], (UInt8)(i + 7));
+    }
+    CHECK_EQ(telegram[2 + 11 * 5], 0);
+}
+
+static void TestQueue(void)
+{
+    static PeakTxQueue queue;
+    static Endpoint endpoint;
+    PeakTxQueueStats stats;
+    CanMsg msgs[40];
+    UInt32 queued, ids[PEAK_TX_BUFFER_SIZE / 3], i, j, n, next = 0;
+    
+    bzero(&endpoint, sizeof(Endpoint));
+    CHECK_EQ(PeakTxQueueCreate(&queue, 2), kIOReturnSuccess);
+    Frames(msgs, 40, 0, 8);
+    
+    // nothing goes anywhere without a device
+    CHECK_EQ(PeakTxQueueSend(&queue, msgs, 1, 0, &queued), kIOReturnNoDevice);
+    CHECK_EQ(queued, 0);
+    
+    PeakTxQueueAttach(&queue, Submit, &endpoint);
+    CHECK_EQ(PeakTxQueueSend(&queue, msgs, 40, 0, &queued), kIOReturnSuccess);
+    CHECK_EQ(queued, 40);
+    
+    // two telegrams in flight, the rest waits for their completions
+    PeakTxQueueGetStats(&queue, &stats);
+    CHECK_EQ(stats.inFlight, 2);
+    CHECK_EQ(stats.queued, 30);
+    CHECK_EQ(endpoint.count, 2);
+    
+    while (endpoint.completed < endpoint.count)
+        CompleteNext(&queue, &endpoint);
+    CHECK_EQ(endpoint.count, 8);
+    
+    // every frame once and in order, the telegram counter going up
+    for (i = 0; i < endpoint.count; i++)
+    {
+        n = Ids(endpoint.telegrams[i], ids);
+        for (j = 0; j < n; j++)
+            CHECK_EQ(ids[j], 0x100 + next++);
+        if (i > 0)
+            CHECK_EQ(endpoint.telegrams[i][PEAK_TX_BUFFER_SIZE - 1], endpoint.telegrams[i - 1][PEAK_TX_BUFFER_SIZE - 1] + 1);
+    }
+    CHECK_EQ(next, 40);
+    
+    PeakTxQueueGetStats(&queue, &stats);
+    CHECK_EQ(stats.frames, 40);
+    CHECK_EQ(stats.telegrams, 8);
+    CHECK_EQ(stats.inFlight, 0);
+    CHECK_EQ(stats.queued, 0);
+}
+
+static void TestSubmitFailure(void)
+{
+    static PeakTxQueue queue;
+    static Endpoint endpoint;
+    PeakTxQueueStats stats;
+    CanMsg msgs[5];
+    
+    bzero(&endpoint, sizeof(Endpoint));
+    PeakTxQueueCreate(&queue, 2);
+    PeakTxQueueAttach(&queue, Submit, &endpoint);
+    Frames(msgs, 5, 0, 8);
+    
+    // the frames of a telegram that could not be submitted are lost and counted
+    endpoint.fail = 1;
+    CHECK_EQ(PeakTxQueueSend(&queue, msgs, 5, 0, NULL), kIOReturnSuccess);
+    PeakTxQueueGetStats(&queue, &stats);
+    CHECK_EQ(stats.errors, 1);
+    CHECK_EQ(stats.frames, 0);
+    CHECK_EQ(stats.inFlight, 0);
+    CHECK_EQ(stats.queued, 0);
+    
+    CHECK_EQ(PeakTxQueueSend(&queue, msgs, 5, 0, NULL), kIOReturnSuccess);
+    CHECK_EQ(endpoint.count, 1);
+}
+
+static void TestBackpressure(void)
+{
+    static PeakTxQueue queue;
+    static Endpoint endpoint;
+    static CanMsg msgs[PEAK_TX_QUEUE_FRAMES + 100];
+    PeakTxQueueStats stats;
+    UInt32 queued;
+    
+    bzero(&endpoint, sizeof(Endpoint));
+    PeakTxQueueCreate(&queue, 1);
+    PeakTxQueueAttach(&queue, Submit, &endpoint);
+    Frames(msgs, PEAK_TX_QUEUE_FRAMES + 100, 0, 8);
+    
+    // one telegram in flight takes five frames off the queue, the rest fills it up
+    CHECK_EQ(PeakTxQueueSend(&queue, msgs, PEAK_TX_QUEUE_FRAMES + 100, 0, &queued), kIOReturnNoSpace);
+    CHECK_EQ(queued, PEAK_TX_QUEUE_FRAMES + 5);
+    CHECK_EQ(PeakTxQueueSend(&queue, msgs, 1, 0, &queued), kIOReturnNoSpace);
+    CHECK_EQ(queued, 0);
+    PeakTxQueueGetStats(&queue, &stats);
+    CHECK_EQ(stats.rejected, 2);
+    CHECK_EQ(stats.queued, PEAK_TX_QUEUE_FRAMES);
+    
+    // a completion makes room for the next telegram's worth
+    CompleteNext(&queue, &endpoint);
+    CHECK_EQ(PeakTxQueueSend(&queue, msgs, 10, 0, &queued), kIOReturnNoSpace);
+    CHECK_EQ(queued, 5);
+}
+
+typedef struct {
+    PeakTxQueue*    queue;
+    CanMsg*         msgs;
+    UInt32          count;
+    UInt32          queued;
+    IOReturn        kr;
+    UInt32          finished;
+} Sender;
+
+static void* SenderThread(void* arg)
+{
+    Sender* sender = arg;
+    
+    sender->kr = PeakTxQueueSend(sender->queue, sender->msgs, sender->count, 1, &sender->queued);
+    __atomic_store_n(&sender->finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void TestBlocking(void)
+{
+    static PeakTxQueue queue;
+    static Endpoint endpoint;
+    static CanMsg msgs[PEAK_TX_QUEUE_FRAMES + 15];
+    struct timespec pause = { 0, 20000000 };
+    PeakTxQueueStats stats;
+    Sender sender;
+    pthread_t thread;
+    
+    bzero(&endpoint, sizeof(Endpoint));
+    PeakTxQueueCreate(&queue, 1);
+    PeakTxQueueAttach(&queue, Submit, &endpoint);
+    Frames(msgs, PEAK_TX_QUEUE_FRAMES + 15, 0, 8);
+    
+    // a waiting sender stays blocked until completions make room for all of its frames
+    bzero(&sender, sizeof(Sender));
+    sender.queue = &queue;
+    sender.msgs = msgs;
+    sender.count = PEAK_TX_QUEUE_FRAMES + 15;
+    pthread_create(&thread, NULL, SenderThread, &sender);
+    nanosleep(&pause, NULL);
+    CHECK(!__atomic_load_n(&sender.finished, __ATOMIC_ACQUIRE));
+    
+    CompleteNext(&queue, &endpoint);
+    nanosleep(&pause, NULL);
+    CompleteNext(&queue, &endpoint);
+    pthread_join(thread, NULL);
+    CHECK_EQ(sender.kr, kIOReturnSuccess);
+    CHECK_EQ(sender.queued, PEAK_TX_QUEUE_FRAMES + 15);
+    PeakTxQueueGetStats(&queue, &stats);
+    CHECK(stats.blocked >= 1);
+    
+    // without the device there is nothing to wait for
+    PeakTxQueueDetach(&queue);
+    CHECK_EQ(PeakTxQueueSend(&queue, msgs, 1, 1, NULL), kIOReturnNoDevice);
+}
+
+int main(void)
+{
+    RUN(TestEncode);
+    RUN(TestEncodeLength);
+    RUN(TestQueue);
+    RUN(TestSubmitFailure);
+    RUN(TestBackpressure);
+    RUN(TestBlocking);
+    return PeakTestResult(__FILE__);
+}